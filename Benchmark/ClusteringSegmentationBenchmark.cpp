@@ -0,0 +1,1138 @@
+//
+//  ClusteringSegmentationBenchmark.cpp
+//  ClusteringSegmentation
+//
+//  Standalone benchmark for the stages of the segmentation pipeline.
+//
+
+// clusteringsegmentation_bench ?--iterations N? ?--synthetic WxH? ?--stage NAME? ?IMAGE ...?
+// clusteringsegmentation_bench --scaling ?--iterations N? ?--sizes WxH,...? ?--regions N,...? ?--stage NAME? ?--csv FILENAME?
+// clusteringsegmentation_bench --golden ?--update? ?--iterations N? ?--time-tolerance F? ?--memory-tolerance F? ?IMAGE ...?
+//
+// Each stage of the segmentation pipeline is run N times on each input image and the
+// median and 95th percentile wall time of the runs is reported along with the number
+// of input pixels processed per second. The --synthetic option adds a generated image
+// of the indicated size and can be passed more than once, --stage limits the run to
+// the named stages. With no images the two test images and a 1024x768 synthetic image
+// are used, the test image paths are relative to the top of the repo.
+//
+// The --scaling mode generates Voronoi mosaics with about N regions at each of the
+// sizes and runs the SRM and parse, containment, capture and merge manager stages on
+// each one. A CSV with the time for each stage, the number of pixels and the number
+// of regions is written to stdout or to FILENAME so that a stage that grows faster
+// than the pixels or the regions can be found and checked against a previous run.
+//
+// The --golden mode runs clusteringCombine on each image, the test images by default,
+// and checks that the tags are the same partition as IMAGE_DIR/BASENAME_golden_tags.png
+// even if the tag values differ. The median time and the peak memory are checked
+// against IMAGE_DIR/BASENAME_baseline.txt, a time more than F slower than the baseline
+// fails with a default F of 0.25 and memory more than F larger fails with a default F
+// of 0.10. The exit status is 1 when any check fails. With --update the golden tags
+// and the baselines are written from this run instead of being checked.
+//
+// This file is plain C++ so that it builds anywhere OpenCV does. Compile it with all
+// the sources of the clusteringsegmentation tool except ClusteringSegmentationMain.cpp
+// and link with the OpenCV core, imgproc and imgcodecs libs.
+
+#include <opencv2/opencv.hpp>
+
+#include "ClusteringSegmentation.hpp"
+
+#include "Superpixel.h"
+#include "SuperpixelEdge.h"
+#include "SuperpixelImage.h"
+
+#include "OpenCVUtil.h"
+#include "OpenCVHull.hpp"
+#include "Util.h"
+
+#include "quant_util.h"
+#include "DivQuantHeader.h"
+
+#include "RegionRemerger.hpp"
+#include "SuperpixelMergeManager.h"
+#include "MemoryStats.h"
+#include "TagCodec.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace cv;
+using namespace std;
+
+// Wall times for one stage run on one image
+
+typedef struct {
+  string stageName;
+  string imageName;
+  int numPixels;
+  vector<double> seconds;
+} StageBenchmarkResult;
+
+// The library logic writes progress to stdout, the output is sent to /dev/null
+// while a stage is being timed so that the report is readable and terminal
+// output is not part of the time.
+
+class StdoutSilencer {
+public:
+  StdoutSilencer()
+  {
+    cout.flush();
+    fflush(stdout);
+    savedFd = dup(STDOUT_FILENO);
+    int nullFd = open("/dev/null", O_WRONLY);
+    if (nullFd != -1) {
+      dup2(nullFd, STDOUT_FILENO);
+      close(nullFd);
+    }
+  }
+  
+  ~StdoutSilencer()
+  {
+    cout.flush();
+    fflush(stdout);
+    if (savedFd != -1) {
+      dup2(savedFd, STDOUT_FILENO);
+      close(savedFd);
+    }
+  }
+
+private:
+  int savedFd;
+};
+
+// Invoke setup() and then run() for each iteration, only run() is timed
+
+static
+vector<double> timeStage(int numIterations, std::function<void()> setup, std::function<void()> run)
+{
+  vector<double> seconds;
+  
+  StdoutSilencer silencer;
+  
+  for ( int i = 0; i < numIterations; i++ ) {
+    setup();
+    
+    auto startTime = std::chrono::steady_clock::now();
+    
+    run();
+    
+    auto endTime = std::chrono::steady_clock::now();
+    
+    seconds.push_back(std::chrono::duration<double>(endTime - startTime).count());
+  }
+  
+  return seconds;
+}
+
+// Nearest rank percentile of the times, p is in the range 0.0 to 1.0
+
+static
+double percentileSeconds(vector<double> seconds, double p)
+{
+  assert(!seconds.empty());
+  
+  sort(begin(seconds), end(seconds));
+  
+  int rank = (int) ceil(p * seconds.size());
+  rank = maxi(1, mini(rank, (int) seconds.size()));
+  
+  return seconds[rank - 1];
+}
+
+// Synthetic input with flat regions, gradients and noise. The same size always
+// generates the same pixels so that runs can be compared.
+
+static
+Mat makeSyntheticImage(int width, int height)
+{
+  Mat img(height, width, CV_8UC3);
+  
+  for ( int y = 0; y < height; y++ ) {
+    Vec3b *rowPtr = img.ptr<Vec3b>(y);
+    for ( int x = 0; x < width; x++ ) {
+      rowPtr[x] = Vec3b((x * 255) / maxi(1, width - 1), (y * 255) / maxi(1, height - 1), 128);
+    }
+  }
+  
+  RNG rng(width * 65536 + height);
+  
+  const int numShapes = maxi(8, (width * height) / (64 * 64));
+  const int maxShapeDim = maxi(4, mini(width, height) / 4);
+  
+  for ( int i = 0; i < numShapes; i++ ) {
+    Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+    Point center(rng.uniform(0, width), rng.uniform(0, height));
+    int dim = rng.uniform(2, maxShapeDim);
+    
+    if ((i % 2) == 0) {
+      rectangle(img, Rect(center.x - dim / 2, center.y - dim / 2, dim, dim / 2 + 1), color, CV_FILLED);
+    } else {
+      circle(img, center, dim / 2, color, CV_FILLED);
+    }
+  }
+  
+  Mat noise(img.size(), CV_8UC3);
+  rng.fill(noise, RNG::UNIFORM, Scalar::all(0), Scalar::all(6));
+  img += noise;
+  
+  return img;
+}
+
+// Parse "WxH" into a size, returns false when the string is not a valid size
+
+static
+bool parseImageSize(const string &str, Size &size)
+{
+  int width = 0;
+  int height = 0;
+  char x = 0;
+  
+  if (sscanf(str.c_str(), "%d%c%d", &width, &x, &height) != 3 || (x != 'x' && x != 'X') || width <= 0 || height <= 0) {
+    return false;
+  }
+  
+  size = Size(width, height);
+  return true;
+}
+
+// Run each selected stage on one input image and append the results
+
+static
+void benchmarkImage(const string &imageName,
+                    Mat &inputImg,
+                    int numIterations,
+                    const set<string> &stageNames,
+                    vector<StageBenchmarkResult> &results)
+{
+  const int numPixels = inputImg.rows * inputImg.cols;
+  
+  const int superpixelDim = 4;
+  int blockWidth = inputImg.cols / superpixelDim;
+  if ((inputImg.cols % superpixelDim) != 0) {
+    blockWidth++;
+  }
+  int blockHeight = inputImg.rows / superpixelDim;
+  if ((inputImg.rows % superpixelDim) != 0) {
+    blockHeight++;
+  }
+  
+  const double Q = 128.0;
+  
+  auto addResult = [&](const char *stageName, std::function<void()> setup, std::function<void()> run)->void {
+    if (!stageNames.empty() && stageNames.count(stageName) == 0) {
+      return;
+    }
+    
+    StageBenchmarkResult result;
+    result.stageName = stageName;
+    result.imageName = imageName;
+    result.numPixels = numPixels;
+    result.seconds = timeStage(numIterations, setup, run);
+    results.push_back(result);
+  };
+  
+  auto noSetup = []()->void {};
+  
+  // Results of the early stages are generated once and the later stages
+  // read a copy so that each timed run sees the same input.
+  
+  Mat srmTags;
+  SuperpixelImage spImage;
+  Mat blockBasedQuantMat;
+  int32_t largestTag = 0;
+  Mat largestMask;
+  
+  {
+    StdoutSilencer silencer;
+    
+    generateSRM(inputImg, Q, srmTags);
+    
+    bool worked = SuperpixelImage::parse(srmTags, spImage);
+    assert(worked);
+    
+    spImage.fillMatrixWithSuperpixelTags(srmTags);
+    
+    CoordGrid<HistogramForBlock> blockMap;
+    blockBasedQuantMat = genHistogramsForBlocks(inputImg, blockMap, blockWidth, blockHeight, superpixelDim);
+    
+    size_t largestSize = 0;
+    
+    for ( int32_t tag : spImage.superpixels ) {
+      Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+      if (spPtr->coords.size() > largestSize) {
+        largestSize = spPtr->coords.size();
+        largestTag = tag;
+      }
+    }
+    
+    largestMask = Mat(inputImg.size(), CV_8UC1, Scalar(0));
+    
+    for ( Coord c : spImage.getSuperpixelPtr(largestTag)->coords ) {
+      largestMask.at<uint8_t>(c.y, c.x) = 0xFF;
+    }
+  }
+  
+  // generateSRM
+  
+  {
+    Mat outTags;
+    
+    addResult("generateSRM", noSetup, [&]() {
+      generateSRM(inputImg, Q, outTags);
+    });
+  }
+  
+  // SuperpixelImage::parse
+  
+  {
+    Mat tags;
+    SuperpixelImage parsedImage;
+    
+    addResult("SuperpixelImage::parse", [&]() {
+      tags = srmTags.clone();
+      parsedImage = SuperpixelImage();
+    }, [&]() {
+      SuperpixelImage::parse(tags, parsedImage);
+    });
+  }
+  
+  // SuperpixelImage::reset of a parsed image, the superpixels stay in the arena
+  
+  {
+    Mat tags;
+    SuperpixelImage parsedImage;
+    
+    addResult("SuperpixelImage::reset", [&]() {
+      tags = srmTags.clone();
+      SuperpixelImage::parse(tags, parsedImage);
+    }, [&]() {
+      parsedImage.reset();
+    });
+  }
+  
+  // Tags written as a PNG and with the tag codec
+  
+  {
+    vector<uint8_t> encoded;
+    
+    addResult("imencode_png_tags", noSetup, [&]() {
+      imencode(".png", srmTags, encoded);
+    });
+    
+    addResult("encodeTagsImage", noSetup, [&]() {
+      encodeTagsImage(srmTags, encoded);
+    });
+  }
+  
+  // SSIM of the input and the tags image, which is as different as it gets
+  
+  {
+    addResult("fusedSSIM", noSetup, [&]() {
+      fusedSSIM(inputImg, srmTags);
+    });
+  }
+  
+  // parseSuperpixelEdges on superpixels parsed from the same tags
+  
+  {
+    Mat tags;
+    SuperpixelImage parsedImage;
+    
+    addResult("parseSuperpixelEdges", [&]() {
+      tags = srmTags.clone();
+      parsedImage = SuperpixelImage();
+      SuperpixelImage::parse(tags, parsedImage);
+      parsedImage.edgeTable = SuperpixelEdgeTable();
+    }, [&]() {
+      SuperpixelImage::parseSuperpixelEdges(tags, parsedImage);
+    });
+  }
+  
+  // genHistogramsForBlocks
+  
+  {
+    CoordGrid<HistogramForBlock> blockMap;
+    
+    addResult("genHistogramsForBlocks", [&]() {
+      blockMap.clear();
+    }, [&]() {
+      genHistogramsForBlocks(inputImg, blockMap, blockWidth, blockHeight, superpixelDim);
+    });
+  }
+  
+  // quant_recurse and map_colors_mps over all the input pixels
+  
+  {
+    Mat packedImg;
+    packPixels(inputImg, packedImg);
+    
+    const uint32_t *inPixels = (const uint32_t *) packedImg.data;
+    
+    vector<uint32_t> outPixels(numPixels);
+    vector<uint32_t> colortable(256);
+    uint32_t numActualClusters = 0;
+    
+    addResult("quant_recurse", [&]() {
+      numActualClusters = (uint32_t) colortable.size();
+    }, [&]() {
+      quant_recurse(numPixels, inPixels, outPixels.data(), &numActualClusters, colortable.data(), 0);
+    });
+    
+    if (numActualClusters == 0) {
+      numActualClusters = (uint32_t) colortable.size();
+      quant_recurse(numPixels, inPixels, outPixels.data(), &numActualClusters, colortable.data(), 0);
+    }
+    
+    addResult("map_colors_mps", noSetup, [&]() {
+      map_colors_mps(inPixels, numPixels, outPixels.data(), colortable.data(), numActualClusters);
+    });
+    
+    // Unique colors and weights that the quant clusters on
+    
+    vector<uint32_t> uniquePixels(numPixels);
+    
+    addResult("calc_color_table", noSetup, [&]() {
+      int numColors = 0;
+      double *weights = calc_color_table(inPixels, numPixels, uniquePixels.data(), 1, numPixels, 1, &numColors);
+      delete [] weights;
+    });
+    
+    // Uniform 5 bit per channel quant used before a decimated run
+    
+    addResult("cut_bits", noSetup, [&]() {
+      cut_bits(inPixels, numPixels, uniquePixels.data(), 5, 5, 5);
+    });
+    
+    // Warm started from the colortable of the same pixels, so only the
+    // k-means refinement and the mapping are run.
+    
+    vector<uint32_t> seedColortable(colortable.begin(), colortable.begin() + numActualClusters);
+    vector<uint32_t> seededColortable(colortable.size());
+    uint32_t numSeededClusters = 0;
+    
+    addResult("quant_recurse_seeded", [&]() {
+      numSeededClusters = (uint32_t) seededColortable.size();
+    }, [&]() {
+      quant_recurse_seeded(numPixels, inPixels, outPixels.data(), &numSeededClusters, seededColortable.data(), 0,
+                           seedColortable.data(), (uint32_t) seedColortable.size(), 1e9, NULL);
+    });
+  }
+  
+  // captureRegionMask for the largest SRM region
+  
+  {
+    Mat mask;
+    
+    addResult("captureRegionMask", noSetup, [&]() {
+      captureRegionMask(spImage, inputImg, srmTags, largestTag, blockWidth, blockHeight, superpixelDim, mask, blockBasedQuantMat);
+    });
+  }
+  
+  // findContourOutline for the largest SRM region
+  
+  {
+    vector<Point2i> contour;
+    
+    addResult("findContourOutline", noSetup, [&]() {
+      findContourOutline(largestMask, contour, false);
+    });
+  }
+  
+  // clusteringCombine and clusteringCombinePyramid with no cached artifacts
+  
+  {
+    Mat resultImg;
+    
+    addResult("clusteringCombine", noSetup, [&]() {
+      ClusteringCombineArtifacts artifacts;
+      artifacts.randomSeed = 0;
+      clusteringCombine(inputImg, resultImg, artifacts);
+    });
+    
+    // Coarse to fine on a half size image
+    
+    addResult("clusteringCombinePyramid", noSetup, [&]() {
+      ClusteringCombineArtifacts artifacts;
+      artifacts.randomSeed = 0;
+      clusteringCombinePyramid(inputImg, resultImg, artifacts, 1);
+    });
+  }
+}
+
+// Scaling mode times the stages whose cost grows with both the number of pixels
+// and the number of regions on synthetic inputs with a known number of regions.
+// One CSV row is written for each stage, size and region count so that the time
+// can be plotted against either the pixels or the regions.
+
+typedef struct {
+  string stageName;
+  int width;
+  int height;
+  int numRegions;
+  // Number of superpixels parsed from the SRM tags of the input
+  int numSuperpixels;
+  vector<double> seconds;
+} ScalingBenchmarkResult;
+
+// Voronoi mosaic of about numRegions regions. The seeds are jittered inside the
+// cells of a grid so that the nearest seed to a pixel is always in one of the 5x5
+// cells around the cell of the pixel, which keeps the generation linear in the
+// number of pixels. Each region is a random color with a gradient of a random
+// direction and the whole image gets a little noise. labelsMat is set to the
+// CV_32SC1 region label of each pixel and paletteIndexes to a color index for
+// each label, there are numRegions/4 indexes so that some neighbors share one.
+
+static
+Mat makeMosaicImage(int width, int height, int numRegions, Mat &labelsMat, vector<int> &paletteIndexes)
+{
+  const double cellDim = sqrt((double) width * height / maxi(1, numRegions));
+  const int numCellsX = maxi(1, (int) round(width / cellDim));
+  const int numCellsY = maxi(1, (int) round(height / cellDim));
+  const int numSeeds = numCellsX * numCellsY;
+  
+  const double cellWidth = (double) width / numCellsX;
+  const double cellHeight = (double) height / numCellsY;
+  
+  RNG rng(numRegions * 7919 + width * 31 + height);
+  
+  vector<Point2f> seeds(numSeeds);
+  vector<Vec3f> baseColors(numSeeds);
+  vector<Vec2f> slopes(numSeeds);
+  
+  paletteIndexes.resize(numSeeds);
+  
+  const int numPaletteColors = maxi(1, numSeeds / 4);
+  
+  vector<Vec3f> paletteColors(numPaletteColors);
+  
+  for ( int i = 0; i < numPaletteColors; i++ ) {
+    paletteColors[i] = Vec3f(rng.uniform(16, 240), rng.uniform(16, 240), rng.uniform(16, 240));
+  }
+  
+  for ( int cy = 0; cy < numCellsY; cy++ ) {
+    for ( int cx = 0; cx < numCellsX; cx++ ) {
+      int i = (cy * numCellsX) + cx;
+      seeds[i] = Point2f((float) ((cx + rng.uniform(0.0, 1.0)) * cellWidth), (float) ((cy + rng.uniform(0.0, 1.0)) * cellHeight));
+      paletteIndexes[i] = rng.uniform(0, numPaletteColors);
+      baseColors[i] = paletteColors[paletteIndexes[i]];
+      float angle = (float) rng.uniform(0.0, 2.0 * CV_PI);
+      float slope = (float) (16.0 / cellDim);
+      slopes[i] = Vec2f(slope * cos(angle), slope * sin(angle));
+    }
+  }
+  
+  labelsMat.create(height, width, CV_32SC1);
+  Mat img(height, width, CV_8UC3);
+  
+  for ( int y = 0; y < height; y++ ) {
+    int32_t *labelsRow = labelsMat.ptr<int32_t>(y);
+    Vec3b *rowPtr = img.ptr<Vec3b>(y);
+    
+    const int cy = mini((int) (y / cellHeight), numCellsY - 1);
+    
+    for ( int x = 0; x < width; x++ ) {
+      const int cx = mini((int) (x / cellWidth), numCellsX - 1);
+      
+      float minDist = FLT_MAX;
+      int minSeed = 0;
+      
+      for ( int ny = maxi(0, cy - 2); ny <= mini(numCellsY - 1, cy + 2); ny++ ) {
+        for ( int nx = maxi(0, cx - 2); nx <= mini(numCellsX - 1, cx + 2); nx++ ) {
+          int i = (ny * numCellsX) + nx;
+          float dx = seeds[i].x - x;
+          float dy = seeds[i].y - y;
+          float d = (dx * dx) + (dy * dy);
+          if (d < minDist) {
+            minDist = d;
+            minSeed = i;
+          }
+        }
+      }
+      
+      labelsRow[x] = minSeed;
+      
+      float delta = (slopes[minSeed][0] * (x - seeds[minSeed].x)) + (slopes[minSeed][1] * (y - seeds[minSeed].y));
+      Vec3f color = baseColors[minSeed];
+      rowPtr[x] = Vec3b(saturate_cast<uint8_t>(color[0] + delta), saturate_cast<uint8_t>(color[1] + delta), saturate_cast<uint8_t>(color[2] + delta));
+    }
+  }
+  
+  Mat noise(img.size(), CV_8UC3);
+  rng.fill(noise, RNG::UNIFORM, Scalar::all(0), Scalar::all(4));
+  img += noise;
+  
+  return img;
+}
+
+// Merges neighbor regions of the mosaic that were generated with the same
+// palette index, the index of each tag is read before the merge loop.
+
+class MosaicPaletteMergeManager : public SuperpixelMergeManager {
+public:
+  unordered_map<int32_t, int> paletteIndexForTag;
+  
+  MosaicPaletteMergeManager(SuperpixelImage & _spImage, Mat &_inputImg, const Mat &labelsMat, const vector<int> &paletteIndexes)
+  : SuperpixelMergeManager(_spImage, _inputImg)
+  {
+    for ( int32_t tag : spImage.superpixels ) {
+      Coord coord = spImage.getSuperpixelPtr(tag)->coords[0];
+      paletteIndexForTag[tag] = paletteIndexes[labelsMat.at<int32_t>(coord.y, coord.x)];
+    }
+    
+    superpixels = spImage.sortSuperpixelsBySize();
+  }
+  
+  bool checkEdge(int32_t dstTag, int32_t srcTag) {
+    return paletteIndexForTag.at(dstTag) == paletteIndexForTag.at(srcTag);
+  }
+};
+
+// Parse the mosaic labels as superpixel tags, every region is one superpixel
+
+static
+void parseMosaicLabels(const Mat &labelsMat, SuperpixelImage &spImage)
+{
+  Mat tags(labelsMat.size(), CV_8UC3);
+  
+  for ( int y = 0; y < labelsMat.rows; y++ ) {
+    const int32_t *labelsRow = labelsMat.ptr<int32_t>(y);
+    Vec3b *tagsRow = tags.ptr<Vec3b>(y);
+    for ( int x = 0; x < labelsMat.cols; x++ ) {
+      tagsRow[x] = PixelToVec3b(labelsRow[x]);
+    }
+  }
+  
+  spImage.reset();
+  bool worked = SuperpixelImage::parse(tags, spImage);
+  assert(worked);
+}
+
+static
+void benchmarkScaling(Size size,
+                      int numRegions,
+                      int numIterations,
+                      const set<string> &stageNames,
+                      vector<ScalingBenchmarkResult> &results)
+{
+  Mat labelsMat;
+  vector<int> paletteIndexes;
+  
+  Mat inputImg = makeMosaicImage(size.width, size.height, numRegions, labelsMat, paletteIndexes);
+  
+  const int superpixelDim = 4;
+  int blockWidth = (inputImg.cols + superpixelDim - 1) / superpixelDim;
+  int blockHeight = (inputImg.rows + superpixelDim - 1) / superpixelDim;
+  
+  const double Q = 128.0;
+  
+  // SRM tags and the superpixels parsed from them, the containment and capture
+  // stages read these in the same way that clusteringCombine() does.
+  
+  Mat srmTags;
+  SuperpixelImage spImage;
+  Mat blockBasedQuantMat;
+  
+  {
+    StdoutSilencer silencer;
+    
+    generateSRM(inputImg, Q, srmTags);
+    
+    bool worked = SuperpixelImage::parse(srmTags, spImage);
+    assert(worked);
+    
+    spImage.fillMatrixWithSuperpixelTags(srmTags);
+    
+    CoordGrid<HistogramForBlock> blockMap;
+    blockBasedQuantMat = genHistogramsForBlocks(inputImg, blockMap, blockWidth, blockHeight, superpixelDim);
+  }
+  
+  const int numSuperpixels = (int) spImage.superpixels.size();
+  
+  auto addResult = [&](const char *stageName, std::function<void()> setup, std::function<void()> run)->void {
+    if (!stageNames.empty() && stageNames.count(stageName) == 0) {
+      return;
+    }
+    
+    ScalingBenchmarkResult result;
+    result.stageName = stageName;
+    result.width = size.width;
+    result.height = size.height;
+    result.numRegions = (int) paletteIndexes.size();
+    result.numSuperpixels = numSuperpixels;
+    result.seconds = timeStage(numIterations, setup, run);
+    results.push_back(result);
+  };
+  
+  // SRM and the parse of the SRM tags
+  
+  {
+    Mat tags;
+    SuperpixelImage parsedImage;
+    
+    addResult("srm_parse", [&]() {
+      parsedImage = SuperpixelImage();
+    }, [&]() {
+      generateSRM(inputImg, Q, tags);
+      SuperpixelImage::parse(tags, parsedImage);
+    });
+  }
+  
+  // Containment recursion over the SRM superpixels
+  
+  vector<int32_t> srmInsideOutOrder;
+  
+  {
+    SuperpixelContainmentTree containsTree;
+    
+    addResult("containment", [&]() {
+      containsTree = SuperpixelContainmentTree();
+    }, [&]() {
+      buildSuperpixelContainmentTree(spImage, srmTags, containsTree);
+    });
+    
+    if (containsTree.rootNodes.empty()) {
+      StdoutSilencer silencer;
+      buildSuperpixelContainmentTree(spImage, srmTags, containsTree);
+    }
+    
+    srmInsideOutOrder = containsTree.getInsideOutOrder();
+  }
+  
+  // Capture loop over the SRM superpixels in containment order
+  
+  {
+    Ptr<RegionRemerger> remergerPtr;
+    
+    addResult("capture", [&]() {
+      remergerPtr.reset(new RegionRemerger(inputImg));
+    }, [&]() {
+      captureRegionMasks(spImage, inputImg, srmTags, srmInsideOutOrder, blockWidth, blockHeight, superpixelDim, *remergerPtr, blockBasedQuantMat, nullptr);
+    });
+  }
+  
+  // Merge manager loop over the mosaic regions
+  
+  {
+    SuperpixelImage mosaicImage;
+    
+    addResult("merge_manager", [&]() {
+      parseMosaicLabels(labelsMat, mosaicImage);
+    }, [&]() {
+      MosaicPaletteMergeManager mergeManager(mosaicImage, inputImg, labelsMat, paletteIndexes);
+      SuperpixelMergeManagerFunc(mergeManager);
+    });
+  }
+}
+
+// Parse a list of comma separated values with the indicated parse function
+
+template <typename T, typename F>
+static
+bool parseList(const string &str, vector<T> &values, F parseFunc)
+{
+  std::stringstream stream(str);
+  string item;
+  
+  values.clear();
+  
+  while (std::getline(stream, item, ',')) {
+    T value;
+    if (!parseFunc(item, value)) {
+      return false;
+    }
+    values.push_back(value);
+  }
+  
+  return !values.empty();
+}
+
+static
+bool parseRegionCount(const string &str, int &numRegions)
+{
+  numRegions = atoi(str.c_str());
+  return numRegions > 0;
+}
+
+static
+int scalingMain(int numIterations, const vector<Size> &sizes, const vector<int> &regionCounts, const set<string> &stageNames, const char *csvFilename)
+{
+  vector<ScalingBenchmarkResult> results;
+  
+  for ( Size size : sizes ) {
+    for ( int numRegions : regionCounts ) {
+      cerr << "scaling " << size.width << "x" << size.height << " with " << numRegions << " regions" << endl;
+      
+      benchmarkScaling(size, numRegions, numIterations, stageNames, results);
+    }
+  }
+  
+  std::ofstream csvFile;
+  
+  if (csvFilename != NULL) {
+    csvFile.open(csvFilename);
+    
+    if (!csvFile) {
+      cerr << "could not write \"" << csvFilename << "\"" << endl;
+      return 1;
+    }
+  }
+  
+  std::ostream &os = (csvFilename != NULL) ? (std::ostream &) csvFile : cout;
+  
+  os << "stage,width,height,pixels,regions,superpixels,median_ms,p95_ms,pixels_per_sec" << endl;
+  
+  for ( const ScalingBenchmarkResult &result : results ) {
+    double median = percentileSeconds(result.seconds, 0.5);
+    double p95 = percentileSeconds(result.seconds, 0.95);
+    int numPixels = result.width * result.height;
+    double pixelsPerSecond = (median > 0.0) ? (numPixels / median) : 0.0;
+    
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%s,%d,%d,%d,%d,%d,%.4f,%.4f,%.0f",
+             result.stageName.c_str(), result.width, result.height, numPixels, result.numRegions, result.numSuperpixels,
+             median * 1000.0, p95 * 1000.0, pixelsPerSecond);
+    os << (char*)buffer << endl;
+  }
+  
+  return 0;
+}
+
+// Golden mode checks the segmentation results and the cost of clusteringCombine
+// against the files stored next to each input image.
+
+typedef struct {
+  double seconds;
+  int64_t matPeakBytes;
+  int64_t heapPeakBytes;
+} GoldenBaseline;
+
+// Image filename without the extension, "tests/Batman/batman.png" -> "tests/Batman/batman"
+
+static
+string goldenPathPrefix(const string &filename)
+{
+  size_t slash = filename.find_last_of('/');
+  size_t dot = filename.find_last_of('.');
+  
+  if (dot == string::npos || (slash != string::npos && dot < slash)) {
+    return filename;
+  }
+  
+  return filename.substr(0, dot);
+}
+
+static
+bool readGoldenBaseline(const string &filename, GoldenBaseline &baseline)
+{
+  std::ifstream inFile(filename);
+  
+  if (!inFile) {
+    return false;
+  }
+  
+  baseline.seconds = 0.0;
+  baseline.matPeakBytes = 0;
+  baseline.heapPeakBytes = 0;
+  
+  string key;
+  
+  while (inFile >> key) {
+    if (key == "seconds") {
+      inFile >> baseline.seconds;
+    } else if (key == "mat_peak_bytes") {
+      inFile >> baseline.matPeakBytes;
+    } else if (key == "heap_peak_bytes") {
+      inFile >> baseline.heapPeakBytes;
+    } else {
+      return false;
+    }
+    
+    if (!inFile) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+static
+bool writeGoldenBaseline(const string &filename, const GoldenBaseline &baseline)
+{
+  std::ofstream outFile(filename);
+  
+  if (!outFile) {
+    return false;
+  }
+  
+  outFile << "seconds " << baseline.seconds << endl;
+  outFile << "mat_peak_bytes " << baseline.matPeakBytes << endl;
+  outFile << "heap_peak_bytes " << baseline.heapPeakBytes << endl;
+  
+  return (bool) outFile;
+}
+
+// True when value is no more than tolerance larger than the baseline, a zero
+// baseline was not measured and is not checked.
+
+static
+bool withinTolerance(double value, double baselineValue, double tolerance)
+{
+  return (baselineValue <= 0.0) || (value <= baselineValue * (1.0 + tolerance));
+}
+
+static
+int goldenMain(const vector<string> &imageFilenames, int numIterations, bool update, double timeTolerance, double memoryTolerance)
+{
+  setMemoryStatsEnabled(true);
+  
+  const bool heapStats = isHeapMemoryStatsAvailable();
+  
+  int numFailed = 0;
+  
+  for ( const string &filename : imageFilenames ) {
+    Mat inputImg = imread(filename, CV_LOAD_IMAGE_COLOR);
+    
+    if (inputImg.empty()) {
+      cerr << "could not read \"" << filename << "\" as image data" << endl;
+      exit(1);
+    }
+    
+    const string prefix = goldenPathPrefix(filename);
+    const string goldenTagsFilename = prefix + "_golden_tags.png";
+    const string baselineFilename = prefix + "_baseline.txt";
+    
+    // Each run starts from empty artifacts so that every stage is run, the
+    // fixed seed makes each run the same as the run that wrote the golden tags.
+    
+    Mat resultImg;
+    GoldenBaseline measured;
+    measured.matPeakBytes = 0;
+    measured.heapPeakBytes = 0;
+    bool worked = true;
+    
+    vector<double> seconds = timeStage(numIterations, []() {}, [&]() {
+      ClusteringCombineArtifacts artifacts;
+      artifacts.randomSeed = 0;
+      worked = worked && clusteringCombine(inputImg, resultImg, artifacts);
+      
+      for ( const ClusteringCombineStageTime &stageTime : artifacts.stageTimes ) {
+        measured.matPeakBytes = max(measured.matPeakBytes, stageTime.matPeakBytes);
+        measured.heapPeakBytes = max(measured.heapPeakBytes, stageTime.heapPeakBytes);
+      }
+    });
+    
+    measured.seconds = percentileSeconds(seconds, 0.5);
+    
+    if (!heapStats) {
+      measured.heapPeakBytes = 0;
+    }
+    
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%-28s : median %10.4f sec : mat peak %9.2f MB : heap peak %9.2f MB",
+             filename.c_str(), measured.seconds, measured.matPeakBytes / (1024.0 * 1024.0), measured.heapPeakBytes / (1024.0 * 1024.0));
+    cout << (char*)buffer << endl;
+    
+    if (!worked) {
+      cout << "FAIL " << filename << " : clusteringCombine failed" << endl;
+      numFailed += 1;
+      continue;
+    }
+    
+    if (update) {
+      if (!imwrite(goldenTagsFilename, resultImg) || !writeGoldenBaseline(baselineFilename, measured)) {
+        cerr << "could not write \"" << goldenTagsFilename << "\" or \"" << baselineFilename << "\"" << endl;
+        exit(1);
+      }
+      cout << "wrote " << goldenTagsFilename << " and " << baselineFilename << endl;
+      continue;
+    }
+    
+    bool passed = true;
+    
+    Mat goldenTags = imread(goldenTagsFilename, CV_LOAD_IMAGE_COLOR);
+    
+    if (goldenTags.empty()) {
+      cout << "FAIL " << filename << " : no golden tags \"" << goldenTagsFilename << "\", run with --update to create them" << endl;
+      passed = false;
+    } else {
+      int numDifferentPixels = 0;
+      
+      if (!tagsEqualUpToRelabel(resultImg, goldenTags, &numDifferentPixels)) {
+        cout << "FAIL " << filename << " : " << numDifferentPixels << " pixels differ from the golden tags" << endl;
+        passed = false;
+      }
+    }
+    
+    GoldenBaseline baseline;
+    
+    if (!readGoldenBaseline(baselineFilename, baseline)) {
+      cout << "FAIL " << filename << " : no baseline \"" << baselineFilename << "\", run with --update to create it" << endl;
+      passed = false;
+    } else {
+      if (!withinTolerance(measured.seconds, baseline.seconds, timeTolerance)) {
+        cout << "FAIL " << filename << " : " << measured.seconds << " seconds, baseline " << baseline.seconds << " seconds" << endl;
+        passed = false;
+      }
+      
+      if (!withinTolerance((double) measured.matPeakBytes, (double) baseline.matPeakBytes, memoryTolerance)) {
+        cout << "FAIL " << filename << " : mat peak " << measured.matPeakBytes << " bytes, baseline " << baseline.matPeakBytes << " bytes" << endl;
+        passed = false;
+      }
+      
+      if (heapStats && !withinTolerance((double) measured.heapPeakBytes, (double) baseline.heapPeakBytes, memoryTolerance)) {
+        cout << "FAIL " << filename << " : heap peak " << measured.heapPeakBytes << " bytes, baseline " << baseline.heapPeakBytes << " bytes" << endl;
+        passed = false;
+      }
+    }
+    
+    if (passed) {
+      cout << "PASS " << filename << endl;
+    } else {
+      numFailed += 1;
+    }
+  }
+  
+  if (!update) {
+    cout << (imageFilenames.size() - numFailed) << " of " << imageFilenames.size() << " images passed" << endl;
+  }
+  
+  return (numFailed == 0) ? 0 : 1;
+}
+
+int main(int argc, const char** argv) {
+  int numIterations = 5;
+  vector<string> imageFilenames;
+  vector<Size> syntheticSizes;
+  set<string> stageNames;
+  
+  bool scaling = false;
+  vector<Size> scalingSizes = { Size(512, 512), Size(1024, 1024), Size(2048, 1536), Size(4000, 3000) };
+  vector<int> regionCounts = { 64, 256, 1024, 4096 };
+  const char *csvFilename = NULL;
+  
+  bool golden = false;
+  bool update = false;
+  double timeTolerance = 0.25;
+  double memoryTolerance = 0.10;
+  
+  for ( int i = 1; i < argc; i++ ) {
+    string arg = argv[i];
+    
+    if (arg == "--iterations" && (i + 1) < argc) {
+      numIterations = atoi(argv[++i]);
+    } else if (arg == "--synthetic" && (i + 1) < argc) {
+      Size size;
+      if (!parseImageSize(argv[++i], size)) {
+        cerr << "invalid synthetic image size \"" << argv[i] << "\", use WxH" << endl;
+        exit(1);
+      }
+      syntheticSizes.push_back(size);
+    } else if (arg == "--stage" && (i + 1) < argc) {
+      stageNames.insert(argv[++i]);
+    } else if (arg == "--scaling") {
+      scaling = true;
+    } else if (arg == "--sizes" && (i + 1) < argc) {
+      if (!parseList(argv[++i], scalingSizes, parseImageSize)) {
+        cerr << "invalid sizes \"" << argv[i] << "\", use WxH,WxH" << endl;
+        exit(1);
+      }
+    } else if (arg == "--regions" && (i + 1) < argc) {
+      if (!parseList(argv[++i], regionCounts, parseRegionCount)) {
+        cerr << "invalid region counts \"" << argv[i] << "\", use N,N" << endl;
+        exit(1);
+      }
+    } else if (arg == "--csv" && (i + 1) < argc) {
+      csvFilename = argv[++i];
+    } else if (arg == "--golden") {
+      golden = true;
+    } else if (arg == "--update") {
+      update = true;
+    } else if (arg == "--time-tolerance" && (i + 1) < argc) {
+      timeTolerance = atof(argv[++i]);
+    } else if (arg == "--memory-tolerance" && (i + 1) < argc) {
+      memoryTolerance = atof(argv[++i]);
+    } else if (arg.size() > 2 && arg[0] == '-' && arg[1] == '-') {
+      cerr << "usage : " << argv[0] << " ?--iterations N? ?--synthetic WxH? ?--stage NAME? ?IMAGE ...?" << endl;
+      cerr << "usage : " << argv[0] << " --scaling ?--iterations N? ?--sizes WxH,...? ?--regions N,...? ?--stage NAME? ?--csv FILENAME?" << endl;
+      cerr << "usage : " << argv[0] << " --golden ?--update? ?--iterations N? ?--time-tolerance F? ?--memory-tolerance F? ?IMAGE ...?" << endl;
+      exit(1);
+    } else {
+      imageFilenames.push_back(arg);
+    }
+  }
+  
+  if (numIterations < 1) {
+    cerr << "iterations must be at least 1" << endl;
+    exit(1);
+  }
+  
+  if (scaling) {
+    return scalingMain(numIterations, scalingSizes, regionCounts, stageNames, csvFilename);
+  }
+  
+  if (golden) {
+    if (imageFilenames.empty()) {
+      imageFilenames.push_back("tests/Batman/batman.png");
+      imageFilenames.push_back("tests/Cookie/cookie.png");
+    }
+    
+    return goldenMain(imageFilenames, numIterations, update, timeTolerance, memoryTolerance);
+  }
+  
+  if (imageFilenames.empty() && syntheticSizes.empty()) {
+    imageFilenames.push_back("tests/Batman/batman.png");
+    imageFilenames.push_back("tests/Cookie/cookie.png");
+    syntheticSizes.push_back(Size(1024, 768));
+  }
+  
+  vector<StageBenchmarkResult> results;
+  
+  for ( const string &filename : imageFilenames ) {
+    Mat inputImg = imread(filename, CV_LOAD_IMAGE_COLOR);
+    
+    if (inputImg.empty()) {
+      cerr << "could not read \"" << filename << "\" as image data" << endl;
+      exit(1);
+    }
+    
+    cout << "benchmark " << filename << " " << inputImg.cols << "x" << inputImg.rows << endl;
+    
+    benchmarkImage(filename, inputImg, numIterations, stageNames, results);
+  }
+  
+  for ( Size size : syntheticSizes ) {
+    std::stringstream nameStream;
+    nameStream << "synthetic_" << size.width << "x" << size.height;
+    string name = nameStream.str();
+    
+    Mat inputImg = makeSyntheticImage(size.width, size.height);
+    
+    cout << "benchmark " << name << endl;
+    
+    benchmarkImage(name, inputImg, numIterations, stageNames, results);
+  }
+  
+  for ( const StageBenchmarkResult &result : results ) {
+    double median = percentileSeconds(result.seconds, 0.5);
+    double p95 = percentileSeconds(result.seconds, 0.95);
+    double pixelsPerSecond = (median > 0.0) ? (result.numPixels / median) : 0.0;
+    
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%-24s %-28s : median %10.4f ms p95 %10.4f ms : %10.2f Mpixels/sec",
+             result.stageName.c_str(), result.imageName.c_str(), median * 1000.0, p95 * 1000.0, pixelsPerSecond / 1.0e6);
+    cout << (char*)buffer << endl;
+  }
+  
+  return 0;
+}
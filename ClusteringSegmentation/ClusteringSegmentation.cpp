@@ -10,6 +10,8 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <opencv2/core/hal/intrin.hpp>
+
 #include "Util.h"
 #include "OpenCVUtil.h"
 #include "OpenCVIter.hpp"
@@ -25,15 +27,26 @@
 #include "MergeSuperpixelImage.h"
 
 #include "srm.h"
+#include "srm_ocl.h"
 
-#include "peakdetect.h"
+#include "peakdetect.hpp"
 
 #include "RegionRemerger.hpp"
 
 #include "RegionVectors.hpp"
 
+#include "TraceEvents.h"
+#include "MemoryStats.h"
+#include "MetricsRegistry.h"
+
 #include <stack>
 
+#include <atomic>
+#include <chrono>
+#include <ctime>
+
+#include <fstream>
+
 using namespace cv;
 using namespace std;
 
@@ -46,7 +59,7 @@ captureVeryCloseRegion(SuperpixelImage &spImage,
                        int blockHeight,
                        int superpixelDim,
                        Mat &outBlockMask,
-                       const vector<Coord> &regionCoords,
+                       RegionPixels &regionPixels,
                        const vector<Coord> &srmRegionCoords,
                        int estNumColors);
 
@@ -59,7 +72,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
                       int blockHeight,
                       int superpixelDim,
                       Mat &mask,
-                      const vector<Coord> &regionCoords,
+                      RegionPixels &regionPixels,
                       const vector<Coord> &srmRegionCoords,
                       int estNumColors,
                       const Mat &blockBasedQuantMat);
@@ -72,10 +85,11 @@ captureRegion(SuperpixelImage &spImage,
               int blockWidth,
               int blockHeight,
               int superpixelDim,
-              Mat &mask,
+              RegionMask &mask,
               const vector<Coord> &regionCoords,
               const vector<Coord> &srmRegionCoords,
-              const Mat &blockBasedQuantMat);
+              const Mat &blockBasedQuantMat,
+              ShapeBoundsGeometryCache *geometryCache = NULL);
 
 vector<SuperpixelEdge>
 getEdgesInRegion(SuperpixelImage &spImage,
@@ -88,7 +102,8 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
                             const Mat & tagsImg,
                             int32_t tag,
                             const vector<Coord> &regionCoords,
-                            Mat & mask);
+                            Mat & mask,
+                            ShapeBoundsGeometryCache *geometryCache = NULL);
 
 // Data and method for scanning ranges of tags around a shape.
 // The total number of divisions (start, end) depends on the
@@ -109,11 +124,12 @@ clockwiseScanForTagsAroundShape(
                                 const vector<Coord> &coords,
                                 vector<TagsAroundShape> &tagsAroundVec);
 
-// Given a set of pixels, scan those pixels and determine the peaks
+// Given a set of pixels and the vote count for each pixel, determine the peaks
 // in the histogram to find likely most common graph peak values.
 
-vector<uint32_t> gatherPeakPixels(const vector<uint32_t> & pixels,
-                                  unordered_map<uint32_t, uint32_t> & pixelToNumVotesMap);
+bool gatherPeakPixels(const vector<uint32_t> & pixels,
+                      const vector<uint32_t> & counts,
+                      vector<uint32_t> & peakPixels);
 
 // This method will contract or expand a region defined by coordinates by N pixel.
 // In the case where the region cannot be expanded or contracted anymore this
@@ -155,14 +171,14 @@ Mat dumpQuantImage(string filename, const Mat &inputImg, uint32_t *pixels) {
     }
   }
   
-  imwrite(filename, quantOutputMat);
+  debugImwrite(filename, quantOutputMat);
   cout << "wrote " << filename << endl;
   return quantOutputMat;
 }
 
 // Dump N x 1 image that contains pixels
 
-void dumpQuantTableImage(string filename, const Mat &inputImg, uint32_t *colortable, uint32_t numColortableEntries)
+void dumpQuantTableImage(string filename, const Mat &inputImg, const uint32_t *colortable, uint32_t numColortableEntries)
 {
   // Write image that contains one color in each row in a N x 1 image
   
@@ -215,94 +231,340 @@ void dumpQuantTableImage(string filename, const Mat &inputImg, uint32_t *colorta
     qtableOutputMat.at<Vec3b>(i, 0) = vec;
   }
   
-  imwrite(filename, qtableOutputMat);
+  debugImwrite(filename, qtableOutputMat);
   cout << "wrote " << filename << endl;
   return;
 }
 
-// Generate a tags Mat from the original input pixels based on SRM algo.
+SRMContext::~SRMContext()
+{
+  if (srmPtr != NULL) {
+    srm_delete(srmPtr);
+  }
+}
 
-Mat generateSRM(const Mat &inputImg, double Q)
+struct srm* SRMContext::prepare(double Q, int width, int height, int channels)
 {
-  // SRM
+  if (srmPtr != NULL && srmPtr->channels != (unsigned int) channels) {
+    srm_delete(srmPtr);
+    srmPtr = NULL;
+  }
   
-  const bool debugOutput = false;
-  const bool debugDumpImage = true;
+  if (srmPtr == NULL) {
+    srmPtr = srm_new(Q, width, height, channels, 0);
+  } else {
+    srm_reset(srmPtr, Q, width, height);
+  }
   
-  int numPixels = inputImg.rows * inputImg.cols;
+  return srmPtr;
+}
+
+static std::atomic<bool> srmDeviceEnabled(false);
+
+void setSRMDeviceEnabled(bool enable)
+{
+  srmDeviceEnabled = enable;
+}
+
+bool isSRMDeviceEnabled()
+{
+  return srmDeviceEnabled;
+}
+
+// srm_run_segment() with the pair diffs from the OpenCL device when enabled
+
+static
+void srmRunSegment(struct srm *srm, const Mat &inputImg, unsigned int widthStep_out, uint8_t *out)
+{
+  if (srmDeviceEnabled) {
+    unsigned int histogram[256];
+    
+    if (srm_ocl_pair_diffs(srm, (unsigned int) inputImg.step, inputImg.data, histogram)) {
+      srm_run_segment_diffs(srm, (unsigned int) inputImg.step, inputImg.data, histogram, widthStep_out, out);
+      return;
+    }
+  }
   
-  assert(inputImg.channels() == 3);
+  srm_run_segment(srm, (unsigned int) inputImg.step, inputImg.data, widthStep_out, out);
+}
+
+// SRM reads gray, BGR and BGRA pixels directly, so an input of another type
+// must be converted by the caller.
+
+static inline
+bool isSRMInputType(const Mat &inputImg)
+{
+  const int type = inputImg.type();
+  return (type == CV_8UC1 || type == CV_8UC3 || type == CV_8UC4);
+}
+
+// Generate a tags Mat from the original input pixels based on SRM algo.
+
+Mat generateSRM(const Mat &inputImg, double Q)
+{
+  Mat outImg;
+  generateSRM(inputImg, Q, outImg);
+  return outImg;
+}
+
+// Run SRM directly on the pixel memory of inputImg and write the averaged region
+// colors into outImg. No intermediate copies of the pixel data are made, the
+// row step of each Mat is passed to the SRM impl so that a non-continuous
+// Mat (an ROI for example) can be processed in place. The outImg Mat is
+// allocated only when it does not already match the size of the input.
+
+void generateSRM(const Mat &inputImg, double Q, Mat &outImg)
+{
+  SRMContext srmContext;
+  generateSRM(inputImg, Q, outImg, srmContext);
+}
+
+// Parallel SRM finalize. The image is split into bands of rows, the SRM roots
+// are found for each band in parallel and then each band lists its regions in
+// the order a row by row scan first sees them. Concatenating the band lists in
+// band order and skipping the regions already labeled gives exactly the labels
+// of srm_run_labels(), the pixel counts and bounds of each region come from the
+// same band scan. The band size does not change the result.
+
+static const int srmFinalizeBandRows = 64;
+
+static const unsigned int srmNoLabel = 0xFFFFFFFF;
+
+typedef struct {
+  int32_t root;
+  int32_t count;
+  int32_t minX;
+  int32_t minY;
+  int32_t maxX;
+  int32_t maxY;
+} SRMBandRegion;
+
+// Write the root of each pixel into labelsMat and reset the root to label
+// table entries for the pixels in the band.
+
+class SRMFlattenParallelBody : public cv::ParallelLoopBody
+{
+public:
+  SRMFlattenParallelBody(struct srm *_srm, Mat &_labelsMat, unsigned int *_rootToLabel)
+  : srm(_srm), labelsMat(_labelsMat), rootToLabel(_rootToLabel) {}
   
-  const int channels = 3;
+  void operator()(const cv::Range& range) const {
+    for ( int band = range.start; band < range.end; band++ ) {
+      int rowStart = band * srmFinalizeBandRows;
+      int rowEnd = mini(labelsMat.rows, rowStart + srmFinalizeBandRows);
+      
+      srm_flatten_rows(srm, rowStart, rowEnd, (unsigned int) labelsMat.step, (int32_t *) labelsMat.data);
+      
+      std::fill(rootToLabel + (rowStart * labelsMat.cols), rootToLabel + (rowEnd * labelsMat.cols), srmNoLabel);
+    }
+  }
   
-  uint8_t *in = new uint8_t[numPixels * channels]();
-  uint8_t *out = new uint8_t[numPixels * channels]();
+private:
+  struct srm *srm;
+  Mat &labelsMat;
+  unsigned int *rootToLabel;
+};
+
+// Gather the regions of each band in first seen order, the count and bounds of
+// each region are updated once for each run of pixels with the same root.
+
+class SRMBandRegionsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  SRMBandRegionsParallelBody(const Mat &_rootsMat, vector<vector<SRMBandRegion> > &_bandRegions)
+  : rootsMat(_rootsMat), bandRegions(_bandRegions) {}
   
-  int i = 0;
-  for(int y = 0; y < inputImg.rows; y++) {
-    for(int x = 0; x < inputImg.cols; x++) {
-      Vec3b vec = inputImg.at<Vec3b>(y, x);
+  void operator()(const cv::Range& range) const {
+    for ( int band = range.start; band < range.end; band++ ) {
+      int rowStart = band * srmFinalizeBandRows;
+      int rowEnd = mini(rootsMat.rows, rowStart + srmFinalizeBandRows);
       
-      uint8_t B = vec[0];
-      uint8_t G = vec[1];
-      uint8_t R = vec[2];
+      vector<SRMBandRegion> &regions = bandRegions[band];
+      unordered_map<int32_t, int32_t> rootToOffset;
       
-      if ((debugOutput)) {
-        char buffer[1024];
-        snprintf(buffer, sizeof(buffer), "for IN (%4d,%4d) pixel is 0x00%02X%02X%02X -> offset %d\n", x, y, R, G, B, i);
-        cout << buffer;
+      for ( int y = rowStart; y < rowEnd; y++ ) {
+        const int32_t *rowPtr = rootsMat.ptr<int32_t>(y);
+        
+        int x = 0;
+        
+        while (x < rootsMat.cols) {
+          int32_t root = rowPtr[x];
+          int runStart = x;
+          
+          while (x < rootsMat.cols && rowPtr[x] == root) {
+            x++;
+          }
+          
+          auto result = rootToOffset.insert(make_pair(root, (int32_t) regions.size()));
+          
+          if (result.second) {
+            SRMBandRegion region;
+            region.root = root;
+            region.count = 0;
+            region.minX = runStart;
+            region.minY = y;
+            region.maxX = x - 1;
+            region.maxY = y;
+            regions.push_back(region);
+          }
+          
+          SRMBandRegion &region = regions[result.first->second];
+          region.count += (x - runStart);
+          region.minX = mini(region.minX, runStart);
+          region.maxX = maxi(region.maxX, x - 1);
+          region.maxY = y;
+        }
       }
+    }
+  }
+  
+private:
+  const Mat &rootsMat;
+  vector<vector<SRMBandRegion> > &bandRegions;
+};
+
+// Replace the root of each pixel with its label
+
+class SRMRelabelParallelBody : public cv::ParallelLoopBody
+{
+public:
+  SRMRelabelParallelBody(Mat &_labelsMat, const unsigned int *_rootToLabel)
+  : labelsMat(_labelsMat), rootToLabel(_rootToLabel) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int y = range.start; y < range.end; y++ ) {
+      int32_t *rowPtr = labelsMat.ptr<int32_t>(y);
       
-      in[(i*3)+0] = B;
-      in[(i*3)+1] = G;
-      in[(i*3)+2] = R;
-      i += 1;
+      for ( int x = 0; x < labelsMat.cols; x++ ) {
+        rowPtr[x] = (int32_t) rootToLabel[rowPtr[x]];
+      }
+    }
+  }
+  
+private:
+  Mat &labelsMat;
+  const unsigned int *rootToLabel;
+};
+
+// Write the average region color of each pixel
+
+class SRMFinalizeParallelBody : public cv::ParallelLoopBody
+{
+public:
+  SRMFinalizeParallelBody(struct srm *_srm) : srm(_srm) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int band = range.start; band < range.end; band++ ) {
+      unsigned int rowStart = band * srmFinalizeBandRows;
+      unsigned int rowEnd = mini((int) srm->height, (int) rowStart + srmFinalizeBandRows);
+      srm_finalize_rows(srm, rowStart, rowEnd);
+    }
+  }
+  
+private:
+  struct srm *srm;
+};
+
+// Write the 0 -> N-1 label of each pixel into labelsMat once the SRM regions
+// are merged, returns N. When labelCounts or labelBounds is not NULL the pixel
+// count or the bounding box of each label is also returned.
+
+static
+int32_t finalizeSRMLabels(struct srm *srm, Mat &labelsMat, vector<int32_t> *labelCounts, vector<Rect> *labelBounds)
+{
+  assert(labelsMat.type() == CV_32SC1);
+  assert((int) srm->width == labelsMat.cols && (int) srm->height == labelsMat.rows);
+  
+  // Region sizes are not needed once merging is finished, so the sizes
+  // array is reused as the root to label table.
+  
+  unsigned int *rootToLabel = srm->sizes;
+  
+  const int numBands = (labelsMat.rows + srmFinalizeBandRows - 1) / srmFinalizeBandRows;
+  
+  parallelFor(Range(0, numBands), SRMFlattenParallelBody(srm, labelsMat, rootToLabel));
+  
+  vector<vector<SRMBandRegion> > bandRegions(numBands);
+  
+  parallelFor(Range(0, numBands), SRMBandRegionsParallelBody(labelsMat, bandRegions));
+  
+  vector<SRMBandRegion> labelRegions;
+  
+  for ( vector<SRMBandRegion> &regions : bandRegions ) {
+    for ( SRMBandRegion &region : regions ) {
+      unsigned int &label = rootToLabel[region.root];
+      
+      if (label == srmNoLabel) {
+        label = (unsigned int) labelRegions.size();
+        labelRegions.push_back(region);
+      } else {
+        SRMBandRegion &labelRegion = labelRegions[label];
+        labelRegion.count += region.count;
+        labelRegion.minX = mini(labelRegion.minX, region.minX);
+        labelRegion.maxX = maxi(labelRegion.maxX, region.maxX);
+        labelRegion.maxY = region.maxY;
+      }
+    }
+    
+    vector<SRMBandRegion>().swap(regions);
+  }
+  
+  parallelFor(Range(0, labelsMat.rows), SRMRelabelParallelBody(labelsMat, rootToLabel));
+  
+  if (labelCounts != NULL) {
+    labelCounts->resize(labelRegions.size());
+    for ( size_t label = 0; label < labelRegions.size(); label++ ) {
+      (*labelCounts)[label] = labelRegions[label].count;
     }
   }
   
+  if (labelBounds != NULL) {
+    labelBounds->resize(labelRegions.size());
+    for ( size_t label = 0; label < labelRegions.size(); label++ ) {
+      const SRMBandRegion &region = labelRegions[label];
+      (*labelBounds)[label] = Rect(region.minX, region.minY, region.maxX - region.minX + 1, region.maxY - region.minY + 1);
+    }
+  }
+  
+  return (int32_t) labelRegions.size();
+}
+
+void generateSRM(const Mat &inputImg, double Q, Mat &outImg, SRMContext &srmContext)
+{
+  // SRM
+  
+  const bool debugOutput = false;
+  const bool debugDumpImage = isDebugStageImagesEnabled();
+  
+  assert(isSRMInputType(inputImg));
+  
+  outImg.create(inputImg.size(), inputImg.type());
+  
   //double Q = 512.0;
   //double Q = 255.0;
   
-  SRM(Q, inputImg.cols, inputImg.rows, channels, in, out, 0);
+  struct srm *srm = srmContext.prepare(Q, inputImg.cols, inputImg.rows, inputImg.channels());
+  srmRunSegment(srm, inputImg, (unsigned int) outImg.step, outImg.data);
   
-  Mat outImg = inputImg.clone();
-  outImg = (Scalar) 0;
+  const int numBands = (inputImg.rows + srmFinalizeBandRows - 1) / srmFinalizeBandRows;
+  parallelFor(Range(0, numBands), SRMFinalizeParallelBody(srm));
   
   bool foundWhitePixel = false;
   uint32_t largestNonWhitePixel = 0x0;
   
-  i = 0;
-  for(int y = 0; y < outImg.rows; y++) {
-    for(int x = 0; x < outImg.cols; x++) {
-      uint32_t B = out[(i*3)+0];
-      uint32_t G = out[(i*3)+1];
-      uint32_t R = out[(i*3)+2];
-      
-      i += 1;
-      
-      if ((debugOutput)) {
-        char buffer[1024];
-        snprintf(buffer, sizeof(buffer), "for OUT (%4d,%4d) pixel is 0x00%02X%02X%02X -> offset %d\n", x, y, R, G, B, i);
-        cout << buffer;
-      }
-      
-      Vec3b vec;
-      
-      vec[0] = B;
-      vec[1] = G;
-      vec[2] = R;
-      
-      outImg.at<Vec3b>(y, x) = vec;
-      
+  // Only a BGR output can be parsed as tags, so only BGR white is rewritten
+  
+  if (outImg.type() == CV_8UC3) {
+    for_each_const_bgr(outImg, [&](uint8_t B, uint8_t G, uint8_t R) {
       if (B == 0xFF && G == 0xFF && R == 0xFF) {
         foundWhitePixel = true;
       } else {
-        uint32_t pixel = (R << 16) | (G << 8) | (B);
+        uint32_t pixel = ((uint32_t)R << 16) | ((uint32_t)G << 8) | (uint32_t)B;
         if (pixel > largestNonWhitePixel) {
           largestNonWhitePixel = pixel;
         }
       }
-    }
+    });
   }
   
   if (foundWhitePixel) {
@@ -314,10 +576,8 @@ Mat generateSRM(const Mat &inputImg, double Q)
     
     nonWhitePixel -= 1;
     
-    while (1) {
-      if (nonWhitePixel != largestNonWhitePixel) {
-        break;
-      }
+    while (nonWhitePixel == largestNonWhitePixel) {
+      nonWhitePixel -= 1;
     }
     
     // nonWhitePixel now contains an unused pixel value
@@ -330,16 +590,13 @@ Mat generateSRM(const Mat &inputImg, double Q)
       cout << buffer;
     }
     
-    for(int y = 0; y < outImg.rows; y++) {
-      for(int x = 0; x < outImg.cols; x++) {
-        Vec3b vec = outImg.at<Vec3b>(y, x);
-        uint32_t pixel = Vec3BToUID(vec);
-        if (pixel == 0x00FFFFFF) {
-          vec = nonWhitePixelVec;
-          outImg.at<Vec3b>(y, x) = vec;
-        }
+    for_each_bgr(outImg, [&](uint8_t B, uint8_t G, uint8_t R)->Vec3b {
+      if (B == 0xFF && G == 0xFF && R == 0xFF) {
+        return nonWhitePixelVec;
+      } else {
+        return Vec3b(B, G, R);
       }
-    }
+    });
   }
   
   if (debugDumpImage) {
@@ -347,234 +604,749 @@ Mat generateSRM(const Mat &inputImg, double Q)
       fnameStream << "srm" << int(Q) << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, outImg);
+      debugImwrite(fname, outImg);
       cout << "wrote " << fname << endl;
   }
   
-  delete [] in;
-  delete [] out;
-  
-  return outImg;
+  return;
 }
 
-// Generate a histogram for each block of 4x4 pixels in the input image.
-// This logic maps input pixels to an even quant division of the color cube
-// so that comparison based on the pixel frequency is easy on a region
-// by region basis.
+// Run SRM in label mode and write a CV_32SC1 Mat where each pixel contains the
+// 0 -> N-1 label of the region it belongs to. Since each SRM region is grown
+// from 4 connected pixel pairs the labels are unique and connected by
+// construction. Returns the number of regions N.
 
-Mat genHistogramsForBlocks(const Mat &inputImg,
-                           unordered_map<Coord, HistogramForBlock> &blockMap,
-                           int blockWidth,
-                           int blockHeight,
-                           int superpixelDim)
+int32_t generateSRMLabels(const Mat &inputImg, double Q, Mat &labelsMat)
 {
-  const bool debugOutput = false;
-  const bool dumpOutputImages = true;
+  SRMContext srmContext;
+  return generateSRMLabels(inputImg, Q, labelsMat, srmContext);
+}
+
+int32_t generateSRMLabels(const Mat &inputImg, double Q, Mat &labelsMat, SRMContext &srmContext,
+                          vector<int32_t> *labelCounts, vector<Rect> *labelBounds)
+{
+  assert(isSRMInputType(inputImg));
   
-  uint32_t width = inputImg.cols;
-  uint32_t height = inputImg.rows;
+  labelsMat.create(inputImg.size(), CV_32SC1);
   
-  uint32_t numPixels = width * height;
-  uint32_t *inPixels = new uint32_t[numPixels];
-  uint32_t *outPixels = new uint32_t[numPixels]();
+  struct srm *srm = srmContext.prepare(Q, inputImg.cols, inputImg.rows, inputImg.channels());
+  srmRunSegment(srm, inputImg, 0, NULL);
   
-  int pi = 0;
-  for(int y = 0; y < height; y++) {
-    for(int x = 0; x < width; x++) {
-      Vec3b vec = inputImg.at<Vec3b>(y, x);
-      uint32_t pixel = Vec3BToUID(vec);
-      
-      if ((debugOutput)) {
-        char buffer[1024];
-        snprintf(buffer, sizeof(buffer), "for (%4d,%4d) pixel is 0x%08X\n", x, y, pixel);
-        cout << buffer;
-      }
-      
-      inPixels[pi++] = pixel;
+  return finalizeSRMLabels(srm, labelsMat, labelCounts, labelBounds);
+}
+
+// Parallel loop body that segments SRM tiles, each tile covers a distinct
+// set of pixels so the tiles can be processed at the same time.
+
+class SRMTileParallelBody : public cv::ParallelLoopBody
+{
+public:
+  SRMTileParallelBody(struct srm *_srm) : srm(_srm) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int tile = range.start; tile < range.end; tile++ ) {
+      srm_tiled_segment_tile(srm, (unsigned int) tile);
     }
   }
   
-  vector<uint32_t> quantColors = getSubdividedColors();
-  uint32_t numColors = (uint32_t) quantColors.size();
-  uint32_t *colortable = new uint32_t[numColors];
+private:
+  struct srm *srm;
+};
+
+// Tiled SRM label mode, the image is split into bands of tileRows rows and each
+// band is segmented on a separate thread. The pairs that cross a band seam are
+// then merged with the same predicate once all the bands are done. Since the
+// merge order differs from a full image SRM run, the results are similar to but
+// not exactly the same as generateSRMLabels(). Pass zero as tileRows to split
+// the image into one band for each thread. Returns the number of regions.
+
+int32_t generateSRMLabelsTiled(const Mat &inputImg, double Q, Mat &labelsMat, SRMContext &srmContext, int tileRows,
+                               vector<int32_t> *labelCounts, vector<Rect> *labelBounds)
+{
+  assert(isSRMInputType(inputImg));
+  
+  labelsMat.create(inputImg.size(), CV_32SC1);
   
-  {
-    int i = 0;
-    for ( uint32_t color : quantColors ) {
-      colortable[i++] = color;
+  if (tileRows <= 0) {
+    int numThreads = max(1, getNumThreads());
+    tileRows = (inputImg.rows + numThreads - 1) / numThreads;
+  }
+  
+  struct srm *srm = srmContext.prepare(Q, inputImg.cols, inputImg.rows, inputImg.channels());
+  
+  unsigned int numTiles = srm_tiled_begin(srm, (unsigned int) tileRows, (unsigned int) inputImg.step, inputImg.data, 0, NULL);
+  
+  parallelFor(Range(0, (int) numTiles), SRMTileParallelBody(srm));
+  
+  srm_tiled_finish(srm);
+  
+  return finalizeSRMLabels(srm, labelsMat, labelCounts, labelBounds);
+}
+
+int32_t generateSRMLabelsAutoQ(const Mat &inputImg, int minRegions, int maxRegions, Mat &labelsMat, SRMContext &srmContext,
+                               double *chosenQ,
+                               vector<int32_t> *labelCounts, vector<Rect> *labelBounds,
+                               double minQ, double maxQ, int maxTrials)
+{
+  assert(isSRMInputType(inputImg));
+  assert(minRegions >= 0 && minRegions <= maxRegions);
+  
+  labelsMat.create(inputImg.size(), CV_32SC1);
+  
+  struct srm *srm = srmContext.prepare(minQ, inputImg.cols, inputImg.rows, inputImg.channels());
+  
+  double Q = srm_run_auto_q(srm, (unsigned int) inputImg.step, inputImg.data,
+                            (unsigned int) minRegions, (unsigned int) maxRegions,
+                            minQ, maxQ, (unsigned int) maxTrials, NULL);
+  
+  if (chosenQ != NULL) {
+    *chosenQ = Q;
+  }
+  
+  return finalizeSRMLabels(srm, labelsMat, labelCounts, labelBounds);
+}
+
+// Streaming SRM, the image is read one band of bandRows rows at a time and
+// the SRM state only covers the current band plus the last row of the previous
+// band. Regions that touch that row carry their size and mean over into the
+// next band so a region can grow across any number of bands. Labels written
+// for an earlier band can be joined by a later band, so the caller must remap
+// the provisional labels with labelMap. Small regions are merged per band so that
+// the results are close to but not exactly the same as generateSRMLabels().
+
+int32_t generateSRMLabelsStreamed(int width, int height, double Q, int bandRows,
+                                  std::function<void(int row, int numRows, Mat &band)> readBand,
+                                  std::function<void(int row, const Mat &labels)> writeLabels,
+                                  vector<int32_t> &labelMap)
+{
+  assert(width > 0 && height > 0);
+  assert(bandRows > 0);
+  
+  struct srm_stream *stream = srm_stream_new(Q, (unsigned int) width, (unsigned int) height, 3, (unsigned int) bandRows);
+  
+  Mat band;
+  Mat bandLabels;
+  
+  for ( int row = 0; row < height; row += bandRows ) {
+    int numRows = min(bandRows, height - row);
+    
+    band.create(numRows, width, CV_8UC3);
+    bandLabels.create(numRows, width, CV_32SC1);
+    
+    readBand(row, numRows, band);
+    assert(band.type() == CV_8UC3 && band.rows == numRows && band.cols == width);
+    
+    srm_stream_push(stream, (unsigned int) numRows, (unsigned int) band.step, band.data, (unsigned int) bandLabels.step, (int32_t *) bandLabels.data);
+    
+    writeLabels(row, bandLabels);
+  }
+  
+  labelMap.resize(srm_stream_labels_count(stream));
+  unsigned int numLabels = srm_stream_finish(stream, labelMap.data());
+  
+  srm_stream_delete(stream);
+  
+  return (int32_t) numLabels;
+}
+
+int32_t generateSRMLabelsStreamed(const Mat &inputImg, double Q, Mat &labelsMat, int bandRows)
+{
+  assert(inputImg.type() == CV_8UC3);
+  
+  labelsMat.create(inputImg.size(), CV_32SC1);
+  
+  vector<int32_t> labelMap;
+  
+  int32_t numLabels = generateSRMLabelsStreamed(inputImg.cols, inputImg.rows, Q, bandRows,
+                                                [&inputImg](int row, int numRows, Mat &band) {
+                                                  inputImg.rowRange(row, row + numRows).copyTo(band);
+                                                },
+                                                [&labelsMat](int row, const Mat &labels) {
+                                                  labels.copyTo(labelsMat.rowRange(row, row + labels.rows));
+                                                },
+                                                labelMap);
+  
+  // Second pass over the label rows to write the final labels
+  
+  for ( int y = 0; y < labelsMat.rows; y++ ) {
+    int32_t *rowPtr = labelsMat.ptr<int32_t>(y);
+    for ( int x = 0; x < labelsMat.cols; x++ ) {
+      rowPtr[x] = labelMap[rowPtr[x]];
     }
   }
   
-  map_colors_mps(inPixels, numPixels, outPixels, colortable, numColors);
+  return numLabels;
+}
+
+// Hierarchical SRM, generate label Mats for each Q value in Qs while only
+// generating and sorting the pixel pairs once. A segmentation for a smaller
+// Q is always a merge of regions from the segmentation for a larger Q, so
+// the results form a hierarchy from fine to coarse. Returns the number of
+// regions found for each Q.
+
+vector<int32_t> generateSRMMultiLabels(const Mat &inputImg, const vector<double> &Qs, vector<Mat> &labelsMats, SRMContext &srmContext)
+{
+  assert(isSRMInputType(inputImg));
+  assert(Qs.size() > 0);
+  
+  const unsigned int numLevels = (unsigned int) Qs.size();
   
-  if (dumpOutputImages) {
-    Mat quantMat = dumpQuantImage("block_quant_full_output.png", inputImg, outPixels);
+  labelsMats.resize(numLevels);
+  
+  vector<int32_t*> labelsPtrs;
+  
+  for ( Mat &labelsMat : labelsMats ) {
+    labelsMat.create(inputImg.size(), CV_32SC1);
+    assert(labelsMat.step == labelsMats[0].step);
+    labelsPtrs.push_back((int32_t *) labelsMat.data);
   }
   
-  // Allocate Mat where a single quant value is selected for each block. Iterate over
-  // each block and query the coordinates associated with a specific block.
+  vector<unsigned int> counts(numLevels);
   
-  Mat blockMat = Mat(blockHeight, blockWidth, CV_8UC3);
-  blockMat = (Scalar) 0;
+  struct srm *srm = srmContext.prepare(Qs[0], inputImg.cols, inputImg.rows, inputImg.channels());
+  srm_run_multi_labels(srm, (unsigned int) inputImg.step, inputImg.data,
+                       numLevels, Qs.data(),
+                       (unsigned int) labelsMats[0].step, labelsPtrs.data(), counts.data());
+  
+  vector<int32_t> numRegions;
   
-  pi = 0;
-  for(int by = 0; by < blockMat.rows; by++) {
-    for(int bx = 0; bx < blockMat.cols; bx++) {
-      Coord blockC(bx, by);
+  for ( unsigned int count : counts ) {
+    numRegions.push_back((int32_t) count);
+  }
+  
+  return numRegions;
+}
+
+// Convert a CV_32SC1 label Mat to a 24 bit tags image. Each tag is written as
+// (label + labelOffset) so that a caller can reserve the zero tag.
+
+void labelsToTags(const Mat &labelsMat, Mat &tagsMat, int32_t labelOffset)
+{
+  assert(labelsMat.type() == CV_32SC1);
+  
+  tagsMat.create(labelsMat.size(), CV_8UC3);
+  
+  for ( int y = 0; y < labelsMat.rows; y++ ) {
+    const int32_t *labelsRowPtr = labelsMat.ptr<int32_t>(y);
+    uint8_t *tagsRowPtr = tagsMat.ptr<uint8_t>(y);
+    
+    for ( int x = 0; x < labelsMat.cols; x++ ) {
+      uint32_t tag = (uint32_t) (labelsRowPtr[x] + labelOffset);
+      assert(tag < 0x00FFFFFF);
+      *tagsRowPtr++ = tag & 0xFF;
+      *tagsRowPtr++ = (tag >> 8) & 0xFF;
+      *tagsRowPtr++ = (tag >> 16) & 0xFF;
+    }
+  }
+  
+  return;
+}
+
+// Two pass connected component labelling, the first pass assigns a provisional
+// label to each pixel and records an equivalence when a pixel joins two labels
+// with the same tag. The second pass writes the final label for each root.
+
+static inline
+int32_t labelConnectedTagsFind(vector<int32_t> &parents, int32_t label)
+{
+  while (parents[label] != label) {
+    parents[label] = parents[parents[label]];
+    label = parents[label];
+  }
+  return label;
+}
+
+int32_t labelConnectedTags(const Mat &tagsMat, Mat &labelsMat)
+{
+  assert(tagsMat.type() == CV_8UC3);
+  
+  const int width = tagsMat.cols;
+  const int height = tagsMat.rows;
+  
+  labelsMat.create(tagsMat.size(), CV_32SC1);
+  
+  vector<int32_t> parents;
+  
+  // The packed tags of the previous row and this row
+  
+  vector<uint32_t> prevTags(width);
+  vector<uint32_t> currentTags(width);
+  
+  for ( int y = 0; y < height; y++ ) {
+    const uint8_t *tagsRowPtr = tagsMat.ptr<uint8_t>(y);
+    int32_t *labelsRowPtr = labelsMat.ptr<int32_t>(y);
+    const int32_t *prevLabelsRowPtr = (y > 0) ? labelsMat.ptr<int32_t>(y-1) : NULL;
+    
+    for ( int x = 0; x < width; x++ ) {
+      uint32_t tag = tagsRowPtr[0] | (tagsRowPtr[1] << 8) | (tagsRowPtr[2] << 16);
+      tagsRowPtr += 3;
+      currentTags[x] = tag;
       
-      if ((debugOutput)) {
-        char buffer[1024];
-        snprintf(buffer, sizeof(buffer), "block (%4d,%4d)", bx, by);
-        cout << buffer << endl;
-      }
-      
-      int actualX = blockC.x * superpixelDim;
-      int actualY = blockC.y * superpixelDim;
+      int32_t label = -1;
       
-      Coord min(actualX, actualY);
-      Coord max(actualX+superpixelDim-1, actualY+superpixelDim-1);
+      // Check the W, NW, N and NE neighbors that were already labelled
       
-      if ((debugOutput)) {
-        char buffer[1024];
-        snprintf(buffer, sizeof(buffer), "block min (%4d,%4d) max (%4d,%4d)", min.x, min.y, max.x, max.y);
-        cout << buffer << endl;
+      if (x > 0 && currentTags[x-1] == tag) {
+        label = labelsRowPtr[x-1];
       }
       
-      vector<uint32_t> pixelsThisBlock;
-      
-      bool isAllSamePixel = true;
-      bool isFirstPixelSet = false;
-      uint32_t firstPixel = 0x0;
-      
-      for (int y = actualY; y <= max.y; y++) {
-        for (int x = actualX; x <= max.x; x++) {
-          if ((debugOutput) && false) {
-            char buffer[1024];
-            snprintf(buffer, sizeof(buffer), "(%4d,%4d)", x, y);
-            cout << buffer << endl;
-          }
+      if (prevLabelsRowPtr != NULL) {
+        for ( int dx = -1; dx <= 1; dx++ ) {
+          int nx = x + dx;
           
-          if (x > width-1) {
-            continue;
-          }
-          if (y > height-1) {
+          if (nx < 0 || nx >= width || prevTags[nx] != tag) {
             continue;
           }
           
-          Coord c(x, y);
-          uint32_t pi = (y * width) + x;
-          uint32_t quantPixel = outPixels[pi];
+          int32_t neighborLabel = prevLabelsRowPtr[nx];
           
-          if (!isFirstPixelSet) {
-            // First pixel in block
-            isFirstPixelSet = true;
-            firstPixel = quantPixel;
+          if (label == -1) {
+            label = neighborLabel;
+          } else if (neighborLabel != label) {
+            int32_t root1 = labelConnectedTagsFind(parents, label);
+            int32_t root2 = labelConnectedTagsFind(parents, neighborLabel);
             
-            if (debugOutput) {
-              cout << "detected first pixel in block at " << x << "," << y << endl;
-            }
-          }
-          
-          if ((debugOutput)) {
-            char buffer[1024];
-            snprintf(buffer, sizeof(buffer), "for (%4d,%4d) offset is %d pixel is 0x%08X\n", x, y, pi, quantPixel);
-            cout << buffer;
-          }
-          
-          pixelsThisBlock.push_back(quantPixel);
-          
-          if (isAllSamePixel) {
-            if (quantPixel != firstPixel) {
-              isAllSamePixel = false;
+            if (root1 < root2) {
+              parents[root2] = root1;
+            } else if (root2 < root1) {
+              parents[root1] = root2;
             }
           }
         }
       }
       
-      if (debugOutput) {
-        cout << "isAllSamePixel " << isAllSamePixel << " isFirstPixelSet " << isFirstPixelSet << " num pixelsThisBlock " << pixelsThisBlock.size() << endl;
+      if (label == -1) {
+        label = (int32_t) parents.size();
+        parents.push_back(label);
       }
       
-      assert(isFirstPixelSet && pixelsThisBlock.size() > 0);
-      
-      // Examine each quant pixel value in pixelsThisBlock and determine which quant pixel best
-      // represents this block. Note that coord is the upper left coord in the block.
-      
-      HistogramForBlock &hfb = blockMap[blockC];
-      
-      unordered_map<uint32_t, uint32_t> &pixelToCountTable = hfb.pixelToCountTable;
-      
-      uint32_t maxPixel = 0x0;
+      labelsRowPtr[x] = label;
+    }
+    
+    prevTags.swap(currentTags);
+  }
+  
+  // A root is always the smallest label in its set, so roots are numbered in
+  // the order the regions are first found.
+  
+  int32_t numLabels = 0;
+  
+  vector<int32_t> finalLabels(parents.size());
+  
+  for ( int32_t label = 0; label < (int32_t) parents.size(); label++ ) {
+    int32_t root = labelConnectedTagsFind(parents, label);
+    
+    if (root == label) {
+      finalLabels[label] = numLabels;
+      numLabels += 1;
+    } else {
+      finalLabels[label] = finalLabels[root];
+    }
+  }
+  
+  for ( int y = 0; y < height; y++ ) {
+    int32_t *labelsRowPtr = labelsMat.ptr<int32_t>(y);
+    
+    for ( int x = 0; x < width; x++ ) {
+      labelsRowPtr[x] = finalLabels[labelsRowPtr[x]];
+    }
+  }
+  
+  return numLabels;
+}
+
+// Add one pixel to a block histogram, a palette offset that is not in the
+// histogram yet is appended so that the offsets stay in first seen order.
+
+static inline
+void addPixelToHistogramForBlock(HistogramForBlock &hfb, uint8_t offset)
+{
+  int i = 0;
+  for ( ; i < hfb.numPixels; i++ ) {
+    if (hfb.paletteOffsets[i] == offset) {
+      break;
+    }
+  }
+  
+  if (i == hfb.numPixels) {
+    assert(hfb.numPixels < HISTOGRAM_FOR_BLOCK_MAX_PIXELS);
+    hfb.paletteOffsets[i] = offset;
+    hfb.counts[i] = 0;
+    hfb.numPixels += 1;
+  }
+  
+  hfb.counts[i] += 1;
+}
+
+// Histogram of the 16 palette offsets of a full 4x4 block in raster order. The
+// offsets are compared 16 at a time, the first offset that has not been counted
+// is compared against all 16 and each match is counted and marked, so the loop
+// runs once for each distinct offset. The result is the same first seen order
+// and counts as adding the pixels one at a time.
+
+static inline
+void histogramForBlock4x4(HistogramForBlock &hfb, const uint8_t *offsets)
+{
+  hfb.numPixels = 0;
+  
+#if CV_SIMD128
+  const v_uint8x16 offsetsVec = v_load(offsets);
+  
+  int remaining = 0xFFFF;
+  
+  while (remaining != 0) {
+    const uint8_t offset = offsets[__builtin_ctz(remaining)];
+    const int matches = v_signmask(offsetsVec == v_setall_u8(offset));
+    
+    hfb.paletteOffsets[hfb.numPixels] = offset;
+    hfb.counts[hfb.numPixels] = (uint8_t) __builtin_popcount(matches);
+    hfb.numPixels += 1;
+    
+    remaining &= ~matches;
+  }
+#else
+  for ( int i = 0; i < 16; i++ ) {
+    addPixelToHistogramForBlock(hfb, offsets[i]);
+  }
+#endif // CV_SIMD128
+}
+
+// Parallel loop body that fills the histogram for each block in a range of
+// block rows. Each block reads a distinct set of input pixels and writes
+// its own entry in the block map, so block rows can be run at the same time.
+// When paletteIndexMat is not NULL the palette offset of each pixel is also
+// written to it. BlockDim is the block size when it is known at compile time
+// and 0 to use superpixelDim. Full 4x4 blocks have their own histogram path,
+// the blocks cut off by the right or bottom edge of the image and any other
+// block size use the generic loop.
+
+template <int BlockDim>
+class BlockHistogramsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  BlockHistogramsParallelBody(const Mat &_inputImg,
+                              CoordGrid<HistogramForBlock> &_blockMap,
+                              Mat &_blockMat,
+                              int _superpixelDim,
+                              Mat *_paletteIndexMat)
+  : inputImg(_inputImg), blockMap(_blockMap), blockMat(_blockMat), superpixelDim(_superpixelDim), paletteIndexMat(_paletteIndexMat)
+  {
+    assert(BlockDim == 0 || BlockDim == superpixelDim);
+  }
+  
+  void operator()(const cv::Range& range) const {
+    const SubdividedColors &subdividedColors = SubdividedColors::getInstance();
+    const vector<uint32_t> &quantColors = subdividedColors.getColors();
+    
+    const int dim = (BlockDim > 0) ? BlockDim : superpixelDim;
+    
+    for ( int by = range.start; by < range.end; by++ ) {
+      int actualY = by * dim;
+      int maxY = mini(actualY + dim, inputImg.rows);
       
-      if (isAllSamePixel) {
-        // Optimized common case where all pixels are exactly the same value
-        
-        maxPixel = pixelsThisBlock[0];
+      for ( int bx = 0; bx < blockMat.cols; bx++ ) {
+        int actualX = bx * dim;
+        int maxX = mini(actualX + dim, inputImg.cols);
         
-        pixelToCountTable[maxPixel] = (uint32_t)pixelsThisBlock.size();
+        HistogramForBlock &hfb = *blockMap.find(Coord(bx, by));
+        hfb.numPixels = 0;
         
-        if ((debugOutput)) {
-          char buffer[1024];
-          snprintf(buffer, sizeof(buffer), "all pixels in block optimized case for pixel 0x%08X\n", maxPixel);
-          cout << buffer;
-        }
-      } else {
-        
-        for ( uint32_t qp : pixelsThisBlock ) {
-          if ((debugOutput)) {
-            char buffer[1024];
-            snprintf(buffer, sizeof(buffer), "histogram pixel 0x%08X\n", qp);
-            cout << buffer;
+        if (BlockDim == 4 && (maxX - actualX) == 4 && (maxY - actualY) == 4) {
+          uint8_t offsets[16];
+          
+          for ( int y = 0; y < 4; y++ ) {
+            const Vec3b *rowPtr = inputImg.ptr<Vec3b>(actualY + y) + actualX;
+            uint16_t *indexRowPtr = (paletteIndexMat == NULL) ? NULL : (paletteIndexMat->ptr<uint16_t>(actualY + y) + actualX);
+            
+            for ( int x = 0; x < 4; x++ ) {
+              uint8_t offset = (uint8_t) subdividedColors.lookupIndex(Vec3BToUID(rowPtr[x]));
+              offsets[(y * 4) + x] = offset;
+              
+              if (indexRowPtr != NULL) {
+                indexRowPtr[x] = offset;
+              }
+            }
           }
           
-          pixelToCountTable[qp] += 1;
+          histogramForBlock4x4(hfb, offsets);
+        } else {
+          for ( int y = actualY; y < maxY; y++ ) {
+            const Vec3b *rowPtr = inputImg.ptr<Vec3b>(y);
+            uint16_t *indexRowPtr = (paletteIndexMat == NULL) ? NULL : paletteIndexMat->ptr<uint16_t>(y);
+            
+            for ( int x = actualX; x < maxX; x++ ) {
+              uint32_t pixel = Vec3BToUID(rowPtr[x]);
+              uint8_t offset = (uint8_t) subdividedColors.lookupIndex(pixel);
+              
+              if (indexRowPtr != NULL) {
+                indexRowPtr[x] = offset;
+              }
+              
+              addPixelToHistogramForBlock(hfb, offset);
+            }
+          }
         }
         
-        int maxCount = 0;
+        assert(hfb.numPixels > 0);
         
-        for ( auto it = begin(pixelToCountTable); it != end(pixelToCountTable); ++it) {
-          uint32_t pixel = it->first;
-          uint32_t count = it->second;
-          
-          if ((debugOutput)) {
-            printf("count table[0x%08X] = %6d\n", pixel, count);
-          }
-          
-          if (count > maxCount) {
-            maxCount = count;
-            maxPixel = pixel;
+        // Determine which quant pixel best represents this block, the first
+        // pixel seen wins a tie.
+        
+        int maxIndex = 0;
+        
+        for ( int i = 1; i < hfb.numPixels; i++ ) {
+          if (hfb.counts[i] > hfb.counts[maxIndex]) {
+            maxIndex = i;
           }
         }
         
         // FIXME: if these are anywhere close, then do a stddev and choose one that is way
         // larger than the others. But if really close then choose no specific pixel.
         
-        if ((debugOutput)) {
-          printf("maxCount %5d : maxPixel 0x%08X\n", maxCount, maxPixel);
-          printf("done\n");
-        }
+        uint32_t maxPixel = quantColors[hfb.paletteOffsets[maxIndex]] & 0x00FFFFFF;
+        
+        hfb.regionQuantPixel = maxPixel;
+        
+        blockMat.at<Vec3b>(by, bx) = PixelToVec3b(maxPixel);
       }
-      
-      hfb.regionQuantPixel = maxPixel;
-      
-      Vec3b vec = PixelToVec3b(maxPixel);
-      blockMat.at<Vec3b>(by, bx) = vec;
     }
   }
   
+private:
+  const Mat &inputImg;
+  CoordGrid<HistogramForBlock> &blockMap;
+  Mat &blockMat;
+  int superpixelDim;
+  Mat *paletteIndexMat;
+};
+
+// Generate a histogram for each block of 4x4 pixels in the input image.
+// This logic maps input pixels to an even quant division of the color cube
+// so that comparison based on the pixel frequency is easy on a region
+// by region basis. The histograms are stored inline in a dense grid of
+// blocks and block rows are filled in parallel.
+
+Mat genHistogramsForBlocks(const Mat &inputImg,
+                           CoordGrid<HistogramForBlock> &blockMap,
+                           int blockWidth,
+                           int blockHeight,
+                           int superpixelDim,
+                           Mat *paletteIndexMat)
+{
+  const bool dumpOutputImages = isDebugStageImagesEnabled();
+  
+  assert(inputImg.type() == CV_8UC3);
+  assert((superpixelDim * superpixelDim) <= HISTOGRAM_FOR_BLOCK_MAX_PIXELS);
+  assert(SubdividedColors::getInstance().getColors().size() <= 256);
+  
+  if (paletteIndexMat != NULL) {
+    paletteIndexMat->create(inputImg.size(), CV_16UC1);
+  }
+  
+  if (dumpOutputImages) {
+    uint32_t numPixels = inputImg.cols * inputImg.rows;
+    uint32_t *inPixels = new uint32_t[numPixels];
+    uint32_t *outPixels = new uint32_t[numPixels];
+    
+    Mat packedImg;
+    packPixels(inputImg, packedImg);
+    memcpy(inPixels, packedImg.data, numPixels * sizeof(uint32_t));
+    
+    SubdividedColors::getInstance().mapColors(inPixels, numPixels, outPixels);
+    
+    Mat quantMat = dumpQuantImage("block_quant_full_output.png", inputImg, outPixels);
+    
+    delete [] inPixels;
+    delete [] outPixels;
+  }
+  
+  // Allocate Mat where a single quant value is selected for each block. Note that
+  // a block coord is the upper left coord in the block divided by superpixelDim.
+  
+  Mat blockMat = Mat(blockHeight, blockWidth, CV_8UC3);
+  blockMat = (Scalar) 0;
+  
+  blockMap.reset(Rect(0, 0, blockWidth, blockHeight));
+  blockMap.insertAll();
+  
+  if (superpixelDim == 4) {
+    parallelFor(Range(0, blockHeight), BlockHistogramsParallelBody<4>(inputImg, blockMap, blockMat, superpixelDim, paletteIndexMat));
+  } else {
+    parallelFor(Range(0, blockHeight), BlockHistogramsParallelBody<0>(inputImg, blockMap, blockMat, superpixelDim, paletteIndexMat));
+  }
+  
   if (dumpOutputImages) {
     char *filename = (char*) "block_quant_output.png";
-    imwrite(filename, blockMat);
+    debugImwrite(filename, blockMat);
     cout << "wrote " << filename << endl;
   }
   
-  delete [] colortable;
-  delete [] inPixels;
-  delete [] outPixels;
-  
   return blockMat;
 }
 
+RegionPixels::RegionPixels(const Mat &_image, const vector<Coord> &_coords, const Mat *_paletteIndexMat)
+: image(_image), coords(_coords), paletteIndexMat(_paletteIndexMat), hasPixels(false), hasPixelCounts(false), hasPalettePixels(false)
+{
+}
+
+size_t RegionPixels::size() const
+{
+  return coords.size();
+}
+
+const vector<uint32_t>& RegionPixels::getPixels()
+{
+  if (!hasPixels) {
+    pixels.resize(coords.size());
+    
+    if (!coords.empty()) {
+      gatherPixels(image, coords, pixels.data());
+    }
+    
+    hasPixels = true;
+  }
+  
+  return pixels;
+}
+
+const unordered_map<uint32_t, uint32_t>& RegionPixels::getPixelCounts()
+{
+  if (!hasPixelCounts) {
+    for ( uint32_t pixel : getPixels() ) {
+      pixelCounts[pixel] += 1;
+    }
+    
+    hasPixelCounts = true;
+  }
+  
+  return pixelCounts;
+}
+
+// The palette offsets of the whole image are read by coord when they were
+// already generated, otherwise each region pixel is mapped.
+
+const vector<uint32_t>& RegionPixels::getPalettePixels()
+{
+  if (!hasPalettePixels) {
+    palettePixels.resize(coords.size());
+    
+    if (paletteIndexMat != NULL && !paletteIndexMat->empty()) {
+      assert(paletteIndexMat->type() == CV_16UC1 && paletteIndexMat->size() == image.size());
+      
+      const vector<uint32_t> &subdividedColors = SubdividedColors::getInstance().getColors();
+      
+      for ( int i = 0; i < (int) coords.size(); i++ ) {
+        Coord c = coords[i];
+        palettePixels[i] = subdividedColors[paletteIndexMat->ptr<uint16_t>(c.y)[c.x]] & 0x00FFFFFF;
+      }
+    } else if (!coords.empty()) {
+      SubdividedColors::getInstance().mapColors(getPixels().data(), (uint32_t) coords.size(), palettePixels.data());
+    }
+    
+    hasPalettePixels = true;
+  }
+  
+  return palettePixels;
+}
+
+const RegionPixelsQuant& RegionPixels::getQuant(uint32_t numClusters)
+{
+  return getQuant(numClusters, vector<uint32_t>(), 0.0);
+}
+
+const RegionPixelsQuant& RegionPixels::getQuant(uint32_t numClusters, const vector<uint32_t> &seedColortable, double maxSeedMSE)
+{
+  for ( const RegionPixelsQuant &quant : quants ) {
+    if (quant.numClusters == numClusters) {
+      return quant;
+    }
+  }
+  
+  const vector<uint32_t> &inPixels = getPixels();
+  
+  quants.push_back(RegionPixelsQuant());
+  RegionPixelsQuant &quant = quants.back();
+  
+  quant.numClusters = numClusters;
+  quant.colortable.resize(numClusters);
+  quant.quantPixels.resize(inPixels.size());
+  quant.seeded = false;
+  
+  uint32_t numActualClusters = numClusters;
+  
+  int allPixelsUnique = 0;
+  
+  if (inPixels.empty()) {
+    numActualClusters = 0;
+  } else if (seedColortable.empty()) {
+    quant_recurse((uint32_t) inPixels.size(), inPixels.data(), quant.quantPixels.data(), &numActualClusters, quant.colortable.data(), allPixelsUnique );
+  } else {
+    QuantSeedStats seedStats;
+    
+    quant_recurse_seeded((uint32_t) inPixels.size(), inPixels.data(), quant.quantPixels.data(), &numActualClusters, quant.colortable.data(), allPixelsUnique,
+                         seedColortable.data(), (uint32_t) seedColortable.size(), maxSeedMSE, &seedStats);
+    
+    quant.seeded = (seedStats.seeded != 0);
+  }
+  
+  quant.colortable.resize(numActualClusters);
+  
+  return quant;
+}
+
+void RegionPixels::quantBatch(const vector<RegionPixels*> &regions, uint32_t numClusters)
+{
+  vector<QuantBatchJob> jobs;
+  vector<RegionPixelsQuant*> jobQuants;
+  
+  jobs.reserve(regions.size());
+  jobQuants.reserve(regions.size());
+  
+  for ( RegionPixels *regionPtr : regions ) {
+    bool found = false;
+    
+    for ( const RegionPixelsQuant &quant : regionPtr->quants ) {
+      if (quant.numClusters == numClusters) {
+        found = true;
+        break;
+      }
+    }
+    
+    // The region pixels are gathered on this thread before the jobs start
+    
+    const vector<uint32_t> &inPixels = regionPtr->getPixels();
+    
+    if (found || inPixels.empty()) {
+      continue;
+    }
+    
+    regionPtr->quants.push_back(RegionPixelsQuant());
+    RegionPixelsQuant &quant = regionPtr->quants.back();
+    
+    quant.numClusters = numClusters;
+    quant.colortable.resize(numClusters);
+    quant.quantPixels.resize(inPixels.size());
+    quant.seeded = false;
+    
+    QuantBatchJob job;
+    job.numPixels = (uint32_t) inPixels.size();
+    job.inPixelsPtr = inPixels.data();
+    job.outPixelsPtr = quant.quantPixels.data();
+    job.numClusters = numClusters;
+    job.outColortablePtr = quant.colortable.data();
+    job.allPixelsUnique = 0;
+    
+    jobs.push_back(job);
+    jobQuants.push_back(&quant);
+  }
+  
+  quant_recurse_batch(jobs.data(), (uint32_t) jobs.size());
+  
+  for ( int i = 0; i < (int) jobs.size(); i++ ) {
+    jobQuants[i]->colortable.resize(jobs[i].numClusters);
+  }
+}
+
 // Given input pixels and a range of coordinates (gathered from a region mask), determine
 // a quant table that gives good quant results. This estimation determines the number of
 // pixels and the actual cluster centers for different cases.
@@ -583,10 +1355,21 @@ bool
 estimateClusterCenters(const Mat & inputImg,
                        int32_t tag,
                        const vector<Coord> &regionCoords,
+                       vector<uint32_t> &clusterCenters,
+                       const Mat *paletteIndexMat)
+{
+  RegionPixels regionPixels(inputImg, regionCoords, paletteIndexMat);
+  return estimateClusterCenters(inputImg, tag, regionPixels, clusterCenters);
+}
+
+bool
+estimateClusterCenters(const Mat & inputImg,
+                       int32_t tag,
+                       RegionPixels &regionPixels,
                        vector<uint32_t> &clusterCenters)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   bool isVeryClose = false;
   
@@ -596,53 +1379,34 @@ estimateClusterCenters(const Mat & inputImg,
   
   // Quant to evenly spaced grid to get estimate for number of clusters N
   
-  vector<uint32_t> subdividedColors = getSubdividedColors();
+  const vector<uint32_t> &subdividedColors = SubdividedColors::getInstance().getColors();
   
   uint32_t numColors = (uint32_t) subdividedColors.size();
-  uint32_t *colortable = new uint32_t[numColors];
-  
-  {
-    int i = 0;
-    for ( uint32_t color : subdividedColors ) {
-      colortable[i++] = color;
-    }
-  }
   
-  // Copy input pixels into array that can be passed to map_colors_mps()
+  const vector<Coord> &regionCoords = regionPixels.getCoords();
   
   uint32_t numPixels = (uint32_t)regionCoords.size();
-  uint32_t *inPixels = new uint32_t[numPixels];
-  uint32_t *outPixels = new uint32_t[numPixels];
-  
-  for ( int i = 0; i < numPixels; i++ ) {
-    Coord c = regionCoords[i];
-    Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
-    uint32_t pixel = Vec3BToUID(vec);
-    inPixels[i] = pixel;
-  }
-  
-  map_colors_mps(inPixels, numPixels, outPixels, colortable, numColors);
-  
-  // Count each quant pixel in outPixels
-  
-  Mat countMat(1, numPixels, CV_8UC3);
-  
-  for (int i = 0; i < numPixels; i++) {
-    uint32_t pixel = outPixels[i];
-    Vec3b vec = PixelToVec3b(pixel);
-    countMat.at<Vec3b>(0, i) = vec;
-  }
   
-  unordered_map<uint32_t, uint32_t> outPixelToCountTable;
+  const vector<uint32_t> &inPixels = regionPixels.getPixels();
+  const vector<uint32_t> &outPixels = regionPixels.getPalettePixels();
   
-  generatePixelHistogram(countMat, outPixelToCountTable);
+  // Count each quant pixel in outPixels, the quant pixels are palette entries so
+  // the counts are indexed by palette offset.
   
   if (debug) {
-    for ( auto it = begin(outPixelToCountTable); it != end(outPixelToCountTable); ++it) {
-      uint32_t pixel = it->first;
-      uint32_t count = it->second;
+    vector<uint32_t> paletteCounts(numColors, 0);
+    
+    for (int i = 0; i < (int) numPixels; i++) {
+      paletteCounts[SubdividedColors::getInstance().lookupIndex(outPixels[i])] += 1;
+    }
+    
+    for (int i = 0; i < (int) numColors; i++) {
+      uint32_t count = paletteCounts[i];
       
-      printf("count table[0x%08X] = %6d\n", pixel, count);
+      if (count > 0) {
+        uint32_t pixel = subdividedColors[i] & 0x00FFFFFF;
+        printf("count table[0x%08X] = %6d\n", pixel, count);
+      }
     }
   }
   
@@ -665,17 +1429,12 @@ estimateClusterCenters(const Mat & inputImg,
       fnameStream << "srm" << "_tag_" << tag << "_quant_est_output" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
     }
 
     {
-      vector<uint32_t> colortableVec;
-      
-      for (int i = 0; i < numColors; i++) {
-        uint32_t pixel = colortable[i];
-        colortableVec.push_back(pixel);
-      }
+      vector<uint32_t> colortableVec(subdividedColors);
       
       // Add phony entry for Red (the mask color)
       colortableVec.push_back(0x00FF0000);
@@ -687,7 +1446,7 @@ estimateClusterCenters(const Mat & inputImg,
         fnameStream << "srm" << "_tag_" << tag << "_quant_est_offsets" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, quantOffsetsMat);
+        debugImwrite(fname, quantOffsetsMat);
         cout << "wrote " << fname << endl;
       }
     }
@@ -699,14 +1458,9 @@ estimateClusterCenters(const Mat & inputImg,
   // total pixels and the total number of quant pixels is the
   // same as the number of unique original original pixels.
   
-  unordered_map<uint32_t, uint32_t> inUniqueTable;
+  const unordered_map<uint32_t, uint32_t> &inUniqueTable = regionPixels.getPixelCounts();
   unordered_map<uint32_t, uint32_t> outUniqueTable;
   
-  for ( int i = 0; i < numPixels; i++ ) {
-    uint32_t pixel = inPixels[i];
-    inUniqueTable[pixel] += 1;
-  }
-  
   for ( int i = 0; i < numPixels; i++ ) {
     uint32_t pixel = outPixels[i];
     outUniqueTable[pixel] += 1;
@@ -751,11 +1505,9 @@ estimateClusterCenters(const Mat & inputImg,
     // Generate a clustering using the estimated number of clusters found by doing
     // the quant to an evenly spaced grid.
     
-    uint32_t numActualClusters = numColors;
+    const RegionPixelsQuant &quant = regionPixels.getQuant(numColors);
     
-    int allPixelsUnique = 0;
-    
-    quant_recurse(numPixels, inPixels, outPixels, &numActualClusters, colortable, allPixelsUnique );
+    const vector<uint32_t> &quantPixels = quant.quantPixels;
     
     if (debugDumpImages) {
       Mat tmpResultImg = inputImg.clone();
@@ -763,7 +1515,7 @@ estimateClusterCenters(const Mat & inputImg,
       
       for ( int i = 0; i < numPixels; i++ ) {
         Coord c = regionCoords[i];
-        uint32_t pixel = outPixels[i];
+        uint32_t pixel = quantPixels[i];
         Vec3b vec = PixelToVec3b(pixel);
         tmpResultImg.at<Vec3b>(c.y, c.x) = vec;
       }
@@ -772,7 +1524,7 @@ estimateClusterCenters(const Mat & inputImg,
       fnameStream << "srm" << "_tag_" << tag << "_quant_est2_output" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -784,14 +1536,14 @@ estimateClusterCenters(const Mat & inputImg,
       fnameStream << "srm" << "_tag_" << tag << "_quant_est2_table" << ".png";
       string fname = fnameStream.str();
       
-      dumpQuantTableImage(fname, inputImg, colortable, numActualClusters);
+      dumpQuantTableImage(fname, inputImg, quant.colortable.data(), (uint32_t) quant.colortable.size());
     }
     
     unordered_map<uint32_t, uint32_t> inToOutTable;
     
     for ( int i = 0; i < numPixels; i++ ) {
       uint32_t inPixel = inPixels[i];
-      uint32_t outPixel = outPixels[i];
+      uint32_t outPixel = quantPixels[i];
       inToOutTable[inPixel] = outPixel;
     }
     
@@ -836,38 +1588,104 @@ estimateClusterCenters(const Mat & inputImg,
     
   } // end doClustering if block
   
-  delete [] colortable;
-  delete [] inPixels;
-  delete [] outPixels;
-  
   return isVeryClose;
 }
 
-// Morph the "region mask", this is basically a way to expand the 2D region around the shape
-// in a way that should capture pixels around the superpixel.
+uint64_t ShapeBoundsGeometryCache::makeKey(int32_t tag, const vector<Coord> &regionCoords)
+{
+  uint32_t hash = my_adler32(1, (unsigned char const *) regionCoords.data(), (uint32_t) (regionCoords.size() * sizeof(Coord)), 0);
+  return (((uint64_t) (uint32_t) tag) << 32) | hash;
+}
 
-void
-morphRegionMask(const Mat & inputImg,
+std::shared_ptr<const ShapeBoundsGeometry> ShapeBoundsGeometryCache::lookup(int32_t tag, cv::Size imageSize, const vector<Coord> &regionCoords)
+{
+  uint64_t key = makeKey(tag, regionCoords);
+  
+  std::lock_guard<std::mutex> lock(mutex);
+  
+  auto it = geometries.find(key);
+  
+  if (it == geometries.end() || it->second->numCoords != regionCoords.size() || it->second->imageSize != imageSize) {
+    return std::shared_ptr<const ShapeBoundsGeometry>();
+  }
+  
+  return it->second;
+}
+
+void ShapeBoundsGeometryCache::insert(int32_t tag, const vector<Coord> &regionCoords, std::shared_ptr<ShapeBoundsGeometry> geometry)
+{
+  uint64_t key = makeKey(tag, regionCoords);
+  
+  geometry->numCoords = (uint32_t) regionCoords.size();
+  
+  std::lock_guard<std::mutex> lock(mutex);
+  
+  geometries[key] = geometry;
+}
+
+size_t ShapeBoundsGeometryCache::size()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return geometries.size();
+}
+
+void ShapeBoundsGeometryCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  geometries.clear();
+}
+
+// Number of blocks a region is expanded by in morphRegionMask()
+
+static std::atomic<int> captureRegionExpandBlocks(2);
+
+void setCaptureRegionExpandBlocks(int numBlocks)
+{
+  captureRegionExpandBlocks = (numBlocks < 1) ? 1 : numBlocks;
+}
+
+int getCaptureRegionExpandBlocks()
+{
+  return captureRegionExpandBlocks;
+}
+
+// Morph the "region mask", this is basically a way to expand the 2D region around the shape
+// in a way that should capture pixels around the superpixel. All of the regionCoords are
+// inside the expandedRoi bbox.
+
+void
+morphRegionMask(const Mat & inputImg,
                 int32_t tag,
                 const vector<Coord> &coords,
                 int blockWidth,
                 int blockHeight,
                 int superpixelDim,
-                vector<Coord> &regionCoords)
+                vector<Coord> &regionCoords,
+                Rect &expandedRoi)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "morphRegionMask" << endl;
   }
   
-  Mat expandedBlockMat = expandBlockRegion(tag, coords, 2, blockWidth, blockHeight, superpixelDim);
+  Rect blockRoi;
+  Mat expandedBlockMat = expandBlockRegion(tag, coords, getCaptureRegionExpandBlocks(), blockWidth, blockHeight, superpixelDim, &blockRoi);
   
-  // Map morph blocks back to rectangular ROI in original image and extract ROI
+  // Map morph blocks back to rectangular ROI in original image and extract ROI,
+  // only the blocks inside blockRoi can be white.
   
   vector<Point> locations;
-  findNonZero(expandedBlockMat, locations);
+  
+  if (blockRoi.area() > 0) {
+    findNonZero(expandedBlockMat(blockRoi), locations);
+    
+    for ( Point &p : locations ) {
+      p.x += blockRoi.x;
+      p.y += blockRoi.y;
+    }
+  }
   
   vector<Coord> minMaxCoords;
   
@@ -892,7 +1710,7 @@ morphRegionMask(const Mat & inputImg,
   
   int32_t originX, originY, width, height;
   bbox(originX, originY, width, height, minMaxCoords);
-  Rect expandedRoi(originX, originY, width, height);
+  expandedRoi = Rect(originX, originY, width, height);
   
   if (debugDumpImages) {
     Mat roiInputMat = inputImg(expandedRoi);
@@ -901,7 +1719,7 @@ morphRegionMask(const Mat & inputImg,
     fnameStream << "srm" << "_tag_" << tag << "_morph_block_input" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, roiInputMat);
+    debugImwrite(fname, roiInputMat);
     cout << "wrote " << fname << endl;
   }
   
@@ -939,7 +1757,7 @@ morphRegionMask(const Mat & inputImg,
     fnameStream << "srm" << "_tag_" << tag << "_morph_block_bw" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, tmpExpandedBlockMat);
+    debugImwrite(fname, tmpExpandedBlockMat);
     cout << "wrote " << fname << endl;
   }
   
@@ -992,7 +1810,7 @@ morphRegionMask(const Mat & inputImg,
       fnameStream << "srm" << "_tag_" << tag << "_morph_masked_input" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
     }
   }
@@ -1017,7 +1835,7 @@ morphRegionMask(const Mat & inputImg,
       fnameStream << "srm" << "_tag_" << tag << "_morph_alpha_input" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
     }
   }
@@ -1029,10 +1847,209 @@ morphRegionMask(const Mat & inputImg,
   return;
 }
 
+// A region contained in only a single block is not captured by itself
+
+static inline
+bool isCaptureRegionTooSmall(const vector<Coord> &coords, int superpixelDim)
+{
+  return (coords.size() <= (size_t) ((superpixelDim*superpixelDim) >> 1));
+}
+
+static std::atomic<int> smallCaptureRegionMaxCoords(256);
+
+void setSmallCaptureRegionMaxCoords(int maxCoords)
+{
+  smallCaptureRegionMaxCoords = maxCoords;
+}
+
+int getSmallCaptureRegionMaxCoords()
+{
+  return smallCaptureRegionMaxCoords;
+}
+
+// A small region is distinct from a neighbor when the distance between the mean
+// colors is at least smallCaptureMinMeanDelta and at least smallCaptureMinZScore
+// times the combined stddev of the two regions.
+
+static const float smallCaptureMinMeanDelta = 16.0f;
+static const float smallCaptureMinZScore = 2.0f;
+
+static inline
+float sumOfChannels(const Vec3f &vec)
+{
+  return vec[0] + vec[1] + vec[2];
+}
+
+// Capture a small region with the color stats of the region and its neighbors
+// instead of the morphology, quant and shape analysis of captureRegion(). A
+// region whose mean color is distinct from every neighbor is captured as the
+// pixels of the region that are not already merged. A region that is close to
+// a neighbor is not captured, so that the pixels are taken by the capture of
+// a larger neighbor or are merged as leftovers. Only the mergedMask pixels of
+// the region coords are read, the mask is set to the bbox of the pixels.
+
+static
+bool captureSmallRegionWithStats(SuperpixelImage &spImage,
+                                 int32_t tag,
+                                 const Mat &mergedMask,
+                                 RegionMask &mask)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+  
+  Vec3f mean, variance;
+  
+  bool worked = spPtr->colorMeanAndVariance(mean, variance);
+  assert(worked);
+  
+  for ( int32_t neighborTag : spImage.edgeTable.getNeighborsSet(tag) ) {
+    Superpixel *neighborPtr = spImage.getSuperpixelPtr(neighborTag);
+    
+    Vec3f neighborMean, neighborVariance;
+    
+    if (neighborPtr == NULL || !neighborPtr->colorMeanAndVariance(neighborMean, neighborVariance)) {
+      continue;
+    }
+    
+    Vec3f delta = mean - neighborMean;
+    float deltaSq = delta.dot(delta);
+    float varianceSum = sumOfChannels(variance) + sumOfChannels(neighborVariance);
+    
+    if (deltaSq < (smallCaptureMinMeanDelta * smallCaptureMinMeanDelta) ||
+        deltaSq < (smallCaptureMinZScore * smallCaptureMinZScore) * varianceSum) {
+      if (debug) {
+        cout << "captureSmallRegionWithStats : tag " << tag << " is close to neighbor " << neighborTag << " with mean delta " << sqrt(deltaSq) << endl;
+      }
+      
+      return false;
+    }
+  }
+  
+  // Collect the unmerged pixels before the mask is cleared
+  
+  vector<Coord> regionCoords;
+  regionCoords.reserve(spPtr->coords.size());
+  
+  spPtr->coords.forEachRun([&](const CoordRun &run) {
+    const uint8_t *maskPtr = mergedMask.ptr<uint8_t>(run.y) + run.x;
+    
+    for ( int j = 0; j < run.length; j++ ) {
+      if (maskPtr[j] == 0) {
+        regionCoords.push_back(Coord((int) (run.x + j), (int) run.y));
+      }
+    }
+  });
+  
+  if (regionCoords.empty()) {
+    return false;
+  }
+  
+  mask.reset(CoordBitSet::boundsOf(regionCoords));
+  
+  for ( Coord c : regionCoords ) {
+    mask.set(c);
+  }
+  
+  if (debug) {
+    cout << "captureSmallRegionWithStats : tag " << tag << " captured " << regionCoords.size() << " distinct pixels" << endl;
+  }
+  
+  return true;
+}
+
+static std::atomic<float> homogeneousCaptureMaxVariance(12.0f);
+
+void setHomogeneousCaptureMaxVariance(float maxVariance)
+{
+  homogeneousCaptureMaxVariance = maxVariance;
+}
+
+float getHomogeneousCaptureMaxVariance()
+{
+  return homogeneousCaptureMaxVariance;
+}
+
+// A pixel is inside a homogeneous region when its distance to the mean color
+// of the region is at most homogeneousCaptureMaxDelta.
+
+static const float homogeneousCaptureMaxDelta = 16.0f;
+
+// True when the cached color stats show the region is flat, mean is set to
+// the mean color of the region. A region that was found to be all the same
+// pixel does not need the stats.
+
+static
+bool isHomogeneousCaptureRegion(Superpixel *spPtr, Vec3f &mean)
+{
+  const float maxVariance = getHomogeneousCaptureMaxVariance();
+  
+  if (maxVariance <= 0.0f) {
+    return false;
+  }
+  
+  Vec3f variance;
+  
+  if (!spPtr->colorMeanAndVariance(mean, variance)) {
+    return false;
+  }
+  
+  return spPtr->isAllSame() || sumOfChannels(variance) <= maxVariance;
+}
+
+// Capture a flat region as the expanded region pixels that are close to the
+// mean color instead of the quant, peak detection, inside/outside and hull
+// scans of captureRegion(), which would all find the one color. The
+// regionCoords are the unmerged pixels of the expanded region, the mask is
+// set to the bbox of the captured pixels.
+
+static
+bool captureHomogeneousRegion(const Mat &inputImg,
+                              int32_t tag,
+                              const vector<Coord> &regionCoords,
+                              const Vec3f &mean,
+                              RegionMask &mask)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  const float maxDeltaSq = homogeneousCaptureMaxDelta * homogeneousCaptureMaxDelta;
+  
+  vector<Coord> insideCoords;
+  insideCoords.reserve(regionCoords.size());
+  
+  for ( Coord c : regionCoords ) {
+    const Vec3b &vec = inputImg.at<Vec3b>(c.y, c.x);
+    
+    const float dB = vec[0] - mean[0];
+    const float dG = vec[1] - mean[1];
+    const float dR = vec[2] - mean[2];
+    
+    if (((dB * dB) + (dG * dG) + (dR * dR)) <= maxDeltaSq) {
+      insideCoords.push_back(c);
+    }
+  }
+  
+  if (debug) {
+    cout << "captureHomogeneousRegion : tag " << tag << " captured " << insideCoords.size() << " of " << regionCoords.size() << " expanded pixels" << endl;
+  }
+  
+  if (insideCoords.empty()) {
+    return false;
+  }
+  
+  mask.reset(CoordBitSet::boundsOf(insideCoords));
+  
+  for ( Coord c : insideCoords ) {
+    mask.set(c);
+  }
+  
+  return true;
+}
+
 // Given a tag indicating a superpixel generate a mask that captures the region in terms of
-// exact pixels. On input, the mask contains either 0x0 or 0xFF to indicate if a given
-// pixel was already consumed by a previous merge process. On return, the mask should contain
-// 0xFF for pixels that are known to be inside the region.
+// exact pixels. The mergedMask contains either 0x0 or 0xFF to indicate if a given pixel was
+// already consumed by a previous merge process and is only read. On return, the mask covers
+// the bbox of the capture and contains 0xFF for pixels that are known to be inside the region.
 
 bool
 captureRegionMask(SuperpixelImage &spImage,
@@ -1042,23 +2059,27 @@ captureRegionMask(SuperpixelImage &spImage,
                   int blockWidth,
                   int blockHeight,
                   int superpixelDim,
-                  Mat &mask,
-                  const Mat &blockBasedQuantMat)
+                  const Mat &mergedMask,
+                  RegionMask &mask,
+                  const Mat &blockBasedQuantMat,
+                  ShapeBoundsGeometryCache *geometryCache)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "captureRegionMask" << endl;
   }
   
-  assert(mask.rows == inputImg.rows);
-  assert(mask.cols == inputImg.cols);
-  assert(mask.channels() == 1);
+  assert(mergedMask.rows == inputImg.rows);
+  assert(mergedMask.cols == inputImg.cols);
+  assert(mergedMask.channels() == 1);
   
   auto &coords = spImage.getSuperpixelPtr(tag)->coords;
   
-  if (coords.size() <= ((superpixelDim*superpixelDim) >> 1)) {
+  TraceZone traceZone("captureRegionMask", tag, coords.size());
+  
+  if (isCaptureRegionTooSmall(coords, superpixelDim)) {
     // A region contained in only a single block, don't process by itself
     
     if (debug) {
@@ -1068,41 +2089,49 @@ captureRegionMask(SuperpixelImage &spImage,
     return false;
   }
   
+  // Small regions are captured with the cached color stats when the stats were
+  // set from this image, the full capture logic is only run for larger regions.
+  
+  if ((int) coords.size() < getSmallCaptureRegionMaxCoords() && spImage.colorStatsData == inputImg.data) {
+    TraceZone smallZone("captureSmallRegion", tag, coords.size());
+    
+    return captureSmallRegionWithStats(spImage, tag, mergedMask, mask);
+  }
+  
+  // A flat region skips captureRegion() once the expanded pixels are known
+  
+  Vec3f homogeneousMean;
+  
+  const bool isHomogeneous = (spImage.colorStatsData == inputImg.data) &&
+    isHomogeneousCaptureRegion(spImage.getSuperpixelPtr(tag), homogeneousMean);
+  
   vector<Coord> regionCoords;
+  Rect expandedRoi;
   
-  morphRegionMask(inputImg, tag, coords, blockWidth, blockHeight, superpixelDim, regionCoords);
+  {
+    TraceZone morphZone("morphRegionMask", tag, coords.size());
+    
+    morphRegionMask(inputImg, tag, coords, blockWidth, blockHeight, superpixelDim, regionCoords, expandedRoi);
+  }
   
-  // Remove pixels from regionCoords that are known to be on in the mask. This limits the pixels
-  // found with the region mask so that known regions that have already been processed will not
-  // be included in the regionCoords.
+  // Remove pixels from regionCoords that are known to be on in the merged mask. This limits the
+  // pixels found with the region mask so that known regions that have already been processed will
+  // not be included in the regionCoords. Only the mask pixels inside the expanded ROI are read, so
+  // the cost depends on the size of the region and not the size of the image.
   
   if ((1)) {
-    unordered_map<Coord, bool> regionCoordsMap;
-    
-    for ( Coord c : regionCoords ) {
-      regionCoordsMap[c] = true;
-    }
-    
-    for ( int y = 0; y < mask.rows; y++ ) {
-      for ( int x = 0; x < mask.cols; x++ ) {
-        uint8_t bval = mask.at<uint8_t>(y, x);
-        if (bval != 0) {
-          // Do not consider this coord
-          Coord c(x, y);
-          regionCoordsMap.erase(c);
-        }
-      }
-    }
+    const Mat roiMask = mergedMask(expandedRoi);
     
     vector<Coord> trimRegionCoords;
+    trimRegionCoords.reserve(regionCoords.size());
     
     for ( Coord c : regionCoords ) {
-      if (regionCoordsMap.count(c) > 0) {
+      if (roiMask.at<uint8_t>(c.y - expandedRoi.y, c.x - expandedRoi.x) == 0) {
         trimRegionCoords.push_back(c);
       }
     }
     
-    regionCoords = trimRegionCoords;
+    regionCoords.swap(trimRegionCoords);
     
     if (debugDumpImages) {
       Mat tmpResultImg(inputImg.rows, inputImg.cols, CV_8UC4);
@@ -1126,28 +2155,36 @@ captureRegionMask(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_morph_minus_mask_alpha_input" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
         cout << "";
       }
     }
   }
   
-  // Init mask after possible early return
+  if (isHomogeneous) {
+    TraceZone homogeneousZone("captureHomogeneousRegion", tag, regionCoords.size());
+    
+    return captureHomogeneousRegion(inputImg, tag, regionCoords, homogeneousMean, mask);
+  }
+  
+  // Init mask after possible early return, the region coords are all inside the expanded ROI
   
-  mask = (Scalar) 0;
+  mask.reset(expandedRoi);
   
+//  RegionPixels regionPixels(spImage.getPackedPixels(inputImg), regionCoords);
+//  
 //  vector<uint32_t> estClusterCenters;
 //  
-//  bool isVeryClose = estimateClusterCenters(inputImg, tag, regionCoords, estClusterCenters);
+//  bool isVeryClose = estimateClusterCenters(inputImg, tag, regionPixels, estClusterCenters);
 //  
 //  if (isVeryClose) {
-//    captureVeryCloseRegion(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, mask, regionCoords, coords, (int)estClusterCenters.size());
+//    captureVeryCloseRegion(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, mask, regionPixels, coords, (int)estClusterCenters.size());
 //  } else {
-//    captureNotCloseRegion(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, mask, regionCoords, coords, (int)estClusterCenters.size(), blockBasedQuantMat);
+//    captureNotCloseRegion(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, mask, regionPixels, coords, (int)estClusterCenters.size(), blockBasedQuantMat);
 //  }
   
-  captureRegion(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, mask, regionCoords, coords, blockBasedQuantMat);
+  captureRegion(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, mask, regionCoords, coords, blockBasedQuantMat, geometryCache);
   
   // Capture mask output as alpha pixels
   
@@ -1155,28 +2192,22 @@ captureRegionMask(SuperpixelImage &spImage,
     Mat tmpResultImg(inputImg.rows, inputImg.cols, CV_8UC4);
     tmpResultImg = Scalar(0,0,0,0);
     
-    for ( int y = 0; y < tmpResultImg.rows; y++ ) {
-      for ( int x = 0; x < tmpResultImg.cols; x++ ) {
-        uint8_t isOn = mask.at<uint8_t>(y, x);
-        
-        if (isOn) {
-          Vec3b vec = inputImg.at<Vec3b>(y, x);
-          Vec4b vec4;
-          vec4[0] = vec[0];
-          vec4[1] = vec[1];
-          vec4[2] = vec[2];
-          vec4[3] = 0xFF;
-          tmpResultImg.at<Vec4b>(y, x) = vec4;
-        }
-      }
-    }
+    mask.forEach([&](Coord c) {
+      Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
+      Vec4b vec4;
+      vec4[0] = vec[0];
+      vec4[1] = vec[1];
+      vec4[2] = vec[2];
+      vec4[3] = 0xFF;
+      tmpResultImg.at<Vec4b>(c.y, c.x) = vec4;
+    });
     
     {
       std::stringstream fnameStream;
       fnameStream << "srm" << "_tag_" << tag << "_morph_minus_mask_alpha_output" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -1189,91 +2220,406 @@ captureRegionMask(SuperpixelImage &spImage,
   return true;
 }
 
-// This implementation will examine the bounds of a region after collapsing and then expanding the region back
-// out to discover where the true edges of regions are located.
+// Frame size mask form of captureRegionMask(), on input the mask indicates the pixels
+// that were already merged and on return it contains only the captured pixels.
 
-void
-captureRegion(SuperpixelImage &spImage,
-              const Mat & inputImg,
-              const Mat & srmTags,
-              int32_t tag,
-              int blockWidth,
-              int blockHeight,
-              int superpixelDim,
-              Mat &mask,
-              const vector<Coord> &regionCoords,
-              const vector<Coord> &srmRegionCoords,
-              const Mat &blockBasedQuantMat)
+bool
+captureRegionMask(SuperpixelImage &spImage,
+                  const Mat & inputImg,
+                  const Mat & srmTags,
+                  int32_t tag,
+                  int blockWidth,
+                  int blockHeight,
+                  int superpixelDim,
+                  Mat &mask,
+                  const Mat &blockBasedQuantMat,
+                  ShapeBoundsGeometryCache *geometryCache)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  RegionMask regionMask;
   
-  if (debug) {
-    cout << "captureRegion " << tag << endl;
+  bool written = captureRegionMask(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, mask, regionMask, blockBasedQuantMat, geometryCache);
+  
+  if (written) {
+    mask = (Scalar) 0;
+    regionMask.copyTo(mask);
   }
   
-  // Gather the tags associated with all the regions
-  // indicated by regionCoords.
+  return written;
+}
+
+// The expanded block region of morphRegionMask() is the blocks of the region dilated
+// by getCaptureRegionExpandBlocks() blocks, so the bbox of the expanded region is the block
+// bbox of the region grown by the same number of blocks.
+
+cv::Rect
+captureRegionMaskBounds(SuperpixelImage &spImage,
+                        const Mat & inputImg,
+                        int32_t tag,
+                        int blockWidth,
+                        int blockHeight,
+                        int superpixelDim)
+{
+  auto &coords = spImage.getSuperpixelPtr(tag)->coords;
   
-  vector<int32_t> allRegionTags;
+  if (coords.empty() || isCaptureRegionTooSmall(coords, superpixelDim)) {
+    return cv::Rect();
+  }
   
-  unordered_map<int32_t, int32_t> allRegionTagsMap;
+  // A block coord only grows with the pixel coord, so the block bbox is the
+  // pixel bbox mapped to blocks and no coord is divided.
   
-  for ( Coord c : regionCoords ) {
-    Vec3b vec = srmTags.at<Vec3b>(c.y, c.x);
-    int32_t tag = Vec3BToUID(vec);
-    allRegionTagsMap[tag] = tag;
-  }
-  for ( auto &pair : allRegionTagsMap ) {
-    allRegionTags.push_back(pair.first);
-  }
+  int minX = INT_MAX;
+  int minY = INT_MAX;
+  int maxX = 0;
+  int maxY = 0;
   
-  if (debug) {
-    cout << "allRegionTags:" << endl;
-    for ( int32_t tag : allRegionTags ) {
-      cout << tag << endl;
-    }
-    cout << "";
+  for ( Coord c : coords ) {
+    minX = mini(minX, c.x);
+    minY = mini(minY, c.y);
+    maxX = maxi(maxX, c.x);
+    maxY = maxi(maxY, c.y);
   }
   
-  // How many edge would there be in the expanded regionCoords ?
+  int minBlockX = minX / superpixelDim;
+  int minBlockY = minY / superpixelDim;
+  int maxBlockX = maxX / superpixelDim;
+  int maxBlockY = maxY / superpixelDim;
   
-  vector<SuperpixelEdge> extendedRegionEdges;
+  const int expandBlocks = getCaptureRegionExpandBlocks();
   
-  {
-    vector<SuperpixelEdge> edges = getEdgesInRegion(spImage, srmTags, tag, regionCoords);
-    
-    cout << "getEdgesInRegion returned " << edges.size() << " edges" << endl;
-    
-    for ( SuperpixelEdge edge : edges ) {
-      cout << "edge " << edge << endl;
-    }
-    
-    cout << "";
-    
-    extendedRegionEdges = edges;
-  }
+  minBlockX = max(minBlockX - expandBlocks, 0);
+  minBlockY = max(minBlockY - expandBlocks, 0);
+  maxBlockX = min(maxBlockX + expandBlocks, blockWidth - 1);
+  maxBlockY = min(maxBlockY + expandBlocks, blockHeight - 1);
   
-  if (extendedRegionEdges.size() == 0) {
-    // No edges between regions, this would typically happen when a parent that contains
-    // interior regions has already consumed all the interior region pixels.
-    
-    if (debug) {
-      cout << "captureRegion returned region as mask since zero edges detected for tag " << tag << endl;
-    }
-    
-    for ( Coord c : regionCoords ) {
-      mask.at<uint8_t>(c.y, c.x) = 0xFF;
-    }
+  int originX = minBlockX * superpixelDim;
+  int originY = minBlockY * superpixelDim;
+  int endX = min((maxBlockX + 1) * superpixelDim, inputImg.cols);
+  int endY = min((maxBlockY + 1) * superpixelDim, inputImg.rows);
+  
+  return cv::Rect(originX, originY, endX - originX, endY - originY);
+}
 
-    return;
+// Capture each tag in a wave on a separate thread, each tag writes into its own mask.
+// The debug output level of the calling thread is used by the worker threads.
+
+class CaptureRegionMaskParallelBody : public cv::ParallelLoopBody
+{
+public:
+  CaptureRegionMaskParallelBody(SuperpixelImage &_spImage,
+                                const Mat &_inputImg,
+                                const Mat &_srmTags,
+                                const int32_t *_tags,
+                                int _blockWidth,
+                                int _blockHeight,
+                                int _superpixelDim,
+                                const Mat &_mergedMask,
+                                vector<RegionMask> &_masks,
+                                vector<uint8_t> &_maskWritten,
+                                vector<float> &_captureSeconds,
+                                const Mat &_blockBasedQuantMat,
+                                ShapeBoundsGeometryCache *_geometryCache)
+  : spImage(_spImage), inputImg(_inputImg), srmTags(_srmTags), tags(_tags),
+  blockWidth(_blockWidth), blockHeight(_blockHeight), superpixelDim(_superpixelDim),
+  mergedMask(_mergedMask), masks(_masks), maskWritten(_maskWritten), captureSeconds(_captureSeconds),
+  blockBasedQuantMat(_blockBasedQuantMat),
+  geometryCache(_geometryCache), debugOutputLevel(getDebugOutputLevel())
+  {
   }
   
-  // At the start of a region identification operation, a rough estimate of the region bounds is available
-  // but the contracted or expanded bounds are not known. Scan clockwise to determine likely bounds based
+  void operator()(const cv::Range& range) const {
+    DebugOutputLevel prevDebugOutputLevel = getDebugOutputLevel();
+    setDebugOutputLevel(debugOutputLevel);
+    
+    // The DivQuant threads follow the parallel loop threads, which is one thread in a stripe
+    
+    int prevQuantThreads = quant_get_num_threads();
+    quant_set_num_threads(getParallelThreads());
+    
+    for ( int i = range.start; i < range.end; i++ ) {
+      auto startTime = std::chrono::steady_clock::now();
+      maskWritten[i] = captureRegionMask(spImage, inputImg, srmTags, tags[i], blockWidth, blockHeight, superpixelDim, mergedMask, masks[i], blockBasedQuantMat, geometryCache);
+      captureSeconds[i] = std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+    }
+    
+    quant_set_num_threads(prevQuantThreads);
+    setDebugOutputLevel(prevDebugOutputLevel);
+  }
+  
+private:
+  SuperpixelImage &spImage;
+  const Mat &inputImg;
+  const Mat &srmTags;
+  const int32_t *tags;
+  int blockWidth;
+  int blockHeight;
+  int superpixelDim;
+  const Mat &mergedMask;
+  vector<RegionMask> &masks;
+  vector<uint8_t> &maskWritten;
+  vector<float> &captureSeconds;
+  const Mat &blockBasedQuantMat;
+  ShapeBoundsGeometryCache *geometryCache;
+  DebugOutputLevel debugOutputLevel;
+};
+
+// A wave is a run of tags in the original order where no two mask bounds overlap, so a
+// tag in a wave reads the same mask pixels it would read after the earlier tags in the
+// wave were merged, unless an earlier tag merged pixels outside of its own bounds.
+
+int
+captureRegionMasks(SuperpixelImage &spImage,
+                   const Mat & inputImg,
+                   const Mat & srmTags,
+                   const vector<int32_t> &tags,
+                   int blockWidth,
+                   int blockHeight,
+                   int superpixelDim,
+                   RegionRemerger &remerger,
+                   const Mat &blockBasedQuantMat,
+                   std::function<void(int32_t tag, const RegionMask &mask)> mergedFunc,
+                   std::chrono::steady_clock::time_point deadline,
+                   vector<float> *tagSeconds)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  const int maxWaveSize = max(1, getNumThreads()) * 2;
+  
+  const int numTags = (int) tags.size();
+  
+  vector<cv::Rect> bounds;
+  bounds.reserve(numTags);
+  
+  for ( int32_t tag : tags ) {
+    bounds.push_back(captureRegionMaskBounds(spImage, inputImg, tag, blockWidth, blockHeight, superpixelDim));
+  }
+  
+  // The capture threads share the packed pixels, so pack the image before the first wave
+  
+  spImage.getPackedPixels(inputImg);
+  
+  // Small regions are captured with the color stats of each superpixel, the stats
+  // are read from the pixels once here instead of on each capture thread.
+  
+  if (getSmallCaptureRegionMaxCoords() > 0 && spImage.colorStatsData != inputImg.data) {
+    spImage.setColorStats((Mat &) inputImg);
+  }
+  
+  // The masks are reused by each wave, each one only covers the bbox of its capture
+  
+  vector<RegionMask> masks(maxWaveSize);
+  vector<uint8_t> maskWritten(maxWaveSize);
+  vector<float> captureSeconds(maxWaveSize);
+  
+  if (tagSeconds != NULL) {
+    tagSeconds->assign(numTags, 0.0f);
+  }
+  
+  vector<cv::Rect> mergedBounds;
+  
+  // A tag captured again after a merge reuses the shape geometry from the wave
+  
+  ShapeBoundsGeometryCache geometryCache;
+  
+  int waveStart = 0;
+  
+  while (waveStart < numTags) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      if (debug) {
+        cout << "capture deadline passed with " << (numTags - waveStart) << " of " << numTags << " tags not captured" << endl;
+      }
+      break;
+    }
+    
+    int waveEnd = waveStart + 1;
+    
+    while (waveEnd < numTags && (waveEnd - waveStart) < maxWaveSize) {
+      bool overlaps = false;
+      for ( int i = waveStart; i < waveEnd; i++ ) {
+        if ((bounds[i] & bounds[waveEnd]).area() > 0) {
+          overlaps = true;
+          break;
+        }
+      }
+      if (overlaps) {
+        break;
+      }
+      waveEnd += 1;
+    }
+    
+    const int waveSize = waveEnd - waveStart;
+    
+    if (debug) {
+      cout << "capture wave of " << waveSize << " tags starting at offset " << waveStart << endl;
+    }
+    
+    // The size of a wave zone is the number of tags in the wave
+    
+    TraceZone traceZone("captureWave", -1, waveSize);
+    
+    // The merged mask is only read by the wave, pixels are merged after every tag returns
+    
+    CaptureRegionMaskParallelBody body(spImage, inputImg, srmTags, &tags[waveStart], blockWidth, blockHeight, superpixelDim, remerger.mergedMask, masks, maskWritten, captureSeconds, blockBasedQuantMat, &geometryCache);
+    
+    if (waveSize == 1) {
+      body(cv::Range(0, 1));
+    } else {
+      parallelFor(cv::Range(0, waveSize), body);
+    }
+    
+    // Merge in the original order, a tag whose bounds contain pixels merged by an
+    // earlier tag in this wave is captured again from the updated mask.
+    
+    mergedBounds.clear();
+    
+    for ( int i = 0; i < waveSize; i++ ) {
+      int32_t tag = tags[waveStart + i];
+      const cv::Rect &tagBounds = bounds[waveStart + i];
+      
+      bool conflict = false;
+      
+      for ( const cv::Rect &rect : mergedBounds ) {
+        if ((rect & tagBounds).area() > 0) {
+          conflict = true;
+          break;
+        }
+      }
+      
+      bool written;
+      
+      if (conflict) {
+        if (debug) {
+          cout << "capture tag " << tag << " again since pixels were merged inside its bounds" << endl;
+        }
+        
+        auto startTime = std::chrono::steady_clock::now();
+        written = captureRegionMask(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, remerger.mergedMask, masks[i], blockBasedQuantMat, &geometryCache);
+        captureSeconds[i] += std::chrono::duration<float>(std::chrono::steady_clock::now() - startTime).count();
+      } else {
+        written = (maskWritten[i] != 0);
+      }
+      
+      if (written) {
+        mergedBounds.push_back(remerger.mergeFromMask(masks[i]));
+        
+        if (mergedFunc) {
+          mergedFunc(tag, masks[i]);
+        }
+      }
+      
+      if (tagSeconds != NULL) {
+        (*tagSeconds)[waveStart + i] = captureSeconds[i];
+      }
+    }
+    
+    waveStart = waveEnd;
+  }
+  
+  return waveStart;
+}
+
+// Set the block of each coord in a block grid mask, see BlockGridCoord
+
+template <int BlockDim>
+static
+void setBlockMaskForCoords(const vector<Coord> &coords, int superpixelDim, Mat &blockMaskMat)
+{
+  for ( Coord c : coords ) {
+    int blockX = BlockGridCoord<BlockDim>::toBlock(c.x, superpixelDim);
+    int blockY = BlockGridCoord<BlockDim>::toBlock(c.y, superpixelDim);
+    
+    blockMaskMat.at<uint8_t>(blockY, blockX) = 0xFF;
+  }
+}
+
+// This implementation will examine the bounds of a region after collapsing and then expanding the region back
+// out to discover where the true edges of regions are located.
+
+void
+captureRegion(SuperpixelImage &spImage,
+              const Mat & inputImg,
+              const Mat & srmTags,
+              int32_t tag,
+              int blockWidth,
+              int blockHeight,
+              int superpixelDim,
+              RegionMask &mask,
+              const vector<Coord> &regionCoords,
+              const vector<Coord> &srmRegionCoords,
+              const Mat &blockBasedQuantMat,
+              ShapeBoundsGeometryCache *geometryCache)
+{
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
+  
+  if (debug) {
+    cout << "captureRegion " << tag << endl;
+  }
+  
+  TraceZone traceZone("captureRegion", tag, regionCoords.size());
+  
+  // Gather the tags associated with all the regions
+  // indicated by regionCoords.
+  
+  vector<int32_t> allRegionTags;
+  
+  unordered_map<int32_t, int32_t> allRegionTagsMap;
+  
+  for ( Coord c : regionCoords ) {
+    Vec3b vec = srmTags.at<Vec3b>(c.y, c.x);
+    int32_t tag = Vec3BToUID(vec);
+    allRegionTagsMap[tag] = tag;
+  }
+  for ( auto &pair : allRegionTagsMap ) {
+    allRegionTags.push_back(pair.first);
+  }
+  
+  if (debug) {
+    cout << "allRegionTags:" << endl;
+    for ( int32_t tag : allRegionTags ) {
+      cout << tag << endl;
+    }
+    cout << "";
+  }
+  
+  // How many edge would there be in the expanded regionCoords ?
+  
+  vector<SuperpixelEdge> extendedRegionEdges;
+  
+  {
+    vector<SuperpixelEdge> edges = getEdgesInRegion(spImage, srmTags, tag, regionCoords);
+    
+    cout << "getEdgesInRegion returned " << edges.size() << " edges" << endl;
+    
+    for ( SuperpixelEdge edge : edges ) {
+      cout << "edge " << edge << endl;
+    }
+    
+    cout << "";
+    
+    extendedRegionEdges = edges;
+  }
+  
+  if (extendedRegionEdges.size() == 0) {
+    // No edges between regions, this would typically happen when a parent that contains
+    // interior regions has already consumed all the interior region pixels.
+    
+    if (debug) {
+      cout << "captureRegion returned region as mask since zero edges detected for tag " << tag << endl;
+    }
+    
+    for ( Coord c : regionCoords ) {
+      mask.set(c);
+    }
+
+    return;
+  }
+  
+  // At the start of a region identification operation, a rough estimate of the region bounds is available
+  // but the contracted or expanded bounds are not known. Scan clockwise to determine likely bounds based
   // on the initial region shape.
   
-  clockwiseScanForShapeBounds(inputImg, srmTags, tag, srmRegionCoords, mask);
+  clockwiseScanForShapeBounds(inputImg, srmTags, tag, srmRegionCoords, mask.mat(), geometryCache);
   
   /*
    
@@ -1502,13 +2848,10 @@ captureRegion(SuperpixelImage &spImage,
   Mat blockMaskMat(blockBasedQuantMat.size(), CV_8UC1);
   blockMaskMat = (Scalar) 0;
   
-  for ( Coord c : bestRegionCoords ) {
-    // Convert (X,Y) to block (X,Y)
-    
-    int blockX = c.x / superpixelDim;
-    int blockY = c.y / superpixelDim;
-    
-    blockMaskMat.at<uint8_t>(blockY, blockX) = 0xFF;
+  if (superpixelDim == 4) {
+    setBlockMaskForCoords<4>(bestRegionCoords, superpixelDim, blockMaskMat);
+  } else {
+    setBlockMaskForCoords<0>(bestRegionCoords, superpixelDim, blockMaskMat);
   }
   
   if (debugDumpImages) {
@@ -1516,7 +2859,7 @@ captureRegion(SuperpixelImage &spImage,
     fnameStream << "srm" << "_tag_" << tag << "_best_region_mask_blocks" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, blockMaskMat);
+    debugImwrite(fname, blockMaskMat);
     cout << "wrote " << fname << endl;
   }
   
@@ -1538,7 +2881,7 @@ captureRegion(SuperpixelImage &spImage,
     fnameStream << "srm" << "_tag_" << tag << "_best_region_alpha" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, tmpMat);
+    debugImwrite(fname, tmpMat);
     cout << "wrote " << fname << endl;
     cout << "";
   }
@@ -1584,7 +2927,7 @@ captureRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_tas_range" << tas.start << "_" << tas.end << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpMat);
+      debugImwrite(fname, tmpMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -1764,7 +3107,7 @@ captureRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_to_" << mostCommonOtherTag << "_combined" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpMat);
+      debugImwrite(fname, tmpMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -1792,13 +3135,7 @@ captureRegion(SuperpixelImage &spImage,
     
     int numPixels = (int)combinedCoords.size();
     
-    for ( int i = 0; i < numPixels; i++ ) {
-      Coord c = combinedCoords[i];
-      
-      Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
-      uint32_t pixel = Vec3BToUID(vec);
-      inPixels[i] = pixel;
-    }
+    spImage.gatherPackedPixels(inputImg, combinedCoords, inPixels);
     
     quant_recurse(numPixels, inPixels, outPixels, &numActualClusters, colortable, allPixelsUnique );
     
@@ -1827,7 +3164,7 @@ captureRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_to_" << mostCommonOtherTag << "_quant3_input" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
       }
       
@@ -1850,7 +3187,7 @@ captureRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_to_" << mostCommonOtherTag << "_quant3_output" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
       }
       
@@ -1951,7 +3288,7 @@ captureRegion(SuperpixelImage &spImage,
       string filename = fnameStream.str();
       
       char *outQuantTableFilename = (char*) filename.c_str();
-      imwrite(outQuantTableFilename, sortedQtableOutputMat);
+      debugImwrite(outQuantTableFilename, sortedQtableOutputMat);
       cout << "wrote " << outQuantTableFilename << endl;
     }
     
@@ -1999,7 +3336,7 @@ captureRegion(SuperpixelImage &spImage,
         string filename = fnameStream.str();
         
         char *outQuantFilename = (char*)filename.c_str();
-        imwrite(outQuantFilename, sortedQuantOutputMat);
+        debugImwrite(outQuantFilename, sortedQuantOutputMat);
         cout << "wrote " << outQuantFilename << endl;
       }
     }
@@ -2007,9 +3344,10 @@ captureRegion(SuperpixelImage &spImage,
     delete [] colortable;
     
     // For the coords that define the inside region, gather all the out quant pixels
-    // and record the colortable offsets.
+    // and record the colortable offsets. The coords are all inside the bbox
+    // of combinedCoords, so a dense grid over the bbox replaces a hashed lookup.
     
-    unordered_map<Coord, uint32_t> coordToQuantPixelMap;
+    CoordGrid<uint32_t> coordToQuantPixelMap(combinedCoords);
     
     for ( int i = 0; i < numPixels; i++ ) {
       Coord c = combinedCoords[i];
@@ -2021,10 +3359,17 @@ captureRegion(SuperpixelImage &spImage,
 #endif // DEBUG
     }
     
-    // Map colortable offset to count "inside"
-    unordered_map<uint32_t, uint32_t> insideOffsetHistogram;
-    // Map colortable offset to count "outside"
-    unordered_map<uint32_t, uint32_t> outsideOffsetHistogram;
+    // Count for each colortable offset "inside" and "outside", the offsets
+    // are the keys that get sorted by count.
+    
+    vector<uint32_t> insideOffsetHistogram(numActualClusters, 0);
+    vector<uint32_t> outsideOffsetHistogram(numActualClusters, 0);
+    
+    vector<uint32_t> colortableOffsets(numActualClusters);
+    
+    for (int i = 0; i < (int) numActualClusters; i++) {
+      colortableOffsets[i] = i;
+    }
     
     for ( Coord c : insideCoords ) {
       uint32_t pixel = coordToQuantPixelMap[c];
@@ -2037,7 +3382,7 @@ captureRegion(SuperpixelImage &spImage,
       outsideOffsetHistogram[offset] += 1;
     }
     
-    vector<uint32_t> sortedInsideOffsetKeys = sort_keys_by_count(insideOffsetHistogram, true);
+    vector<uint32_t> sortedInsideOffsetKeys = sort_keys_by_count(insideOffsetHistogram, colortableOffsets, true);
     
     if (debug) {
       fprintf(stdout, "sortedInsideOffsetKeys\n");
@@ -2048,7 +3393,7 @@ captureRegion(SuperpixelImage &spImage,
       fprintf(stdout, "done\n");
     }
 
-    vector<uint32_t> sortedOutsideOffsetKeys = sort_keys_by_count(outsideOffsetHistogram, true);
+    vector<uint32_t> sortedOutsideOffsetKeys = sort_keys_by_count(outsideOffsetHistogram, colortableOffsets, true);
     
     if (debug) {
       fprintf(stdout, "sortedOutsideOffsetKeys\n");
@@ -2096,9 +3441,10 @@ captureRegion(SuperpixelImage &spImage,
     
     unordered_map<uint32_t, uint32_t> outsideInputHistogram;
     
+    const Mat &packedImg = spImage.getPackedPixels(inputImg);
+    
     for ( Coord c : outsideCoords ) {
-      Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
-      uint32_t pixel = Vec3BToUID(vec);
+      uint32_t pixel = packedImg.at<uint32_t>(c.y, c.x);
       outsideInputHistogram[pixel] += 1;
     }
     
@@ -2272,7 +3618,7 @@ captureRegion(SuperpixelImage &spImage,
         
         string fname = fnameStream.str();
         
-        imwrite(fname, qtableOutputMat);
+        debugImwrite(fname, qtableOutputMat);
         cout << "wrote " << fname << endl;
         cout << "";
       }
@@ -2307,7 +3653,7 @@ captureRegion(SuperpixelImage &spImage,
         
         string fname = fnameStream.str();
         
-        imwrite(fname, qtableOutputMat);
+        debugImwrite(fname, qtableOutputMat);
         cout << "wrote " << fname << endl;
         cout << "";
       }
@@ -2415,7 +3761,7 @@ captureRegion(SuperpixelImage &spImage,
       
       string fname = fnameStream.str();
       
-      imwrite(fname, qtableOutputMat);
+      debugImwrite(fname, qtableOutputMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -2453,7 +3799,7 @@ captureRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_to_" << mostCommonOtherTag << "_quant3_generated_output" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
       }
     }
@@ -2503,7 +3849,7 @@ captureRegion(SuperpixelImage &spImage,
         qtableOutputMat.at<Vec3b>(i, 1) = vec;
       }
       
-      imwrite(fname, qtableOutputMat);
+      debugImwrite(fname, qtableOutputMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -2520,7 +3866,7 @@ captureRegion(SuperpixelImage &spImage,
       bool isInside = pixelToInside[quantPixel].isInside;
       
       if (isInside) {
-        mask.at<uint8_t>(c.y, c.x) = 0xFF;
+        mask.set(c);
         
         if (debug && debugOnOff) {
           printf("pixel 0x%08X at (%5d,%5d) is marked on (inside)\n", quantPixel, c.x, c.y);
@@ -2540,40 +3886,38 @@ captureRegion(SuperpixelImage &spImage,
   // of the pixels.
   
   if ((1)) {
-    vector<Point> locations;
-    findNonZero(mask, locations);
+    // The flood fill only needs the bbox of the on pixels, so each temporary
+    // is the size of that bbox and not the size of the frame.
     
-    vector<Coord> coords;
+    Rect roiRect = mask.nonZeroBounds();
     
-    for ( Point p : locations ) {
-      Coord c(p.x, p.y);
-      coords.push_back(c);
-    }
+    int32_t originX = roiRect.x;
+    int32_t originY = roiRect.y;
+    
+    Rect localRoiRect(roiRect.x - mask.roi.x, roiRect.y - mask.roi.y, roiRect.width, roiRect.height);
+    
+    Mat &maskMat = mask.mat();
     
-    int32_t originX, originY, regionWidth, regionHeight;
-    bbox(originX, originY, regionWidth, regionHeight, coords);
-    Rect roiRect(originX, originY, regionWidth, regionHeight);
-
     Mat outDistMat;
     outDistMat = Scalar(0);
     
-    Coord roiCenter = findRegionCenter(mask, roiRect, outDistMat, tag);
+    Coord roiCenter = findRegionCenter(maskMat, localRoiRect, outDistMat, tag);
 
     Coord regionCenter(originX + roiCenter.x, originY + roiCenter.y);
     
-    Point2i center2i(regionCenter.x, regionCenter.y);
+    Point2i center2i(regionCenter.x - mask.roi.x, regionCenter.y - mask.roi.y);
     
     if (debugDumpImages) {
       std::stringstream fnameStream;
       fnameStream << "srm" << "_tag_" << tag << "_pre_flood_region_mask" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, mask);
+      debugImwrite(fname, maskMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
     
-    Mat invMaskMat = mask.clone();
+    Mat invMaskMat = maskMat.clone();
     binMatInvert(invMaskMat);
 
     if (debugDumpImages) {
@@ -2581,30 +3925,22 @@ captureRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_pre_flood_inv_region_mask" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, invMaskMat);
+      debugImwrite(fname, invMaskMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
     
     invMaskMat.at<uint8_t>(center2i.y, center2i.x) = 0xFF;
     
-    Mat outFloodMat = mask.clone();
-    outFloodMat = Scalar(0);
+    Mat outFloodMat(maskMat.size(), CV_8UC1, Scalar(0));
     
-    int numPixelsFilled = floodFillMask(invMaskMat, outFloodMat, center2i, 8);
-    assert(numPixelsFilled > 0);
+    // All the mask pixels are inside roiRect, so the fill does not need to read
+    // the rest of the mask.
     
-    if (debugDumpImages && false) {
-      Mat tmpResultImg = mask.clone();
-      
-      std::stringstream fnameStream;
-      fnameStream << "srm" << "_tag_" << tag << "_post_flood_region_mask" << ".png";
-      string fname = fnameStream.str();
-      
-      imwrite(fname, tmpResultImg);
-      cout << "wrote " << fname << endl;
-      cout << "";
-    }
+    static thread_local FloodFillScratch floodScratch;
+    
+    int numPixelsFilled = scanlineFloodFill(invMaskMat, outFloodMat, center2i, 8, localRoiRect, floodScratch);
+    assert(numPixelsFilled > 0);
     
     if (debugDumpImages) {
       Mat tmpResultImg = outFloodMat.clone();
@@ -2613,7 +3949,7 @@ captureRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_post_flood_out_mask" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -2621,7 +3957,7 @@ captureRegion(SuperpixelImage &spImage,
     // Any pixel that is on in mask but off in outFloodMat should be turned
     // off in mask since this pixel was not included in the flood fill.
     
-    assert(mask.size() == outFloodMat.size());
+    assert(maskMat.size() == outFloodMat.size());
     
     // Do dump that shows any pixels that should avtually be off because
     // they were not included in the flood mask.
@@ -2634,16 +3970,13 @@ captureRegion(SuperpixelImage &spImage,
       // to 0xFF only in the case where the mask is on and the
       // flood mask is off.
       
-      for_each_byte(tmpResultImg, mask,
+      for_each_byte(tmpResultImg, maskMat,
                     [&numRemoved](uint8_t *floodBPtr, const uint8_t *maskBPtr)->void {
                       uint8_t floodB = *floodBPtr;
                       const uint8_t maskB = *maskBPtr;
                       if (maskB && !floodB) {
                         *floodBPtr = 0xFF;
                         numRemoved++;
-                        //fprintf(stdout, "maskB %3d, floodB %3d -> %3d\n", maskB, floodB, *floodBPtr);
-                      } else {
-                        //fprintf(stdout, "maskB %3d, floodB %3d -> %3d\n", maskB, floodB, floodB);
                       }
                     });
       
@@ -2652,7 +3985,7 @@ captureRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_post_flood_out_mask_removed" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
         cout << "";
       }
@@ -2662,17 +3995,15 @@ captureRegion(SuperpixelImage &spImage,
       }
     }
     
-    // Optimal impl that iterates over each Mat result and calls lambda with pointers
+    // Optimal impl that iterates over each Mat result and calls lambda with pointers,
+    // mask pixels are only on inside roiRect.
     
-    for_each_byte(mask, outFloodMat,
+    for_each_byte(maskMat, outFloodMat, localRoiRect,
                      [](uint8_t *maskBPtr, const uint8_t *floodBPtr)->void {
                        uint8_t maskB = *maskBPtr;
                        uint8_t floodB = *floodBPtr;
                        if (maskB && !floodB) {
                          *maskBPtr = 0;
-                         //fprintf(stdout, "maskB %3d, floodB %3d -> %3d\n", maskB, floodB, *maskBPtr);
-                       } else {
-                         //fprintf(stdout, "maskB %3d, floodB %3d -> %3d\n", maskB, floodB, floodB);
                        }
                        return;
                      });
@@ -2701,33 +4032,24 @@ captureVeryCloseRegion(SuperpixelImage &spImage,
                   int blockHeight,
                   int superpixelDim,
                   Mat &mask,
-                  const vector<Coord> &regionCoords,
+                  RegionPixels &regionPixels,
                   const vector<Coord> &srmRegionCoords,
                   int estNumColors)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "captureVeryCloseRegion" << endl;
   }
   
-  int numPixels = (int)regionCoords.size();
+  const vector<Coord> &regionCoords = regionPixels.getCoords();
   
-  assert(estNumColors > 0);
-  uint32_t numActualClusters = estNumColors;
+  TraceZone traceZone("captureVeryCloseRegion", tag, regionCoords.size());
   
-  uint32_t *colortable = new uint32_t[numActualClusters];
-  uint32_t *inPixels = new uint32_t[numPixels];
-  uint32_t *outPixels = new uint32_t[numPixels];
+  int numPixels = (int)regionCoords.size();
   
-  for ( int i = 0; i < numPixels; i++ ) {
-    Coord c = regionCoords[i];
-    
-    Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
-    uint32_t pixel = Vec3BToUID(vec);
-    inPixels[i] = pixel;
-  }
+  assert(estNumColors > 0);
   
   // In this case the pixels are from a very small colortable or all the entries
   // are so close together that one can assume that the colors are very simple
@@ -2776,17 +4098,21 @@ captureVeryCloseRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_srm_region_tags" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
       cout << "";
     }
   }
   
-  // Generate cluster centers based on the indicated number of clusters N
+  // Generate cluster centers based on the indicated number of clusters N, the
+  // quant is shared with any other branch that asks for the same N.
   
-  int allPixelsUnique = 0;
+  const RegionPixelsQuant &quant = regionPixels.getQuant(estNumColors);
   
-  quant_recurse(numPixels, inPixels, outPixels, &numActualClusters, colortable, allPixelsUnique );
+  const uint32_t *colortable = quant.colortable.data();
+  const uint32_t *outPixels = quant.quantPixels.data();
+  
+  uint32_t numActualClusters = (uint32_t) quant.colortable.size();
   
   // Write quant output where each original pixel is replaced with the closest
   // colortable entry.
@@ -2807,7 +4133,7 @@ captureVeryCloseRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_quant_inside_output" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
     }
     
@@ -2836,7 +4162,7 @@ captureVeryCloseRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_quant_inside_offsets" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, quantOffsetsMat);
+      debugImwrite(fname, quantOffsetsMat);
       cout << "wrote " << fname << endl;
     }
   }
@@ -2865,7 +4191,7 @@ captureVeryCloseRegion(SuperpixelImage &spImage,
   
   unordered_map<uint32_t, InsideOutsideRecord> pixelToInside;
   
-  insideOutsideTest(inputImg.rows, inputImg.cols, srmRegionCoords, tag, regionCoords, outPixels, sortedColortable, pixelToInside);
+  insideOutsideTest(inputImg.cols, inputImg.rows, srmRegionCoords, tag, regionCoords, outPixels, sortedColortable, pixelToInside);
   
   // Each pixel in the input is now mapped to a boolean condition that
   // indicates if that pixel is inside or outside the shape.
@@ -2894,10 +4220,6 @@ captureVeryCloseRegion(SuperpixelImage &spImage,
     }
   }
   
-  delete [] colortable;
-  delete [] inPixels;
-  delete [] outPixels;
-  
   if (debug) {
     cout << "return captureVeryCloseRegion" << endl;
   }
@@ -2917,30 +4239,31 @@ captureNotCloseRegion(SuperpixelImage &spImage,
                        int blockHeight,
                        int superpixelDim,
                        Mat &mask,
-                       const vector<Coord> &regionCoords,
+                       RegionPixels &regionPixels,
                        const vector<Coord> &srmRegionCoords,
                        int estNumColors,
                       const Mat &blockBasedQuantMat)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "captureNotCloseRegion " << tag << endl;
   }
   
+  const vector<Coord> &regionCoords = regionPixels.getCoords();
+  
+  TraceZone traceZone("captureNotCloseRegion", tag, regionCoords.size());
+  
   int numPixels = (int)regionCoords.size();
   
-  uint32_t *inPixels = new uint32_t[numPixels];
-  uint32_t *outPixels = new uint32_t[numPixels];
+  const uint32_t *inPixels = regionPixels.getPixels().data();
   
-  for ( int i = 0; i < numPixels; i++ ) {
-    Coord c = regionCoords[i];
-    
-    Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
-    uint32_t pixel = Vec3BToUID(vec);
-    inPixels[i] = pixel;
-  }
+  // The quant pixels are mapped again to a generated colortable below, so
+  // the shared quant result is copied.
+  
+  vector<uint32_t> outPixelsVec(numPixels);
+  uint32_t *outPixels = outPixelsVec.data();
   
 //  unordered_map<Coord, HistogramForBlock> blockMap;
 //  
@@ -2954,6 +4277,11 @@ captureNotCloseRegion(SuperpixelImage &spImage,
   Mat blockMaskMat(blockBasedQuantMat.size(), CV_8UC1);
   blockMaskMat = (Scalar) 0;
   
+  int minBlockX = blockMaskMat.cols;
+  int minBlockY = blockMaskMat.rows;
+  int maxBlockX = -1;
+  int maxBlockY = -1;
+  
   for ( Coord c : regionCoords ) {
     // Convert (X,Y) to block (X,Y)
     
@@ -2961,6 +4289,17 @@ captureNotCloseRegion(SuperpixelImage &spImage,
     int blockY = c.y / superpixelDim;
     
     blockMaskMat.at<uint8_t>(blockY, blockX) = 0xFF;
+    
+    minBlockX = mini(minBlockX, blockX);
+    minBlockY = mini(minBlockY, blockY);
+    maxBlockX = maxi(maxBlockX, blockX);
+    maxBlockY = maxi(maxBlockY, blockY);
+  }
+  
+  cv::Rect blockMaskRoi;
+  
+  if (maxBlockX >= 0) {
+    blockMaskRoi = cv::Rect(minBlockX, minBlockY, maxBlockX - minBlockX + 1, maxBlockY - minBlockY + 1);
   }
   
   if (debugDumpImages) {
@@ -2968,7 +4307,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
     fnameStream << "srm" << "_tag_" << tag << "_block_mask" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, blockMaskMat);
+    debugImwrite(fname, blockMaskMat);
     cout << "wrote " << fname << endl;
   }
   
@@ -2980,9 +4319,31 @@ captureNotCloseRegion(SuperpixelImage &spImage,
   
   unordered_map<uint32_t, uint32_t> pixelToNumVotesMap;
   
-  vote_for_identical_neighbors(pixelToNumVotesMap, blockBasedQuantMat, blockMaskMat);
+  vector<uint32_t> sortedPixelKeys;
   
-  vector<uint32_t> sortedPixelKeys = sort_keys_by_count(pixelToNumVotesMap, true);
+  {
+    // Only the blocks in the mask bbox and the neighbors just outside it are mapped to
+    // palette offsets, votes are then counted in a dense vector over the palette.
+    
+    cv::Rect neighborRoi(blockMaskRoi.x - 1, blockMaskRoi.y - 1, blockMaskRoi.width + 2, blockMaskRoi.height + 2);
+    
+    Mat blockIndexMat;
+    vector<uint32_t> palette;
+    
+    mapPixelsToPaletteIndexes(blockBasedQuantMat, neighborRoi, blockIndexMat, palette);
+    
+    vector<uint32_t> votes;
+    
+    vote_for_identical_neighbors(votes, blockIndexMat, blockMaskMat, (int) palette.size(), blockMaskRoi);
+    
+    for ( int i = 0; i < (int) palette.size(); i++ ) {
+      if (votes[i] > 0) {
+        pixelToNumVotesMap[palette[i]] = votes[i];
+      }
+    }
+    
+    sortedPixelKeys = sort_keys_by_count(votes, palette, true);
+  }
   
   if (debug) {
     for ( uint32_t pixel : sortedPixelKeys ) {
@@ -3004,6 +4365,10 @@ captureNotCloseRegion(SuperpixelImage &spImage,
   
   vector<uint32_t> sortedColortable;
   
+  // Vote count for each entry in sortedColortable
+  
+  vector<uint32_t> sortedVoteCounts;
+  
   for (int i = 0; i < numPoints; i++) {
     int si = (int) sortedOffsets[i];
     uint32_t pixel = sortedPixelKeys[si];
@@ -3011,6 +4376,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
     sortedQtableOutputMat.at<Vec3b>(i, 0) = vec;
     
     sortedColortable.push_back(pixel);
+    sortedVoteCounts.push_back(pixelToNumVotesMap[pixel]);
   }
   
   if (debug) {
@@ -3046,14 +4412,19 @@ captureNotCloseRegion(SuperpixelImage &spImage,
     string filename = fnameStream.str();
     
     char *outQuantTableFilename = (char*) filename.c_str();
-    imwrite(outQuantTableFilename, sortedQtableOutputMat);
+    debugImwrite(outQuantTableFilename, sortedQtableOutputMat);
     cout << "wrote " << outQuantTableFilename << endl;
   }
   
   // Use peak detection logic to examine the 1D histogram in sorted order so as to find the
   // peaks in the distribution.
   
-  vector<uint32_t> peakPixels = gatherPeakPixels(sortedColortable, pixelToNumVotesMap);
+  vector<uint32_t> peakPixels;
+  
+  if (!gatherPeakPixels(sortedColortable, sortedVoteCounts, peakPixels)) {
+    // No peaks is treated as the minimum N below
+    peakPixels.clear();
+  }
   
   int N = (int) peakPixels.size();
   
@@ -3143,13 +4514,14 @@ captureNotCloseRegion(SuperpixelImage &spImage,
     cout << "numClusters detected as " << numClusters << endl;
   }
   
-  uint32_t *colortable = new uint32_t[numClusters];
+  const RegionPixelsQuant &quant = regionPixels.getQuant(numClusters);
   
-  uint32_t numActualClusters = numClusters;
+  uint32_t *colortable = new uint32_t[numClusters];
   
-  int allPixelsUnique = 0;
+  uint32_t numActualClusters = (uint32_t) quant.colortable.size();
   
-  quant_recurse(numPixels, inPixels, outPixels, &numActualClusters, colortable, allPixelsUnique );
+  std::copy(quant.colortable.begin(), quant.colortable.end(), colortable);
+  std::copy(quant.quantPixels.begin(), quant.quantPixels.end(), outPixels);
   
   // Write quant output where each original pixel is replaced with the closest
   // colortable entry.
@@ -3170,7 +4542,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_quant_output" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
     }
     
@@ -3270,7 +4642,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
       string filename = fnameStream.str();
       
       char *outQuantTableFilename = (char*) filename.c_str();
-      imwrite(outQuantTableFilename, sortedQtableOutputMat);
+      debugImwrite(outQuantTableFilename, sortedQtableOutputMat);
       cout << "wrote " << outQuantTableFilename << endl;
     }
     
@@ -3316,7 +4688,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
       string filename = fnameStream.str();
       
       char *outQuantFilename = (char*)filename.c_str();
-      imwrite(outQuantFilename, sortedQuantOutputMat);
+      debugImwrite(outQuantFilename, sortedQuantOutputMat);
       cout << "wrote " << outQuantFilename << endl;
     }
   }
@@ -3369,7 +4741,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         printf("peak com = 0x%02X%02X%02X\n", centerOfMass[0], centerOfMass[1], centerOfMass[2]);
       }
       
-      imwrite(fname, outputMat);
+      debugImwrite(fname, outputMat);
       cout << "wrote " << fname << endl;
     }
   }
@@ -3470,7 +4842,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         i += 1;
       }
       
-      imwrite(fname, outputMat);
+      debugImwrite(fname, outputMat);
       cout << "wrote " << fname << endl;
     }
   }
@@ -3617,7 +4989,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         i += 1;
       }
       
-      imwrite(fname, outputMat);
+      debugImwrite(fname, outputMat);
       cout << "wrote " << fname << endl;
     }
   }
@@ -3833,7 +5205,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_quant_output2" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
       }
     }
@@ -3842,7 +5214,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
     
     unordered_map<uint32_t, InsideOutsideRecord> pixelToInside;
     
-    insideOutsideTest(inputImg.rows, inputImg.cols, srmRegionCoords, tag, regionCoords, outPixels, resortedColortable, pixelToInside);
+    insideOutsideTest(inputImg.cols, inputImg.rows, srmRegionCoords, tag, regionCoords, outPixels, resortedColortable, pixelToInside);
     
     // Emit vote result table which basically shows the sorted pixel and the vote boolean as black or white
     
@@ -3875,7 +5247,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         qtableOutputMat.at<Vec3b>(i, 1) = vec;
       }
       
-      imwrite(fname, qtableOutputMat);
+      debugImwrite(fname, qtableOutputMat);
       cout << "wrote " << fname << endl;
     }
   
@@ -3985,7 +5357,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
       fnameStream << "srm" << "_tag_" << tag << "_srm_region_decrease_mask" << "1" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, tmpResultImg);
+      debugImwrite(fname, tmpResultImg);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -4009,7 +5381,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_srm_region_decrease_alpha_mask" << "1" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, alphaMaskResultImg);
+        debugImwrite(fname, alphaMaskResultImg);
         cout << "wrote " << fname << endl;
         cout << "";
       }
@@ -4049,7 +5421,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_srm_region_decrease_mask" << i << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
         cout << "";
       }
@@ -4075,7 +5447,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
           fnameStream << "srm" << "_tag_" << tag << "_srm_region_decrease_alpha_mask" << i << ".png";
           string fname = fnameStream.str();
           
-          imwrite(fname, alphaMaskResultImg);
+          debugImwrite(fname, alphaMaskResultImg);
           cout << "wrote " << fname << endl;
           cout << "";
         }
@@ -4120,7 +5492,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
         fnameStream << "srm" << "_tag_" << tag << "_srm_region_increase_mask" << i << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, tmpResultImg);
+        debugImwrite(fname, tmpResultImg);
         cout << "wrote " << fname << endl;
         cout << "";
       }
@@ -4146,7 +5518,7 @@ captureNotCloseRegion(SuperpixelImage &spImage,
           fnameStream << "srm" << "_tag_" << tag << "_srm_region_increase_alpha_mask" << i << ".png";
           string fname = fnameStream.str();
           
-          imwrite(fname, alphaMaskResultImg);
+          debugImwrite(fname, alphaMaskResultImg);
           cout << "wrote " << fname << endl;
           cout << "";
         }
@@ -4219,105 +5591,165 @@ captureNotCloseRegion(SuperpixelImage &spImage,
     return;
 }
 
-// Loop over each pixel passed through the quant logic and count up how
-// often a pixel is "inside" the known region vs how often it is "outside".
-
-// Foreach pixel in a colortable determine the "inside/outside" status of that
-// pixel based on a stats test as compared to the current known region.
-
-void insideOutsideTest(int32_t width,
-                       int32_t height,
-                       const vector<Coord> &coords,
-                       int32_t tag,
-                       const vector<Coord> &regionCoords,
-                       const uint32_t *outPixels,
-                       const vector<uint32_t> &sortedColortable,
-                       unordered_map<uint32_t, InsideOutsideRecord> &pixelToInsideMap)
+void InsideOutsideCounts::init(const vector<Coord> &coords,
+                               const vector<Coord> &regionCoords,
+                               const uint32_t *outPixels,
+                               const vector<uint32_t> &sortedColortable)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  // Region mask covers only the bbox of the region coords
   
-  // Create region mask as byte mask
-  
-  Mat isInsideMask(height, width, CV_8UC1);
-  isInsideMask = Scalar(0);
+  CoordBitSet isInsideMask(coords);
   
   for ( Coord c : coords ) {
-    isInsideMask.at<uint8_t>(c.y, c.x) = 0xFF;
+    isInsideMask.insert(c);
   }
   
-  if (debugDumpImages) {
-    std::stringstream fnameStream;
-    fnameStream << "srm" << "_tag_" << tag << "_srm_region_mask" << ".png";
-    string fname = fnameStream.str();
-    
-    imwrite(fname, isInsideMask);
-    cout << "wrote " << fname << endl;
-    cout << "";
+  // The bin of a pixel is found with a binary search over the colortable sorted
+  // by pixel value and the last bin is reused for a run of the same pixel.
+  
+  const int numColors = (int) sortedColortable.size();
+  
+  vector<pair<uint32_t, int32_t> > pixelToBin;
+  pixelToBin.reserve(numColors);
+  
+  for ( int i = 0; i < numColors; i++ ) {
+    pixelToBin.push_back(make_pair(sortedColortable[i], (int32_t) i));
   }
   
-  //unordered_map<uint32_t, InsideOutside> srmTagInsideCount;
+  sort(pixelToBin.begin(), pixelToBin.end());
   
-  int numPixels = (int) regionCoords.size();
+  colortable = sortedColortable;
+  colorBins.resize(numColors);
+  
+  for ( int i = 0; i < numColors; i++ ) {
+    const bool isFirst = (i == 0 || pixelToBin[i].first != pixelToBin[i-1].first);
+    colorBins[pixelToBin[i].second] = isFirst ? pixelToBin[i].second : colorBins[pixelToBin[i-1].second];
+  }
+  
+  otherPixels.clear();
+  unordered_map<uint32_t, int32_t> otherPixelToBin;
+  
+  const int numPixels = (int) regionCoords.size();
+  
+  coordBins.resize(numPixels);
+  coordInside.resize(numPixels);
+  
+  uint32_t lastPixel = 0;
+  int32_t lastBin = -1;
   
   for ( int i = 0; i < numPixels; i++ ) {
-    Coord c = regionCoords[i];
     uint32_t quantPixel = outPixels[i];
     
-    if (debug && 0) {
-      printf("quantPixel 0x%08X\n", quantPixel);
+    if (lastBin == -1 || quantPixel != lastPixel) {
+      auto it = lower_bound(pixelToBin.begin(), pixelToBin.end(), make_pair(quantPixel, (int32_t) -1));
+      
+      if (it != pixelToBin.end() && it->first == quantPixel) {
+        lastBin = it->second;
+      } else {
+        auto result = otherPixelToBin.insert(make_pair(quantPixel, (int32_t) (numColors + otherPixels.size())));
+        if (result.second) {
+          otherPixels.push_back(quantPixel);
+        }
+        lastBin = result.first->second;
+      }
+      
+      lastPixel = quantPixel;
     }
     
-    InsideOutsideRecord &inOut = pixelToInsideMap[quantPixel];
-    uint8_t isInside = isInsideMask.at<uint8_t>(c.y, c.x);
-    if (isInside) {
-      inOut.inside += 1;
-    } else {
-      inOut.outside += 1;
-    }
+    coordBins[i] = lastBin;
+    coordInside[i] = isInsideMask.contains(regionCoords[i]) ? 1 : 0;
   }
   
-  for ( int i = 0; i < sortedColortable.size(); i++ ) {
-    uint32_t pixel = sortedColortable[i];
-    
-    if (pixelToInsideMap.count(pixel) == 0) {
-      InsideOutsideRecord &inOut = pixelToInsideMap[pixel];
-      // FIXME: assume it is inside somewhere in a gradient ?
-      // May not be important since no output pixels match it.
-      inOut.inside += 1;
-      inOut.outside += 0;
-      inOut.confidence = 0.0f;
+  insideCounts.assign(numColors + otherPixels.size(), 0);
+  outsideCounts.assign(numColors + otherPixels.size(), 0);
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    if (coordInside[i]) {
+      insideCounts[coordBins[i]] += 1;
+    } else {
+      outsideCounts[coordBins[i]] += 1;
     }
   }
+}
+
+void InsideOutsideCounts::writeRecords(unordered_map<uint32_t, InsideOutsideRecord> &pixelToInsideMap) const
+{
+  const int numColors = (int) colorBins.size();
   
-  // If any colortable pixels did not appear in outPixels then add inside = 0
-  // votes for that pixel ?
+  // Pixel that is not in the colortable is counted but not voted on
   
-  // Vote for inside/outside status for each unique pixel based on a GT 50% chance
+  for ( int i = 0; i < (int) otherPixels.size(); i++ ) {
+    InsideOutsideRecord &inOut = pixelToInsideMap[otherPixels[i]];
+    inOut.inside = insideCounts[numColors + i];
+    inOut.outside = outsideCounts[numColors + i];
+    inOut.confidence = 0.0f;
+    inOut.isInside = false;
+  }
   
-  for ( int i = 0; i < sortedColortable.size(); i++ ) {
-    uint32_t pixel = sortedColortable[i];
-    InsideOutsideRecord &inOut = pixelToInsideMap[pixel];
+  for ( int offset = 0; offset < numColors; offset++ ) {
+    InsideOutsideRecord &inOut = pixelToInsideMap[colortable[offset]];
     
-    if (debug) {
-      printf("inout table[0x%08X] = (in out) (%5d %5d)\n", pixel, inOut.inside, inOut.outside);
-    }
+    inOut.inside = getInside(offset);
+    inOut.outside = getOutside(offset);
     
-    float percentOn = (float)inOut.inside / (inOut.inside + inOut.outside);
+    if ((inOut.inside + inOut.outside) == 0) {
+      // FIXME: assume it is inside somewhere in a gradient ?
+      // May not be important since no output pixels match it.
+      inOut.inside = 1;
+    }
     
-    inOut.confidence = percentOn;
+    inOut.confidence = getConfidence(offset);
+    inOut.isInside = (inOut.confidence > 0.5f);
+  }
+}
+
+// Loop over each pixel passed through the quant logic and count up how
+// often a pixel is "inside" the known region vs how often it is "outside".
+
+// Foreach pixel in a colortable determine the "inside/outside" status of that
+// pixel based on a stats test as compared to the current known region.
+
+void insideOutsideTest(int32_t width,
+                       int32_t height,
+                       const vector<Coord> &coords,
+                       int32_t tag,
+                       const vector<Coord> &regionCoords,
+                       const uint32_t *outPixels,
+                       const vector<uint32_t> &sortedColortable,
+                       unordered_map<uint32_t, InsideOutsideRecord> &pixelToInsideMap)
+{
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
+  
+  if (debugDumpImages) {
+    Mat isInsideMaskMat(height, width, CV_8UC1);
+    isInsideMaskMat = Scalar(0);
     
-    if (debug) {
-      printf("percent on [0x%08X] = %0.3f\n", pixel, percentOn);
+    for ( Coord c : coords ) {
+      isInsideMaskMat.at<uint8_t>(c.y, c.x) = 0xFF;
     }
     
-    if (percentOn > 0.5f) {
-      inOut.isInside = true;
-    } else {
-      inOut.isInside = false;
-    }
+    std::stringstream fnameStream;
+    fnameStream << "srm" << "_tag_" << tag << "_srm_region_mask" << ".png";
+    string fname = fnameStream.str();
     
-    if (debug) {
+    debugImwrite(fname, isInsideMaskMat);
+    cout << "wrote " << fname << endl;
+    cout << "";
+  }
+  
+  InsideOutsideCounts counts;
+  counts.init(coords, regionCoords, outPixels, sortedColortable);
+  
+  // Vote for inside/outside status for each unique pixel based on a GT 50% chance
+  
+  counts.writeRecords(pixelToInsideMap);
+  
+  if (debug) {
+    for ( uint32_t pixel : sortedColortable ) {
+      InsideOutsideRecord &inOut = pixelToInsideMap[pixel];
+      printf("inout table[0x%08X] = (in out) (%5d %5d)\n", pixel, inOut.inside, inOut.outside);
+      printf("percent on [0x%08X] = %0.3f\n", pixel, inOut.confidence);
       printf("pixelToInsideMap[0x%08X].isInside = %d\n", pixel, inOut.isInside);
     }
   }
@@ -4410,112 +5842,195 @@ void insideOutsideTest(int32_t width,
   return;
 }
 
-// Given a set of pixels, scan those pixels and determine the peaks
-// in the histogram to find likely most common graph peak values.
+// Given a set of pixels and the vote count for each pixel, scan the counts and
+// determine the peaks in the histogram to find likely most common graph peak
+// values. Buffers for a palette of up to GATHER_PEAK_STACK_POINTS entries are
+// on the stack, a larger palette uses heap buffers. Returns false when the
+// peaks could not be detected.
+
+#define GATHER_PEAK_STACK_POINTS 256
 
-vector<uint32_t> gatherPeakPixels(const vector<uint32_t> & pixels,
-                                  unordered_map<uint32_t, uint32_t> & pixelToNumVotesMap)
+bool gatherPeakPixels(const vector<uint32_t> & pixels,
+                      const vector<uint32_t> & counts,
+                      vector<uint32_t> & peakPixels)
 {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
-  vector<uint32_t> peakPixels;
+  assert(pixels.size() == counts.size());
   
-  // FIXME: dynamically allocate buffers to fit input size ?
+  int numDataPoints = (int) pixels.size();
   
-  double*     data[2];
-  //  double      row[2];
+  // Zero count at the front and the back so that a peak can be
+  // detected in the first and last positions.
   
-#define MAX_PEAK    256
+  int dataCount = numDataPoints + 2;
   
-  int         emi_peaks[MAX_PEAK];
-  int         absorp_peaks[MAX_PEAK];
+  uint32_t    stackData[GATHER_PEAK_STACK_POINTS + 2];
+  int         stackEmiPeaks[GATHER_PEAK_STACK_POINTS + 2];
+  int         stackAbsorpPeaks[GATHER_PEAK_STACK_POINTS + 2];
   
-  int         emi_count = 0;
-  int         absorp_count = 0;
+  vector<uint32_t> heapData;
+  vector<int> heapEmiPeaks;
+  vector<int> heapAbsorpPeaks;
   
-  double      delta = 1e-6;
-  int         emission_first = 0;
+  uint32_t *data = stackData;
+  int *emi_peaks = stackEmiPeaks;
+  int *absorp_peaks = stackAbsorpPeaks;
   
-  int numDataPoints = (int) pixels.size();
+  if (numDataPoints > GATHER_PEAK_STACK_POINTS) {
+    heapData.resize(dataCount);
+    heapEmiPeaks.resize(dataCount);
+    heapAbsorpPeaks.resize(dataCount);
+    
+    data = heapData.data();
+    emi_peaks = heapEmiPeaks.data();
+    absorp_peaks = heapAbsorpPeaks.data();
+  }
   
-  assert(numDataPoints <= 256);
+  int         emi_count = 0;
+  int         absorp_count = 0;
   
-  data[0] = new double[MAX_PEAK]();
-  data[1] = new double[MAX_PEAK]();
+  // Integer counts with a zero delta, same as the tiny delta on double counts
   
-  int i = 0;
+  uint32_t    delta = 0;
+  int         emission_first = 0;
   
-  // Insert zero slow with zero count so that a peak can
-  // be detected in the first position.
-  i += 1;
+  data[0] = 0;
   
-  for ( uint32_t pixel : pixels ) {
-    uint32_t count = pixelToNumVotesMap[pixel];
-    uint32_t pixelNoAlpha = pixel & 0x00FFFFFF;
-    
-    data[0][i] = pixelNoAlpha;
-//    data[0][i] = i;
-    data[1][i] = count;
-    
-    if ((0)) {
-      fprintf(stderr, "data[%05d] = 0x%08X -> count %d\n", i, pixelNoAlpha, count);
-    }
-    
-    i += 1;
+  for ( int i = 0; i < numDataPoints; i++ ) {
+    data[i+1] = counts[i];
   }
   
-  // +1 at the end of the samples
-  i += 1;
+  data[dataCount-1] = 0;
   
-  // Print the input data with zeros at the front and the back
-  
-  for ( int j = 0; j < i; j++ ) {
-    uint32_t pixelNoAlpha = data[0][j];
-    uint32_t count = data[1][j];
-    
-    if (debug) {
-      fprintf(stderr, "pixel %05d : 0x%08X = %d\n", j, pixelNoAlpha, count);
+  if (debug) {
+    for ( int i = 0; i < numDataPoints; i++ ) {
+      fprintf(stderr, "pixel %05d : 0x%08X = %d\n", i+1, pixels[i] & 0x00FFFFFF, counts[i]);
     }
   }
   
-  if(detect_peak(data[1], i,
-                 emi_peaks, &emi_count, MAX_PEAK,
-                 absorp_peaks, &absorp_count, MAX_PEAK,
-                 delta, emission_first))
+  if(detect_peak_t(data, dataCount,
+                   emi_peaks, &emi_count, dataCount,
+                   absorp_peaks, &absorp_count, dataCount,
+                   delta, emission_first))
   {
     fprintf(stderr, "There are too many peaks.\n");
-    exit(1);
+    return false;
   }
   
   if (debug) {
     fprintf(stdout, "num emi_peaks %d\n", emi_count);
   }
   
-  for(i = 0; i < emi_count; ++i) {
+  for ( int i = 0; i < emi_count; ++i ) {
     int offset = emi_peaks[i];
+    
+    // The zero count padding entries are never a peak
+    
+    if (offset < 1 || offset > numDataPoints) {
+      continue;
+    }
+    
+    uint32_t pixel = pixels[offset-1] & 0x00FFFFFF;
+    
     if (debug) {
-      fprintf(stdout, "%5d : %5d,%5d\n", offset, (int)data[0][offset], (int)data[1][offset]);
+      fprintf(stdout, "%5d : %5d,%5d\n", offset, (int)pixel, (int)data[offset]);
     }
     
-    uint32_t pixel = (uint32_t) round(data[0][offset]);
     peakPixels.push_back(pixel);
   }
   
   if (debug) {
     fprintf(stdout, "num absorp_peaks %d\n", absorp_count);
+    
+    for ( int i = 0; i < absorp_count; ++i ) {
+      int offset = absorp_peaks[i];
+      fprintf(stdout, "%5d : %5d\n", offset, (int)data[offset]);
+    }
   }
   
-  for(i = 0; i < absorp_count; ++i) {
-    int offset = absorp_peaks[i];
-    if (debug) {
-      fprintf(stdout, "%5d : %5d,%5d\n", offset, (int)data[0][offset],(int)data[1][offset]);
+  return true;
+}
+
+std::shared_ptr<BboxRayTable> BboxRayTableCache::build(int width, int height, Coord center)
+{
+  std::shared_ptr<BboxRayTable> table(new BboxRayTable());
+  
+  vector<Coord> outlineCoords = genRectangleOutline(width, height);
+  
+  // The LineIterator visits the same pixels as line() with 8 connectivity, the
+  // Mat is only used for the bounds.
+  
+  Mat boundsMat(height, width, CV_8UC1);
+  
+  Point2i centerP(center.x, center.y);
+  
+  table->rayStarts.reserve(outlineCoords.size() + 1);
+  
+  for ( Coord edgeCoord : outlineCoords ) {
+    table->rayStarts.push_back((int32_t) table->points.size());
+    
+    Point2i edgePoint(edgeCoord.x, edgeCoord.y);
+    
+    LineIterator it(boundsMat, centerP, edgePoint, 8, true);
+    
+    auto rayBegin = table->points.size();
+    
+    for ( int i = 0; i < it.count; i++, ++it ) {
+      Point p = it.pos();
+      table->points.push_back(Coord(p.x, p.y));
+    }
+    
+    // Raster order, the same as findNonZero() on the rendered line
+    
+    sort(table->points.begin() + rayBegin, table->points.end());
+  }
+  
+  table->rayStarts.push_back((int32_t) table->points.size());
+  
+  return table;
+}
+
+std::shared_ptr<const BboxRayTable> BboxRayTableCache::lookup(int width, int height, Coord center)
+{
+  uint64_t key = (((uint64_t) width) << 48) | (((uint64_t) height) << 32) | (((uint64_t) center.y) << 16) | center.x;
+  
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto it = tables.find(key);
+    
+    if (it != tables.end()) {
+      return it->second;
     }
   }
   
-  delete [] data[0];
-  delete [] data[1];
+  // Build without holding the lock, two threads building the same key get
+  // the same result.
+  
+  std::shared_ptr<const BboxRayTable> table = build(width, height, center);
+  
+  std::lock_guard<std::mutex> lock(mutex);
+  
+  if (tables.size() >= maxTables) {
+    tables.clear();
+  }
+  
+  tables[key] = table;
   
-  return peakPixels;
+  return table;
+}
+
+size_t BboxRayTableCache::size()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return tables.size();
+}
+
+void BboxRayTableCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  tables.clear();
 }
 
 // This method accepts a region defined by coords and returns the edges between
@@ -4528,8 +6043,8 @@ clockwiseScanForTagsAroundShape(
                                 const vector<Coord> &regionCoords,
                                 vector<TagsAroundShape> &tagsAroundVec)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   const bool debugDumpStepImages = false;
   
   if (debug) {
@@ -4567,16 +6082,17 @@ clockwiseScanForTagsAroundShape(
     fnameStream << "srm" << "_tag_" << tag << "_region_outline_coords" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, renderMat);
+    debugImwrite(fname, renderMat);
     cout << "wrote " << fname << endl;
     cout << "";
   }
   
   // Map from global coordinates to the specific tag at that coordinate
   // but ignore the current shape tag since most coords will be for the
-  // interior of the shape.
+  // interior of the shape. The grid covers the bbox of the region coords
+  // and a coord outside the bbox is not in the map.
   
-  unordered_map<Coord, int32_t> tagMap;
+  CoordGrid<int32_t> tagMap(regionCoords);
   
   for ( Coord c : regionCoords ) {
     Vec3b vec = tagsImg.at<Vec3b>(c.y, c.x);
@@ -4635,43 +6151,58 @@ clockwiseScanForTagsAroundShape(
   
   vector<vector<Coord> > allCoordForVectors;
   
+  // The rays for this bbox size and center are shared with other regions
+  
+  static BboxRayTableCache rayTableCache;
+  
+  std::shared_ptr<const BboxRayTable> rayTable = rayTableCache.lookup(regionWidth, regionHeight, regionCenter);
+  
   int stepi = 0;
   int stepMax = (int) outlineCoords.size();
   
+#if defined(DEBUG)
+  assert(rayTable->rayStarts.size() == (stepMax + 1));
+#endif // DEBUG
+  
   for ( ; stepi < stepMax; stepi++ ) {
     
     set<int32_t> tagsForVector;
     vector<Coord> coordsForVector;
     
-    Coord edgeCoord = outlineCoords[stepi];
-    
-    Point2i edgePoint(edgeCoord.x, edgeCoord.y);
-    
-    renderMat = Scalar(0);
-    line(renderMat, center, edgePoint, Scalar(0xFF));
+    const Coord *rayBegin = rayTable->points.data() + rayTable->rayStarts[stepi];
+    const Coord *rayEnd = rayTable->points.data() + rayTable->rayStarts[stepi+1];
     
     if (debug) {
-      cout << "render center line from " << center << " to " << edgePoint << endl;
+      Coord edgeCoord = outlineCoords[stepi];
+      cout << "scan center line from " << center << " to " << Point2i(edgeCoord.x, edgeCoord.y) << endl;
     }
     
+    // Points on the ray only rendered for the step images
+    
+    vector<Point> locations;
+    
     if (debugDumpImages && debugDumpStepImages) {
+      renderMat = Scalar(0);
+      
+      for ( const Coord *rayPtr = rayBegin; rayPtr < rayEnd; rayPtr++ ) {
+        renderMat.at<uint8_t>(rayPtr->y, rayPtr->x) = 0xFF;
+        locations.push_back(Point(rayPtr->x, rayPtr->y));
+      }
+      
       std::stringstream fnameStream;
       fnameStream << "srm" << "_tag_" << tag << "_step" << stepi << "_region_vec" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, renderMat);
+      debugImwrite(fname, renderMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
     
-    vector<Point> locations;
-    findNonZero(renderMat, locations);
-    
-    for ( Point p : locations ) {
-      Coord c(p.x, p.y);
-      c = originCoord + c;
-      if (tagMap.count(c) > 0) {
-        int32_t regionTag = tagMap[c];
+    for ( const Coord *rayPtr = rayBegin; rayPtr < rayEnd; rayPtr++ ) {
+      Coord c = originCoord + *rayPtr;
+      const int32_t *regionTagPtr = tagMap.find(c);
+      if (regionTagPtr != NULL) {
+        int32_t regionTag = *regionTagPtr;
         tagsForVector.insert(regionTag);
         coordsForVector.push_back(c);
       }
@@ -4687,7 +6218,7 @@ clockwiseScanForTagsAroundShape(
       fnameStream << "srm" << "_tag_" << tag << "_step" << stepi << "_region_input_tags_roi" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, regionRoiMat);
+      debugImwrite(fname, regionRoiMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -4706,7 +6237,7 @@ clockwiseScanForTagsAroundShape(
       fnameStream << "srm" << "_tag_" << tag << "_step" << stepi << "_region_input_tags" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, allTagsOn);
+      debugImwrite(fname, allTagsOn);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -4717,7 +6248,7 @@ clockwiseScanForTagsAroundShape(
       for ( Point p : locations ) {
         Coord c(p.x, p.y);
         c = originCoord + c;
-        if (tagMap.count(c) > 0) {
+        if (tagMap.contains(c)) {
           c = c - originCoord;
           renderMat.at<uint8_t>(c.y, c.x) = 0xFF;
         }
@@ -4727,7 +6258,7 @@ clockwiseScanForTagsAroundShape(
       fnameStream << "srm" << "_tag_" << tag << "_step" << stepi << "_hits_for_tag_vec" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, renderMat);
+      debugImwrite(fname, renderMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -4741,7 +6272,7 @@ clockwiseScanForTagsAroundShape(
       for ( Point p : locations ) {
         Coord c(p.x, p.y);
         c = originCoord + c;
-        if (tagMap.count(c) > 0) {
+        if (tagMap.contains(c)) {
           allTagsHit.at<Vec3b>(c.y, c.x) = tagsImg.at<Vec3b>(c.y, c.x);
         }
       }
@@ -4750,7 +6281,7 @@ clockwiseScanForTagsAroundShape(
       fnameStream << "srm" << "_tag_" << tag << "_step" << stepi << "_hit_tags_for_tag_vec" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, allTagsHit);
+      debugImwrite(fname, allTagsHit);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -4799,7 +6330,7 @@ clockwiseScanForTagsAroundShape(
     fnameStream << "srm" << "_tag_" << tag << "_hit_tags_in_scan_region" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, allTagsHit);
+    debugImwrite(fname, allTagsHit);
     cout << "wrote " << fname << endl;
     cout << "";
   }
@@ -4807,7 +6338,7 @@ clockwiseScanForTagsAroundShape(
   // Condense tags in regions starting from the top. A region range is condensed as long
   // as the tags in the range are the same or if there are no tags.
   
-  unordered_map<Coord, bool> uniqueCoords;
+  CoordBitSet uniqueCoords(regionCoords);
   
   for ( stepi = 0 ; stepi < stepMax; ) {
     if (debug) {
@@ -4863,14 +6394,10 @@ clockwiseScanForTagsAroundShape(
     
     tas.tags = vecOfTags;
     
-    // Gather all unique coords from combined range
+    // Gather all unique coords from combined range, a coord that was already
+    // seen in a previous range is not added again.
     
-#if defined(DEBUG)
-    for ( auto &pair : uniqueCoords ) {
-      bool uniqueThisLoop = pair.second;
-      assert(uniqueThisLoop == false);
-    }
-#endif // DEBUG
+    vector<Coord> &uniqueCoordsVec = tas.coords;
     
     int maxStepi = mini((nextStepi + 1), stepMax);
     
@@ -4889,21 +6416,13 @@ clockwiseScanForTagsAroundShape(
       }
       
       for ( Coord c : allCoordForVectors[i] ) {
-        if (uniqueCoords.count(c) == 0) {
-          uniqueCoords[c] = true;
+        if (uniqueCoords.insert(c)) {
+          uniqueCoordsVec.push_back(c);
         }
       }
     }
     
-    vector<Coord> &uniqueCoordsVec = tas.coords;
-    for ( auto &pair : uniqueCoords ) {
-      Coord c = pair.first;
-      bool uniqueThisLoop = pair.second;
-      if (uniqueThisLoop) {
-        pair.second = false;
-        uniqueCoordsVec.push_back(c);
-      }
-    }
+    sort(uniqueCoordsVec.begin(), uniqueCoordsVec.end());
     
 #if defined(DEBUG)
     assert((nextStepi + 1) > stepi);
@@ -5016,7 +6535,7 @@ clockwiseScanForTagsAroundShape(
 
 vector<Coord> genRectangleOutline(int regionWidth, int regionHeight)
 {
-  const bool debugDumpImages = true;
+  const bool debugDumpImages = isDebugStageImagesEnabled();
   
   vector<Coord> outlineCoords;
   
@@ -5107,23 +6626,24 @@ vector<Coord> genRectangleOutline(int regionWidth, int regionHeight)
 }
 
 // This method accepts an unsimplified contour of points and returns the approx normal vector for
-// each point on the contour.
+// each point on the contour. The inside, on and outside points for each contour point are
+// returned as 3 point rays in one buffer.
 
 void calcNormalsOnContour(CvSize size,
                           int32_t tag,
                           const vector<Point2i> &contour,
                           vector<Point2f> &contourNormals,
-                          vector<vector<Point2f> > &contourNormalCoords)
+                          ContourNormalRays &allNormalVectors)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "calcNormalsOnContour " << tag << endl;
   }
   
   contourNormals.clear();
-  contourNormalCoords.clear();
+  allNormalVectors.clear();
   
   // Set all contourNormals to 0.0 so that the size of contourNormals is
   // the same as the size of contour.
@@ -5142,56 +6662,39 @@ void calcNormalsOnContour(CvSize size,
   
   // Calculate normal vector that corresponds to each original contour coordinate.
   
-  vector<vector<Point2f> > &allNormalVectors = contourNormalCoords;
-  
-  Rect roi(0,0,size.width, size.height);
-  
-  // FIXME: should attempt to invoke splitContourIntoLinesSegments() with episilon = 0.0
-  // to determine simplified set of points that combine into lines without any approx.
-  // When the approx is then applied it can find longer lines. But, when the approx is
-  // small this logic ends up finding really small lines of length 2 or 3 which are really
-  // part of curves.
+  // FIXME: when epsilon is small this logic ends up finding really small lines of
+  // length 2 or 3 which are really part of curves.
   
   //        double epsilon = 0.0;
   double epsilon = 1.4;
   
-  vector<HullLineOrCurveSegment> vecOfSeg = splitContourIntoLinesSegments(tag, size, roi, contour, epsilon);
-  
-#if defined(DEBUG)
-  {
-    // Double check that the coordinate indicated as the HullLineOrCurveSegment
-    // starting point is the same as the first coord.
-    
-    int startOff = vecOfSeg[0].startContourOffset;
-    Point2i p = vecOfSeg[0].points[0];
-    assert(contour[startOff] == p);
-  }
-#endif // DEBUG
+  vector<ContourSpan> spans = splitContourIntoLineSpans(contour, epsilon);
   
-  // Note that iteration order of coordinates in vecOfSeg may not start on contourCoords[0] so
-  // create a map from known line points to the common line slope.
+  // Note that iteration order of coordinates in spans may not start on contourCoords[0] so
+  // create a table of the common line normal for each span.
   
   vector<Point2f> normalUnitVecTable;
   
-  for ( HullLineOrCurveSegment & locSeg : vecOfSeg ) {
-    if (locSeg.isLine) {
-      Point2f slopeVec = locSeg.slope;
-      Point2f normF;
+  for ( ContourSpan & span : spans ) {
+    Point2f normF(0.0f, 0.0f);
+    
+    if (span.isLine) {
+      Point2f slopeVec = span.slope;
       
       // Calculate normal vector
       float tmp = slopeVec.x;
       normF.x = slopeVec.y * -1;
       normF.y = tmp;
       normF *= -1; // invert
-      
-      normalUnitVecTable.push_back(normF);
     }
+    
+    normalUnitVecTable.push_back(normF);
   }
   
   // Util lambda that will determine the slope for a position by ave of L and R slopes
   
   auto aveSlope = [&normalUnitVecTable, &contour, &contourNormals](int offset)->Point2f {
-    const bool debug = true;
+    const bool debug = isDebugTraceEnabled();
     
     if (debug) {
       cout << "aveSlope starting at offset " << offset << endl;
@@ -5291,34 +6794,26 @@ void calcNormalsOnContour(CvSize size,
   
   const int lastContourOffset = (int)contour.size() - 1;
   
-  const bool debugOffsetOutput = true;
+  const bool debugOffsetOutput = isDebugTraceEnabled();
   
-  for ( HullLineOrCurveSegment & locSeg : vecOfSeg ) {
-    if (locSeg.isLine) {
-      auto &pointsVec = locSeg.points;
-      int startEndN;
-      
-      int locContourOffset = locSeg.startContourOffset;
-      
-      // Generate mapping from point to contour offset
-      const int numPoints = (int) pointsVec.size();
-      vector<int> contourOffsetVec(numPoints);
+  for ( ContourSpan & span : spans ) {
+    // Each span offset maps to a contour offset that wraps around
+    
+    const int numPoints = span.end - span.start;
+    vector<int> contourOffsetVec(numPoints);
+    
+    for ( int i = 0; i < numPoints; i++ ) {
+      contourOffsetVec[i] = (span.start + i) % (lastContourOffset + 1);
       
-      for ( int i = 0; i < numPoints; i++ ) {
-        contourOffsetVec[i] = locContourOffset;
-        
-        if (debugOffsetOutput) {
-          cout << "contourOffsetVec[" << i << "] = " << locContourOffset << endl;
-        }
-        
-        if (locContourOffset == lastContourOffset) {
-          locContourOffset = 0;
-        } else {
-          locContourOffset++;
-        }
+      if (debugOffsetOutput) {
+        cout << "contourOffsetVec[" << i << "] = " << contourOffsetVec[i] << endl;
       }
+    }
+    
+    if (span.isLine) {
+      int startEndN;
       
-      // Iterate from line midpoint to edges using offsets into pointsVec
+      // Iterate from line midpoint to edges using offsets into the span
       
       vector<int> pointOffsetVec(numPoints);
       
@@ -5326,45 +6821,22 @@ void calcNormalsOnContour(CvSize size,
         pointOffsetVec[i] = i;
       }
       
-#if defined(DEBUG)
-      assert(numPoints == pointOffsetVec.size());
-#endif // DEBUG
-      
       vector<int> reorderedOffsetVec = iterInsideOut(pointOffsetVec);
       
-      if (pointsVec.size() <= 3) {
-        startEndN = 2;
-      } else if (pointsVec.size() <= 5) {
-        startEndN = 2;
-      } else {
-        startEndN = 2;
-        //startEndN = 1;
-      }
+      startEndN = 2;
       
       for ( int i = 0; i < numPoints; i++ ) {
-#if defined(DEBUG)
-        assert(i >= 0 && i < reorderedOffsetVec.size());
-#endif // DEBUG
-        
         int insideOutOffset = reorderedOffsetVec[i];
         
 #if defined(DEBUG)
-        assert(insideOutOffset >= 0 && insideOutOffset < pointsVec.size());
-#endif // DEBUG
-        
-        Point2i p = pointsVec[insideOutOffset];
-        
-        if (debugOffsetOutput) {
-          cout << "loop i = " << i << " : insideOutOffset " << insideOutOffset << " point " << p << endl;
-        }
-        
-#if defined(DEBUG)
-        assert(i >= 0 && i < contourOffsetVec.size());
+        assert(insideOutOffset >= 0 && insideOutOffset < numPoints);
 #endif // DEBUG
         
         int originalContourOffset = contourOffsetVec[insideOutOffset];
+        Point2i p = contour[originalContourOffset];
         
         if (debugOffsetOutput) {
+          cout << "loop i = " << i << " : insideOutOffset " << insideOutOffset << " point " << p << endl;
           cout << "slope calc " << i << " : originalContourOffset " << originalContourOffset << endl;
         }
         
@@ -5394,21 +6866,11 @@ void calcNormalsOnContour(CvSize size,
     } else {
       // All points on curves treated as average between existing slopes.
       
-      int locContourOffset = locSeg.startContourOffset;
-      
       // FIXME: should curve points be added inside out, so that ave at
       // edges is done before other points?
       
-      vector<Coord> vec = convertPointsToCoords(locSeg.points);
-      
-      for ( Coord c : vec ) {
-        int originalContourOffset = locContourOffset;
-        
-        if (locContourOffset == lastContourOffset) {
-          locContourOffset = 0;
-        } else {
-          locContourOffset++;
-        }
+      for ( int originalContourOffset : contourOffsetVec ) {
+        Coord c = pointToCoord(contour[originalContourOffset]);
         
 #if defined(DEBUG)
         assert(pendingLineEdges.count(originalContourOffset) == 0);
@@ -5449,6 +6911,8 @@ void calcNormalsOnContour(CvSize size,
   
   int contouri = 0;
   
+  allNormalVectors.reserve((int)contour.size(), 3);
+  
   for ( Point2i p : contour ) {
     Point2f normF;
     
@@ -5468,8 +6932,6 @@ void calcNormalsOnContour(CvSize size,
     Point2f normOutside = cF + (normF * 1);
     Point2f normInside = cF + (normF * -1);
     
-    vector<Point2f> vecPoints;
-    
     const bool roundToPixels = false;
     
     if (roundToPixels) {
@@ -5477,11 +6939,11 @@ void calcNormalsOnContour(CvSize size,
       round(normOutside);
     }
     
-    vecPoints.push_back(normInside);
-    vecPoints.push_back(cF);
-    vecPoints.push_back(normOutside);
+    Point2f *vecPoints = allNormalVectors.appendRay(3);
     
-    allNormalVectors.push_back(vecPoints);
+    vecPoints[0] = normInside;
+    vecPoints[1] = cF;
+    vecPoints[2] = normOutside;
     
     contouri += 1;
   }
@@ -5495,12 +6957,10 @@ void calcNormalsOnContour(CvSize size,
     binMat = Mat(size, CV_8UC1);
     binMat = Scalar(0);
     
-    for ( auto &vec : allNormalVectors ) {
-      for ( Point2f p : vec ) {
-        round(p);
-        Point2i pi = p;
-        binMat.at<uint8_t>(pi.y, pi.x) = 0xFF;
-      }
+    for ( Point2f p : allNormalVectors.points ) {
+      round(p);
+      Point2i pi = p;
+      binMat.at<uint8_t>(pi.y, pi.x) = 0xFF;
     }
     
     for ( Point2i p : contour ) {
@@ -5544,10 +7004,10 @@ void calcNormalsOnContour(CvSize size,
     // Render each normal vector as line with arrow at end
     
     for ( int y = 0; y < allNormalVectors.size(); y++) {
-      auto &vec = allNormalVectors[y];
+      const Point2f *vec = allNormalVectors.ray(y);
       
       Point2f p1 = vec[0];
-      Point2f p2 = vec[vec.size() - 1];
+      Point2f p2 = vec[allNormalVectors.rayLength(y) - 1];
       
       if ((1)) {
         // Add a little more to the second vector
@@ -5597,8 +7057,8 @@ generateVectorsThroughPoints(const CvSize &matSize,
                              const vector<Coord> &innerCoords,
                              const vector<Coord> &outerCoords)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     int N1 = (int) innerCoords.size();
@@ -5667,9 +7127,7 @@ generateVectorsThroughPoints(const CvSize &matSize,
         printf("outer coord (%d,%d)\n", p2.x, p2.y);
       }
       
-      vector<Point2i> generatedPoints = generatePointsOnLine(p1, p2);
-      
-      for ( Point2i p : generatedPoints ) {
+      for ( Point2i p : PointsOnLine<int>(p1, p2) ) {
         coords.push_back(pointToCoord(p));
       }
       
@@ -5762,9 +7220,7 @@ generateVectorsThroughPoints(const CvSize &matSize,
         printf("outer halfway coord (%0.3f,%0.3f)\n", outerHalf.x, outerHalf.y);
       }
       
-      vector<Point2f> generatedPoints = generateFloatPointsOnLine(innerHalf, outerHalf);
-      
-      for ( Point2f p : generatedPoints ) {
+      for ( Point2f p : PointsOnLine<float>(innerHalf, outerHalf) ) {
         Point2f rp = p;
         round(rp);
         
@@ -5808,7 +7264,7 @@ generateVectorsThroughPoints(const CvSize &matSize,
         cout << "render vec " << i << endl;
       }
       
-      Vec3b colorVec((rand() % 256), (rand() % 256), (rand() % 256));
+      Vec3b colorVec = PixelToVec3b(randomPixelForIndex(i));
       
       for ( Coord c : coordsInVec ) {
         segmentMat.at<Vec3b>(c.y, c.x) = colorVec;
@@ -5830,35 +7286,30 @@ generateVectorsThroughPoints(const CvSize &matSize,
   return std::move(vecOfVecs);
 }
 
-// Scan region given likely bounds and determine where most accurate region bounds are likely to be
+// The part of clockwiseScanForShapeBounds() that only depends on the region
+// coords: the hull split of the contour, the contour normals and the region center.
 
-void
-clockwiseScanForShapeBounds(const Mat & inputImg,
-                            const Mat & tagsImg,
-                            int32_t tag,
-                            const vector<Coord> &regionCoords,
-                            Mat & mask)
+static void
+calcShapeBoundsGeometry(const Mat & tagsImg,
+                        int32_t tag,
+                        const vector<Coord> &regionCoords,
+                        ShapeBoundsGeometry &geometry)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
-  const bool debugDumpInsideOutsiteExpandStepImages = true;
-  const bool debugDumpInsideOutsiteStepImages = false;
-  const bool debugDumpPolygonSegmentStepImages = true;
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
-  if (debug) {
-    cout << "clockwiseScanForShapeBounds " << tag << endl;
-  }
+  geometry.imageSize = tagsImg.size();
   
   // If the shape is convex then wrap it in a convex hull and simplify the shape with
   // smallish straight lines so that perpendicular lines can be computed as compared
   // to each line segment in order to find the shape normals.
 
-  vector<TypedHullCoords> hullCoordsVec = clockwiseScanOfHullCoords(tagsImg, tag, regionCoords);
+  vector<TypedHullCoords> &hullCoordsVec = geometry.hullCoordsVec;
+  hullCoordsVec = clockwiseScanOfHullCoords(tagsImg, tag, regionCoords);
   
   // Iterate over all sets of coords at the same time and determine
   // the order that coordinates on the contour would be consumed.
   
-  vector<Coord> contourCoords;
+  vector<Coord> &contourCoords = geometry.contourCoords;
   
   for ( TypedHullCoords &typedHullCoords : hullCoordsVec ) {
     auto &coordVec = typedHullCoords.coords;
@@ -5976,7 +7427,7 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
     fnameStream << "srm" << "_tag_" << tag << "_hull_near_points" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -5988,12 +7439,10 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
   if (debugDumpImages) {
     Mat colorMat(tagsImg.size(), CV_8UC3, Scalar(0, 0, 0));
     
+    uint32_t colorIndex = 0;
+    
     for ( TypedHullCoords &typedHullCoords : hullCoordsVec ) {
-      uint32_t pixel = 0;
-      pixel |= (rand() % 256);
-      pixel |= ((rand() % 256) << 8);
-      pixel |= ((rand() % 256) << 16);
-      pixel |= (0xFF << 24);
+      uint32_t pixel = randomPixelForIndex(colorIndex++);
       
       Vec3b vec = PixelToVec3b(pixel);
       
@@ -6307,14 +7756,17 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
       binMat.at<uint8_t>(c.y, c.x) = 0xFF;
     }
     
-    skelReduce(binMat);
+    int32_t originX, originY, regionWidth, regionHeight;
+    bbox(originX, originY, regionWidth, regionHeight, regionCoords);
+    
+    skelReduce(binMat, Rect(originX, originY, regionWidth, regionHeight));
     
     if (debugDumpImages) {
       std::stringstream fnameStream;
       fnameStream << "srm" << "_tag_" << tag << "_region_skel" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, binMat);
+      debugImwrite(fname, binMat);
       cout << "wrote " << fname << endl;
       cout << "" << endl;
     }
@@ -6330,49 +7782,17 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
   // in the mask that means the pixels are not available for an
   // inward scan.
   
-  vector<Point2i> contour = convertCoordsToPoints(contourCoords);
+  vector<Point2i> &contour = geometry.contour;
+  contour = convertCoordsToPoints(contourCoords);
   
-  vector<Point2f> contourNormals;
-  vector<vector<Point2f> > allNormalVectors;
+  vector<Point2f> &contourNormals = geometry.contourNormals;
+  ContourNormalRays &allNormalVectors = geometry.normalVectors;
   
   calcNormalsOnContour(tagsImg.size(), tag, contour, contourNormals, allNormalVectors);
   
-  if (1) {
-    int maxWidth = 0;
-    
-    for ( auto &vec : allNormalVectors ) {
-      int N = (int) vec.size();
-      if (N > maxWidth) {
-        maxWidth = N;
-      }
-    }
-    
-    Mat colorMat((int)allNormalVectors.size(), maxWidth, CV_8UC3, Scalar(0,0,0));
-    
-    for ( int y = 0; y < colorMat.rows; y++) {
-      auto &vec = allNormalVectors[y];
-      int numCols = (int) vec.size();
-      
-      for ( int x = 0; x < numCols; x++) {
-        Point2f p = vec[x];
-        round(p);
-        Point2i c = p;
-        Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
-        colorMat.at<Vec3b>(y, x) = vec;
-      }
-    }
-    
-    std::stringstream fnameStream;
-    fnameStream << "srm" << "_tag_" << tag << "_hull_iter_vec_pixels" << ".png";
-    string fname = fnameStream.str();
-    
-    writeWroteImg(fname, colorMat);
-    cout << "" << endl;
-  }
-  
   // Calculate region center
   
-  Point2i regionCenterP;
+  Point2i &regionCenterP = geometry.regionCenterP;
   
   {
     Mat renderMat(tagsImg.size(), CV_8UC1, Scalar(0));
@@ -6406,6 +7826,88 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
       cout << "";
     }
   }
+}
+
+// Scan region given likely bounds and determine where most accurate region bounds are likely to be
+
+void
+clockwiseScanForShapeBounds(const Mat & inputImg,
+                            const Mat & tagsImg,
+                            int32_t tag,
+                            const vector<Coord> &regionCoords,
+                            Mat & mask,
+                            ShapeBoundsGeometryCache *geometryCache)
+{
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
+  const bool debugDumpInsideOutsiteExpandStepImages = isDebugTagImagesEnabled(tag);
+  const bool debugDumpInsideOutsiteStepImages = false;
+  const bool debugDumpPolygonSegmentStepImages = isDebugTagImagesEnabled(tag);
+  
+  if (debug) {
+    cout << "clockwiseScanForShapeBounds " << tag << endl;
+  }
+  
+  TraceZone traceZone("clockwiseScanForShapeBounds", tag, regionCoords.size());
+  
+  std::shared_ptr<const ShapeBoundsGeometry> geometry;
+  
+  if (geometryCache != NULL) {
+    geometry = geometryCache->lookup(tag, tagsImg.size(), regionCoords);
+  }
+  
+  if (!geometry) {
+    std::shared_ptr<ShapeBoundsGeometry> computed(new ShapeBoundsGeometry());
+    calcShapeBoundsGeometry(tagsImg, tag, regionCoords, *computed);
+    
+    if (geometryCache != NULL) {
+      geometryCache->insert(tag, regionCoords, computed);
+    }
+    
+    geometry = computed;
+  } else if (debug) {
+    cout << "clockwiseScanForShapeBounds " << tag << " reused cached shape geometry" << endl;
+  }
+  
+  const vector<Coord> &contourCoords = geometry->contourCoords;
+  const vector<Point2i> &contour = geometry->contour;
+  const vector<Point2f> &contourNormals = geometry->contourNormals;
+  const ContourNormalRays &allNormalVectors = geometry->normalVectors;
+  const Point2i regionCenterP = geometry->regionCenterP;
+  
+  if (1) {
+    int maxWidth = 0;
+    
+    for ( int y = 0; y < allNormalVectors.size(); y++) {
+      int N = allNormalVectors.rayLength(y);
+      if (N > maxWidth) {
+        maxWidth = N;
+      }
+    }
+    
+    Mat colorMat((int)allNormalVectors.size(), maxWidth, CV_8UC3, Scalar(0,0,0));
+    
+    for ( int y = 0; y < colorMat.rows; y++) {
+      const Point2f *vec = allNormalVectors.ray(y);
+      int numCols = allNormalVectors.rayLength(y);
+      
+      for ( int x = 0; x < numCols; x++) {
+        Point2f p = vec[x];
+        round(p);
+        Point2i c = p;
+        Vec3b vec = inputImg.at<Vec3b>(c.y, c.x);
+        colorMat.at<Vec3b>(y, x) = vec;
+      }
+    }
+    
+    std::stringstream fnameStream;
+    fnameStream << "srm" << "_tag_" << tag << "_hull_iter_vec_pixels" << ".png";
+    string fname = fnameStream.str();
+    
+    writeWroteImg(fname, colorMat);
+    cout << "" << endl;
+  }
+  
   
   // ---------------------------------------------------------------------------------------------
   // Inside
@@ -6422,7 +7924,7 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
     
     for ( int contouri = 0; contouri < maxContouri; contouri++ ) {
       //Coord c = contourCoords[contouri];
-      vector<Point2f> normalVecPoints = allNormalVectors[contouri];
+      const Point2f *normalVecPoints = allNormalVectors.ray(contouri);
       
       Point2f insideF = normalVecPoints[0];
       Point2f onF = normalVecPoints[1];
@@ -6474,7 +7976,7 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
     // are the same.
     
     auto doCoordsConvergeToSamePixel = [](const Mat & pixelMat, const vector<Coord> &coords, uint32_t *pixelPtr)->bool {
-      const bool debug = true;
+      const bool debug = isDebugTraceEnabled();
       const bool debugPrintPixels = false;
       
       if (coords.size() == 0) {
@@ -6908,7 +8410,7 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
         
         // dMax is largest distance a line could extend for
         
-        vector<Point2f> normalVecPoints = allNormalVectors[contouri];
+        const Point2f *normalVecPoints = allNormalVectors.ray(contouri);
         
         Point2f onF = normalVecPoints[1];
         Point2f outsideF = normalVecPoints[2];
@@ -7027,9 +8529,7 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
             printf("gen inside line from (%5d,%5d) to (%5d,%5d)\n", p1.x, p1.y, p2.x, p2.y);
           }
           
-          vector<Point2i> generatedPoints = generatePointsOnLine(p1, p2);
-          
-          for ( Point2i p : generatedPoints ) {
+          for ( Point2i p : PointsOnLine<int>(p1, p2) ) {
             innerCoords.push_back(pointToCoord(p));
           }
         }
@@ -7068,9 +8568,7 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
         if (arePointsOnEasyHorizontal) {
           // Line is either vertical or horizontal
           
-          vector<Point2i> generatedPoints = generatePointsOnLine(p1, p2);
-          
-          for ( Point2i p : generatedPoints ) {
+          for ( Point2i p : PointsOnLine<int>(p1, p2) ) {
             outerCoords.push_back(pointToCoord(p));
           }
         } else {
@@ -8043,7 +9541,7 @@ clockwiseScanForShapeBounds(const Mat & inputImg,
     
     for ( int contouri = 0; contouri < maxContouri; contouri++ ) {
       //Coord c = contourCoords[contouri];
-      vector<Point2f> normalVecPoints = allNormalVectors[contouri];
+      const Point2f *normalVecPoints = allNormalVectors.ray(contouri);
       
       Point2f insideF = normalVecPoints[0];
       Point2f onF = normalVecPoints[1];
@@ -8243,7 +9741,7 @@ getEdgesInRegion(SuperpixelImage &spImage,
                  int32_t tag,
                  const vector<Coord> &coords)
 {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
   // Generate vectors that determine how different colors that are nearby each other
   // in 2D space map to other nearby colors. It is only possible to determine that
@@ -8357,9 +9855,9 @@ contractOrExpandRegion(const Mat & inputImg,
                        int numPixels,
                        vector<Coord> &outCoords)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
-  const bool debugDumpInputStateImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
+  const bool debugDumpInputStateImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "contractOrExpandRegion " << tag << " with N = " << coords.size() << " and isExpand " << isExpand << endl;
@@ -8424,7 +9922,7 @@ contractOrExpandRegion(const Mat & inputImg,
     fnameStream << "srm" << "_tag_" << tag << "_srm_region_" << expandStr << "_input" << numPixels << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, inBoolMat);
+    debugImwrite(fname, inBoolMat);
     cout << "wrote " << fname << endl;
     cout << "";
   }
@@ -8486,7 +9984,7 @@ contractOrExpandRegion(const Mat & inputImg,
       tmpMat.at<uint8_t>(c.y, c.x) = 0xFF;
     }
     
-    imwrite(fname, tmpMat);
+    debugImwrite(fname, tmpMat);
     cout << "wrote " << fname << endl;
     cout << "";
   }
@@ -8515,7 +10013,7 @@ contractOrExpandRegion(const Mat & inputImg,
       fnameStream << "srm" << "_tag_" << tag << "_srm_region_" << expandStr << "_alpha_mask" << numPixels << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, alphaMaskResultImg);
+      debugImwrite(fname, alphaMaskResultImg);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -8539,417 +10037,524 @@ contractOrExpandRegion(const Mat & inputImg,
   return retval;
 }
 
-// Invoked for each child of a container, returns the tags that are direct children of tag
+// Containment is a depth first search over the superpixel neighbors. When a
+// superpixel is visited each neighbor that is not yet in the tree and not yet
+// claimed is claimed as a child, ordered by the offset of the superpixel among
+// the outermost superpixels. The claimed children are then visited one after
+// another, so that a claimed child cannot be taken by the search from a sibling.
+// The outermost superpixels are all claimed before the first is visited. The
+// claimed children of all the frames on the search stack are kept in one
+// pending vector, a frame owns the range of the vector it appended.
 
-void
-recurseSuperpixelContainmentImpl(SuperpixelImage &spImage,
-                                 unordered_map<int32_t, std::vector<int32_t> > &map,
-                                 int32_t tag,
-                                unordered_map<int32_t, int32_t> &superpixelTagToOffsetMap)
+typedef struct {
+  int32_t node;
+  int32_t start;
+  int32_t next;
+  int32_t end;
+} ContainmentFrame;
+
+void buildSuperpixelContainmentTree(SuperpixelImage &spImage,
+                                    const Mat &tagsImg,
+                                    SuperpixelContainmentTree &tree)
 {
-  const bool debug = true;
-  
-  Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+  const bool debug = isDebugTraceEnabled();
   
-  if (debug) {
-    cout << "recurseSuperpixelContainmentImpl for tag " << tag << " with N = " << spPtr->coords.size() << endl;
-  }
-  
-#if defined(DEBUG)
-  if (map.count(tag) > 0) {
-    cout << " already processed tag " << tag << endl;
-    assert(0);
-  }
-#endif // DEBUG
-  
-  // Before processing neightbors, mark this superpixel as processed
-  
-  vector<int32_t> &children = map[tag];
+  // Determine the outermost set of tags by gathering all the tags along the
+  // edges of the image. In the tricky case where more than 1 superpixel is a
+  // sibling at the toplevel this logic figures out where to begin. When each
+  // superpixel has a cached bbox, as after SuperpixelImage::parseLabels() with
+  // the SRM label bounds, a superpixel touches an edge exactly when its bbox
+  // does so no pixels are read. Otherwise only the 4 edges are scanned.
   
-  auto &neighborsSet = spImage.edgeTable.getNeighborsSet(tag);
-
-  if (debug) {
-    cout << "neighbors: " << endl;
-    
-    for ( int32_t neighborTag : neighborsSet ) {
-      cout << neighborTag << endl;
-    }
-  }
-  
-  // Order neighborsSet by the offset in superpixelTagToOffsetMap
+  set<int32_t> rootSet;
   
-  // Filter neighborsSet into a set of siblings by removing
-  // the neighbors that are known to already be processed.
+  const int width = tagsImg.cols;
+  const int height = tagsImg.rows;
   
-  vector<int32_t> siblings;
+  bool bboxValid = true;
   
-  for ( int32_t neighborTag : neighborsSet ) {
-    if (debug) {
-      cout << "check for unprocessed neighbor " << neighborTag << endl;
-    }
-    
-    if (map.count(neighborTag) > 0) {
-      if (debug) {
-        cout << "already processed neighbor tag " << neighborTag << endl;
-      }
-    } else {
-      siblings.push_back(neighborTag);
+  for ( auto &pair : spImage.tagToSuperpixelMap ) {
+    Superpixel *spPtr = pair.second;
+    if (spPtr->bboxNumCoords == 0 || spPtr->bboxNumCoords != spPtr->coords.size()) {
+      bboxValid = false;
+      break;
     }
   }
   
-  // order siblings by superpixelTagToOffsetMap
-  sort(begin(siblings), end(siblings),
-       [&](int tag1, int tag2) {
-         int32_t offset1 = superpixelTagToOffsetMap[tag1];
-         int32_t offset2 = superpixelTagToOffsetMap[tag2];
-         return offset1 < offset2;
-       });
-  
-  if (debug) {
-    int offset = 0;
-    
-    for ( int32_t siblingTag : siblings ) {
-      Superpixel *spPtr = spImage.getSuperpixelPtr(siblingTag);
-      
-      printf("sibling[%5d] : %d contains N = %d coords\n", offset, siblingTag, (int)spPtr->coords.size());
+  if (bboxValid) {
+    for ( auto &pair : spImage.tagToSuperpixelMap ) {
+      const Rect &bbox = pair.second->cachedBbox;
       
-      offset += 1;
+      if (bbox.x == 0 || bbox.y == 0 || (bbox.x + bbox.width) == width || (bbox.y + bbox.height) == height) {
+        rootSet.insert(pair.first);
+      }
     }
-  }
-  
-  // FIXME: might be better to impl siblings as a stack instead of a vector if N is large
-  
-  // Iterate over neighbors and recursively process, note that any
-  // other siblings are inserted into the processed map in order
-  // to properly handle recursion WRT siblings.
-
-  while ( 1 ) {
-    int32_t neighborTag;
+  } else {
+    int32_t lastTag = 0;
     
-    {
-      // Scope ensures that iterators are released before loop body
-      auto it = begin(siblings);
-      auto itEnd = end(siblings);
+    auto addEdgeTag = [&](int x, int y) {
+      int32_t tag = readTag(tagsImg, x, y);
       
-      if (it == itEnd) {
-        break;
+      if (tag != lastTag) {
+        rootSet.insert(tag);
       }
-      
-      neighborTag = *it;
-      
-      siblings.erase(it);
-    }
+      lastTag = tag;
+    };
     
-    if (debug) {
-      cout << "process neighbor " << neighborTag << endl;
+    for ( int x = 0; x < width; x++ ) {
+      addEdgeTag(x, 0);
     }
     
-    children.push_back(neighborTag);
-    
-    for ( int32_t sibling : siblings ) {
-#if defined(DEBUG)
-      assert(sibling != neighborTag);
-      assert(map.count(sibling) == 0);
-#endif // DEBUG
-      map[sibling] = vector<int32_t>();
+    for ( int y = 1; y < (height-1); y++ ) {
+      addEdgeTag(0, y);
     }
     
-    // Recurse into neighbors of neighbor at this point
-    
-    recurseSuperpixelContainmentImpl(spImage, map, neighborTag, superpixelTagToOffsetMap);
-    
-    for ( int32_t sibling : siblings ) {
-#if defined(DEBUG)
-      assert(sibling != neighborTag);
-      assert(map.count(sibling) > 0);
-      assert(map[sibling].size() == 0);
-#endif // DEBUG
-      map.erase(sibling);
+    if (width > 1) {
+      for ( int y = 1; y < (height-1); y++ ) {
+        addEdgeTag(width-1, y);
+      }
     }
-  }
-
-#if defined(DEBUG)
-  assert(siblings.size() == 0);
-#endif // DEBUG
-
-  if (debug) {
-    cout << "recurseSuperpixelContainmentImpl for " << tag << " finished with children: " << endl;
     
-    for ( int32_t childTag : children ) {
-      cout << childTag << endl;
+    if (height > 1) {
+      for ( int x = 0; x < width; x++ ) {
+        addEdgeTag(x, height-1);
+      }
     }
   }
   
-  return;
-}
-
-// Recurse into each superpixel and determine the children of each superpixel.
-
-std::vector<int32_t>
-recurseSuperpixelContainment(SuperpixelImage &spImage,
-                             const Mat &tagsImg,
-                             unordered_map<int32_t, std::vector<int32_t> > &map)
-{
-  const bool debug = false;
-
-  set<int32_t> rootSet;
-  vector<int32_t> rootTags;
+  // Each superpixel gets a compact node index in decreasing size order
   
-  // Determine the outermost set of tags by gathering all the tags along the edges of the image. In the
-  // tricky case where more than 1 superpixel is a sibling at the toplevel this logic figures out where
-  // to being with the recursion.
+  tree.nodeTags = spImage.sortSuperpixelsBySize();
   
-  int width = tagsImg.cols;
-  int height = tagsImg.rows;
+  const int32_t numNodes = (int32_t) tree.nodeTags.size();
   
-  int32_t lastTag = 0;
+  int32_t maxTag = 0;
+  for ( int32_t tag : tree.nodeTags ) {
+    maxTag = maxi(maxTag, tag);
+  }
   
-  for ( int y = 0; y < height; y++ ) {
-    bool isFirstRow = (y == 0);
-    bool isLastRow = (y == (height-1));
-    
-    for ( int x = 0; x < width; x++ ) {
-      bool isFirstCol = (x == 0);
-      bool isLastCol = (x == (width-1));
-      
-      if (isFirstRow || isLastRow) {
-        // All pixels in first and last row processed
-        
-        if (debug) {
-          cout << "check " << x << "," << y << endl;
-        }
-      } else if (isFirstCol || isLastCol) {
-        // All pixels in first and last col processed
-        
-        if (debug) {
-          cout << "check " << x << "," << y << endl;
-        }
-      } else {
-        // Not on the edges
-        
-        if (debug) {
-          cout << "skip " << x << "," << y << endl;
-        }
-        
-        continue;
-      }
-      
-      Vec3b vec = tagsImg.at<Vec3b>(y, x);
-      int32_t tag = Vec3BToUID(vec);
-      
-      if (tag != lastTag) {
-        if (debug) {
-          cout << "check " << x << "," << y << " with tag " << tag << endl;
-        }
-        
-        rootSet.insert(tag);
-      }
-      lastTag = tag;
-    }
+  const bool denseTags = (maxTag < (1 << 20)) || (maxTag < (4 * numNodes));
+  
+  vector<int32_t> &denseTagToNode = tree.denseTagToNode;
+  unordered_map<int32_t, int32_t> &sparseTagToNode = tree.sparseTagToNode;
+  
+  denseTagToNode.clear();
+  sparseTagToNode.clear();
+  
+  if (denseTags) {
+    denseTagToNode.assign(maxTag + 1, -1);
   }
   
-  // Sort by superpixel size and then determine order by decreasing size
+  for ( int32_t node = 0; node < numNodes; node++ ) {
+    if (denseTags) {
+      denseTagToNode[tree.nodeTags[node]] = node;
+    } else {
+      sparseTagToNode[tree.nodeTags[node]] = node;
+    }
+  }
   
-  vector<int32_t> sortedSuperpixelTags = spImage.sortSuperpixelsBySize();
-
-  // Map superpixel UID to the offset in the sorted list, smaller offset
-  // means that the superpixel is larger.
+  auto tagToNode = [&](int32_t tag)->int32_t {
+    if (denseTags) {
+      return denseTagToNode[tag];
+    } else {
+      return sparseTagToNode[tag];
+    }
+  };
   
-  unordered_map<int32_t, int32_t> superpixelTagToOffsetMap;
+  // Offset of each outermost superpixel in the rootSet order, the other
+  // superpixels have the offset 0.
   
-//  unordered_map<int32_t,int32_t> rootTagToSize;
+  vector<int32_t> rootOffsets(numNodes, 0);
   
   {
     int offset = 0;
     
     for ( int32_t tag : rootSet ) {
-      superpixelTagToOffsetMap[tag] = offset;
+      rootOffsets[tagToNode(tag)] = offset;
       offset += 1;
     }
   }
   
-  for ( int32_t tag : sortedSuperpixelTags ) {
-    if (superpixelTagToOffsetMap.count(tag) > 0) {
-      // This superpixel is in rootSet
-      rootTags.push_back(tag);
+  tree.parents.assign(numNodes, -1);
+  tree.firstChildren.assign(numNodes, -1);
+  tree.nextSiblings.assign(numNodes, -1);
+  tree.rootNodes.clear();
+  
+  vector<int32_t> lastChildren(numNodes, -1);
+  
+  // A node is unvisited, claimed as the child of a visited node, or visited
+  
+  const uint8_t unvisitedState = 0;
+  const uint8_t claimedState = 1;
+  const uint8_t visitedState = 2;
+  
+  vector<uint8_t> states(numNodes, unvisitedState);
+  
+  for ( int32_t tag : rootSet ) {
+    states[tagToNode(tag)] = claimedState;
+  }
+  
+  for ( int32_t node = 0; node < numNodes; node++ ) {
+    if (states[node] == claimedState) {
+      tree.rootNodes.push_back(node);
     }
   }
   
-  sortedSuperpixelTags = vector<int32_t>(); // Dealloc possibly large list
+  assert(tree.rootNodes.size() == rootSet.size());
   
-  assert(rootTags.size() == rootSet.size());
-
-  set<int32_t> siblings;
-  for ( int32_t tag : rootTags ) {
-    siblings.insert(tag);
-  }
+  vector<int32_t> pending;
+  vector<ContainmentFrame> frames;
   
-  for ( int32_t tag : rootTags ) {
-    siblings.erase(tag);
+  auto visit = [&](int32_t node) {
+    states[node] = visitedState;
     
-    for ( int32_t sibling : siblings ) {
-      if (debug) {
-        cout << "sibling " << sibling << endl;
+    int32_t start = (int32_t) pending.size();
+    
+    for ( int32_t neighborTag : spImage.edgeTable.getNeighborsSet(tree.nodeTags[node]) ) {
+      int32_t neighborNode = tagToNode(neighborTag);
+      
+      if (states[neighborNode] == unvisitedState) {
+        pending.push_back(neighborNode);
       }
-#if defined(DEBUG)
-      assert(map.count(sibling) == 0);
-#endif
-      map[sibling] = vector<int32_t>();
     }
     
-    recurseSuperpixelContainmentImpl(spImage, map, tag, superpixelTagToOffsetMap);
+    sort(pending.begin() + start, pending.end(),
+         [&](int32_t node1, int32_t node2) {
+           return rootOffsets[node1] < rootOffsets[node2];
+         });
     
-    for ( int32_t sibling : siblings ) {
-#if defined(DEBUG)
-      assert(map.count(sibling) > 0);
-      assert(map[sibling].size() == 0);
-#endif
-
-      map.erase(sibling);
+    for ( auto it = pending.begin() + start; it != pending.end(); ++it ) {
+      states[*it] = claimedState;
+    }
+    
+    ContainmentFrame frame;
+    frame.node = node;
+    frame.start = start;
+    frame.next = start;
+    frame.end = (int32_t) pending.size();
+    frames.push_back(frame);
+  };
+  
+  for ( int32_t rootNode : tree.rootNodes ) {
+    visit(rootNode);
+    
+    while (!frames.empty()) {
+      ContainmentFrame &frame = frames.back();
+      
+      if (frame.next == frame.end) {
+        pending.resize(frame.start);
+        frames.pop_back();
+        continue;
+      }
+      
+      int32_t parent = frame.node;
+      int32_t child = pending[frame.next++];
+      
+      tree.parents[child] = parent;
+      
+      if (lastChildren[parent] == -1) {
+        tree.firstChildren[parent] = child;
+      } else {
+        tree.nextSiblings[lastChildren[parent]] = child;
+      }
+      lastChildren[parent] = child;
+      
+      visit(child);
     }
-
   }
   
-  return rootTags;
+  if (debug) {
+    cout << "containment tree with " << tree.rootNodes.size() << " roots for " << numNodes << " superpixels" << endl;
+  }
 }
 
-// Segment an input image with multiple passes of SRM approach and place the
-// result tags in tagsMat.
-
-bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat) {
-  // Run SRM logic to generate initial segmentation based on statistical "alikeness".
-  // Very large regions are likely to be very alike or even contain many pixels that
-  // are identical.
-  
-  const bool debugWriteIntermediateFiles = false;
+void SuperpixelContainmentTree::unlinkNode(int32_t node)
+{
+  const int32_t parent = parents[node];
   
-  //    double Q = 16.0;
-  //    double Q = 32.0;
-  //    double Q = 64.0; // Not too small
-  double Q = 128.0; // keeps small circles together
-  //    double Q = 256.0;
-  //    double Q = 512.0;
+  if (parent == -1) {
+    auto it = find(rootNodes.begin(), rootNodes.end(), node);
+    assert(it != rootNodes.end());
+    rootNodes.erase(it);
+    return;
+  }
   
-  //double Qmore = Q + 128.0; // break up into more regions
-  //double Qmore = 512.0; // break up into more regions
+  int32_t prev = -1;
   
-  Mat srmTags1 = generateSRM(inputImg, Q);
+  for ( int32_t child = firstChildren[parent]; child != node; child = nextSiblings[child] ) {
+    assert(child != -1);
+    prev = child;
+  }
   
-//  Mat srmTags2 = generateSRM(inputImg, Qmore);
+  if (prev == -1) {
+    firstChildren[parent] = nextSiblings[node];
+  } else {
+    nextSiblings[prev] = nextSiblings[node];
+  }
   
-  // Collect the more precise segmentations into groups
+  nextSiblings[node] = -1;
+}
+
+void SuperpixelContainmentTree::spliceChildren(int32_t node)
+{
+  const int32_t parent = parents[node];
+  const int32_t firstChild = firstChildren[node];
   
-  // Alloc object on stack
-  SuperpixelImage spImage;
+  assert(parent != -1);
   
-  bool worked = SuperpixelImage::parse(srmTags1, spImage);
+  if (firstChild == -1) {
+    unlinkNode(node);
+    return;
+  }
   
-  if (!worked) {
-    return false;
+  int32_t lastChild = -1;
+  
+  for ( int32_t child = firstChild; child != -1; child = nextSiblings[child] ) {
+    parents[child] = parent;
+    lastChild = child;
   }
   
-  if ((1)) {
-    // Bypass second stage SRM
-    
-    tagsMat = srmTags1;
-
+  int32_t prev = -1;
+  
+  for ( int32_t child = firstChildren[parent]; child != node; child = nextSiblings[child] ) {
+    assert(child != -1);
+    prev = child;
   }
   
-  // Check input coming from the SRM process for the difficult to deal with condition
-  // where two regions that are not 8 connected are assigned the same tag. This
-  // makes it impossible to process correctly so each superpixel region needs to
-  // be test via a flood fill to make sure that no disconnected pixels are found.
+  nextSiblings[lastChild] = nextSiblings[node];
   
-  if (1) {
+  if (prev == -1) {
+    firstChildren[parent] = firstChild;
+  } else {
+    nextSiblings[prev] = firstChild;
+  }
+  
+  firstChildren[node] = -1;
+  nextSiblings[node] = -1;
+}
+
+void SuperpixelContainmentTree::mergeNodes(int32_t srcTag, int32_t dstTag)
+{
+  const int32_t src = findNode(srcTag);
+  const int32_t dst = findNode(dstTag);
+  
+  assert(src != -1 && dst != -1 && src != dst);
+  
+  // True when src contains dst, the children of src then cannot be appended
+  // to dst since that would make dst contain one of its parents.
+  
+  bool srcContainsDst = false;
+  
+  for ( int32_t parent = parents[dst]; parent != -1; parent = parents[parent] ) {
+    if (parent == src) {
+      srcContainsDst = true;
+      break;
+    }
+  }
+  
+  if (parents[src] == dst) {
+    spliceChildren(src);
+  } else if (srcContainsDst) {
+    // The children of dst take the place of dst among the children of its
+    // parent, then dst takes the place of src with all the children of src.
     
-    RegionRemerger remerger(inputImg);
+    spliceChildren(dst);
     
-    vector<int32_t> sortedSuperpixelTags = spImage.sortSuperpixelsBySize();
+    firstChildren[dst] = firstChildren[src];
     
-    Mat floodMask = remerger.maskMat.clone();
+    for ( int32_t child = firstChildren[dst]; child != -1; child = nextSiblings[child] ) {
+      parents[child] = dst;
+    }
     
-    //Mat outMask = remerger.maskMat.clone();
+    const int32_t parent = parents[src];
     
-    for ( auto it = begin(sortedSuperpixelTags); it != end(sortedSuperpixelTags); ) {
-      int32_t tag = *it;
-      
-      if (1) {
-        cout << "iter tag " << tag << endl;
-      }
-
-      floodMask = Scalar(0);
-      
-      // FIXME: not strictly needed since floodFillMask() clears
-      //outMask = Scalar(0);
-      
-      // Find bbox for this superpixel region
-      
-      Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
-      
-//      int32_t originX, originY, regionWidth, regionHeight;
-//      bbox(originX, originY, regionWidth, regionHeight, spPtr->coords);
-//      Rect roiRect(originX, originY, regionWidth, regionHeight);
-
-      // Generate flood fill in mask based on input
-      
-      for (Coord c : spPtr->coords) {
-        floodMask.at<uint8_t>(c.y, c.x) = 0xFF;
-      }
-      
-      // Set remerger.maskMat for any already merged superpixels
-      
-      remerger.mergeMatToMask();
-      
-      for_each_byte(floodMask, remerger.maskMat, [](uint8_t* bytePtr1, const uint8_t* bytePtr2) {
-        if (*bytePtr2) {
-          *bytePtr1 = 0x0;
-        }
-      });
-      
-      // FIXME: could make faster with int count on, instead of findNonZero.
-      // Could also manintain a count of pixels consumed for each superpixel.
-      
-//      Point2i startPoint = coordToPoint(spPtr->coords[0]);
+    parents[dst] = parent;
+    
+    if (parent == -1) {
+      *find(rootNodes.begin(), rootNodes.end(), src) = dst;
+    } else {
+      int32_t prev = -1;
       
-      vector<Point> locations;
-      findNonZero(floodMask, locations);
-      if (locations.size() == 0) {
-        // All pixels in specific superpixel now consumed
-        ++it;
-        continue;
+      for ( int32_t child = firstChildren[parent]; child != src; child = nextSiblings[child] ) {
+        prev = child;
       }
-      Point2i startPoint = locations[0];
       
-      // Invert so that black pixels get filled, white means do not expand
-      
-      binMatInvert(floodMask);
-      
-      floodMask.at<uint8_t>(startPoint.y, startPoint.x) = 0xFF;
-      
-      // FIXME: what about pixels that were not merged from same superpixel ?
-      
-      int numFilled = floodFillMask(floodMask, remerger.maskMat, startPoint, 8);
-      
-      if (numFilled == 0) {
-        // When no more pixels can be filled from this superpixel, advance to next one
-        ++it;
+      if (prev == -1) {
+        firstChildren[parent] = dst;
       } else {
-        remerger.mergeFromMask();
+        nextSiblings[prev] = dst;
       }
     }
     
-    remerger.mergeLeftovers(tagsMat);
+    nextSiblings[dst] = nextSiblings[src];
+  } else {
+    unlinkNode(src);
+    
+    int32_t lastChild = -1;
+    
+    for ( int32_t child = firstChildren[dst]; child != -1; child = nextSiblings[child] ) {
+      lastChild = child;
+    }
     
-    // State of remerged Mat should now be ready to use
+    for ( int32_t child = firstChildren[src]; child != -1; child = nextSiblings[child] ) {
+      parents[child] = dst;
+    }
     
-    tagsMat = remerger.mergeMat;
+    if (lastChild == -1) {
+      firstChildren[dst] = firstChildren[src];
+    } else {
+      nextSiblings[lastChild] = firstChildren[src];
+    }
+  }
+  
+  parents[src] = -1;
+  firstChildren[src] = -1;
+  nextSiblings[src] = -1;
+  
+  if (!denseTagToNode.empty()) {
+    denseTagToNode[srcTag] = -1;
+  } else {
+    sparseTagToNode.erase(srcTag);
+  }
+}
+
+void mergeEdgeInContainmentTree(SuperpixelImage &spImage,
+                                SuperpixelContainmentTree &tree,
+                                SuperpixelEdge &edge)
+{
+  const int32_t tagA = edge.A;
+  const int32_t tagB = edge.B;
+  
+  spImage.mergeEdge(edge);
+  
+  // The smaller superpixel was merged into the larger one
+  
+  if (spImage.getSuperpixelPtr(tagA) == NULL) {
+    tree.mergeNodes(tagA, tagB);
+  } else {
+    tree.mergeNodes(tagB, tagA);
+  }
+}
+
+// Recurse into each superpixel and determine the children of each superpixel.
+
+std::vector<int32_t>
+recurseSuperpixelContainment(SuperpixelImage &spImage,
+                             const Mat &tagsImg,
+                             unordered_map<int32_t, std::vector<int32_t> > &map)
+{
+  SuperpixelContainmentTree tree;
+  
+  buildSuperpixelContainmentTree(spImage, tagsImg, tree);
+  
+  for ( int32_t node : tree.rootNodes ) {
+    tree.getChildTags(node, map[tree.nodeTags[node]]);
+  }
   
+  for ( int32_t node = 0; node < (int32_t) tree.nodeTags.size(); node++ ) {
+    if (tree.parents[node] != -1) {
+      tree.getChildTags(node, map[tree.nodeTags[node]]);
+    }
   }
+  
+  return tree.getRootTags();
+}
+
+// Segment an input image with multiple passes of SRM approach and place the
+// result tags in tagsMat.
+
+bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat) {
+  SRMContext srmContext;
+  return srmMultiSegment(inputImg, tagsMat, srmContext);
+}
+
+bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat, SRMContext & srmContext, Mat *labelsMat, vector<int32_t> *labelCounts,
+                     vector<Rect> *labelBounds) {
+  // Run SRM logic to generate initial segmentation based on statistical "alikeness".
+  // Very large regions are likely to be very alike or even contain many pixels that
+  // are identical.
+  
+  const bool debugWriteIntermediateFiles = false;
+  
+  // The default Q of 128 keeps small circles together, 64 is not too small
+  // and 256 and 512 break up into more regions.
+  
+  double Q = srmContext.getQ();
+  
+  //double Qmore = Q + 128.0; // break up into more regions
+  //double Qmore = 512.0; // break up into more regions
+  
+  // SRM label mode generates a unique label for each region, a region that
+  // has the same average color as a region that is not connected still gets
+  // its own label so no flood fill disambiguation of the results is needed.
+  
+  // A single SRM context is used for each pass so that the SRM buffers are
+  // allocated once no matter how many Q values are run. A caller that segments
+  // many images passes the same context for each image.
+  
+  // Large images are segmented as tiles on multiple threads. The tiles are a
+  // fixed number of rows and are used no matter how many threads there are,
+  // so that the tags are the same with any number of threads.
+  
+  const int tiledSRMMinNumPixels = 4096 * 4096;
+  const int tiledSRMTileRows = 512;
+  
+  Mat srmLabels;
+  
+  int32_t numRegions;
+  
+  // A target region range searches for Q with the full image pairs, so the
+  // image is not tiled in that case.
+  
+  if (srmContext.hasTargetRegionRange()) {
+    numRegions = generateSRMLabelsAutoQ(inputImg, srmContext.getMinRegions(), srmContext.getMaxRegions(),
+                                        srmLabels, srmContext, &Q, labelCounts, labelBounds);
     
+    if (debugWriteIntermediateFiles) {
+      cout << "auto Q " << Q << " generated " << numRegions << " regions" << endl;
+    }
+  } else if ((inputImg.rows * inputImg.cols) >= tiledSRMMinNumPixels) {
+    numRegions = generateSRMLabelsTiled(inputImg, Q, srmLabels, srmContext, tiledSRMTileRows, labelCounts, labelBounds);
+  } else {
+    numRegions = generateSRMLabels(inputImg, Q, srmLabels, srmContext, labelCounts, labelBounds);
+  }
+  
+  srmContext.setLastQ(Q);
+  
+  if (numRegions >= (0x00FFFFFF - 1)) {
+    cerr << "error : SRM generated " << numRegions << " regions which does not fit into a 24 bit tag" << endl;
+    return false;
+  }
+  
+  // Note that tags start at 1 so that the zero tag is never used
+  
+  labelsToTags(srmLabels, tagsMat, 1);
+  
+  if (labelsMat != NULL) {
+    *labelsMat = srmLabels;
+  }
+  
+  Mat srmTags1 = tagsMat;
+  
+  // Note that a second more precise segmentation can be generated along with
+  // the first one via generateSRMMultiLabels() so that the pairs are only
+  // sorted once, for example Qs = { Q, Qmore }.
+  
+  
   // -----------------------------------------------------------------------------
   
   if ((0)) {
   
+  // Collect the more precise segmentations into groups
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(srmTags1, spImage);
+  
+  if (!worked) {
+    return false;
+  }
+  
   // Scan each grouping to determine when pixels identified as being in
   // the same group in srmTags1 are not included in the group in srmTags2.
   
@@ -8982,7 +10587,7 @@ bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat) {
       fnameStream << "srm_multi" << "_tag_" << tag << "_check_region_bbox" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, roiInputMat);
+      debugImwrite(fname, roiInputMat);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -9008,7 +10613,7 @@ bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat) {
       fnameStream << "srm_multi" << "_tag_" << tag << "_check_region_alpha_input" << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, alphaMaskedRegionPixels);
+      debugImwrite(fname, alphaMaskedRegionPixels);
       cout << "wrote " << fname << endl;
       cout << "";
     }
@@ -9109,3 +10714,1627 @@ bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat) {
 
   return true;
 }
+
+// Content hash of the pixels in a Mat, the size and type are hashed first so that
+// the same bytes in a different layout do not have the same hash.
+
+uint32_t matContentHash(const Mat &mat)
+{
+  int32_t header[3] = { mat.rows, mat.cols, mat.type() };
+  
+  uint32_t hash = my_adler32(1, (unsigned char const *) header, sizeof(header), 0);
+  
+  const uint32_t rowNumBytes = (uint32_t) (mat.cols * mat.elemSize());
+  
+  for ( int y = 0; y < mat.rows; y++ ) {
+    hash = my_adler32(hash, mat.ptr<unsigned char>(y), rowNumBytes, 0);
+  }
+  
+  return hash;
+}
+
+void ClusteringCombineArtifacts::setInputHash(uint32_t hash)
+{
+  if (hash != inputHash) {
+    clear();
+    inputHash = hash;
+  }
+}
+
+void ClusteringCombineArtifacts::clear()
+{
+  inputHash = 0;
+  srmTags = Mat();
+  srmInsideOutOrder.clear();
+  srmTagsHash = 0;
+  superpixelDim = 0;
+  blockBasedQuantMat = Mat();
+  blockHistograms.clear();
+  paletteIndexMat = Mat();
+}
+
+// The SRM tags are a lossless PNG, the hashes and the containment order are
+// written as text with one value on each line.
+
+bool ClusteringCombineArtifacts::save(const string &dirname)
+{
+  if (srmTags.empty()) {
+    return false;
+  }
+  
+  string tagsFilename = dirname + "/srm_tags.png";
+  
+  if (!imwrite(tagsFilename, srmTags)) {
+    return false;
+  }
+  
+  std::ofstream outFile(dirname + "/srm_artifacts.txt");
+  
+  if (!outFile) {
+    return false;
+  }
+  
+  outFile << inputHash << endl;
+  outFile << srmTagsHash << endl;
+  outFile << srmInsideOutOrder.size() << endl;
+  
+  for ( int32_t tag : srmInsideOutOrder ) {
+    outFile << tag << endl;
+  }
+  
+  return (bool) outFile;
+}
+
+bool ClusteringCombineArtifacts::load(const string &dirname, uint32_t hash)
+{
+  std::ifstream inFile(dirname + "/srm_artifacts.txt");
+  
+  if (!inFile) {
+    return false;
+  }
+  
+  uint32_t savedInputHash = 0;
+  uint32_t savedTagsHash = 0;
+  size_t numTags = 0;
+  
+  inFile >> savedInputHash >> savedTagsHash >> numTags;
+  
+  if (!inFile || savedInputHash != hash) {
+    return false;
+  }
+  
+  vector<int32_t> order;
+  order.reserve(numTags);
+  
+  for ( size_t i = 0; i < numTags; i++ ) {
+    int32_t tag;
+    inFile >> tag;
+    if (!inFile) {
+      return false;
+    }
+    order.push_back(tag);
+  }
+  
+  Mat tags = imread(dirname + "/srm_tags.png", CV_LOAD_IMAGE_COLOR);
+  
+  if (tags.empty() || matContentHash(tags) != savedTagsHash) {
+    return false;
+  }
+  
+  setInputHash(hash);
+  
+  srmTags = tags;
+  srmInsideOutOrder = order;
+  srmTagsHash = savedTagsHash;
+  
+  return true;
+}
+
+void ClusteringCombineArtifacts::printStageTimes(std::ostream &os) const
+{
+  for ( const ClusteringCombineStageTime &stageTime : stageTimes ) {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "stage %-20s : %10.4f seconds%s", stageTime.name.c_str(), stageTime.seconds, stageTime.cached ? " (cached)" : "");
+    os << (char*)buffer;
+    
+    if (stageTime.hasMemoryStats) {
+      snprintf(buffer, sizeof(buffer), " : mat peak %9.2f MB in %7lld allocs", stageTime.matPeakBytes / (1024.0 * 1024.0), (long long) stageTime.matAllocations);
+      os << (char*)buffer;
+      
+      if (isHeapMemoryStatsAvailable()) {
+        snprintf(buffer, sizeof(buffer), " : heap peak %9.2f MB in %9lld allocs", stageTime.heapPeakBytes / (1024.0 * 1024.0), (long long) stageTime.heapAllocations);
+        os << (char*)buffer;
+      }
+    }
+    
+    os << endl;
+  }
+}
+
+void recordClusteringCombineMetrics(const ClusteringCombineArtifacts &artifacts, bool worked, double seconds)
+{
+  addMetricsCounter("segmentation_images_total", worked ? "result=\"ok\"" : "result=\"failed\"");
+  
+  if (!worked) {
+    return;
+  }
+  
+  observeMetricsHistogram("segmentation_image_seconds", NULL, seconds);
+  
+  for ( const ClusteringCombineStageTime &stageTime : artifacts.stageTimes ) {
+    if (!stageTime.cached) {
+      string labels = "stage=\"" + stageTime.name + "\"";
+      observeMetricsHistogram("segmentation_stage_seconds", labels.c_str(), stageTime.seconds);
+    }
+  }
+  
+  addMetricsCounter("segmentation_srm_regions_total", NULL, artifacts.numSRMRegions);
+  addMetricsCounter("segmentation_captured_regions_total", NULL, artifacts.numCapturedRegions);
+  addMetricsCounter("segmentation_regions_total", NULL, artifacts.numRegions);
+  
+  setMetricsGauge("segmentation_last_srm_regions", NULL, artifacts.numSRMRegions);
+  setMetricsGauge("segmentation_last_regions", NULL, artifacts.numRegions);
+  
+  if (artifacts.partial) {
+    addMetricsCounter("segmentation_partial_images_total", NULL);
+  }
+}
+
+void setSegmentationThreads(int numThreads)
+{
+  setParallelThreads(numThreads);
+  quant_set_num_threads(numThreads);
+}
+
+static const SegmentationProfile segmentationProfiles[] = {
+  // name, srmQ, superpixelDim, captureExpandBlocks, quantMaxIters, quantDecFactor, quantNumBits, histogramBinDim
+  { "fast", 64.0, 4, 1, 3, 1, 7, 8 },
+  { "balanced", 128.0, 4, 2, 10, 1, 8, 16 },
+  { "quality", 256.0, 4, 3, 20, 1, 8, 32 }
+};
+
+static const int numSegmentationProfiles = (int) (sizeof(segmentationProfiles) / sizeof(segmentationProfiles[0]));
+
+static std::mutex segmentationProfileMutex;
+
+static SegmentationProfile segmentationProfile = segmentationProfiles[1];
+
+bool findSegmentationProfile(const string &name, SegmentationProfile &profile)
+{
+  for ( int i = 0; i < numSegmentationProfiles; i++ ) {
+    if (name == segmentationProfiles[i].name) {
+      profile = segmentationProfiles[i];
+      return true;
+    }
+  }
+  
+  return false;
+}
+
+bool setSegmentationProfile(const SegmentationProfile &profile)
+{
+  if (profile.srmQ <= 0.0 ||
+      profile.superpixelDim < 1 || (profile.superpixelDim * profile.superpixelDim) > HISTOGRAM_FOR_BLOCK_MAX_PIXELS ||
+      profile.captureExpandBlocks < 1 ||
+      profile.quantMaxIters < 0 || profile.quantDecFactor < 1 ||
+      profile.quantNumBits < 1 || profile.quantNumBits > 8 ||
+      profile.histogramBinDim < 2 || profile.histogramBinDim > 256) {
+    cerr << "error : invalid segmentation profile " << ((profile.name != NULL) ? profile.name : "") << endl;
+    return false;
+  }
+  
+  std::lock_guard<std::mutex> lock(segmentationProfileMutex);
+  
+  segmentationProfile = profile;
+  
+  setCaptureRegionExpandBlocks(profile.captureExpandBlocks);
+  quant_set_params(profile.quantMaxIters, profile.quantDecFactor, profile.quantNumBits);
+  setDefaultHistogramBinDim(profile.histogramBinDim);
+  
+  return true;
+}
+
+SegmentationProfile getSegmentationProfile()
+{
+  std::lock_guard<std::mutex> lock(segmentationProfileMutex);
+  
+  return segmentationProfile;
+}
+
+// Main method that implements the cluster combine logic. The logic runs as a series
+// of stages, the results of the stages that do not depend on the region capture
+// logic are kept in artifacts and reused by a later run on the same input image.
+// The time of each stage is recorded in artifacts.stageTimes, along with the
+// peak memory and allocation counts when the memory stats are enabled.
+
+// The DivQuant local k-means ranges run with parallelFor(), so that they share
+// the parallel loop threads and the thread budget of the calling thread
+
+class QuantParallelForBody : public cv::ParallelLoopBody
+{
+public:
+  QuantParallelForBody(QuantParallelRangeFunc _func, void *_data)
+  : func(_func), data(_data)
+  {
+  }
+  
+  void operator()(const cv::Range& range) const {
+    for ( int i = range.start; i < range.end; i++ ) {
+      func(i, data);
+    }
+  }
+  
+private:
+  QuantParallelRangeFunc func;
+  void *data;
+};
+
+static
+void quantParallelFor(int numRanges, QuantParallelRangeFunc func, void *data)
+{
+  parallelFor(cv::Range(0, numRanges), QuantParallelForBody(func, data));
+}
+
+bool clusteringCombine(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts)
+{
+  quant_set_parallel_for(quantParallelFor);
+  
+  const bool debug = isDebugTraceEnabled();
+  const bool debugWriteIntermediateFiles = isDebugStageImagesEnabled();
+  
+  TraceZone traceZone("clusteringCombine", -1, inputImg.rows * inputImg.cols);
+  
+  artifacts.setInputHash(matContentHash(inputImg));
+  artifacts.stageTimes.clear();
+  
+  const bool memoryStats = isMemoryStatsEnabled();
+  
+  auto stageStartTime = std::chrono::steady_clock::now();
+  
+  // The time budget starts with the run, so the capture gets what the earlier
+  // stages did not use.
+  
+  const auto captureDeadline = (artifacts.timeBudget > 0.0) ?
+    (stageStartTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(artifacts.timeBudget))) :
+    std::chrono::steady_clock::time_point::max();
+  
+  artifacts.partial = false;
+  artifacts.tagCosts.clear();
+  artifacts.numSRMRegions = 0;
+  artifacts.numCapturedRegions = 0;
+  artifacts.numRegions = 0;
+  
+  // Allocation counts as the current stage started
+  
+  MemoryCounters stageStartMat = getMatMemoryCounters();
+  MemoryCounters stageStartHeap = getHeapMemoryCounters();
+  
+  if (memoryStats) {
+    resetMemoryPeaks();
+  }
+  
+  // Record the time and memory use since the previous stage ended
+  
+  auto stageDone = [&](const char *name, bool cached)->void {
+    auto stageEndTime = std::chrono::steady_clock::now();
+    
+    addTraceEvent(name, stageStartTime, stageEndTime);
+    
+    ClusteringCombineStageTime stageTime;
+    stageTime.name = name;
+    stageTime.seconds = std::chrono::duration<double>(stageEndTime - stageStartTime).count();
+    stageTime.cached = cached;
+    stageTime.hasMemoryStats = memoryStats;
+    stageTime.matPeakBytes = 0;
+    stageTime.matAllocations = 0;
+    stageTime.heapPeakBytes = 0;
+    stageTime.heapAllocations = 0;
+    
+    if (memoryStats) {
+      MemoryCounters mat = getMatMemoryCounters();
+      MemoryCounters heap = getHeapMemoryCounters();
+      
+      stageTime.matPeakBytes = mat.peakBytes;
+      stageTime.matAllocations = mat.numAllocations - stageStartMat.numAllocations;
+      stageTime.heapPeakBytes = heap.peakBytes;
+      stageTime.heapAllocations = heap.numAllocations - stageStartHeap.numAllocations;
+      
+      stageStartMat = mat;
+      stageStartHeap = heap;
+      resetMemoryPeaks();
+    }
+    
+    artifacts.stageTimes.push_back(stageTime);
+    
+    stageStartTime = stageEndTime;
+  };
+  
+  // Alloc object on stack
+  SuperpixelImage spImage;
+  //
+  // Ref to object allocated on heap
+//  Ptr<SuperpixelImage> spImagePtr = new SuperpixelImage();
+//  SuperpixelImage &spImage = *spImagePtr;
+  
+  // Block size of the block based map, 4x4 unless the profile says otherwise
+  
+  const SegmentationProfile profile = getSegmentationProfile();
+  
+  const int superpixelDim = profile.superpixelDim;
+  int blockWidth = inputImg.cols / superpixelDim;
+  if ((inputImg.cols % superpixelDim) != 0) {
+    blockWidth++;
+  }
+  int blockHeight = inputImg.rows / superpixelDim;
+  if ((inputImg.rows % superpixelDim) != 0) {
+    blockHeight++;
+  }
+  
+  assert((blockWidth * superpixelDim) >= inputImg.cols);
+  assert((blockHeight * superpixelDim) >= inputImg.rows);
+  
+  // Run SRM logic to generate initial segmentation based on statistical "alikeness".
+  // Very large regions are likely to be very alike or even contain many pixels that
+  // are identical.
+  
+  bool worked;
+  
+  bool cachedSRM = !artifacts.srmTags.empty();
+  
+  // Freshly generated SRM labels are parsed directly, cached SRM tags are
+  // parsed from the tags image.
+  
+  Mat srmLabels;
+  vector<int32_t> srmLabelCounts;
+  vector<Rect> srmLabelBounds;
+  
+  if (!cachedSRM) {
+    SRMContext localSRMContext;
+    SRMContext &srmContext = (artifacts.srmContext != NULL) ? *artifacts.srmContext : localSRMContext;
+    
+    srmContext.setTargetRegionRange(artifacts.srmMinRegions, artifacts.srmMaxRegions);
+    srmContext.setQ(profile.srmQ);
+    
+    worked = srmMultiSegment(inputImg, artifacts.srmTags, srmContext, &srmLabels, &srmLabelCounts, &srmLabelBounds);
+    
+    artifacts.srmQ = srmContext.getLastQ();
+    
+    if (!worked) {
+      artifacts.srmTags = Mat();
+      return false;
+    }
+  }
+  
+  // The containment stage writes superpixel tags into srmTags, so the SRM tags
+  // in artifacts are not parsed in place.
+  
+  Mat srmTags;
+  
+  stageDone("srm", cachedSRM);
+  
+  // Generate a second segmentation of the same image but at a higher precision
+  // setting so that areas that may have been segmented into the same region
+  // in the less precise segmentation get split by this segmentation
+    
+  // Scan the tags generated by SRM and create superpixels of vario
+  
+  // The SRM tags are the labels plus 1 and parse() adds 1 to each tag
+  
+  if (cachedSRM) {
+    srmTags = artifacts.srmTags.clone();
+    worked = SuperpixelImage::parse(srmTags, spImage);
+  } else {
+    worked = SuperpixelImage::parseLabels(srmLabels, 2, srmTags, spImage, &srmLabelCounts, &srmLabelBounds);
+  }
+  
+  if (!worked) {
+    return false;
+  }
+  
+  srmLabels.release();
+  vector<int32_t>().swap(srmLabelCounts);
+  vector<Rect>().swap(srmLabelBounds);
+  
+  artifacts.numSRMRegions = (int32_t) spImage.superpixels.size();
+  
+  stageDone("parse", false);
+  
+  // Dump image that shows the input superpixels written with a colortable
+  
+  resultImg = inputImg.clone();
+  resultImg = (Scalar) 0;
+  
+  // A fixed seed gives the same debug colors on every run
+  
+  if (artifacts.randomSeed >= 0) {
+    setRandomSeed((uint32_t) artifacts.randomSeed);
+  } else {
+    setRandomSeed((uint32_t) std::chrono::system_clock::now().time_since_epoch().count());
+  }
+  
+  if (debugWriteIntermediateFiles) {
+    generateStaticColortable(inputImg, spImage);
+  }
+  
+  if (debugWriteIntermediateFiles) {
+    writeTagsWithStaticColortable(spImage, resultImg);
+    debugImwrite("tags_init.png", resultImg);
+  }
+  
+  cout << "started with " << spImage.superpixels.size() << " superpixels" << endl;
+  
+  // Scan superpixels to determine containment tree
+  
+  vector<int32_t> srmInsideOutOrder;
+  
+  {
+    // Fill with UID+1
+    
+    spImage.fillMatrixWithSuperpixelTags(srmTags);
+    
+    // The containment order only depends on the SRM tags, the tags parsed from
+    // the same SRM tags are always the same.
+    
+    uint32_t srmTagsHash = matContentHash(artifacts.srmTags);
+    
+    bool cachedContainment = (!artifacts.srmInsideOutOrder.empty() && artifacts.srmTagsHash == srmTagsHash);
+    
+    if (cachedContainment) {
+      srmInsideOutOrder = artifacts.srmInsideOutOrder;
+    } else {
+      // Scan SRM superpixel regions in terms of containment, this generates a tree
+      // where each UID can contain 1 to N children.
+      
+      // FIXME: If just 1 interior shape touches edge, do not conside as sigblings
+      
+      SuperpixelContainmentTree containsTree;
+      
+      buildSuperpixelContainmentTree(spImage, srmTags, containsTree);
+      
+      srmInsideOutOrder = containsTree.getInsideOutOrder();
+      
+      if (debug) {
+        vector<int32_t> childTags;
+        
+        containsTree.iterate([&](int32_t tag, int32_t node) {
+          containsTree.getChildTags(node, childTags);
+          fprintf(stdout, "tag %9d has %5d children and N = %d\n", tag, (int)childTags.size(), (int)spImage.getSuperpixelPtr(tag)->coords.size());
+        });
+      }
+      
+      artifacts.srmInsideOutOrder = srmInsideOutOrder;
+      artifacts.srmTagsHash = srmTagsHash;
+    }
+    
+    stageDone("containment", cachedContainment);
+  }
+  
+  // Scan all superpixels and implement region merge and split based on the input pixels
+  
+  {
+    RegionRemerger remerger(inputImg, artifacts.matPool);
+    
+    // Quant the entire image into small 4x4 blocks and then generate histograms
+    // for each block. The histogram data can be scanned significantly faster
+    // that rereading all the original pixel info.
+    
+    bool cachedBlockHistograms = (artifacts.superpixelDim == superpixelDim && !artifacts.blockBasedQuantMat.empty() && !artifacts.paletteIndexMat.empty());
+    
+    if (!cachedBlockHistograms) {
+      artifacts.blockHistograms.clear();
+      artifacts.blockBasedQuantMat = genHistogramsForBlocks(inputImg, artifacts.blockHistograms, blockWidth, blockHeight, superpixelDim, &artifacts.paletteIndexMat);
+      artifacts.superpixelDim = superpixelDim;
+    }
+    
+    Mat &blockBasedQuantMat = artifacts.blockBasedQuantMat;
+    
+    stageDone("blockHistograms", cachedBlockHistograms);
+    
+    // Loop over superpixels starting at the most contained and working outwards,
+    // regions whose bounds do not overlap are captured in parallel.
+    
+    if (debug) {
+      for ( int32_t tag : srmInsideOutOrder ) {
+        Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+        cout << "process tag " << tag << " containing " << spPtr->coords.size() << endl;
+      }
+    }
+    
+    // The pixel count of a committed region is the change in the captured pixels
+    
+    int numCommittedPixels = remerger.numCapturedPixels;
+    
+    auto mergedFunc = [&](int32_t tag, const RegionMask &mask)->void {
+      if (artifacts.regionFunc) {
+        ClusteringCombineRegion region;
+        region.srmTag = tag;
+        region.captureIndex = remerger.numCapturedRegions - 1;
+        region.numPixels = remerger.numCapturedPixels - numCommittedPixels;
+        region.bounds = mask.nonZeroBounds();
+        region.meanColor = Vec3b(0, 0, 0);
+        region.mask = &mask;
+        
+        if (region.numPixels > 0) {
+          Scalar meanScalar = cv::mean(inputImg(mask.roi), mask.mat());
+          region.meanColor = Vec3b(saturate_cast<uint8_t>(meanScalar[0]), saturate_cast<uint8_t>(meanScalar[1]), saturate_cast<uint8_t>(meanScalar[2]));
+        }
+        
+        artifacts.regionFunc(region);
+      }
+      
+      numCommittedPixels = remerger.numCapturedPixels;
+      
+      if (isDebugTagImagesEnabled(tag))
+      {
+        std::stringstream fnameStream;
+        fnameStream << "srm" << "_tag_" << tag << "_region_mask" << ".png";
+        string fname = fnameStream.str();
+        
+        debugImwrite(fname, remerger.maskMat);
+        cout << "wrote " << fname << endl;
+        cout << "";
+      }
+      
+      if (debugWriteIntermediateFiles) {
+        std::stringstream fnameStream;
+        fnameStream << "srm" << "_tag_" << tag << "_merge_region" << ".png";
+        string fname = fnameStream.str();
+        
+        debugImwrite(fname, remerger.mergeMat);
+        cout << "wrote " << fname << endl;
+        cout << "" << endl;
+      }
+    };
+    
+    vector<float> tagSeconds;
+    
+    int numCapturedTags = captureRegionMasks(spImage, inputImg, srmTags, srmInsideOutOrder, blockWidth, blockHeight, superpixelDim, remerger, blockBasedQuantMat, mergedFunc, captureDeadline, &tagSeconds);
+    
+    // The cost of a tag that was not captured is estimated from the seconds per
+    // coord of the tags that were captured.
+    
+    {
+      double capturedSeconds = 0.0;
+      int64_t capturedCoords = 0;
+      
+      artifacts.tagCosts.resize(srmInsideOutOrder.size());
+      
+      for ( int i = 0; i < (int) srmInsideOutOrder.size(); i++ ) {
+        ClusteringCombineTagCost &cost = artifacts.tagCosts[i];
+        cost.tag = srmInsideOutOrder[i];
+        cost.numCoords = (int32_t) spImage.getSuperpixelPtr(cost.tag)->coords.size();
+        cost.seconds = tagSeconds[i];
+        cost.captured = (i < numCapturedTags);
+        
+        if (cost.captured) {
+          capturedSeconds += cost.seconds;
+          capturedCoords += cost.numCoords;
+        }
+      }
+      
+      const double secondsPerCoord = (capturedCoords > 0) ? (capturedSeconds / capturedCoords) : 0.0;
+      
+      for ( int i = numCapturedTags; i < (int) srmInsideOutOrder.size(); i++ ) {
+        ClusteringCombineTagCost &cost = artifacts.tagCosts[i];
+        cost.seconds = (float) (cost.numCoords * secondsPerCoord);
+      }
+      
+      artifacts.partial = (numCapturedTags < (int) srmInsideOutOrder.size());
+      
+      if (artifacts.partial) {
+        cout << "time budget of " << artifacts.timeBudget << " seconds captured " << numCapturedTags << " of " << srmInsideOutOrder.size() << " tags" << endl;
+      }
+    }
+    
+    // Gather any remaining tags that have not been merged
+    // and add these as new sets of pixels.
+    
+    remerger.mergeLeftovers(srmTags);
+    
+    // A captured region or the leftover pixels of a SRM region need not be
+    // connected, so each connected part of a merged tag gets its own tag.
+    
+    int32_t numMergedRegions;
+    
+    {
+      PooledMat mergedLabelsBuffer = acquirePooledMat(artifacts.matPool, inputImg.size(), CV_32SC1, false);
+      Mat &mergedLabels = mergedLabelsBuffer.mat;
+      
+      numMergedRegions = labelConnectedTags(remerger.mergeMat, mergedLabels);
+      
+      if (numMergedRegions >= (0x00FFFFFF - 1)) {
+        cerr << "error : merge generated " << numMergedRegions << " regions which does not fit into a 24 bit tag" << endl;
+        return false;
+      }
+      
+      labelsToTags(mergedLabels, remerger.mergeMat, 1);
+    }
+    
+    artifacts.numCapturedRegions = remerger.numCapturedRegions;
+    
+    stageDone("capture", false);
+    
+    if (debugWriteIntermediateFiles) {
+      std::stringstream fnameStream;
+      fnameStream << "srm_merged_all_regions" << ".png";
+      string fname = fnameStream.str();
+      
+      debugImwrite(fname, remerger.mergeMat);
+      cout << "wrote " << fname << endl;
+      cout << "" << endl;
+    }
+    
+    // When no region was captured the merged tags are the SRM regions split into
+    // connected parts. If no region was split the superpixels already parsed from
+    // the SRM tags are the same regions, so the reparse is skipped and the existing
+    // superpixels and edges are reused.
+    
+    bool skipReparse = (remerger.numCapturedRegions == 0 && numMergedRegions == (int32_t) spImage.superpixels.size());
+    
+    if (debug) {
+      char buffer[1024];
+      snprintf(buffer, sizeof(buffer), "captured %d regions with %d pixels, fingerprint 0x%08X", remerger.numCapturedRegions, remerger.numCapturedPixels, remerger.captureFingerprint);
+      cout << buffer << endl;
+      
+      if (skipReparse) {
+        cout << "merge operation did not change any regions" << endl;
+      }
+    }
+    
+    if (!skipReparse) {
+      spImage.reset();
+      
+      worked = SuperpixelImage::parse(remerger.mergeMat, spImage);
+      
+      if (!worked) {
+        return false;
+      }
+    }
+    
+    stageDone("reparse", skipReparse);
+    
+    // mergeMat now contains tags after a split and merge operation
+    
+  }
+  
+  // Generate result image after region based merging, the result is written
+  // whether or not the debug images are enabled. The colors do not use the
+  // shared static colortable since more than one run can be active at a time.
+  
+  writeTagsWithIndexColors(spImage, resultImg);
+  
+  if (debugWriteIntermediateFiles) {
+    debugImwrite("tags_after_region_merge.png", resultImg);
+  }
+  
+  // Done
+  
+  artifacts.numRegions = (int32_t) spImage.superpixels.size();
+  
+  cout << "ended with " << spImage.superpixels.size() << " superpixels" << endl;
+  
+  return true;
+}
+
+// Record a stage that ran from startTime until now without memory stats, for the
+// stages that run outside of clusteringCombine().
+
+static
+void addStageTime(ClusteringCombineArtifacts &artifacts, const char *name, std::chrono::steady_clock::time_point startTime)
+{
+  auto endTime = std::chrono::steady_clock::now();
+  
+  addTraceEvent(name, startTime, endTime);
+  
+  ClusteringCombineStageTime stageTime;
+  stageTime.name = name;
+  stageTime.seconds = std::chrono::duration<double>(endTime - startTime).count();
+  stageTime.cached = false;
+  stageTime.hasMemoryStats = false;
+  stageTime.matPeakBytes = 0;
+  stageTime.matAllocations = 0;
+  stageTime.heapPeakBytes = 0;
+  stageTime.heapAllocations = 0;
+  artifacts.stageTimes.push_back(stageTime);
+}
+
+// Sums of the pixels in the coarse regions that are outside of the refine band,
+// a region with no pixels outside the band uses the sums of all its pixels.
+
+typedef struct {
+  uint64_t sum[3];
+  uint32_t count;
+  uint64_t bandSum[3];
+  uint32_t bandCount;
+} PyramidRegionSums;
+
+// Each pixel in the refine band takes the label of the candidate region with the
+// closest mean color. The candidates are the labels at the pixel and at the 8
+// pixels bandRadius away, so any region that touches the band near the pixel is
+// a candidate. Rows are refined on separate threads, each pixel only reads the
+// coarse labels so the results do not depend on the number of threads.
+
+class PyramidRefineParallelBody : public cv::ParallelLoopBody
+{
+public:
+  PyramidRefineParallelBody(const Mat &_inputImg,
+                            const Mat &_bandMask,
+                            const Mat &_coarseLabels,
+                            const vector<Vec3f> &_means,
+                            int _bandRadius,
+                            Mat &_refinedLabels)
+  : inputImg(_inputImg), bandMask(_bandMask), coarseLabels(_coarseLabels), means(_means),
+  bandRadius(_bandRadius), refinedLabels(_refinedLabels)
+  {
+  }
+  
+  void operator()(const cv::Range& range) const {
+    const int width = inputImg.cols;
+    const int height = inputImg.rows;
+    
+    for ( int y = range.start; y < range.end; y++ ) {
+      const Vec3b *inputRowPtr = inputImg.ptr<Vec3b>(y);
+      const uint8_t *bandRowPtr = bandMask.ptr<uint8_t>(y);
+      int32_t *refinedRowPtr = refinedLabels.ptr<int32_t>(y);
+      
+      for ( int x = 0; x < width; x++ ) {
+        int32_t label = coarseLabels.at<int32_t>(y, x);
+        
+        if (bandRowPtr[x] == 0) {
+          refinedRowPtr[x] = label;
+          continue;
+        }
+        
+        Vec3f pixel(inputRowPtr[x][0], inputRowPtr[x][1], inputRowPtr[x][2]);
+        
+        Vec3f delta = pixel - means[label];
+        float minDist = delta.dot(delta);
+        int32_t minLabel = label;
+        
+        for ( int dy = -1; dy <= 1; dy++ ) {
+          int cy = mini(maxi(y + dy * bandRadius, 0), height - 1);
+          
+          for ( int dx = -1; dx <= 1; dx++ ) {
+            int cx = mini(maxi(x + dx * bandRadius, 0), width - 1);
+            
+            int32_t candidate = coarseLabels.at<int32_t>(cy, cx);
+            
+            if (candidate == minLabel) {
+              continue;
+            }
+            
+            delta = pixel - means[candidate];
+            float dist = delta.dot(delta);
+            
+            if (dist < minDist || (dist == minDist && candidate < minLabel)) {
+              minDist = dist;
+              minLabel = candidate;
+            }
+          }
+        }
+        
+        refinedRowPtr[x] = minLabel;
+      }
+    }
+  }
+  
+private:
+  const Mat &inputImg;
+  const Mat &bandMask;
+  const Mat &coarseLabels;
+  const vector<Vec3f> &means;
+  int bandRadius;
+  Mat &refinedLabels;
+};
+
+// The input is reduced with pyrDown() numLevels times and segmented with
+// clusteringCombine(). The coarse regions are scaled back up to the input size
+// and only the pixels in a band around the coarse region boundaries are looked
+// at again at full resolution.
+
+bool clusteringCombinePyramid(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts, int numLevels)
+{
+  const bool debug = isDebugTraceEnabled();
+  const bool debugWriteIntermediateFiles = isDebugStageImagesEnabled();
+  
+  if (numLevels <= 0) {
+    return clusteringCombine(inputImg, resultImg, artifacts);
+  }
+  
+  TraceZone traceZone("clusteringCombinePyramid", -1, inputImg.rows * inputImg.cols);
+  
+  Mat coarseImg = inputImg;
+  
+  for ( int level = 0; level < numLevels; level++ ) {
+    Mat downImg;
+    pyrDown(coarseImg, downImg);
+    coarseImg = downImg;
+  }
+  
+  if (debug) {
+    cout << "segment coarse " << coarseImg.cols << "x" << coarseImg.rows << " image for " << inputImg.cols << "x" << inputImg.rows << " input" << endl;
+  }
+  
+  Mat coarseTags;
+  
+  if (!clusteringCombine(coarseImg, coarseTags, artifacts)) {
+    return false;
+  }
+  
+  auto refineStartTime = std::chrono::steady_clock::now();
+  
+  // Coarse regions at full size, each connected region gets a label
+  
+  // The full size temporaries are recycled when the artifacts have a pool
+  
+  MatPool *matPool = artifacts.matPool;
+  
+  PooledMat upTagsBuffer = acquirePooledMat(matPool, inputImg.size(), CV_8UC3, false);
+  Mat &upTags = upTagsBuffer.mat;
+  resize(coarseTags, upTags, inputImg.size(), 0, 0, INTER_NEAREST);
+  
+  PooledMat coarseLabelsBuffer = acquirePooledMat(matPool, inputImg.size(), CV_32SC1, false);
+  Mat &coarseLabels = coarseLabelsBuffer.mat;
+  int32_t numCoarseLabels = labelConnectedTags(upTags, coarseLabels);
+  
+  // The band is the pixels within bandRadius of a coarse boundary, which covers
+  // the error of a boundary placed at the coarse resolution.
+  
+  const int bandRadius = 1 << numLevels;
+  
+  PooledMat boundaryMaskBuffer = acquirePooledMat(matPool, inputImg.size(), CV_8UC1, true);
+  Mat &boundaryMask = boundaryMaskBuffer.mat;
+  
+  for ( int y = 0; y < coarseLabels.rows; y++ ) {
+    const int32_t *labelsRowPtr = coarseLabels.ptr<int32_t>(y);
+    const int32_t *nextLabelsRowPtr = (y < coarseLabels.rows - 1) ? coarseLabels.ptr<int32_t>(y+1) : NULL;
+    uint8_t *boundaryRowPtr = boundaryMask.ptr<uint8_t>(y);
+    
+    for ( int x = 0; x < coarseLabels.cols; x++ ) {
+      if ((x < coarseLabels.cols - 1 && labelsRowPtr[x] != labelsRowPtr[x+1]) ||
+          (nextLabelsRowPtr != NULL && labelsRowPtr[x] != nextLabelsRowPtr[x])) {
+        boundaryRowPtr[x] = 0xFF;
+      }
+    }
+  }
+  
+  PooledMat bandMaskBuffer = acquirePooledMat(matPool, inputImg.size(), CV_8UC1, false);
+  Mat &bandMask = bandMaskBuffer.mat;
+  Mat bandElement = getStructuringElement(MORPH_RECT, Size(2 * bandRadius + 1, 2 * bandRadius + 1));
+  dilate(boundaryMask, bandMask, bandElement);
+  
+  if (debugWriteIntermediateFiles) {
+    debugImwrite("pyramid_refine_band.png", bandMask);
+  }
+  
+  // Mean color of each coarse region from the full resolution pixels
+  
+  vector<PyramidRegionSums> sums(numCoarseLabels);
+  memset(sums.data(), 0, sums.size() * sizeof(PyramidRegionSums));
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    const Vec3b *inputRowPtr = inputImg.ptr<Vec3b>(y);
+    const int32_t *labelsRowPtr = coarseLabels.ptr<int32_t>(y);
+    const uint8_t *bandRowPtr = bandMask.ptr<uint8_t>(y);
+    
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      PyramidRegionSums &regionSums = sums[labelsRowPtr[x]];
+      const Vec3b &pixel = inputRowPtr[x];
+      
+      if (bandRowPtr[x] == 0) {
+        for ( int i = 0; i < 3; i++ ) {
+          regionSums.sum[i] += pixel[i];
+        }
+        regionSums.count += 1;
+      } else {
+        for ( int i = 0; i < 3; i++ ) {
+          regionSums.bandSum[i] += pixel[i];
+        }
+        regionSums.bandCount += 1;
+      }
+    }
+  }
+  
+  vector<Vec3f> means(numCoarseLabels);
+  
+  for ( int32_t label = 0; label < numCoarseLabels; label++ ) {
+    const PyramidRegionSums &regionSums = sums[label];
+    
+    for ( int i = 0; i < 3; i++ ) {
+      if (regionSums.count > 0) {
+        means[label][i] = (float) regionSums.sum[i] / regionSums.count;
+      } else {
+        means[label][i] = (float) (regionSums.sum[i] + regionSums.bandSum[i]) / maxi(1, regionSums.count + regionSums.bandCount);
+      }
+    }
+  }
+  
+  PooledMat refinedLabelsBuffer = acquirePooledMat(matPool, inputImg.size(), CV_32SC1, false);
+  Mat &refinedLabels = refinedLabelsBuffer.mat;
+  
+  parallelFor(Range(0, inputImg.rows), PyramidRefineParallelBody(inputImg, bandMask, coarseLabels, means, bandRadius, refinedLabels));
+  
+  // A band pixel can be split off from its region, so each connected part gets its own tag
+  
+  PooledMat refinedTagsBuffer = acquirePooledMat(matPool, inputImg.size(), CV_8UC3, false);
+  Mat &refinedTags = refinedTagsBuffer.mat;
+  labelsToTags(refinedLabels, refinedTags, 1);
+  
+  PooledMat finalLabelsBuffer = acquirePooledMat(matPool, inputImg.size(), CV_32SC1, false);
+  Mat &finalLabels = finalLabelsBuffer.mat;
+  int32_t numFinalLabels = labelConnectedTags(refinedTags, finalLabels);
+  
+  if (numFinalLabels >= (0x00FFFFFF - 1)) {
+    cerr << "error : pyramid refine generated " << numFinalLabels << " regions which does not fit into a 24 bit tag" << endl;
+    return false;
+  }
+  
+  labelsToTags(finalLabels, resultImg, 1);
+  
+  addStageTime(artifacts, "pyramidRefine", refineStartTime);
+  
+  if (debug) {
+    cout << "pyramid refine of " << countNonZero(bandMask) << " band pixels ended with " << numFinalLabels << " regions" << endl;
+  }
+  
+  return true;
+}
+
+bool clusteringCombineROI(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts, cv::Rect roi, int margin, int numLevels)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  const Rect imageRect(0, 0, inputImg.cols, inputImg.rows);
+  
+  if (roi.width <= 0 || roi.height <= 0 || (roi & imageRect) != roi) {
+    cerr << "error : roi " << roi << " is not inside the " << inputImg.cols << "x" << inputImg.rows << " input" << endl;
+    return false;
+  }
+  
+  // The context is a Mat header into the input pixels, nothing is copied
+  
+  Rect contextRect(roi.x - margin, roi.y - margin, roi.width + (margin * 2), roi.height + (margin * 2));
+  contextRect &= imageRect;
+  
+  if (debug) {
+    cout << "segment roi " << roi << " with context " << contextRect << endl;
+  }
+  
+  Mat contextImg = inputImg(contextRect);
+  Mat contextResultImg;
+  
+  if (!clusteringCombinePyramid(contextImg, contextResultImg, artifacts, numLevels)) {
+    return false;
+  }
+  
+  // Copy so that the caller gets a continuous Mat the size of the roi
+  
+  Rect roiInContext(roi.x - contextRect.x, roi.y - contextRect.y, roi.width, roi.height);
+  
+  resultImg = contextResultImg(roiInContext).clone();
+  
+  return true;
+}
+
+// One tile of a tiled segmentation, the core is the pixels the tile writes to
+// the result and the bounds are the core plus the apron that is segmented.
+
+typedef struct {
+  cv::Rect core;
+  cv::Rect bounds;
+  Mat labels;
+  int32_t numLabels;
+  int32_t labelOffset;
+  bool worked;
+} SegmentationTile;
+
+// Segment each tile with clusteringCombine() on a separate thread, each tile
+// has its own artifacts so no state is shared between the tiles. The tiles
+// would write debug images with the same names, so only tracing is enabled.
+
+class SegmentTilesParallelBody : public cv::ParallelLoopBody
+{
+public:
+  SegmentTilesParallelBody(const Mat &_inputImg,
+                           vector<SegmentationTile> &_tiles,
+                           int64_t _randomSeed)
+  : inputImg(_inputImg), tiles(_tiles), randomSeed(_randomSeed),
+  debugOutputLevel(min(getDebugOutputLevel(), DEBUG_OUTPUT_TRACE))
+  {
+  }
+  
+  void operator()(const cv::Range& range) const {
+    DebugOutputLevel prevDebugOutputLevel = getDebugOutputLevel();
+    setDebugOutputLevel(debugOutputLevel);
+    
+    int prevQuantThreads = quant_get_num_threads();
+    quant_set_num_threads(getParallelThreads());
+    
+    for ( int i = range.start; i < range.end; i++ ) {
+      SegmentationTile &tile = tiles[i];
+      
+      Mat tileImg = inputImg(tile.bounds).clone();
+      Mat tileResultImg;
+      
+      ClusteringCombineArtifacts tileArtifacts;
+      tileArtifacts.randomSeed = randomSeed;
+      
+      tile.worked = clusteringCombine(tileImg, tileResultImg, tileArtifacts);
+      
+      if (tile.worked) {
+        tile.numLabels = labelConnectedTags(tileResultImg, tile.labels);
+      }
+    }
+    
+    quant_set_num_threads(prevQuantThreads);
+    setDebugOutputLevel(prevDebugOutputLevel);
+  }
+  
+private:
+  const Mat &inputImg;
+  vector<SegmentationTile> &tiles;
+  int64_t randomSeed;
+  DebugOutputLevel debugOutputLevel;
+};
+
+// Two labels from tiles that overlap are joined when at least this fraction of
+// the overlap pixels of the smaller label are in the other label.
+
+static const float tileReconcileMinOverlap = 0.5f;
+
+// Split the image into tiles of tileSize x tileSize pixels in raster order, each
+// tile is segmented over its core grown by apron pixels on every side.
+
+static
+void makeSegmentationTiles(const cv::Size &imageSize, int tileSize, int apron, vector<SegmentationTile> &tiles)
+{
+  const Rect imageRect(0, 0, imageSize.width, imageSize.height);
+  
+  const int numTilesX = (imageSize.width + tileSize - 1) / tileSize;
+  const int numTilesY = (imageSize.height + tileSize - 1) / tileSize;
+  
+  tiles.resize(numTilesX * numTilesY);
+  
+  for ( int ty = 0; ty < numTilesY; ty++ ) {
+    for ( int tx = 0; tx < numTilesX; tx++ ) {
+      SegmentationTile &tile = tiles[(ty * numTilesX) + tx];
+      tile.core = Rect(tx * tileSize, ty * tileSize, tileSize, tileSize) & imageRect;
+      tile.bounds = Rect(tile.core.x - apron, tile.core.y - apron, tile.core.width + 2 * apron, tile.core.height + 2 * apron) & imageRect;
+      tile.numLabels = 0;
+      tile.labelOffset = 0;
+      tile.worked = false;
+    }
+  }
+}
+
+// Join the labels of two label Mats in the union find where they overlap, each
+// Mat holds the labels of the pixels in its bounds and the labels are offset
+// into parents. When countMask is not NULL only the overlap pixels that are not
+// zero in this image size mask are counted.
+
+static
+void joinOverlapLabels(vector<int32_t> &parents,
+                       const Mat &labels1, const Rect &bounds1, int32_t labelOffset1,
+                       const Mat &labels2, const Rect &bounds2, int32_t labelOffset2,
+                       const Mat *countMask)
+{
+  const Rect overlap = bounds1 & bounds2;
+  
+  if (overlap.area() == 0) {
+    return;
+  }
+  
+  // Pixel counts of each label pair and of each label inside the overlap
+  
+  unordered_map<uint64_t, int> pairCounts;
+  unordered_map<int32_t, int> labelCounts;
+  
+  for ( int y = overlap.y; y < overlap.y + overlap.height; y++ ) {
+    const int32_t *labelsRow1 = labels1.ptr<int32_t>(y - bounds1.y);
+    const int32_t *labelsRow2 = labels2.ptr<int32_t>(y - bounds2.y);
+    const uint8_t *maskRow = (countMask != NULL) ? countMask->ptr<uint8_t>(y) : NULL;
+    
+    for ( int x = overlap.x; x < overlap.x + overlap.width; x++ ) {
+      if (maskRow != NULL && maskRow[x] == 0) {
+        continue;
+      }
+      
+      int32_t label1 = labelOffset1 + labelsRow1[x - bounds1.x];
+      int32_t label2 = labelOffset2 + labelsRow2[x - bounds2.x];
+      
+      pairCounts[((uint64_t) label1 << 32) | (uint32_t) label2] += 1;
+      labelCounts[label1] += 1;
+      labelCounts[label2] += 1;
+    }
+  }
+  
+  for ( auto &pair : pairCounts ) {
+    int32_t label1 = (int32_t) (pair.first >> 32);
+    int32_t label2 = (int32_t) (uint32_t) pair.first;
+    
+    int minCount = mini(labelCounts[label1], labelCounts[label2]);
+    
+    if (pair.second < tileReconcileMinOverlap * minCount) {
+      continue;
+    }
+    
+    int32_t root1 = labelConnectedTagsFind(parents, label1);
+    int32_t root2 = labelConnectedTagsFind(parents, label2);
+    
+    if (root1 < root2) {
+      parents[root2] = root1;
+    } else if (root2 < root1) {
+      parents[root1] = root2;
+    }
+  }
+}
+
+bool clusteringCombineTiled(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts, int tileSize, int apron)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  assert(tileSize > 0);
+  assert(apron >= 0);
+  
+  const int width = inputImg.cols;
+  const int height = inputImg.rows;
+  
+  TraceZone traceZone("clusteringCombineTiled", -1, width * height);
+  
+  artifacts.setInputHash(matContentHash(inputImg));
+  artifacts.stageTimes.clear();
+  
+  auto stageStartTime = std::chrono::steady_clock::now();
+  
+  vector<SegmentationTile> tiles;
+  makeSegmentationTiles(inputImg.size(), tileSize, apron, tiles);
+  
+  if (debug) {
+    cout << "segment " << tiles.size() << " tiles of " << tileSize << " pixels with a " << apron << " pixel apron" << endl;
+  }
+  
+  parallelFor(Range(0, (int) tiles.size()), SegmentTilesParallelBody(inputImg, tiles, artifacts.randomSeed));
+  
+  int32_t numLabels = 0;
+  
+  for ( SegmentationTile &tile : tiles ) {
+    if (!tile.worked) {
+      return false;
+    }
+    tile.labelOffset = numLabels;
+    numLabels += tile.numLabels;
+  }
+  
+  addStageTime(artifacts, "tiles", stageStartTime);
+  stageStartTime = std::chrono::steady_clock::now();
+  
+  // Each label is a set in the union find, labels of two tiles that cover the
+  // same region in the overlap of the tiles are joined.
+  
+  vector<int32_t> parents(numLabels);
+  
+  for ( int32_t label = 0; label < numLabels; label++ ) {
+    parents[label] = label;
+  }
+  
+  for ( int i = 0; i < (int) tiles.size(); i++ ) {
+    for ( int j = i + 1; j < (int) tiles.size(); j++ ) {
+      const SegmentationTile &tile1 = tiles[i];
+      const SegmentationTile &tile2 = tiles[j];
+      
+      joinOverlapLabels(parents,
+                        tile1.labels, tile1.bounds, tile1.labelOffset,
+                        tile2.labels, tile2.bounds, tile2.labelOffset,
+                        NULL);
+    }
+  }
+  
+  // Each tile writes the joined labels for the pixels of its core
+  
+  Mat joinedLabels(inputImg.size(), CV_32SC1);
+  
+  for ( const SegmentationTile &tile : tiles ) {
+    for ( int y = tile.core.y; y < tile.core.y + tile.core.height; y++ ) {
+      const int32_t *labels = tile.labels.ptr<int32_t>(y - tile.bounds.y);
+      int32_t *joinedRowPtr = joinedLabels.ptr<int32_t>(y);
+      
+      for ( int x = tile.core.x; x < tile.core.x + tile.core.width; x++ ) {
+        joinedRowPtr[x] = labelConnectedTagsFind(parents, tile.labelOffset + labels[x - tile.bounds.x]);
+      }
+    }
+  }
+  
+  // A region split by a seam that was not joined and a joined label whose parts
+  // only touched in an apron become separate connected regions.
+  
+  Mat joinedTags;
+  labelsToTags(joinedLabels, joinedTags, 1);
+  
+  Mat finalLabels;
+  int32_t numFinalLabels = labelConnectedTags(joinedTags, finalLabels);
+  
+  if (numFinalLabels >= (0x00FFFFFF - 1)) {
+    cerr << "error : tiles generated " << numFinalLabels << " regions which does not fit into a 24 bit tag" << endl;
+    return false;
+  }
+  
+  labelsToTags(finalLabels, resultImg, 1);
+  
+  addStageTime(artifacts, "reconcile", stageStartTime);
+  
+  if (debug) {
+    cout << "reconciled " << numLabels << " tile regions into " << numFinalLabels << " regions" << endl;
+  }
+  
+  return true;
+}
+
+// A tile is dirty when more than this fraction of its core pixels differ from
+// the reference pixels, so that sensor noise on a few pixels does not cause
+// the tile to be segmented again.
+
+static const float temporalMinChangedFraction = 0.001f;
+
+// Find the tiles whose core pixels differ from the reference pixels by more
+// than diffThreshold in any channel, one tile per loop index.
+
+class FindDirtyTilesParallelBody : public cv::ParallelLoopBody
+{
+public:
+  FindDirtyTilesParallelBody(const Mat &_inputImg,
+                             const Mat &_referenceImg,
+                             const vector<SegmentationTile> &_tiles,
+                             int _diffThreshold,
+                             vector<uint8_t> &_dirtyTiles)
+  : inputImg(_inputImg), referenceImg(_referenceImg), tiles(_tiles),
+  diffThreshold(_diffThreshold), dirtyTiles(_dirtyTiles)
+  {
+  }
+  
+  void operator()(const cv::Range& range) const {
+    for ( int i = range.start; i < range.end; i++ ) {
+      const Rect &core = tiles[i].core;
+      
+      const int maxChanged = (int) (core.area() * temporalMinChangedFraction);
+      int numChanged = 0;
+      
+      for ( int y = core.y; y < core.y + core.height && numChanged <= maxChanged; y++ ) {
+        const uint8_t *inputPtr = inputImg.ptr<uint8_t>(y) + (core.x * 3);
+        const uint8_t *referencePtr = referenceImg.ptr<uint8_t>(y) + (core.x * 3);
+        
+        for ( int x = 0; x < core.width; x++, inputPtr += 3, referencePtr += 3 ) {
+          if (abs(inputPtr[0] - referencePtr[0]) > diffThreshold ||
+              abs(inputPtr[1] - referencePtr[1]) > diffThreshold ||
+              abs(inputPtr[2] - referencePtr[2]) > diffThreshold) {
+            numChanged += 1;
+          }
+        }
+      }
+      
+      dirtyTiles[i] = (numChanged > maxChanged) ? 1 : 0;
+    }
+  }
+  
+private:
+  const Mat &inputImg;
+  const Mat &referenceImg;
+  const vector<SegmentationTile> &tiles;
+  int diffThreshold;
+  vector<uint8_t> &dirtyTiles;
+};
+
+void ClusteringCombineTemporalState::clear()
+{
+  referenceImg = Mat();
+  labels = Mat();
+  numLabels = 0;
+  tileSize = 0;
+  apron = 0;
+  numDirtyTiles = 0;
+  numTiles = 0;
+}
+
+// Join the labels of segmented dirty tiles with the labels in state and write the
+// result, the state is then updated to the result and the pixels of the dirty
+// tile cores.
+
+static
+bool reconcileDirtyTiles(Mat &inputImg, Mat &resultImg, ClusteringCombineTemporalState &state,
+                         vector<SegmentationTile> &dirtyTiles, ClusteringCombineArtifacts &artifacts)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  auto stageStartTime = std::chrono::steady_clock::now();
+  
+  // The labels in state come first in the union find, then the labels of each
+  // dirty tile.
+  
+  int32_t numLabels = state.numLabels;
+  
+  for ( SegmentationTile &tile : dirtyTiles ) {
+    if (!tile.worked) {
+      return false;
+    }
+    tile.labelOffset = numLabels;
+    numLabels += tile.numLabels;
+  }
+  
+  vector<int32_t> parents(numLabels);
+  
+  for ( int32_t label = 0; label < numLabels; label++ ) {
+    parents[label] = label;
+  }
+  
+  // A dirty tile apron that covers clean pixels joins the tile labels with the
+  // labels in state, only the clean pixels are counted.
+  
+  Mat cleanMask(inputImg.size(), CV_8UC1, Scalar(0xFF));
+  
+  for ( const SegmentationTile &tile : dirtyTiles ) {
+    cleanMask(tile.core) = Scalar(0);
+  }
+  
+  const Rect imageRect(0, 0, inputImg.cols, inputImg.rows);
+  
+  for ( int i = 0; i < (int) dirtyTiles.size(); i++ ) {
+    const SegmentationTile &tile1 = dirtyTiles[i];
+    
+    joinOverlapLabels(parents,
+                      tile1.labels, tile1.bounds, tile1.labelOffset,
+                      state.labels, imageRect, 0,
+                      &cleanMask);
+    
+    for ( int j = i + 1; j < (int) dirtyTiles.size(); j++ ) {
+      const SegmentationTile &tile2 = dirtyTiles[j];
+      
+      joinOverlapLabels(parents,
+                        tile1.labels, tile1.bounds, tile1.labelOffset,
+                        tile2.labels, tile2.bounds, tile2.labelOffset,
+                        NULL);
+    }
+  }
+  
+  // Clean pixels keep their joined label from state and each dirty tile writes
+  // the joined labels of its core.
+  
+  Mat joinedLabels(inputImg.size(), CV_32SC1);
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    const int32_t *labelsRowPtr = state.labels.ptr<int32_t>(y);
+    int32_t *joinedRowPtr = joinedLabels.ptr<int32_t>(y);
+    
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      joinedRowPtr[x] = labelConnectedTagsFind(parents, labelsRowPtr[x]);
+    }
+  }
+  
+  for ( const SegmentationTile &tile : dirtyTiles ) {
+    for ( int y = tile.core.y; y < tile.core.y + tile.core.height; y++ ) {
+      const int32_t *labels = tile.labels.ptr<int32_t>(y - tile.bounds.y);
+      int32_t *joinedRowPtr = joinedLabels.ptr<int32_t>(y);
+      
+      for ( int x = tile.core.x; x < tile.core.x + tile.core.width; x++ ) {
+        joinedRowPtr[x] = labelConnectedTagsFind(parents, tile.labelOffset + labels[x - tile.bounds.x]);
+      }
+    }
+  }
+  
+  Mat joinedTags;
+  labelsToTags(joinedLabels, joinedTags, 1);
+  
+  Mat finalLabels;
+  int32_t numFinalLabels = labelConnectedTags(joinedTags, finalLabels);
+  
+  if (numFinalLabels >= (0x00FFFFFF - 1)) {
+    cerr << "error : reconcile generated " << numFinalLabels << " regions which does not fit into a 24 bit tag" << endl;
+    state.clear();
+    return false;
+  }
+  
+  labelsToTags(finalLabels, resultImg, 1);
+  
+  // The dirty tiles are now up to date with inputImg
+  
+  state.labels = finalLabels;
+  state.numLabels = numFinalLabels;
+  
+  for ( const SegmentationTile &tile : dirtyTiles ) {
+    inputImg(tile.core).copyTo(state.referenceImg(tile.core));
+  }
+  
+  addStageTime(artifacts, "reconcile", stageStartTime);
+  
+  if (debug) {
+    cout << "reconciled " << numLabels << " state and tile regions into " << numFinalLabels << " regions" << endl;
+  }
+  
+  return true;
+}
+
+bool clusteringCombineTemporal(Mat &inputImg, Mat &resultImg, ClusteringCombineTemporalState &state,
+                               ClusteringCombineArtifacts &artifacts, int tileSize, int apron, int diffThreshold)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  assert(tileSize > 0);
+  assert(apron >= 0);
+  assert(inputImg.type() == CV_8UC3);
+  
+  TraceZone traceZone("clusteringCombineTemporal", -1, inputImg.rows * inputImg.cols);
+  
+  vector<SegmentationTile> tiles;
+  makeSegmentationTiles(inputImg.size(), tileSize, apron, tiles);
+  
+  // The first frame, or a frame that does not match the state, is segmented
+  // as a whole with the same tiles.
+  
+  if (state.labels.empty() || state.labels.size() != inputImg.size() || state.tileSize != tileSize || state.apron != apron) {
+    state.clear();
+    
+    if (!clusteringCombineTiled(inputImg, resultImg, artifacts, tileSize, apron)) {
+      return false;
+    }
+    
+    state.numLabels = labelConnectedTags(resultImg, state.labels);
+    state.referenceImg = inputImg.clone();
+    state.tileSize = tileSize;
+    state.apron = apron;
+    state.numDirtyTiles = (int) tiles.size();
+    state.numTiles = (int) tiles.size();
+    
+    return true;
+  }
+  
+  artifacts.stageTimes.clear();
+  
+  auto stageStartTime = std::chrono::steady_clock::now();
+  
+  vector<uint8_t> dirtyFlags(tiles.size());
+  
+  parallelFor(Range(0, (int) tiles.size()), FindDirtyTilesParallelBody(inputImg, state.referenceImg, tiles, diffThreshold, dirtyFlags));
+  
+  vector<SegmentationTile> dirtyTiles;
+  
+  for ( int i = 0; i < (int) tiles.size(); i++ ) {
+    if (dirtyFlags[i]) {
+      dirtyTiles.push_back(tiles[i]);
+    }
+  }
+  
+  state.numDirtyTiles = (int) dirtyTiles.size();
+  state.numTiles = (int) tiles.size();
+  
+  addStageTime(artifacts, "frameDiff", stageStartTime);
+  stageStartTime = std::chrono::steady_clock::now();
+  
+  if (debug) {
+    cout << "segment " << dirtyTiles.size() << " of " << tiles.size() << " tiles that changed" << endl;
+  }
+  
+  if (dirtyTiles.empty()) {
+    labelsToTags(state.labels, resultImg, 1);
+    return true;
+  }
+  
+  parallelFor(Range(0, (int) dirtyTiles.size()), SegmentTilesParallelBody(inputImg, dirtyTiles, artifacts.randomSeed));
+  
+  addStageTime(artifacts, "tiles", stageStartTime);
+  
+  return reconcileDirtyTiles(inputImg, resultImg, state, dirtyTiles, artifacts);
+}
+
+// A region that crosses the dirty rect is segmented again as a whole when its
+// bbox is at most this many times the area of the dirty rect, a larger region
+// is only segmented again inside the dirty rect.
+
+static const int resegmentMaxRegionScale = 4;
+
+bool resegmentRegion(Mat &inputImg, Mat &resultImg, ClusteringCombineTemporalState &state,
+                     ClusteringCombineArtifacts &artifacts, cv::Rect dirtyRect, int apron)
+{
+  const bool debug = isDebugTraceEnabled();
+  
+  assert(apron >= 0);
+  assert(inputImg.type() == CV_8UC3);
+  
+  TraceZone traceZone("resegmentRegion", -1, dirtyRect.area());
+  
+  const Rect imageRect(0, 0, inputImg.cols, inputImg.rows);
+  
+  // Without labels for this image size the whole image is segmented
+  
+  if (state.labels.empty() || state.labels.size() != inputImg.size()) {
+    state.clear();
+    
+    if (!clusteringCombine(inputImg, resultImg, artifacts)) {
+      return false;
+    }
+    
+    state.numLabels = labelConnectedTags(resultImg, state.labels);
+    state.referenceImg = inputImg.clone();
+    state.numDirtyTiles = 1;
+    state.numTiles = 1;
+    
+    return true;
+  }
+  
+  artifacts.stageTimes.clear();
+  
+  dirtyRect &= imageRect;
+  
+  if (dirtyRect.area() == 0) {
+    labelsToTags(state.labels, resultImg, 1);
+    return true;
+  }
+  
+  auto stageStartTime = std::chrono::steady_clock::now();
+  
+  // Labels that have a pixel in the dirty rect
+  
+  vector<uint8_t> touched(state.numLabels, 0);
+  
+  for ( int y = dirtyRect.y; y < dirtyRect.y + dirtyRect.height; y++ ) {
+    const int32_t *labelsRowPtr = state.labels.ptr<int32_t>(y);
+    
+    for ( int x = dirtyRect.x; x < dirtyRect.x + dirtyRect.width; x++ ) {
+      touched[labelsRowPtr[x]] = 1;
+    }
+  }
+  
+  // Bbox of each touched label as min and max coords
+  
+  vector<cv::Rect> bounds(state.numLabels, cv::Rect(inputImg.cols, inputImg.rows, -1, -1));
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    const int32_t *labelsRowPtr = state.labels.ptr<int32_t>(y);
+    
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      int32_t label = labelsRowPtr[x];
+      
+      if (touched[label]) {
+        cv::Rect &r = bounds[label];
+        r.x = mini(r.x, x);
+        r.y = mini(r.y, y);
+        r.width = maxi(r.width, x);
+        r.height = maxi(r.height, y);
+      }
+    }
+  }
+  
+  cv::Rect core = dirtyRect;
+  
+  for ( int32_t label = 0; label < state.numLabels; label++ ) {
+    if (!touched[label]) {
+      continue;
+    }
+    
+    const cv::Rect &r = bounds[label];
+    cv::Rect regionBbox(r.x, r.y, r.width - r.x + 1, r.height - r.y + 1);
+    
+    if (regionBbox.area() <= resegmentMaxRegionScale * dirtyRect.area()) {
+      core |= regionBbox;
+    }
+  }
+  
+  vector<SegmentationTile> dirtyTiles(1);
+  
+  SegmentationTile &tile = dirtyTiles[0];
+  tile.core = core;
+  tile.bounds = Rect(core.x - apron, core.y - apron, core.width + 2 * apron, core.height + 2 * apron) & imageRect;
+  tile.numLabels = 0;
+  tile.labelOffset = 0;
+  tile.worked = false;
+  
+  if (debug) {
+    cout << "resegment " << core << " for dirty rect " << dirtyRect << endl;
+  }
+  
+  SegmentTilesParallelBody(inputImg, dirtyTiles, artifacts.randomSeed)(Range(0, 1));
+  
+  state.numDirtyTiles = 1;
+  state.numTiles = 1;
+  
+  addStageTime(artifacts, "tiles", stageStartTime);
+  
+  return reconcileDirtyTiles(inputImg, resultImg, state, dirtyTiles, artifacts);
+}
@@ -11,12 +11,27 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 
+#include "Coord.h"
+#include "CoordGrid.h"
+#include "RegionMask.h"
+#include "MatPool.h"
+#include "OpenCVHull.hpp"
+
+struct srm;
+
 class SuperpixelImage;
-class Coord;
+class SuperpixelEdge;
 class LineOrCurveSegment;
+class RegionRemerger;
 
 using cv::Mat;
 using std::string;
@@ -31,29 +46,375 @@ void writeTagsWithMinColortable(SuperpixelImage &spImage, Mat &origImg, Mat &res
 
 Mat dumpQuantImage(string filename, const Mat &inputImg, uint32_t *pixels);
 
-void dumpQuantTableImage(string filename, const Mat &inputImg, uint32_t *colortable, uint32_t numColortableEntries);
+void dumpQuantTableImage(string filename, const Mat &inputImg, const uint32_t *colortable, uint32_t numColortableEntries);
+
+// A 4x4 block has at most 16 distinct quant pixels
+
+#define HISTOGRAM_FOR_BLOCK_MAX_PIXELS 16
 
 typedef struct {
   // What is the overall most common pixel that the region would quant to
   uint32_t regionQuantPixel;
   
-  // Counts for each pixel in the block
-  unordered_map<uint32_t, uint32_t> pixelToCountTable;
+  // Number of distinct quant pixels in the block
+  uint8_t numPixels;
+  
+  // Palette offset and count for each distinct quant pixel in the block, in the
+  // order the pixels are first seen in the block
+  uint8_t paletteOffsets[HISTOGRAM_FOR_BLOCK_MAX_PIXELS];
+  uint8_t counts[HISTOGRAM_FOR_BLOCK_MAX_PIXELS];
 } HistogramForBlock;
 
+// When paletteIndexMat is not NULL it is written with the CV_16UC1 offset in
+// the subdivided palette of each input pixel, the same offsets the block
+// histograms count.
+
 Mat genHistogramsForBlocks(const Mat &inputImg,
-                           unordered_map<Coord, HistogramForBlock> &blockMap,
+                           CoordGrid<HistogramForBlock> &blockMap,
                            int blockWidth,
                            int blockHeight,
-                           int superpixelDim);
+                           int superpixelDim,
+                           Mat *paletteIndexMat = NULL);
+
+// The pixels of one region, read once and shared by the estimate and capture
+// branches that run on the same region coords in sequence or as fallbacks.
+// The packed pixels, the count of each distinct pixel, the subdivided palette
+// pixels and each quant_recurse() result are generated the first time a
+// branch asks for them. The image can be BGR or packed by packPixels(), the
+// image, coords and paletteIndexMat must outlive the RegionPixels.
+
+typedef struct {
+  uint32_t numClusters;
+  // Cluster centers, the size is the number of actual clusters
+  vector<uint32_t> colortable;
+  // Cluster center of each region pixel
+  vector<uint32_t> quantPixels;
+  // True when the colortable was refined from a seed colortable
+  bool seeded;
+} RegionPixelsQuant;
+
+class RegionPixels {
+public:
+  RegionPixels(const Mat &image, const vector<Coord> &coords, const Mat *paletteIndexMat = NULL);
+  
+  const vector<Coord>& getCoords() const {
+    return coords;
+  }
+  
+  size_t size() const;
+  
+  // 24 bit pixel of each coord
+  
+  const vector<uint32_t>& getPixels();
+  
+  // Number of coords with each distinct pixel
+  
+  const unordered_map<uint32_t, uint32_t>& getPixelCounts();
+  
+  // Nearest subdivided palette pixel of each coord, read from paletteIndexMat
+  // when one was passed.
+  
+  const vector<uint32_t>& getPalettePixels();
+  
+  // quant_recurse() of the pixels into at most numClusters clusters
+  
+  const RegionPixelsQuant& getQuant(uint32_t numClusters);
+  
+  // Same as getQuant() but warm started from seedColortable, like the colortable
+  // of a region that contains this one, see quant_recurse_seeded(). A quant that
+  // was already generated for numClusters is returned as is.
+  
+  const RegionPixelsQuant& getQuant(uint32_t numClusters, const vector<uint32_t> &seedColortable, double maxSeedMSE);
+  
+  // Generate the quant for numClusters of each region that does not have one
+  // yet with one quant_recurse_batch() call, so that a wave of regions is
+  // quantized in parallel. getQuant() then returns the result.
+  
+  static void quantBatch(const vector<RegionPixels*> &regions, uint32_t numClusters);
+  
+private:
+  const Mat &image;
+  const vector<Coord> &coords;
+  const Mat *paletteIndexMat;
+  
+  vector<uint32_t> pixels;
+  bool hasPixels;
+  
+  unordered_map<uint32_t, uint32_t> pixelCounts;
+  bool hasPixelCounts;
+  
+  vector<uint32_t> palettePixels;
+  bool hasPalettePixels;
+  
+  // Few cluster counts are used for one region, so the quants are searched in
+  // order. A deque keeps the returned references valid as quants are added.
+  
+  std::deque<RegionPixelsQuant> quants;
+  
+  RegionPixels(const RegionPixels &);
+  RegionPixels& operator=(const RegionPixels &);
+};
+
+// Given input pixels and a range of coordinates, estimate the number of clusters
+// and the cluster centers. Returns true when the region pixels are very close.
+// Pass the paletteIndexMat from genHistogramsForBlocks() to read the palette
+// offset of each region pixel instead of mapping the pixels again.
+
+bool
+estimateClusterCenters(const Mat & inputImg,
+                       int32_t tag,
+                       const vector<Coord> &regionCoords,
+                       vector<uint32_t> &clusterCenters,
+                       const Mat *paletteIndexMat = NULL);
+
+// Same as estimateClusterCenters() for the pixels of a region that may already
+// have been read by another branch.
+
+bool
+estimateClusterCenters(const Mat & inputImg,
+                       int32_t tag,
+                       RegionPixels &regionPixels,
+                       vector<uint32_t> &clusterCenters);
+
+// Generate rectangle coordinates given region width and height, the outline
+// starts at 12 oclock and goes around clockwise.
+
+vector<Coord> genRectangleOutline(int regionWidth, int regionHeight);
+
+// Pixels on each ray that clockwiseScanForTagsAroundShape() renders from a center
+// point to the points returned by genRectangleOutline() for one bbox size. The
+// points of ray i are points[rayStarts[i]] up to points[rayStarts[i+1]], these
+// are bbox relative and in raster order. The rays are the same as the 8 connected
+// lines drawn by cv::line().
+
+typedef struct {
+  vector<int32_t> rayStarts;
+  vector<Coord> points;
+} BboxRayTable;
+
+// The rays only depend on the bbox size and the center, so the tables are built
+// once for each key and shared between regions and threads.
+
+class BboxRayTableCache {
+public:
+  BboxRayTableCache(size_t maxTables = 256) : maxTables(maxTables) {}
+  
+  std::shared_ptr<const BboxRayTable> lookup(int width, int height, Coord center);
+  
+  size_t size();
+  
+  void clear();
+  
+  static std::shared_ptr<BboxRayTable> build(int width, int height, Coord center);
+  
+private:
+  std::mutex mutex;
+  
+  // When the number of tables reaches this size the cache is cleared
+  
+  size_t maxTables;
+  
+  unordered_map<uint64_t, std::shared_ptr<const BboxRayTable> > tables;
+};
+
+// Shape analysis that clockwiseScanForShapeBounds() does for a region before
+// any pixels are read: the hull split of the region contour, the contour with
+// normals for each point and the region center.
+
+typedef struct {
+  vector<TypedHullCoords> hullCoordsVec;
+  vector<Coord> contourCoords;
+  vector<Point2i> contour;
+  vector<Point2f> contourNormals;
+  ContourNormalRays normalVectors;
+  Point2i regionCenterP;
+  // Size of the tags image and number of region coords, checked on lookup
+  cv::Size imageSize;
+  uint32_t numCoords;
+} ShapeBoundsGeometry;
+
+// Shape geometry for one capture run keyed on the tag and an adler hash of the
+// region coords. A tag that is captured again after a merge in the same run has
+// the same region coords, so only the pixel dependent scan is done again. The
+// cache can be shared by capture threads.
+
+class ShapeBoundsGeometryCache {
+public:
+  std::shared_ptr<const ShapeBoundsGeometry> lookup(int32_t tag, cv::Size imageSize, const vector<Coord> &regionCoords);
+  
+  void insert(int32_t tag, const vector<Coord> &regionCoords, std::shared_ptr<ShapeBoundsGeometry> geometry);
+  
+  size_t size();
+  
+  void clear();
+  
+  static uint64_t makeKey(int32_t tag, const vector<Coord> &regionCoords);
+  
+private:
+  std::mutex mutex;
+  
+  unordered_map<uint64_t, std::shared_ptr<const ShapeBoundsGeometry> > geometries;
+};
+
+// An SRM context holds the SRM buffers so that multiple SRM runs can be
+// executed without reallocating. A context can be reused across different
+// Q values and images, the buffers are only reallocated when an image is
+// larger than any previous image. A context must not be shared between
+// threads, each worker thread should hold its own context.
+
+class SRMContext {
+public:
+  SRMContext() : srmPtr(NULL), minRegions(0), maxRegions(0), Q(128.0), lastQ(0.0) {}
+  
+  ~SRMContext();
+  
+  // Return a context ready to run with the indicated Q and dimensions, the
+  // pixels have 1 gray, 3 BGR or 4 BGRA channels.
+  
+  struct srm* prepare(double Q, int width, int height, int channels = 3);
+  
+  // When a region range is set srmMultiSegment() searches for a Q that
+  // generates between minRegions and maxRegions regions instead of using
+  // a fixed Q, a zero maxRegions disables the search.
+  
+  void setTargetRegionRange(int minRegions, int maxRegions) {
+    this->minRegions = minRegions;
+    this->maxRegions = maxRegions;
+  }
+  
+  bool hasTargetRegionRange() const {
+    return maxRegions > 0;
+  }
+  
+  int getMinRegions() const {
+    return minRegions;
+  }
+  
+  int getMaxRegions() const {
+    return maxRegions;
+  }
+  
+  // Q that srmMultiSegment() runs with when there is no target region range,
+  // 128 by default. A smaller Q merges more pixels into fewer regions.
+  
+  void setQ(double Q) {
+    this->Q = Q;
+  }
+  
+  double getQ() const {
+    return Q;
+  }
+  
+  // Q used by the last srmMultiSegment() run with this context
+  
+  double getLastQ() const {
+    return lastQ;
+  }
+  
+  void setLastQ(double Q) {
+    lastQ = Q;
+  }
+  
+private:
+  struct srm *srmPtr;
+  int minRegions;
+  int maxRegions;
+  double Q;
+  double lastQ;
+  
+  SRMContext(const SRMContext &);
+  SRMContext& operator=(const SRMContext &);
+};
 
 // Generate a tags Mat from the original input pixels based on SRM algo.
 
 Mat generateSRM(const Mat &inputImg, double Q);
 
+// Zero copy SRM entry point, the input pixels are read directly from inputImg
+// and the region colors are written into outImg. The input can be a CV_8UC1,
+// CV_8UC3 or CV_8UC4 Mat, so a gray scan or a BGRA frame is segmented without a
+// conversion to BGR. Note that outImg is only reallocated when it is not already
+// a Mat of the same size and type as the input.
+
+void generateSRM(const Mat &inputImg, double Q, Mat &outImg);
+
+void generateSRM(const Mat &inputImg, double Q, Mat &outImg, SRMContext &srmContext);
+
+// When enabled and the OpenCV T-API has an OpenCL device, generateSRM() and
+// generateSRMLabels() compute the SRM pair diffs and the diff histogram on the
+// device and only sort and merge the pairs on the CPU. The merge is the same,
+// so the output is the same as the CPU path. A kernel that fails to build or
+// run falls back to the CPU diffs. Disabled by default.
+
+void setSRMDeviceEnabled(bool enable);
+
+bool isSRMDeviceEnabled();
+
+// SRM label mode, writes a CV_32SC1 Mat where each region has a unique 0 -> N-1 label.
+// The input types are the same as generateSRM(). Returns the number of regions N. The labels are written on multiple threads, when
+// labelCounts or labelBounds is not NULL the pixel count or the bounding box of
+// each label is gathered in the same pass.
+
+int32_t generateSRMLabels(const Mat &inputImg, double Q, Mat &labelsMat);
+
+int32_t generateSRMLabels(const Mat &inputImg, double Q, Mat &labelsMat, SRMContext &srmContext,
+                          vector<int32_t> *labelCounts = NULL, vector<Rect> *labelBounds = NULL);
+
+// Tiled SRM label mode, bands of tileRows rows are segmented in parallel and then
+// the band seams are merged. Pass zero as tileRows to use one band per thread.
+// Returns the number of regions.
+
+int32_t generateSRMLabelsTiled(const Mat &inputImg, double Q, Mat &labelsMat, SRMContext &srmContext, int tileRows,
+                               vector<int32_t> *labelCounts = NULL, vector<Rect> *labelBounds = NULL);
+
+// Auto Q SRM label mode, Q is found by a binary search between minQ and maxQ so
+// that the number of regions is between minRegions and maxRegions. The pairs
+// are sorted once and each trial only merges them again. When no Q in at most
+// maxTrials trials gives a count in the range the closest Q is used. Returns
+// the number of regions and writes the Q into chosenQ when not NULL.
+
+int32_t generateSRMLabelsAutoQ(const Mat &inputImg, int minRegions, int maxRegions, Mat &labelsMat, SRMContext &srmContext,
+                               double *chosenQ = NULL,
+                               vector<int32_t> *labelCounts = NULL, vector<Rect> *labelBounds = NULL,
+                               double minQ = 4.0, double maxQ = 4096.0, int maxTrials = 16);
+
+// Streaming SRM label mode for images too large to hold in memory. readBand() is
+// invoked with a row offset and a row count and must fill a CV_8UC3 band Mat with
+// those rows. writeLabels() gets the provisional CV_32SC1 labels for each band. Once
+// all bands are processed labelMap maps each provisional label to a final 0 -> N-1
+// label, so the label stream is remapped in a second pass. Returns N.
+
+int32_t generateSRMLabelsStreamed(int width, int height, double Q, int bandRows,
+                                  std::function<void(int row, int numRows, Mat &band)> readBand,
+                                  std::function<void(int row, const Mat &labels)> writeLabels,
+                                  vector<int32_t> &labelMap);
+
+// Streaming SRM label mode for an input Mat that is backed by a memory mapped file
+// or some other lazy source, only bandRows rows of input are touched at a time.
+
+int32_t generateSRMLabelsStreamed(const Mat &inputImg, double Q, Mat &labelsMat, int bandRows);
+
+// Hierarchical SRM label mode, one CV_32SC1 label Mat is generated for each Q value
+// but the SRM pairs are only sorted once. Regions for a smaller Q are always a merge
+// of regions for a larger Q. Returns the number of regions for each Q.
+
+vector<int32_t> generateSRMMultiLabels(const Mat &inputImg, const vector<double> &Qs, vector<Mat> &labelsMats, SRMContext &srmContext);
+
+// Convert a CV_32SC1 label Mat into a 24 bit tags Mat as (label + labelOffset)
+
+void labelsToTags(const Mat &labelsMat, Mat &tagsMat, int32_t labelOffset);
+
+// Label the 8 connected components of each tag in a 24 bit tags Mat, so that a tag
+// used by regions that are not connected gets one label for each region. Labels
+// are written to a CV_32SC1 Mat in the order the regions are first found in a
+// raster scan and the number of labels is returned.
+
+int32_t labelConnectedTags(const Mat &tagsMat, Mat &labelsMat);
+
 // Given a tag indicating a superpixel generate a mask that captures the region in terms of
 // exact pixels. This method returns a Mat that indicate a boolean region mask where 0xFF
-// means that the pixel is inside the indicated region.
+// means that the pixel is inside the indicated region. When a geometryCache is passed, a
+// region captured again with the same coords reuses the shape analysis from the cache.
 
 bool
 captureRegionMask(SuperpixelImage &spImage,
@@ -64,7 +425,91 @@ captureRegionMask(SuperpixelImage &spImage,
                   int blockHeight,
                   int superpixelDim,
                   Mat &mask,
-                  const Mat &blockBasedQuantMat);
+                  const Mat &blockBasedQuantMat,
+                  ShapeBoundsGeometryCache *geometryCache = NULL);
+
+// Region mask form of captureRegionMask() where mergedMask is only read to find the pixels
+// that were already merged, and the mask is set to the bbox of the captured pixels. Each
+// capture of a region costs the size of the region and not the size of the image.
+
+bool
+captureRegionMask(SuperpixelImage &spImage,
+                  const Mat & inputImg,
+                  const Mat & srmTags,
+                  int32_t tag,
+                  int blockWidth,
+                  int blockHeight,
+                  int superpixelDim,
+                  const Mat &mergedMask,
+                  RegionMask &mask,
+                  const Mat &blockBasedQuantMat,
+                  ShapeBoundsGeometryCache *geometryCache = NULL);
+
+// Regions with fewer coords than this are captured by captureRegionMask() with a
+// comparison of the mean and variance of the region colors against the neighbors
+// when the color stats of spImage were set from inputImg. A small region that is
+// distinct from every neighbor is captured as its own pixels, one that is close
+// to a neighbor is not captured. The default is 256, 0 disables the small region
+// capture so that every region is run through the full capture logic.
+
+void setSmallCaptureRegionMaxCoords(int maxCoords);
+
+int getSmallCaptureRegionMaxCoords();
+
+// Regions that are not small and whose color variance, the sum of the variance
+// of each channel in the cached color stats, is at most this value are captured
+// by captureRegionMask() as the pixels of the expanded region that are close to
+// the mean color of the region. Flat backgrounds and UI areas skip the quant and
+// shape analysis this way. The default is 12, 0 disables the homogeneous capture.
+
+void setHomogeneousCaptureMaxVariance(float maxVariance);
+
+float getHomogeneousCaptureMaxVariance();
+
+// Number of blocks around a region that captureRegionMask() expands the region
+// by to find the pixels that may belong to it, 2 by default. More blocks find
+// more of a region that SRM split up at the cost of a larger capture. This
+// must not be changed while a capture is running.
+
+void setCaptureRegionExpandBlocks(int numBlocks);
+
+int getCaptureRegionExpandBlocks();
+
+// Bounds of the mask pixels that captureRegionMask() reads for a tag, an empty
+// Rect when the region is too small to be captured.
+
+cv::Rect
+captureRegionMaskBounds(SuperpixelImage &spImage,
+                        const Mat & inputImg,
+                        int32_t tag,
+                        int blockWidth,
+                        int blockHeight,
+                        int superpixelDim);
+
+// Capture and merge each tag in order, the same result as invoking captureRegionMask()
+// for each tag and then remerger.mergeFromMask() when a mask was written. Tags next to
+// each other in the order whose mask bounds do not overlap are captured in parallel as
+// a wave, the masks are then merged in order. When an earlier tag in a wave merged
+// pixels inside the bounds of a later tag, the later tag is captured again after that
+// merge. mergedFunc is invoked after each merge with the tag and the mask that was
+// merged. No new wave is started once the deadline has passed, the tags that
+// were not captured are left for remerger.mergeLeftovers(). When tagSeconds is not
+// NULL it is set to the capture time of each tag, zero for a tag that was not
+// captured. Returns the number of tags from the start of the order that were captured.
+
+int
+captureRegionMasks(SuperpixelImage &spImage,
+                   const Mat & inputImg,
+                   const Mat & srmTags,
+                   const vector<int32_t> &tags,
+                   int blockWidth,
+                   int blockHeight,
+                   int superpixelDim,
+                   RegionRemerger &remerger,
+                   const Mat &blockBasedQuantMat,
+                   std::function<void(int32_t tag, const RegionMask &mask)> mergedFunc,
+                   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(),
+                   vector<float> *tagSeconds = NULL);
 
 // Foreach pixel in a colortable determine the "inside/outside" status of that
 // pixel based on a stats test as compared to the current known region.
@@ -85,6 +530,205 @@ void insideOutsideTest(int32_t width,
                        const vector<uint32_t> &sortedColortable,
                        unordered_map<uint32_t, InsideOutsideRecord> &pixelToInsideMap);
 
+// Inside and outside counts of each colortable pixel over the quant pixels of a
+// region, kept up to date as region coords move across the boundary of the known
+// region. A move only updates the count of the one pixel, so a step that grows
+// or shrinks the known region by N coords costs O(N) and not a rescan of the
+// region. Pixels that are not in the colortable are counted but not voted on,
+// as with insideOutsideTest().
+
+class InsideOutsideCounts {
+public:
+  // regionCoords[i] was quantized to outPixels[i], the coords of the known
+  // region are inside and every other region coord is outside.
+  
+  void init(const vector<Coord> &coords,
+            const vector<Coord> &regionCoords,
+            const uint32_t *outPixels,
+            const vector<uint32_t> &sortedColortable);
+  
+  int getNumRegionCoords() const {
+    return (int) coordBins.size();
+  }
+  
+  bool isInside(int i) const {
+    return coordInside[i] != 0;
+  }
+  
+  // Move region coord i inside or outside, no-op when it already is
+  
+  void setInside(int i, bool inside) {
+    if (isInside(i) == inside) {
+      return;
+    }
+    const int32_t bin = coordBins[i];
+    coordInside[i] = inside ? 1 : 0;
+    insideCounts[bin] += inside ? 1 : -1;
+    outsideCounts[bin] += inside ? -1 : 1;
+  }
+  
+  // Counts and confidence of the colortable pixel at offset, a pixel with no
+  // quant pixels is assumed to be inside.
+  
+  int getInside(int offset) const {
+    return insideCounts[colorBins[offset]];
+  }
+  
+  int getOutside(int offset) const {
+    return outsideCounts[colorBins[offset]];
+  }
+  
+  float getConfidence(int offset) const {
+    const int inside = getInside(offset);
+    const int total = inside + getOutside(offset);
+    return (total == 0) ? 1.0f : ((float) inside / total);
+  }
+  
+  // Write the record of each pixel, replacing the records of the pixels
+  // already in pixelToInsideMap. A colortable pixel is inside when its
+  // confidence is GT 50%.
+  
+  void writeRecords(unordered_map<uint32_t, InsideOutsideRecord> &pixelToInsideMap) const;
+  
+private:
+  // Bin of each colortable offset, a pixel that is in the colortable more
+  // than once is counted in the bin of its first offset.
+  
+  vector<uint32_t> colortable;
+  vector<int32_t> colorBins;
+  
+  // Pixels not in the colortable, counted in the bins after the colortable bins
+  
+  vector<uint32_t> otherPixels;
+  
+  vector<int> insideCounts;
+  vector<int> outsideCounts;
+  
+  vector<int32_t> coordBins;
+  vector<uint8_t> coordInside;
+};
+
+// Containment tree of the superpixels stored in flat arrays indexed by a compact
+// node index, -1 means no node. The children of a node are linked through
+// nextSiblings starting from firstChildren in the order they were found. The
+// tree is kept up to date under merges with mergeNodes(), so that an inside
+// out order can be read again after a merge pass without a rebuild.
+
+class SuperpixelContainmentTree {
+public:
+  // Tag of each node, nodes that are not in the tree have a -1 parent and
+  // are not reachable from rootNodes.
+  
+  vector<int32_t> nodeTags;
+  vector<int32_t> parents;
+  vector<int32_t> firstChildren;
+  vector<int32_t> nextSiblings;
+  
+  // Outermost nodes with the largest superpixel first
+  
+  vector<int32_t> rootNodes;
+  
+  // Node of each tag, the table is indexed by tag when the tags are dense and
+  // the map is used otherwise.
+  
+  vector<int32_t> denseTagToNode;
+  unordered_map<int32_t, int32_t> sparseTagToNode;
+  
+  // Node of a tag or -1 when the tag is not in the tree
+  
+  int32_t findNode(int32_t tag) const {
+    if (!denseTagToNode.empty()) {
+      return ((size_t) tag < denseTagToNode.size()) ? denseTagToNode[tag] : -1;
+    }
+    auto it = sparseTagToNode.find(tag);
+    return (it == sparseTagToNode.end()) ? -1 : it->second;
+  }
+  
+  // Update the tree after the superpixel srcTag was merged into dstTag, the
+  // src node is removed from the tree. Merging a child into its parent splices
+  // the children of the child into the parent at the position of the child.
+  // Merging a node into a node it contains moves the children of dst up to the
+  // parent of dst and then moves dst to the position of src with all the
+  // children of src. Merging siblings, or any other two nodes, appends the
+  // children of src to dst. The roots are not sorted by size again.
+  
+  void mergeNodes(int32_t srcTag, int32_t dstTag);
+  
+  vector<int32_t> getRootTags() const {
+    vector<int32_t> rootTags;
+    rootTags.reserve(rootNodes.size());
+    for ( int32_t node : rootNodes ) {
+      rootTags.push_back(nodeTags[node]);
+    }
+    return rootTags;
+  }
+  
+  void getChildTags(int32_t node, vector<int32_t> &childTags) const {
+    childTags.clear();
+    for ( int32_t child = firstChildren[node]; child != -1; child = nextSiblings[child] ) {
+      childTags.push_back(nodeTags[child]);
+    }
+  }
+  
+  // Invoke f(tag, node) for each node in the tree in the same order as
+  // recurseSuperpixelIterate(), the last root first and each node before its
+  // children with the last child first. An explicit stack is used so that
+  // a deeply nested tree cannot overflow the call stack.
+  
+  template <typename F>
+  void iterate(F f) const {
+    vector<int32_t> stack(rootNodes.begin(), rootNodes.end());
+    
+    while (!stack.empty()) {
+      int32_t node = stack.back();
+      stack.pop_back();
+      
+      f(nodeTags[node], node);
+      
+      for ( int32_t child = firstChildren[node]; child != -1; child = nextSiblings[child] ) {
+        stack.push_back(child);
+      }
+    }
+  }
+  
+  // Tags from the innermost superpixel outwards, the reverse of iterate()
+  
+  vector<int32_t> getInsideOutOrder() const {
+    vector<int32_t> order;
+    iterate([&order](int32_t tag, int32_t node) {
+      order.push_back(tag);
+    });
+    std::reverse(order.begin(), order.end());
+    return order;
+  }
+  
+private:
+  
+  // Remove node from the child list of its parent or from the roots
+  
+  void unlinkNode(int32_t node);
+  
+  // Replace node in the child list of its parent with the children of node
+  
+  void spliceChildren(int32_t node);
+};
+
+// Determine the containment tree of the superpixels. The outermost superpixels
+// are the ones that touch the edges of tagsImg, each superpixel contains the
+// neighbors that are not already contained by another superpixel. The tags
+// image is CV_8UC3 or CV_32SC1.
+
+void buildSuperpixelContainmentTree(SuperpixelImage &spImage,
+                                    const Mat &tagsImg,
+                                    SuperpixelContainmentTree &tree);
+
+// Merge edge with SuperpixelImage::mergeEdge() and update the containment
+// tree for the merge with mergeNodes().
+
+void mergeEdgeInContainmentTree(SuperpixelImage &spImage,
+                                SuperpixelContainmentTree &tree,
+                                SuperpixelEdge &edge);
+
 // Recurse into each superpixel and determine the children of each superpixel.
 
 std::vector<int32_t>
@@ -92,21 +736,26 @@ recurseSuperpixelContainment(SuperpixelImage &spImage,
                              const Mat &tagsImg,
                              unordered_map<int32_t, std::vector<int32_t> > &map);
 
-// Inlined typed recursion method to iterate over tree structure contained
-// in root tags and a map that maps the tag to a vector of children.
+// Iterate over tree structure contained in root tags and a map that maps the
+// tag to a vector of children. The last tag is visited first and each tag is
+// visited before its children, an explicit stack is used in place of recursion.
 
-static inline
+template <typename F>
 void recurseSuperpixelIterate(const vector<int32_t> &tags,
                               unordered_map<int32_t, vector<int32_t> > &map,
-                              std::function<void(int32_t, const vector<int32_t> &)> f)
+                              F f)
 {
-  for (auto it = tags.rbegin(); it != tags.rend(); ++it) {
-    int32_t tag = *it;
+  vector<int32_t> stack(tags.begin(), tags.end());
+  
+  while (!stack.empty()) {
+    int32_t tag = stack.back();
+    stack.pop_back();
+    
     vector<int32_t> &children = map[tag];
     
     f(tag, children);
     
-    recurseSuperpixelIterate(children, map, f);
+    stack.insert(stack.end(), children.begin(), children.end());
   }
 }
 
@@ -114,6 +763,16 @@ void recurseSuperpixelIterate(const vector<int32_t> &tags,
 
 bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat);
 
+// Multi segmenting approach that reuses the SRM buffers in srmContext. When
+// labelsMat is not NULL the CV_32SC1 SRM labels are also returned, each tag
+// in tagsMat is the label plus 1. When labelCounts is not NULL the pixel
+// count of each label is returned and when labelBounds is not NULL the bbox
+// of each label, see SuperpixelImage::parseLabels().
+
+bool srmMultiSegment(const Mat & inputImg, Mat & tagsMat, SRMContext & srmContext,
+                     Mat *labelsMat = NULL, vector<int32_t> *labelCounts = NULL,
+                     vector<Rect> *labelBounds = NULL);
+
 // Implement merge of superpixels based on coordinates gather from SRM process
 
 #import "SuperpixelMergeManager.h"
@@ -124,9 +783,9 @@ public:
   unordered_map<int32_t, int32_t> locked;
   
   // Other tags is a read-only set of tags that indicate which
-  // superpixels were found to be in the region.
+  // superpixels were found to be in the region, see setOtherTags().
   
-  set<int32_t> *otherTagsSetPtr;
+  SuperpixelTagBitset otherTags;
   
   // The all sorted list makes it possible to hold the sorted
   // list across multiple invocations of the merge logic using
@@ -138,16 +797,27 @@ public:
 
   int32_t mergedIntoTag;
   
+  // Lazy merge mode of the edge table before setup()
+  
+  bool wasLazyMerge;
+  
   // Set to true to enable debug global step dump
-  const bool debugDumpImages = true;
+  const bool debugDumpImages = false;
   
   // Set to true to enable debug step dump
   const bool debugDumpEachStepImages = false;
   
   SRMMergeManager(SuperpixelImage & _spImage, Mat &_inputImg)
-  : SuperpixelMergeManager(_spImage, _inputImg), mergeStepAtStart(0), mergedIntoTag(0)
+  : SuperpixelMergeManager(_spImage, _inputImg), mergeStepAtStart(0), mergedIntoTag(0), wasLazyMerge(false)
   {}
   
+  // Set the tags found in the region from a set or vector of tags
+  
+  template <class C>
+  void setOtherTags(const C &tags) {
+    otherTags.assign(tags);
+  }
+  
   // Invoked before the merge operation starts, useful to setup initial
   // state and cache values.
   
@@ -156,24 +826,27 @@ public:
       allSortedSuperpixels = spImage.sortSuperpixelsBySize();
     }
     
-    unordered_map<int32_t,int32_t> map;
-    
-    for ( int32_t tag : *otherTagsSetPtr ) {
-      map[tag] = tag;
-    }
+    superpixels.reserve(otherTags.count);
     
     for ( int32_t tag : allSortedSuperpixels ) {
-      if (map.count(tag) > 0) {
+      if (otherTags.contains(tag)) {
         superpixels.push_back(tag);
       }
     }
     
+    // Many small regions are merged into each region, so only update the
+    // neighbors of the other regions when they are accessed
+    
+    wasLazyMerge = spImage.edgeTable.lazyMerge;
+    spImage.edgeTable.lazyMerge = true;
+    
     return;
   }
   
   // Invoked at the end of the processing operation
   
   void finish() {
+    spImage.edgeTable.lazyMerge = wasLazyMerge;
     return;
   }
   
@@ -235,13 +908,9 @@ public:
   // should be merged and false otherwise.
   
   bool checkEdge(int32_t dst, int32_t src) {
-    // dst was already verified, so just check to see if src is in otherTagsSet
+    // dst was already verified, so just check to see if src is in otherTags
     
-    if ( otherTagsSetPtr->find(src) != otherTagsSetPtr->end() ) {
-      return true;
-    } else {
-      return false;
-    }
+    return otherTags.contains(src);
   }
   
   // This method actually does the merge operation
@@ -270,5 +939,329 @@ public:
   
 };
 
+// Stage results of clusteringCombine() that do not depend on the region capture
+// settings. When the same artifacts are passed to another clusteringCombine()
+// run on the same input image the SRM, containment and block histogram stages
+// are not run again. Each artifact records the content hash of the input it
+// was generated from, a different input discards it. The SRM tags and the
+// containment order can be saved to and loaded from a directory.
+
+typedef struct {
+  string name;
+  double seconds;
+  // True when the stage result was read from the artifacts
+  bool cached;
+  // True when the memory stats were enabled as the stage ran
+  bool hasMemoryStats;
+  // High water mark of the Mat pixel data and of the heap during the stage,
+  // the heap values are zero unless built with SEGMENTATION_COUNT_HEAP_ALLOCATIONS
+  int64_t matPeakBytes;
+  int64_t matAllocations;
+  int64_t heapPeakBytes;
+  int64_t heapAllocations;
+} ClusteringCombineStageTime;
+
+// Capture cost of one tag, the seconds are measured for a captured tag and
+// estimated from the seconds per coord of the captured tags otherwise.
+
+typedef struct {
+  int32_t tag;
+  int32_t numCoords;
+  float seconds;
+  bool captured;
+} ClusteringCombineTagCost;
+
+// A region as the capture stage commits it, see ClusteringCombineArtifacts::regionFunc.
+// The mask is only valid while regionFunc runs, its bbox can be larger than the
+// bounds of the pixels that are on.
+
+typedef struct {
+  // Tag of the SRM superpixel the region was captured for
+  int32_t srmTag;
+  // Regions are committed in capture order starting at 0
+  int32_t captureIndex;
+  int32_t numPixels;
+  cv::Rect bounds;
+  // Mean BGR of the input pixels in the region
+  cv::Vec3b meanColor;
+  const RegionMask *mask;
+} ClusteringCombineRegion;
+
+class ClusteringCombineArtifacts {
+public:
+  // Content hash of the input image
+  
+  uint32_t inputHash;
+  
+  // SRM stage: tags generated by srmMultiSegment() for the input image
+  
+  Mat srmTags;
+  
+  // Containment stage: superpixel tags from the most contained region outwards,
+  // valid for the tags parsed from srmTags with the content hash srmTagsHash.
+  
+  vector<int32_t> srmInsideOutOrder;
+  
+  uint32_t srmTagsHash;
+  
+  // Block histogram stage for blocks of superpixelDim x superpixelDim pixels
+  
+  int superpixelDim;
+  
+  Mat blockBasedQuantMat;
+  
+  CoordGrid<HistogramForBlock> blockHistograms;
+  
+  // CV_16UC1 subdivided palette offset of each input pixel, generated along
+  // with the block histograms so that a region analysis reads the offsets of
+  // the region coords instead of mapping the region pixels again.
+  
+  Mat paletteIndexMat;
+  
+  // Time for each stage of the last run, in stage order
+  
+  vector<ClusteringCombineStageTime> stageTimes;
+  
+  // When not NULL the SRM stage reuses the buffers in this context, a worker
+  // that segments many images sets this to a context it owns. This is not
+  // an artifact of the input image so clear() does not reset it.
+  
+  SRMContext *srmContext;
+  
+  // When not NULL the frame size temporaries are taken from this pool, so a
+  // worker that segments many images of the same size reuses the buffers. This
+  // is not an artifact of the input image so clear() does not reset it.
+  
+  MatPool *matPool;
+  
+  // Seed for the colors of the debug images and the static colortable, the
+  // default of -1 seeds from the clock as each run starts. A benchmark or a
+  // golden output check sets a fixed seed so that every run is the same.
+  // This is not an artifact of the input image so clear() does not reset it.
+  
+  int64_t randomSeed;
+  
+  // When srmMaxRegions is not zero the SRM stage searches for a Q that gives
+  // between srmMinRegions and srmMaxRegions regions, see generateSRMLabelsAutoQ().
+  // The Q that was used is written into srmQ. These are not artifacts of the
+  // input image so clear() does not reset them, srmTags loaded for the input
+  // are used as is.
+  
+  int srmMinRegions;
+  int srmMaxRegions;
+  
+  double srmQ;
+  
+  // When not zero the capture stage does not start another tag once this many
+  // seconds have passed since clusteringCombine() started, the pixels of the
+  // tags that were not captured keep their SRM regions. This is not an
+  // artifact of the input image so clear() does not reset it.
+  
+  double timeBudget;
+  
+  // True when the last run used up the time budget before every tag was
+  // captured, so the result is partly the SRM regions.
+  
+  bool partial;
+  
+  // Capture cost of each tag of the last run in capture order, a scheduler can
+  // use the cost of the tags that were not captured to pick a budget.
+  
+  vector<ClusteringCombineTagCost> tagCosts;
+  
+  // Region counts of the last run, the SRM regions as parsed, the regions the
+  // capture stage merged SRM regions into and the regions in the result.
+  
+  int32_t numSRMRegions;
+  int32_t numCapturedRegions;
+  int32_t numRegions;
+  
+  // When set this is invoked on the thread that runs clusteringCombine() as each
+  // captured region is committed, so that work on the finished regions can start
+  // while the rest of the image is captured. The pixels of a committed region do
+  // not change, but the result can split a region that is not connected into more
+  // than one tag, and the pixels that were not captured only appear in the result.
+  // The regions of clusteringCombinePyramid() and clusteringCombineROI() are in
+  // the coords of the reduced or cropped input. A slow consumer should copy the
+  // region and hand it to another thread. This is not an artifact of the input
+  // image so clear() does not reset it.
+  
+  std::function<void(const ClusteringCombineRegion &region)> regionFunc;
+  
+  ClusteringCombineArtifacts()
+  : inputHash(0), srmTagsHash(0), superpixelDim(0), srmContext(NULL), matPool(NULL), randomSeed(-1),
+  srmMinRegions(0), srmMaxRegions(0), srmQ(0.0), timeBudget(0.0), partial(false),
+  numSRMRegions(0), numCapturedRegions(0), numRegions(0)
+  {
+  }
+  
+  // Discard the artifacts unless they were generated from an input with this
+  // content hash.
+  
+  void setInputHash(uint32_t hash);
+  
+  void clear();
+  
+  // Write srm_tags.png and srm_artifacts.txt into the existing directory dirname
+  
+  bool save(const string &dirname);
+  
+  // Read artifacts written by save(), returns false when the files are missing
+  // or were not generated from an input with the indicated content hash.
+  
+  bool load(const string &dirname, uint32_t hash);
+  
+  // Write one line with the time of each stage
+  
+  void printStageTimes(std::ostream &os) const;
+};
+
+// Threads that the segmentations run on this thread may use, for both the
+// parallel loops (see setParallelThreads()) and the DivQuant local k-means.
+// A process that runs N segmentations at once gives each worker thread about
+// 1/N of the cores so that the segmentations share the cores evenly. Every
+// thread, including the main one, is not limited until this is called, and 0
+// means all cores.
+
+void setSegmentationThreads(int numThreads);
+
+// Speed and quality settings that are set together by name. The "balanced"
+// profile has the values that a segmentation always used and is the default,
+// "fast" trades region accuracy for throughput and "quality" does more work
+// for regions that follow the edges more closely.
+
+typedef struct {
+  const char *name;
+  // SRM Q when there is no target region range, see SRMContext::setQ()
+  double srmQ;
+  // Block size in pixels of the block histograms and region masks, at most 4
+  // since a block histogram holds HISTOGRAM_FOR_BLOCK_MAX_PIXELS pixels
+  int superpixelDim;
+  // See setCaptureRegionExpandBlocks()
+  int captureExpandBlocks;
+  // See quant_set_params()
+  int quantMaxIters;
+  int quantDecFactor;
+  int quantNumBits;
+  // See setDefaultHistogramBinDim()
+  int histogramBinDim;
+} SegmentationProfile;
+
+// Find the profile with the indicated name, returns false for an unknown name
+
+bool findSegmentationProfile(const string &name, SegmentationProfile &profile);
+
+// Set the process wide profile, the SRM Q and the block size are read as each
+// clusteringCombine() starts and the other values are set right away. SRM tags
+// that are already in the artifacts are used as is. This must not be invoked
+// while a segmentation is running. Returns false when a value is out of range.
+
+bool setSegmentationProfile(const SegmentationProfile &profile);
+
+SegmentationProfile getSegmentationProfile();
+
+// Segment inputImg and write the tags into resultImg. The logic runs as a series
+// of stages, the results of the stages that do not depend on the region capture
+// logic are kept in artifacts and reused by a later run on the same input image.
+// The time of each stage is recorded in artifacts.stageTimes, along with the
+// peak memory and allocation counts when the memory stats are enabled.
+
+bool clusteringCombine(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts);
+
+// Coarse to fine segmentation, clusteringCombine() is run on the input reduced
+// with pyrDown() numLevels times, so a level of 1 is half size and 2 is quarter
+// size. The coarse regions are scaled up to the input size and each pixel within
+// 2^numLevels pixels of a coarse region boundary is assigned to the nearby region
+// with the closest mean color, so the boundaries are placed at full resolution.
+// The stage times include a "pyramidRefine" stage, the artifacts are for the
+// reduced input. A numLevels of 0 is the same as clusteringCombine().
+
+bool clusteringCombinePyramid(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts, int numLevels);
+
+// Segment only the pixels in roi, for a subject inside a known bbox. The roi
+// grown by margin pixels on each side and clipped to the input is segmented
+// with clusteringCombinePyramid() so that the regions at the roi edge see some
+// context, and resultImg is the roi.width x roi.height tags of the roi. The
+// artifacts are for the context pixels. Returns false if the roi is empty or
+// not inside the input.
+
+bool clusteringCombineROI(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts, cv::Rect roi, int margin, int numLevels);
+
+// Tiled segmentation for very large inputs. The input is split into tiles of
+// tileSize x tileSize pixels and each tile grown by apron pixels on every side is
+// segmented with clusteringCombine() on its own thread with its own artifacts.
+// The regions of two tiles that cover the same pixels in the overlap of the tiles
+// are then joined, and each pixel gets the joined region of the tile it is inside
+// of. The stage times are a "tiles" and a "reconcile" stage, the other artifacts
+// are not set since each tile has its own. A 2048 tileSize with a 64 apron is a
+// good place to start.
+
+bool clusteringCombineTiled(Mat &inputImg, Mat &resultImg, ClusteringCombineArtifacts &artifacts, int tileSize, int apron);
+
+// State kept from one frame to the next by clusteringCombineTemporal()
+
+class ClusteringCombineTemporalState {
+public:
+  // Input pixels of each tile as of the frame the tile was last segmented, so
+  // that a slow change still adds up to a difference that is detected.
+  
+  Mat referenceImg;
+  
+  // Labels of the last frame in labelConnectedTags() form, the tags written
+  // to resultImg are these labels plus one.
+  
+  Mat labels;
+  
+  int32_t numLabels;
+  
+  int tileSize;
+  int apron;
+  
+  // Number of tiles segmented for the last frame out of numTiles
+  
+  int numDirtyTiles;
+  int numTiles;
+  
+  ClusteringCombineTemporalState()
+  : numLabels(0), tileSize(0), apron(0), numDirtyTiles(0), numTiles(0)
+  {
+  }
+  
+  void clear();
+};
+
+// Temporal segmentation of a video frame. The first frame is segmented with
+// clusteringCombineTiled(), after that only the tiles of tileSize x tileSize
+// pixels where the frame differs from the pixels the tile was last segmented
+// from by more than diffThreshold are segmented again with their apron. The
+// labels of a new tile are joined with the labels of the last frame in the
+// clean pixels of its apron, so a region that continues into unchanged tiles
+// keeps one tag. A frame with no changed tiles returns the last result. The
+// stage times are "frameDiff", "tiles" and "reconcile".
+
+bool clusteringCombineTemporal(Mat &inputImg, Mat &resultImg, ClusteringCombineTemporalState &state,
+                               ClusteringCombineArtifacts &artifacts, int tileSize, int apron, int diffThreshold);
+
+// Incremental segmentation after an edit of the pixels in dirtyRect. The regions
+// in state.labels that have a pixel in dirtyRect are segmented again along with
+// the dirtyRect, a region much larger than the dirtyRect is only segmented again
+// inside the dirtyRect. The area is segmented with clusteringCombine() over an
+// apron of context and joined with the unchanged regions in the apron, see
+// clusteringCombineTemporal(). When state has no labels for this image size the
+// whole image is segmented to initialize the state.
+
+bool resegmentRegion(Mat &inputImg, Mat &resultImg, ClusteringCombineTemporalState &state,
+                     ClusteringCombineArtifacts &artifacts, cv::Rect dirtyRect, int apron);
+
+// Record the result of one segmentation in the metrics registry, see
+// MetricsRegistry.h. The image count is a counter with a result label, the time
+// of the image and of each stage that was not cached are latency histograms
+// and the region counts of the artifacts are added to counters.
+
+void recordClusteringCombineMetrics(const ClusteringCombineArtifacts &artifacts, bool worked, double seconds);
+
+// Content hash of the pixels in a Mat, this is an adler32 of each row
+
+uint32_t matContentHash(const Mat &mat);
 
 #endif /* ClusteringSegmentation_hpp */
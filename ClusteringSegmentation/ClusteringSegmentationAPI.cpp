@@ -0,0 +1,334 @@
+//
+//  ClusteringSegmentationAPI.cpp
+//  ClusteringSegmentation
+//
+//  In process entry point that segments pixels already in memory, see
+//  ClusteringSegmentationAPI.h.
+//
+
+#include "ClusteringSegmentationAPI.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "ClusteringSegmentation.hpp"
+
+#include "Util.h"
+
+using namespace cv;
+using namespace std;
+
+struct ClusteringSegmentationContext {
+  SRMContext srmContext;
+  MatPool matPool;
+};
+
+// Restore the debug output level of the calling thread as the segmentation
+// returns, no matter how it returns.
+
+class DebugOutputLevelScope {
+public:
+  DebugOutputLevelScope(DebugOutputLevel level)
+  : savedLevel(getDebugOutputLevel())
+  {
+    setDebugOutputLevel(level);
+  }
+  
+  ~DebugOutputLevelScope() {
+    setDebugOutputLevel(savedLevel);
+  }
+  
+private:
+  DebugOutputLevel savedLevel;
+};
+
+// The calling thread is not limited again once the segmentation returns
+
+class SegmentationThreadsScope {
+public:
+  SegmentationThreadsScope(int numThreads)
+  : limited(numThreads > 0)
+  {
+    if (limited) {
+      setSegmentationThreads(numThreads);
+    }
+  }
+  
+  ~SegmentationThreadsScope() {
+    if (limited) {
+      setSegmentationThreads(0);
+    }
+  }
+  
+private:
+  bool limited;
+};
+
+void clusteringSegmentationDefaultConfig(ClusteringSegmentationConfig *config)
+{
+  config->pyramidLevels = 0;
+  config->tileSize = 0;
+  config->tileApron = 64;
+  config->srmMinRegions = 0;
+  config->srmMaxRegions = 0;
+  config->randomSeed = 0;
+  config->roiX = 0;
+  config->roiY = 0;
+  config->roiWidth = 0;
+  config->roiHeight = 0;
+  config->roiMargin = 32;
+  config->numThreads = 0;
+  config->regionFunc = NULL;
+  config->regionUserData = NULL;
+}
+
+ClusteringSegmentationContext* clusteringSegmentationContextCreate(void)
+{
+  return new (std::nothrow) ClusteringSegmentationContext();
+}
+
+void clusteringSegmentationContextFree(ClusteringSegmentationContext *context)
+{
+  delete context;
+}
+
+// Count, bbox and mean color of each label in one pass over the labels
+
+static
+void fillSegmentationRegions(const Mat &inputImg, const Mat &labelsMat, int32_t numRegions, ClusteringSegmentationRegion *regions)
+{
+  vector<int32_t> minX(numRegions, inputImg.cols);
+  vector<int32_t> minY(numRegions, inputImg.rows);
+  vector<int32_t> maxX(numRegions, -1);
+  vector<int32_t> maxY(numRegions, -1);
+  vector<int64_t> sums(numRegions * 3, 0);
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    const Vec3b *inputRowPtr = inputImg.ptr<Vec3b>(y);
+    const int32_t *labelsRowPtr = labelsMat.ptr<int32_t>(y);
+  
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      int32_t label = labelsRowPtr[x];
+      const Vec3b &pixel = inputRowPtr[x];
+  
+      regions[label].numPixels += 1;
+  
+      minX[label] = mini(minX[label], x);
+      minY[label] = mini(minY[label], y);
+      maxX[label] = maxi(maxX[label], x);
+      maxY[label] = maxi(maxY[label], y);
+  
+      int64_t *sumPtr = &sums[label * 3];
+      sumPtr[0] += pixel[0];
+      sumPtr[1] += pixel[1];
+      sumPtr[2] += pixel[2];
+    }
+  }
+  
+  for ( int32_t label = 0; label < numRegions; label++ ) {
+    ClusteringSegmentationRegion &region = regions[label];
+    int64_t numPixels = maxi(1, region.numPixels);
+  
+    region.x = minX[label];
+    region.y = minY[label];
+    region.width = maxX[label] - minX[label] + 1;
+    region.height = maxY[label] - minY[label] + 1;
+  
+    region.meanB = (uint8_t) ((sums[label * 3 + 0] + (numPixels / 2)) / numPixels);
+    region.meanG = (uint8_t) ((sums[label * 3 + 1] + (numPixels / 2)) / numPixels);
+    region.meanR = (uint8_t) ((sums[label * 3 + 2] + (numPixels / 2)) / numPixels);
+  }
+}
+
+// The mask of a committed region is cropped to the bounds of its pixels
+
+static
+void emitCommittedRegion(const ClusteringCombineRegion &region, ClusteringSegmentationRegionFunc regionFunc, void *userData)
+{
+  const RegionMask &mask = *region.mask;
+  
+  ClusteringSegmentationCommittedRegion committed;
+  committed.captureIndex = region.captureIndex;
+  committed.numPixels = region.numPixels;
+  committed.x = region.bounds.x;
+  committed.y = region.bounds.y;
+  committed.width = region.bounds.width;
+  committed.height = region.bounds.height;
+  committed.meanB = region.meanColor[0];
+  committed.meanG = region.meanColor[1];
+  committed.meanR = region.meanColor[2];
+  committed.mask = NULL;
+  committed.maskStride = 0;
+  
+  if (region.bounds.area() > 0) {
+    const Mat &maskMat = mask.mat();
+    committed.mask = maskMat.ptr<uint8_t>(region.bounds.y - mask.roi.y) + (region.bounds.x - mask.roi.x);
+    committed.maskStride = maskMat.step;
+  }
+  
+  regionFunc(&committed, userData);
+}
+
+int clusteringSegmentationSegmentBGR(ClusteringSegmentationContext *context,
+                                     const uint8_t *bgrPixels,
+                                     int32_t width,
+                                     int32_t height,
+                                     size_t stride,
+                                     const ClusteringSegmentationConfig *config,
+                                     ClusteringSegmentationResult *result)
+{
+  if (result == NULL) {
+    return 0;
+  }
+  
+  memset(result, 0, sizeof(ClusteringSegmentationResult));
+  
+  if (bgrPixels == NULL || width <= 0 || height <= 0 || stride < ((size_t) width * 3)) {
+    cerr << "error : invalid " << width << " x " << height << " BGR pixels with stride " << stride << endl;
+    return 0;
+  }
+  
+  ClusteringSegmentationConfig defaultConfig;
+  
+  if (config == NULL) {
+    clusteringSegmentationDefaultConfig(&defaultConfig);
+    config = &defaultConfig;
+  }
+  
+  ClusteringSegmentationContext localContext;
+  
+  if (context == NULL) {
+    context = &localContext;
+  }
+  
+  // Debug images would be written into the process working dir
+  
+  DebugOutputLevelScope debugOutputLevelScope(DEBUG_OUTPUT_NONE);
+  
+  SegmentationThreadsScope segmentationThreadsScope(config->numThreads);
+  
+  int32_t *labels = NULL;
+  ClusteringSegmentationRegion *regions = NULL;
+  
+  try {
+    // The input is only read, so the caller pixels are wrapped without a copy
+  
+    Mat inputImg(height, width, CV_8UC3, (void*) bgrPixels, stride);
+  
+    ClusteringCombineArtifacts artifacts;
+    artifacts.srmContext = &context->srmContext;
+    artifacts.matPool = &context->matPool;
+    artifacts.randomSeed = config->randomSeed;
+    artifacts.srmMinRegions = config->srmMinRegions;
+    artifacts.srmMaxRegions = config->srmMaxRegions;
+  
+    // A region from a reduced, tiled or cropped run is not in the input coords
+  
+    if (config->regionFunc != NULL && config->pyramidLevels == 0 && config->tileSize <= 0 && config->roiWidth <= 0) {
+      artifacts.regionFunc = [config](const ClusteringCombineRegion &region) {
+        emitCommittedRegion(region, config->regionFunc, config->regionUserData);
+      };
+    }
+  
+    Mat resultImg;
+  
+    bool worked;
+  
+    if (config->roiWidth > 0) {
+      Rect roi(config->roiX, config->roiY, config->roiWidth, config->roiHeight);
+      worked = clusteringCombineROI(inputImg, resultImg, artifacts, roi, config->roiMargin, config->pyramidLevels);
+    } else if (config->tileSize > 0) {
+      worked = clusteringCombineTiled(inputImg, resultImg, artifacts, config->tileSize, config->tileApron);
+    } else {
+      worked = clusteringCombinePyramid(inputImg, resultImg, artifacts, config->pyramidLevels);
+    }
+  
+    if (!worked) {
+      return 0;
+    }
+  
+    // The stats are for the input pixels under the result
+  
+    if (config->roiWidth > 0) {
+      inputImg = inputImg(Rect(config->roiX, config->roiY, config->roiWidth, config->roiHeight));
+    }
+  
+    const int32_t resultWidth = resultImg.cols;
+    const int32_t resultHeight = resultImg.rows;
+  
+    // Each connected region of the result tags gets a label, written directly
+    // into the caller owned buffer.
+  
+    labels = (int32_t*) malloc((size_t) resultWidth * resultHeight * sizeof(int32_t));
+  
+    if (labels == NULL) {
+      cerr << "error : could not allocate labels for " << resultWidth << " x " << resultHeight << " pixels" << endl;
+      return 0;
+    }
+  
+    Mat labelsMat(resultHeight, resultWidth, CV_32SC1, labels);
+  
+    int32_t numRegions = labelConnectedTags(resultImg, labelsMat);
+  
+    assert(labelsMat.data == (uchar*) labels);
+  
+    regions = (ClusteringSegmentationRegion*) calloc(maxi(numRegions, 1), sizeof(ClusteringSegmentationRegion));
+  
+    if (regions == NULL) {
+      cerr << "error : could not allocate " << numRegions << " regions" << endl;
+      free(labels);
+      return 0;
+    }
+  
+    fillSegmentationRegions(inputImg, labelsMat, numRegions, regions);
+  
+    result->width = resultWidth;
+    result->height = resultHeight;
+    result->labels = labels;
+    result->numRegions = numRegions;
+    result->regions = regions;
+    result->srmQ = artifacts.srmQ;
+  } catch (const cv::Exception &e) {
+    cerr << "error : segmentation failed with " << e.what() << endl;
+    free(labels);
+    free(regions);
+    memset(result, 0, sizeof(ClusteringSegmentationResult));
+    return 0;
+  } catch (const std::bad_alloc &e) {
+    cerr << "error : segmentation could not allocate memory" << endl;
+    free(labels);
+    free(regions);
+    memset(result, 0, sizeof(ClusteringSegmentationResult));
+    return 0;
+  }
+  
+  return 1;
+}
+
+void clusteringSegmentationResultFree(ClusteringSegmentationResult *result)
+{
+  if (result == NULL) {
+    return;
+  }
+  
+  free(result->labels);
+  free(result->regions);
+  
+  memset(result, 0, sizeof(ClusteringSegmentationResult));
+}
+
+int clusteringSegmentationSetProfile(const char *name)
+{
+  SegmentationProfile profile;
+  
+  if (name == NULL || !findSegmentationProfile(name, profile)) {
+    cerr << "error : unknown segmentation profile " << ((name != NULL) ? name : "NULL") << endl;
+    return 0;
+  }
+  
+  return setSegmentationProfile(profile) ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+//
+//  ClusteringSegmentationAPI.h
+//  ClusteringSegmentation
+//
+//  In process entry point for a caller that already has decoded pixels in
+//  memory. The BGR pixels are wrapped without a copy, the regions are returned
+//  as a caller owned label buffer along with a table of region stats, and no
+//  file is read or written. The process working dir is not changed and the
+//  debug output is disabled for the calling thread while the segmentation runs,
+//  so that no debug images are written. Calls on different threads do not share
+//  any state other than the static colortable seed and the profile, a context
+//  must only be used by one thread at a time.
+
+#ifndef CLUSTERING_SEGMENTATION_API_H
+#define	CLUSTERING_SEGMENTATION_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A region as the segmentation commits it, before the whole image is done. The
+// mask is width x height bytes with maskStride bytes from one row to the next,
+// a byte is non zero for a pixel in the region. The mask is only valid while the
+// region callback runs.
+
+typedef struct {
+  // Regions are committed in capture order starting at 0
+  int32_t captureIndex;
+  int32_t numPixels;
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  // Mean BGR of the input pixels in the region
+  uint8_t meanB;
+  uint8_t meanG;
+  uint8_t meanR;
+  const uint8_t *mask;
+  size_t maskStride;
+} ClusteringSegmentationCommittedRegion;
+
+typedef void (*ClusteringSegmentationRegionFunc)(const ClusteringSegmentationCommittedRegion *region, void *userData);
+
+typedef struct {
+  // Number of pyrDown() levels, see clusteringCombinePyramid()
+  int pyramidLevels;
+  // When not zero the image is segmented as tiles of tileSize x tileSize pixels
+  // with a tileApron pixel overlap, see clusteringCombineTiled()
+  int tileSize;
+  int tileApron;
+  // When srmMaxRegions is not zero the SRM Q is searched for so that SRM
+  // generates between srmMinRegions and srmMaxRegions regions
+  int srmMinRegions;
+  int srmMaxRegions;
+  // Seed for the debug and region colors, -1 seeds from the clock
+  int64_t randomSeed;
+  // When roiWidth is not zero only the roi inside the image is segmented with
+  // roiMargin pixels of context, and the result is roiWidth x roiHeight, see
+  // clusteringCombineROI(). The tileSize is not used with a roi.
+  int32_t roiX;
+  int32_t roiY;
+  int32_t roiWidth;
+  int32_t roiHeight;
+  int32_t roiMargin;
+  // Threads the segmentation may use, a caller that runs several segmentations
+  // at once gives each one a share of the cores. 0 means all cores.
+  int32_t numThreads;
+  // When not NULL regionFunc is invoked with regionUserData on the calling thread
+  // as each captured region is committed. A committed region keeps its pixels in
+  // the result, though the result labels split a region that is not connected and
+  // the pixels that were not captured are only in the result. The regions are only
+  // streamed when there is no pyramid level, tile size or roi.
+  ClusteringSegmentationRegionFunc regionFunc;
+  void *regionUserData;
+} ClusteringSegmentationConfig;
+
+// Stats for one region, the bbox is x, y, width, height in pixels
+
+typedef struct {
+  int32_t numPixels;
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  // Mean BGR of the input pixels in the region
+  uint8_t meanB;
+  uint8_t meanG;
+  uint8_t meanR;
+} ClusteringSegmentationRegion;
+
+typedef struct {
+  int32_t width;
+  int32_t height;
+  // Label of each pixel as width x height row major values with no row padding,
+  // labels are 0 to numRegions-1 in the order a raster scan first finds them
+  int32_t *labels;
+  int32_t numRegions;
+  // Stats for each region indexed by label
+  ClusteringSegmentationRegion *regions;
+  // SRM Q that was used
+  double srmQ;
+} ClusteringSegmentationResult;
+
+// Buffers that are reused from one segmentation to the next, a caller that
+// segments many images keeps one context per thread.
+
+typedef struct ClusteringSegmentationContext ClusteringSegmentationContext;
+
+void clusteringSegmentationDefaultConfig(ClusteringSegmentationConfig *config);
+
+ClusteringSegmentationContext* clusteringSegmentationContextCreate(void);
+
+void clusteringSegmentationContextFree(ClusteringSegmentationContext *context);
+
+// Segment width x height BGR pixels, stride is the number of bytes from one row
+// to the next. With a roi the result width and height are those of the roi. The context and the config can be NULL to use a temporary context
+// and the default config. Returns 1 and fills in result on success, the buffers
+// in result are owned by the caller and are released with
+// clusteringSegmentationResultFree(). Returns 0 and leaves result empty on error.
+
+int clusteringSegmentationSegmentBGR(ClusteringSegmentationContext *context,
+                                     const uint8_t *bgrPixels,
+                                     int32_t width,
+                                     int32_t height,
+                                     size_t stride,
+                                     const ClusteringSegmentationConfig *config,
+                                     ClusteringSegmentationResult *result);
+
+void clusteringSegmentationResultFree(ClusteringSegmentationResult *result);
+
+// Set the speed and quality profile of every segmentation in the process by
+// name, "fast", "balanced" or "quality". The default is "balanced". This must
+// not be invoked while a segmentation is running. Returns 0 for an unknown name.
+
+int clusteringSegmentationSetProfile(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CLUSTERING_SEGMENTATION_API_H
@@ -0,0 +1,466 @@
+//
+//  ClusteringSegmentationDaemon.cpp
+//  ClusteringSegmentation
+//
+//  Unix socket server that segments frames passed in shared memory, see
+//  ClusteringSegmentationDaemon.h.
+//
+
+#include "ClusteringSegmentationDaemon.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <chrono>
+#include <new>
+#include <thread>
+
+#include "ClusteringSegmentation.hpp"
+#include "MetricsRegistry.h"
+
+#include "Util.h"
+
+using namespace cv;
+using namespace std;
+
+// Read or write exactly numBytes, returns false on error or when the client
+// closed the connection.
+
+static
+bool daemonReadFully(int fd, void *buffer, size_t numBytes)
+{
+  uint8_t *ptr = (uint8_t*) buffer;
+  
+  while (numBytes > 0) {
+    ssize_t numRead = read(fd, ptr, numBytes);
+  
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numRead <= 0) {
+      return false;
+    }
+  
+    ptr += numRead;
+    numBytes -= (size_t) numRead;
+  }
+  
+  return true;
+}
+
+static
+bool daemonWriteFully(int fd, const void *buffer, size_t numBytes)
+{
+  const uint8_t *ptr = (const uint8_t*) buffer;
+  
+  while (numBytes > 0) {
+    ssize_t numWritten = write(fd, ptr, numBytes);
+  
+    if (numWritten < 0 && errno == EINTR) {
+      continue;
+    }
+    if (numWritten <= 0) {
+      return false;
+    }
+  
+    ptr += numWritten;
+    numBytes -= (size_t) numWritten;
+  }
+  
+  return true;
+}
+
+// Shared memory object mapped by a worker, kept from one request to the next
+// while the client sends the same name. The object is looked up again for each
+// request so that a client that resized or replaced the object under the same
+// name gets a new mapping.
+
+class DaemonSharedFrame {
+public:
+  string name;
+  void *mapPtr;
+  size_t mapSize;
+  dev_t mapDev;
+  ino_t mapIno;
+  
+  DaemonSharedFrame()
+  : mapPtr(NULL), mapSize(0), mapDev(0), mapIno(0)
+  {
+  }
+  
+  ~DaemonSharedFrame() {
+    close();
+  }
+  
+  void close() {
+    if (mapPtr != NULL) {
+      munmap(mapPtr, mapSize);
+      mapPtr = NULL;
+      mapSize = 0;
+    }
+    name.clear();
+  }
+  
+  bool open(const string &shmName) {
+    int fd = shm_open(shmName.c_str(), O_RDWR, 0);
+  
+    if (fd == -1) {
+      cerr << "error : could not open shared memory \"" << shmName << "\"" << endl;
+      close();
+      return false;
+    }
+  
+    struct stat statBuf;
+  
+    if (fstat(fd, &statBuf) != 0 || statBuf.st_size <= 0) {
+      ::close(fd);
+      close();
+      return false;
+    }
+  
+    // The current mapping is still the whole object
+  
+    if (mapPtr != NULL && name == shmName && mapDev == statBuf.st_dev && mapIno == statBuf.st_ino && mapSize == (size_t) statBuf.st_size) {
+      ::close(fd);
+      return true;
+    }
+  
+    close();
+  
+    void *ptr = mmap(NULL, (size_t) statBuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  
+    ::close(fd);
+  
+    if (ptr == MAP_FAILED) {
+      cerr << "error : could not map shared memory \"" << shmName << "\"" << endl;
+      return false;
+    }
+  
+    name = shmName;
+    mapPtr = ptr;
+    mapSize = (size_t) statBuf.st_size;
+    mapDev = statBuf.st_dev;
+    mapIno = statBuf.st_ino;
+    return true;
+  }
+};
+
+// State a worker keeps between requests
+
+typedef struct {
+  SRMContext srmContext;
+  MatPool matPool;
+  ClusteringCombineArtifacts artifacts;
+  DaemonSharedFrame frame;
+} DaemonWorkerState;
+
+// True when the pixels and the labels of the request fit inside the mapping. The
+// offsets and the stride come from the client, so each end is checked with a
+// division rather than computed, a product could wrap around.
+
+static
+bool daemonFrameFits(const SegmentationDaemonRequest &request, size_t mapSize)
+{
+  if (request.pixelsOffset >= mapSize || request.labelsOffset >= mapSize || request.stride == 0 || request.stride > mapSize) {
+    return false;
+  }
+  
+  const uint64_t rowBytes = (uint64_t) request.width * 3;
+  const uint64_t pixelsAvail = mapSize - request.pixelsOffset;
+  
+  if (rowBytes > pixelsAvail || ((uint64_t) (request.height - 1)) > ((pixelsAvail - rowBytes) / request.stride)) {
+    return false;
+  }
+  
+  const uint64_t labelsRowBytes = (uint64_t) request.width * sizeof(int32_t);
+  const uint64_t labelsAvail = mapSize - request.labelsOffset;
+  
+  if (labelsRowBytes > labelsAvail || ((uint64_t) request.height) > (labelsAvail / labelsRowBytes)) {
+    return false;
+  }
+  
+  return true;
+}
+
+static
+void daemonSegmentFrame(DaemonWorkerState &state, const SegmentationDaemonRequest &request, SegmentationDaemonResponse &response, int workerThreads)
+{
+  memset(&response, 0, sizeof(SegmentationDaemonResponse));
+  response.magic = SEGMENTATION_DAEMON_MAGIC;
+  
+  if (request.magic != SEGMENTATION_DAEMON_MAGIC || request.version != SEGMENTATION_DAEMON_VERSION) {
+    cerr << "error : daemon request does not have a valid header" << endl;
+    addMetricsCounter("segmentation_daemon_invalid_requests_total", NULL);
+    return;
+  }
+  
+  const int32_t width = request.width;
+  const int32_t height = request.height;
+  
+  if (memchr(request.shmName, '\0', sizeof(request.shmName)) == NULL || request.shmName[0] == '\0' ||
+      width <= 0 || height <= 0 || request.stride < ((uint64_t) width * 3) || (request.labelsOffset % sizeof(int32_t)) != 0) {
+    cerr << "error : invalid " << width << " x " << height << " daemon request" << endl;
+    addMetricsCounter("segmentation_daemon_invalid_requests_total", NULL);
+    return;
+  }
+  
+  // An object that the client resized or replaced under the same name is mapped again
+  
+  DaemonSharedFrame &frame = state.frame;
+  
+  if (!frame.open(request.shmName)) {
+    addMetricsCounter("segmentation_daemon_invalid_requests_total", NULL);
+    return;
+  }
+  
+  if (!daemonFrameFits(request, frame.mapSize)) {
+    cerr << "error : " << width << " x " << height << " frame does not fit in " << frame.mapSize << " bytes of \"" << frame.name << "\"" << endl;
+    addMetricsCounter("segmentation_daemon_invalid_requests_total", NULL);
+    return;
+  }
+  
+  uint8_t *basePtr = (uint8_t*) frame.mapPtr;
+  
+  // A request can ask for fewer threads than the share of this worker
+  
+  setSegmentationThreads((request.config.numThreads > 0) ? request.config.numThreads : workerThreads);
+  
+  auto startTime = std::chrono::steady_clock::now();
+  
+  try {
+    Mat inputImg(height, width, CV_8UC3, basePtr + request.pixelsOffset, (size_t) request.stride);
+  
+    ClusteringCombineArtifacts &artifacts = state.artifacts;
+    artifacts.srmContext = &state.srmContext;
+    artifacts.matPool = &state.matPool;
+    artifacts.randomSeed = request.config.randomSeed;
+    artifacts.srmMinRegions = request.config.srmMinRegions;
+    artifacts.srmMaxRegions = request.config.srmMaxRegions;
+  
+    Mat resultImg;
+  
+    bool worked;
+  
+    if (request.config.roiWidth > 0) {
+      Rect roi(request.config.roiX, request.config.roiY, request.config.roiWidth, request.config.roiHeight);
+      worked = clusteringCombineROI(inputImg, resultImg, artifacts, roi, request.config.roiMargin, request.config.pyramidLevels);
+    } else if (request.config.tileSize > 0) {
+      worked = clusteringCombineTiled(inputImg, resultImg, artifacts, request.config.tileSize, request.config.tileApron);
+    } else {
+      worked = clusteringCombinePyramid(inputImg, resultImg, artifacts, request.config.pyramidLevels);
+    }
+  
+    if (!worked) {
+      recordClusteringCombineMetrics(artifacts, false, 0.0);
+      return;
+    }
+  
+    // The labels are written directly into the shared object, a roi result
+    // is smaller than the frame so it always fits.
+  
+    Mat labelsMat(resultImg.rows, resultImg.cols, CV_32SC1, basePtr + request.labelsOffset);
+  
+    response.numRegions = labelConnectedTags(resultImg, labelsMat);
+  
+    assert(labelsMat.data == basePtr + request.labelsOffset);
+  
+    response.srmQ = artifacts.srmQ;
+    response.partial = artifacts.partial ? 1 : 0;
+    response.status = 1;
+  } catch (const cv::Exception &e) {
+    cerr << "error : segmentation failed with " << e.what() << endl;
+    recordClusteringCombineMetrics(state.artifacts, false, 0.0);
+    return;
+  } catch (const std::bad_alloc &e) {
+    cerr << "error : segmentation could not allocate memory" << endl;
+    recordClusteringCombineMetrics(state.artifacts, false, 0.0);
+    return;
+  }
+  
+  auto endTime = std::chrono::steady_clock::now();
+  
+  response.seconds = std::chrono::duration<double>(endTime - startTime).count();
+  
+  recordClusteringCombineMetrics(state.artifacts, true, response.seconds);
+}
+
+// Each worker accepts a connection and serves its requests in order until
+// the client closes it, the mapping is released with the connection since
+// another client could reuse the name for a different object. A worker may
+// use workerThreads threads so that the workers share the cores.
+
+static
+void daemonWorker(int listenFd, int workerThreads)
+{
+  setDebugOutputLevel(DEBUG_OUTPUT_NONE);
+  
+  DaemonWorkerState state;
+  
+  while (1) {
+    int fd = accept(listenFd, NULL, NULL);
+  
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      cerr << "error : accept failed with errno " << errno << endl;
+      return;
+    }
+  
+    addMetricsGauge("segmentation_daemon_connections", NULL, 1.0);
+  
+    SegmentationDaemonRequest request;
+    SegmentationDaemonResponse response;
+  
+    while (daemonReadFully(fd, &request, sizeof(request))) {
+      addMetricsGauge("segmentation_daemon_busy_workers", NULL, 1.0);
+      daemonSegmentFrame(state, request, response, workerThreads);
+      addMetricsGauge("segmentation_daemon_busy_workers", NULL, -1.0);
+  
+      if (!daemonWriteFully(fd, &response, sizeof(response))) {
+        break;
+      }
+    }
+  
+    state.frame.close();
+  
+    close(fd);
+  
+    addMetricsGauge("segmentation_daemon_connections", NULL, -1.0);
+  }
+}
+
+// Each connection to the metrics socket gets one HTTP response with the metrics
+// in the Prometheus text format, so that the socket can be scraped with
+// curl --unix-socket or through a proxy. The request is not parsed.
+
+static
+void daemonMetricsServer(int metricsFd)
+{
+  while (1) {
+    int fd = accept(metricsFd, NULL, NULL);
+  
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      cerr << "error : metrics accept failed with errno " << errno << endl;
+      return;
+    }
+  
+    char requestBuffer[1024];
+    ssize_t numRead;
+  
+    do {
+      numRead = read(fd, requestBuffer, sizeof(requestBuffer));
+    } while (numRead < 0 && errno == EINTR);
+  
+    FILE *fp = fdopen(fd, "w");
+  
+    if (fp == NULL) {
+      close(fd);
+      continue;
+    }
+  
+    fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    writeMetricsPrometheus(fp);
+  
+    // Closes fd
+  
+    fclose(fp);
+  }
+}
+
+// Bind and listen on the Unix socket at socketPath, returns -1 on error
+
+static
+int daemonListen(const char *socketPath, int backlog)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    cerr << "error : socket path \"" << socketPath << "\" is too long" << endl;
+    return -1;
+  }
+  
+  strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+  
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  
+  if (listenFd == -1) {
+    cerr << "error : could not create socket" << endl;
+    return -1;
+  }
+  
+  unlink(socketPath);
+  
+  if (::bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listenFd, backlog) != 0) {
+    cerr << "error : could not listen on \"" << socketPath << "\"" << endl;
+    close(listenFd);
+    return -1;
+  }
+  
+  return listenFd;
+}
+
+bool segmentationDaemonMain(const char *socketPath, int numWorkers)
+{
+  // A client that goes away while a response is written must not kill the daemon
+  
+  signal(SIGPIPE, SIG_IGN);
+  
+  int listenFd = daemonListen(socketPath, maxi(numWorkers, 1) * 4);
+  
+  if (listenFd == -1) {
+    return false;
+  }
+  
+  string metricsPath = string(socketPath) + ".metrics";
+  
+  int metricsFd = daemonListen(metricsPath.c_str(), 4);
+  
+  if (metricsFd == -1) {
+    close(listenFd);
+    unlink(socketPath);
+    return false;
+  }
+  
+  cout << "listening on \"" << socketPath << "\" with " << maxi(numWorkers, 1) << " workers, metrics on \"" << metricsPath << "\"" << endl;
+  
+  // One worker gets all the cores, otherwise each worker gets an even share
+  
+  const int workerThreads = (numWorkers > 1) ? maxi(1, ((int) std::thread::hardware_concurrency()) / numWorkers) : 0;
+  
+  // The metrics thread is not joined since it only returns when accept fails
+  
+  std::thread(daemonMetricsServer, metricsFd).detach();
+  
+  vector<std::thread> workers;
+  
+  for ( int i = 0; i < maxi(numWorkers, 1); i++ ) {
+    workers.push_back(std::thread(daemonWorker, listenFd, workerThreads));
+  }
+  
+  for ( std::thread &worker : workers ) {
+    worker.join();
+  }
+  
+  close(metricsFd);
+  unlink(metricsPath.c_str());
+  
+  close(listenFd);
+  unlink(socketPath);
+  
+  return true;
+}
@@ -0,0 +1,69 @@
+//
+//  ClusteringSegmentationDaemon.h
+//  ClusteringSegmentation
+//
+//  Long running segmentation process that takes frames over a Unix socket, so
+//  that the process startup and the first touch of the segmentation buffers is
+//  paid once instead of once per image. A client writes BGR pixels into a POSIX
+//  shared memory object, sends a request that names the object, and the daemon
+//  maps the object, segments the pixels in place and writes the labels into the
+//  same object before it sends the response. No pixels pass through the socket
+//  and no file is written. Each connection is served by one worker thread that
+//  keeps its own SRM context and artifacts from one request to the next, and
+//  the mapping of the last object is kept while the client sends the same name.
+//  Each worker uses an even share of the cores unless the config of a request
+//  sets numThreads.
+//
+//  The metrics of the daemon, see MetricsRegistry.h, are served on a second Unix
+//  socket at SOCKET_PATH.metrics as an HTTP response in the Prometheus text
+//  format, like curl --unix-socket SOCKET_PATH.metrics http://localhost/metrics
+//
+//  The labels are width x height int32_t values in labelConnectedTags() form,
+//  0 to numRegions-1 in the order a raster scan first finds them. When the
+//  config sets a roi the labels are roiWidth x roiHeight values.
+
+#ifndef CLUSTERING_SEGMENTATION_DAEMON_H
+#define	CLUSTERING_SEGMENTATION_DAEMON_H
+
+#include <stdint.h>
+
+#include "ClusteringSegmentationAPI.h"
+
+#define SEGMENTATION_DAEMON_MAGIC 0x47455343
+#define SEGMENTATION_DAEMON_VERSION 3
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  // Name passed to shm_open(), like "/frame0", NUL terminated
+  char shmName[64];
+  int32_t width;
+  int32_t height;
+  // Bytes from one input row to the next
+  uint64_t stride;
+  // Byte offset of the BGR pixels in the object
+  uint64_t pixelsOffset;
+  // Byte offset of the width x height labels in the object, 4 byte aligned
+  uint64_t labelsOffset;
+  ClusteringSegmentationConfig config;
+} SegmentationDaemonRequest;
+
+typedef struct {
+  uint32_t magic;
+  // 1 when the labels were written, 0 on error
+  int32_t status;
+  int32_t numRegions;
+  int32_t partial;
+  // SRM Q that was used
+  double srmQ;
+  // Time to segment the frame, not including the socket round trip
+  double seconds;
+} SegmentationDaemonResponse;
+
+// Listen on the Unix socket at socketPath and serve requests with numWorkers
+// threads until the process is killed. Returns false if the socket or the
+// metrics socket could not be created.
+
+bool segmentationDaemonMain(const char *socketPath, int numWorkers);
+
+#endif // CLUSTERING_SEGMENTATION_DAEMON_H
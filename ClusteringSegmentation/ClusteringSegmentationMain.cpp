@@ -7,12 +7,53 @@
 //
 
 // clusteringsegmentation IMAGE TAGS_IMAGE
+// clusteringsegmentation --batch MANIFEST_OR_DIR OUTPUT_DIR ?NUM_WORKERS?
+// clusteringsegmentation --daemon SOCKET_PATH ?NUM_WORKERS?
 //
 // This logic reads input pixels from an image and segments the image into different connected
 // areas based on growing area of alike pixels. A set of pixels is determined to be alike
 // if the pixels are near to each other in terms of 3D space via a fast clustering method.
 // The TAGS_IMAGE output file is written with alike pixels being defined as having the same
 // tag color.
+//
+// In batch mode each image listed in the MANIFEST_OR_DIR text file (one filename per line)
+// or found in the MANIFEST_OR_DIR directory is segmented by one of NUM_WORKERS threads and
+// the tags are written into OUTPUT_DIR as BASENAME_tags.png. Images are decoded and the
+// tags are encoded on separate threads so that the segmentation workers do not wait on
+// the disk or the PNG codec.
+//
+// When TAGS_IMAGE ends with .regions, or in batch mode when SEGMENTATION_OUTPUT_REGIONS
+// is set to 1, the regions are written as a binary region file instead of a PNG, see
+// RegionFile.h.
+//
+// When TAGS_IMAGE ends with .tags, or in batch mode when SEGMENTATION_OUTPUT_TAGS is set
+// to 1, the tags are written with the tag codec, which is much smaller and faster to
+// encode than a PNG, see TagCodec.h.
+//
+// In daemon mode the process listens on the Unix socket SOCKET_PATH and segments frames
+// that clients pass in POSIX shared memory, see ClusteringSegmentationDaemon.h. The
+// metrics of the daemon are served in the Prometheus text format on SOCKET_PATH.metrics.
+//
+// An IMAGE that ends with .bgr or .ppm is read with mmap() instead of imread(), a .bgr
+// file is wrapped with no copy, see MappedImage.h.
+//
+// Set SEGMENTATION_SEED to a number to generate the same debug image colors on each run.
+// Set SEGMENTATION_PYRAMID_LEVELS to 1 or 2 to segment a half or quarter size image and
+// refine the region boundaries at full size, see clusteringCombinePyramid().
+// Set SEGMENTATION_TILE_SIZE to segment a very large image as tiles of that size with a
+// 64 pixel apron, see clusteringCombineTiled().
+// Set SEGMENTATION_TEMPORAL to a pixel difference threshold like 16 to segment the batch
+// images as frames of a video in order on one thread, each frame only segments again
+// the tiles that changed, see clusteringCombineTemporal().
+// Set SEGMENTATION_ROI to X,Y,WIDTH,HEIGHT or X,Y,WIDTH,HEIGHT,MARGIN to segment only that
+// area of IMAGE with MARGIN pixels of context, TAGS_IMAGE is the size of the area, see
+// clusteringCombineROI().
+// Set SEGMENTATION_TIME_BUDGET to a number of seconds to stop capturing regions once that
+// time has passed, the regions that were not captured keep their SRM regions.
+// Set SEGMENTATION_SRM_REGIONS to MIN-MAX to search for the SRM Q that generates between
+// MIN and MAX regions instead of using the fixed Q, see generateSRMLabelsAutoQ().
+// Set SEGMENTATION_METRICS_JSON to a file path to write a JSON summary of the metrics
+// at the end of a batch, see MetricsRegistry.h.
 
 #include <opencv2/opencv.hpp>
 
@@ -37,17 +78,255 @@
 #include "Util.h"
 
 #include "RegionRemerger.hpp"
+#include "RegionFile.h"
+#include "TagCodec.h"
+#include "MappedImage.h"
+#include "ClusteringSegmentationDaemon.h"
+#include "MetricsRegistry.h"
 
 #include <stack>
 
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <fstream>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
 using namespace cv;
 using namespace std;
 
-bool clusteringCombine(Mat &inputImg, Mat &resultImg);
+int batchMain(int argc, const char** argv);
+
+// A SEGMENTATION_SEED environment variable sets a fixed seed for the debug
+// colors so that two runs write the same images, -1 seeds from the clock.
+
+static int64_t randomSeedFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_SEED");
+  
+  if (value == NULL || *value == '\0') {
+    return -1;
+  }
+  
+  return (int64_t) strtoul(value, NULL, 10);
+}
+
+// Tile size from SEGMENTATION_TILE_SIZE, 0 when not set
+
+static int tileSizeFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_TILE_SIZE");
+  
+  if (value == NULL) {
+    return 0;
+  }
+  
+  return max(0, atoi(value));
+}
+
+// Number of pyrDown() levels from SEGMENTATION_PYRAMID_LEVELS, 0 when not set
+
+static int pyramidLevelsFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_PYRAMID_LEVELS");
+  
+  if (value == NULL) {
+    return 0;
+  }
+  
+  return max(0, atoi(value));
+}
+
+// Time budget in seconds from SEGMENTATION_TIME_BUDGET, 0 when not set
+
+static double timeBudgetFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_TIME_BUDGET");
+  
+  if (value == NULL) {
+    return 0.0;
+  }
+  
+  return max(0.0, atof(value));
+}
+
+// Roi from SEGMENTATION_ROI as X,Y,WIDTH,HEIGHT or X,Y,WIDTH,HEIGHT,MARGIN,
+// returns false when not set. The margin defaults to 32 pixels.
+
+static bool roiFromEnvironment(Rect &roi, int &margin)
+{
+  const char *value = getenv("SEGMENTATION_ROI");
+  
+  if (value == NULL) {
+    return false;
+  }
+  
+  int x, y, width, height;
+  margin = 32;
+  
+  int numValues = sscanf(value, "%d,%d,%d,%d,%d", &x, &y, &width, &height, &margin);
+  
+  if (numValues < 4) {
+    return false;
+  }
+  
+  roi = Rect(x, y, width, height);
+  margin = max(0, margin);
+  return true;
+}
+
+// Temporal diff threshold from SEGMENTATION_TEMPORAL, 0 when not set
+
+static int temporalThresholdFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_TEMPORAL");
+  
+  if (value == NULL) {
+    return 0;
+  }
+  
+  return max(0, atoi(value));
+}
+
+// SRM region range from SEGMENTATION_SRM_REGIONS as MIN-MAX or a single
+// count N, leaves the range as is when not set.
+
+static void srmRegionRangeFromEnvironment(ClusteringCombineArtifacts &artifacts)
+{
+  const char *value = getenv("SEGMENTATION_SRM_REGIONS");
+  
+  if (value == NULL || *value == '\0') {
+    return;
+  }
+  
+  int minRegions = 0;
+  int maxRegions = 0;
+  
+  int numValues = sscanf(value, "%d-%d", &minRegions, &maxRegions);
+  
+  if (numValues == 1) {
+    maxRegions = minRegions;
+  }
+  
+  if (numValues < 1 || minRegions < 1 || maxRegions < minRegions) {
+    cerr << "ignoring invalid SEGMENTATION_SRM_REGIONS \"" << value << "\"" << endl;
+    return;
+  }
+  
+  artifacts.srmMinRegions = minRegions;
+  artifacts.srmMaxRegions = maxRegions;
+}
+
+// SEGMENTATION_SRM_DEVICE=opencl computes the SRM pair diffs on an OpenCL device
+
+static bool srmDeviceFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_SRM_DEVICE");
+  
+  return (value != NULL && strcmp(value, "opencl") == 0);
+}
+
+// SEGMENTATION_TILED_IMAGE=4 or 8 gathers region pixels from a copy of the
+// input stored in 4x4 or 8x8 tiles, 0 when not set
+
+static int tiledImageDimFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_TILED_IMAGE");
+  
+  if (value == NULL) {
+    return 0;
+  }
+  
+  return atoi(value);
+}
+
+// SEGMENTATION_PROFILE=fast, balanced or quality sets the speed and quality
+// settings, see findSegmentationProfile(). Returns false for an unknown name.
+
+static bool segmentationProfileFromEnvironment()
+{
+  const char *value = getenv("SEGMENTATION_PROFILE");
+  
+  if (value == NULL) {
+    return true;
+  }
+  
+  SegmentationProfile profile;
+  
+  if (!findSegmentationProfile(value, profile)) {
+    cerr << "error : unknown SEGMENTATION_PROFILE \"" << value << "\", use fast, balanced or quality" << endl;
+    return false;
+  }
+  
+  return setSegmentationProfile(profile);
+}
+
+// True when the output filename ends with ext
+
+static bool hasFilenameExtension(const string &filename, const string &ext)
+{
+  return filename.size() >= ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Write the result tags as a PNG, a region file or a tag codec file depending
+// on the filename
+
+static bool writeOutputTags(const string &filename, const Mat &inputImg, const Mat &resultImg)
+{
+  if (hasFilenameExtension(filename, ".regions")) {
+    return writeRegionFile(filename, inputImg, resultImg);
+  } else if (hasFilenameExtension(filename, ".tags")) {
+    return writeTagsFile(filename, resultImg);
+  } else {
+    return imwrite(filename, resultImg);
+  }
+}
+
+// Map a .bgr or .ppm image, other formats are decoded with imread(). A mapped
+// Mat is only valid while mappedImage is open. Returns an empty Mat on error.
+
+static Mat readInputImage(const string &filename, MappedImage &mappedImage)
+{
+  if (MappedImage::isMappedImageFilename(filename)) {
+    if (!mappedImage.open(filename)) {
+      return Mat();
+    }
+    return mappedImage.mat;
+  } else {
+    return imread(filename, CV_LOAD_IMAGE_COLOR);
+  }
+}
 
 int main(int argc, const char** argv) {
   const char *inputImgFilename = NULL;
   const char *outputTagsImgFilename = NULL;
+  const char *artifactsDirname = NULL;
+  
+  setSRMDeviceEnabled(srmDeviceFromEnvironment());
+  setDefaultTiledImageDim(tiledImageDimFromEnvironment());
+  
+  if (!segmentationProfileFromEnvironment()) {
+    return 1;
+  }
+  
+  if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+    return batchMain(argc, argv);
+  }
+  
+  if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) {
+    if (argc != 3 && argc != 4) {
+      cerr << "usage : " << argv[0] << " --daemon SOCKET_PATH ?NUM_WORKERS?" << endl;
+      return 1;
+    }
+    int numWorkers = (argc == 4) ? atoi(argv[3]) : (int) std::thread::hardware_concurrency();
+    return segmentationDaemonMain(argv[2], numWorkers) ? 0 : 1;
+  }
 
   if (argc == 2) {
     inputImgFilename = argv[1];
@@ -81,17 +360,28 @@ int main(int argc, const char** argv) {
       
       free(dirname);
     }
-  } else if (argc != 3) {
-    cerr << "usage : " << argv[0] << " IMAGE ?TAGS_IMAGE?" << endl;
+  } else if (argc != 3 && argc != 4) {
+    cerr << "usage : " << argv[0] << " IMAGE ?TAGS_IMAGE? ?ARTIFACTS_DIR?" << endl;
+    cerr << "usage : " << argv[0] << " --batch MANIFEST_OR_DIR OUTPUT_DIR ?NUM_WORKERS?" << endl;
+    cerr << "usage : " << argv[0] << " --daemon SOCKET_PATH ?NUM_WORKERS?" << endl;
     exit(1);
-  } else if (argc == 3) {
+  } else {
     inputImgFilename = argv[1];
     outputTagsImgFilename = argv[2];
+    
+    // The SRM and containment results are read from and saved to ARTIFACTS_DIR
+    // so that a run on the same image does not need to generate them again.
+    
+    if (argc == 4) {
+      artifactsDirname = argv[3];
+    }
   }
 
   cout << "read \"" << inputImgFilename << "\"" << endl;
   
-  Mat inputImg = imread(inputImgFilename, CV_LOAD_IMAGE_COLOR);
+  MappedImage mappedImage;
+  
+  Mat inputImg = readInputImage(inputImgFilename, mappedImage);
   if( inputImg.empty() ) {
     cerr << "could not read \"" << inputImgFilename << "\" as image data" << endl;
     exit(1);
@@ -106,279 +396,509 @@ int main(int argc, const char** argv) {
   
   Mat resultImg;
   
-  bool worked = clusteringCombine(inputImg, resultImg);
+  ClusteringCombineArtifacts artifacts;
+  artifacts.randomSeed = randomSeedFromEnvironment();
+  artifacts.timeBudget = timeBudgetFromEnvironment();
+  srmRegionRangeFromEnvironment(artifacts);
+  
+  if (artifactsDirname != NULL) {
+    if (artifacts.load(artifactsDirname, matContentHash(inputImg))) {
+      cout << "read artifacts from \"" << artifactsDirname << "\"" << endl;
+    }
+  }
+  
+  // Debug images are encoded on a background thread so that the segmentation
+  // logic does not wait for each PNG to be written.
+  
+  if (isDebugStageImagesEnabled()) {
+    startDebugImageWriter(1, 32, DEBUG_IMAGE_FORMAT_FAST_PNG);
+  }
+  
+  const int tileSize = tileSizeFromEnvironment();
+  
+  Rect roi;
+  int roiMargin = 0;
+  const bool hasROI = roiFromEnvironment(roi, roiMargin);
+  
+  bool worked;
+  
+  if (hasROI) {
+    worked = clusteringCombineROI(inputImg, resultImg, artifacts, roi, roiMargin, pyramidLevelsFromEnvironment());
+  } else if (tileSize > 0) {
+    worked = clusteringCombineTiled(inputImg, resultImg, artifacts, tileSize, 64);
+  } else {
+    worked = clusteringCombinePyramid(inputImg, resultImg, artifacts, pyramidLevelsFromEnvironment());
+  }
+  
+  stopDebugImageWriter();
+  
   if (!worked) {
     cerr << "cluster combine operation failed " << endl;
     exit(1);
   }
   
-  imwrite(outputTagsImgFilename, resultImg);
+  artifacts.printStageTimes(cout);
+  
+  if (artifactsDirname != NULL) {
+    if (artifacts.save(artifactsDirname)) {
+      cout << "wrote artifacts to \"" << artifactsDirname << "\"" << endl;
+    } else {
+      cerr << "could not write artifacts to \"" << artifactsDirname << "\"" << endl;
+    }
+  }
+  
+  // A region file has the mean colors of the input pixels under the tags
+  
+  Mat tagsInputImg = hasROI ? inputImg(roi) : inputImg;
+  
+  if (!writeOutputTags(outputTagsImgFilename, tagsInputImg, resultImg)) {
+    cerr << "could not write \"" << outputTagsImgFilename << "\"" << endl;
+    exit(1);
+  }
   
   cout << "wrote " << outputTagsImgFilename << endl;
   
   exit(0);
 }
 
-// Main method that implements the cluster combine logic
+// Result of segmenting one image in batch mode
+
+typedef struct {
+  string inputFilename;
+  string outputFilename;
+  double decodeSeconds;
+  double segmentSeconds;
+  double encodeSeconds;
+  bool worked;
+} BatchImageResult;
+
+// An image moving through the batch pipeline, the mapped image is owned by
+// the item since inputImg can point into the mapping.
+
+typedef struct {
+  int index;
+  std::shared_ptr<MappedImage> mappedImage;
+  Mat inputImg;
+  Mat resultImg;
+} BatchPipelineItem;
+
+// Bounded queue between two pipeline stages, push() blocks while the queue is
+// full so that a fast stage cannot decode or hold more images than the next
+// stage can take. pop() returns false once the queue is closed and empty. The
+// number of queued images is the segmentation_queue_depth gauge with the
+// labels given to the constructor.
+
+class BatchPipelineQueue {
+  public:
+  
+  size_t maxQueued;
+  
+  std::mutex queueMutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  
+  std::deque<BatchPipelineItem> queue;
+  
+  bool closed;
+  
+  const char *metricsLabels;
+  
+  BatchPipelineQueue(int maxQueued, const char *metricsLabels)
+  : maxQueued(max(maxQueued, 1)), closed(false), metricsLabels(metricsLabels)
+  {
+  }
+  
+  void push(const BatchPipelineItem &item)
+  {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    notFull.wait(lock, [this]{ return queue.size() < maxQueued; });
+    queue.push_back(item);
+    setMetricsGauge("segmentation_queue_depth", metricsLabels, (double) queue.size());
+    lock.unlock();
+    notEmpty.notify_one();
+  }
+  
+  bool pop(BatchPipelineItem &item)
+  {
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      notEmpty.wait(lock, [this]{ return closed || !queue.empty(); });
+      
+      if (queue.empty()) {
+        return false;
+      }
+      
+      item = queue.front();
+      queue.pop_front();
+      setMetricsGauge("segmentation_queue_depth", metricsLabels, (double) queue.size());
+    }
+    
+    notFull.notify_one();
+    return true;
+  }
+  
+  // Called once every thread that pushes has returned
+  
+  void close()
+  {
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      closed = true;
+    }
+    notEmpty.notify_all();
+  }
+};
+
+static
+bool hasImageExtension(const string &filename)
+{
+  size_t dotOffset = filename.rfind('.');
+  if (dotOffset == string::npos) {
+    return false;
+  }
+  string ext = filename.substr(dotOffset + 1);
+  for ( char &c : ext ) {
+    c = tolower(c);
+  }
+  return (ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "bmp" || ext == "tif" || ext == "tiff" || ext == "bgr" || ext == "ppm");
+}
+
+// Read the input image filenames from a directory or from a manifest file
+// with one filename per line, empty lines and lines that start with # are
+// ignored. Filenames in a directory are sorted so that the order is stable.
 
-bool clusteringCombine(Mat &inputImg, Mat &resultImg)
+static
+bool readBatchInputFilenames(const string &manifestOrDirname, vector<string> &inputFilenames)
 {
-  const bool debug = true;
-  const bool debugWriteIntermediateFiles = true;
+  struct stat statBuf;
+  
+  if (stat(manifestOrDirname.c_str(), &statBuf) != 0) {
+    return false;
+  }
+  
+  if (S_ISDIR(statBuf.st_mode)) {
+    DIR *dir = opendir(manifestOrDirname.c_str());
+    if (dir == NULL) {
+      return false;
+    }
+    
+    struct dirent *entry;
+    
+    while ((entry = readdir(dir)) != NULL) {
+      string filename = entry->d_name;
+      if (filename[0] != '.' && hasImageExtension(filename)) {
+        inputFilenames.push_back(manifestOrDirname + "/" + filename);
+      }
+    }
+    
+    closedir(dir);
+    
+    sort(inputFilenames.begin(), inputFilenames.end());
+  } else {
+    std::ifstream manifest(manifestOrDirname.c_str());
+    if (!manifest) {
+      return false;
+    }
+    
+    string line;
+    
+    while (getline(manifest, line)) {
+      while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+        line.pop_back();
+      }
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      inputFilenames.push_back(line);
+    }
+  }
   
-  // Alloc object on stack
-  SuperpixelImage spImage;
-  //
-  // Ref to object allocated on heap
-//  Ptr<SuperpixelImage> spImagePtr = new SuperpixelImage();
-//  SuperpixelImage &spImage = *spImagePtr;
+  return true;
+}
+
+// OUTPUT_DIR/BASENAME_tags.png for OUTPUT_DIR/BASENAME.EXT, outputExt replaces
+// .png when writing region files or tag codec files.
+
+static
+string batchOutputFilename(const string &outputDirname, const string &inputFilename, const string &outputExt)
+{
+  string basename = inputFilename;
   
-  // Constant for block of 4x4 based map
+  size_t slashOffset = basename.rfind('/');
+  if (slashOffset != string::npos) {
+    basename = basename.substr(slashOffset + 1);
+  }
   
-  const int superpixelDim = 4;
-  int blockWidth = inputImg.cols / superpixelDim;
-  if ((inputImg.cols % superpixelDim) != 0) {
-    blockWidth++;
+  size_t dotOffset = basename.rfind('.');
+  if (dotOffset != string::npos) {
+    basename = basename.substr(0, dotOffset);
   }
-  int blockHeight = inputImg.rows / superpixelDim;
-  if ((inputImg.rows % superpixelDim) != 0) {
-    blockHeight++;
+  
+  return outputDirname + "/" + basename + "_tags" + outputExt;
+}
+
+// Batch mode segments many images in one process as a three stage pipeline.
+// Decode threads read the images in order into a bounded queue, NUM_WORKERS
+// segmentation threads each keep their own SRM context, so the SRM buffers are
+// allocated once per worker instead of once per image, and encode threads write
+// the tags. The queues hold at most NUM_WORKERS images each, so the memory used
+// does not grow with the number of images. A worker does not trace or write
+// debug images since clusteringCombine() would write the same filenames from
+// every thread, and no chdir() is done since the CWD is shared by all the threads.
+
+int batchMain(int argc, const char** argv)
+{
+  if (argc != 4 && argc != 5) {
+    cerr << "usage : " << argv[0] << " --batch MANIFEST_OR_DIR OUTPUT_DIR ?NUM_WORKERS?" << endl;
+    return 1;
   }
   
-  assert((blockWidth * superpixelDim) >= inputImg.cols);
-  assert((blockHeight * superpixelDim) >= inputImg.rows);
+  string manifestOrDirname = argv[2];
+  string outputDirname = argv[3];
   
-  // Run SRM logic to generate initial segmentation based on statistical "alikeness".
-  // Very large regions are likely to be very alike or even contain many pixels that
-  // are identical.
+  int numWorkers = (int) std::thread::hardware_concurrency();
   
-  bool worked;
+  if (argc == 5) {
+    numWorkers = atoi(argv[4]);
+  }
   
-  Mat srmTags;
+  // Frames of a video are segmented in order since each frame starts from the
+  // state of the one before it.
   
-  worked = srmMultiSegment(inputImg, srmTags);
+  const int temporalThreshold = temporalThresholdFromEnvironment();
   
-  if (!worked) {
-    return false;
+  if (numWorkers < 1 || temporalThreshold > 0) {
+    numWorkers = 1;
   }
   
-  // Generate a second segmentation of the same image but at a higher precision
-  // setting so that areas that may have been segmented into the same region
-  // in the less precise segmentation get split by this segmentation
-    
-  // Scan the tags generated by SRM and create superpixels of vario
+  vector<string> inputFilenames;
   
-  worked = SuperpixelImage::parse(srmTags, spImage);
+  if (!readBatchInputFilenames(manifestOrDirname, inputFilenames)) {
+    cerr << "could not read input filenames from \"" << manifestOrDirname << "\"" << endl;
+    return 1;
+  }
   
-  if (!worked) {
-    return false;
+  const int numImages = (int) inputFilenames.size();
+  
+  if (numWorkers > numImages) {
+    numWorkers = max(numImages, 1);
   }
   
-  // Dump image that shows the input superpixels written with a colortable
+  cout << "batch segment " << numImages << " images with " << numWorkers << " workers" << endl;
   
-  resultImg = inputImg.clone();
-  resultImg = (Scalar) 0;
+  const char *outputRegionsValue = getenv("SEGMENTATION_OUTPUT_REGIONS");
+  const char *outputTagsValue = getenv("SEGMENTATION_OUTPUT_TAGS");
   
-  sranddev();
+  string outputExt = ".png";
   
-  if (debugWriteIntermediateFiles) {
-    generateStaticColortable(inputImg, spImage);
+  if (outputRegionsValue != NULL && atoi(outputRegionsValue) != 0) {
+    outputExt = ".regions";
+  } else if (outputTagsValue != NULL && atoi(outputTagsValue) != 0) {
+    outputExt = ".tags";
   }
   
-  if (debugWriteIntermediateFiles) {
-    writeTagsWithStaticColortable(spImage, resultImg);
-    imwrite("tags_init.png", resultImg);
+  // Each result is written by only the thread that holds that image
+  
+  vector<BatchImageResult> results(numImages);
+  
+  for ( int i = 0; i < numImages; i++ ) {
+    BatchImageResult &result = results[i];
+    result.inputFilename = inputFilenames[i];
+    result.outputFilename = batchOutputFilename(outputDirname, result.inputFilename, outputExt);
+    result.decodeSeconds = 0.0;
+    result.segmentSeconds = 0.0;
+    result.encodeSeconds = 0.0;
+    result.worked = false;
   }
   
-  cout << "started with " << spImage.superpixels.size() << " superpixels" << endl;
+  std::atomic<int> nextImage(0);
   
-  // Scan superpixels to determine containment tree
+  const int numPyramidLevels = pyramidLevelsFromEnvironment();
   
-  vector<int32_t> srmInsideOutOrder;
+  const int temporalTileSize = (tileSizeFromEnvironment() > 0) ? tileSizeFromEnvironment() : 256;
   
-  {
-    // Fill with UID+1
-    
-    spImage.fillMatrixWithSuperpixelTags(srmTags);
-    
-    // Scan SRM superpixel regions in terms of containment, this generates a tree
-    // where each UID can contain 1 to N children.
-    
-    unordered_map<int32_t, vector<int32_t> > containsTreeMap;
-    
-    // FIXME: If just 1 interior shape touches edge, do not conside as sigblings
-    
-    vector<int32_t> rootTags = recurseSuperpixelContainment(spImage, srmTags, containsTreeMap);
-    
-    for ( auto &pair : containsTreeMap ) {
-      uint32_t tag = pair.first;
-      vector<int32_t> children = pair.second;
+  // One decode and one encode thread for every 4 segmentation workers, frames
+  // are decoded by one thread so that they reach the worker in order.
+  
+  const int numDecoders = (temporalThreshold > 0) ? 1 : max(1, numWorkers / 4);
+  const int numEncoders = max(1, numWorkers / 4);
+  
+  BatchPipelineQueue decodedQueue(numWorkers, "queue=\"decoded\"");
+  BatchPipelineQueue segmentedQueue(numWorkers, "queue=\"segmented\"");
+  
+  auto batchStartTime = std::chrono::steady_clock::now();
+  
+  auto decodeFunc = [&]()->void {
+    while (1) {
+      int i = nextImage++;
       
-      cout << "for srm superpixels tag " << tag << " num children are " << children.size() << endl;
-      for ( int32_t childTag : children ) {
-        cout << childTag << endl;
+      if (i >= numImages) {
+        break;
       }
-    }
-    
-    stack<int32_t> insideOutStack;
-    
-    // Lambda
-    auto lambdaFunc = [&](int32_t tag, const vector<int32_t> &children)->void {
-      fprintf(stdout, "tag %9d has %5d children\n", tag, (int)children.size());
       
-      insideOutStack.push(tag);
-    };
-    
-    recurseSuperpixelIterate(rootTags, containsTreeMap, lambdaFunc);
-    
-    // Print in stack order
-
-    if (debug) {
-    fprintf(stdout, "inside out order\n");
-    }
-    
-    while (!insideOutStack.empty())
-    {
-      int32_t tag = insideOutStack.top();
-      if (debug) {
-        Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
-        fprintf(stdout, "tag %5d has %5d children and N = %d\n", tag, (int)containsTreeMap[tag].size(), (int)spPtr->coords.size());
-      }
-      insideOutStack.pop();
+      BatchImageResult &result = results[i];
       
-      srmInsideOutOrder.push_back(tag);
-    }
-    
-    if (debug) {
-    fprintf(stdout, "done\n");
+      auto startTime = std::chrono::steady_clock::now();
+      
+      BatchPipelineItem item;
+      item.index = i;
+      item.mappedImage.reset(new MappedImage());
+      item.inputImg = readInputImage(result.inputFilename, *item.mappedImage);
+      
+      auto endTime = std::chrono::steady_clock::now();
+      
+      result.decodeSeconds = std::chrono::duration<double>(endTime - startTime).count();
+      
+      if (!item.inputImg.empty()) {
+        observeMetricsHistogram("segmentation_stage_seconds", "stage=\"decode\"", result.decodeSeconds);
+        decodedQueue.push(item);
+      } else {
+        addMetricsCounter("segmentation_images_total", "result=\"unreadable\"");
+      }
     }
-  }
+  };
   
-  // Scan all superpixels and implement region merge and split based on the input pixels
+  // The workers segment at the same time, so each one gets an even share of the cores
   
-  {
-    RegionRemerger remerger(inputImg);
-    
-    // Quant the entire image into small 4x4 blocks and then generate histograms
-    // for each block. The histogram data can be scanned significantly faster
-    // that rereading all the original pixel info.
-    
-    unordered_map<Coord, HistogramForBlock> coordToBlockHistogramMap;
+  const int workerThreads = (numWorkers > 1) ? max(1, ((int) std::thread::hardware_concurrency()) / numWorkers) : 0;
+  
+  auto segmentFunc = [&]()->void {
+    setDebugOutputLevel(DEBUG_OUTPUT_NONE);
+    setSegmentationThreads(workerThreads);
     
-    Mat blockBasedQuantMat = genHistogramsForBlocks(inputImg, coordToBlockHistogramMap, blockWidth, blockHeight, superpixelDim);
+    SRMContext srmContext;
+    MatPool matPool;
+    ClusteringCombineArtifacts artifacts;
+    artifacts.srmContext = &srmContext;
+    artifacts.matPool = &matPool;
+    artifacts.randomSeed = randomSeedFromEnvironment();
+    artifacts.timeBudget = timeBudgetFromEnvironment();
+    srmRegionRangeFromEnvironment(artifacts);
     
-    // Loop over superpixels starting at the most contained and working outwards
+    ClusteringCombineTemporalState temporalState;
     
-    bool maskWritten;
+    BatchPipelineItem item;
     
-    for ( int32_t tag : srmInsideOutOrder ) {
-      if (debug) {
-        Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
-        cout << "process tag " << tag << " containing " << spPtr->coords.size() << endl;
-      }
+    while (decodedQueue.pop(item)) {
+      BatchImageResult &result = results[item.index];
       
-      remerger.mergeMatToMask();
+      auto startTime = std::chrono::steady_clock::now();
       
-      maskWritten = captureRegionMask(spImage, inputImg, srmTags, tag, blockWidth, blockHeight, superpixelDim, remerger.maskMat, blockBasedQuantMat);
+      bool worked;
       
-      if (maskWritten)
-      {
-        std::stringstream fnameStream;
-        fnameStream << "srm" << "_tag_" << tag << "_region_mask" << ".png";
-        string fname = fnameStream.str();
-        
-        imwrite(fname, remerger.maskMat);
-        cout << "wrote " << fname << endl;
-        cout << "";
+      if (temporalThreshold > 0) {
+        worked = clusteringCombineTemporal(item.inputImg, item.resultImg, temporalState, artifacts, temporalTileSize, 32, temporalThreshold);
+      } else {
+        worked = clusteringCombinePyramid(item.inputImg, item.resultImg, artifacts, numPyramidLevels);
       }
       
-      if (maskWritten) {
-        remerger.mergeFromMask();
-        
-        if (debugWriteIntermediateFiles) {
-          std::stringstream fnameStream;
-          fnameStream << "srm" << "_tag_" << tag << "_merge_region" << ".png";
-          string fname = fnameStream.str();
-          
-          imwrite(fname, remerger.mergeMat);
-          cout << "wrote " << fname << endl;
-          cout << "" << endl;
-        }
-      } // if maskWritten
+      auto endTime = std::chrono::steady_clock::now();
       
-    } // foreach tag in sorted superpixels
-    
-    // Gather any remaining tags that have not been merged
-    // and add these as new sets of pixels.
-    
-    remerger.mergeLeftovers(srmTags);
-    
-    if (debugWriteIntermediateFiles) {
-      std::stringstream fnameStream;
-      fnameStream << "srm_merged_all_regions" << ".png";
-      string fname = fnameStream.str();
+      result.segmentSeconds = std::chrono::duration<double>(endTime - startTime).count();
       
-      imwrite(fname, remerger.mergeMat);
-      cout << "wrote " << fname << endl;
-      cout << "" << endl;
-    }
-    
-    /*
-    
-    uint32_t tagsAdlerAfterMerge = 0;
-    
-    for ( int y = 0; y < mergeMat.rows; y++ ) {
-      for ( int x = 0; x < mergeMat.cols; x++ ) {
-        Vec3b vec = mergeMat.at<Vec3b>(y, x);
-        uint32_t pixel = Vec3BToUID(vec);
-        tagsAdlerAfterMerge = my_adler32(tagsAdlerAfterMerge, (unsigned char const *)&pixel, sizeof(uint32_t), 0);
+      recordClusteringCombineMetrics(artifacts, worked, result.segmentSeconds);
+      
+      if (worked) {
+        segmentedQueue.push(item);
       }
+      
+      item = BatchPipelineItem();
     }
+  };
+  
+  auto encodeFunc = [&]()->void {
+    BatchPipelineItem item;
     
-    // Don't do expensive reparsing if merge resulted in the exact same thing
-
-    if (tagsAdlerBeforeMerge == tagsAdlerAfterMerge) {
-      if (debug) {
-        cout << "merge operation did not change any tags" << endl;
-      }
-    } else {
-      spImage = SuperpixelImage();
+    while (segmentedQueue.pop(item)) {
+      BatchImageResult &result = results[item.index];
       
-      worked = SuperpixelImage::parse(mergeMat, spImage);
+      auto startTime = std::chrono::steady_clock::now();
       
-      if (!worked) {
-        return false;
+      result.worked = writeOutputTags(result.outputFilename, item.inputImg, item.resultImg);
+      
+      auto endTime = std::chrono::steady_clock::now();
+      
+      result.encodeSeconds = std::chrono::duration<double>(endTime - startTime).count();
+      
+      if (result.worked) {
+        observeMetricsHistogram("segmentation_stage_seconds", "stage=\"encode\"", result.encodeSeconds);
+      } else {
+        addMetricsCounter("segmentation_encode_failures_total", NULL);
       }
+      
+      item = BatchPipelineItem();
     }
-    
-    // FIXME: If there have been no changes, no reason to reparse ? (check an adler32)
-    
-    */
-    
-    spImage = SuperpixelImage();
-    
-    worked = SuperpixelImage::parse(remerger.mergeMat, spImage);
-    
-    if (!worked) {
-      return false;
-    }
-    
-    // mergeMat now contains tags after a split and merge operation
-    
+  };
+  
+  vector<std::thread> decoders;
+  vector<std::thread> workers;
+  vector<std::thread> encoders;
+  
+  for ( int i = 0; i < numDecoders; i++ ) {
+    decoders.push_back(std::thread(decodeFunc));
+  }
+  for ( int i = 0; i < numWorkers; i++ ) {
+    workers.push_back(std::thread(segmentFunc));
+  }
+  for ( int i = 0; i < numEncoders; i++ ) {
+    encoders.push_back(std::thread(encodeFunc));
   }
   
-  // Generate result image after region based merging
+  // Each queue is closed once the stage that fills it is done
   
-  if (debugWriteIntermediateFiles) {
-    generateStaticColortable(inputImg, spImage);
-    writeTagsWithStaticColortable(spImage, resultImg);
-    imwrite("tags_after_region_merge.png", resultImg);
+  for ( std::thread &decoder : decoders ) {
+    decoder.join();
   }
+  decodedQueue.close();
   
-  // Done
+  for ( std::thread &worker : workers ) {
+    worker.join();
+  }
+  segmentedQueue.close();
   
-  cout << "ended with " << spImage.superpixels.size() << " superpixels" << endl;
+  for ( std::thread &encoder : encoders ) {
+    encoder.join();
+  }
   
-  return true;
+  auto batchEndTime = std::chrono::steady_clock::now();
+  
+  double batchSeconds = std::chrono::duration<double>(batchEndTime - batchStartTime).count();
+  
+  int numFailed = 0;
+  
+  for ( BatchImageResult &result : results ) {
+    char buffer[1024];
+    double seconds = result.decodeSeconds + result.segmentSeconds + result.encodeSeconds;
+    if (result.worked) {
+      snprintf(buffer, sizeof(buffer), "%10.4f seconds (read %.4f segment %.4f write %.4f) : wrote %s", seconds, result.decodeSeconds, result.segmentSeconds, result.encodeSeconds, result.outputFilename.c_str());
+    } else {
+      snprintf(buffer, sizeof(buffer), "%10.4f seconds : failed %s", seconds, result.inputFilename.c_str());
+      numFailed += 1;
+    }
+    cout << (char*)buffer << endl;
+  }
+  
+  {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "segmented %d of %d images in %.4f seconds : %.4f images per second", numImages - numFailed, numImages, batchSeconds, (batchSeconds > 0.0) ? (numImages / batchSeconds) : 0.0);
+    cout << (char*)buffer << endl;
+  }
+  
+  const char *metricsPath = getenv("SEGMENTATION_METRICS_JSON");
+  
+  if (metricsPath != NULL && *metricsPath != '\0') {
+    setMetricsGauge("segmentation_batch_seconds", NULL, batchSeconds);
+    
+    FILE *fp = fopen(metricsPath, "w");
+    
+    if (fp == NULL) {
+      cerr << "could not write metrics to \"" << metricsPath << "\"" << endl;
+    } else {
+      writeMetricsJSON(fp);
+      fclose(fp);
+      cout << "wrote " << metricsPath << endl;
+    }
+  }
+  
+  return (numFailed == 0) ? 0 : 1;
 }
-
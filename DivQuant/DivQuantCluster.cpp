@@ -17,7 +17,13 @@
 
 #include "DivQuantHeader.h"
 
+#include "DivQuantProfile.h"
+
+#include "quant_util.h"
+
+#include <new>
 #include <vector>
+#include <thread>
 
 #include "assert.h"
 
@@ -29,6 +35,11 @@ using namespace std;
 
 //#define VERBOSE
 
+// Local k-means iterations are only split across threads when each thread
+// would process at least this many points.
+
+#define DIVQUANT_MIN_POINTS_PER_THREAD ( 32768 )
+
 // UW  : true if a uniform weight applies to each pixel evenly
 // MT  : type of the member attribute, either uint8_t uint32_t
 // KM  : true if 1 or more kmeans iterations will be applied
@@ -122,6 +133,288 @@ DivQuantClusterInitMeanAndVar(
 #endif
 }
 
+// Partial sums for the points assigned to the new cluster during one
+// local k-means iteration.
+
+typedef struct
+{
+  Pixel_Double mean; /* weighted sum of the point values */
+  Pixel_Double var; /* weighted sum of the squared point values */
+  double weight;
+  int size;
+#ifdef VERBOSE
+  double mse;
+#endif
+} DivQuantLKMSums;
+
+// Assign the points in the range [start, end) to either the old or the new
+// cluster for one local k-means iteration and accumulate the new cluster
+// sums. Each point only writes its own member entry so that distinct ranges
+// can be processed at the same time on different threads.
+
+template <bool UW, typename MT>
+void
+DivQuantClusterLKMRange(
+                const int start,
+                const int end,
+                const uint32_t *tmp_data,
+                const int *point_index,
+                const double data_weight,
+                const double *weightsPtr,
+                MT *member,
+                const double lhs,
+                const double rhs_red,
+                const double rhs_green,
+                const double rhs_blue,
+                const Pixel_Double *old_mean,
+                const bool last_iter,
+                const int old_index,
+                const int new_index,
+                DivQuantLKMSums *sums)
+{
+  double red, green, blue;
+  double tmp_weight = 0.0;
+  
+  memset(sums, 0, sizeof(DivQuantLKMSums));
+  
+  for ( int ip = start; ip < end; )
+  {
+    int maxLoopOffset = 0xFFFF;
+    int numLeft = (end - ip);
+    if (numLeft < maxLoopOffset) {
+      maxLoopOffset = numLeft;
+    }
+    maxLoopOffset += ip;
+    
+    uint32_t new_mean_red = 0;
+    uint32_t new_mean_green = 0;
+    uint32_t new_mean_blue = 0;
+    
+    uint32_t new_var_red = 0;
+    uint32_t new_var_green = 0;
+    uint32_t new_var_blue = 0;
+    
+    for ( ; ip < maxLoopOffset; ip++ ) {
+      
+      uint32_t pixel = tmp_data[ip];
+      uint32_t B = pixel & 0xFF;
+      uint32_t G = (pixel >> 8) & 0xFF;
+      uint32_t R = (pixel >> 16) & 0xFF;
+      
+      red = R;
+      green = G;
+      blue = B;
+      
+      int pointindex = ip;
+      if (point_index) {
+        pointindex = point_index[ip];
+      }
+      
+      if (!UW) {
+        tmp_weight = weightsPtr[pointindex];
+      }
+#ifdef VERBOSE
+      else {
+        tmp_weight = data_weight;
+      }
+#endif
+      
+      if ( lhs < ( (rhs_red * red) + (rhs_green * green) + (rhs_blue * blue) ) )
+      {
+#ifdef VERBOSE
+        // Update the MSE of the old cluster
+        sums->mse += tmp_weight *
+        ( SQR ( red - old_mean->red ) +
+         SQR ( green - old_mean->green ) +
+         SQR ( blue - old_mean->blue ) );
+#endif
+        
+        if ( last_iter )
+        {
+          // Save the membership of the point
+          member[pointindex] = old_index;
+        }
+      }
+      else
+      {
+#ifdef VERBOSE
+        // Update the MSE of the new cluster
+        sums->mse += tmp_weight *
+        ( SQR ( red - old_mean->red + rhs_red ) +
+         SQR ( green - old_mean->green + rhs_green ) +
+         SQR ( blue - old_mean->blue + rhs_blue ) );
+#endif
+        
+        if (UW) {
+          new_mean_red += R;
+          new_mean_green += G;
+          new_mean_blue += B;
+        } else {
+          sums->mean.red += tmp_weight * red;
+          sums->mean.green += tmp_weight * green;
+          sums->mean.blue += tmp_weight * blue;
+        }
+        
+        if ( last_iter )
+        {
+          // Update variance
+          
+          if (UW) {
+            new_var_red += ( R * R );
+            new_var_green += ( G * G );
+            new_var_blue += ( B * B );
+          } else {
+            sums->var.red += tmp_weight * ( R * R );
+            sums->var.green += tmp_weight * ( G * G );
+            sums->var.blue += tmp_weight * ( B * B );
+          }
+          
+          // Save the membership of the point
+          member[pointindex] = new_index;
+        }
+        
+        // Update the weight/size of the new cluster
+        
+        if (!UW) {
+          sums->weight += tmp_weight;
+        }
+        sums->size++;
+      }
+    } // end foreach point inner loop
+    
+    if (UW) {
+      sums->mean.red += new_mean_red;
+      sums->mean.green += new_mean_green;
+      sums->mean.blue += new_mean_blue;
+      
+      sums->var.red += new_var_red;
+      sums->var.green += new_var_green;
+      sums->var.blue += new_var_blue;
+    }
+    
+  } // end foreach point outer loop
+  
+  (void) old_mean;
+  (void) data_weight;
+}
+
+// Arguments of one local k-means iteration, each range index is one range of
+// points with its own sums
+
+template <bool UW, typename MT>
+struct DivQuantClusterLKMRanges
+{
+  int num_points;
+  int points_per_range;
+  const uint32_t *tmp_data;
+  const int *point_index;
+  double data_weight;
+  const double *weightsPtr;
+  MT *member;
+  double lhs;
+  double rhs_red;
+  double rhs_green;
+  double rhs_blue;
+  const Pixel_Double *old_mean;
+  bool last_iter;
+  int old_index;
+  int new_index;
+  DivQuantLKMSums *rangeSums;
+};
+
+template <bool UW, typename MT>
+static void
+DivQuantClusterLKMRangeFunc ( int index, void *data )
+{
+  const DivQuantClusterLKMRanges<UW, MT> &r = *((const DivQuantClusterLKMRanges<UW, MT> *) data);
+  
+  int start = index * r.points_per_range;
+  int end = min(r.num_points, start + r.points_per_range);
+  
+  DivQuantClusterLKMRange<UW, MT>(start, end, r.tmp_data, r.point_index, r.data_weight, r.weightsPtr, r.member, r.lhs, r.rhs_red, r.rhs_green, r.rhs_blue, r.old_mean, r.last_iter, r.old_index, r.new_index, &r.rangeSums[index]);
+}
+
+// Run one local k-means iteration over num_points points, when num_threads
+// is larger than 1 and there are enough points the points are split into
+// equal ranges that are processed with the quant_set_parallel_for() loop, or
+// on a thread for each range when no loop is set. The per range sums are then
+// reduced in range order.
+
+template <bool UW, typename MT>
+void
+DivQuantClusterLKM(
+                const int num_threads,
+                const int num_points,
+                const uint32_t *tmp_data,
+                const int *point_index,
+                const double data_weight,
+                const double *weightsPtr,
+                MT *member,
+                const double lhs,
+                const double rhs_red,
+                const double rhs_green,
+                const double rhs_blue,
+                const Pixel_Double *old_mean,
+                const bool last_iter,
+                const int old_index,
+                const int new_index,
+                DivQuantLKMSums *sums)
+{
+  int numRanges = num_threads;
+  
+  if ((num_points / DIVQUANT_MIN_POINTS_PER_THREAD) < numRanges) {
+    numRanges = num_points / DIVQUANT_MIN_POINTS_PER_THREAD;
+  }
+  
+  if (numRanges <= 1) {
+    DivQuantClusterLKMRange<UW, MT>(0, num_points, tmp_data, point_index, data_weight, weightsPtr, member, lhs, rhs_red, rhs_green, rhs_blue, old_mean, last_iter, old_index, new_index, sums);
+    return;
+  }
+  
+  vector<DivQuantLKMSums> rangeSums(numRanges);
+  
+  const int pointsPerRange = (num_points + numRanges - 1) / numRanges;
+  
+  DivQuantClusterLKMRanges<UW, MT> ranges = { num_points, pointsPerRange, tmp_data, point_index, data_weight, weightsPtr, member, lhs, rhs_red, rhs_green, rhs_blue, old_mean, last_iter, old_index, new_index, rangeSums.data() };
+  
+  QuantParallelForFunc parallelForFunc = quant_get_parallel_for();
+  
+  if (parallelForFunc != NULL) {
+    parallelForFunc(numRanges, DivQuantClusterLKMRangeFunc<UW, MT>, &ranges);
+  } else {
+    // The calling thread processes the first range
+    
+    vector<thread> threads;
+    threads.reserve(numRanges - 1);
+    
+    for ( int i = 1; i < numRanges; i++ ) {
+      threads.push_back(thread(DivQuantClusterLKMRangeFunc<UW, MT>, i, &ranges));
+    }
+    
+    DivQuantClusterLKMRangeFunc<UW, MT>(0, &ranges);
+    
+    for ( thread &t : threads ) {
+      t.join();
+    }
+  }
+  
+  memset(sums, 0, sizeof(DivQuantLKMSums));
+  
+  for ( DivQuantLKMSums &rs : rangeSums ) {
+    sums->mean.red += rs.mean.red;
+    sums->mean.green += rs.mean.green;
+    sums->mean.blue += rs.mean.blue;
+    sums->var.red += rs.var.red;
+    sums->var.green += rs.var.green;
+    sums->var.blue += rs.var.blue;
+    sums->weight += rs.weight;
+    sums->size += rs.size;
+#ifdef VERBOSE
+    sums->mse += rs.mse;
+#endif
+  }
+}
+
 // This method defines a clustering approach that divides the input into
 // roughly equally sized clusters until N clusters is reached or the
 // clusters can be divided no more.
@@ -130,8 +423,30 @@ DivQuantClusterInitMeanAndVar(
 // MT  : type of the member attribute, either uint8_t uint32_t
 // KM  : true if 1 or more kmeans iterations will be applied
 
+// Allocate n zeroed values from the arena, or from the heap when arena is NULL
+
+template <typename T>
+static inline
+T* DivQuantClusterAlloc( DivQuantArena *arena, size_t n )
+{
+  if (arena != NULL) {
+    return (T*) divquant_arena_alloc(arena, n * sizeof(T));
+  } else {
+    return new (std::nothrow) T[n]();
+  }
+}
+
+template <typename T>
+static inline
+void DivQuantClusterFree( DivQuantArena *arena, T *ptr )
+{
+  if (arena == NULL) {
+    delete [] ptr;
+  }
+}
+
 template <bool UW, typename MT, bool KM>
-void
+DivQuantStatus
 DivQuantCluster(
                 const int num_points,
                 const uint32_t *data,
@@ -141,8 +456,13 @@ DivQuantCluster(
                 const int num_bits,
                 const int max_iters,
                 uint32_t *colortablePtr,
-                uint32_t *numClustersPtr)
+                uint32_t *numClustersPtr,
+                const int num_threads,
+                DivQuantArena *arena)
 {
+  DivQuantStatus status = DIVQUANT_OK;
+  const DivQuantStatus alloc_error = (arena != NULL) ? DIVQUANT_ERROR_ARENA_TOO_SMALL : DIVQUANT_ERROR_NO_MEMORY;
+
   int ic, ip, it;
   int colortableOffset;
   int max_iters_m1; /* MAX_ITERS - 1 */
@@ -167,7 +487,9 @@ DivQuantCluster(
   double max_val;
   double cut_pos; /* cutting position */
   double proj_val; /* projection of a data point on the cutting axis */
+#ifdef VERBOSE
   double red, green, blue; /* R, G, B values of a particular pixel */
+#endif
   double tmp_weight; /* weight of a particular pixel */
   double total_weight; /* weight of C */
   double old_weight; /* weight of C1 */
@@ -276,10 +598,10 @@ DivQuantCluster(
     if ((num_points % 8) != 0) {
       numDoubleWords++;
     }
-    uint64_t *ptr64 = new uint64_t[numDoubleWords]();
+    uint64_t *ptr64 = DivQuantClusterAlloc<uint64_t>(arena, numDoubleWords);
     member = (MT*) ptr64;
   } else {
-    member = new MT[num_points]();
+    member = DivQuantClusterAlloc<MT>(arena, num_points);
   }
   
   point_index = nullptr;
@@ -287,7 +609,7 @@ DivQuantCluster(
 #if defined(DEBUG)
   weight_size = num_colors;
 #endif // DEBUG
-  weight = new double[num_colors]();
+  weight = DivQuantClusterAlloc<double>(arena, num_colors);
   
   /*
    * Contains the size of each cluster. The size of a cluster is
@@ -296,22 +618,37 @@ DivQuantCluster(
 #if defined(DEBUG)
   size_size = num_colors;
 #endif // DEBUG
-  size = new int[num_colors]();
+  size = DivQuantClusterAlloc<int>(arena, num_colors);
   
 #if defined(DEBUG)
   tse_size = num_colors;
 #endif // DEBUG
-  tse = new double[num_colors]();
+  tse = DivQuantClusterAlloc<double>(arena, num_colors);
   
 #if defined(DEBUG)
   mean_size = num_colors;
 #endif // DEBUG
-  mean = new Pixel_Double[num_colors]();
+  mean = DivQuantClusterAlloc<Pixel_Double>(arena, num_colors);
   
 #if defined(DEBUG)
   var_size = num_colors;
 #endif // DEBUG
-  var = new Pixel_Double[num_colors]();
+  var = DivQuantClusterAlloc<Pixel_Double>(arena, num_colors);
+  
+  if (member == nullptr || weight == nullptr || size == nullptr || tse == nullptr || mean == nullptr || var == nullptr) {
+    if (is64Bit && sizeof(MT) == 1) {
+      DivQuantClusterFree(arena, (uint64_t*) member);
+    } else {
+      DivQuantClusterFree(arena, member);
+    }
+    DivQuantClusterFree(arena, weight);
+    DivQuantClusterFree(arena, size);
+    DivQuantClusterFree(arena, tse);
+    DivQuantClusterFree(arena, mean);
+    DivQuantClusterFree(arena, var);
+    *numClustersPtr = 0;
+    return alloc_error;
+  }
   
   Pixel_Double *total_mean = &total_mean_prop;
   Pixel_Double *total_var = &total_var_prop;
@@ -636,145 +973,26 @@ DivQuantCluster(
       printf ( "Local kmeans Iteration %d\n", it );
 #endif
       
-      for ( ip = 0; ip < tmp_num_points; )
-      {
-        int maxLoopOffset = 0xFFFF;
-        int numLeft = (tmp_num_points - ip);
-        if (numLeft < maxLoopOffset) {
-          maxLoopOffset = numLeft;
-        }
-        maxLoopOffset += ip;
-        
-        uint32_t new_mean_red = 0;
-        uint32_t new_mean_green = 0;
-        uint32_t new_mean_blue = 0;
-        
-        uint32_t new_var_red = 0;
-        uint32_t new_var_green = 0;
-        uint32_t new_var_blue = 0;
-        
-        for ( ; ip < maxLoopOffset; ip++ ) {
-          
-          uint32_t pixel = tmp_data[ip];
-          uint32_t B = pixel & 0xFF;
-          uint32_t G = (pixel >> 8) & 0xFF;
-          uint32_t R = (pixel >> 16) & 0xFF;
-          
-          red = R;
-          green = G;
-          blue = B;
-          
-          int pointindex = ip;
-          if (point_index) {
-            pointindex = point_index[ip];
-          }
-#if defined(DEBUG)
-          assert(pointindex >= 0 && pointindex < num_points);
-          assert(pointindex >= 0 && pointindex < member_size);
-#endif // DEBUG
-          if (UW) {
-#ifdef VERBOSE
-            tmp_weight = data_weight;
-#endif // VERBOSE
-          } else {
-            tmp_weight = weightsPtr[pointindex];
-          }
-          
-          if ( lhs < ( (rhs_red * red) + (rhs_green * green) + (rhs_blue * blue) ) )
-          {
-#ifdef VERBOSE
-            // Update the MSE of the old cluster
-            mse += tmp_weight *
-            ( SQR ( red - old_mean->red ) +
-             SQR ( green - old_mean->green ) +
-             SQR ( blue - old_mean->blue ) );
-#endif
-            
-            if ( it == max_iters_m1 )
-            {
-              // Save the membership of the point
-              member[pointindex] = old_index;
-#ifdef VERBOSE
-              fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
-#endif
-            }
-          }
-          else
-          {
-#ifdef VERBOSE
-            // Update the MSE of the new cluster
-            mse += tmp_weight *
-            ( SQR ( red - old_mean->red + rhs_red ) +
-             SQR ( green - old_mean->green + rhs_green ) +
-             SQR ( blue - old_mean->blue + rhs_blue ) );
-#endif
-            
-            if ( it != max_iters_m1 )
-            {
-              // Update only mean
-              
-              if (UW) {
-                new_mean_red += R;
-                new_mean_green += G;
-                new_mean_blue += B;
-              } else {
-                new_mean->red += tmp_weight * red;
-                new_mean->green += tmp_weight * green;
-                new_mean->blue += tmp_weight * blue;
-              }
-            }
-            else
-            {
-              // Update mean and variance
-              
-              if (UW) {
-                new_mean_red += R;
-                new_mean_green += G;
-                new_mean_blue += B;
-              } else {
-                new_mean->red += tmp_weight * red;
-                new_mean->green += tmp_weight * green;
-                new_mean->blue += tmp_weight * blue;
-              }
-              
-              if (UW) {
-                new_var_red += ( R * R );
-                new_var_green += ( G * G );
-                new_var_blue += ( B * B );
-              } else {
-                new_var->red += tmp_weight * ( R * R );
-                new_var->green += tmp_weight * ( G * G );
-                new_var->blue += tmp_weight * ( B * B );
-              }
-              
-              // Save the membership of the point
-              member[pointindex] = new_index;
+      DivQuantLKMSums sums;
+      
+      DivQuantClusterLKM<UW, MT>(num_threads, tmp_num_points, tmp_data, point_index, data_weight, weightsPtr, member,
+                                 lhs, rhs_red, rhs_green, rhs_blue, old_mean, (it == max_iters_m1),
+                                 old_index, new_index, &sums);
+      
+      new_mean->red = sums.mean.red;
+      new_mean->green = sums.mean.green;
+      new_mean->blue = sums.mean.blue;
+      
+      new_var->red = sums.var.red;
+      new_var->green = sums.var.green;
+      new_var->blue = sums.var.blue;
+      
+      new_weight = sums.weight;
+      new_size = sums.size;
+      
 #ifdef VERBOSE
-              fprintf(stdout, "write member[%d] = %d (ip = %d)\n", pointindex, member[pointindex], ip);
+      mse = sums.mse;
 #endif
-            }
-            
-            // Update the weight/size of the new cluster
-            
-            if (UW) {
-            } else {
-              new_weight += tmp_weight;
-            }
-            new_size++;
-          }
-        } // end foreach tmp_num_points inner loop
-        
-        if (UW) {
-          new_mean->red += new_mean_red;
-          new_mean->green += new_mean_green;
-          new_mean->blue += new_mean_blue;
-          
-          new_var->red += new_var_red;
-          new_var->green += new_var_green;
-          new_var->blue += new_var_blue;
-        }
-        
-      } // end foreach tmp_num_points outer loop
       
 #ifdef VERBOSE
       printf ( "\tLocal Iteration %d: MSE = %f\n", it, mse );
@@ -917,7 +1135,13 @@ DivQuantCluster(
       tmp_buffer_used = largerSize;
       
       // alloc and init to zero
-      point_index = new int[largerSize]();
+      point_index = DivQuantClusterAlloc<int>(arena, largerSize);
+      
+      if (point_index == nullptr) {
+        // The clusters split so far are still valid
+        status = alloc_error;
+        break;
+      }
     } else {
 #if defined(DEBUG)
       assert(tmp_data == tmp_buffer);
@@ -1080,23 +1304,106 @@ DivQuantCluster(
 #endif
   
   
-  if (tmp_buffer_used > 0) {
-    delete [] point_index;
+  DivQuantClusterFree(arena, point_index);
+  if (is64Bit && sizeof(MT) == 1) {
+    DivQuantClusterFree(arena, (uint64_t*) member);
+  } else {
+    DivQuantClusterFree(arena, member);
   }
-  delete [] member;
-  delete [] weight;
-  delete [] size;
-  delete [] tse;
-  delete [] mean;
-  delete [] var;
+  DivQuantClusterFree(arena, weight);
+  DivQuantClusterFree(arena, size);
+  DivQuantClusterFree(arena, tse);
+  DivQuantClusterFree(arena, mean);
+  DivQuantClusterFree(arena, var);
   
   int numClusters = num_colors - num_empty;
   *numClustersPtr = numClusters;
   
-  return;
+  return status;
 }
 
-void
+// Cluster points that have already been deduplicated (or cut) into num_points
+// colors with either a uniform weight or a weight for each point. The
+// tmpPixels buffer must hold num_points values.
+
+static DivQuantStatus
+quant_cluster_points (
+                      const int num_points,
+                      const uint32_t *inputPixels,
+                      uint32_t *tmpPixels,
+                      const double weightUniform,
+                      double *weightsPtr,
+                      uint32_t *numClustersPtr,
+                      uint32_t *colortablePtr,
+                      const int num_bits,
+                      const int max_iters,
+                      const DivQuantOptions *options)
+{
+  const int num_threads = options ? options->num_threads : 1;
+  const bool float_soa = options ? (options->float_soa != 0) : false;
+  DivQuantArena *arena = options ? options->arena : NULL;
+  
+  int num_colors = *numClustersPtr;
+  
+  DivQuantScopedTimer timer("cluster");
+  divquant_profile_count("cluster.points", num_points);
+  
+  DivQuantStatus status = DIVQUANT_OK;
+  
+  if (float_soa) {
+    // Float32 structure of arrays data path
+    
+    DivQuantClusterFloat(num_points, inputPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+  } else if (weightsPtr == nullptr) {
+    // Uniform weight
+    
+    if (num_colors <= 256) {
+      // Uniform weight and each cluster int fits in one byte
+      
+      status = DivQuantCluster<true, uint8_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, num_threads, arena);
+    } else {
+      // Uniform weight where each cluster fits in a word
+
+      status = DivQuantCluster<true, uint32_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, num_threads, arena);
+    }
+  } else {
+    // Non-uniform weights (num clusters unrestrained)
+    
+    if (num_colors <= 256) {
+      status = DivQuantCluster<false, uint8_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, num_threads, arena);
+    } else {
+      status = DivQuantCluster<false, uint32_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr, num_threads, arena);
+    }
+  }
+  
+  return status;
+}
+
+// The arena needs room for the calc_color_table() buffers, the copy of the
+// deduplicated pixels and the DivQuantCluster() buffers. Each allocation
+// can be padded by up to 15 bytes.
+
+size_t
+divquant_arena_size ( const uint32_t numPixels, const int num_colors )
+{
+  size_t bytes = calc_color_table_arena_size(numPixels);
+  
+  // Deduplicated pixels
+  bytes += numPixels * sizeof(uint32_t) + 15;
+  
+  // member, size of the largest member type rounded up to 8 points
+  bytes += ((numPixels + 7) & ~7) * sizeof(uint32_t) + 15;
+  
+  // point_index
+  bytes += numPixels * sizeof(int) + 15;
+  
+  // weight, size, tse, mean, var
+  bytes += num_colors * (2 * sizeof(double) + sizeof(int) + 2 * sizeof(Pixel_Double)) + 5 * 15;
+  
+  return bytes;
+}
+
+DivQuantStatus
 quant_varpart_fast (
                     const uint32_t numPixels,
                     const uint32_t *inPixels,
@@ -1108,73 +1415,81 @@ quant_varpart_fast (
                     const int num_bits,
                     const int dec_factor,
                     const int max_iters,
-                    const int allPixelsUnique)
+                    const int allPixelsUnique,
+                    const DivQuantOptions *options)
 {
   int num_points;
   
-  if ( !validate_num_bits ( num_bits ) )
+  if ( !validate_num_bits ( num_bits ) || dec_factor <= 0 )
   {
-    assert(0);
+    return DIVQUANT_ERROR_INVALID_ARGUMENT;
   }
   
+  DivQuantArena *arena = options ? options->arena : NULL;
+  const size_t arena_used = arena ? arena->used : 0;
+  const DivQuantStatus alloc_error = (arena != NULL) ? DIVQUANT_ERROR_ARENA_TOO_SMALL : DIVQUANT_ERROR_NO_MEMORY;
+  
   num_points = numPixels;
   
-  int num_colors = *numClustersPtr;
-
   bool inputPixelsAllocated = false;
   uint32_t *inputPixels = (uint32_t*) inPixels;
   
   double weightUniform = 0.0;
   double *weightsPtr = nullptr;
   
+  DivQuantStatus status = DIVQUANT_OK;
+  
   if ((allPixelsUnique && (num_bits == 8 && dec_factor == 1) && 1)) {
     // No duplicate pixels and no decimation or bit shifting
     weightUniform = get_double_scale(inPixels, numPixels);
-  } else if (!allPixelsUnique && num_bits == 8) {
-    // No cut bits, but duplicate pixels, dedup now
-    weightsPtr = calc_color_table(inPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, &num_points);
-    inputPixelsAllocated = true;
-    inputPixels = new uint32_t[num_points];
-    memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
   } else {
-    // cut bits with right shift and dedup to generate significantly smaller sized buffer
-    cut_bits(inPixels, numPixels, tmpPixels, num_bits, num_bits, num_bits);
-    weightsPtr = calc_color_table(tmpPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, &num_points);
-    inputPixelsAllocated = true;
-    inputPixels = new uint32_t[num_points];
-    memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
-  }
-  
-  if (weightsPtr == nullptr) {
-    // Uniform weight
+    // Dedup the duplicate pixels, when num_bits is less than 8 the bits are
+    // cut with a right shift as the pixels are read to generate a
+    // significantly smaller sized buffer.
     
-    if (num_colors <= 256) {
-      // Uniform weight and each cluster int fits in one byte
-      
-      DivQuantCluster<true, uint8_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
-    } else {
-      // Uniform weight where each cluster fits in a word
-
-      DivQuantCluster<true, uint32_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+    const int num_threads = options ? options->num_threads : 1;
+    
+    {
+      DivQuantScopedTimer timer("calc_color_table");
+      weightsPtr = calc_color_table(inPixels, numPixels, tmpPixels, numRows, numCols, dec_factor, &num_points, arena, num_bits, num_threads);
     }
-  } else {
-    // Non-uniform weights (num clusters unrestrained)
     
-    if (num_colors <= 256) {
-      DivQuantCluster<false, uint8_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+    if (weightsPtr == nullptr) {
+      status = alloc_error;
     } else {
-      DivQuantCluster<false, uint32_t, true>(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+      if (arena != NULL) {
+        inputPixels = (uint32_t*) divquant_arena_alloc(arena, num_points * sizeof(uint32_t));
+      } else {
+        inputPixels = new (std::nothrow) uint32_t[num_points];
+      }
+      
+      if (inputPixels == nullptr) {
+        status = alloc_error;
+      } else {
+        inputPixelsAllocated = true;
+        memcpy(inputPixels, tmpPixels, num_points * sizeof(uint32_t));
+      }
     }
   }
   
-  if (weightsPtr != nullptr) {
-    delete [] weightsPtr;
+  if (status == DIVQUANT_OK) {
+    status = quant_cluster_points(num_points, inputPixels, tmpPixels, weightUniform, weightsPtr, numClustersPtr, colortablePtr, num_bits, max_iters, options);
+  } else {
+    *numClustersPtr = 0;
   }
   
-  if (inputPixelsAllocated) {
-    delete [] inputPixels;
+  if (arena != NULL) {
+    // Release everything allocated from the arena during this call
+    arena->used = arena_used;
+  } else {
+    if (weightsPtr != nullptr) {
+      delete [] weightsPtr;
+    }
+    
+    if (inputPixelsAllocated) {
+      delete [] inputPixels;
+    }
   }
   
-  return;
+  return status;
 }
-
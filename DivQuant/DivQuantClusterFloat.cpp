@@ -0,0 +1,459 @@
+// Float32 structure of arrays variant of DivQuantCluster(). The packed input
+// pixels are unpacked into contiguous R, G, B and weight arrays once and the
+// points of each cluster to be split are gathered into contiguous arrays, so
+// that the projection and local k-means loops are simple streaming loops
+// over float arrays that the compiler can vectorize. The cluster state is
+// also kept as a structure of arrays. The divisive split and local k-means
+// logic is the same as DivQuantCluster().
+
+#include "DivQuantHeader.h"
+
+#include <vector>
+
+#include "assert.h"
+
+using namespace std;
+
+#define SQR( X ) ( ( X ) * ( X ) )
+
+// Number of independent float accumulators, keeping separate partial sums
+// lets the reductions be vectorized without reordering float adds.
+
+#define DIVQUANT_FLOAT_LANES ( 8 )
+
+// Float partial sums are flushed into double sums after this many points so
+// that precision does not degrade for very large clusters.
+
+#define DIVQUANT_FLOAT_BLOCK ( 4096 )
+
+typedef struct
+{
+  double weight;
+  double red, green, blue;
+  double red2, green2, blue2;
+  int size;
+} DivQuantFloatSums;
+
+// Accumulate the weighted sums (and optionally weighted squares) of the points
+// for which isNew(i) is true.
+
+template <bool SQUARES, typename P>
+static inline void
+DivQuantFloatAccumulate(
+                const int n,
+                const float *red,
+                const float *green,
+                const float *blue,
+                const float *weight,
+                P isNew,
+                DivQuantFloatSums *sums)
+{
+  const int L = DIVQUANT_FLOAT_LANES;
+
+  memset(sums, 0, sizeof(DivQuantFloatSums));
+
+  for ( int start = 0; start < n; start += DIVQUANT_FLOAT_BLOCK ) {
+    int end = start + DIVQUANT_FLOAT_BLOCK;
+    if (end > n) {
+      end = n;
+    }
+
+    float aw[L], ar[L], ag[L], ab[L], ar2[L], ag2[L], ab2[L];
+    int ac[L];
+
+    for ( int l = 0; l < L; l++ ) {
+      aw[l] = ar[l] = ag[l] = ab[l] = ar2[l] = ag2[l] = ab2[l] = 0.0f;
+      ac[l] = 0;
+    }
+
+    int i = start;
+
+    for ( ; (i + L) <= end; i += L ) {
+      for ( int l = 0; l < L; l++ ) {
+        const int k = i + l;
+        const int sel = isNew(k) ? 1 : 0;
+        const float w = (float) sel * weight[k];
+        const float wr = w * red[k];
+        const float wg = w * green[k];
+        const float wb = w * blue[k];
+        aw[l] += w;
+        ar[l] += wr;
+        ag[l] += wg;
+        ab[l] += wb;
+        if (SQUARES) {
+          ar2[l] += wr * red[k];
+          ag2[l] += wg * green[k];
+          ab2[l] += wb * blue[k];
+        }
+        ac[l] += sel;
+      }
+    }
+
+    for ( ; i < end; i++ ) {
+      const bool sel = isNew(i);
+      const float w = sel ? weight[i] : 0.0f;
+      aw[0] += w;
+      ar[0] += w * red[i];
+      ag[0] += w * green[i];
+      ab[0] += w * blue[i];
+      if (SQUARES) {
+        ar2[0] += w * red[i] * red[i];
+        ag2[0] += w * green[i] * green[i];
+        ab2[0] += w * blue[i] * blue[i];
+      }
+      ac[0] += sel ? 1 : 0;
+    }
+
+    for ( int l = 0; l < L; l++ ) {
+      sums->weight += aw[l];
+      sums->red += ar[l];
+      sums->green += ag[l];
+      sums->blue += ab[l];
+      sums->red2 += ar2[l];
+      sums->green2 += ag2[l];
+      sums->blue2 += ab2[l];
+      sums->size += ac[l];
+    }
+  }
+}
+
+// MT : type of the member attribute, either uint8_t uint32_t
+
+template <typename MT>
+void
+DivQuantClusterFloat(
+                const int num_points,
+                const uint32_t *data,
+                const double data_weight,
+                const double *weightsPtr,
+                const int num_bits,
+                const int max_iters,
+                uint32_t *colortablePtr,
+                uint32_t *numClustersPtr)
+{
+  assert(num_points > 0);
+
+  const int num_colors = *numClustersPtr;
+  assert(num_colors > 0);
+
+  // In the uniform weight case each point has a weight of 1 and the sums
+  // are scaled by data_weight, this keeps small weights out of the floats.
+
+  const bool uniformWeight = (weightsPtr == nullptr);
+  const double scale = uniformWeight ? data_weight : 1.0;
+  assert(scale > 0.0);
+
+  const int max_iters_m1 = max_iters - 1;
+
+  // Unpack the input pixels once
+
+  vector<float> pointRed(num_points);
+  vector<float> pointGreen(num_points);
+  vector<float> pointBlue(num_points);
+  vector<float> pointWeight(num_points);
+
+  for ( int ip = 0; ip < num_points; ip++ ) {
+    uint32_t pixel = data[ip];
+    pointBlue[ip] = (float) (pixel & 0xFF);
+    pointGreen[ip] = (float) ((pixel >> 8) & 0xFF);
+    pointRed[ip] = (float) ((pixel >> 16) & 0xFF);
+    pointWeight[ip] = uniformWeight ? 1.0f : (float) weightsPtr[ip];
+  }
+
+  vector<MT> member(num_points, 0);
+
+  // The points of the cluster being split, gathered into contiguous arrays
+
+  vector<float> tmpRed, tmpGreen, tmpBlue, tmpWeight;
+  vector<int> pointIndex;
+
+  // Cluster state
+
+  vector<double> meanRed(num_colors), meanGreen(num_colors), meanBlue(num_colors);
+  vector<double> varRed(num_colors), varGreen(num_colors), varBlue(num_colors);
+  vector<double> weight(num_colors), tse(num_colors);
+  vector<int> size(num_colors);
+
+  DivQuantFloatSums sums;
+
+  DivQuantFloatAccumulate<true>(num_points, pointRed.data(), pointGreen.data(), pointBlue.data(), pointWeight.data(),
+                                [](int) { return true; }, &sums);
+
+  meanRed[0] = sums.red * scale;
+  meanGreen[0] = sums.green * scale;
+  meanBlue[0] = sums.blue * scale;
+
+  varRed[0] = sums.red2 * scale - SQR ( meanRed[0] );
+  varGreen[0] = sums.green2 * scale - SQR ( meanGreen[0] );
+  varBlue[0] = sums.blue2 * scale - SQR ( meanBlue[0] );
+
+  weight[0] = 1.0;
+  size[0] = num_points;
+
+  int old_index = 0;
+  int tmp_num_points = num_points;
+
+  const float *clusterRed = pointRed.data();
+  const float *clusterGreen = pointGreen.data();
+  const float *clusterBlue = pointBlue.data();
+  const float *clusterWeight = pointWeight.data();
+  const int *clusterIndex = nullptr;
+
+  for ( int new_index = 1; new_index < num_colors; new_index++ )
+  {
+    const double total_weight = weight[old_index];
+    const double total_mean_red = meanRed[old_index];
+    const double total_mean_green = meanGreen[old_index];
+    const double total_mean_blue = meanBlue[old_index];
+    const double total_var_red = varRed[old_index];
+    const double total_var_green = varGreen[old_index];
+    const double total_var_blue = varBlue[old_index];
+
+    // Cut along the axis with the greatest variance at the mean
+
+    double max_val = total_var_red;
+    const float *proj = clusterRed;
+    double cut_pos = total_mean_red;
+
+    if ( max_val < total_var_green ) {
+      max_val = total_var_green;
+      proj = clusterGreen;
+      cut_pos = total_mean_green;
+    }
+
+    if ( max_val < total_var_blue ) {
+      proj = clusterBlue;
+      cut_pos = total_mean_blue;
+    }
+
+    const float cutPos = (float) cut_pos;
+
+    // Split the cluster, the squares are only needed when LKM is not applied
+
+    auto isNewCut = [proj, cutPos](int i) { return cutPos < proj[i]; };
+
+    if ( max_iters > 0 ) {
+      DivQuantFloatAccumulate<false>(tmp_num_points, clusterRed, clusterGreen, clusterBlue, clusterWeight, isNewCut, &sums);
+    } else {
+      DivQuantFloatAccumulate<true>(tmp_num_points, clusterRed, clusterGreen, clusterBlue, clusterWeight, isNewCut, &sums);
+
+      for ( int i = 0; i < tmp_num_points; i++ ) {
+        int pointindex = clusterIndex ? clusterIndex[i] : i;
+        member[pointindex] = isNewCut(i) ? new_index : old_index;
+      }
+    }
+
+    double new_weight = sums.weight * scale;
+    double new_mean_red = sums.red * scale / new_weight;
+    double new_mean_green = sums.green * scale / new_weight;
+    double new_mean_blue = sums.blue * scale / new_weight;
+    double new_var_red = sums.red2 * scale;
+    double new_var_green = sums.green2 * scale;
+    double new_var_blue = sums.blue2 * scale;
+    int new_size = sums.size;
+
+    double old_weight = total_weight - new_weight;
+
+    // Calculate the mean of the old cluster using the 'combined mean' formula
+    double old_mean_red = ( total_weight * total_mean_red - new_weight * new_mean_red ) / old_weight;
+    double old_mean_green = ( total_weight * total_mean_green - new_weight * new_mean_green ) / old_weight;
+    double old_mean_blue = ( total_weight * total_mean_blue - new_weight * new_mean_blue ) / old_weight;
+
+    /* LOCAL K-MEANS BEGIN */
+
+    for ( int it = 0; it < max_iters; it++ )
+    {
+      const float lhs = (float) ( 0.5 *
+      ( SQR ( old_mean_red ) - SQR ( new_mean_red ) +
+       SQR ( old_mean_green ) - SQR ( new_mean_green ) +
+       SQR ( old_mean_blue ) - SQR ( new_mean_blue ) ) );
+
+      const float rhs_red = (float) ( old_mean_red - new_mean_red );
+      const float rhs_green = (float) ( old_mean_green - new_mean_green );
+      const float rhs_blue = (float) ( old_mean_blue - new_mean_blue );
+
+      const float *r = clusterRed;
+      const float *g = clusterGreen;
+      const float *b = clusterBlue;
+
+      // A point closer to the new mean than the old mean joins the new cluster
+
+      auto isNewLKM = [=](int i) { return !( lhs < ( (rhs_red * r[i]) + (rhs_green * g[i]) + (rhs_blue * b[i]) ) ); };
+
+      if ( it != max_iters_m1 ) {
+        DivQuantFloatAccumulate<false>(tmp_num_points, r, g, b, clusterWeight, isNewLKM, &sums);
+      } else {
+        DivQuantFloatAccumulate<true>(tmp_num_points, r, g, b, clusterWeight, isNewLKM, &sums);
+
+        // Save the membership of each point
+
+        for ( int i = 0; i < tmp_num_points; i++ ) {
+          int pointindex = clusterIndex ? clusterIndex[i] : i;
+          member[pointindex] = isNewLKM(i) ? new_index : old_index;
+        }
+      }
+
+      new_weight = sums.weight * scale;
+      new_size = sums.size;
+
+      new_mean_red = sums.red * scale / new_weight;
+      new_mean_green = sums.green * scale / new_weight;
+      new_mean_blue = sums.blue * scale / new_weight;
+
+      new_var_red = sums.red2 * scale;
+      new_var_green = sums.green2 * scale;
+      new_var_blue = sums.blue2 * scale;
+
+      old_weight = total_weight - new_weight;
+
+      old_mean_red = ( total_weight * total_mean_red - new_weight * new_mean_red ) / old_weight;
+      old_mean_green = ( total_weight * total_mean_green - new_weight * new_mean_green ) / old_weight;
+      old_mean_blue = ( total_weight * total_mean_blue - new_weight * new_mean_blue ) / old_weight;
+    }
+
+    /* LOCAL K-MEANS END */
+
+    meanRed[old_index] = old_mean_red;
+    meanGreen[old_index] = old_mean_green;
+    meanBlue[old_index] = old_mean_blue;
+
+    meanRed[new_index] = new_mean_red;
+    meanGreen[new_index] = new_mean_green;
+    meanBlue[new_index] = new_mean_blue;
+
+    size[old_index] = tmp_num_points - new_size;
+    size[new_index] = new_size;
+
+    if ( new_index == num_colors - 1 ) {
+      break;
+    }
+
+    /* Calculate the variance of the new cluster */
+    new_var_red = new_var_red / new_weight - SQR ( new_mean_red );
+    new_var_green = new_var_green / new_weight - SQR ( new_mean_green );
+    new_var_blue = new_var_blue / new_weight - SQR ( new_mean_blue );
+
+    /* Calculate the variance of the old cluster using the 'combined variance' formula */
+    double old_var_red = ( ( total_weight * total_var_red -
+                            new_weight * ( new_var_red + SQR ( new_mean_red - total_mean_red ) ) ) / old_weight ) -
+    SQR ( old_mean_red - total_mean_red );
+
+    double old_var_green = ( ( total_weight * total_var_green -
+                              new_weight * ( new_var_green + SQR ( new_mean_green - total_mean_green ) ) ) / old_weight ) -
+    SQR ( old_mean_green - total_mean_green );
+
+    double old_var_blue = ( ( total_weight * total_var_blue -
+                             new_weight * ( new_var_blue + SQR ( new_mean_blue - total_mean_blue ) ) ) / old_weight ) -
+    SQR ( old_mean_blue - total_mean_blue );
+
+    varRed[old_index] = old_var_red;
+    varGreen[old_index] = old_var_green;
+    varBlue[old_index] = old_var_blue;
+
+    varRed[new_index] = new_var_red;
+    varGreen[new_index] = new_var_green;
+    varBlue[new_index] = new_var_blue;
+
+    weight[old_index] = old_weight;
+    weight[new_index] = new_weight;
+
+    tse[old_index] = old_weight * ( old_var_red + old_var_green + old_var_blue );
+    tse[new_index] = new_weight * ( new_var_red + new_var_green + new_var_blue );
+
+    /* Split the cluster with the maximum TSE */
+    max_val = DBL_MIN;
+    for ( int ic = 0; ic <= new_index; ic++ ) {
+      if ( max_val < tse[ic] ) {
+        max_val = tse[ic];
+        old_index = ic;
+      }
+    }
+
+    tmp_num_points = size[old_index];
+
+    // Gather the points of the next cluster to be split
+
+    tmpRed.resize(tmp_num_points);
+    tmpGreen.resize(tmp_num_points);
+    tmpBlue.resize(tmp_num_points);
+    tmpWeight.resize(tmp_num_points);
+    pointIndex.resize(tmp_num_points);
+
+    int count = 0;
+
+    for ( int ip = 0; ip < num_points; ip++ ) {
+      if ( member[ip] == (uint32_t) old_index ) {
+        if ( count == tmp_num_points ) {
+          count++;
+          break;
+        }
+        tmpRed[count] = pointRed[ip];
+        tmpGreen[count] = pointGreen[ip];
+        tmpBlue[count] = pointBlue[ip];
+        tmpWeight[count] = pointWeight[ip];
+        pointIndex[count] = ip;
+        count++;
+      }
+    }
+
+    if ( count != tmp_num_points )
+    {
+      fprintf ( stderr, "Cluster to be split is expected to be of size %d not %d !\n",
+               tmp_num_points, count );
+      abort ( );
+    }
+
+    clusterRed = tmpRed.data();
+    clusterGreen = tmpGreen.data();
+    clusterBlue = tmpBlue.data();
+    clusterWeight = tmpWeight.data();
+    clusterIndex = pointIndex.data();
+  }
+
+  /* Determine the final cluster centers */
+  const int shift_amount = 8 - num_bits;
+  int num_empty = 0;
+  int colortableOffset = 0;
+
+  for ( int ic = 0; ic < num_colors; ic++ )
+  {
+    if ( size[ic] > 0 )
+    {
+      uint32_t R = ( ( uint8_t ) ( meanRed[ic] + 0.5 ) ) << shift_amount; /* round */
+      uint32_t G = ( ( uint8_t ) ( meanGreen[ic] + 0.5 ) ) << shift_amount; /* round */
+      uint32_t B = ( ( uint8_t ) ( meanBlue[ic] + 0.5 ) ) << shift_amount; /* round */
+      uint32_t pixel = (R << 16) | (G << 8) | B;
+      colortablePtr[colortableOffset++] = pixel;
+    }
+    else
+    {
+      /* Empty cluster */
+      num_empty++;
+    }
+  }
+
+  if ( num_empty )
+  {
+    fprintf ( stderr, "# empty clusters: %d\n", num_empty );
+  }
+
+  *numClustersPtr = num_colors - num_empty;
+}
+
+void
+DivQuantClusterFloat(
+                const int num_points,
+                const uint32_t *data,
+                const double data_weight,
+                const double *weightsPtr,
+                const int num_bits,
+                const int max_iters,
+                uint32_t *colortablePtr,
+                uint32_t *numClustersPtr)
+{
+  if (*numClustersPtr <= 256) {
+    DivQuantClusterFloat<uint8_t>(num_points, data, data_weight, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+  } else {
+    DivQuantClusterFloat<uint32_t>(num_points, data, data_weight, weightsPtr, num_bits, max_iters, colortablePtr, numClustersPtr);
+  }
+}
@@ -0,0 +1,218 @@
+// Packed pixel colorspace conversion for DivQuant
+
+#include "DivQuantColorSpace.h"
+
+#include <math.h>
+
+#include "assert.h"
+
+// Linear RGB and XYZ values are fixed point with LAB_SHIFT fraction bits,
+// the cube root table has one entry for each fixed point XYZ value and the
+// results are fixed point with LAB_F_SHIFT fraction bits.
+
+#define LAB_SHIFT ( 14 )
+#define LAB_ONE ( 1 << LAB_SHIFT )
+#define LAB_F_SHIFT ( 15 )
+#define LAB_F_ONE ( 1 << LAB_F_SHIFT )
+
+typedef struct {
+  int gammaTab[256];
+  int coeffs[9];
+  int cbrtTab[LAB_ONE + 1];
+} DivQuantLabTables;
+
+// Same sRGB D65 constants as cvtColor()
+
+static const double sRGB2XYZ_D65[9] = {
+  0.412453, 0.357580, 0.180423,
+  0.212671, 0.715160, 0.072169,
+  0.019334, 0.119193, 0.950227
+};
+
+static const double XYZ2sRGB_D65[9] = {
+  3.240479, -1.53715, -0.498535,
+  -0.969256, 1.875991, 0.041556,
+  0.055648, -0.204043, 1.057311
+};
+
+static const double D65_WhiteX = 0.950456;
+static const double D65_WhiteZ = 1.088754;
+
+static inline double lab_f ( double t )
+{
+  if (t > 0.008856) {
+    return cbrt(t);
+  } else {
+    return 7.787 * t + 16.0 / 116.0;
+  }
+}
+
+static inline double lab_f_inv ( double t )
+{
+  if (t > 6.0 / 29.0) {
+    return t * t * t;
+  } else {
+    return (t - 16.0 / 116.0) / 7.787;
+  }
+}
+
+static inline int clamp_byte ( int v )
+{
+  return (v < 0) ? 0 : ((v > 255) ? 255 : v);
+}
+
+static void lab_tables_init ( DivQuantLabTables *tables )
+{
+  for ( int i = 0; i < 256; i++ ) {
+    double v = i / 255.0;
+    v = (v <= 0.04045) ? (v / 12.92) : pow((v + 0.055) / 1.055, 2.4);
+    tables->gammaTab[i] = (int) lround(v * LAB_ONE);
+  }
+
+  // Scale X and Z by the white point so that each row sums to 1.0
+
+  for ( int i = 0; i < 9; i++ ) {
+    double scale = (i < 3) ? (1.0 / D65_WhiteX) : ((i >= 6) ? (1.0 / D65_WhiteZ) : 1.0);
+    tables->coeffs[i] = (int) lround(sRGB2XYZ_D65[i] * scale * LAB_ONE);
+  }
+
+  for ( int i = 0; i <= LAB_ONE; i++ ) {
+    tables->cbrtTab[i] = (int) lround(lab_f((double) i / LAB_ONE) * LAB_F_ONE);
+  }
+}
+
+static const DivQuantLabTables & lab_tables ( void )
+{
+  static DivQuantLabTables tables;
+  static bool initialized = (lab_tables_init(&tables), true);
+  (void) initialized;
+  return tables;
+}
+
+static inline int lab_xyz_index ( const int *coeffs, int R, int G, int B )
+{
+  int v = (coeffs[0] * R + coeffs[1] * G + coeffs[2] * B + (1 << (LAB_SHIFT - 1))) >> LAB_SHIFT;
+  return (v > LAB_ONE) ? LAB_ONE : v;
+}
+
+static inline uint32_t rgb_to_lab ( const DivQuantLabTables &tables, uint32_t pixel )
+{
+  int R = tables.gammaTab[(pixel >> 16) & 0xFF];
+  int G = tables.gammaTab[(pixel >> 8) & 0xFF];
+  int B = tables.gammaTab[pixel & 0xFF];
+
+  int fX = tables.cbrtTab[lab_xyz_index(&tables.coeffs[0], R, G, B)];
+  int fY = tables.cbrtTab[lab_xyz_index(&tables.coeffs[3], R, G, B)];
+  int fZ = tables.cbrtTab[lab_xyz_index(&tables.coeffs[6], R, G, B)];
+
+  // L = 116 * fY - 16 scaled from [0, 100] to [0, 255]
+
+  int L = (((116 * fY) - (16 << LAB_F_SHIFT)) * 255 + (50 << LAB_F_SHIFT)) / (100 << LAB_F_SHIFT);
+  int a = (500 * (fX - fY) + (128 << LAB_F_SHIFT) + (1 << (LAB_F_SHIFT - 1))) >> LAB_F_SHIFT;
+  int b = (200 * (fY - fZ) + (128 << LAB_F_SHIFT) + (1 << (LAB_F_SHIFT - 1))) >> LAB_F_SHIFT;
+
+  return ((uint32_t) clamp_byte(L) << 16) | ((uint32_t) clamp_byte(a) << 8) | (uint32_t) clamp_byte(b);
+}
+
+static inline uint32_t lab_to_rgb ( uint32_t pixel )
+{
+  double L = ((pixel >> 16) & 0xFF) * (100.0 / 255.0);
+  double a = (double) ((int) ((pixel >> 8) & 0xFF) - 128);
+  double b = (double) ((int) (pixel & 0xFF) - 128);
+
+  double fY = (L + 16.0) / 116.0;
+  double fX = fY + a / 500.0;
+  double fZ = fY - b / 200.0;
+
+  double XYZ[3];
+  XYZ[0] = lab_f_inv(fX) * D65_WhiteX;
+  XYZ[1] = lab_f_inv(fY);
+  XYZ[2] = lab_f_inv(fZ) * D65_WhiteZ;
+
+  int RGB[3];
+
+  for ( int i = 0; i < 3; i++ ) {
+    double v = XYZ2sRGB_D65[i*3+0] * XYZ[0] + XYZ2sRGB_D65[i*3+1] * XYZ[1] + XYZ2sRGB_D65[i*3+2] * XYZ[2];
+    v = (v < 0.0) ? 0.0 : ((v > 1.0) ? 1.0 : v);
+    v = (v <= 0.0031308) ? (12.92 * v) : (1.055 * pow(v, 1.0 / 2.4) - 0.055);
+    RGB[i] = clamp_byte((int) lround(v * 255.0));
+  }
+
+  return ((uint32_t) RGB[0] << 16) | ((uint32_t) RGB[1] << 8) | (uint32_t) RGB[2];
+}
+
+// Y = R/4 + G/2 + B/4, Co = R/2 - B/2, Cg = G/2 - R/4 - B/4
+
+static inline uint32_t rgb_to_ycocg ( uint32_t pixel )
+{
+  int R = (pixel >> 16) & 0xFF;
+  int G = (pixel >> 8) & 0xFF;
+  int B = pixel & 0xFF;
+
+  int Y = (R + 2 * G + B + 2) >> 2;
+  int Co = ((R - B + 1) >> 1) + 128;
+  int Cg = ((2 * G - R - B + 2) >> 2) + 128;
+
+  return ((uint32_t) clamp_byte(Y) << 16) | ((uint32_t) clamp_byte(Co) << 8) | (uint32_t) clamp_byte(Cg);
+}
+
+static inline uint32_t ycocg_to_rgb ( uint32_t pixel )
+{
+  int Y = (pixel >> 16) & 0xFF;
+  int Co = (int) ((pixel >> 8) & 0xFF) - 128;
+  int Cg = (int) (pixel & 0xFF) - 128;
+
+  int R = Y + Co - Cg;
+  int G = Y + Cg;
+  int B = Y - Co - Cg;
+
+  return ((uint32_t) clamp_byte(R) << 16) | ((uint32_t) clamp_byte(G) << 8) | (uint32_t) clamp_byte(B);
+}
+
+void divquant_rgb_to_colorspace ( DivQuantColorSpace colorspace, const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr )
+{
+  if (colorspace == DIVQUANT_COLORSPACE_LAB) {
+    const DivQuantLabTables &tables = lab_tables();
+
+    // Runs of the same input pixel are common, so reuse the last result
+
+    uint32_t lastIn = 0;
+    uint32_t lastOut = rgb_to_lab(tables, 0);
+
+    for ( uint32_t i = 0; i < numPixels; i++ ) {
+      uint32_t pixel = inPixelsPtr[i] & 0x00FFFFFF;
+
+      if (pixel != lastIn) {
+        lastIn = pixel;
+        lastOut = rgb_to_lab(tables, pixel);
+      }
+
+      outPixelsPtr[i] = lastOut;
+    }
+  } else if (colorspace == DIVQUANT_COLORSPACE_YCOCG) {
+    for ( uint32_t i = 0; i < numPixels; i++ ) {
+      outPixelsPtr[i] = rgb_to_ycocg(inPixelsPtr[i]);
+    }
+  } else {
+    assert(colorspace == DIVQUANT_COLORSPACE_RGB);
+
+    for ( uint32_t i = 0; i < numPixels; i++ ) {
+      outPixelsPtr[i] = inPixelsPtr[i] & 0x00FFFFFF;
+    }
+  }
+}
+
+void divquant_colorspace_to_rgb ( DivQuantColorSpace colorspace, const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr )
+{
+  for ( uint32_t i = 0; i < numPixels; i++ ) {
+    uint32_t pixel = inPixelsPtr[i];
+
+    if (colorspace == DIVQUANT_COLORSPACE_LAB) {
+      outPixelsPtr[i] = lab_to_rgb(pixel);
+    } else if (colorspace == DIVQUANT_COLORSPACE_YCOCG) {
+      outPixelsPtr[i] = ycocg_to_rgb(pixel);
+    } else {
+      outPixelsPtr[i] = pixel & 0x00FFFFFF;
+    }
+  }
+}
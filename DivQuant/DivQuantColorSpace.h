@@ -0,0 +1,46 @@
+// Conversion of packed pixels between RGB and a perceptual colorspace so
+// that DivQuant can cluster and map colors in that space. A converted pixel
+// uses the same 0x00RRGGBB layout as a RGB pixel, so the clustering and the
+// palette mapper treat it like any other 24 bit pixel:
+//
+// Lab   : L in the red byte, a in the green byte, b in the blue byte. The
+//         8 bit scaling matches cvtColor(CV_BGR2Lab), L is scaled by
+//         255/100 and 128 is added to a and b.
+// YCoCg : Y in the red byte, Co and Cg offset by 128 in the green and blue
+//         bytes. This form is lossy, a round trip can be off by one.
+//
+// The RGB to Lab conversion is done with integer math and tables that are
+// built once per process, so an image can be converted once and then any
+// number of region subsets can be clustered without converting again.
+//
+// This header can be included into either C++ or C code.
+
+#ifndef DivQuantColorSpace_h
+#define DivQuantColorSpace_h
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  typedef enum {
+    DIVQUANT_COLORSPACE_RGB = 0,
+    DIVQUANT_COLORSPACE_LAB,
+    DIVQUANT_COLORSPACE_YCOCG
+  } DivQuantColorSpace;
+
+  // Convert RGB pixels to the colorspace, in place conversion is supported
+
+  void divquant_rgb_to_colorspace ( DivQuantColorSpace colorspace, const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr );
+
+  // Convert pixels in the colorspace back to RGB, this is meant for a
+  // colortable and is not table driven. In place conversion is supported.
+
+  void divquant_colorspace_to_rgb ( DivQuantColorSpace colorspace, const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DivQuantColorSpace_h
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
 
 #include <vector>
 
@@ -49,17 +50,51 @@ typedef struct
  double weight;
 } Pixel_Double; /**< (Double) Pixel */
 
-clock_t start_timer ( void );
-double stop_timer ( const clock_t );
+typedef enum
+{
+ DIVQUANT_OK = 0,
+ DIVQUANT_ERROR_INVALID_ARGUMENT, /**< A num_bits or dec_factor value is out of range */
+ DIVQUANT_ERROR_NO_MEMORY, /**< A heap allocation failed */
+ DIVQUANT_ERROR_ARENA_TOO_SMALL /**< The scratch arena does not have enough space left */
+} DivQuantStatus; /**< Result of a quant_varpart_fast() call */
+
+typedef struct
+{
+ uint8_t *buffer;
+ size_t size; /**< Capacity of buffer in bytes */
+ size_t used; /**< Number of bytes allocated from buffer */
+} DivQuantArena; /**< Caller owned scratch memory, see divquant_arena_size() */
+
+typedef struct
+{
+ int num_threads; /**< Split local k-means iterations across threads when larger than 1 */
+ int float_soa; /**< Cluster with the float32 structure of arrays data path */
+ DivQuantArena *arena; /**< Allocate scratch buffers from this arena instead of the heap */
+} DivQuantOptions; /**< Options for quant_varpart_fast(), NULL means defaults */
 
 void check_mem ( const int );
 
+/*
+ * A scratch arena lets a worker that runs many quant_varpart_fast() calls
+ * do all of the per call allocations out of one buffer. Each call releases
+ * what it allocated before returning, so the same arena can be passed to
+ * every call. Only the single threaded double precision path allocates
+ * from the arena, the float_soa path and the threaded local k-means still
+ * use the heap.
+ */
+
+void divquant_arena_init ( DivQuantArena *arena, void *buffer, size_t size );
+
+/* Bytes needed for a quant_varpart_fast() call with numPixels input pixels and num_colors clusters */
+size_t divquant_arena_size ( const uint32_t numPixels, const int num_colors );
+
+/* Allocate zeroed 16 byte aligned memory, NULL if the arena is full */
+void * divquant_arena_alloc ( DivQuantArena *arena, size_t size );
+
 double
 get_double_scale(const uint32_t *inPixels,
                  const uint32_t numPixels);
 
-long timediff(clock_t t1, clock_t t2);
-
 void map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, uint32_t *outColortablePtr, int colormapSize );
 
 double *
@@ -69,7 +104,13 @@ calc_color_table ( const uint32_t *inPixels,
                   const uint32_t numRows,
                   const uint32_t numCols,
                   const int dec_factor,
-                  int *num_colors );
+                  int *num_colors,
+                  DivQuantArena *arena = NULL,
+                  const uchar num_bits = 8,
+                  const int num_threads = 1 );
+
+/* Scratch bytes needed by calc_color_table() for numPixels input pixels */
+size_t calc_color_table_arena_size ( const uint32_t numPixels );
 
 void
 cut_bits ( const uint32_t *inPixels,
@@ -79,7 +120,15 @@ cut_bits ( const uint32_t *inPixels,
           const uchar num_bits_green,
           const uchar num_bits_blue );
 
+/* Same as cut_bits() with the pixels as both the input and the output */
 void
+cut_bits_inplace ( uint32_t *pixels,
+                  const uint32_t numPixels,
+                  const uchar num_bits_red,
+                  const uchar num_bits_green,
+                  const uchar num_bits_blue );
+
+DivQuantStatus
 quant_varpart_fast (
                     const uint32_t numPixels,
                     const uint32_t *inPixels,
@@ -91,7 +140,19 @@ quant_varpart_fast (
                     const int num_bits,
                     const int dec_factor,
                     const int max_iters,
-                    const int allPixelsUnique);
+                    const int allPixelsUnique,
+                    const DivQuantOptions *options = NULL);
+
+void
+DivQuantClusterFloat(
+                     const int num_points,
+                     const uint32_t *data,
+                     const double data_weight,
+                     const double *weightsPtr,
+                     const int num_bits,
+                     const int max_iters,
+                     uint32_t *colortablePtr,
+                     uint32_t *numClustersPtr);
 
 int validate_num_bits ( const uchar );
 
@@ -0,0 +1,37 @@
+// Unique color histogram with a count for each color
+
+#include "DivQuantHistogram.h"
+
+using namespace std;
+
+void DivQuantHistogram::clear()
+{
+  colors.clear();
+  counts.clear();
+  colorToOffset.clear();
+  numPixels = 0;
+}
+
+void DivQuantHistogram::addPixel(uint32_t pixel)
+{
+  pixel &= 0x00FFFFFF;
+
+  auto it = colorToOffset.find(pixel);
+
+  if (it == colorToOffset.end()) {
+    colorToOffset[pixel] = (uint32_t) colors.size();
+    colors.push_back(pixel);
+    counts.push_back(1);
+  } else {
+    counts[it->second] += 1;
+  }
+
+  numPixels += 1;
+}
+
+void DivQuantHistogram::addPixels(const uint32_t *pixels, uint32_t n)
+{
+  for ( uint32_t i = 0; i < n; i++ ) {
+    addPixel(pixels[i]);
+  }
+}
@@ -0,0 +1,53 @@
+// A histogram of the unique RGB colors of a set of pixels with a count for
+// each color, the same unique colors and counts that calc_color_table()
+// generates. quant_recurse_seeded() refines its seed colortable over the
+// histogram colors weighted by their counts.
+
+#ifndef DivQuantHistogram_h
+#define DivQuantHistogram_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+#include <unordered_map>
+
+class DivQuantHistogram
+{
+public:
+  DivQuantHistogram() : numPixels(0) {}
+
+  void clear();
+
+  // Add a pixel, the alpha component is ignored
+
+  void addPixel(uint32_t pixel);
+
+  void addPixels(const uint32_t *pixels, uint32_t n);
+
+  uint32_t getNumColors() const {
+    return (uint32_t) colors.size();
+  }
+
+  uint32_t getNumPixels() const {
+    return numPixels;
+  }
+
+  // Unique colors in the histogram in the order they were first added
+
+  const uint32_t* getColors() const {
+    return colors.empty() ? NULL : &colors[0];
+  }
+
+  const uint32_t* getCounts() const {
+    return counts.empty() ? NULL : &counts[0];
+  }
+
+private:
+  std::vector<uint32_t> colors;
+  std::vector<uint32_t> counts;
+  std::unordered_map<uint32_t, uint32_t> colorToOffset;
+  uint32_t numPixels;
+};
+
+#endif // DivQuantHistogram_h
@@ -15,8 +15,16 @@
 
 #include "DivQuantHeader.h"
 
+#include "DivQuantProfile.h"
+
 #include <assert.h>
 
+#include <algorithm>
+#include <new>
+#include <thread>
+
+#include <opencv2/core/hal/intrin.hpp>
+
 #define L2_SQR( X1, Y1, Z1, X2, Y2, Z2 )\
 temp = ( X1 ) - ( X2 );\
 dist = temp * temp;\
@@ -52,32 +60,128 @@ check_mem ( const int x )
 
 /* dec_factor: decimation factor */
 
-#define HASH_SIZE 20023
+// The unique colors are found by sorting the 24 bit colors and counting the
+// runs of equal colors. An LSD radix sort does one pass per 8 bit channel,
+// and a pass is skipped when every color has the same value in the channel.
+// A large input run on one thread marks the colors in a presence bitmap of
+// all 2^24 colors instead, the rank of a color in the bitmap is then the
+// index of its weight. Either way the unique colors are output in ascending
+// order.
+
+#define COLOR_TABLE_RADIX_BITS ( 8 )
+#define COLOR_TABLE_RADIX_SIZE ( 1 << COLOR_TABLE_RADIX_BITS )
+#define COLOR_TABLE_RADIX_PASSES ( 3 )
+
+#define COLOR_TABLE_BITMAP_WORDS ( ( 1 << 24 ) / 64 )
+
+// Inputs with at least this many pixels use the bitmap when single threaded
+
+#define COLOR_TABLE_BITMAP_MIN_PIXELS ( 1 << 20 )
 
-/* TODO: No need for the bitmasking in HASH */
+#define COLOR_TABLE_MAX_THREADS ( 16 )
+#define COLOR_TABLE_MIN_PIXELS_PER_THREAD ( 65536 )
 
-#define HASH(R, G, B) ( ( ( ( long ) ( R ) * 33023 + \
-( long ) ( G ) * 30013 + \
-( long ) ( B ) * 27011 ) \
-& 0x7fffffff ) % HASH_SIZE )
+// Max number of unique colors for numPixels input pixels
+
+static inline
+uint32_t calc_color_table_max_colors ( const uint32_t numPixels )
+{
+  return ( numPixels < ( 1 << 24 ) ) ? numPixels : ( 1 << 24 );
+}
+
+size_t
+calc_color_table_arena_size ( const uint32_t numPixels )
+{
+  size_t maxColors = calc_color_table_max_colors ( numPixels );
+  
+  // Each arena allocation can be padded by up to 15 bytes
+  
+  size_t bytes = ( maxColors * sizeof ( double ) + 15 );
+  
+  if ( numPixels >= COLOR_TABLE_BITMAP_MIN_PIXELS )
+  {
+    // Presence bitmap and the rank of each bitmap word, the radix buffers
+    // are not allocated when the bitmap is used.
+    bytes += ( COLOR_TABLE_BITMAP_WORDS * sizeof ( uint64_t ) + 15 ) +
+             ( COLOR_TABLE_BITMAP_WORDS * sizeof ( uint32_t ) + 15 );
+  }
+  
+  // Radix sort buffer and the per thread counts for each pass
+  
+  size_t radixBytes = ( numPixels * sizeof ( uint32_t ) + 15 ) +
+                      ( COLOR_TABLE_MAX_THREADS * COLOR_TABLE_RADIX_PASSES * COLOR_TABLE_RADIX_SIZE * sizeof ( uint32_t ) + 15 );
+  
+  return bytes + radixBytes;
+}
 
-typedef struct Bucket_Entry* Bucket;
+template <typename T>
+static inline
+T* calc_color_table_alloc ( DivQuantArena *arena, size_t n )
+{
+  if ( arena != NULL )
+  {
+    return ( T * ) divquant_arena_alloc ( arena, n * sizeof ( T ) );
+  }
+  else
+  {
+    return new ( std::nothrow ) T[n]();
+  }
+}
 
-struct Bucket_Entry
+template <typename T>
+static inline
+void calc_color_table_free ( DivQuantArena *arena, T *ptr )
 {
-  int red;
-  int green;
-  int blue;
-  int value;
-  Bucket next;
-};
+  if ( arena == NULL )
+  {
+    delete [] ptr;
+  }
+}
 
-typedef Bucket* Hash_Table;
+// Run f(thread, start, end) over numThreads equal ranges of numKeys, the
+// calling thread runs the first range.
+
+template <typename F>
+static void
+calc_color_table_for_ranges ( const int numThreads, const uint32_t numKeys, F f )
+{
+  const uint32_t keysPerThread = ( numKeys + numThreads - 1 ) / numThreads;
+  
+  if ( numThreads <= 1 )
+  {
+    f ( 0, 0, numKeys );
+    return;
+  }
+  
+  std::vector<std::thread> threads;
+  threads.reserve ( numThreads - 1 );
+  
+  for ( int t = 1; t < numThreads; t++ )
+  {
+    uint32_t start = std::min ( numKeys, t * keysPerThread );
+    uint32_t end = std::min ( numKeys, start + keysPerThread );
+    threads.push_back ( std::thread ( f, t, start, end ) );
+  }
+  
+  f ( 0, 0, std::min ( numKeys, keysPerThread ) );
+  
+  for ( std::thread &t : threads )
+  {
+    t.join ( );
+  }
+}
 
 // This method will dedup unique pixels and subsample pixels
 // based on dec_factor. When dec_factor is 1 then this method
 // would not do anything if the input is already unique, use
-// unique_colors_as_doubles() in that case.
+// unique_colors_as_doubles() in that case. When num_bits is
+// less than 8 each component is shifted right the same way
+// cut_bits() does as the pixels are read. When arena is not
+// NULL all memory is allocated from the arena. The input is
+// split into num_threads ranges that are sorted at the same
+// time and the per range counts are merged after each pass.
+// Returns NULL when dec_factor or num_bits is invalid or an
+// allocation fails.
 
 double *
 calc_color_table ( const uint32_t *inPixels,
@@ -86,19 +190,13 @@ calc_color_table ( const uint32_t *inPixels,
                   const uint32_t numRows,
                   const uint32_t numCols,
                   const int dec_factor,
-                  int *num_colors )
+                  int *num_colors,
+                  DivQuantArena *arena,
+                  const uchar num_bits,
+                  const int num_threads )
 {
-  int ih;
-  int ir, ic;
-  int hash;
-  int index;
-  int red, green, blue;
   double norm_factor;
-  Bucket bucket;
-  Bucket temp_bucket;
-  Hash_Table hash_table;
   double *weights;
-  uint32_t pixel;
   
   if ( dec_factor <= 0 )
   {
@@ -107,98 +205,292 @@ calc_color_table ( const uint32_t *inPixels,
     return NULL;
   }
   
-  hash_table = ( Hash_Table ) malloc ( HASH_SIZE * sizeof ( Bucket ) );
-  check_mem ( hash_table == NULL );
+  if ( !validate_num_bits ( num_bits ) )
+  {
+    return NULL;
+  }
   
-  for ( ih = 0; ih < HASH_SIZE; ih++ )
+  if ( (uint64_t) numRows * numCols > numPixels )
   {
-    hash_table[ih] = NULL;
+    return NULL;
   }
   
+  // Sampled pixels, the same as cut_bits() when the shift is 0
+  
+  const uint32_t shift = 8 - num_bits;
+  const uint32_t byteMask = ( ( 0xFF >> shift ) << shift );
+  const uint32_t wordMask = ( byteMask << 16 ) | ( byteMask << 8 ) | byteMask;
+  
+  const uint32_t samplesPerRow = ( numCols + dec_factor - 1 ) / dec_factor;
+  const uint32_t samplesPerCol = ( numRows + dec_factor - 1 ) / dec_factor;
+  const uint32_t numKeys = samplesPerRow * samplesPerCol;
+  
   *num_colors = 0;
   
-  for ( ir = 0; ir < numRows; ir += dec_factor )
+  int numThreads = std::min ( num_threads, COLOR_TABLE_MAX_THREADS );
+  
+  if ( ( numKeys / COLOR_TABLE_MIN_PIXELS_PER_THREAD ) < (uint32_t) numThreads )
+  {
+    numThreads = numKeys / COLOR_TABLE_MIN_PIXELS_PER_THREAD;
+  }
+  
+  if ( numThreads < 1 )
+  {
+    numThreads = 1;
+  }
+  
+  // Reading in place is only safe when each key is written at or before the
+  // index it is read from by the same thread.
+  
+  const int gatherThreads = ( inPixels == outPixels && dec_factor != 1 ) ? 1 : numThreads;
+  
+  if ( numKeys == 0 )
+  {
+    return calc_color_table_alloc<double> ( arena, 1 );
+  }
+  
+  if ( numThreads == 1 && numKeys >= COLOR_TABLE_BITMAP_MIN_PIXELS )
   {
-    for ( ic = 0; ic < numCols; ic += dec_factor )
+    uint64_t *bitmap = calc_color_table_alloc<uint64_t> ( arena, COLOR_TABLE_BITMAP_WORDS );
+    uint32_t *wordRanks = calc_color_table_alloc<uint32_t> ( arena, COLOR_TABLE_BITMAP_WORDS );
+    
+    if ( bitmap == NULL || wordRanks == NULL )
     {
-      pixel = inPixels[ic + (ir * numRows)];
-      blue = pixel & 0xFF;
-      green = (pixel >> 8) & 0xFF;
-      red = (pixel >> 16) & 0xFF;
+      calc_color_table_free ( arena, bitmap );
+      calc_color_table_free ( arena, wordRanks );
+      return NULL;
+    }
+    
+    uint32_t ki = 0;
+    
+    for ( uint32_t ir = 0; ir < numRows; ir += dec_factor )
+    {
+      const uint32_t *rowPtr = inPixels + ( ir * numCols );
       
-      /* Determine the bucket */
-      hash = HASH ( red, green, blue );
+      for ( uint32_t ic = 0; ic < numCols; ic += dec_factor )
+      {
+        uint32_t key = ( ( rowPtr[ic] & wordMask ) >> shift ) & 0xFFFFFF;
+        bitmap[key >> 6] |= ( ( uint64_t ) 1 ) << ( key & 63 );
+        outPixels[ki++] = key;
+      }
+    }
+    
+    uint32_t rank = 0;
+    
+    for ( int wi = 0; wi < COLOR_TABLE_BITMAP_WORDS; wi++ )
+    {
+      wordRanks[wi] = rank;
+      rank += __builtin_popcountll ( bitmap[wi] );
+    }
+    
+    *num_colors = ( int ) rank;
+    
+    weights = calc_color_table_alloc<double> ( arena, rank );
+    
+    if ( weights == NULL )
+    {
+      calc_color_table_free ( arena, bitmap );
+      calc_color_table_free ( arena, wordRanks );
+      return NULL;
+    }
+    
+    for ( uint32_t i = 0; i < numKeys; i++ )
+    {
+      uint32_t key = outPixels[i];
+      uint64_t lowBits = bitmap[key >> 6] & ( ( ( ( uint64_t ) 1 ) << ( key & 63 ) ) - 1 );
+      weights[wordRanks[key >> 6] + __builtin_popcountll ( lowBits )] += 1.0;
+    }
+    
+    // Unique colors in ascending order
+    
+    uint32_t index = 0;
+    
+    for ( int wi = 0; wi < COLOR_TABLE_BITMAP_WORDS; wi++ )
+    {
+      uint64_t word = bitmap[wi];
       
-      /* Search for the color in the bucket chain */
-      for ( bucket = hash_table[hash]; bucket != NULL; bucket = bucket->next )
+      while ( word != 0 )
       {
-        if ( bucket->red == red && bucket->green == green && bucket->blue == blue )
+        outPixels[index++] = ( wi << 6 ) | __builtin_ctzll ( word );
+        word &= word - 1;
+      }
+    }
+    
+    calc_color_table_free ( arena, bitmap );
+    calc_color_table_free ( arena, wordRanks );
+  }
+  else
+  {
+    uint32_t *tmpKeys = calc_color_table_alloc<uint32_t> ( arena, numKeys );
+    uint32_t *counts = calc_color_table_alloc<uint32_t> ( arena, numThreads * COLOR_TABLE_RADIX_PASSES * COLOR_TABLE_RADIX_SIZE );
+    
+    if ( tmpKeys == NULL || counts == NULL )
+    {
+      calc_color_table_free ( arena, tmpKeys );
+      calc_color_table_free ( arena, counts );
+      return NULL;
+    }
+    
+    // Each thread reads the samples in its range and counts the value of
+    // each channel.
+    
+    calc_color_table_for_ranges ( gatherThreads, numKeys, [&] ( int t, uint32_t start, uint32_t end ) {
+      uint32_t *threadCounts = counts + ( t * COLOR_TABLE_RADIX_PASSES * COLOR_TABLE_RADIX_SIZE );
+      
+      for ( uint32_t ki = start; ki < end; ki++ )
+      {
+        const uint32_t ir = ( ki / samplesPerRow ) * dec_factor;
+        const uint32_t ic = ( ki % samplesPerRow ) * dec_factor;
+        uint32_t key = ( ( inPixels[ic + ( ir * numCols )] & wordMask ) >> shift ) & 0xFFFFFF;
+        outPixels[ki] = key;
+        threadCounts[key & 0xFF] += 1;
+        threadCounts[COLOR_TABLE_RADIX_SIZE + ( ( key >> 8 ) & 0xFF )] += 1;
+        threadCounts[( 2 * COLOR_TABLE_RADIX_SIZE ) + ( key >> 16 )] += 1;
+      }
+    } );
+    
+    // When the gather was not split the counts are redone per range
+    
+    if ( gatherThreads != numThreads )
+    {
+      memset ( counts, 0, numThreads * COLOR_TABLE_RADIX_PASSES * COLOR_TABLE_RADIX_SIZE * sizeof ( uint32_t ) );
+      
+      calc_color_table_for_ranges ( numThreads, numKeys, [&] ( int t, uint32_t start, uint32_t end ) {
+        uint32_t *threadCounts = counts + ( t * COLOR_TABLE_RADIX_PASSES * COLOR_TABLE_RADIX_SIZE );
+        
+        for ( uint32_t ki = start; ki < end; ki++ )
+        {
+          uint32_t key = outPixels[ki];
+          threadCounts[key & 0xFF] += 1;
+          threadCounts[COLOR_TABLE_RADIX_SIZE + ( ( key >> 8 ) & 0xFF )] += 1;
+          threadCounts[( 2 * COLOR_TABLE_RADIX_SIZE ) + ( key >> 16 )] += 1;
+        }
+      } );
+    }
+    
+    uint32_t *srcKeys = outPixels;
+    uint32_t *dstKeys = tmpKeys;
+    bool keysMoved = false;
+    
+    for ( int pass = 0; pass < COLOR_TABLE_RADIX_PASSES; pass++ )
+    {
+      const uint32_t passShift = pass * COLOR_TABLE_RADIX_BITS;
+      
+      // The total count of each value does not depend on the key order
+      
+      bool skipPass = false;
+      
+      for ( int b = 0; b < COLOR_TABLE_RADIX_SIZE && !skipPass; b++ )
+      {
+        uint32_t bucketCount = 0;
+        
+        for ( int t = 0; t < numThreads; t++ )
         {
-          /* This color exists in the hash table */
-          break;
+          bucketCount += counts[( t * COLOR_TABLE_RADIX_PASSES + pass ) * COLOR_TABLE_RADIX_SIZE + b];
         }
+        
+        skipPass = ( bucketCount == numKeys );
       }
       
-      if ( bucket != NULL )
+      if ( skipPass )
       {
-        /* This color exists in the hash table */
-        bucket->value++;
+        continue;
       }
-      else
+      
+      // Once a pass has moved the keys the counts of each range are redone
+      
+      if ( numThreads > 1 && keysMoved )
       {
-        (*num_colors)++;
-        
-        /* Create a new bucket entry for this color */
-        bucket = ( Bucket ) malloc ( sizeof ( struct Bucket_Entry ) );
-        check_mem ( bucket == NULL );
+        calc_color_table_for_ranges ( numThreads, numKeys, [&] ( int t, uint32_t start, uint32_t end ) {
+          uint32_t *threadCounts = counts + ( ( t * COLOR_TABLE_RADIX_PASSES + pass ) * COLOR_TABLE_RADIX_SIZE );
+          
+          memset ( threadCounts, 0, COLOR_TABLE_RADIX_SIZE * sizeof ( uint32_t ) );
+          
+          for ( uint32_t ki = start; ki < end; ki++ )
+          {
+            threadCounts[( srcKeys[ki] >> passShift ) & 0xFF] += 1;
+          }
+        } );
+      }
+      
+      // Merge the per thread counts into the offset each thread writes the
+      // keys with a given value at, so that the sort is stable.
+      
+      uint32_t offset = 0;
+      
+      for ( int b = 0; b < COLOR_TABLE_RADIX_SIZE; b++ )
+      {
+        for ( int t = 0; t < numThreads; t++ )
+        {
+          uint32_t *countPtr = &counts[( t * COLOR_TABLE_RADIX_PASSES + pass ) * COLOR_TABLE_RADIX_SIZE + b];
+          uint32_t count = *countPtr;
+          *countPtr = offset;
+          offset += count;
+        }
+      }
+      
+      calc_color_table_for_ranges ( numThreads, numKeys, [&] ( int t, uint32_t start, uint32_t end ) {
+        uint32_t *offsets = counts + ( ( t * COLOR_TABLE_RADIX_PASSES + pass ) * COLOR_TABLE_RADIX_SIZE );
         
-        bucket->red = red;
-        bucket->green = green;
-        bucket->blue = blue;
-        bucket->value = 1;
-        bucket->next = hash_table[hash];
-        hash_table[hash] = bucket;
+        for ( uint32_t ki = start; ki < end; ki++ )
+        {
+          uint32_t key = srcKeys[ki];
+          dstKeys[offsets[( key >> passShift ) & 0xFF]++] = key;
+        }
+      } );
+      
+      std::swap ( srcKeys, dstKeys );
+      keysMoved = true;
+    }
+    
+    // Count the runs of equal keys, the colors go to outPixels and the counts
+    // to tmpKeys. Both are written at or before the index of the run start,
+    // so either one can also hold the sorted keys.
+    
+    uint32_t index = 0;
+    uint32_t runStart = 0;
+    
+    for ( uint32_t ki = 1; ki <= numKeys; ki++ )
+    {
+      if ( ki == numKeys || srcKeys[ki] != srcKeys[runStart] )
+      {
+        uint32_t color = srcKeys[runStart];
+        outPixels[index] = color;
+        tmpKeys[index] = ki - runStart;
+        index++;
+        runStart = ki;
       }
     }
+    
+    *num_colors = ( int ) index;
+    
+    weights = calc_color_table_alloc<double> ( arena, index );
+    
+    if ( weights == NULL )
+    {
+      calc_color_table_free ( arena, tmpKeys );
+      calc_color_table_free ( arena, counts );
+      return NULL;
+    }
+    
+    for ( uint32_t i = 0; i < index; i++ )
+    {
+      weights[i] = tmpKeys[i];
+    }
+    
+    calc_color_table_free ( arena, tmpKeys );
+    calc_color_table_free ( arena, counts );
   }
   
-  // printf ( "# colors = %d\n", num_colors );
-  
-  weights = new double[*num_colors];
-  check_mem ( weights == NULL );
-  
   /* Normalization factor to obtain color frequencies to color probabilities */
   /* norm_factor = ( dec_factor * dec_factor ) / ( double ) num_pixels; */
   norm_factor =  1.0 / ( ceil ( numRows / ( double ) dec_factor ) * ceil ( numCols / ( double ) dec_factor ) );
   
-  index = 0;
-  for ( hash = 0; hash < HASH_SIZE; hash++ )
+  for ( int i = 0; i < *num_colors; i++ )
   {
-    for ( bucket = hash_table[hash]; bucket != NULL; )
-    {
-      uint32_t B = bucket->blue;
-      uint32_t G = bucket->green;
-      uint32_t R = bucket->red;
-      uint32_t pixel = (R << 16) | (G << 8) | B;
-      outPixels[index] = pixel;
-      
-      weights[index] = norm_factor * bucket->value;
-      
-      index++;
-      
-      // Save the current bucket pointer
-      temp_bucket = bucket;
-      
-      // Advance to the next bucket
-      bucket = bucket->next;
-      
-      // Free the current bucket
-      free ( temp_bucket );
-    }
+    weights[i] *= norm_factor;
   }
   
-  free ( hash_table );
-  
   return weights;
 }
 
@@ -237,6 +529,120 @@ sort_color ( Pixel_Int *cmap, const int num_colors )
   }
 }
 
+// Palettes with at most this many entries are mapped with a brute force
+// search that compares each pixel to every palette entry. For a palette
+// this small the vectorized compare is faster than the MPS search.
+
+#define MPS_BRUTE_FORCE_MAX_COLORS ( 32 )
+
+// Brute force nearest palette entry search, when two entries are the same
+// distance from a pixel the entry with the lower palette offset is used.
+// The SIMD path packs R and G as an int16 pair and B as an int16 with a
+// zero pair in each 32 bit lane, so that a pair of multiply adds generate
+// the squared distance for 4 pixels in int32 lanes.
+
+static void
+map_colors_brute_force ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr, const uint32_t *colortablePtr, int num_colors )
+{
+  int rgTable[MPS_BRUTE_FORCE_MAX_COLORS];
+  int bTable[MPS_BRUTE_FORCE_MAX_COLORS];
+  int redTable[MPS_BRUTE_FORCE_MAX_COLORS];
+  int greenTable[MPS_BRUTE_FORCE_MAX_COLORS];
+  uint32_t outTable[MPS_BRUTE_FORCE_MAX_COLORS];
+  
+  assert(num_colors > 0 && num_colors <= MPS_BRUTE_FORCE_MAX_COLORS);
+  
+  for ( int ic = 0; ic < num_colors; ic++ ) {
+    uint32_t pixel = colortablePtr[ic];
+    int blue = pixel & 0xFF;
+    int green = (pixel >> 8) & 0xFF;
+    int red = (pixel >> 16) & 0xFF;
+    redTable[ic] = red;
+    greenTable[ic] = green;
+    rgTable[ic] = red | (green << 16);
+    bTable[ic] = blue;
+    outTable[ic] = pixel & 0x00FFFFFF;
+  }
+  
+  uint32_t ik = 0;
+  
+#if CV_SIMD128
+  const cv::v_uint32x4 mask8 = cv::v_setall_u32(0xFF);
+  
+  for ( ; ik + 8 <= numPixels; ik += 8 )
+  {
+    cv::v_uint32x4 p0 = cv::v_load(inPixelsPtr + ik);
+    cv::v_uint32x4 p1 = cv::v_load(inPixelsPtr + ik + 4);
+    
+    cv::v_int16x8 rg0 = cv::v_reinterpret_as_s16(((p0 >> 16) & mask8) | (((p0 >> 8) & mask8) << 16));
+    cv::v_int16x8 rg1 = cv::v_reinterpret_as_s16(((p1 >> 16) & mask8) | (((p1 >> 8) & mask8) << 16));
+    cv::v_int16x8 b0 = cv::v_reinterpret_as_s16(p0 & mask8);
+    cv::v_int16x8 b1 = cv::v_reinterpret_as_s16(p1 & mask8);
+    
+    cv::v_int32x4 best0 = cv::v_setall_s32(INT_MAX);
+    cv::v_int32x4 best1 = best0;
+    cv::v_int32x4 index0 = cv::v_setall_s32(0);
+    cv::v_int32x4 index1 = index0;
+    
+    for ( int ic = 0; ic < num_colors; ic++ )
+    {
+      cv::v_int16x8 cmapRG = cv::v_reinterpret_as_s16(cv::v_setall_s32(rgTable[ic]));
+      cv::v_int16x8 cmapB = cv::v_reinterpret_as_s16(cv::v_setall_s32(bTable[ic]));
+      cv::v_int32x4 vic = cv::v_setall_s32(ic);
+      
+      cv::v_int16x8 drg0 = rg0 - cmapRG;
+      cv::v_int16x8 db0 = b0 - cmapB;
+      cv::v_int32x4 dist0 = cv::v_dotprod(drg0, drg0) + cv::v_dotprod(db0, db0);
+      
+      cv::v_int16x8 drg1 = rg1 - cmapRG;
+      cv::v_int16x8 db1 = b1 - cmapB;
+      cv::v_int32x4 dist1 = cv::v_dotprod(drg1, drg1) + cv::v_dotprod(db1, db1);
+      
+      cv::v_int32x4 closer0 = dist0 < best0;
+      cv::v_int32x4 closer1 = dist1 < best1;
+      
+      best0 = cv::v_select(closer0, dist0, best0);
+      best1 = cv::v_select(closer1, dist1, best1);
+      index0 = cv::v_select(closer0, vic, index0);
+      index1 = cv::v_select(closer1, vic, index1);
+    }
+    
+    int indexes[8];
+    cv::v_store(indexes, index0);
+    cv::v_store(indexes + 4, index1);
+    
+    for ( int i = 0; i < 8; i++ ) {
+      outPixelsPtr[ik + i] = outTable[indexes[i]];
+    }
+  }
+#endif // CV_SIMD128
+  
+  for ( ; ik < numPixels; ik++ )
+  {
+    uint32_t pixel = inPixelsPtr[ik];
+    int blue = pixel & 0xFF;
+    int green = (pixel >> 8) & 0xFF;
+    int red = (pixel >> 16) & 0xFF;
+    
+    int index = 0;
+    int min_dist = L2_sqr_int ( red, green, blue, redTable[0], greenTable[0], bTable[0] );
+    
+    for ( int ic = 1; ic < num_colors; ic++ )
+    {
+      int dist = L2_sqr_int ( red, green, blue, redTable[ic], greenTable[ic], bTable[ic] );
+      if ( dist < min_dist )
+      {
+        min_dist = dist;
+        index = ic;
+      }
+    }
+    
+    outPixelsPtr[ik] = outTable[index];
+  }
+  
+  return;
+}
+
 //#define SEARCH_DEBUG
 //#define SEARCH_DEBUG_SORT
 
@@ -263,6 +669,14 @@ map_colors_mps ( const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outP
   int num_colors = colormapSize;
   assert(num_colors > 0);
   
+  DivQuantScopedTimer timer("map_colors_mps");
+  divquant_profile_count("map_colors_mps.pixels", numPixels);
+  
+  if (num_colors <= MPS_BRUTE_FORCE_MAX_COLORS) {
+    map_colors_brute_force ( inPixelsPtr, numPixels, outPixelsPtr, outColortablePtr, num_colors );
+    return;
+  }
+  
   lut_init = ( int * ) malloc ( size_lut_init * sizeof ( int ) );
   check_mem ( lut_init == NULL );
   
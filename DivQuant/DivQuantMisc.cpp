@@ -15,24 +15,6 @@
 
 #include "DivQuantHeader.h"
 
-clock_t
-start_timer ( void )
-{
-  return clock();
-}
-
-double
-stop_timer ( const clock_t start_time )
-{
-  return ( ( double ) ( clock (  ) - start_time ) ) / CLOCKS_PER_SEC;
-}
-
-long timediff(clock_t t1, clock_t t2) {
-  long elapsed;
-  elapsed = ((double)t2 - t1) / CLOCKS_PER_SEC * 1000;
-  return elapsed;
-}
-
 int
 validate_num_bits ( const uchar num_bits )
 {
@@ -44,3 +26,30 @@ validate_num_bits ( const uchar num_bits )
   
   return 1;
 }
+
+void
+divquant_arena_init ( DivQuantArena *arena, void *buffer, size_t size )
+{
+  arena->buffer = ( uint8_t * ) buffer;
+  arena->size = size;
+  arena->used = 0;
+}
+
+void *
+divquant_arena_alloc ( DivQuantArena *arena, size_t size )
+{
+  uintptr_t addr = ( uintptr_t ) ( arena->buffer + arena->used );
+  size_t pad = ( size_t ) ( ( 16 - ( addr & 15 ) ) & 15 );
+  
+  if ( arena->used + pad + size > arena->size )
+  {
+    return NULL;
+  }
+  
+  uint8_t *ptr = arena->buffer + arena->used + pad;
+  arena->used += pad + size;
+  
+  memset ( ptr, 0, size );
+  
+  return ptr;
+}
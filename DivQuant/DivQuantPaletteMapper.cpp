@@ -0,0 +1,235 @@
+// Nearest palette color mapping with a cached inverse color map
+
+#include "DivQuantPaletteMapper.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "assert.h"
+
+using namespace std;
+
+// Each axis of the inverse color map is divided into 32 cells of 8 values
+
+#define GRID_BITS ( 5 )
+#define GRID_DIM ( 1 << GRID_BITS )
+#define GRID_CELL_SHIFT ( 8 - GRID_BITS )
+#define GRID_CELL_SIZE ( 1 << GRID_CELL_SHIFT )
+
+static inline
+int L2_sqr_int ( const int x1, const int y1, const int z1,
+                 const int x2, const int y2, const int z2 )
+{
+  int dr = x1 - x2;
+  int dg = y1 - y2;
+  int db = z1 - z2;
+  return dr * dr + dg * dg + db * db;
+}
+
+DivQuantPaletteMapper::DivQuantPaletteMapper(const uint32_t *colortable, int colormapSize)
+{
+  assert(colormapSize > 0);
+  assert(colormapSize <= 0xFFFF);
+
+  colors.resize(colormapSize);
+  reds.resize(colormapSize);
+  greens.resize(colormapSize);
+  blues.resize(colormapSize);
+
+  for ( int i = 0; i < colormapSize; i++ ) {
+    uint32_t pixel = colortable[i] & 0x00FFFFFF;
+    colors[i] = pixel;
+    blues[i] = pixel & 0xFF;
+    greens[i] = (pixel >> 8) & 0xFF;
+    reds[i] = (pixel >> 16) & 0xFF;
+  }
+
+  buildGrid();
+}
+
+// For each cell of the inverse color map find the smallest distance bound
+// such that every color in the cell has a palette entry at least that close,
+// then any palette entry that could be nearer than that bound to some color
+// in the cell is a candidate. Per axis squared distances are tabulated for
+// each palette entry so that each cell and entry pair is just a few adds.
+
+void DivQuantPaletteMapper::buildGrid()
+{
+  const int numColors = (int) colors.size();
+
+  vector<int> minDist[3];
+  vector<int> maxDist[3];
+
+  for ( int axis = 0; axis < 3; axis++ ) {
+    const vector<int> &vals = (axis == 0) ? reds : ((axis == 1) ? greens : blues);
+
+    minDist[axis].resize(numColors * GRID_DIM);
+    maxDist[axis].resize(numColors * GRID_DIM);
+
+    for ( int i = 0; i < numColors; i++ ) {
+      int v = vals[i];
+
+      for ( int c = 0; c < GRID_DIM; c++ ) {
+        int lo = c << GRID_CELL_SHIFT;
+        int hi = lo + GRID_CELL_SIZE - 1;
+
+        int dmin = (v < lo) ? (lo - v) : ((v > hi) ? (v - hi) : 0);
+        int dmax = max(abs(v - lo), abs(v - hi));
+
+        minDist[axis][i * GRID_DIM + c] = dmin * dmin;
+        maxDist[axis][i * GRID_DIM + c] = dmax * dmax;
+      }
+    }
+  }
+
+  gridOffsets.resize(GRID_DIM * GRID_DIM * GRID_DIM + 1);
+  gridCandidates.clear();
+  gridCandidates.reserve(GRID_DIM * GRID_DIM * GRID_DIM * 2);
+
+  int cell = 0;
+
+  for ( int cr = 0; cr < GRID_DIM; cr++ ) {
+    for ( int cg = 0; cg < GRID_DIM; cg++ ) {
+      for ( int cb = 0; cb < GRID_DIM; cb++ ) {
+        int bound = INT_MAX;
+
+        for ( int i = 0; i < numColors; i++ ) {
+          int d = maxDist[0][i * GRID_DIM + cr] + maxDist[1][i * GRID_DIM + cg] + maxDist[2][i * GRID_DIM + cb];
+          if (d < bound) {
+            bound = d;
+          }
+        }
+
+        gridOffsets[cell++] = (uint32_t) gridCandidates.size();
+
+        // Candidates are stored in palette order so that the lowest offset wins a tie
+
+        for ( int i = 0; i < numColors; i++ ) {
+          int d = minDist[0][i * GRID_DIM + cr] + minDist[1][i * GRID_DIM + cg] + minDist[2][i * GRID_DIM + cb];
+          if (d <= bound) {
+            gridCandidates.push_back((uint16_t) i);
+          }
+        }
+      }
+    }
+  }
+
+  gridOffsets[cell] = (uint32_t) gridCandidates.size();
+}
+
+int DivQuantPaletteMapper::lookupGrid(int R, int G, int B) const
+{
+  int cell = ((R >> GRID_CELL_SHIFT) << (2 * GRID_BITS)) | ((G >> GRID_CELL_SHIFT) << GRID_BITS) | (B >> GRID_CELL_SHIFT);
+
+  uint32_t start = gridOffsets[cell];
+  uint32_t end = gridOffsets[cell+1];
+
+#if defined(DEBUG)
+  assert(end > start);
+#endif // DEBUG
+
+  int bestOffset = gridCandidates[start];
+
+  if ((end - start) == 1) {
+    return bestOffset;
+  }
+
+  int bestDist = L2_sqr_int(R, G, B, reds[bestOffset], greens[bestOffset], blues[bestOffset]);
+
+  for ( uint32_t ci = start + 1; ci < end; ci++ ) {
+    int offset = gridCandidates[ci];
+    int dist = L2_sqr_int(R, G, B, reds[offset], greens[offset], blues[offset]);
+    if (dist < bestDist) {
+      bestDist = dist;
+      bestOffset = offset;
+    }
+  }
+
+  return bestOffset;
+}
+
+int DivQuantPaletteMapper::lookupIndex(uint32_t pixel) const
+{
+  int B = pixel & 0xFF;
+  int G = (pixel >> 8) & 0xFF;
+  int R = (pixel >> 16) & 0xFF;
+
+  return lookupGrid(R, G, B);
+}
+
+void DivQuantPaletteMapper::mapIndexes(const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outIndexesPtr) const
+{
+  for ( uint32_t i = 0; i < numPixels; i++ ) {
+    outIndexesPtr[i] = (uint32_t) lookupIndex(inPixelsPtr[i]);
+  }
+}
+
+void DivQuantPaletteMapper::mapColors(const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr) const
+{
+  // Runs of the same input pixel are common, so reuse the last result
+
+  uint32_t lastIn = 0;
+  uint32_t lastOut = 0;
+  bool hasLast = false;
+
+  for ( uint32_t i = 0; i < numPixels; i++ ) {
+    uint32_t pixel = inPixelsPtr[i] & 0x00FFFFFF;
+
+    if (!hasLast || pixel != lastIn) {
+      lastIn = pixel;
+      lastOut = colors[lookupIndex(pixel)];
+      hasLast = true;
+    }
+
+    outPixelsPtr[i] = lastOut;
+  }
+}
+
+// Most recently used palettes are kept at the front of the cache
+
+std::shared_ptr<const DivQuantPaletteMapper>
+DivQuantPaletteMapper::getShared(const uint32_t *colortable, int colormapSize)
+{
+  typedef pair<vector<uint32_t>, shared_ptr<const DivQuantPaletteMapper> > CacheEntry;
+
+  static mutex cacheMutex;
+  static vector<CacheEntry> cache;
+
+  vector<uint32_t> key(colormapSize);
+  for ( int i = 0; i < colormapSize; i++ ) {
+    key[i] = colortable[i] & 0x00FFFFFF;
+  }
+
+  {
+    lock_guard<mutex> lock(cacheMutex);
+
+    for ( size_t i = 0; i < cache.size(); i++ ) {
+      if (cache[i].first == key) {
+        CacheEntry entry = cache[i];
+        cache.erase(cache.begin() + i);
+        cache.insert(cache.begin(), entry);
+        return entry.second;
+      }
+    }
+  }
+
+  // Build outside the lock, in the rare case that two threads build the
+  // same palette at the same time both results are valid.
+
+  shared_ptr<const DivQuantPaletteMapper> mapper(new DivQuantPaletteMapper(colortable, colormapSize));
+
+  {
+    lock_guard<mutex> lock(cacheMutex);
+
+    cache.insert(cache.begin(), CacheEntry(key, mapper));
+
+    if (cache.size() > DIVQUANT_MAPPER_CACHE_SIZE) {
+      cache.pop_back();
+    }
+  }
+
+  return mapper;
+}
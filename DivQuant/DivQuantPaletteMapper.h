@@ -0,0 +1,77 @@
+// Nearest color mapping of pixels to a fixed palette. For the same palette
+// and input this produces the closest palette entry just like
+// map_colors_mps(), but the search structure is built once in the
+// constructor and the mapper can then be used to map any number of pixels.
+// The palette is mapped with a 32x32x32 inverse color map where each cell
+// holds the palette entries that can be nearest to a color in that cell, so
+// that most pixels resolve with a single table lookup and the rest compare
+// against a few candidates. When two palette entries are the same distance
+// from a pixel, the entry with the lower palette offset is returned.
+//
+// A mapper is immutable once constructed so the map methods can be invoked
+// from multiple threads at the same time. getShared() returns a mapper from
+// a small process wide cache keyed by the palette contents, so that repeated
+// calls with the same palette do not rebuild the search structure.
+
+#ifndef DivQuantPaletteMapper_h
+#define DivQuantPaletteMapper_h
+
+#include <stdint.h>
+
+#include <vector>
+#include <memory>
+
+// Number of palettes held in the getShared() cache
+
+#define DIVQUANT_MAPPER_CACHE_SIZE ( 8 )
+
+class DivQuantPaletteMapper
+{
+public:
+  // The alpha component of the colortable entries is ignored
+
+  DivQuantPaletteMapper(const uint32_t *colortable, int colormapSize);
+
+  static std::shared_ptr<const DivQuantPaletteMapper> getShared(const uint32_t *colortable, int colormapSize);
+
+  int getNumColors() const {
+    return (int) colors.size();
+  }
+
+  // Palette entry as a RGB pixel without alpha
+
+  uint32_t getColor(int offset) const {
+    return colors[offset];
+  }
+
+  // Offset of the palette entry nearest to pixel
+
+  int lookupIndex(uint32_t pixel) const;
+
+  // Write the offset of the nearest palette entry for each pixel
+
+  void mapIndexes(const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outIndexesPtr) const;
+
+  // Write the nearest palette entry for each pixel, the output is the same
+  // RGB format without alpha that map_colors_mps() writes.
+
+  void mapColors(const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr) const;
+
+private:
+  void buildGrid();
+
+  int lookupGrid(int R, int G, int B) const;
+
+  std::vector<uint32_t> colors;
+  std::vector<int> reds;
+  std::vector<int> greens;
+  std::vector<int> blues;
+
+  // Inverse color map, the candidates for cell i are
+  // gridCandidates[gridOffsets[i]] to gridCandidates[gridOffsets[i+1]-1]
+
+  std::vector<uint32_t> gridOffsets;
+  std::vector<uint16_t> gridCandidates;
+};
+
+#endif // DivQuantPaletteMapper_h
@@ -0,0 +1,205 @@
+// Per thread registry of named timers and counters
+
+#include "DivQuantProfile.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+typedef struct {
+  uint64_t calls;
+  uint64_t nanos;
+} DivQuantProfileTimer;
+
+typedef struct {
+  int threadNum;
+  map<string, DivQuantProfileTimer> timers;
+  map<string, uint64_t> counters;
+} DivQuantProfileThread;
+
+static atomic<bool> profileEnabled(false);
+static once_flag profileInitFlag;
+
+static mutex profileMutex;
+static unordered_map<thread::id, DivQuantProfileThread> profileThreads;
+
+static string profileOutputPath;
+
+static void divquant_profile_write_at_exit ( void )
+{
+  FILE *fp = fopen(profileOutputPath.c_str(), "w");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not write DivQuant profile to \"%s\"\n", profileOutputPath.c_str());
+    return;
+  }
+
+  divquant_profile_dump_json(fp);
+  fclose(fp);
+}
+
+// Check the environment once, the first time any profile method is invoked
+
+static void divquant_profile_init ( void )
+{
+  const char *path = getenv("DIVQUANT_PROFILE");
+
+  if (path != NULL && *path != '\0') {
+    profileOutputPath = path;
+    profileEnabled = true;
+    atexit(divquant_profile_write_at_exit);
+  }
+}
+
+void divquant_profile_enable ( bool enable )
+{
+  call_once(profileInitFlag, divquant_profile_init);
+  profileEnabled = enable;
+}
+
+bool divquant_profile_is_enabled ( void )
+{
+  call_once(profileInitFlag, divquant_profile_init);
+  return profileEnabled;
+}
+
+// Must be invoked with profileMutex held
+
+static DivQuantProfileThread & divquant_profile_this_thread ( void )
+{
+  thread::id tid = this_thread::get_id();
+
+  auto it = profileThreads.find(tid);
+
+  if (it == profileThreads.end()) {
+    DivQuantProfileThread &pt = profileThreads[tid];
+    pt.threadNum = (int) profileThreads.size() - 1;
+    return pt;
+  }
+
+  return it->second;
+}
+
+void divquant_profile_add_time ( const char *name, uint64_t nanos )
+{
+  if (!divquant_profile_is_enabled()) {
+    return;
+  }
+
+  lock_guard<mutex> lock(profileMutex);
+
+  DivQuantProfileTimer &timer = divquant_profile_this_thread().timers[name];
+  timer.calls += 1;
+  timer.nanos += nanos;
+}
+
+void divquant_profile_count ( const char *name, uint64_t count )
+{
+  if (!divquant_profile_is_enabled()) {
+    return;
+  }
+
+  lock_guard<mutex> lock(profileMutex);
+
+  divquant_profile_this_thread().counters[name] += count;
+}
+
+void divquant_profile_reset ( void )
+{
+  lock_guard<mutex> lock(profileMutex);
+
+  profileThreads.clear();
+}
+
+static void divquant_profile_write_json_string ( FILE *fp, const string &str )
+{
+  fputc('"', fp);
+  for ( char c : str ) {
+    if (c == '"' || c == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+static void divquant_profile_write_json_section ( FILE *fp, const char *indent,
+                                                  const map<string, DivQuantProfileTimer> &timers,
+                                                  const map<string, uint64_t> &counters )
+{
+  fprintf(fp, "%s\"timers\": {", indent);
+
+  const char *sep = "\n";
+  for ( auto &pair : timers ) {
+    fprintf(fp, "%s%s  ", sep, indent);
+    divquant_profile_write_json_string(fp, pair.first);
+    fprintf(fp, ": { \"calls\": %llu, \"ms\": %.3f }", (unsigned long long) pair.second.calls, pair.second.nanos / 1.0e6);
+    sep = ",\n";
+  }
+
+  if (!timers.empty()) {
+    fprintf(fp, "\n%s", indent);
+  }
+
+  fprintf(fp, "},\n%s\"counters\": {", indent);
+
+  sep = "\n";
+  for ( auto &pair : counters ) {
+    fprintf(fp, "%s%s  ", sep, indent);
+    divquant_profile_write_json_string(fp, pair.first);
+    fprintf(fp, ": %llu", (unsigned long long) pair.second);
+    sep = ",\n";
+  }
+
+  if (!counters.empty()) {
+    fprintf(fp, "\n%s", indent);
+  }
+
+  fprintf(fp, "}");
+}
+
+void divquant_profile_dump_json ( FILE *fp )
+{
+  lock_guard<mutex> lock(profileMutex);
+
+  // Order the threads by when each first recorded a result
+
+  vector<const DivQuantProfileThread*> threads(profileThreads.size());
+  for ( auto &pair : profileThreads ) {
+    threads[pair.second.threadNum] = &pair.second;
+  }
+
+  map<string, DivQuantProfileTimer> totalTimers;
+  map<string, uint64_t> totalCounters;
+
+  fprintf(fp, "{\n  \"threads\": [");
+
+  for ( size_t i = 0; i < threads.size(); i++ ) {
+    const DivQuantProfileThread *pt = threads[i];
+
+    fprintf(fp, "%s\n    {\n      \"thread\": %d,\n", (i == 0) ? "" : ",", pt->threadNum);
+    divquant_profile_write_json_section(fp, "      ", pt->timers, pt->counters);
+    fprintf(fp, "\n    }");
+
+    for ( auto &pair : pt->timers ) {
+      DivQuantProfileTimer &total = totalTimers[pair.first];
+      total.calls += pair.second.calls;
+      total.nanos += pair.second.nanos;
+    }
+    for ( auto &pair : pt->counters ) {
+      totalCounters[pair.first] += pair.second;
+    }
+  }
+
+  fprintf(fp, "%s],\n  \"totals\": {\n", threads.empty() ? "" : "\n  ");
+  divquant_profile_write_json_section(fp, "    ", totalTimers, totalCounters);
+  fprintf(fp, "\n  }\n}\n");
+}
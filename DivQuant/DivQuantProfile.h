@@ -0,0 +1,63 @@
+// Lightweight profiling of the DivQuant phases. A scoped timer measures the
+// wall time between construction and destruction with a monotonic clock and
+// adds it to a named timer, counters are named sums. Both are accumulated
+// per thread so that results stay meaningful when quant calls run on
+// multiple threads. Profiling is disabled by default, it is enabled by
+// calling divquant_profile_enable() or by setting the DIVQUANT_PROFILE
+// environment variable to a file path. With the environment variable the
+// results are written to that path as JSON when the process exits.
+
+#ifndef DivQuantProfile_h
+#define DivQuantProfile_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+
+void divquant_profile_enable ( bool enable );
+
+bool divquant_profile_is_enabled ( void );
+
+// Add nanos to the named timer and increment the number of calls
+
+void divquant_profile_add_time ( const char *name, uint64_t nanos );
+
+// Add count to the named counter
+
+void divquant_profile_count ( const char *name, uint64_t count );
+
+// Discard all timers and counters
+
+void divquant_profile_reset ( void );
+
+// Write the timers and counters for each thread and the totals as JSON
+
+void divquant_profile_dump_json ( FILE *fp );
+
+class DivQuantScopedTimer
+{
+public:
+  explicit DivQuantScopedTimer(const char *name)
+  : name(name), start(std::chrono::steady_clock::now()) {}
+
+  ~DivQuantScopedTimer() {
+    if (divquant_profile_is_enabled()) {
+      std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+      divquant_profile_add_time(name, (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+  }
+
+  // Milliseconds since the timer was created
+
+  double elapsedMillis() const {
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+  }
+
+private:
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+};
+
+#endif // DivQuantProfile_h
@@ -11,10 +11,114 @@
 
 #include "quant_util.h"
 
+#include "DivQuantHistogram.h"
+#include "DivQuantProfile.h"
+
+#include <algorithm>
+#include <atomic>
 #include <unordered_map>
+#include <thread>
 
 using namespace std;
 
+static thread_local int quantNumThreads = 0;
+
+static atomic<int> quantMaxIters(10);
+static atomic<int> quantDecFactor(1);
+static atomic<int> quantNumBits(8);
+
+static atomic<QuantParallelForFunc> quantParallelFor(NULL);
+
+void quant_set_params ( int maxIters, int decFactor, int numBits )
+{
+  quantMaxIters = (maxIters < 0) ? 0 : maxIters;
+  quantDecFactor = (decFactor < 1) ? 1 : decFactor;
+  quantNumBits = (numBits < 1 || numBits > 8) ? 8 : numBits;
+}
+
+void quant_get_params ( int *maxItersPtr, int *decFactorPtr, int *numBitsPtr )
+{
+  *maxItersPtr = quantMaxIters;
+  *decFactorPtr = quantDecFactor;
+  *numBitsPtr = quantNumBits;
+}
+
+void quant_set_num_threads ( int numThreads )
+{
+  quantNumThreads = (numThreads < 0) ? 0 : numThreads;
+}
+
+int quant_get_num_threads ( void )
+{
+  if (quantNumThreads > 0) {
+    return quantNumThreads;
+  }
+  
+  int numThreads = (int) thread::hardware_concurrency();
+  return (numThreads < 1) ? 1 : numThreads;
+}
+
+void quant_set_parallel_for ( QuantParallelForFunc parallelForFunc )
+{
+  quantParallelFor = parallelForFunc;
+}
+
+QuantParallelForFunc quant_get_parallel_for ( void )
+{
+  return quantParallelFor;
+}
+
+// Options used for each quant_recurse() call
+
+static void quant_default_options ( DivQuantOptions *options )
+{
+  memset(options, 0, sizeof(DivQuantOptions));
+  
+  // Local kmeans iterations over large clusters are split across threads
+  options->num_threads = quant_get_num_threads();
+  
+  // Set to 1 to cluster with the float32 structure of arrays data path
+  options->float_soa = 0;
+  
+  // Scratch buffers are allocated on the heap
+  options->arena = NULL;
+}
+
+// Dedup cmap in case of repeated values that resolve to same RGB entry,
+// returns true if the colortable was modified.
+
+static bool quant_dedup_colortable ( uint32_t *numClustersPtr, uint32_t *outColortablePtr )
+{
+  int act_num_colors = *numClustersPtr;
+  
+  unordered_map<uint32_t, uint32_t> seen;
+  vector<uint32_t> dedupOrder;
+  dedupOrder.reserve(act_num_colors);
+
+  for ( int i = 0; i < act_num_colors; i++) {
+    uint32_t pixel = outColortablePtr[i];
+    if (seen.count(pixel) > 0) {
+      continue;
+    }
+    seen[pixel] = i;
+    dedupOrder.push_back(pixel);
+  }
+  
+  if ((int)dedupOrder.size() == act_num_colors) {
+    return false;
+  }
+  
+  act_num_colors = (int)dedupOrder.size();
+  *numClustersPtr = act_num_colors;
+  
+  for ( int i = 0; i < act_num_colors; i++) {
+    uint32_t pixel = dedupOrder[i];
+    outColortablePtr[i] = pixel;
+  }
+  
+  return true;
+}
+
 // Each cluster is represented by an exact floating point cluster center and the variance.
 
 void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique )
@@ -23,17 +127,19 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
   
   const bool dumpDedupCmap = false;
   
-  clock_t t1, t2;
-  long elapsed;
+  DivQuantScopedTimer totalTimer("quant_recurse");
+  divquant_profile_count("quant_recurse.pixels", numPixels);
   
   //int num_colors = 256;
   
-  int max_iters = 10;
-  //int max_iters = 5;
-  //int max_iters = 0; // no local kmeans
+  // See quant_set_params(), a dec_factor of 1 means no decimation. Note that
+  // width = numPixels and height = 1 is passed with uni quant disabled.
   
-  int dec_factor = 1; // 1.0 means no decimation
-  int num_bits = 8; // note that width = numPixels and height = 1 is passed with uni quant disabled
+  int max_iters, dec_factor, num_bits;
+  quant_get_params(&max_iters, &dec_factor, &num_bits);
+  
+  DivQuantOptions options;
+  quant_default_options(&options);
   
   //  int dec_factor = 1; // 1.0 means no decimation
   //  int num_bits = 7; // note that width = numPixels and height = 1 is passed with uni quant disabled
@@ -45,10 +151,6 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
   //  int dec_factor = 1;
   //  int num_bits = 6;
   
-  if (displayTimings) {
-    t1 = clock();
-  }
-  
   if ((0)) {
     // Determine adler32 for input pixels
     
@@ -57,19 +159,26 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
     fprintf(stdout, "quant_varpart_fast() input pixels adler 0x%08X\n", (int)adlerSig);
   }
   
-  quant_varpart_fast( numPixels, inPixelsPtr, outPixelsPtr, 1, numPixels, numClustersPtr, outColortablePtr, num_bits, dec_factor, max_iters, allPixelsUnique);
-  
-  if (displayTimings) {
-    t2 = clock();
-    elapsed = timediff(t1, t2);
-    printf("quant_varpart_fast() elapsed: %ld ms aka %0.2f s\n", elapsed, elapsed/1000.0f);
+  {
+    DivQuantScopedTimer timer("quant_recurse.quant");
+    
+    DivQuantStatus status = quant_varpart_fast( numPixels, inPixelsPtr, outPixelsPtr, 1, numPixels, numClustersPtr, outColortablePtr, num_bits, dec_factor, max_iters, allPixelsUnique, &options);
+    
+    if (status != DIVQUANT_OK) {
+      fprintf(stderr, "quant_varpart_fast() failed with status %d\n", (int)status);
+      *numClustersPtr = 0;
+      return;
+    }
+    
+    if (displayTimings) {
+      double elapsed = timer.elapsedMillis();
+      printf("quant_varpart_fast() elapsed: %0.2f ms aka %0.2f s\n", elapsed, elapsed/1000.0);
+    }
   }
   
   int act_num_colors = *numClustersPtr;
   
-  if (displayTimings) {
-    t1 = clock();
-  }
+  DivQuantScopedTimer mapTimer("quant_recurse.map");
   
   // Dump cmap entries and dedup cmap in case of repeated values that resolve to same RGB entry.
   
@@ -90,31 +199,12 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
     }
   }
   
-  unordered_map<uint32_t, uint32_t> seen;
-  vector<uint32_t> dedupOrder;
-  dedupOrder.reserve(act_num_colors);
-
-  for ( int i = 0; i < act_num_colors; i++) {
-    uint32_t pixel = outColortablePtr[i];
-    if (seen.count(pixel) > 0) {
-      continue;
-    }
-    seen[pixel] = i;
-    dedupOrder.push_back(pixel);
-  }
-  
-  if ((int)dedupOrder.size() < act_num_colors) {
+  if (quant_dedup_colortable(numClustersPtr, outColortablePtr)) {
     if (dumpDedupCmap) {
-      fprintf(stdout, "DEDUP cmap from %d to %d entries\n", act_num_colors, (int)dedupOrder.size());
+      fprintf(stdout, "DEDUP cmap from %d to %d entries\n", act_num_colors, (int)*numClustersPtr);
     }
     
-    act_num_colors = (int)dedupOrder.size();
-    *numClustersPtr = act_num_colors;
-    
-    for ( int i = 0; i < act_num_colors; i++) {
-      uint32_t pixel = dedupOrder[i];
-      outColortablePtr[i] = pixel;
-    }
+    act_num_colors = *numClustersPtr;
   }
   
   if (dumpDedupCmap) {
@@ -139,9 +229,8 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
   map_colors_mps ( inPixelsPtr, numPixels, outPixelsPtr, outColortablePtr, act_num_colors );
   
   if (displayTimings) {
-    t2 = clock();
-    elapsed = timediff(t1, t2);
-    printf("map_colors_mps() elapsed: %ld ms aka %0.2f s\n", elapsed, elapsed/1000.0f);
+    double elapsed = mapTimer.elapsedMillis();
+    printf("map_colors_mps() elapsed: %0.2f ms aka %0.2f s\n", elapsed, elapsed/1000.0);
   }
   
   if ((0)) {
@@ -157,3 +246,451 @@ void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *
   return;
 }
 
+// Quant one job with the scratch buffers allocated out of arena, the arena
+// buffer is grown when the job needs more room than the last one.
+
+static void quant_batch_job ( QuantBatchJob *job, vector<uint8_t> &arenaBuffer )
+{
+  if (job->numPixels == 0 || job->numClusters == 0) {
+    job->numClusters = 0;
+    return;
+  }
+  
+  int max_iters, dec_factor, num_bits;
+  quant_get_params(&max_iters, &dec_factor, &num_bits);
+  
+  size_t arenaSize = divquant_arena_size(job->numPixels, (int) job->numClusters);
+  
+  if (arenaBuffer.size() < arenaSize) {
+    arenaBuffer.resize(arenaSize);
+  }
+  
+  DivQuantArena arena;
+  divquant_arena_init(&arena, &arenaBuffer[0], arenaBuffer.size());
+  
+  // The jobs are already split across threads, so each job runs its local
+  // kmeans on the thread that runs the job.
+  
+  DivQuantOptions options;
+  quant_default_options(&options);
+  options.num_threads = 1;
+  options.arena = &arena;
+  
+  DivQuantStatus status = quant_varpart_fast( job->numPixels, job->inPixelsPtr, job->outPixelsPtr, 1, job->numPixels, &job->numClusters, job->outColortablePtr, num_bits, dec_factor, max_iters, job->allPixelsUnique, &options);
+  
+  if (status != DIVQUANT_OK) {
+    fprintf(stderr, "quant_varpart_fast() failed with status %d\n", (int)status);
+    job->numClusters = 0;
+    return;
+  }
+  
+  quant_dedup_colortable(&job->numClusters, job->outColortablePtr);
+  
+  map_colors_mps ( job->inPixelsPtr, job->numPixels, job->outPixelsPtr, job->outColortablePtr, job->numClusters );
+}
+
+void quant_recurse_batch ( QuantBatchJob *jobs, uint32_t numJobs )
+{
+  DivQuantScopedTimer totalTimer("quant_recurse_batch");
+  divquant_profile_count("quant_recurse_batch.jobs", numJobs);
+  
+  if (numJobs == 0) {
+    return;
+  }
+  
+  // Largest jobs first so that a large job started last does not run alone
+  
+  vector<uint32_t> order(numJobs);
+  
+  for ( uint32_t i = 0; i < numJobs; i++ ) {
+    order[i] = i;
+  }
+  
+  std::stable_sort(order.begin(), order.end(), [jobs](uint32_t a, uint32_t b) {
+    return jobs[a].numPixels > jobs[b].numPixels;
+  });
+  
+  std::atomic<uint32_t> nextJob(0);
+  
+  auto worker = [&]() {
+    vector<uint8_t> arenaBuffer;
+    
+    while (1) {
+      uint32_t i = nextJob.fetch_add(1);
+      
+      if (i >= numJobs) {
+        break;
+      }
+      
+      quant_batch_job(&jobs[order[i]], arenaBuffer);
+    }
+  };
+  
+  int numThreads = quant_get_num_threads();
+  
+  if ((uint32_t) numThreads > numJobs) {
+    numThreads = (int) numJobs;
+  }
+  
+  // The calling thread runs jobs along with the other threads
+  
+  vector<thread> threads;
+  threads.reserve(numThreads - 1);
+  
+  for ( int i = 1; i < numThreads; i++ ) {
+    threads.push_back(thread(worker));
+  }
+  
+  worker();
+  
+  for ( thread &t : threads ) {
+    t.join();
+  }
+}
+
+// Squared RGB distance between two pixels
+
+static inline uint32_t quant_pixel_error ( uint32_t p1, uint32_t p2 )
+{
+  int dB = (int)(p1 & 0xFF) - (int)(p2 & 0xFF);
+  int dG = (int)((p1 >> 8) & 0xFF) - (int)((p2 >> 8) & 0xFF);
+  int dR = (int)((p1 >> 16) & 0xFF) - (int)((p2 >> 16) & 0xFF);
+  return (uint32_t) (dR * dR + dG * dG + dB * dB);
+}
+
+// Select one pixel at a random offset inside each of maxSamples equal sized
+// strata so that the sample covers the whole input evenly. The random
+// generator is seeded with a constant so the results are repeatable.
+
+static void quant_stratified_sample ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t maxSamples, uint32_t *samplePixelsPtr )
+{
+  uint32_t rnd = 0x9E3779B9;
+  
+  for ( uint32_t i = 0; i < maxSamples; i++ ) {
+    uint32_t start = (uint32_t) (((uint64_t) i * numPixels) / maxSamples);
+    uint32_t end = (uint32_t) (((uint64_t) (i + 1) * numPixels) / maxSamples);
+    
+    // xorshift32
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+    
+    uint32_t offset = start + (rnd % (end - start));
+    samplePixelsPtr[i] = inPixelsPtr[offset];
+  }
+}
+
+void quant_recurse_sampled ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique, uint32_t maxSamples, QuantSampleStats *statsPtr )
+{
+  assert(numPixels > 0);
+  assert(maxSamples > 0);
+  
+  DivQuantScopedTimer totalTimer("quant_recurse_sampled");
+  
+  uint32_t numSamples = numPixels;
+  
+  if (numPixels <= maxSamples) {
+    quant_recurse(numPixels, inPixelsPtr, outPixelsPtr, numClustersPtr, outColortablePtr, allPixelsUnique);
+  } else {
+    numSamples = maxSamples;
+    
+    vector<uint32_t> samples(numSamples);
+    vector<uint32_t> tmpPixels(numSamples);
+    
+    quant_stratified_sample(numPixels, inPixelsPtr, numSamples, &samples[0]);
+    
+    int max_iters, dec_factor, num_bits;
+    quant_get_params(&max_iters, &dec_factor, &num_bits);
+    
+    DivQuantOptions options;
+    quant_default_options(&options);
+    
+    // A sample of unique pixels could still contain duplicates
+    
+    DivQuantStatus status = quant_varpart_fast( numSamples, &samples[0], &tmpPixels[0], 1, numSamples, numClustersPtr, outColortablePtr, num_bits, dec_factor, max_iters, 0, &options);
+    
+    if (status != DIVQUANT_OK) {
+      fprintf(stderr, "quant_varpart_fast() failed with status %d\n", (int)status);
+      *numClustersPtr = 0;
+      return;
+    }
+    
+    quant_dedup_colortable(numClustersPtr, outColortablePtr);
+    
+    map_colors_mps ( inPixelsPtr, numPixels, outPixelsPtr, outColortablePtr, *numClustersPtr );
+  }
+  
+  if (statsPtr == NULL) {
+    return;
+  }
+  
+  double sum = 0.0;
+  double sumSqr = 0.0;
+  double fullSum = 0.0;
+  
+  for ( uint32_t i = 0; i < numPixels; i++ ) {
+    fullSum += quant_pixel_error(inPixelsPtr[i], outPixelsPtr[i]);
+  }
+  
+  // Sampling the input and output with the same strata and random offsets
+  // pairs each sampled pixel with the colortable entry it was mapped to.
+  
+  vector<uint32_t> sampleInPixels(numSamples);
+  vector<uint32_t> sampleOutPixels(numSamples);
+  
+  if (numSamples == numPixels) {
+    memcpy(&sampleInPixels[0], inPixelsPtr, numPixels * sizeof(uint32_t));
+    memcpy(&sampleOutPixels[0], outPixelsPtr, numPixels * sizeof(uint32_t));
+  } else {
+    quant_stratified_sample(numPixels, inPixelsPtr, numSamples, &sampleInPixels[0]);
+    quant_stratified_sample(numPixels, outPixelsPtr, numSamples, &sampleOutPixels[0]);
+  }
+  
+  for ( uint32_t i = 0; i < numSamples; i++ ) {
+    double err = quant_pixel_error(sampleInPixels[i], sampleOutPixels[i]);
+    sum += err;
+    sumSqr += err * err;
+  }
+  
+  double mean = sum / numSamples;
+  double variance = (sumSqr / numSamples) - (mean * mean);
+  if (variance < 0.0) {
+    variance = 0.0;
+  }
+  
+  statsPtr->numSamples = numSamples;
+  statsPtr->sampleMSE = mean;
+  statsPtr->sampleStdErr = sqrt(variance / numSamples);
+  statsPtr->fullMSE = fullSum / numPixels;
+  
+  return;
+}
+
+// Lloyd iterations over the unique colors of the histogram, each color is
+// weighted by its count. The centers are refined in place, an empty cluster
+// keeps its center. Returns the number of iterations that were run, the
+// iterations stop early once no color changes cluster.
+
+static uint32_t quant_seeded_kmeans ( const DivQuantHistogram &histogram, vector<double> &centers, vector<int> &assignments, int max_iters )
+{
+  const uint32_t numColors = histogram.getNumColors();
+  const uint32_t *colors = histogram.getColors();
+  const uint32_t *counts = histogram.getCounts();
+  
+  const int numCenters = (int) (centers.size() / 3);
+  
+  assignments.assign(numColors, -1);
+  
+  vector<double> sums(numCenters * 3);
+  vector<double> weights(numCenters);
+  
+  uint32_t numIterations = 0;
+  
+  for ( int it = 0; it < max_iters; it++ ) {
+    bool changed = false;
+    
+    std::fill(sums.begin(), sums.end(), 0.0);
+    std::fill(weights.begin(), weights.end(), 0.0);
+    
+    for ( uint32_t i = 0; i < numColors; i++ ) {
+      uint32_t pixel = colors[i];
+      double B = pixel & 0xFF;
+      double G = (pixel >> 8) & 0xFF;
+      double R = (pixel >> 16) & 0xFF;
+      
+      int best = 0;
+      double bestDist = 0.0;
+      
+      for ( int c = 0; c < numCenters; c++ ) {
+        double dR = R - centers[c*3+0];
+        double dG = G - centers[c*3+1];
+        double dB = B - centers[c*3+2];
+        double dist = dR * dR + dG * dG + dB * dB;
+        
+        if (c == 0 || dist < bestDist) {
+          best = c;
+          bestDist = dist;
+        }
+      }
+      
+      if (assignments[i] != best) {
+        assignments[i] = best;
+        changed = true;
+      }
+      
+      double w = counts[i];
+      sums[best*3+0] += w * R;
+      sums[best*3+1] += w * G;
+      sums[best*3+2] += w * B;
+      weights[best] += w;
+    }
+    
+    if (!changed) {
+      break;
+    }
+    
+    numIterations += 1;
+    
+    for ( int c = 0; c < numCenters; c++ ) {
+      if (weights[c] > 0.0) {
+        centers[c*3+0] = sums[c*3+0] / weights[c];
+        centers[c*3+1] = sums[c*3+1] / weights[c];
+        centers[c*3+2] = sums[c*3+2] / weights[c];
+      }
+    }
+  }
+  
+  return numIterations;
+}
+
+void quant_recurse_seeded ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique, const uint32_t *seedColortablePtr, uint32_t numSeedColors, double maxSeedMSE, QuantSeedStats *statsPtr )
+{
+  assert(numPixels > 0);
+  
+  DivQuantScopedTimer totalTimer("quant_recurse_seeded");
+  
+  if (statsPtr != NULL) {
+    memset(statsPtr, 0, sizeof(QuantSeedStats));
+  }
+  
+  if (seedColortablePtr == NULL || numSeedColors == 0 || numSeedColors > *numClustersPtr) {
+    quant_recurse(numPixels, inPixelsPtr, outPixelsPtr, numClustersPtr, outColortablePtr, allPixelsUnique);
+    return;
+  }
+  
+  const int max_iters = 10;
+  
+  DivQuantHistogram histogram;
+  histogram.addPixels(inPixelsPtr, numPixels);
+  
+  vector<double> centers(numSeedColors * 3);
+  
+  for ( uint32_t c = 0; c < numSeedColors; c++ ) {
+    uint32_t pixel = seedColortablePtr[c];
+    centers[c*3+0] = (pixel >> 16) & 0xFF;
+    centers[c*3+1] = (pixel >> 8) & 0xFF;
+    centers[c*3+2] = pixel & 0xFF;
+  }
+  
+  vector<int> assignments;
+  
+  uint32_t numIterations = quant_seeded_kmeans(histogram, centers, assignments, max_iters);
+  
+  divquant_profile_count("quant_recurse_seeded.iterations", numIterations);
+  
+  // The error of each unique color against the refined center of its cluster,
+  // only the clusters that have colors are written to the colortable.
+  
+  const uint32_t numColors = histogram.getNumColors();
+  const uint32_t *colors = histogram.getColors();
+  const uint32_t *counts = histogram.getCounts();
+  
+  vector<uint32_t> centerPixels(numSeedColors);
+  vector<bool> centerUsed(numSeedColors, false);
+  
+  for ( uint32_t c = 0; c < numSeedColors; c++ ) {
+    uint32_t R = (uint32_t) min(255.0, max(0.0, centers[c*3+0] + 0.5));
+    uint32_t G = (uint32_t) min(255.0, max(0.0, centers[c*3+1] + 0.5));
+    uint32_t B = (uint32_t) min(255.0, max(0.0, centers[c*3+2] + 0.5));
+    centerPixels[c] = (R << 16) | (G << 8) | B;
+  }
+  
+  double sumErr = 0.0;
+  
+  for ( uint32_t i = 0; i < numColors; i++ ) {
+    int c = assignments[i];
+    centerUsed[c] = true;
+    sumErr += (double) counts[i] * quant_pixel_error(colors[i], centerPixels[c]);
+  }
+  
+  double seedMSE = sumErr / numPixels;
+  
+  if (statsPtr != NULL) {
+    statsPtr->numIterations = numIterations;
+    statsPtr->seedMSE = seedMSE;
+  }
+  
+  if (seedMSE > maxSeedMSE) {
+    quant_recurse(numPixels, inPixelsPtr, outPixelsPtr, numClustersPtr, outColortablePtr, allPixelsUnique);
+    return;
+  }
+  
+  uint32_t numActualClusters = 0;
+  
+  for ( uint32_t c = 0; c < numSeedColors; c++ ) {
+    if (centerUsed[c]) {
+      outColortablePtr[numActualClusters++] = centerPixels[c];
+    }
+  }
+  
+  *numClustersPtr = numActualClusters;
+  
+  quant_dedup_colortable(numClustersPtr, outColortablePtr);
+  
+  map_colors_mps ( inPixelsPtr, numPixels, outPixelsPtr, outColortablePtr, *numClustersPtr );
+  
+  if (statsPtr != NULL) {
+    statsPtr->seeded = 1;
+  }
+  
+  return;
+}
+
+// Clustering in a perceptual colorspace like Lab splits smooth gradients
+// where the eye sees the difference instead of evenly in RGB.
+
+void quant_recurse_colorspace ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique, DivQuantColorSpace colorspace )
+{
+  int max_iters = 10;
+  int dec_factor = 1;
+  int num_bits = 8;
+  
+  DivQuantScopedTimer totalTimer("quant_recurse_colorspace");
+  
+  DivQuantOptions options;
+  quant_default_options(&options);
+  
+  DivQuantStatus status = quant_varpart_fast( numPixels, inPixelsPtr, outPixelsPtr, 1, numPixels, numClustersPtr, outColortablePtr, num_bits, dec_factor, max_iters, allPixelsUnique, &options);
+  
+  if (status != DIVQUANT_OK) {
+    fprintf(stderr, "quant_varpart_fast() failed with status %d\n", (int)status);
+    *numClustersPtr = 0;
+    return;
+  }
+  
+  quant_dedup_colortable(numClustersPtr, outColortablePtr);
+  
+  int act_num_colors = *numClustersPtr;
+  
+  map_colors_mps ( inPixelsPtr, numPixels, outPixelsPtr, outColortablePtr, act_num_colors );
+  
+  // Each output pixel is one of the colortable entries, so convert the
+  // colortable and then replace each output pixel with the RGB entry.
+  
+  vector<uint32_t> rgbColortable(act_num_colors);
+  divquant_colorspace_to_rgb(colorspace, outColortablePtr, act_num_colors, &rgbColortable[0]);
+  
+  unordered_map<uint32_t, uint32_t> toRGB;
+  for ( int i = 0; i < act_num_colors; i++ ) {
+    toRGB[outColortablePtr[i]] = rgbColortable[i];
+  }
+  
+  uint32_t lastIn = outPixelsPtr[0];
+  uint32_t lastOut = toRGB[lastIn];
+  
+  for ( uint32_t i = 0; i < numPixels; i++ ) {
+    uint32_t pixel = outPixelsPtr[i];
+    if (pixel != lastIn) {
+      lastIn = pixel;
+      lastOut = toRGB[pixel];
+    }
+    outPixelsPtr[i] = lastOut;
+  }
+  
+  // Distinct entries in the colorspace can convert to the same RGB value
+  
+  memcpy(outColortablePtr, &rgbColortable[0], act_num_colors * sizeof(uint32_t));
+  quant_dedup_colortable(numClustersPtr, outColortablePtr);
+  
+  return;
+}
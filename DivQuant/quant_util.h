@@ -3,12 +3,108 @@
 #ifndef quant_util_h
 #define quant_util_h
 
+#include "DivQuantColorSpace.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
     
   void quant_recurse ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outColorTableOffsetPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique );
   
+  // Error stats for quant_recurse_sampled(), errors are squared RGB distances
+  // between a pixel and the colortable entry it maps to.
+  
+  typedef struct {
+    uint32_t numSamples; // number of pixels that were clustered
+    double sampleMSE; // mean error of the sampled pixels
+    double sampleStdErr; // standard error of sampleMSE
+    double fullMSE; // mean error of all the input pixels
+  } QuantSampleStats;
+  
+  // Sampled quant, when there are more than maxSamples pixels a stratified
+  // random sample of maxSamples pixels is clustered and then every input
+  // pixel is mapped to the resulting colortable. When fullMSE is outside
+  // sampleMSE +- 2 * sampleStdErr the sample did not represent the input
+  // well. The stats pointer can be NULL.
+  
+  void quant_recurse_sampled ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique, uint32_t maxSamples, QuantSampleStats *statsPtr );
+  
+  // Quant pixels that were already converted to colorspace with
+  // divquant_rgb_to_colorspace(), clustering and mapping are done in that
+  // colorspace and then the colortable and the output pixels are converted
+  // back to RGB.
+  
+  void quant_recurse_colorspace ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique, DivQuantColorSpace colorspace );
+  
+  // One quant_recurse_batch() job, numClusters is the requested number of
+  // clusters on input and the number of colortable entries on output.
+  
+  typedef struct {
+    uint32_t numPixels;
+    const uint32_t *inPixelsPtr;
+    uint32_t *outPixelsPtr; // numPixels quant pixels
+    uint32_t numClusters;
+    uint32_t *outColortablePtr; // numClusters entries
+    int allPixelsUnique;
+  } QuantBatchJob;
+  
+  // Quant each job the same as quant_recurse(), the jobs are run at the same
+  // time on up to quant_get_num_threads() threads with the largest jobs
+  // started first. Each thread allocates the scratch buffers of all its jobs
+  // out of one arena it reuses, and no timings are printed. A job that fails
+  // has numClusters set to 0.
+  
+  void quant_recurse_batch ( QuantBatchJob *jobs, uint32_t numJobs );
+  
+  // Stats for quant_recurse_seeded(), errors are squared RGB distances
+  // between a pixel and the colortable entry it maps to.
+  
+  typedef struct {
+    int seeded; // 1 when the refined seed colortable was used
+    uint32_t numIterations; // k-means iterations run from the seed
+    double seedMSE; // mean error of the refined seed colortable
+  } QuantSeedStats;
+  
+  // Warm started quant, the numSeedColors entries of seedColortablePtr, like
+  // the colortable of a containing or neighbor region, are refined with a
+  // weighted k-means over the unique input colors. When the refined seed has
+  // a mean error of at most maxSeedMSE it is used as the colortable and the
+  // divisive splitting is skipped, otherwise this is the same as
+  // quant_recurse(). A seed with more than *numClustersPtr entries is not
+  // used. The stats pointer can be NULL.
+  
+  void quant_recurse_seeded ( uint32_t numPixels, const uint32_t *inPixelsPtr, uint32_t *outPixelsPtr, uint32_t *numClustersPtr, uint32_t *outColortablePtr, int allPixelsUnique, const uint32_t *seedColortablePtr, uint32_t numSeedColors, double maxSeedMSE, QuantSeedStats *statsPtr );
+  
+  // Threads that the local k-means of quant calls made on this thread may
+  // use, 0 means thread::hardware_concurrency(). The value is per thread.
+  
+  void quant_set_num_threads ( int numThreads );
+  
+  int quant_get_num_threads ( void );
+  
+  // A parallel loop invokes func(index, data) once for each index from 0 to
+  // numRanges-1, possibly from several threads at once, and returns when all
+  // the calls are done. A caller with its own thread pool sets one so that the
+  // local k-means ranges run on its threads, NULL runs each range on its own
+  // thread. The value is process wide.
+  
+  typedef void (*QuantParallelRangeFunc) ( int index, void *data );
+  
+  typedef void (*QuantParallelForFunc) ( int numRanges, QuantParallelRangeFunc func, void *data );
+  
+  void quant_set_parallel_for ( QuantParallelForFunc parallelForFunc );
+  
+  QuantParallelForFunc quant_get_parallel_for ( void );
+  
+  // Local k-means iterations, decimation factor and bits per channel that
+  // quant_recurse(), quant_recurse_batch() and quant_recurse_sampled() pass to
+  // quant_varpart_fast(), 10, 1 and 8 by default. Fewer iterations or bits
+  // are faster and less exact. The values are process wide.
+  
+  void quant_set_params ( int maxIters, int decFactor, int numBits );
+  
+  void quant_get_params ( int *maxItersPtr, int *decFactorPtr, int *numBitsPtr );
+  
 #ifdef __cplusplus
 }
 #endif
@@ -6,12 +6,23 @@
 
 #include "unionfind.h"
 #include "srm.h"
+#include "srm_simd.h"
+#include "srm_alloc.h"
 
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 
 #define index(i, j) (i) * srm->width + (j)
-#define offset(offset, idx, widthStep) {unsigned int _i = (idx) / srm->width; unsigned int _j = (idx) % srm->width; (offset) = _i * (widthStep) + srm->channels * _j;}
+// Packed rows, as generateSRM() always passes, are addressed directly so that
+// only a buffer with row padding needs the divide to find the row.
+
+#define offset(offset, idx, widthStep) { \
+  if ((widthStep) == srm->channels * srm->width) { \
+    (offset) = srm->channels * (idx); \
+  } else { \
+    unsigned int _i = (idx) / srm->width; unsigned int _j = (idx) % srm->width; (offset) = _i * (widthStep) + srm->channels * _j; \
+  } \
+}
 
 #define get_b(im, offset) (im)[(offset)    ]
 #define get_g(im, offset) (im)[(offset) + 1]
@@ -21,15 +32,33 @@
 #define set_g(im, offset, g) (im)[(offset) + 1] = (g)
 #define set_r(im, offset, r) (im)[(offset) + 2] = (r)
 
+// Mean values of the region rooted at reg
+#define region_mean(srm, reg) (&(srm)->means[(srm)->mean_channels * (reg)])
+
+// The second region of a pair is always the pixel to the right or below r1
+#define pair_r2(srm, p) ((p).r1 + ((p).vertical ? (srm)->width : 1))
+
+// Write a pair directly into the next slot of the bucket for its diff
+#define add_pair(ordered_pairs, cnbe, idx, vert, d) { struct my_pair *_p = &(ordered_pairs)[(cnbe)[(d)]++]; _p->r1 = (idx); _p->diff = (d); _p->vertical = (vert); }
+
 void initialize(struct srm *srm);
 void segmentation(struct srm *srm);
+void segmentation_pairs(struct srm *srm);
+void segmentation_merge(struct srm *srm);
+void merge_pairs(struct srm *srm, struct my_pair *ordered_pairs, unsigned int n_pairs);
 void finalize(struct srm *srm);
+unsigned int finalize_labels(struct srm *srm, unsigned int *rootToLabel, unsigned int widthStep_labels, int32_t *labels);
 void merge_small_regions(struct srm *srm);
 
 unsigned int diff(struct srm *srm, unsigned int idx1, unsigned int idx2);
+static void write_mean(struct srm *srm, const float *mean, uint8_t *pixel);
 unsigned int merge_predicate(struct srm *srm, unsigned int reg1, unsigned int reg2);
-void bucket_sort(struct my_pair *pairs, struct my_pair *ordered_pairs, unsigned int size);
+void cumulative_histogram(const unsigned int *nbe, unsigned int *cnbe);
+void row_diffs_h(struct srm *srm, unsigned int i);
+void row_diffs_v(struct srm *srm, unsigned int i);
 void merge_regions(struct srm *srm, unsigned int r1, unsigned int r2);
+static void fill_dev_table(struct srm *srm);
+static void sort_pairs(struct srm *srm, const unsigned int *nbe);
 
 void SRM(double Q, unsigned int width, unsigned int height, unsigned int channels, uint8_t *in, uint8_t *out, unsigned int borders) {
   struct srm *srm = srm_new(Q, width, height, channels, borders);
@@ -37,32 +66,103 @@ void SRM(double Q, unsigned int width, unsigned int height, unsigned int channel
   srm_delete(srm);
 }
 
-struct srm* srm_new(double Q, unsigned int width, unsigned int height, unsigned int channels, unsigned int borders) {
-  struct srm *srm;
-  srm = malloc(sizeof(struct srm));
+// Number of C4 pairs for the image dimensions
+
+static unsigned int pairs_count(unsigned int width, unsigned int height) {
+  return 2 * (width - 1) * (height - 1) + (height - 1) + (width - 1);
+}
 
+// Set the dimensions and the Q value along with derived values
+
+static void srm_set_params(struct srm *srm, double Q, unsigned int width, unsigned int height) {
   srm->width         = width;
   srm->height        = height;
-  srm->channels      = channels;
   srm->Q             = Q;
-  srm->borders       = borders;
 
   srm->size          = width * height;
   srm->smallregion   = 0.001 * srm->size;
 
   srm->logdelta      = 2.0 * log(6.0 * srm->size);
   srm->g             = 256.0;
-  srm->n_pairs       = 2 * (srm->width - 1) * (srm->height - 1) + (srm->height - 1) + (srm->width - 1);
+  srm->n_pairs       = pairs_count(width, height);
+}
+
+struct srm* srm_new(double Q, unsigned int width, unsigned int height, unsigned int channels, unsigned int borders) {
+  struct srm *srm;
+  srm = malloc(sizeof(struct srm));
+
+  assert(channels == 1 || channels == 3 || channels == 4);
+
+  srm->channels      = channels;
+  srm->mean_channels = (channels == 1) ? 1 : 3;
+  srm->borders       = borders;
+
+  srm_set_params(srm, Q, width, height);
+
+  srm->capacity      = srm->size;
+  srm->pairs_capacity = srm->n_pairs;
 
   srm->uf            = unionfind_new(srm->size);
-  srm->sizes         = malloc(srm->size * sizeof(unsigned int));
-  srm->pairs         = malloc(srm->n_pairs * sizeof(struct my_pair));
-  srm->ordered_pairs = malloc(srm->n_pairs * sizeof(struct my_pair));
+  srm->sizes         = srm_alloc_large(srm->size * sizeof(unsigned int));
+  srm->means         = srm_alloc_large(srm->mean_channels * srm->size * sizeof(float));
+  srm->diffs         = srm_alloc_large(2 * srm->size * sizeof(uint8_t));
+  srm->ordered_pairs = srm_alloc_large(srm->n_pairs * sizeof(struct my_pair));
+  srm->tile_rows     = 0;
+  srm->concurrent    = 0;
+  srm->keep_pairs    = 0;
+
+  srm->dev_table_size = SRM_DEV_TABLE_SIZE;
+  srm->dev_table     = malloc(srm->dev_table_size * sizeof(double));
+  fill_dev_table(srm);
 
   return srm;
 }
 
-void srm_run(struct srm *srm, unsigned int widthStep_in, uint8_t *in, unsigned int widthStep_out, uint8_t *out) {
+// Reuse an existing context for a new Q value or new image dimensions. Buffers
+// are only reallocated when the new dimensions need more space than the
+// existing buffers provide.
+
+void srm_reset(struct srm *srm, double Q, unsigned int width, unsigned int height) {
+  srm_set_params(srm, Q, width, height);
+
+  if (srm->size > srm->capacity) {
+    free(srm->sizes);
+    free(srm->means);
+    free(srm->diffs);
+    srm->capacity    = srm->size;
+    srm->sizes       = srm_alloc_large(srm->size * sizeof(unsigned int));
+    srm->means       = srm_alloc_large(srm->mean_channels * srm->size * sizeof(float));
+    srm->diffs       = srm_alloc_large(2 * srm->size * sizeof(uint8_t));
+  }
+
+  if (srm->n_pairs > srm->pairs_capacity) {
+    free(srm->ordered_pairs);
+    srm->pairs_capacity = srm->n_pairs;
+    srm->ordered_pairs = srm_alloc_large(srm->n_pairs * sizeof(struct my_pair));
+  }
+
+  unionfind_reset(srm->uf, srm->size);
+
+  fill_dev_table(srm);
+}
+
+// The deviation bound of a region depends only on the region size and the
+// image size once the 1/Q factor is pulled out. Precompute it for region
+// sizes below dev_table_size so that merge_predicate() avoids the log().
+
+static double region_dev(struct srm *srm, unsigned int size) {
+  double logreg = min(srm->g, size) * log(1.0 + size);
+  return (srm->g * srm->g) / (2.0 * size) * (logreg + srm->logdelta);
+}
+
+static void fill_dev_table(struct srm *srm) {
+  srm->dev_table[0] = 0.0;
+  for (unsigned int size = 1; size < srm->dev_table_size; size++) {
+    srm->dev_table[size] = region_dev(srm, size);
+  }
+}
+
+void srm_run(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int widthStep_out, uint8_t *out) {
   srm->in  = in;
   srm->widthStep_in = widthStep_in;
   srm->out = out;
@@ -74,22 +174,351 @@ void srm_run(struct srm *srm, unsigned int widthStep_in, uint8_t *in, unsigned i
   finalize(srm);
 }
 
+unsigned int srm_run_labels(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int widthStep_labels, int32_t *labels) {
+  // The region averages are tracked in means, so no output image is needed
+  srm->in  = in;
+  srm->widthStep_in = widthStep_in;
+  srm->out = NULL;
+  srm->widthStep_out = 0;
+
+  initialize(srm);
+  segmentation(srm);
+  merge_small_regions(srm);
+  // Region sizes are not needed once merging is finished, so the sizes
+  // array is reused as the root to label table.
+  return finalize_labels(srm, srm->sizes, widthStep_labels, labels);
+}
+
+void srm_run_segment(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int widthStep_out, uint8_t *out) {
+  srm->in  = in;
+  srm->widthStep_in = widthStep_in;
+  srm->out = out;
+  srm->widthStep_out = widthStep_out;
+
+  initialize(srm);
+  segmentation(srm);
+  merge_small_regions(srm);
+}
+
+uint8_t* srm_diffs(struct srm *srm) {
+  return srm->diffs;
+}
+
+void srm_run_segment_diffs(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, const unsigned int *histogram,
+                           unsigned int widthStep_out, uint8_t *out) {
+  srm->in  = in;
+  srm->widthStep_in = widthStep_in;
+  srm->out = out;
+  srm->widthStep_out = widthStep_out;
+
+  initialize(srm);
+  sort_pairs(srm, histogram);
+  segmentation_merge(srm);
+  merge_small_regions(srm);
+}
+
+void srm_run_multi_labels(struct srm *srm, unsigned int widthStep_in, const uint8_t *in,
+                          unsigned int n_levels, const double *Qs,
+                          unsigned int widthStep_labels, int32_t **labels, unsigned int *counts) {
+  srm->in  = in;
+  srm->widthStep_in = widthStep_in;
+  srm->out = NULL;
+  srm->widthStep_out = 0;
+
+  // Region sizes are needed by the next level, so a distinct label table is used
+  unsigned int *rootToLabel = srm_alloc_large(srm->size * sizeof(unsigned int));
+  unsigned char *done = calloc(n_levels, sizeof(unsigned char));
+
+  initialize(srm);
+  segmentation_pairs(srm);
+
+  // Process levels from the largest Q (most regions) to the smallest Q so
+  // that each level only merges regions from the previous level.
+  for (unsigned int level = 0; level < n_levels; level++) {
+    unsigned int k = n_levels;
+    for (unsigned int i = 0; i < n_levels; i++) {
+      if (!done[i] && (k == n_levels || Qs[i] > Qs[k]))
+        k = i;
+    }
+    done[k] = 1;
+
+    srm->Q = Qs[k];
+    segmentation_merge(srm);
+    merge_small_regions(srm);
+    counts[k] = finalize_labels(srm, rootToLabel, widthStep_labels, labels[k]);
+  }
+
+  free(done);
+  free(rootToLabel);
+}
+
+// Auto Q mode, the pairs are generated and sorted once and then each trial Q
+// only resets the regions and merges the sorted pairs again. The region count
+// grows with Q, so Q is found by a binary search on log Q.
+
+static unsigned int auto_q_trial(struct srm *srm, double Q) {
+  srm->Q = Q;
+  initialize(srm);
+  segmentation_merge(srm);
+  merge_small_regions(srm);
+  return unionfind_count(srm->uf);
+}
+
+double srm_run_auto_q(struct srm *srm, unsigned int widthStep_in, const uint8_t *in,
+                      unsigned int min_regions, unsigned int max_regions,
+                      double Q_min, double Q_max, unsigned int max_trials,
+                      unsigned int *n_regions) {
+  assert(min_regions <= max_regions);
+  assert(Q_min > 0.0 && Q_min <= Q_max);
+
+  srm->in  = in;
+  srm->widthStep_in = widthStep_in;
+  srm->out = NULL;
+  srm->widthStep_out = 0;
+
+  initialize(srm);
+  segmentation_pairs(srm);
+
+  srm->keep_pairs = 1;
+
+  double lo = log(Q_min);
+  double hi = log(Q_max);
+
+  double best_Q = 0.0;
+  unsigned int best_count = 0;
+  unsigned int best_miss = 0xFFFFFFFF;
+
+  double Q = 0.0;
+  unsigned int count = 0;
+
+  if (max_trials < 1)
+    max_trials = 1;
+
+  for (unsigned int trial = 0; trial < max_trials; trial++) {
+    Q = exp((lo + hi) / 2.0);
+    count = auto_q_trial(srm, Q);
+
+    unsigned int miss = 0;
+    if (count < min_regions)
+      miss = min_regions - count;
+    else if (count > max_regions)
+      miss = count - max_regions;
+
+    if (miss < best_miss) {
+      best_miss = miss;
+      best_Q = Q;
+      best_count = count;
+    }
+
+    if (miss == 0)
+      break;
+    else if (count < min_regions)
+      lo = log(Q);
+    else
+      hi = log(Q);
+  }
+
+  // The regions are left merged for the closest Q, ready to be finalized
+  if (Q != best_Q)
+    count = auto_q_trial(srm, best_Q);
+
+  assert(count == best_count);
+
+  srm->keep_pairs = 0;
+
+  if (n_regions != NULL)
+    *n_regions = count;
+
+  return best_Q;
+}
+
+// Tiled mode, the image is split into bands of tile_rows rows and each band is
+// segmented on its own. The pixels of a band never touch the pixels of another
+// band while the bands are processed, so each band can be processed on its
+// own thread. The pairs that cross a band seam are merged by srm_tiled_finish().
+
+static unsigned int tile_pairs_count(struct srm *srm, unsigned int rows) {
+  return rows * (srm->width - 1) + (rows - 1) * srm->width;
+}
+
+unsigned int srm_tiled_begin(struct srm *srm, unsigned int tile_rows,
+                             unsigned int widthStep_in, const uint8_t *in,
+                             unsigned int widthStep_out, uint8_t *out) {
+  srm->in  = in;
+  srm->widthStep_in = widthStep_in;
+  srm->out = out;
+  srm->widthStep_out = widthStep_out;
+
+  if (tile_rows < 2)
+    tile_rows = 2;
+  if (tile_rows > srm->height)
+    tile_rows = srm->height;
+  srm->tile_rows = tile_rows;
+
+  initialize(srm);
+
+  srm->concurrent = 1;
+
+  return (srm->height + tile_rows - 1) / tile_rows;
+}
+
+void srm_tiled_segment_tile(struct srm *srm, unsigned int tile) {
+  unsigned int row_start = tile * srm->tile_rows;
+  unsigned int row_end = min(srm->height, row_start + srm->tile_rows);
+
+  unsigned int pair_index = tile * tile_pairs_count(srm, srm->tile_rows);
+  struct my_pair *ordered_pairs = &srm->ordered_pairs[pair_index];
+
+  const uint8_t *diffs_h = srm->diffs;
+  const uint8_t *diffs_v = srm->diffs + srm->size;
+
+  unsigned int nbe[256];
+  unsigned int cnbe[256];
+  memset(nbe, 0, sizeof(nbe));
+
+  for (unsigned int i = row_start; i < row_end; i++) {
+    row_diffs_h(srm, i);
+    for (unsigned int j = 0; j < srm->width - 1; j++)
+      nbe[diffs_h[index(i, j)]]++;
+
+    if (i < row_end - 1) {
+      row_diffs_v(srm, i);
+      for (unsigned int j = 0; j < srm->width; j++)
+        nbe[diffs_v[index(i, j)]]++;
+    }
+  }
+
+  cumulative_histogram(nbe, cnbe);
+
+  unsigned int index;
+  for (unsigned int i = row_start; i < row_end; i++) {
+    for (unsigned int j = 0; j < srm->width; j++) {
+      index = index(i, j);
+
+      if (j < srm->width - 1)
+        add_pair(ordered_pairs, cnbe, index, 0, diffs_h[index]);
+
+      if (i < row_end - 1)
+        add_pair(ordered_pairs, cnbe, index, 1, diffs_v[index]);
+    }
+  }
+
+  unsigned int n = tile_pairs_count(srm, row_end - row_start);
+  assert(cnbe[255] == n);
+
+  merge_pairs(srm, ordered_pairs, n);
+}
+
+void srm_tiled_finish(struct srm *srm) {
+  unsigned int num_tiles = (srm->height + srm->tile_rows - 1) / srm->tile_rows;
+
+  // The union-find count is not updated while the bands are processed
+  // since that would not be thread safe, so recount the regions now.
+  srm->concurrent = 0;
+  unionfind_recount(srm->uf);
+
+  // Seam pairs are stored after the pairs for all the bands
+  unsigned int n = (num_tiles - 1) * srm->width;
+  struct my_pair *ordered_pairs = &srm->ordered_pairs[srm->n_pairs - n];
+
+  const uint8_t *diffs_v = srm->diffs + srm->size;
+
+  unsigned int nbe[256];
+  unsigned int cnbe[256];
+  memset(nbe, 0, sizeof(nbe));
+
+  for (unsigned int tile = 1; tile < num_tiles; tile++) {
+    unsigned int i = tile * srm->tile_rows - 1;
+    row_diffs_v(srm, i);
+    for (unsigned int j = 0; j < srm->width; j++)
+      nbe[diffs_v[index(i, j)]]++;
+  }
+
+  cumulative_histogram(nbe, cnbe);
+
+  unsigned int index;
+  for (unsigned int tile = 1; tile < num_tiles; tile++) {
+    unsigned int i = tile * srm->tile_rows - 1;
+
+    for (unsigned int j = 0; j < srm->width; j++) {
+      index = index(i, j);
+      add_pair(ordered_pairs, cnbe, index, 1, diffs_v[index]);
+    }
+  }
+
+  merge_pairs(srm, ordered_pairs, n);
+
+  merge_small_regions(srm);
+}
+
+void srm_tiled_finalize(struct srm *srm) {
+  assert(srm->out != NULL);
+  finalize(srm);
+}
+
+unsigned int srm_tiled_finalize_labels(struct srm *srm, unsigned int widthStep_labels, int32_t *labels) {
+  return finalize_labels(srm, srm->sizes, widthStep_labels, labels);
+}
+
+// Parallel finalize, once all the merging is done the union-find is only read.
+// The root is found without path compression so that nothing is written to
+// the union-find and rows can be finalized on different threads at once.
+
+static inline unsigned int find_root(const struct unionfind *uf, unsigned int id) {
+  const struct unionfind_node *nodes = uf->nodes;
+
+  while (nodes[id].parent != id) {
+    id = nodes[id].parent;
+  }
+
+  return id;
+}
+
+void srm_flatten_rows(struct srm *srm, unsigned int row_start, unsigned int row_end, unsigned int widthStep_roots, int32_t *roots) {
+  for (unsigned int i = row_start; i < row_end; i++) {
+    int32_t *rowPtr = (int32_t *) (((uint8_t *) roots) + (i * widthStep_roots));
+    unsigned int index = index(i, 0);
+
+    for (unsigned int j = 0; j < srm->width; j++, index++) {
+      rowPtr[j] = (int32_t) find_root(srm->uf, index);
+    }
+  }
+}
+
+void srm_finalize_rows(struct srm *srm, unsigned int row_start, unsigned int row_end) {
+  for (unsigned int i = row_start; i < row_end; i++) {
+    uint8_t *rowPtr = srm->out + i * srm->widthStep_out;
+    unsigned int index = index(i, 0);
+
+    for (unsigned int j = 0; j < srm->width; j++, index++) {
+      const float *mean = region_mean(srm, find_root(srm->uf, index));
+      write_mean(srm, mean, rowPtr + srm->channels * j);
+    }
+  }
+}
+
 unsigned int srm_regions_count(struct srm *srm) {
   return srm->uf->count;
 }
 
-unsigned int* srm_regions(struct srm *srm) {
-  return srm->uf->parents;
+// Return the region id (root pixel index) for the pixel at index
+
+unsigned int srm_region(struct srm *srm, unsigned int index) {
+  return unionfind_find(srm->uf, index);
 }
 
+// Pixel count for each region, only valid at region ids
+
 unsigned int* srm_regions_sizes(struct srm *srm) {
-  return srm->uf->weights;
+  return srm->sizes;
 }
 
 void srm_delete(struct srm *srm) {
   unionfind_delete(srm->uf);
   free(srm->sizes);
-  free(srm->pairs);
+  free(srm->means);
+  free(srm->dev_table);
+  free(srm->diffs);
   free(srm->ordered_pairs);
   free(srm);
 }
@@ -97,33 +526,54 @@ void srm_delete(struct srm *srm) {
 void initialize(struct srm *srm) {
   unionfind_init(srm->uf);
 
-  memcpy(srm->out, srm->in, srm->channels * srm->size * sizeof(uint8_t));
-  for (unsigned int i = 0; i < srm->size; i++) {
-      unsigned int offset_in;
-      offset(offset_in, i, srm->widthStep_in);
+  // merge_small_regions() drops the pairs inside a region from the pairs
+  srm->n_pairs = pairs_count(srm->width, srm->height);
 
-      unsigned int offset_out;
-      offset(offset_out, i, srm->widthStep_out);
-      set_r(srm->out, offset_out, get_r(srm->in, offset_in));
-      set_g(srm->out, offset_out, get_g(srm->in, offset_in));
-      set_b(srm->out, offset_out, get_b(srm->in, offset_in));
+  // Copy input rows to output rows so that the alpha of a BGRA pixel is
+  // kept, the widthStep of each buffer can include row padding.
+  if (srm->out != NULL) {
+    for (unsigned int i = 0; i < srm->height; i++) {
+      memcpy(srm->out + (i * srm->widthStep_out), srm->in + (i * srm->widthStep_in), srm->channels * srm->width * sizeof(uint8_t));
+    }
+  }
+
+  // Each pixel starts as a region of size 1 with the pixel color as the
+  // mean. The widthStep of the input can include row padding.
+  for (unsigned int i = 0; i < srm->height; i++) {
+    const uint8_t *rowPtr = srm->in + (i * srm->widthStep_in);
+    float *means = region_mean(srm, index(i, 0));
 
+    if (srm->mean_channels == 1) {
+      for (unsigned int j = 0; j < srm->width; j++) {
+        means[j] = rowPtr[j];
+      }
+      continue;
+    }
+
+    for (unsigned int j = 0; j < srm->width; j++) {
+      const uint8_t *pixel = rowPtr + (srm->channels * j);
+      means[3*j + 0] = get_b(pixel, 0);
+      means[3*j + 1] = get_g(pixel, 0);
+      means[3*j + 2] = get_r(pixel, 0);
+    }
+  }
+
+  for (unsigned int i = 0; i < srm->size; i++) {
     srm->sizes[i] = 1;
   }
 }
 
-inline unsigned int diff(struct srm *srm, unsigned int idx1, unsigned int idx2) {
-  unsigned int offset1;
-  offset(offset1, idx1, srm->widthStep_in);
-  unsigned char r1 = get_r(srm->in, offset1);
-  unsigned char g1 = get_g(srm->in, offset1);
-  unsigned char b1 = get_b(srm->in, offset1);
+static inline unsigned int diff_pixels(unsigned int channels, const uint8_t *pixel1, const uint8_t *pixel2) {
+  if (channels == 1)
+    return pixel2[0] > pixel1[0] ? pixel2[0] - pixel1[0] : pixel1[0] - pixel2[0];
 
-  unsigned int offset2;
-  offset(offset2, idx2, srm->widthStep_in);
-  unsigned char r2 = get_r(srm->in, offset2);
-  unsigned char g2 = get_g(srm->in, offset2);
-  unsigned char b2 = get_b(srm->in, offset2);
+  unsigned char r1 = get_r(pixel1, 0);
+  unsigned char g1 = get_g(pixel1, 0);
+  unsigned char b1 = get_b(pixel1, 0);
+
+  unsigned char r2 = get_r(pixel2, 0);
+  unsigned char g2 = get_g(pixel2, 0);
+  unsigned char b2 = get_b(pixel2, 0);
 
   unsigned int diff_r = r2 > r1 ? r2 - r1 : r1 - r2;
   unsigned int diff_g = g2 > g1 ? g2 - g1 : g1 - g2;
@@ -132,57 +582,124 @@ inline unsigned int diff(struct srm *srm, unsigned int idx1, unsigned int idx2)
   return max(diff_r, max(diff_g, diff_b));
 }
 
+inline unsigned int diff(struct srm *srm, unsigned int idx1, unsigned int idx2) {
+  unsigned int offset1;
+  offset(offset1, idx1, srm->widthStep_in);
+
+  unsigned int offset2;
+  offset(offset2, idx2, srm->widthStep_in);
+
+  return diff_pixels(srm->channels, srm->in + offset1, srm->in + offset2);
+}
+
 void segmentation(struct srm *srm) {
+  segmentation_pairs(srm);
+  segmentation_merge(srm);
+}
+
+// Calculate the diff for each pixel in row i and the pixel to the right
+
+void row_diffs_h(struct srm *srm, unsigned int i) {
+  uint8_t *diffs_h = &srm->diffs[index(i, 0)];
+  const uint8_t *row = srm->in + i * srm->widthStep_in;
+
+  srm_row_diffs_h(row, srm->width, srm->channels, diffs_h);
+}
+
+// Calculate the diff for each pixel in row i and the pixel below
+
+void row_diffs_v(struct srm *srm, unsigned int i) {
+  uint8_t *diffs_v = &srm->diffs[srm->size + index(i, 0)];
+  const uint8_t *row = srm->in + i * srm->widthStep_in;
+  const uint8_t *rowBelow = row + srm->widthStep_in;
+
+  srm_row_diffs_v(row, rowBelow, srm->width, srm->channels, diffs_v);
+}
+
+// Generate all C4 pairs sorted by color difference. A counting pass over the
+// diffs determines the size of each bucket so that each pair can then be
+// written directly into its sorted position.
+
+void segmentation_pairs(struct srm *srm) {
   // Consider C4-connectivity here
 
+  const uint8_t *diffs_h = srm->diffs;
+  const uint8_t *diffs_v = srm->diffs + srm->size;
+
+  unsigned int nbe[256];
+  memset(nbe, 0, sizeof(nbe));
+
+  // class all elements according to their family
+  for (unsigned int i = 0; i < srm->height; i++) {
+    row_diffs_h(srm, i);
+    for (unsigned int j = 0; j < srm->width - 1; j++)
+      nbe[diffs_h[index(i, j)]]++;
+
+    if (i < srm->height - 1) {
+      row_diffs_v(srm, i);
+      for (unsigned int j = 0; j < srm->width; j++)
+        nbe[diffs_v[index(i, j)]]++;
+    }
+  }
+
+  sort_pairs(srm, nbe);
+}
+
+// Write each pair into its bucket once the diffs and the number of pairs with
+// each diff are known.
+
+static void sort_pairs(struct srm *srm, const unsigned int *nbe) {
+  const uint8_t *diffs_h = srm->diffs;
+  const uint8_t *diffs_v = srm->diffs + srm->size;
+
+  unsigned int cnbe[256];
+
+  cumulative_histogram(nbe, cnbe);
+
+  // The pairs are written in the same order as they were originally
+  // generated, this keeps the order within each bucket the same.
+
   unsigned int index;
-  unsigned int pair_index = 0;
   for (unsigned int i = 0; i < srm->height - 1; i++) {
     for (unsigned int j = 0; j < srm->width - 1; j++) {
       index = index(i, j);
 
       // C4 left
-      srm->pairs[pair_index].r1 = index;
-      srm->pairs[pair_index].r2 = index + 1;
-      srm->pairs[pair_index].diff = diff(srm, index, index + 1);
-      pair_index++;
+      add_pair(srm->ordered_pairs, cnbe, index, 0, diffs_h[index]);
 
       // C4 below
-      srm->pairs[pair_index].r1 = index;
-      srm->pairs[pair_index].r2 = index + srm->width;
-      srm->pairs[pair_index].diff = diff(srm, index, index + srm->width);
-      pair_index++;
+      add_pair(srm->ordered_pairs, cnbe, index, 1, diffs_v[index]);
     }
   }
 
   // The two border lines
   for (unsigned int i = 0; i < srm->height - 1; i++) {
     index = index(i, srm->width - 1);
-
-    srm->pairs[pair_index].r1 = index;
-    srm->pairs[pair_index].r2 = index + srm->width;
-    srm->pairs[pair_index].diff = diff(srm, index, index + srm->width);
-    pair_index++;
+    add_pair(srm->ordered_pairs, cnbe, index, 1, diffs_v[index]);
   }
   for (unsigned int j = 0; j < srm->width - 1; j++) {
     index = index(srm->height - 1,  j);
-
-    srm->pairs[pair_index].r1 = index;
-    srm->pairs[pair_index].r2 = index + 1;
-    srm->pairs[pair_index].diff = diff(srm, index, index + 1);
-    pair_index++;
+    add_pair(srm->ordered_pairs, cnbe, index, 0, diffs_h[index]);
   }
 
-  // Sorting the edges according to the maximum color channel difference
-  bucket_sort(srm->pairs, srm->ordered_pairs, srm->n_pairs);
+  assert(cnbe[255] == srm->n_pairs);
+}
+
+// Merge regions in sorted pair order, this can be invoked again with a
+// smaller Q to merge the existing regions into larger regions.
+
+void segmentation_merge(struct srm *srm) {
+  merge_pairs(srm, srm->ordered_pairs, srm->n_pairs);
+}
 
+void merge_pairs(struct srm *srm, struct my_pair *ordered_pairs, unsigned int n_pairs) {
   // Merging similar regions
   unsigned int reg1, reg2;
-  for (unsigned int i = 0; i < srm->n_pairs; i++) {
-    reg1 = srm->ordered_pairs[i].r1;
+  for (unsigned int i = 0; i < n_pairs; i++) {
+    reg1 = ordered_pairs[i].r1;
     reg1 = unionfind_find(srm->uf, reg1);
 
-    reg2 = srm->ordered_pairs[i].r2;
+    reg2 = pair_r2(srm, ordered_pairs[i]);
     reg2 = unionfind_find(srm->uf, reg2);
 
     if ((reg1 != reg2) && (merge_predicate(srm, reg1, reg2)))
@@ -192,127 +709,394 @@ void segmentation(struct srm *srm) {
 
 unsigned int merge_predicate(struct srm *srm, unsigned int reg1, unsigned int reg2) {
   double dR, dG, dB;
-  double logreg1, logreg2;
-  double dev1, dev2, dev;
-
-  unsigned int offset1;
-  offset(offset1, reg1, srm->widthStep_out);
-  unsigned int offset2;
-  offset(offset2, reg2, srm->widthStep_out);
+  double dev;
 
-  dR = (double)get_r(srm->out, offset1) - (double)get_r(srm->out, offset2);
-  dR *= dR;
+  const float *mean1 = region_mean(srm, reg1);
+  const float *mean2 = region_mean(srm, reg2);
 
-  dG = (double)get_g(srm->out, offset1) - (double)get_g(srm->out, offset2);
-  dG *= dG;
+  // A gray mean has only the one value, which is compared as all 3 channels
 
-  dB = (double)get_b(srm->out, offset1) - (double)get_b(srm->out, offset2);
+  dB = (double)get_b(mean1, 0) - (double)get_b(mean2, 0);
   dB *= dB;
 
+  if (srm->mean_channels == 1) {
+    dR = dB;
+    dG = dB;
+  } else {
+    dR = (double)get_r(mean1, 0) - (double)get_r(mean2, 0);
+    dR *= dR;
+
+    dG = (double)get_g(mean1, 0) - (double)get_g(mean2, 0);
+    dG *= dG;
+  }
+
   assert(reg1 < srm->size);
-  /* printf("%i %i %i\n", reg1, srm->size, srm->sizes[reg1]); */
   assert(srm->sizes[reg1] != 0);
-  logreg1 = min(srm->g, srm->sizes[reg1]) * log(1.0 + srm->sizes[reg1]);
-  logreg2 = min(srm->g, srm->sizes[reg2]) * log(1.0 + srm->sizes[reg2]);
+  unsigned int size1 = srm->sizes[reg1];
+  unsigned int size2 = srm->sizes[reg2];
 
-  dev1 = (srm->g * srm->g) / (2.0 * srm->Q * srm->sizes[reg1]) * (logreg1 + srm->logdelta);
-  dev2 = (srm->g * srm->g) / (2.0 * srm->Q * srm->sizes[reg2]) * (logreg2 + srm->logdelta);
+  double dev1 = (size1 < srm->dev_table_size) ? srm->dev_table[size1] : region_dev(srm, size1);
+  double dev2 = (size2 < srm->dev_table_size) ? srm->dev_table[size2] : region_dev(srm, size2);
 
-  dev = dev1 + dev2;
+  dev = (dev1 + dev2) / srm->Q;
 
   return ((dR < dev) && (dG < dev) && (dB < dev));
 }
 
-void bucket_sort(struct my_pair *pairs, struct my_pair *ordered_pairs, unsigned int size) {
-  unsigned int nbe[256];
-  unsigned int cnbe[256];
-
-  for (unsigned int i = 0; i < 256; i++)
-    nbe[i] = 0;
-
-  // class all elements according to their family
-  for (unsigned int i = 0; i < size; i++)
-    nbe[pairs[i].diff]++;
+// Convert bucket counts to the index of the first element of each bucket
 
-  // cumulative histogram
+void cumulative_histogram(const unsigned int *nbe, unsigned int *cnbe) {
   cnbe[0] = 0;
   for (unsigned int i = 1; i < 256; i++)
     cnbe[i] = cnbe[i - 1] + nbe[i - 1]; // index of first element of category i
-
-  // allocation
-  for (unsigned int i = 0; i < size; i++) {
-    ordered_pairs[cnbe[pairs[i].diff]++] = pairs[i];
-  }
 }
 
-// Merge two regions
+// Merge two regions, the merged mean is stored at the new root
 void merge_regions(struct srm *srm, unsigned int reg1, unsigned int reg2) {
-  unsigned int reg = unionfind_union(srm->uf, reg1, reg2);
-
-  unsigned int offset1;
-  offset(offset1, reg1, srm->widthStep_out);
-  unsigned int offset2;
-  offset(offset2, reg2, srm->widthStep_out);
-  unsigned int offset;
-  offset(offset, reg, srm->widthStep_out);
+  unsigned int reg = srm->concurrent ? unionfind_link(srm->uf, reg1, reg2) : unionfind_union(srm->uf, reg1, reg2);
 
   assert(reg1 < srm->size);
   assert(reg2 < srm->size);
-  unsigned int new_size = srm->sizes[reg1] + srm->sizes[reg2];
-  /* printf("tutu %i %i %i\n", new_size, srm->sizes[reg1], srm->sizes[reg2]); */
-  double r_avg = (srm->sizes[reg1] * get_r(srm->out, offset1) + srm->sizes[reg2] * get_r(srm->out, offset2)) / new_size;
-  double g_avg = (srm->sizes[reg1] * get_g(srm->out, offset1) + srm->sizes[reg2] * get_g(srm->out, offset2)) / new_size;
-  double b_avg = (srm->sizes[reg1] * get_b(srm->out, offset1) + srm->sizes[reg2] * get_b(srm->out, offset2)) / new_size;
-  /* printf("titi\n"); */
+  unsigned int size1 = srm->sizes[reg1];
+  unsigned int size2 = srm->sizes[reg2];
+  unsigned int new_size = size1 + size2;
+
+  const float *mean1 = region_mean(srm, reg1);
+  const float *mean2 = region_mean(srm, reg2);
+  float *mean = region_mean(srm, reg);
 
   srm->sizes[reg] = new_size;
   assert(srm->sizes[reg] != 0);
-  set_r(srm->out, offset, (unsigned char)r_avg);
-  set_g(srm->out, offset, (unsigned char)g_avg);
-  set_b(srm->out, offset, (unsigned char)b_avg);
+
+  if (srm->mean_channels == 1) {
+    mean[0] = (size1 * mean1[0] + size2 * mean2[0]) / new_size;
+    return;
+  }
+
+  float b_avg = (size1 * get_b(mean1, 0) + size2 * get_b(mean2, 0)) / new_size;
+  float g_avg = (size1 * get_g(mean1, 0) + size2 * get_g(mean2, 0)) / new_size;
+  float r_avg = (size1 * get_r(mean1, 0) + size2 * get_r(mean2, 0)) / new_size;
+
+  set_b(mean, 0, b_avg);
+  set_g(mean, 0, g_avg);
+  set_r(mean, 0, r_avg);
 }
 
+// Merge each region smaller than smallregion into an adjacent region. The 4
+// connected pairs are visited in the sorted pair order, so a small region is
+// merged into its most similar neighbor first and both horizontal and
+// vertical neighbors are considered. A pair inside a region stays inside,
+// so each pair inside a region or merged here is dropped from the pairs and
+// only the pairs on a region boundary are kept, in order. A later
+// segmentation_merge() with a smaller Q, as in srm_run_multi_labels(), then
+// only visits the boundary pairs. When keep_pairs is set the pairs are left
+// as they are so that the same pairs can be merged again with another Q.
+
 void merge_small_regions(struct srm *srm) {
   unsigned int reg1, reg2;
+  unsigned int n_kept = 0;
 
-  unsigned int index;
-  for (unsigned int i = 0; i < srm->height; i++) {
-    for (unsigned int j = 1; j < srm->width; j++) {
-      index = index(i, j);
+  for (unsigned int i = 0; i < srm->n_pairs; i++) {
+    struct my_pair pair = srm->ordered_pairs[i];
 
-      reg1 = unionfind_find(srm->uf, index);
-      reg2 = unionfind_find(srm->uf, index - 1);
+    reg1 = unionfind_find(srm->uf, pair.r1);
+    reg2 = unionfind_find(srm->uf, pair_r2(srm, pair));
 
-      if (reg1 != reg2) {
-        if ((srm->sizes[reg1] < srm->smallregion) || (srm->sizes[reg2] < srm->smallregion))
-          merge_regions(srm, reg1, reg2);
-      }
+    if (reg1 == reg2)
+      continue;
+
+    if ((srm->sizes[reg1] < srm->smallregion) || (srm->sizes[reg2] < srm->smallregion)) {
+      merge_regions(srm, reg1, reg2);
+      continue;
     }
+
+    if (!srm->keep_pairs)
+      srm->ordered_pairs[n_kept++] = pair;
   }
+
+  if (!srm->keep_pairs)
+    srm->n_pairs = n_kept;
 }
 
 #include <stdio.h>
 
+// Write the rounded mean of a region to an output pixel
+
+static void write_mean(struct srm *srm, const float *mean, uint8_t *pixel) {
+  if (srm->mean_channels == 1) {
+    pixel[0] = (uint8_t)(mean[0] + 0.5f);
+    return;
+  }
+
+  set_r(pixel, 0, (uint8_t)(get_r(mean, 0) + 0.5f));
+  set_g(pixel, 0, (uint8_t)(get_g(mean, 0) + 0.5f));
+  set_b(pixel, 0, (uint8_t)(get_b(mean, 0) + 0.5f));
+}
+
 void finalize(struct srm *srm) {
   unsigned int index, root;
 
+  // Each output row is addressed from its start so that the widthStep of the
+  // output does not need a divide for each pixel.
+
   for (unsigned int i = 0; i < srm->height; i++) {
+    const unsigned int rowOffset = i * srm->widthStep_out;
+
     for (unsigned int j = 0; j < srm->width; j++) {
       index = index(i, j);
       root = unionfind_find(srm->uf, index);
-      unsigned int root_offset;
-      offset(root_offset, root, srm->widthStep_out);
-
-      unsigned int offset;
-      offset(offset, index, srm->widthStep_out);
-      set_r(srm->out, offset, get_r(srm->out, root_offset));
-      set_g(srm->out, offset, get_g(srm->out, root_offset));
-      set_b(srm->out, offset, get_b(srm->out, root_offset));
+      const float *mean = region_mean(srm, root);
+
+      unsigned int offset = rowOffset + srm->channels * j;
+      write_mean(srm, mean, srm->out + offset);
       
       if ((0)) {
-        fprintf(stdout, "index %5d = 0x%02X%02X%02X\n", index, get_r(srm->out, root_offset), get_g(srm->out, root_offset) ,get_b(srm->out, root_offset));
+        fprintf(stdout, "index %5d = 0x%02X%02X%02X\n", index, get_r(srm->out, offset), get_g(srm->out, offset) ,get_b(srm->out, offset));
+      }
+    }
+  }
+}
+
+
+// Write a compacted label in the range 0 -> N-1 for each pixel. Labels are
+// assigned in the order that regions are first seen in a row by row scan.
+// The rootToLabel table must hold srm->size entries. Returns the number of
+// regions N.
+
+unsigned int finalize_labels(struct srm *srm, unsigned int *rootToLabel, unsigned int widthStep_labels, int32_t *labels) {
+  unsigned int index, root;
+  unsigned int numLabels = 0;
+
+  const unsigned int noLabel = 0xFFFFFFFF;
+
+  for (unsigned int i = 0; i < srm->size; i++) {
+    rootToLabel[i] = noLabel;
+  }
+
+  for (unsigned int i = 0; i < srm->height; i++) {
+    int32_t *rowPtr = (int32_t *) (((uint8_t *) labels) + (i * widthStep_labels));
+
+    for (unsigned int j = 0; j < srm->width; j++) {
+      index = index(i, j);
+      root = unionfind_find(srm->uf, index);
+
+      if (rootToLabel[root] == noLabel) {
+        rootToLabel[root] = numLabels++;
+      }
+
+      rowPtr[j] = (int32_t) rootToLabel[root];
+    }
+  }
+
+  return numLabels;
+}
+
+// Streaming mode
+
+#define SRM_NO_LABEL 0xFFFFFFFF
+
+struct srm_stream* srm_stream_new(double Q, unsigned int width, unsigned int height, unsigned int channels, unsigned int band_rows) {
+  struct srm_stream *stream;
+  stream = malloc(sizeof(struct srm_stream));
+
+  assert(band_rows > 0);
+
+  stream->width           = width;
+  stream->height          = height;
+  stream->channels        = channels;
+  stream->band_rows       = band_rows;
+  stream->rows_done       = 0;
+  stream->Q               = Q;
+
+  // Each band is segmented together with the last row of the previous band
+  unsigned int band_size  = (band_rows + 1) * width;
+
+  stream->band            = srm_new(Q, width, band_rows + 1, channels, 0);
+  stream->band_in         = malloc(band_size * channels * sizeof(uint8_t));
+  stream->boundary_labels = malloc(width * sizeof(unsigned int));
+  stream->root_labels     = malloc(band_size * sizeof(unsigned int));
+
+  stream->n_labels        = 0;
+  stream->labels_capacity = 1024;
+  stream->labels_uf       = unionfind_new(0);
+  stream->label_sizes     = malloc(stream->labels_capacity * sizeof(unsigned int));
+  stream->label_means     = malloc(3 * stream->labels_capacity * sizeof(float));
+  stream->label_proxies   = malloc(stream->labels_capacity * sizeof(unsigned int));
+
+  return stream;
+}
+
+// Size the band context for rows rows, the merge predicate and the small
+// region threshold use the size of the whole image and not the band size.
+
+static void stream_band_reset(struct srm_stream *stream, unsigned int rows) {
+  struct srm *band = stream->band;
+  unsigned int image_size = stream->width * stream->height;
+
+  srm_reset(band, stream->Q, stream->width, rows);
+
+  band->logdelta    = 2.0 * log(6.0 * image_size);
+  band->smallregion = 0.001 * image_size;
+  fill_dev_table(band);
+}
+
+static unsigned int stream_new_label(struct srm_stream *stream) {
+  if (stream->n_labels == stream->labels_capacity) {
+    stream->labels_capacity *= 2;
+    stream->label_sizes   = realloc(stream->label_sizes, stream->labels_capacity * sizeof(unsigned int));
+    stream->label_means   = realloc(stream->label_means, 3 * stream->labels_capacity * sizeof(float));
+    stream->label_proxies = realloc(stream->label_proxies, stream->labels_capacity * sizeof(unsigned int));
+  }
+
+  unsigned int label = stream->n_labels++;
+  unionfind_grow(stream->labels_uf, stream->n_labels);
+  stream->label_proxies[label] = SRM_NO_LABEL;
+  return label;
+}
+
+// Save the size and mean of the band region rooted at root for label
+
+static void stream_save_label(struct srm_stream *stream, unsigned int label, unsigned int root) {
+  struct srm *band = stream->band;
+  stream->label_sizes[label] = band->sizes[root];
+  memcpy(&stream->label_means[3 * label], region_mean(band, root), band->mean_channels * sizeof(float));
+}
+
+void srm_stream_push(struct srm_stream *stream, unsigned int rows, unsigned int widthStep_in, const uint8_t *in,
+                     unsigned int widthStep_labels, int32_t *labels) {
+  assert(rows > 0 && rows <= stream->band_rows);
+  assert(stream->rows_done + rows <= stream->height);
+
+  struct srm *band = stream->band;
+  const unsigned int width = stream->width;
+  const unsigned int rowBytes = width * stream->channels;
+
+  // The first band has no boundary row
+  const unsigned int first_row = (stream->rows_done > 0) ? 1 : 0;
+
+  stream_band_reset(stream, rows + first_row);
+
+  // The boundary row pixels are already at the start of band_in
+  for (unsigned int i = 0; i < rows; i++) {
+    memcpy(stream->band_in + ((first_row + i) * rowBytes), in + (i * widthStep_in), rowBytes);
+  }
+
+  band->in  = stream->band_in;
+  band->widthStep_in = rowBytes;
+  band->out = NULL;
+  band->widthStep_out = 0;
+
+  initialize(band);
+
+  // Each region in the boundary row is represented by a single proxy region
+  // holding the size and mean of the whole region seen so far.
+  for (unsigned int j = 0; j < width * first_row; j++) {
+    unsigned int label = unionfind_find(stream->labels_uf, stream->boundary_labels[j]);
+    unsigned int proxy = stream->label_proxies[label];
+    unsigned int root = j;
+
+    if (proxy != SRM_NO_LABEL) {
+      root = unionfind_union(band->uf, proxy, j);
+    }
+
+    band->sizes[root] = stream->label_sizes[label];
+    memcpy(region_mean(band, root), &stream->label_means[3 * label], band->mean_channels * sizeof(float));
+    stream->label_proxies[label] = root;
+  }
+
+  for (unsigned int j = 0; j < width * first_row; j++) {
+    unsigned int label = unionfind_find(stream->labels_uf, stream->boundary_labels[j]);
+    stream->label_proxies[label] = SRM_NO_LABEL;
+  }
+
+  segmentation(band);
+  merge_small_regions(band);
+
+  for (unsigned int i = 0; i < band->size; i++) {
+    stream->root_labels[i] = SRM_NO_LABEL;
+  }
+
+  // Regions joined through the boundary row keep the label of the previous
+  // band, distinct labels that were joined in this band become equivalent.
+  for (unsigned int j = 0; j < width * first_row; j++) {
+    unsigned int root = unionfind_find(band->uf, j);
+    unsigned int label = unionfind_find(stream->labels_uf, stream->boundary_labels[j]);
+    unsigned int rootLabel = stream->root_labels[root];
+
+    if (rootLabel != SRM_NO_LABEL && rootLabel != label) {
+      label = unionfind_union(stream->labels_uf, rootLabel, label);
+    }
+
+    if (rootLabel != label) {
+      stream->root_labels[root] = label;
+      stream_save_label(stream, label, root);
+    }
+  }
+
+  for (unsigned int i = 0; i < rows; i++) {
+    int32_t *rowPtr = (int32_t *) (((uint8_t *) labels) + (i * widthStep_labels));
+
+    for (unsigned int j = 0; j < width; j++) {
+      unsigned int root = unionfind_find(band->uf, (first_row + i) * width + j);
+      unsigned int label = stream->root_labels[root];
+
+      if (label == SRM_NO_LABEL) {
+        label = stream_new_label(stream);
+        stream->root_labels[root] = label;
+        stream_save_label(stream, label, root);
       }
+
+      rowPtr[j] = (int32_t) label;
     }
   }
+
+  // The last row of this band is the boundary row for the next band
+  unsigned int last_row = first_row + rows - 1;
+  memcpy(stream->band_in, stream->band_in + (last_row * rowBytes), rowBytes);
+  const int32_t *lastLabels = (const int32_t *) (((const uint8_t *) labels) + ((rows - 1) * widthStep_labels));
+  for (unsigned int j = 0; j < width; j++) {
+    stream->boundary_labels[j] = (unsigned int) lastLabels[j];
+  }
+
+  stream->rows_done += rows;
 }
 
+unsigned int srm_stream_labels_count(struct srm_stream *stream) {
+  return stream->n_labels;
+}
+
+unsigned int srm_stream_finish(struct srm_stream *stream, int32_t *labelMap) {
+  assert(stream->rows_done == stream->height);
+
+  // Provisional labels are allocated in scan order, so visiting them in
+  // order assigns final labels in the order regions are first seen.
+  unsigned int numLabels = 0;
+
+  for (unsigned int i = 0; i < stream->n_labels; i++) {
+    stream->label_proxies[i] = SRM_NO_LABEL;
+  }
+
+  for (unsigned int i = 0; i < stream->n_labels; i++) {
+    unsigned int root = unionfind_find(stream->labels_uf, i);
+
+    if (stream->label_proxies[root] == SRM_NO_LABEL) {
+      stream->label_proxies[root] = numLabels++;
+    }
+
+    labelMap[i] = (int32_t) stream->label_proxies[root];
+  }
+
+  return numLabels;
+}
+
+void srm_stream_delete(struct srm_stream *stream) {
+  srm_delete(stream->band);
+  free(stream->band_in);
+  free(stream->boundary_labels);
+  free(stream->root_labels);
+  unionfind_delete(stream->labels_uf);
+  free(stream->label_sizes);
+  free(stream->label_means);
+  free(stream->label_proxies);
+  free(stream);
+}
@@ -2,10 +2,19 @@
 extern "C" {
 #endif
 
+// Number of region sizes with a precomputed merge predicate deviation
+
+#ifndef SRM_DEV_TABLE_SIZE
+#define SRM_DEV_TABLE_SIZE 4096
+#endif
+
+// A packed pair of C4 neighbor pixels, r2 is the pixel to the right of r1
+// or the pixel below r1 when vertical is set.
+
 struct my_pair {
   unsigned int r1;
-  unsigned int r2;
-  unsigned int diff;
+  uint8_t diff;
+  uint8_t vertical;
 };
 
 struct srm {
@@ -13,7 +22,9 @@ struct srm {
   unsigned int height;
   unsigned int size;
   unsigned int channels;
-  uint8_t *in;
+  // Number of values in the mean of a region, 1 for gray and 3 for BGR or BGRA
+  unsigned int mean_channels;
+  const uint8_t *in;
   uint8_t *out;
   unsigned int *sizes;
   double logdelta;
@@ -22,17 +33,131 @@ struct srm {
   double Q;
   struct unionfind *uf;
   unsigned int borders;
-  struct my_pair *pairs;
+  uint8_t *diffs;
   unsigned int n_pairs;
   struct my_pair *ordered_pairs;
   unsigned int widthStep_in;
   unsigned int widthStep_out;
+  float *means;
+  double *dev_table;
+  unsigned int dev_table_size;
+  unsigned int capacity;
+  unsigned int pairs_capacity;
+  unsigned int tile_rows;
+  unsigned int concurrent;
+  unsigned int keep_pairs;
 };
 
+// The pixels have 1 gray channel, 3 BGR channels or 4 BGRA channels. Only the
+// gray or BGR values are compared, the alpha of a BGRA pixel is copied to the
+// output unchanged.
 struct srm* srm_new(double Q, unsigned int width, unsigned int height, unsigned int channels, unsigned int borders);
-void srm_run(struct srm *srm, unsigned int widthStep_in, uint8_t *in, unsigned int widthStep_out, uint8_t *out);
+void srm_reset(struct srm *srm, double Q, unsigned int width, unsigned int height);
+void srm_run(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int widthStep_out, uint8_t *out);
+
+// Label mode, instead of writing the average color of each region this
+// method writes a unique 0 -> N-1 int label for each region into labels.
+// The widthStep_labels value is the row size in bytes. Returns N.
+unsigned int srm_run_labels(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int widthStep_labels, int32_t *labels);
+
+// Hierarchical label mode, the pairs are generated and sorted once and then
+// each Q in Qs is merged from the largest Q to the smallest. Each level is a
+// coarser version of the level with the next larger Q. The labels for Qs[i]
+// are written to labels[i] and the number of regions to counts[i].
+void srm_run_multi_labels(struct srm *srm, unsigned int widthStep_in, const uint8_t *in,
+                          unsigned int n_levels, const double *Qs,
+                          unsigned int widthStep_labels, int32_t **labels, unsigned int *counts);
+
+// Auto Q mode, a binary search on Q between Q_min and Q_max looks for a Q that
+// generates between min_regions and max_regions regions. The pairs are sorted
+// once and each trial Q costs one merge pass over the sorted pairs. At most
+// max_trials Q values are tried, returns the Q that came closest to the range
+// and writes its region count into n_regions. The regions are left merged for
+// that Q, so a parallel finalize can be used to write the output.
+double srm_run_auto_q(struct srm *srm, unsigned int widthStep_in, const uint8_t *in,
+                      unsigned int min_regions, unsigned int max_regions,
+                      double Q_min, double Q_max, unsigned int max_trials,
+                      unsigned int *n_regions);
+
+// Tiled mode, srm_tiled_begin() returns the number of tiles N and then
+// srm_tiled_segment_tile() must be invoked for each tile 0 -> N-1. The
+// different tiles can be processed at the same time on different threads.
+// Once all tiles are processed srm_tiled_finish() merges the pairs along
+// the tile seams and then one of the finalize methods writes the output.
+// Pass NULL for out when only srm_tiled_finalize_labels() will be used.
+unsigned int srm_tiled_begin(struct srm *srm, unsigned int tile_rows,
+                             unsigned int widthStep_in, const uint8_t *in,
+                             unsigned int widthStep_out, uint8_t *out);
+void srm_tiled_segment_tile(struct srm *srm, unsigned int tile);
+void srm_tiled_finish(struct srm *srm);
+void srm_tiled_finalize(struct srm *srm);
+unsigned int srm_tiled_finalize_labels(struct srm *srm, unsigned int widthStep_labels, int32_t *labels);
+
+// Parallel finalize, srm_run_segment() is srm_run() without the finalize
+// step, pass NULL for out when only the labels are needed. Once the regions
+// are merged, either by srm_run_segment() or by srm_tiled_finish(), the rows
+// of the image can be finalized on different threads. srm_flatten_rows()
+// writes the root index of each pixel in rows row_start -> row_end into
+// roots and srm_finalize_rows() writes the average color of each pixel in
+// the rows into out. Distinct rows can be processed at the same time. The
+// region sizes are not needed once merged, so srm->sizes can be reused as a
+// srm->size entry root to label table.
+void srm_run_segment(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int widthStep_out, uint8_t *out);
+
+// Precomputed diffs mode, srm_run_segment() with the pair diffs computed by the
+// caller, for example on a GPU. The caller writes the max channel diff of each
+// pixel and the pixel to its right into srm_diffs(srm)[y * width + x] and the
+// diff of each pixel and the pixel below into srm_diffs(srm)[size + y * width + x],
+// the last column of the right diffs and the last row of the below diffs are not
+// read. histogram[d] is the number of pairs with diff d. The merge is the same as
+// srm_run_segment(), so the regions are the same as long as the diffs are.
+uint8_t* srm_diffs(struct srm *srm);
+void srm_run_segment_diffs(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, const unsigned int *histogram,
+                           unsigned int widthStep_out, uint8_t *out);
+void srm_flatten_rows(struct srm *srm, unsigned int row_start, unsigned int row_end, unsigned int widthStep_roots, int32_t *roots);
+void srm_finalize_rows(struct srm *srm, unsigned int row_start, unsigned int row_end);
+
+// Streaming mode, the image is fed to srm_stream_push() as a series of row
+// bands from top to bottom so that the whole image never needs to be in
+// memory. Only the current band and the last row of the previous band are
+// segmented at a time, the regions that touch that boundary row carry their
+// size and mean into the next band. Each push writes provisional labels for
+// the rows in the band, regions can still be joined by later bands so once
+// all rows are pushed srm_stream_finish() fills in a table that maps each
+// provisional label to a final 0 -> N-1 label and returns N. The table must
+// hold srm_stream_labels_count() entries. Small regions are merged per band,
+// so the result is close to but not the same as a full image segmentation.
+// Use bands of at least a few dozen rows, very short bands make each merge
+// decision with too little context.
+
+struct srm_stream {
+  unsigned int width;
+  unsigned int height;
+  unsigned int channels;
+  unsigned int band_rows;
+  unsigned int rows_done;
+  double Q;
+  struct srm *band;
+  uint8_t *band_in;
+  unsigned int *boundary_labels;
+  unsigned int *root_labels;
+  struct unionfind *labels_uf;
+  unsigned int n_labels;
+  unsigned int labels_capacity;
+  unsigned int *label_sizes;
+  float *label_means;
+  unsigned int *label_proxies;
+};
+
+struct srm_stream* srm_stream_new(double Q, unsigned int width, unsigned int height, unsigned int channels, unsigned int band_rows);
+void srm_stream_push(struct srm_stream *stream, unsigned int rows, unsigned int widthStep_in, const uint8_t *in,
+                     unsigned int widthStep_labels, int32_t *labels);
+unsigned int srm_stream_labels_count(struct srm_stream *stream);
+unsigned int srm_stream_finish(struct srm_stream *stream, int32_t *labelMap);
+void srm_stream_delete(struct srm_stream *stream);
+
 unsigned int srm_regions_count(struct srm *srm);
-unsigned int* srm_regions(struct srm *srm);
+unsigned int srm_region(struct srm *srm, unsigned int index);
 unsigned int* srm_regions_sizes(struct srm *srm);
 void srm_delete(struct srm *srm);
 
@@ -0,0 +1,95 @@
+// posix_memalign() is POSIX, madvise() and MADV_HUGEPAGE are not and need the
+// default glibc features
+
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "srm_alloc.h"
+
+static volatile int alloc_policy_init = 0;
+static volatile unsigned int alloc_policy = SRM_ALLOC_DEFAULT;
+
+static unsigned int alloc_policy_from_environment(void) {
+  const char *value = getenv("SEGMENTATION_ALLOC_POLICY");
+  unsigned int policy = SRM_ALLOC_DEFAULT;
+
+  if (value == NULL)
+    return policy;
+
+  if (strstr(value, "hugepages") != NULL)
+    policy |= SRM_ALLOC_HUGE_PAGES;
+  if (strstr(value, "firsttouch") != NULL)
+    policy |= SRM_ALLOC_FIRST_TOUCH;
+
+  return policy;
+}
+
+void srm_set_alloc_policy(unsigned int policy) {
+  alloc_policy = policy;
+  alloc_policy_init = 1;
+}
+
+// A race on the first read only reads the environment twice
+
+unsigned int srm_get_alloc_policy(void) {
+  if (!alloc_policy_init) {
+    alloc_policy = alloc_policy_from_environment();
+    alloc_policy_init = 1;
+  }
+  return alloc_policy;
+}
+
+void srm_advise_large(void *ptr, size_t bytes) {
+  unsigned int policy = srm_get_alloc_policy();
+
+  if (ptr == NULL || bytes < SRM_ALLOC_LARGE_BYTES || policy == SRM_ALLOC_DEFAULT)
+    return;
+
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  uintptr_t start = ((uintptr_t) ptr + page_size - 1) & ~(uintptr_t) (page_size - 1);
+  uintptr_t end = ((uintptr_t) ptr + bytes) & ~(uintptr_t) (page_size - 1);
+
+  if (end <= start)
+    return;
+
+#if defined(MADV_HUGEPAGE)
+  if (policy & SRM_ALLOC_HUGE_PAGES)
+    madvise((void *) start, end - start, MADV_HUGEPAGE);
+#endif
+
+  // Read and write back one byte of each page so that a page that is not
+  // mapped yet is faulted in on this thread without changing the contents
+
+  if (policy & SRM_ALLOC_FIRST_TOUCH) {
+    for (uintptr_t p = start; p < end; p += page_size) {
+      volatile uint8_t *byte = (volatile uint8_t *) p;
+      *byte = *byte;
+    }
+  }
+}
+
+void* srm_alloc_large(size_t bytes) {
+  unsigned int policy = srm_get_alloc_policy();
+  void *ptr = NULL;
+
+  if (bytes < SRM_ALLOC_LARGE_BYTES || policy == SRM_ALLOC_DEFAULT)
+    return malloc(bytes);
+
+  if (policy & SRM_ALLOC_HUGE_PAGES) {
+    if (posix_memalign(&ptr, SRM_ALLOC_HUGE_PAGE_BYTES, bytes) != 0)
+      return NULL;
+  } else {
+    ptr = malloc(bytes);
+  }
+
+  srm_advise_large(ptr, bytes);
+
+  return ptr;
+}
@@ -0,0 +1,42 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// Allocation policy for the large per pixel buffers of SRM. The union find
+// nodes, region sizes and means and the sorted pairs are read in a random order
+// by the merge, so with 4K pages most reads of a large image miss the TLB.
+// With SRM_ALLOC_HUGE_PAGES a buffer of at least SRM_ALLOC_LARGE_BYTES is
+// aligned to a huge page and marked with madvise(MADV_HUGEPAGE) where the
+// platform supports transparent huge pages. With SRM_ALLOC_FIRST_TOUCH the
+// pages of such a buffer are written as it is allocated, so that they are
+// placed on the NUMA node of the allocating thread, the worker that runs
+// the SRM, and not on the node of whichever thread writes them first.
+//
+// The policy is read from SEGMENTATION_ALLOC_POLICY the first time a buffer is
+// allocated, as a comma separated list of "hugepages" and "firsttouch". It
+// should be set before any SRM runs since a buffer keeps the policy it was
+// allocated with.
+
+#define SRM_ALLOC_DEFAULT 0
+#define SRM_ALLOC_HUGE_PAGES 1
+#define SRM_ALLOC_FIRST_TOUCH 2
+
+#define SRM_ALLOC_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+#define SRM_ALLOC_LARGE_BYTES SRM_ALLOC_HUGE_PAGE_BYTES
+
+void srm_set_alloc_policy(unsigned int policy);
+unsigned int srm_get_alloc_policy(void);
+
+// Allocate a buffer that is released with free(), a small buffer or the
+// default policy is a plain malloc().
+void* srm_alloc_large(size_t bytes);
+
+// Apply the policy to a buffer that was allocated elsewhere, the pages entirely
+// inside the buffer are advised and touched. The contents are not changed.
+void srm_advise_large(void *ptr, size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,124 @@
+// OpenCL pair diff and histogram kernel for SRM, see srm_ocl.h. The kernel is
+// built once for each channel count with CN defined, the alpha of a BGRA pixel
+// is not compared as in srm_simd.cpp.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
+
+#include "srm.h"
+#include "srm_ocl.h"
+
+using namespace cv;
+
+static const char *srmOclSource =
+"#define COLOR_CN ((CN == 4) ? 3 : CN)\n"
+"\n"
+"inline uint pixel_max_diff(__global const uchar *p1, __global const uchar *p2)\n"
+"{\n"
+"  uint m = 0;\n"
+"  for (int c = 0; c < COLOR_CN; c++) {\n"
+"    m = max(m, (uint) abs_diff(p1[c], p2[c]));\n"
+"  }\n"
+"  return m;\n"
+"}\n"
+"\n"
+"__kernel void srm_pair_diffs(__global const uchar *in, int in_step, int in_offset,\n"
+"                             int width, int height,\n"
+"                             __global uchar *diffs, __global uint *histogram)\n"
+"{\n"
+"  __local uint local_histogram[256];\n"
+"\n"
+"  const int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);\n"
+"  const int lsize = get_local_size(0) * get_local_size(1);\n"
+"\n"
+"  for (int i = lid; i < 256; i += lsize)\n"
+"    local_histogram[i] = 0;\n"
+"\n"
+"  barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"  const int x = get_global_id(0);\n"
+"  const int y = get_global_id(1);\n"
+"\n"
+"  if (x < width && y < height) {\n"
+"    __global const uchar *pixel = in + in_offset + y * in_step + x * CN;\n"
+"    const int index = y * width + x;\n"
+"\n"
+"    if (x < width - 1) {\n"
+"      uint d = pixel_max_diff(pixel, pixel + CN);\n"
+"      diffs[index] = (uchar) d;\n"
+"      atomic_inc(&local_histogram[d]);\n"
+"    }\n"
+"\n"
+"    if (y < height - 1) {\n"
+"      uint d = pixel_max_diff(pixel, pixel + in_step);\n"
+"      diffs[width * height + index] = (uchar) d;\n"
+"      atomic_inc(&local_histogram[d]);\n"
+"    }\n"
+"  }\n"
+"\n"
+"  barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"  for (int i = lid; i < 256; i += lsize) {\n"
+"    if (local_histogram[i] != 0)\n"
+"      atomic_add(&histogram[i], local_histogram[i]);\n"
+"  }\n"
+"}\n";
+
+// The work group is 16 x 16 pixels, the global size is rounded up to it
+
+static const int srmOclGroupSize = 16;
+
+int srm_ocl_available(void) {
+  return (ocl::haveOpenCL() && ocl::useOpenCL()) ? 1 : 0;
+}
+
+int srm_ocl_pair_diffs(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int *histogram) {
+  if (!srm_ocl_available() || srm->width < 2 || srm->height < 2)
+    return 0;
+
+  const int width = (int) srm->width;
+  const int height = (int) srm->height;
+  const int channels = (int) srm->channels;
+
+  ocl::ProgramSource source(srmOclSource);
+  String errmsg;
+  ocl::Kernel kernel("srm_pair_diffs", source, format("-D CN=%d", channels), &errmsg);
+
+  if (kernel.empty())
+    return 0;
+
+  Mat inMat(height, width, CV_8UC(channels), (void *) in, widthStep_in);
+  UMat inUMat = inMat.getUMat(ACCESS_READ);
+  UMat diffsUMat(2 * height, width, CV_8UC1);
+  UMat histogramUMat(1, 256, CV_32SC1, Scalar(0));
+
+  kernel.args(ocl::KernelArg::ReadOnlyNoSize(inUMat), width, height,
+              ocl::KernelArg::PtrWriteOnly(diffsUMat), ocl::KernelArg::PtrReadWrite(histogramUMat));
+
+  size_t globalSize[2] = {
+    (size_t) ((width + srmOclGroupSize - 1) / srmOclGroupSize) * srmOclGroupSize,
+    (size_t) ((height + srmOclGroupSize - 1) / srmOclGroupSize) * srmOclGroupSize
+  };
+  size_t localSize[2] = { (size_t) srmOclGroupSize, (size_t) srmOclGroupSize };
+
+  if (!kernel.run(2, globalSize, localSize, true))
+    return 0;
+
+  Mat diffsMat(2 * height, width, CV_8UC1, srm_diffs(srm));
+  diffsUMat.copyTo(diffsMat);
+
+  Mat histogramMat(1, 256, CV_32SC1, histogram);
+  histogramUMat.copyTo(histogramMat);
+
+  // A histogram that does not count every pair would write the sorted pairs
+  // out of bounds, so a device that got it wrong falls back to the CPU
+
+  uint64_t numPairs = 0;
+  for (int i = 0; i < 256; i++)
+    numPairs += histogram[i];
+
+  return (numPairs == (uint64_t) (2 * (width - 1) * (height - 1) + (height - 1) + (width - 1))) ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct srm;
+
+// OpenCL pair diffs for SRM through the OpenCV T-API. The diff of each C4 pair
+// and the histogram of the diffs are computed on the device and the diffs are
+// read back into srm_diffs(srm), so that srm_run_segment_diffs() only sorts and
+// merges the pairs on the CPU. The merge is sequential in diff order since each
+// merge_predicate() depends on the regions the earlier pairs merged, so the
+// regions are the same as with srm_run_segment().
+
+// Returns 1 when the T-API has an OpenCL device to run on
+int srm_ocl_available(void);
+
+// Compute the diffs of the pixels in, which has the width, height and channels
+// of the srm context, and write the 256 bucket histogram. Returns 0 when the
+// kernel could not be built or run, the caller then computes the diffs on the CPU.
+int srm_ocl_pair_diffs(struct srm *srm, unsigned int widthStep_in, const uint8_t *in, unsigned int *histogram);
+
+#ifdef __cplusplus
+}
+#endif
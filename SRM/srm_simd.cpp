@@ -0,0 +1,122 @@
+// Vectorized pixel diff kernels for SRM. The C implementation in srm.c calls
+// into these row kernels so that the universal intrinsics from OpenCV can
+// be used to generate SSE2 or NEON code depending on the target. Each kernel
+// is instantiated for 1, 3 and 4 channel pixels so that the channel loop is
+// unrolled and a gray or BGRA row is read without a conversion to BGR.
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <opencv2/core/hal/intrin.hpp>
+
+#include "srm_simd.h"
+
+// Number of channels that are compared, the alpha of a BGRA pixel is ignored
+
+template <int CN>
+struct SRMColorChannels {
+  enum { value = (CN == 4) ? 3 : CN };
+};
+
+template <int CN>
+static inline uint8_t pixelMaxDiff(const uint8_t *p1, const uint8_t *p2) {
+  uint8_t m = 0;
+  for (int c = 0; c < SRMColorChannels<CN>::value; c++) {
+    uint8_t d = p1[c] > p2[c] ? p1[c] - p2[c] : p2[c] - p1[c];
+    m = d > m ? d : m;
+  }
+  return m;
+}
+
+#if CV_SIMD128
+
+// Max channel diff of the 16 pixels at p1 and the 16 pixels at p2
+
+template <int CN>
+static inline cv::v_uint8x16 loadMaxDiff16(const uint8_t *p1, const uint8_t *p2);
+
+template <>
+inline cv::v_uint8x16 loadMaxDiff16<1>(const uint8_t *p1, const uint8_t *p2) {
+  return cv::v_absdiff(cv::v_load(p1), cv::v_load(p2));
+}
+
+template <>
+inline cv::v_uint8x16 loadMaxDiff16<3>(const uint8_t *p1, const uint8_t *p2) {
+  cv::v_uint8x16 b1, g1, r1, b2, g2, r2;
+  cv::v_load_deinterleave(p1, b1, g1, r1);
+  cv::v_load_deinterleave(p2, b2, g2, r2);
+  return cv::v_max(cv::v_absdiff(b1, b2), cv::v_max(cv::v_absdiff(g1, g2), cv::v_absdiff(r1, r2)));
+}
+
+template <>
+inline cv::v_uint8x16 loadMaxDiff16<4>(const uint8_t *p1, const uint8_t *p2) {
+  cv::v_uint8x16 b1, g1, r1, a1, b2, g2, r2, a2;
+  cv::v_load_deinterleave(p1, b1, g1, r1, a1);
+  cv::v_load_deinterleave(p2, b2, g2, r2, a2);
+  return cv::v_max(cv::v_absdiff(b1, b2), cv::v_max(cv::v_absdiff(g1, g2), cv::v_absdiff(r1, r2)));
+}
+
+#endif // CV_SIMD128
+
+template <int CN>
+static void rowDiffsH(const uint8_t *row, unsigned int width, uint8_t *diffs) {
+  unsigned int j = 0;
+
+#if CV_SIMD128
+  // Reading 16 pixels starting at j+1 needs j+16 < width
+  for ( ; j + 16 < width; j += 16) {
+    cv::v_store(diffs + j, loadMaxDiff16<CN>(row + CN * j, row + CN * (j + 1)));
+  }
+#endif // CV_SIMD128
+
+  for ( ; j + 1 < width; j++) {
+    diffs[j] = pixelMaxDiff<CN>(row + CN * j, row + CN * (j + 1));
+  }
+}
+
+template <int CN>
+static void rowDiffsV(const uint8_t *row, const uint8_t *rowBelow, unsigned int width, uint8_t *diffs) {
+  unsigned int j = 0;
+
+#if CV_SIMD128
+  for ( ; j + 16 <= width; j += 16) {
+    cv::v_store(diffs + j, loadMaxDiff16<CN>(row + CN * j, rowBelow + CN * j));
+  }
+#endif // CV_SIMD128
+
+  for ( ; j < width; j++) {
+    diffs[j] = pixelMaxDiff<CN>(row + CN * j, rowBelow + CN * j);
+  }
+}
+
+void srm_row_diffs_h(const uint8_t *row, unsigned int width, unsigned int channels, uint8_t *diffs) {
+  switch (channels) {
+    case 1:
+      rowDiffsH<1>(row, width, diffs);
+      break;
+    case 3:
+      rowDiffsH<3>(row, width, diffs);
+      break;
+    case 4:
+      rowDiffsH<4>(row, width, diffs);
+      break;
+    default:
+      assert(0);
+  }
+}
+
+void srm_row_diffs_v(const uint8_t *row, const uint8_t *rowBelow, unsigned int width, unsigned int channels, uint8_t *diffs) {
+  switch (channels) {
+    case 1:
+      rowDiffsV<1>(row, rowBelow, width, diffs);
+      break;
+    case 3:
+      rowDiffsV<3>(row, rowBelow, width, diffs);
+      break;
+    case 4:
+      rowDiffsV<4>(row, rowBelow, width, diffs);
+      break;
+    default:
+      assert(0);
+  }
+}
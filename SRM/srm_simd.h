@@ -0,0 +1,20 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Max channel absolute difference between each pixel in a row and the pixel
+// to its right. A pixel has 1 gray channel, 3 BGR channels or 4 BGRA channels,
+// the alpha channel is not compared. Writes width-1 diffs.
+
+void srm_row_diffs_h(const uint8_t *row, unsigned int width, unsigned int channels, uint8_t *diffs);
+
+// Max channel absolute difference between each pixel in a row and the pixel
+// directly below it in rowBelow. Writes width diffs.
+
+void srm_row_diffs_v(const uint8_t *row, const uint8_t *rowBelow, unsigned int width, unsigned int channels, uint8_t *diffs);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "unionfind.h"
+#include "srm_alloc.h"
 
 struct unionfind* unionfind_new(unsigned int size) {
   struct unionfind *uf;
@@ -8,8 +9,8 @@ struct unionfind* unionfind_new(unsigned int size) {
 
   uf->count = size;
   uf->size = size;
-  uf->weights = malloc(size * sizeof(unsigned int));
-  uf->parents = malloc(size * sizeof(unsigned int));
+  uf->capacity = size;
+  uf->nodes = srm_alloc_large(size * sizeof(struct unionfind_node));
 
   unionfind_init(uf);
 
@@ -17,59 +18,94 @@ struct unionfind* unionfind_new(unsigned int size) {
 }
 
 void unionfind_init(struct unionfind *uf) {
+  uf->count = uf->size;
+
   for (unsigned int i = 0; i < uf->size; i++) {
-    uf->weights[i] = 1;
-    uf->parents[i] = i;
+    uf->nodes[i].parent = i;
+    uf->nodes[i].rank = 0;
+  }
+
+}
+
+/* Resize for a new number of nodes, keeps the existing arrays when large enough */
+void unionfind_reset(struct unionfind *uf, unsigned int size) {
+  if (size > uf->capacity) {
+    free(uf->nodes);
+    uf->nodes = srm_alloc_large(size * sizeof(struct unionfind_node));
+    uf->capacity = size;
   }
 
+  /* Note that unionfind_init() must be invoked before the next use */
+  uf->size = size;
+  uf->count = size;
+}
+
+/* Grow to size nodes while keeping the existing sets, each new node is
+   a set of its own */
+void unionfind_grow(struct unionfind *uf, unsigned int size) {
+  if (size > uf->capacity) {
+    unsigned int capacity = uf->capacity * 2;
+    if (capacity < size)
+      capacity = size;
+    uf->nodes = realloc(uf->nodes, capacity * sizeof(struct unionfind_node));
+    uf->capacity = capacity;
+    srm_advise_large(uf->nodes, capacity * sizeof(struct unionfind_node));
+  }
+
+  for (unsigned int i = uf->size; i < size; i++) {
+    uf->nodes[i].parent = i;
+    uf->nodes[i].rank = 0;
+  }
+
+  uf->count += size - uf->size;
+  uf->size = size;
 }
 
 unsigned int unionfind_find(struct unionfind *uf, unsigned int id) {
-  /* Finding the root */
-  unsigned int root = uf->parents[id];
-  unsigned int previous;
-
-  do {
-    previous = root;
-    root = uf->parents[root];
-  } while (root != previous);
-
-  /* Path compression */
-  unsigned int next = id;
-  unsigned int tmp;
-  do {
-    tmp = next;
-    next = uf->parents[tmp];
-    uf->parents[tmp] = root;
-  } while (root != next);
+  struct unionfind_node *nodes = uf->nodes;
+
+  /* Path halving, each node on the path is pointed at its grandparent
+     so that the root is found in a single pass */
+  while (nodes[id].parent != id) {
+    unsigned int grandparent = nodes[nodes[id].parent].parent;
+    nodes[id].parent = grandparent;
+    id = grandparent;
+  }
 
-  return root;
+  return id;
 }
 
 unsigned int unionfind_union(struct unionfind *uf, unsigned int i1, unsigned int i2) {
+  unsigned int root = unionfind_link(uf, i1, i2);
+
+  uf->count--;
+
+  return root;
+}
+
+/* Union without updating count, this can be invoked from multiple threads
+   as long as each thread operates on a distinct set of nodes */
+unsigned int unionfind_link(struct unionfind *uf, unsigned int i1, unsigned int i2) {
   i1 = unionfind_find(uf, i1);
   i2 = unionfind_find(uf, i2);
 
-  unsigned int w1 = uf->weights[i1];
-  unsigned int w2 = uf->weights[i2];
+  struct unionfind_node *n1 = &uf->nodes[i1];
+  struct unionfind_node *n2 = &uf->nodes[i2];
 
-  /* i1 will be the heaviest set */
-  if (w2 > w1) {
-    unsigned int tmp;
+  /* i1 will be the root with the largest rank */
+  if (n2->rank > n1->rank) {
+    struct unionfind_node *tmpNode = n1;
+    n1 = n2;
+    n2 = tmpNode;
 
-    tmp = i1;
+    unsigned int tmp = i1;
     i1 = i2;
     i2 = tmp;
-    
-    tmp = w1;
-    w1 = w2;
-    w2 = tmp;
+  } else if (n2->rank == n1->rank) {
+    n1->rank++;
   }
 
-  uf->weights[i1] += w2;
-  uf->parents[i2] = i1;
-
-  uf->count--;
+  n2->parent = i1;
 
   return i1;
 }
@@ -78,9 +114,20 @@ unsigned int unionfind_count(struct unionfind *uf) {
   return uf->count;
 }
 
+/* Recalculate count as the number of roots */
+void unionfind_recount(struct unionfind *uf) {
+  unsigned int count = 0;
+
+  for (unsigned int i = 0; i < uf->size; i++) {
+    if (uf->nodes[i].parent == i)
+      count++;
+  }
+
+  uf->count = count;
+}
+
 void unionfind_delete(struct unionfind *uf) {
-  free(uf->weights);
-  free(uf->parents);
+  free(uf->nodes);
   free(uf);
 }
 
@@ -1,14 +1,41 @@
+#include <stdint.h>
+
+/* The rank of a root is bounded by log2 of the number of nodes, define
+   UNIONFIND_RANK16 to store a 16 bit rank and pack each node into 6 bytes */
+
+#if defined(UNIONFIND_RANK16)
+typedef uint16_t unionfind_rank_t;
+#pragma pack(push, 2)
+#else
+typedef uint32_t unionfind_rank_t;
+#endif
+
+/* The parent and rank of a node are interleaved so that a find touches
+   a single cache line per node */
+
+struct unionfind_node {
+  unsigned int parent;
+  unionfind_rank_t rank;
+};
+
+#if defined(UNIONFIND_RANK16)
+#pragma pack(pop)
+#endif
+
 struct unionfind {
   unsigned int size;
   unsigned int count;
-  unsigned int* weights;
-  unsigned int* parents;
+  unsigned int capacity;
+  struct unionfind_node* nodes;
 };
 
 struct unionfind* unionfind_new(unsigned int size);
 void unionfind_init(struct unionfind *uf);
+void unionfind_reset(struct unionfind *uf, unsigned int size);
+void unionfind_grow(struct unionfind *uf, unsigned int size);
 unsigned int unionfind_find(struct unionfind *uf, unsigned int id);
 unsigned int unionfind_union(struct unionfind *uf, unsigned int i1, unsigned int i2);
+unsigned int unionfind_link(struct unionfind *uf, unsigned int i1, unsigned int i2);
 unsigned int unionfind_count(struct unionfind *uf);
+void unionfind_recount(struct unionfind *uf);
 void unionfind_delete(struct unionfind *uf);
-
@@ -157,6 +157,109 @@
   XCTAssert(containsTreeMap.size() == 1, @"map");
 }
 
+// The parallel edge parse must find the same neighbors as the serial parse,
+// including neighbors that only touch at a diagonal and across stripe seams.
+
+- (void)testParseEdgesParallel {
+  
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(2), @(1), @(3),
+                         @(4), @(4), @(3), @(1),
+                         @(4), @(5), @(5), @(5)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  XCTAssert(spImage.superpixels.size() == 6, @"num sumperpixels");
+  
+  // Tag 3 (2 + 1) only touches tag 4 (3 + 1) at a diagonal
+  
+  vector<int32_t> neighbors = spImage.edgeTable.getNeighbors(3);
+  vector<int32_t> expected = { 1, 2, 4, 5 };
+  XCTAssert(neighbors == expected, @"neighbors");
+  
+  for ( int stripeRows = 0; stripeRows <= 4; stripeRows++ ) {
+    SuperpixelImage serialImage;
+    serialImage.superpixels = spImage.superpixels;
+    
+    SuperpixelImage parallelImage;
+    parallelImage.superpixels = spImage.superpixels;
+    
+    worked = SuperpixelImage::parseSuperpixelEdges(tagsImg, serialImage);
+    XCTAssert(worked, @"parseSuperpixelEdges");
+    
+    worked = SuperpixelImage::parseSuperpixelEdgesParallel(tagsImg, parallelImage, stripeRows);
+    XCTAssert(worked, @"parseSuperpixelEdgesParallel");
+    
+    for ( int32_t tag : spImage.superpixels ) {
+      XCTAssert(serialImage.edgeTable.getNeighbors(tag) == parallelImage.edgeTable.getNeighbors(tag), @"neighbors");
+    }
+  }
+}
+
+// A lazy merge must leave the same superpixels, coords and neighbors as an
+// eager merge once the neighbors are accessed.
+
+- (void)testLazyMergeEdge {
+  
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(2), @(1), @(3),
+                         @(4), @(4), @(3), @(1),
+                         @(4), @(5), @(5), @(5)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat lazyTagsImg = tagsImg.clone();
+  
+  SuperpixelImage eagerImage;
+  SuperpixelImage lazyImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, eagerImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  worked = SuperpixelImage::parse(lazyTagsImg, lazyImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  lazyImage.edgeTable.lazyMerge = true;
+  
+  // Merge 3 into 2, then 4 into the result, then 6 into 5
+  
+  int32_t mergeTags[] = { 3, 2, 4, 2, 6, 5 };
+  
+  for ( int i = 0; i < 6; i += 2 ) {
+    SuperpixelEdge edge(mergeTags[i], mergeTags[i+1]);
+    eagerImage.mergeEdge(edge);
+    lazyImage.mergeEdge(edge);
+  }
+  
+  XCTAssert(eagerImage.superpixels == lazyImage.superpixels, @"superpixels");
+  XCTAssert(lazyImage.superpixels.size() == 3, @"num sumperpixels");
+  
+  for ( int32_t tag : eagerImage.superpixels ) {
+    Superpixel *eagerPtr = eagerImage.getSuperpixelPtr(tag);
+    Superpixel *lazyPtr = lazyImage.getSuperpixelPtr(tag);
+    XCTAssert(lazyPtr != NULL, @"superpixel");
+    
+    NSArray *eagerCoords = [self.class formatSuperpixelCoords:eagerPtr];
+    NSArray *lazyCoords = [self.class formatSuperpixelCoords:lazyPtr];
+    XCTAssert([eagerCoords isEqualToArray:lazyCoords], @"coords");
+    
+    XCTAssert(eagerImage.edgeTable.getNeighbors(tag) == lazyImage.edgeTable.getNeighbors(tag), @"neighbors");
+  }
+}
+
 - (void)testParse2x2Containment {
   
   NSArray *pixelsArr = @[
@@ -387,4 +490,141 @@
   }
 }
 
+// Nested (0+1) contains (1+1) which contains (2+1), the flat tree should
+// match the map built by recurseSuperpixelContainment()
+
+- (void)testContainmentTreeNested {
+  
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(0), @(0), @(0),
+                         @(0), @(1), @(1), @(1), @(0),
+                         @(0), @(1), @(2), @(1), @(0),
+                         @(0), @(1), @(1), @(1), @(0),
+                         @(0), @(0), @(0), @(0), @(0),
+                         ];
+  
+  Mat tagsImg(5, 5, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  SuperpixelContainmentTree tree;
+  
+  buildSuperpixelContainmentTree(spImage, tagsImg, tree);
+  
+  vector<int32_t> rootTags = tree.getRootTags();
+  XCTAssert(rootTags.size() == 1, @"roots");
+  XCTAssert(rootTags[0] == 1, @"roots");
+  
+  vector<int32_t> childTags;
+  
+  tree.getChildTags(tree.rootNodes[0], childTags);
+  XCTAssert(childTags.size() == 1, @"children");
+  XCTAssert(childTags[0] == 2, @"children");
+  
+  vector<int32_t> insideOut = tree.getInsideOutOrder();
+  vector<int32_t> expectedInsideOut = { 3, 2, 1 };
+  XCTAssert(insideOut == expectedInsideOut, @"inside out");
+  
+  unordered_map<int32_t, vector<int32_t> > containsTreeMap;
+  
+  vector<int32_t> mapRootTags = recurseSuperpixelContainment(spImage, tagsImg, containsTreeMap);
+  XCTAssert(mapRootTags == rootTags, @"roots");
+  
+  XCTAssert(containsTreeMap.size() == 3, @"map");
+  XCTAssert(containsTreeMap[1] == vector<int32_t>{ 2 }, @"map");
+  XCTAssert(containsTreeMap[2] == vector<int32_t>{ 3 }, @"map");
+  XCTAssert(containsTreeMap[3].empty(), @"map");
+}
+
+// Merges update the containment tree in place, a child merged into its parent
+// moves its children up and a parent merged into its child is replaced by it
+
+- (void)testContainmentTreeMerge {
+  
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(0), @(0), @(0), @(0), @(0),
+                         @(0), @(1), @(1), @(1), @(1), @(1), @(0),
+                         @(0), @(1), @(2), @(2), @(2), @(1), @(0),
+                         @(0), @(1), @(2), @(3), @(2), @(1), @(0),
+                         @(0), @(1), @(2), @(2), @(2), @(1), @(0),
+                         @(0), @(1), @(1), @(1), @(1), @(1), @(0),
+                         @(0), @(0), @(0), @(0), @(0), @(0), @(0),
+                         ];
+  
+  Mat tagsImg(7, 7, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  SuperpixelContainmentTree tree;
+  
+  buildSuperpixelContainmentTree(spImage, tagsImg, tree);
+  
+  XCTAssert(tree.getInsideOutOrder() == vector<int32_t>({ 4, 3, 2, 1 }), @"inside out");
+  
+  // 2 (16 pixels) is merged into 1 (24 pixels), 3 becomes a child of 1
+  
+  SuperpixelEdge edge12(1, 2);
+  mergeEdgeInContainmentTree(spImage, tree, edge12);
+  
+  XCTAssert(tree.findNode(2) == -1, @"merged node");
+  XCTAssert(tree.getInsideOutOrder() == vector<int32_t>({ 4, 3, 1 }), @"inside out");
+  XCTAssert(tree.parents[tree.findNode(3)] == tree.findNode(1), @"parent");
+  
+  // Merging the root 1 into its child 3 makes 3 the root
+  
+  tree.mergeNodes(1, 3);
+  
+  XCTAssert(tree.getRootTags() == vector<int32_t>({ 3 }), @"roots");
+  XCTAssert(tree.getInsideOutOrder() == vector<int32_t>({ 4, 3 }), @"inside out");
+  
+  vector<int32_t> childTags;
+  tree.getChildTags(tree.findNode(3), childTags);
+  XCTAssert(childTags == vector<int32_t>({ 4 }), @"children");
+}
+
+// Roots found from the cached label bounds given to parseLabels() match the
+// roots found by scanning the edges of the tags image
+
+- (void)testContainmentRootsFromLabelBounds {
+  
+  Mat labels(6, 8, CV_32SC1, Scalar(0));
+  labels(cv::Rect(2, 1, 3, 2)) = Scalar(1);
+  labels(cv::Rect(5, 3, 3, 3)) = Scalar(2);
+  
+  vector<int32_t> labelCounts = { 48 - 6 - 9, 6, 9 };
+  vector<cv::Rect> labelBounds = { cv::Rect(0, 0, 8, 6), cv::Rect(2, 1, 3, 2), cv::Rect(5, 3, 3, 3) };
+  
+  Mat boundsTagsImg;
+  SuperpixelImage boundsImage;
+  bool worked = SuperpixelImage::parseLabels(labels, 1, boundsTagsImg, boundsImage, &labelCounts, &labelBounds);
+  XCTAssert(worked, @"SuperpixelImage parseLabels with bounds");
+  
+  Mat tagsImg;
+  SuperpixelImage spImage;
+  worked = SuperpixelImage::parseLabels(labels, 1, tagsImg, spImage, &labelCounts);
+  XCTAssert(worked, @"SuperpixelImage parseLabels");
+  
+  SuperpixelContainmentTree boundsTree;
+  buildSuperpixelContainmentTree(boundsImage, boundsTagsImg, boundsTree);
+  
+  SuperpixelContainmentTree tree;
+  buildSuperpixelContainmentTree(spImage, tagsImg, tree);
+  
+  vector<int32_t> expectedRootTags = { 1, 3 };
+  
+  XCTAssert(boundsTree.getRootTags() == expectedRootTags, @"roots from bounds");
+  XCTAssert(tree.getRootTags() == expectedRootTags, @"roots from edges");
+  XCTAssert(boundsTree.getInsideOutOrder() == tree.getInsideOutOrder(), @"same order");
+}
+
 @end
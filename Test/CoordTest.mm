@@ -11,19 +11,103 @@
 #include "Util.h"
 #include "OpenCVUtil.h"
 #include "OpenCVHull.hpp"
+#include "vf_DistanceTransform.h"
 
 #include "Coord.h"
+#include "CoordGrid.h"
+#include "RegionMask.h"
+#include "MatPool.h"
 #include "Superpixel.h"
 #include "SuperpixelEdge.h"
 #include "SuperpixelImage.h"
 
 #include "SuperpixelEdgeFuncs.h"
 #include "MergeSuperpixelImage.h"
+#include "MergeSuperpixelPipeline.h"
+#include "SuperpixelMergeManager.h"
+#include "RegionRemerger.hpp"
 
 #include "ClusteringSegmentation.hpp"
 
+#include "peakdetect.h"
+#include "peakdetect.hpp"
+
 #import <XCTest/XCTest.h>
 
+// Merge manager for the merge loop tests that merges neighbors with the same
+// color, the color of each tag is read before the merge loop so that
+// checkEdge() only reads.
+
+class SameColorManager : public SuperpixelMergeManager {
+public:
+  unordered_map<int32_t, Vec3b> colors;
+  
+  SameColorManager(SuperpixelImage & _spImage, Mat &_inputImg)
+  : SuperpixelMergeManager(_spImage, _inputImg)
+  {
+    for ( int32_t tag : spImage.superpixels ) {
+      Coord coord = spImage.getSuperpixelPtr(tag)->coords[0];
+      colors[tag] = inputImg.at<Vec3b>(coord.y, coord.x);
+    }
+    
+    superpixels = spImage.sortSuperpixelsBySize();
+  }
+  
+  bool checkEdge(int32_t dstTag, int32_t srcTag) {
+    return colors.at(dstTag) == colors.at(srcTag);
+  }
+};
+
+class ParallelSameColorManager : public SameColorManager {
+public:
+  static const bool orderInsensitive = true;
+  
+  ParallelSameColorManager(SuperpixelImage & _spImage, Mat &_inputImg)
+  : SameColorManager(_spImage, _inputImg)
+  {}
+};
+
+// Order insensitive manager that merges neighbors while the merged superpixel
+// would have at most maxSize pixels, checkEdge() reads the current sizes so a
+// result is stale once dst has merged a neighbor.
+
+class ParallelMaxSizeManager : public SuperpixelMergeManager {
+public:
+  static const bool orderInsensitive = true;
+  
+  size_t maxSize;
+  
+  ParallelMaxSizeManager(SuperpixelImage & _spImage, Mat &_inputImg, size_t _maxSize)
+  : SuperpixelMergeManager(_spImage, _inputImg), maxSize(_maxSize)
+  {
+    superpixels = spImage.sortSuperpixelsBySize();
+  }
+  
+  bool checkEdge(int32_t dstTag, int32_t srcTag) {
+    size_t numCoords = spImage.getSuperpixelPtr(dstTag)->coords.size() + spImage.getSuperpixelPtr(srcTag)->coords.size();
+    return numCoords <= maxSize;
+  }
+};
+
+// Records each stripe and the parallel threads seen inside the stripe
+
+class RecordStripesParallelBody : public cv::ParallelLoopBody {
+public:
+  RecordStripesParallelBody(std::mutex &_mutex, vector<cv::Range> &_stripes, vector<int> &_nestedThreads)
+  : mutex(_mutex), stripes(_stripes), nestedThreads(_nestedThreads)
+  {}
+  
+  void operator()(const cv::Range &range) const {
+    std::unique_lock<std::mutex> lock(mutex);
+    stripes.push_back(range);
+    nestedThreads.push_back(getParallelThreads());
+  }
+  
+  std::mutex &mutex;
+  vector<cv::Range> &stripes;
+  vector<int> &nestedThreads;
+};
+
 @interface CoordTest : XCTestCase
 
 @end
@@ -210,6 +294,49 @@
   XCTAssert(edge.B == superpixels[1], @"edge.B");
 }
 
+// Reset keeps the superpixel objects in the arena for the next parse
+
+- (void)testSuperpixelImageReset {
+  
+  NSArray *pixelsArr = @[
+                         @(0), @(0),
+                         @(1), @(2),
+                         ];
+  
+  Mat tagsImg(2, 2, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  XCTAssert(spImage.superpixels.size() == 3, @"num sumperpixels");
+  XCTAssert(spImage.superpixelArena.size() == 3, @"arena size");
+  
+  Superpixel *firstPtr = spImage.getSuperpixelPtr(1);
+  
+  spImage.reset();
+  
+  XCTAssert(spImage.superpixels.size() == 0, @"num sumperpixels");
+  XCTAssert(spImage.tagToSuperpixelMap.size() == 0, @"num sumperpixels");
+  XCTAssert(spImage.getEdges().size() == 0, @"num edges");
+  XCTAssert(spImage.superpixelArena.size() == 0, @"arena size");
+  XCTAssert(spImage.superpixelArena.capacity() > 0, @"arena capacity");
+  
+  [self.class fillImageWithPixels:@[ @(0), @(0), @(1), @(1) ] img:tagsImg];
+  
+  worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  XCTAssert(spImage.superpixels.size() == 2, @"num sumperpixels");
+  XCTAssert(spImage.getSuperpixelPtr(1) == firstPtr, @"reused object");
+  XCTAssert(spImage.getSuperpixelPtr(1)->coords.size() == 2, @"coords");
+  XCTAssert(spImage.getSuperpixelPtr(2)->coords.size() == 2, @"coords");
+  XCTAssert(spImage.getEdges().size() == 1, @"num edges");
+}
+
 - (void)testParse1and3V1 {
   
   NSArray *pixelsArr = @[
@@ -545,10 +672,13 @@
   // In this case, there is a tie and the smaller UID is used.
   
   XCTAssert(spImage.tagToSuperpixelMap.size() == 2, @"sumperpixel UID table");
+  XCTAssert(spImage.tagToSuperpixelTable.size() == 3, @"sumperpixel direct table");
   
   spImage.mergeEdge(edges[0]);
   
   XCTAssert(spImage.tagToSuperpixelMap.size() == 1, @"sumperpixel UID table");
+  XCTAssert(spImage.getSuperpixelPtr(1+1) == NULL, @"merged sumperpixel");
+  XCTAssert(spImage.getSuperpixelPtr(0+1) == spImage.tagToSuperpixelMap[0+1], @"sumperpixel direct table");
   
   superpixels = spImage.getSuperpixelsVec();
   XCTAssert(superpixels.size() == 1, @"num sumperpixels");
@@ -2023,6 +2153,134 @@
   XCTAssert(edgeStrengthMap.count(edge) == 0, @"val");
 }
 
+// Edge weights in the open addressing table, erase must keep the edges that
+// probed past an erased slot reachable.
+
+- (void)testSuperpixelEdgeWeights {
+  SuperpixelEdgeWeights edgeWeights;
+  
+  XCTAssert(edgeWeights.empty(), @"empty");
+  XCTAssert(edgeWeights.count(SuperpixelEdge(0, 1)) == 0, @"not found");
+  XCTAssert(edgeWeights.find(SuperpixelEdge(0, 1)) == edgeWeights.end(), @"not found");
+  
+  // Enough edges that the table is grown a few times
+  
+  for ( int32_t tag = 1; tag <= 200; tag++ ) {
+    edgeWeights[SuperpixelEdge(tag, 0)] = (float) tag;
+    edgeWeights[SuperpixelEdge(tag, tag + 1)] = (float) -tag;
+  }
+  
+  XCTAssert(edgeWeights.size() == 400, @"size");
+  XCTAssert(edgeWeights[SuperpixelEdge(0, 7)] == 7.0f, @"canonical edge");
+  XCTAssert(edgeWeights.find(SuperpixelEdge(8, 7))->second == -7.0f, @"find");
+  
+  // Erase every other edge to 0 and check the rest
+  
+  for ( int32_t tag = 1; tag <= 200; tag += 2 ) {
+    XCTAssert(edgeWeights.erase(SuperpixelEdge(0, tag)) == 1, @"erased");
+  }
+  
+  XCTAssert(edgeWeights.erase(SuperpixelEdge(0, 1)) == 0, @"already erased");
+  XCTAssert(edgeWeights.size() == 300, @"size");
+  
+  for ( int32_t tag = 1; tag <= 200; tag++ ) {
+    XCTAssert(edgeWeights.count(SuperpixelEdge(0, tag)) == ((tag % 2) == 0 ? 1 : 0), @"count");
+    XCTAssert(edgeWeights[SuperpixelEdge(tag, tag + 1)] == (float) -tag, @"weight");
+  }
+  
+  // Bulk erase of the edges of a merged superpixel
+  
+  vector<int32_t> neighbors = { 0, 9, 11 };
+  
+  XCTAssert(edgeWeights.eraseEdges(10, neighbors) == 3, @"eraseEdges");
+  XCTAssert(edgeWeights.count(SuperpixelEdge(10, 0)) == 0, @"erased");
+  XCTAssert(edgeWeights.count(SuperpixelEdge(9, 10)) == 0, @"erased");
+  XCTAssert(edgeWeights.count(SuperpixelEdge(10, 11)) == 0, @"erased");
+  XCTAssert(edgeWeights.size() == 297, @"size");
+  
+  // Iteration visits each edge once
+  
+  int numVisited = 0;
+  double sum = 0.0;
+  
+  for ( auto &pair : edgeWeights ) {
+    XCTAssert(pair.first.A < pair.first.B, @"canonical edge");
+    numVisited += 1;
+    sum += pair.second;
+  }
+  
+  XCTAssert(numVisited == 297, @"iteration");
+  
+  double expectedSum = 0.0;
+  
+  for ( int32_t tag = 1; tag <= 200; tag++ ) {
+    if (tag != 10 && tag != 9) {
+      expectedSum += -tag;
+    }
+    if ((tag % 2) == 0 && tag != 10) {
+      expectedSum += tag;
+    }
+  }
+  
+  XCTAssert(sum == expectedSum, @"iteration");
+  
+  edgeWeights.clear();
+  
+  XCTAssert(edgeWeights.empty(), @"empty");
+  XCTAssert(edgeWeights.begin() == edgeWeights.end(), @"empty");
+}
+
+// Neighbors range and edge callback read the edge table without a copy
+
+- (void)testEdgeTableRanges {
+  SuperpixelEdgeTable edgeTable;
+  
+  edgeTable.setNeighbors(1, vector<int32_t>{ 3, 2 });
+  edgeTable.setNeighbors(2, vector<int32_t>{ 1, 3 });
+  edgeTable.setNeighbors(3, vector<int32_t>{ 2, 1, 4 });
+  edgeTable.setNeighbors(4, vector<int32_t>{ 3 });
+  
+  SuperpixelTagRange range = edgeTable.getNeighborsRange(3);
+  
+  XCTAssert(range.size() == 3, @"size");
+  XCTAssert(range[0] == 1 && range[1] == 2 && range[2] == 4, @"sorted");
+  XCTAssert(range.count(4) == 1 && range.count(3) == 0, @"count");
+  XCTAssert(vector<int32_t>(range.begin(), range.end()) == edgeTable.getNeighbors(3), @"same as copy");
+  
+  XCTAssert(edgeTable.getNeighborsRange(5).empty(), @"not in table");
+  
+  vector<SuperpixelEdge> edges;
+  
+  edgeTable.forEachEdge([&edges](const SuperpixelEdge &edge) {
+    edges.push_back(edge);
+  });
+  
+  sort(edges.begin(), edges.end(), [](const SuperpixelEdge &e1, const SuperpixelEdge &e2) {
+    return (e1.A != e2.A) ? (e1.A < e2.A) : (e1.B < e2.B);
+  });
+  
+  XCTAssert(edges == edgeTable.getAllEdges(), @"same as getAllEdges");
+  XCTAssert(edges.size() == 4, @"num edges");
+  
+  // Lazy merge of 4 into 2 is resolved before the edges are visited
+  
+  edgeTable.lazyMerge = true;
+  edgeTable.mergeNeighborsLazy(4, 2);
+  
+  int numEdges = 0;
+  int numMergedTag = 0;
+  
+  edgeTable.forEachEdge([&numEdges, &numMergedTag](const SuperpixelEdge &edge) {
+    if (edge.A == 4 || edge.B == 4) {
+      numMergedTag += 1;
+    }
+    numEdges += 1;
+  });
+  
+  XCTAssert(numEdges == 3, @"num edges");
+  XCTAssert(numMergedTag == 0, @"merged tag");
+}
+
 // Testing C++ details related to Coord class and
 // putting it into an unordered map.
 
@@ -2704,6 +2962,3713 @@
   XCTAssert(ordered[4] == 5, @"result");
 }
 
-@end
+// The cached bbox and color stats of a merged superpixel must match a rescan
+// of the merged coords.
+
+- (void)testMergeStats
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1),
+                         @(0), @(1), @(1),
+                         @(2), @(2), @(2)
+                         ];
+  
+  Mat tagsImg(3, 3, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  // Input pixels are the same within tag 1 and tag 3
+  
+  Mat inputImg(3, 3, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  inputImg.at<Vec3b>(0, 2) = Vec3b(40, 50, 60);
+  inputImg.at<Vec3b>(1, 1) = Vec3b(42, 50, 60);
+  inputImg.at<Vec3b>(1, 2) = Vec3b(40, 50, 60);
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  spImage.setColorStats(inputImg);
+  
+  XCTAssert(spImage.isAllSamePixels(inputImg, 1) == true, @"all same");
+  XCTAssert(spImage.isAllSamePixels(inputImg, 2) == false, @"all same");
+  XCTAssert(spImage.isAllSamePixels(inputImg, 3) == true, @"all same");
+  
+  XCTAssert(Superpixel_opencv_bbox(spImage.getSuperpixelPtr(1)) == cv::Rect(0, 0, 2, 2), @"bbox");
+  
+  Superpixel *spPtr = spImage.getSuperpixelPtr(3);
+  XCTAssert(Superpixel_opencv_bbox(spPtr) == cv::Rect(0, 2, 3, 1), @"bbox");
+  
+  // Merge 1 into 3, both have 3 coords
+  
+  SuperpixelEdge edge(1, 3);
+  spImage.mergeEdge(edge);
+  
+  spPtr = spImage.getSuperpixelPtr(1);
+  XCTAssert(spPtr != NULL, @"merged");
+  XCTAssert(spPtr->coords.size() == 6, @"merged coords");
+  
+  int32_t originX, originY, width, height;
+  bbox(originX, originY, width, height, spPtr->coords.getVector());
+  XCTAssert(Superpixel_opencv_bbox(spPtr) == cv::Rect(originX, originY, width, height), @"bbox");
+  XCTAssert(Superpixel_opencv_bbox(spPtr) == cv::Rect(0, 0, 3, 3), @"bbox");
+  
+  Vec3f mean, variance;
+  worked = spPtr->colorMeanAndVariance(mean, variance);
+  XCTAssert(worked, @"color stats");
+  XCTAssert(mean == Vec3f(10, 20, 30), @"mean");
+  XCTAssert(variance == Vec3f(0, 0, 0), @"variance");
+  
+  spPtr = spImage.getSuperpixelPtr(2);
+  worked = spPtr->colorMeanAndVariance(mean, variance);
+  XCTAssert(worked, @"color stats");
+  XCTAssert(fabs(mean[0] - (122.0f / 3)) < 0.001f, @"mean");
+  XCTAssert(variance[0] > 0.0f && variance[1] == 0.0f && variance[2] == 0.0f, @"variance");
+}
+
+// Coords stored as runs are read back in the same order
+
+- (void)testCoordRuns
+{
+  SuperpixelCoords coords;
+  
+  for ( int x = 2; x < 6; x++ ) {
+    coords.push_back(Coord(x, 1));
+  }
+  coords.push_back(Coord(0, 2));
+  coords.push_back(Coord(3, 2));
+  coords.push_back(Coord(4, 2));
+  
+  vector<Coord> expected = coords.getVector();
+  
+  XCTAssert(coords.numRuns() == 3, @"runs");
+  
+  coords.encodeRuns();
+  
+  XCTAssert(coords.isRunLength(), @"run mode");
+  XCTAssert(coords.size() == 7, @"size");
+  
+  vector<CoordRun> runs;
+  coords.forEachRun([&runs](const CoordRun &run) {
+    runs.push_back(run);
+  });
+  
+  XCTAssert(runs.size() == 3, @"runs");
+  XCTAssert(runs[0].x == 2 && runs[0].y == 1 && runs[0].length == 4, @"run");
+  XCTAssert(runs[1].x == 0 && runs[1].y == 2 && runs[1].length == 1, @"run");
+  XCTAssert(runs[2].x == 3 && runs[2].y == 2 && runs[2].length == 2, @"run");
+  
+  vector<Coord> iterated;
+  coords.forEachCoord([&iterated](Coord coord) {
+    iterated.push_back(coord);
+  });
+  
+  XCTAssert(iterated == expected, @"forEachCoord");
+  
+  // Splice coords stored as a vector onto the runs
+  
+  SuperpixelCoords other;
+  other.push_back(Coord(5, 2));
+  other.push_back(Coord(7, 3));
+  
+  coords.splice(other);
+  
+  XCTAssert(other.empty(), @"spliced");
+  XCTAssert(coords.isRunLength(), @"run mode");
+  XCTAssert(coords.size() == 9, @"size");
+  
+  expected.push_back(Coord(5, 2));
+  expected.push_back(Coord(7, 3));
+  
+  // Accessing the vector expands the runs
+  
+  XCTAssert(coords.getVector() == expected, @"expanded");
+  XCTAssert(coords.isRunLength() == false, @"vector mode");
+}
+
+- (void)testEncodeCoordRuns
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1),
+                         @(0), @(1), @(1),
+                         @(2), @(2), @(2)
+                         ];
+  
+  Mat tagsImg(3, 3, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  spImage.encodeCoordRuns();
+  
+  Superpixel *spPtr = spImage.getSuperpixelPtr(3);
+  XCTAssert(spPtr->coords.isRunLength(), @"run mode");
+  XCTAssert(spPtr->coords.numRuns() == 1, @"runs");
+  XCTAssert(Superpixel_opencv_bbox(spPtr) == cv::Rect(0, 2, 3, 1), @"bbox");
+  XCTAssert(spPtr->coords.isRunLength(), @"bbox does not expand runs");
+  
+  Mat outTagsImg(3, 3, CV_MAKETYPE(CV_8U, 3));
+  outTagsImg = Scalar(0xFF, 0xFF, 0xFF);
+  
+  spImage.fillMatrixWithSuperpixelTags(outTagsImg);
+  
+  XCTAssert(outTagsImg.at<Vec3b>(0, 1) == PixelToVec3b(1), @"tags");
+  XCTAssert(outTagsImg.at<Vec3b>(1, 2) == PixelToVec3b(2), @"tags");
+  XCTAssert(outTagsImg.at<Vec3b>(2, 0) == PixelToVec3b(3), @"tags");
+  XCTAssert(outTagsImg.at<Vec3b>(2, 2) == PixelToVec3b(3), @"tags");
+}
+
+// Cached histograms are added on merge and match a histogram read from the pixels
+
+- (void)testHistogramCache
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1),
+                         @(0), @(1), @(1),
+                         @(2), @(2), @(2)
+                         ];
+  
+  Mat tagsImg(3, 3, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat inputImg(3, 3, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  inputImg.at<Vec3b>(0, 1) = Vec3b(200, 20, 30);
+  inputImg.at<Vec3b>(2, 2) = Vec3b(10, 120, 30);
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  XCTAssert(spImage.getHistogram(inputImg, 1).sum() == 3, @"hist count");
+  XCTAssert(spImage.getHistogram(inputImg, 3).sum() == 3, @"hist count");
+  XCTAssert(spImage.histogramCache.size() == 2, @"cached");
+  
+  SuperpixelEdge edge(1, 3);
+  spImage.mergeEdge(edge);
+  
+  XCTAssert(spImage.histogramCache.size() == 1, @"cached");
+  
+  int32_t mergedTag = spImage.getSuperpixelPtr(1) != NULL ? 1 : 3;
+  
+  SparseColorHistogram mergedHist = spImage.getHistogram(inputImg, mergedTag);
+  XCTAssert(mergedHist.sum() == 6, @"hist count");
+  XCTAssert(mergedHist.bins.size() == 3, @"hist bins");
+  
+  spImage.histogramCache.clear();
+  
+  const SparseColorHistogram &readHist = spImage.getHistogram(inputImg, mergedTag);
+  XCTAssert(readHist.bins.size() == mergedHist.bins.size(), @"hist bins");
+  
+  for ( int i = 0; i < (int)readHist.bins.size(); i++ ) {
+    XCTAssert(readHist.bins[i].bin == mergedHist.bins[i].bin, @"hist bin");
+    XCTAssert(readHist.bins[i].count == mergedHist.bins[i].count, @"hist count");
+  }
+}
 
+// Sparse histogram compare and back projection
+
+- (void)testSparseColorHistogram
+{
+  Mat pixels1(1, 4, CV_8UC3);
+  pixels1.at<Vec3b>(0, 0) = Vec3b(0, 0, 0);
+  pixels1.at<Vec3b>(0, 1) = Vec3b(15, 15, 15);
+  pixels1.at<Vec3b>(0, 2) = Vec3b(16, 0, 0);
+  pixels1.at<Vec3b>(0, 3) = Vec3b(255, 255, 255);
+  
+  SparseColorHistogram hist1;
+  hist1.parse(pixels1);
+  
+  XCTAssert(hist1.bins.size() == 3, @"bins");
+  XCTAssert(hist1.bins[0].bin == 0 && hist1.bins[0].count == 2, @"bin");
+  XCTAssert(hist1.bins[1].bin == (1 * 16 * 16) && hist1.bins[1].count == 1, @"bin");
+  XCTAssert(hist1.bins[2].bin == (16 * 16 * 16 - 1) && hist1.bins[2].count == 1, @"bin");
+  
+  XCTAssert(hist1.bhattacharyya(hist1) < 0.0001, @"same");
+  XCTAssert(hist1.chiSquare(hist1) == 0.0, @"same");
+  
+  // No shared bins
+  
+  Mat pixels2(1, 2, CV_8UC3);
+  pixels2.at<Vec3b>(0, 0) = Vec3b(100, 100, 100);
+  pixels2.at<Vec3b>(0, 1) = Vec3b(100, 100, 100);
+  
+  SparseColorHistogram hist2;
+  hist2.parse(pixels2);
+  
+  XCTAssert(hist1.bhattacharyya(hist2) == 1.0, @"distinct");
+  
+  // Scaling does not change the compare
+  
+  SparseColorHistogram scaled = hist1;
+  scaled.normalize();
+  XCTAssert(scaled.maxCount() == 1.0f, @"normalize");
+  XCTAssert(fabs(scaled.bhattacharyya(hist2) - hist1.bhattacharyya(hist2)) < 0.0001, @"scaled");
+  
+  hist1.add(hist2);
+  XCTAssert(hist1.bins.size() == 4, @"add");
+  XCTAssert(hist1.sum() == 6, @"add");
+  
+  Mat backProjection;
+  hist1.backproject(pixels1, backProjection);
+  
+  XCTAssert(backProjection.rows == 1 && backProjection.cols == 4, @"backproject size");
+  XCTAssert(backProjection.at<uint8_t>(0, 0) == 255, @"backproject");
+  XCTAssert(backProjection.at<uint8_t>(0, 2) == 128, @"backproject");
+}
+
+// Min cost merge collapses the same color regions and stops at the color edge
+
+- (void)testMergeMinCostEdges
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(1), @(1),
+                         @(2), @(2), @(3), @(3),
+                         ];
+  
+  Mat tagsImg(3, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat inputImg(3, 4, CV_8UC3);
+  inputImg = Scalar(0, 0, 255);
+  
+  for ( int x = 0; x < 4; x++ ) {
+    inputImg.at<Vec3b>(2, x) = Vec3b(255, 0, 0);
+  }
+  
+  MergeSuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  XCTAssert(spImage.superpixels.size() == 4, @"superpixels");
+  
+  int mergeStep = spImage.mergeMinCostEdges(inputImg, 0.1, 0);
+  
+  XCTAssert(mergeStep == 2, @"merges");
+  XCTAssert(spImage.superpixels.size() == 2, @"superpixels");
+  
+  for ( int32_t tag : spImage.superpixels ) {
+    Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+    XCTAssert(spPtr->coords.size() == 4 || spPtr->coords.size() == 8, @"merged size");
+  }
+  
+  // With no cost limit everything is merged into one superpixel
+  
+  mergeStep = spImage.mergeMinCostEdges(inputImg, 1.0, mergeStep);
+  
+  XCTAssert(mergeStep == 3, @"merges");
+  XCTAssert(spImage.superpixels.size() == 1, @"superpixels");
+}
+
+// A colorspace conversion of the input image is done once and then cached
+
+- (void)testConvertedImageCache
+{
+  Mat inputImg(2, 2, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  
+  SuperpixelImage spImage;
+  
+  XCTAssert(spImage.getConvertedImage(inputImg, 0).data == inputImg.data, @"no conversion");
+  
+  Mat &labImg = spImage.getConvertedImage(inputImg, CV_BGR2Lab);
+  
+  Mat expectedImg;
+  cvtColor(inputImg, expectedImg, CV_BGR2Lab);
+  
+  XCTAssert(labImg.size() == inputImg.size(), @"converted size");
+  XCTAssert(labImg.at<Vec3b>(1, 1) == expectedImg.at<Vec3b>(1, 1), @"converted");
+  
+  XCTAssert(spImage.getConvertedImage(inputImg, CV_BGR2Lab).data == labImg.data, @"cached");
+  XCTAssert(spImage.convertedImages.size() == 1, @"cached");
+  
+  spImage.getConvertedImage(inputImg, CV_BGR2HSV);
+  XCTAssert(spImage.convertedImages.size() == 2, @"cached");
+  
+  // A different image discards the cached conversions
+  
+  Mat otherImg = inputImg.clone();
+  spImage.getConvertedImage(otherImg, CV_BGR2Lab);
+  XCTAssert(spImage.convertedImages.size() == 1, @"discarded");
+}
+
+// Edge boundary pixels recorded by parse and updated by merge
+
+- (void)testEdgeBoundaries
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1), @(1),
+                         @(0), @(0), @(1), @(1), @(2),
+                         @(0), @(3), @(3), @(2), @(2),
+                         @(3), @(3), @(2), @(2), @(2),
+                         @(3), @(3), @(3), @(2), @(2)
+                         ];
+  
+  Mat tagsImg(5, 5, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
   
+  SuperpixelImage spImage;
+  spImage.recordEdgeBoundaries = true;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  vector<SuperpixelEdge> edges = spImage.getEdges();
+  XCTAssert(spImage.edgeTable.edgeBoundaryMap.size() == edges.size(), @"one boundary for each edge");
+  
+  // The recorded boundaries must be the same coords as the bbox scan, in
+  // any order, before and after a merge.
+  
+  for ( int merged = 0; merged < 2; merged++ ) {
+    edges = spImage.getEdges();
+    
+    for ( SuperpixelEdge &edge : edges ) {
+      vector<Coord> edgeCoords1;
+      vector<Coord> edgeCoords2;
+      
+      spImage.filterEdgeCoords(edge.A, edgeCoords1, edge.B, edgeCoords2);
+      
+      vector<Coord> scanCoords1;
+      vector<Coord> scanCoords2;
+      
+      Superpixel::filterEdgeCoords(spImage.getSuperpixelPtr(edge.A), scanCoords1, spImage.getSuperpixelPtr(edge.B), scanCoords2);
+      
+      sort(edgeCoords1.begin(), edgeCoords1.end());
+      sort(edgeCoords2.begin(), edgeCoords2.end());
+      sort(scanCoords1.begin(), scanCoords1.end());
+      sort(scanCoords2.begin(), scanCoords2.end());
+      
+      XCTAssert(!edgeCoords1.empty() && !edgeCoords2.empty(), @"boundary coords");
+      XCTAssert(edgeCoords1 == scanCoords1, @"boundary coords");
+      XCTAssert(edgeCoords2 == scanCoords2, @"boundary coords");
+    }
+    
+    if (merged == 0) {
+      SuperpixelEdge edge(2, 4);
+      spImage.mergeEdge(edge);
+      
+      XCTAssert(spImage.edgeTable.edgeBoundaryMap.size() == spImage.getEdges().size(), @"one boundary for each edge");
+    }
+  }
+}
+
+// Lab gradient map and the edge gradient sums kept up to date by merge
+
+- (void)testEdgeGradients
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1), @(1),
+                         @(0), @(0), @(1), @(1), @(2),
+                         @(0), @(3), @(3), @(2), @(2),
+                         @(3), @(3), @(2), @(2), @(2),
+                         @(3), @(3), @(3), @(2), @(2)
+                         ];
+  
+  Mat tagsImg(5, 5, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  // Each region is a different gray
+  
+  Mat inputImg(5, 5, CV_8UC3);
+  
+  for ( int y = 0; y < 5; y++ ) {
+    for ( int x = 0; x < 5; x++ ) {
+      uint8_t gray = tagsImg.at<Vec3b>(y, x)[0] * 60;
+      inputImg.at<Vec3b>(y, x) = Vec3b(gray, gray, gray);
+    }
+  }
+  
+  // A step between 2 flat colors has the Lab difference of the colors on both sides
+  
+  Mat stepImg(4, 4, CV_8UC3);
+  stepImg = Scalar(0, 0, 0);
+  stepImg(Rect(2, 0, 2, 4)) = Scalar(255, 255, 255);
+  
+  SuperpixelImage stepSpImage;
+  const Mat &stepGradients = stepSpImage.getLabGradients(stepImg);
+  
+  XCTAssert(stepGradients.type() == CV_32FC1, @"gradients type");
+  XCTAssert(stepGradients.at<float>(0, 0) == 0.0f, @"flat");
+  XCTAssert(stepGradients.at<float>(0, 1) == 255.0f, @"step");
+  XCTAssert(stepGradients.at<float>(3, 2) == 255.0f, @"step");
+  XCTAssert(stepGradients.at<float>(3, 3) == 0.0f, @"flat");
+  
+  // The sums need the recorded boundaries
+  
+  SuperpixelImage noBoundariesImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, noBoundariesImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  worked = noBoundariesImage.computeEdgeGradients(inputImg);
+  XCTAssert(worked == false, @"no boundaries");
+  
+  SuperpixelImage spImage;
+  spImage.recordEdgeBoundaries = true;
+  
+  worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  worked = spImage.computeEdgeGradients(inputImg);
+  XCTAssert(worked, @"computeEdgeGradients");
+  XCTAssert(spImage.hasEdgeGradients(inputImg), @"hasEdgeGradients");
+  
+  const Mat &gradients = spImage.getLabGradients(inputImg);
+  
+  vector<SuperpixelEdge> edges = spImage.getEdges();
+  XCTAssert(spImage.edgeTable.edgeGradientMap.size() == edges.size(), @"one sum for each edge");
+  
+  for ( SuperpixelEdge &edge : edges ) {
+    vector<Coord> edgeCoords1;
+    vector<Coord> edgeCoords2;
+    
+    spImage.filterEdgeCoords(edge.A, edgeCoords1, edge.B, edgeCoords2);
+    
+    double sum = 0.0;
+    
+    for ( Coord c : edgeCoords1 ) {
+      sum += gradients.at<float>(c.y, c.x);
+    }
+    for ( Coord c : edgeCoords2 ) {
+      sum += gradients.at<float>(c.y, c.x);
+    }
+    
+    SuperpixelEdgeGradient &edgeGradient = spImage.edgeTable.edgeGradientMap[edge];
+    
+    XCTAssert(edgeGradient.numPixels == (int) (edgeCoords1.size() + edgeCoords2.size()), @"boundary pixels");
+    XCTAssert(fabs(edgeGradient.sum - sum) < 1e-3, @"gradient sum");
+    XCTAssert(edgeGradient.sum > 0.0, @"different colors");
+  }
+  
+  // The compare returns the mean gradient of each edge
+  
+  int32_t tag = edges[0].A;
+  
+  vector<CompareNeighborTuple> results;
+  SuperpixelEdgeFuncs::compareNeighborEdges(spImage, inputImg, tag, results, NULL, 0, false);
+  
+  XCTAssert(results.size() == spImage.edgeTable.getNeighbors(tag).size(), @"one result for each neighbor");
+  
+  for ( CompareNeighborTuple &tuple : results ) {
+    SuperpixelEdgeGradient &edgeGradient = spImage.edgeTable.edgeGradientMap[SuperpixelEdge(tag, get<2>(tuple))];
+    XCTAssert(get<0>(tuple) == edgeGradient.sum / edgeGradient.numPixels, @"mean gradient");
+  }
+  
+  // A merge adds the sums of the merged edges
+  
+  SuperpixelEdge mergedEdge = edges[0];
+  
+  double sumBefore = 0.0;
+  
+  for ( SuperpixelEdge &edge : edges ) {
+    if (!(edge == mergedEdge)) {
+      sumBefore += spImage.edgeTable.edgeGradientMap[edge].sum;
+    }
+  }
+  
+  spImage.mergeEdge(mergedEdge);
+  
+  edges = spImage.getEdges();
+  XCTAssert(spImage.edgeTable.edgeGradientMap.size() == edges.size(), @"one sum for each edge");
+  
+  double sumAfter = 0.0;
+  
+  for ( SuperpixelEdge &edge : edges ) {
+    sumAfter += spImage.edgeTable.edgeGradientMap[edge].sum;
+  }
+  
+  XCTAssert(fabs(sumAfter - sumBefore) < 1e-3, @"merged sums");
+}
+
+// Parallel neighbor back projection gives the same results as the serial loop
+
+- (void)testBackprojectNeighborsParallel
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(0), @(2), @(2),
+                         @(3), @(3), @(0), @(2), @(2),
+                         @(3), @(3), @(4), @(4), @(4)
+                         ];
+  
+  Mat tagsImg(5, 5, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat inputImg(5, 5, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  
+  // Superpixel 4 has a different color and one of the pixels in superpixel 5 does
+  
+  for ( int y = 3; y < 5; y++ ) {
+    for ( int x = 0; x < 2; x++ ) {
+      inputImg.at<Vec3b>(y, x) = Vec3b(200, 200, 200);
+    }
+  }
+  inputImg.at<Vec3b>(4, 3) = Vec3b(200, 200, 200);
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  SuperpixelTagBitset locked;
+  locked.insert(4);
+  
+  vector<CompareNeighborTuple> serialResults;
+  vector<CompareNeighborTuple> parallelResults;
+  
+  MergeSuperpixelImage::backprojectNeighborSuperpixels(spImage, inputImg, 1, serialResults, &locked, -1, 0, 20, 2, false, 200, 16, false);
+  MergeSuperpixelImage::backprojectNeighborSuperpixels(spImage, inputImg, 1, parallelResults, &locked, -1, 0, 20, 2, false, 200, 16, true);
+  
+  XCTAssert(serialResults.size() == 2, @"accepted neighbors");
+  XCTAssert(serialResults == parallelResults, @"same results");
+  
+  // Once superpixel 4 is unlocked it is evaluated and rejected
+  
+  locked.erase(4);
+  
+  MergeSuperpixelImage::backprojectNeighborSuperpixels(spImage, inputImg, 1, serialResults, &locked, -1, 0, 20, 2, false, 200, 16, false);
+  MergeSuperpixelImage::backprojectNeighborSuperpixels(spImage, inputImg, 1, parallelResults, &locked, -1, 0, 20, 2, false, 200, 16, true);
+  
+  XCTAssert(serialResults.size() == 2, @"accepted neighbors");
+  XCTAssert(serialResults == parallelResults, @"same results");
+}
+
+// One scan of the pixels finds all the superpixels with identical pixels
+
+- (void)testScanAllSamePixels
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(1), @(1),
+                         @(2), @(2), @(3), @(3),
+                         @(2), @(2), @(3), @(3)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  // Superpixels 1 and 2 have the same pixels, 3 has one other pixel and 4 is mixed
+  
+  Mat inputImg(4, 4, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  
+  for ( int y = 2; y < 4; y++ ) {
+    for ( int x = 0; x < 2; x++ ) {
+      inputImg.at<Vec3b>(y, x) = Vec3b(10, 20, 31);
+    }
+  }
+  inputImg.at<Vec3b>(3, 3) = Vec3b(0, 0, 0);
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  unordered_map<int32_t, uint32_t> allSamePixels;
+  
+  spImage.scanAllSamePixels(inputImg, allSamePixels);
+  
+  XCTAssert(allSamePixels.size() == 3, @"all same");
+  XCTAssert(allSamePixels[1] == 0x1E140A, @"all same pixel");
+  XCTAssert(allSamePixels[2] == 0x1E140A, @"all same pixel");
+  XCTAssert(allSamePixels[3] == 0x1F140A, @"all same pixel");
+  
+  XCTAssert(spImage.getSuperpixelPtr(1)->isAllSame(), @"all same");
+  XCTAssert(spImage.getSuperpixelPtr(3)->isAllSame(), @"all same");
+  XCTAssert(spImage.getSuperpixelPtr(4)->isNotAllSame(), @"not all same");
+  
+  // Only the identical neighbors 1 and 2 are merged
+  
+  spImage.mergeIdenticalSuperpixels(inputImg);
+  
+  XCTAssert(spImage.superpixels.size() == 3, @"merged");
+  XCTAssert(spImage.getSuperpixelPtr(3) != NULL && spImage.getSuperpixelPtr(4) != NULL, @"not merged");
+  
+  int32_t mergedTag = spImage.getSuperpixelPtr(1) != NULL ? 1 : 2;
+  XCTAssert(spImage.getSuperpixelPtr(mergedTag)->coords.size() == 8, @"merged");
+}
+
+// Running edge weight stats match the stats of all the weights
+
+- (void)testSuperpixelWeights
+{
+  float weightsArr1[] = { 2.0f, 4.0f, 4.0f, 5.0f };
+  float weightsArr2[] = { 10.0f, 12.0f, 30.0f };
+  
+  vector<float> allWeights;
+  
+  SuperpixelWeights weights1;
+  SuperpixelWeights weights2;
+  
+  XCTAssert(weights1.empty() && weights1.mean() == 0.0f && weights1.stddev() == 0.0f, @"empty");
+  
+  for ( float weight : weightsArr1 ) {
+    weights1.push_back(weight);
+    allWeights.push_back(weight);
+  }
+  for ( float weight : weightsArr2 ) {
+    weights2.push_back(weight);
+    allWeights.push_back(weight);
+  }
+  
+  vector<float> weightsVec1(weightsArr1, weightsArr1 + 4);
+  
+  float mean, stddev;
+  
+  sample_mean(weightsVec1, &mean);
+  sample_mean_delta_squared_div(weightsVec1, mean, &stddev);
+  
+  XCTAssert(weights1.size() == 4, @"size");
+  XCTAssert(fabs(weights1.mean() - mean) < 0.0001f, @"mean");
+  XCTAssert(fabs(weights1.stddev() - stddev) < 0.0001f, @"stddev");
+  
+  // Combined stats are the same as the stats of all the weights
+  
+  weights1.append(weights2);
+  
+  sample_mean(allWeights, &mean);
+  sample_mean_delta_squared_div(allWeights, mean, &stddev);
+  
+  XCTAssert(weights2.empty(), @"src empty");
+  XCTAssert(weights1.size() == 7, @"size");
+  XCTAssert(fabs(weights1.mean() - mean) < 0.0001f, @"mean");
+  XCTAssert(fabs(weights1.stddev() - stddev) < 0.0001f, @"stddev");
+  
+  // Append to an empty list
+  
+  weights2.append(weights1);
+  
+  XCTAssert(weights1.empty(), @"src empty");
+  XCTAssert(weights2.size() == 7, @"size");
+  XCTAssert(fabs(weights2.mean() - mean) < 0.0001f, @"mean");
+}
+
+// Merge pipeline runs passes in rounds and records stats for each pass
+
+- (void)testMergeSuperpixelPipeline
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(1), @(1),
+                         @(2), @(2), @(3), @(3),
+                         @(2), @(2), @(3), @(3)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  // Superpixels 1 and 2 have the same pixels, 3 and 4 have other pixels
+  
+  Mat inputImg(4, 4, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  
+  for ( int y = 2; y < 4; y++ ) {
+    for ( int x = 0; x < 4; x++ ) {
+      inputImg.at<Vec3b>(y, x) = Vec3b(10, 20, 31 + x);
+    }
+  }
+  
+  MergeSuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  int numCountPassCalls = 0;
+  
+  MergeSuperpixelPipeline pipeline;
+  pipeline.maxRounds = 3;
+  
+  pipeline.addMergeIdenticalPass();
+  
+  pipeline.addPass("countPass", [&numCountPassCalls](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    numCountPassCalls += 1;
+    return mergeStep + 1;
+  });
+  
+  int mergeStep = pipeline.run(spImage, inputImg, 10);
+  
+  // The second round makes no merges, so there is no third round
+  
+  XCTAssert(mergeStep == 12, @"merge step");
+  XCTAssert(numCountPassCalls == 2, @"rounds");
+  XCTAssert(pipeline.passStats.size() == 4, @"pass stats");
+  
+  XCTAssert(pipeline.passStats[0].name == "mergeIdenticalSuperpixels", @"pass name");
+  XCTAssert(pipeline.passStats[0].numMerges == 1, @"pass merges");
+  XCTAssert(pipeline.passStats[1].numMerges == 0 && pipeline.passStats[1].numSteps == 1, @"pass steps");
+  XCTAssert(pipeline.passStats[2].round == 1 && pipeline.passStats[2].numMerges == 0, @"second round");
+  XCTAssert(pipeline.numMerges("mergeIdenticalSuperpixels") == 1, @"total merges");
+  XCTAssert(spImage.superpixels.size() == 3, @"merged");
+  
+  // A pass that stops the pipeline when it does not merge
+  
+  pipeline.passes.clear();
+  pipeline.addMergeIdenticalPass(true);
+  pipeline.addPass("countPass", [&numCountPassCalls](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    numCountPassCalls += 1;
+    return mergeStep;
+  });
+  
+  pipeline.run(spImage, inputImg, 0);
+  
+  XCTAssert(numCountPassCalls == 2, @"stopped");
+  XCTAssert(pipeline.passStats.size() == 1, @"stopped");
+}
+
+// Merges recorded in a merge log by a pipeline are replayed on a freshly parsed image
+
+- (void)testSuperpixelMergeLog
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(1), @(1),
+                         @(2), @(2), @(3), @(3),
+                         @(2), @(2), @(3), @(3)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat replayTagsImg = tagsImg.clone();
+  
+  Mat inputImg(4, 4, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  
+  MergeSuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  SuperpixelMergeLog mergeLog;
+  spImage.mergeLog = &mergeLog;
+  
+  MergeSuperpixelPipeline pipeline;
+  pipeline.addPass("mergeFirstEdge", [](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    SuperpixelEdge edge(1, 2);
+    spImage.mergeEdge(edge);
+    return mergeStep + 1;
+  });
+  pipeline.addMergeIdenticalPass();
+  
+  pipeline.run(spImage, inputImg, 0);
+  
+  XCTAssert(spImage.superpixels.size() == 1, @"merged");
+  XCTAssert(mergeLog.getNumPasses() == 2, @"num passes");
+  XCTAssert(mergeLog.getNumMerges() == 3, @"num merges");
+  
+  string filename = string([NSTemporaryDirectory() UTF8String]) + "/test_merges.log";
+  
+  XCTAssert(mergeLog.save(filename), @"save");
+  
+  SuperpixelMergeLog loadedLog;
+  
+  XCTAssert(SuperpixelMergeLog::load(filename, loadedLog), @"load");
+  XCTAssert(loadedLog.getBytes() == mergeLog.getBytes(), @"same bytes");
+  
+  // Replay only the first pass
+  
+  {
+    SuperpixelImage replayImage;
+    Mat tags = replayTagsImg.clone();
+    worked = SuperpixelImage::parse(tags, replayImage);
+    XCTAssert(worked, @"SuperpixelImage parse");
+    
+    XCTAssert(loadedLog.replay(replayImage, 1) == 1, @"replayed");
+    XCTAssert(replayImage.superpixels.size() == 3, @"first pass");
+    XCTAssert(replayImage.getSuperpixelPtr(1)->coords.size() == 8, @"merged coords");
+    XCTAssert(replayImage.edgeTable.lazyMerge == false, @"lazy merge restored");
+  }
+  
+  // Replay the whole log
+  
+  {
+    SuperpixelImage replayImage;
+    Mat tags = replayTagsImg.clone();
+    worked = SuperpixelImage::parse(tags, replayImage);
+    XCTAssert(worked, @"SuperpixelImage parse");
+    
+    XCTAssert(loadedLog.replay(replayImage) == 3, @"replayed");
+    XCTAssert(replayImage.superpixels == spImage.superpixels, @"same superpixels");
+    XCTAssert(replayImage.getEdges().size() == 0, @"num edges");
+  }
+}
+
+// A merge tree recorded by mergeEdge() is cut by region count and by cost
+
+- (void)testSuperpixelMergeTree
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(1), @(1),
+                         @(2), @(2), @(3), @(3),
+                         @(2), @(2), @(3), @(3)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  SuperpixelMergeTree mergeTree;
+  mergeTree.start(spImage);
+  spImage.mergeTree = &mergeTree;
+  
+  // Equal sizes merge B into A, the cost of the last merge is raised to the
+  // cost of the merge of 3 and 4
+  
+  SuperpixelEdge edge12(1, 2);
+  spImage.mergeEdge(edge12, 0.1f);
+  SuperpixelEdge edge34(3, 4);
+  spImage.mergeEdge(edge34, 0.5f);
+  SuperpixelEdge edge13(1, 3);
+  spImage.mergeEdge(edge13, 0.3f);
+  
+  XCTAssert(mergeTree.getNumLeaves() == 4, @"leaves");
+  XCTAssert(mergeTree.getNumMerges() == 3, @"merges");
+  XCTAssert(mergeTree.getMergeCost(2) == 0.5f, @"monotone cost");
+  
+  vector<int32_t> regionTags;
+  
+  XCTAssert(mergeTree.cutByRegionCount(4, regionTags) == 4, @"regions");
+  XCTAssert(regionTags == vector<int32_t>({ 1, 2, 3, 4 }), @"region tags");
+  
+  XCTAssert(mergeTree.cutByRegionCount(2, regionTags) == 2, @"regions");
+  XCTAssert(regionTags == vector<int32_t>({ 1, 1, 3, 3 }), @"region tags");
+  
+  XCTAssert(mergeTree.cutByRegionCount(1, regionTags) == 1, @"regions");
+  XCTAssert(regionTags == vector<int32_t>({ 1, 1, 1, 1 }), @"region tags");
+  
+  XCTAssert(mergeTree.cutByCost(0.2f, regionTags) == 3, @"regions");
+  XCTAssert(regionTags == vector<int32_t>({ 1, 1, 3, 4 }), @"region tags");
+  
+  XCTAssert(mergeTree.cutByCost(0.5f, regionTags) == 1, @"regions");
+}
+
+// A converted image is uploaded to a UMat once and discarded with the converted images
+
+- (void)testConvertedUMatCache
+{
+  Mat inputImg(2, 2, CV_8UC3);
+  inputImg = Scalar(10, 20, 30);
+  
+  SuperpixelImage spImage;
+  
+  XCTAssert(spImage.isOpenCLBackProjection() == false, @"off by default");
+  
+  UMat &labUMat = spImage.getConvertedUMat(inputImg, CV_BGR2Lab);
+  
+  Mat labImg = labUMat.getMat(ACCESS_READ).clone();
+  
+  XCTAssert(labImg.size() == inputImg.size(), @"uploaded size");
+  XCTAssert(labImg.at<Vec3b>(1, 1) == spImage.getConvertedImage(inputImg, CV_BGR2Lab).at<Vec3b>(1, 1), @"uploaded");
+  
+  XCTAssert(&spImage.getConvertedUMat(inputImg, CV_BGR2Lab) == &labUMat, @"cached");
+  XCTAssert(spImage.convertedUMats.size() == 1, @"cached");
+  
+  // A different image discards the uploaded images
+  
+  Mat otherImg = inputImg.clone();
+  spImage.getConvertedImage(otherImg, 0);
+  spImage.getConvertedImage(otherImg, CV_BGR2HSV);
+  XCTAssert(spImage.convertedUMats.size() == 0, @"discarded");
+}
+
+// The merge loop gives the same result with and without a trace, the trace records each step
+
+- (void)testSuperpixelMergeManagerTrace
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1), @(1),
+                         @(0), @(0), @(1), @(1),
+                         @(2), @(2), @(3), @(3),
+                         @(2), @(2), @(3), @(3)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat inputImg(4, 4, CV_8UC3);
+  inputImg = Scalar(0, 0, 0);
+  
+  // Merge manager that merges every edge that is checked
+  
+  class MergeAllManager : public SuperpixelMergeManager {
+  public:
+    MergeAllManager(SuperpixelImage & _spImage, Mat &_inputImg)
+    : SuperpixelMergeManager(_spImage, _inputImg)
+    {}
+    
+    bool checkEdge(int32_t dstTag, int32_t srcTag) {
+      return true;
+    }
+  };
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  MergeAllManager mergeManager(spImage, inputImg);
+  mergeManager.superpixels = spImage.sortSuperpixelsBySize();
+  
+  int mergeStep = SuperpixelMergeManagerFunc(mergeManager);
+  
+  XCTAssert(mergeStep == 3, @"merges");
+  XCTAssert(spImage.superpixels.size() == 1, @"merged");
+  
+  // The same merges are done with a trace that records each step
+  
+  SuperpixelImage tracedImage;
+  
+  worked = SuperpixelImage::parse(tagsImg, tracedImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  MergeAllManager tracedManager(tracedImage, inputImg);
+  tracedManager.superpixels = tracedImage.sortSuperpixelsBySize();
+  
+  SuperpixelMergeTrace trace;
+  
+  int tracedMergeStep = SuperpixelMergeManagerFunc(tracedManager, trace);
+  
+  XCTAssert(tracedMergeStep == 3, @"traced merges");
+  XCTAssert(tracedImage.superpixels.size() == 1, @"traced merged");
+  
+  XCTAssert(trace.count(SUPERPIXEL_MERGE_TRACE_CHECKED_EDGE) >= 3, @"checked edges");
+  XCTAssert(trace.count(SUPERPIXEL_MERGE_TRACE_ALREADY_MERGED) == 3, @"merged away");
+  XCTAssert(trace.events.front().type == SUPERPIXEL_MERGE_TRACE_FOUND_NEIGHBORS, @"first event");
+  XCTAssert(trace.events.back().type == SUPERPIXEL_MERGE_TRACE_ALREADY_MERGED, @"last event");
+  
+  int numMergedNeighbor = 0;
+  for ( const SuperpixelMergeTraceEvent &event : trace.events ) {
+    if (event.type == SUPERPIXEL_MERGE_TRACE_DONE_PROCESSING && event.value == 1) {
+      numMergedNeighbor += 1;
+    }
+  }
+  XCTAssert(numMergedNeighbor >= 1, @"merged neighbor");
+}
+
+// An order insensitive merge manager checks edges in parallel and does the same merges
+
+- (void)testSuperpixelMergeManagerParallel
+{
+  NSArray *pixelsArr = @[
+                         @(0),  @(1),  @(2),  @(3),
+                         @(4),  @(5),  @(6),  @(7),
+                         @(8),  @(9),  @(10), @(11),
+                         @(12), @(13), @(14), @(15)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  // The left half and the right half are each one color
+  
+  Mat inputImg(4, 4, CV_8UC3);
+  
+  for ( int y = 0; y < 4; y++ ) {
+    for ( int x = 0; x < 4; x++ ) {
+      inputImg.at<Vec3b>(y, x) = (x < 2) ? Vec3b(0, 0, 255) : Vec3b(255, 0, 0);
+    }
+  }
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  SameColorManager mergeManager(spImage, inputImg);
+  
+  int mergeStep = SuperpixelMergeManagerFunc(mergeManager);
+  
+  XCTAssert(mergeStep == 14, @"merges");
+  XCTAssert(spImage.superpixels.size() == 2, @"merged");
+  
+  SuperpixelImage parallelImage;
+  
+  worked = SuperpixelImage::parse(tagsImg, parallelImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  ParallelSameColorManager parallelManager(parallelImage, inputImg);
+  
+  SuperpixelMergeTrace trace;
+  
+  int parallelMergeStep = SuperpixelMergeManagerFunc(parallelManager, trace);
+  
+  XCTAssert(parallelMergeStep == 14, @"parallel merges");
+  XCTAssert(parallelImage.superpixels.size() == 2, @"parallel merged");
+  
+  // Each merged superpixel covers one half of the image
+  
+  for ( int32_t tag : parallelImage.superpixels ) {
+    Superpixel *spPtr = parallelImage.getSuperpixelPtr(tag);
+    XCTAssert(spPtr->coords.size() == 8, @"half");
+    
+    Vec3b color = parallelManager.colors.at(tag);
+    
+    for ( Coord coord : spPtr->coords ) {
+      XCTAssert(inputImg.at<Vec3b>(coord.y, coord.x) == color, @"same color");
+    }
+  }
+  
+  // No edge between the two halves was merged
+  
+  int numMergedEdges = 0;
+  for ( const SuperpixelMergeTraceEvent &event : trace.events ) {
+    if (event.type == SUPERPIXEL_MERGE_TRACE_CHECKED_EDGE && event.value == 1) {
+      numMergedEdges += 1;
+    }
+  }
+  XCTAssert(numMergedEdges == 14, @"merged edges");
+}
+
+// A superpixel that merged a neighbor checks its other edges again, the parallel
+// result from before the merge would merge every neighbor into it
+
+- (void)testSuperpixelMergeManagerParallelRecheck
+{
+  NSArray *pixelsArr = @[
+                         @(0),  @(1),  @(2),  @(3),
+                         @(4),  @(5),  @(6),  @(7),
+                         @(8),  @(9),  @(10), @(11),
+                         @(12), @(13), @(14), @(15)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat inputImg(4, 4, CV_8UC3, Scalar(0, 0, 0));
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  ParallelMaxSizeManager mergeManager(spImage, inputImg, 2);
+  
+  int mergeStep = SuperpixelMergeManagerFunc(mergeManager);
+  
+  XCTAssert(mergeStep >= 1, @"merges");
+  XCTAssert(spImage.superpixels.size() == (size_t) (16 - mergeStep), @"one superpixel less for each merge");
+  
+  for ( int32_t tag : spImage.superpixels ) {
+    XCTAssert(spImage.getSuperpixelPtr(tag)->coords.size() <= 2, @"max size");
+  }
+}
+
+// Tag bitset membership from a set or a vector of tags
+
+- (void)testSuperpixelTagBitset
+{
+  SuperpixelTagBitset tags;
+  
+  XCTAssert(tags.contains(0) == false, @"empty");
+  
+  set<int32_t> tagsSet = { 1, 63, 64, 200 };
+  tags.assign(tagsSet);
+  
+  XCTAssert(tags.count == 4, @"count");
+  XCTAssert(tags.contains(1) && tags.contains(63) && tags.contains(64) && tags.contains(200), @"contains");
+  XCTAssert(!tags.contains(0) && !tags.contains(2) && !tags.contains(199) && !tags.contains(201), @"not contains");
+  XCTAssert(!tags.contains(100000), @"past the last word");
+  
+  // Assign from a vector with a duplicate discards the previous tags
+  
+  vector<int32_t> tagsVec = { 5, 5, 7 };
+  tags.assign(tagsVec);
+  
+  XCTAssert(tags.count == 2, @"count");
+  XCTAssert(tags.contains(5) && tags.contains(7), @"contains");
+  XCTAssert(!tags.contains(200), @"discarded");
+  
+  // Insert past the last word grows the bits, erase of a missing tag is a no-op
+  
+  tags.insert(300);
+  tags.insert(300);
+  XCTAssert(tags.count == 3 && tags.contains(300), @"inserted");
+  
+  tags.erase(5);
+  tags.erase(6);
+  tags.erase(100000);
+  XCTAssert(tags.count == 2 && !tags.contains(5) && tags.contains(7), @"erased");
+}
+
+// The size order is kept up to date by merges and rebuilt when a size changes
+
+- (void)testSortSuperpixelsBySize
+{
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(0), @(1),
+                         @(0), @(0), @(2), @(1),
+                         @(3), @(3), @(2), @(1),
+                         @(3), @(4), @(4), @(4)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  // Sizes are 5, 3, 2, 3, 3 for tags 1 to 5
+  
+  vector<int32_t> sorted = spImage.sortSuperpixelsBySize();
+  vector<int32_t> expected = { 1, 2, 4, 5, 3 };
+  XCTAssert(sorted == expected, @"sorted");
+  XCTAssert(spImage.sizeOrder.size() == 5, @"size order");
+  
+  vector<int32_t> increasing = spImage.sortSuperpixelsBySizeIncreasing();
+  expected = { 3, 5, 4, 2, 1 };
+  XCTAssert(increasing == expected, @"increasing");
+  
+  // Merge 3 into 2 and then 4 into 1, the merges update the order
+  
+  SuperpixelEdge edge1(2, 3);
+  spImage.mergeEdge(edge1);
+  
+  XCTAssert(spImage.sizeOrder.size() == 4, @"size order");
+  
+  sorted = spImage.sortSuperpixelsBySize();
+  expected = { 1, 2, 4, 5 };
+  XCTAssert(sorted == expected, @"sorted after merge");
+  
+  SuperpixelEdge edge2(1, 4);
+  spImage.mergeEdge(edge2);
+  
+  sorted = spImage.sortSuperpixelsBySize();
+  expected = { 1, 2, 5 };
+  XCTAssert(sorted == expected, @"sorted after merge");
+  XCTAssert(spImage.sizeOrder.begin()->first == -8, @"merged size");
+  
+  // A size that changed outside of mergeEdge() rebuilds the order
+  
+  Superpixel *spPtr = spImage.getSuperpixelPtr(5);
+  vector<Coord> &coords = spPtr->coords;
+  coords.push_back(Coord(0, 0));
+  coords.push_back(Coord(0, 0));
+  coords.push_back(Coord(0, 0));
+  
+  sorted = spImage.sortSuperpixelsBySize();
+  expected = { 1, 5, 2 };
+  XCTAssert(sorted == expected, @"rebuilt");
+}
+
+// The merged pixels mask is kept up to date by the region merges
+
+- (void)testRegionRemergerMask
+{
+  Mat tagsImg(2, 2, CV_8UC3);
+  tagsImg = Scalar(0, 0, 0);
+  tagsImg.at<Vec3b>(1, 0) = Vec3b(1, 0, 0);
+  tagsImg.at<Vec3b>(1, 1) = Vec3b(2, 0, 0);
+  
+  RegionRemerger remerger(tagsImg);
+  
+  remerger.mergeMatToMask();
+  XCTAssert(countNonZero(remerger.maskMat) == 0, @"nothing merged");
+  
+  // Merge the top row as one region
+  
+  remerger.maskMat = Scalar(0);
+  remerger.maskMat.at<uint8_t>(0, 0) = 0xFF;
+  remerger.maskMat.at<uint8_t>(0, 1) = 0xFF;
+  
+  remerger.mergeFromMask();
+  
+  XCTAssert(Vec3BToUID(remerger.mergeMat.at<Vec3b>(0, 1)) == 1, @"merged tag");
+  XCTAssert(remerger.mergedTag == 2, @"next tag");
+  
+  // The mask is reset to the merged pixels
+  
+  remerger.maskMat = Scalar(0);
+  remerger.mergeMatToMask();
+  
+  XCTAssert(remerger.maskMat.at<uint8_t>(0, 0) == 0xFF && remerger.maskMat.at<uint8_t>(0, 1) == 0xFF, @"merged pixels");
+  XCTAssert(remerger.maskMat.at<uint8_t>(1, 0) == 0 && remerger.maskMat.at<uint8_t>(1, 1) == 0, @"unmerged pixels");
+  
+  // Each leftover tag becomes a new region
+  
+  remerger.mergeLeftovers(tagsImg);
+  
+  XCTAssert(remerger.mergedTag == 4, @"leftover tags");
+  XCTAssert(countNonZero(remerger.mergedMask) == 4, @"all merged");
+  XCTAssert(remerger.mergeMat.at<Vec3b>(1, 0) != remerger.mergeMat.at<Vec3b>(1, 1), @"leftover regions");
+}
+
+// Connected components of each tag get their own label
+
+- (void)testLabelConnectedTags
+{
+  // Tag 1 is used by two regions that are not connected, the diagonal pixels
+  // of tag 2 are 8 connected.
+  
+  NSArray *pixelsArr = @[
+                         @(1), @(1), @(0), @(2),
+                         @(0), @(0), @(2), @(0),
+                         @(0), @(2), @(0), @(0),
+                         @(0), @(0), @(1), @(1)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat labelsMat;
+  
+  int32_t numLabels = labelConnectedTags(tagsImg, labelsMat);
+  
+  // The pixels of tag 0 are 8 connected through the diagonals
+  
+  XCTAssert(numLabels == 4, @"num labels");
+  
+  XCTAssert(labelsMat.at<int32_t>(0, 0) == 0 && labelsMat.at<int32_t>(0, 1) == 0, @"first region");
+  XCTAssert(labelsMat.at<int32_t>(0, 2) == 1, @"second region");
+  XCTAssert(labelsMat.at<int32_t>(0, 3) == 2 && labelsMat.at<int32_t>(1, 2) == 2 && labelsMat.at<int32_t>(2, 1) == 2, @"diagonal region");
+  XCTAssert(labelsMat.at<int32_t>(1, 0) == 1 && labelsMat.at<int32_t>(3, 0) == 1 && labelsMat.at<int32_t>(2, 3) == 1, @"joined region");
+  XCTAssert(labelsMat.at<int32_t>(1, 3) == 1, @"diagonal neighbor");
+  XCTAssert(labelsMat.at<int32_t>(3, 2) == 3 && labelsMat.at<int32_t>(3, 3) == 3, @"split tag");
+}
+
+// A tag used by pieces that are not 8 connected is split into a new tag
+
+- (void)testSplitSplayPixels
+{
+  NSArray *pixelsArr = @[
+                         @(1), @(1), @(0), @(2),
+                         @(0), @(0), @(2), @(0),
+                         @(0), @(2), @(0), @(0),
+                         @(0), @(0), @(1), @(1)
+                         ];
+  
+  Mat tagsImg(4, 4, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Superpixel::splitSplayPixels(tagsImg);
+  
+  // The first piece of tag 1 keeps the tag, the second gets the max tag plus 1
+  
+  XCTAssert(Vec3BToUID(tagsImg.at<Vec3b>(0, 0)) == 1 && Vec3BToUID(tagsImg.at<Vec3b>(0, 1)) == 1, @"first piece");
+  XCTAssert(Vec3BToUID(tagsImg.at<Vec3b>(3, 2)) == 3 && Vec3BToUID(tagsImg.at<Vec3b>(3, 3)) == 3, @"split piece");
+  
+  // Diagonal pixels of tag 2 and all the pixels of tag 0 are 8 connected
+  
+  XCTAssert(Vec3BToUID(tagsImg.at<Vec3b>(0, 3)) == 2 && Vec3BToUID(tagsImg.at<Vec3b>(2, 1)) == 2, @"diagonal piece");
+  XCTAssert(Vec3BToUID(tagsImg.at<Vec3b>(0, 2)) == 0 && Vec3BToUID(tagsImg.at<Vec3b>(3, 0)) == 0, @"connected tag");
+  
+  Mat labelsMat;
+  XCTAssert(labelConnectedTags(tagsImg, labelsMat) == 4, @"one tag for each piece");
+}
+
+// Artifacts are discarded when the input image changes
+
+- (void)testClusteringCombineArtifacts
+{
+  Mat img1(2, 2, CV_8UC3, Scalar(0, 0, 0));
+  Mat img2 = img1.clone();
+  
+  XCTAssert(matContentHash(img1) == matContentHash(img2), @"same content");
+  
+  img2.at<Vec3b>(1, 1) = Vec3b(0, 0, 1);
+  
+  XCTAssert(matContentHash(img1) != matContentHash(img2), @"different content");
+  
+  // The same pixels in a different shape are not the same content
+  
+  Mat img3 = img1.reshape(3, 1);
+  
+  XCTAssert(matContentHash(img1) != matContentHash(img3), @"different shape");
+  
+  ClusteringCombineArtifacts artifacts;
+  
+  artifacts.setInputHash(matContentHash(img1));
+  artifacts.srmTags = img1.clone();
+  artifacts.srmInsideOutOrder.push_back(1);
+  
+  // Same input keeps the artifacts
+  
+  artifacts.setInputHash(matContentHash(img1));
+  
+  XCTAssert(!artifacts.srmTags.empty(), @"kept tags");
+  XCTAssert(artifacts.srmInsideOutOrder.size() == 1, @"kept order");
+  
+  artifacts.setInputHash(matContentHash(img2));
+  
+  XCTAssert(artifacts.srmTags.empty(), @"discarded tags");
+  XCTAssert(artifacts.srmInsideOutOrder.size() == 0, @"discarded order");
+  XCTAssert(artifacts.inputHash == matContentHash(img2), @"input hash");
+  
+  ClusteringCombineStageTime stageTime;
+  stageTime.name = "srm";
+  stageTime.seconds = 0.5;
+  stageTime.cached = true;
+  stageTime.hasMemoryStats = false;
+  artifacts.stageTimes.push_back(stageTime);
+  
+  std::stringstream os;
+  artifacts.printStageTimes(os);
+  
+  XCTAssert(os.str().find("srm") != string::npos && os.str().find("(cached)") != string::npos, @"stage times");
+}
+
+// Debug images are not written once disabled for this thread
+
+- (void)testDebugImageOutputDisabled
+{
+  Mat img(2, 2, CV_8UC3, Scalar(0, 0, 0));
+  
+  DebugOutputLevel level = getDebugOutputLevel();
+  
+  setDebugOutputLevel(DEBUG_OUTPUT_TRACE);
+  
+  bool wrote = debugImwrite("debug_image_output_disabled.png", img);
+  
+  setDebugOutputLevel(level);
+  
+  XCTAssert(wrote == false, @"not written");
+}
+
+// Tag images can be limited to specific tags
+
+- (void)testDebugOutputTags
+{
+  DebugOutputLevel level = getDebugOutputLevel();
+  
+  XCTAssert(isDebugOutputTag(1) && isDebugOutputTag(2), @"all tags");
+  
+  vector<int32_t> tags;
+  tags.push_back(3);
+  tags.push_back(1);
+  setDebugOutputTags(tags);
+  
+  XCTAssert(isDebugOutputTag(1) && isDebugOutputTag(3), @"enabled tags");
+  XCTAssert(!isDebugOutputTag(2), @"disabled tag");
+  
+  setDebugOutputLevel(DEBUG_OUTPUT_NONE);
+  
+  XCTAssert(!isDebugTraceEnabled() && !isDebugStageImagesEnabled() && !isDebugTagImagesEnabled(1), @"no output");
+  
+  setDebugOutputLevel(level);
+  setDebugOutputTags(vector<int32_t>());
+  
+  XCTAssert(isDebugOutputTag(2), @"all tags again");
+}
+
+// Queued debug images are written by the time the writer is stopped
+
+- (void)testDebugImageWriterRaw
+{
+  Mat img(2, 3, CV_8UC3, Scalar(1, 2, 3));
+  
+  startDebugImageWriter(2, 1, DEBUG_IMAGE_FORMAT_RAW);
+  
+  bool queued = debugImwrite("debug_image_writer_test.png", img);
+  
+  // The queued image is a copy
+  
+  img = Scalar(0, 0, 0);
+  
+  stopDebugImageWriter();
+  
+  bool enabled = isDebugStageImagesEnabled();
+  
+  XCTAssert(queued == enabled, @"queued");
+  
+  if (enabled) {
+    FILE *fp = fopen("debug_image_writer_test.raw", "rb");
+    XCTAssert(fp != NULL, @"raw file");
+    
+    int32_t header[3];
+    uint8_t pixels[2 * 3 * 3];
+    XCTAssert(fread(header, sizeof(header), 1, fp) == 1, @"header");
+    XCTAssert(fread(pixels, sizeof(pixels), 1, fp) == 1, @"pixels");
+    fclose(fp);
+    unlink("debug_image_writer_test.raw");
+    
+    XCTAssert(header[0] == 2 && header[1] == 3 && header[2] == CV_8UC3, @"header");
+    XCTAssert(pixels[0] == 1 && pixels[1] == 2 && pixels[2] == 3, @"pixels");
+  }
+  
+  startDebugImageWriter(1, 1, DEBUG_IMAGE_FORMAT_DEFAULT);
+  stopDebugImageWriter();
+}
+
+// Capture bounds are the block bbox of a region grown by the morph blocks
+
+- (void)testCaptureRegionMaskBounds
+{
+  // 40x8 pixels as 10x2 blocks of 4x4, tag 1 covers blocks 4 and 5
+  
+  Mat tagsImg(8, 40, CV_8UC3, Scalar(0, 0, 0));
+  tagsImg(cv::Rect(16, 0, 8, 8)) = Scalar(1, 0, 0);
+  tagsImg.at<Vec3b>(0, 0) = Vec3b(2, 0, 0);
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  cv::Rect bounds = captureRegionMaskBounds(spImage, tagsImg, 1+1, 10, 2, 4);
+  
+  XCTAssert(bounds == cv::Rect(8, 0, 24, 8), @"expanded bounds");
+  
+  // A region inside one block is not captured
+  
+  bounds = captureRegionMaskBounds(spImage, tagsImg, 2+1, 10, 2, 4);
+  
+  XCTAssert(bounds.area() == 0, @"too small");
+  
+  // The bbox of merged pixels is returned by the merge
+  
+  RegionRemerger remerger(tagsImg);
+  remerger.maskMat(cv::Rect(3, 2, 5, 4)) = Scalar(0xFF);
+  
+  cv::Rect mergedBounds = remerger.mergeFromMask();
+  
+  XCTAssert(mergedBounds == cv::Rect(3, 2, 5, 4), @"merged bounds");
+}
+
+// A coord grid stores values for coords inside the bbox of the coords
+
+- (void)testCoordGrid
+{
+  vector<Coord> coords;
+  coords.push_back(Coord(5, 3));
+  coords.push_back(Coord(2, 4));
+  coords.push_back(Coord(4, 2));
+  
+  CoordBitSet bitSet(coords);
+  
+  XCTAssert(bitSet.roi == cv::Rect(2, 2, 4, 3), @"bbox");
+  XCTAssert(bitSet.size() == 0, @"empty");
+  
+  for ( Coord c : coords ) {
+    bool added = bitSet.insert(c);
+    XCTAssert(added, @"added");
+  }
+  
+  XCTAssert(bitSet.insert(Coord(5, 3)) == false, @"already added");
+  XCTAssert(bitSet.size() == 3, @"size");
+  XCTAssert(bitSet.contains(Coord(2, 4)), @"contains");
+  XCTAssert(bitSet.contains(Coord(3, 3)) == false, @"not contains");
+  XCTAssert(bitSet.contains(Coord(0, 0)) == false, @"outside bbox");
+  XCTAssert(bitSet.contains(Coord(6, 3)) == false, @"outside bbox");
+  
+  // Coords are visited in sorted order
+  
+  vector<Coord> sortedCoords = coords;
+  sort(sortedCoords.begin(), sortedCoords.end());
+  
+  XCTAssert(bitSet.getCoords() == sortedCoords, @"sorted");
+  
+  XCTAssert(bitSet.erase(Coord(4, 2)), @"erased");
+  XCTAssert(bitSet.erase(Coord(0, 0)) == false, @"erase outside bbox");
+  XCTAssert(bitSet.size() == 2, @"size");
+  
+  CoordGrid<int32_t> grid(coords);
+  
+  XCTAssert(grid.find(Coord(5, 3)) == NULL, @"not found");
+  
+  grid[Coord(5, 3)] = 7;
+  grid[Coord(2, 4)] += 2;
+  
+  XCTAssert(grid.size() == 2, @"size");
+  XCTAssert(grid.contains(Coord(5, 3)), @"contains");
+  XCTAssert(*grid.find(Coord(5, 3)) == 7, @"value");
+  XCTAssert(*grid.find(Coord(2, 4)) == 2, @"value");
+  XCTAssert(grid.find(Coord(10, 10)) == NULL, @"outside bbox");
+  
+  vector<int32_t> values;
+  grid.forEach([&values](Coord c, int32_t &value) {
+    values.push_back(value);
+  });
+  
+  XCTAssert(values.size() == 2 && values[0] == 7 && values[1] == 2, @"values in sorted order");
+  
+  grid.erase(Coord(5, 3));
+  
+  XCTAssert(grid.size() == 1, @"size");
+  XCTAssert(grid[Coord(5, 3)] == 0, @"value reset by erase");
+}
+
+// The histogram for each block of 4x4 pixels counts quant pixels inline
+
+- (void)testGenHistogramsForBlocks
+{
+  // Block 0 is all one color, block 1 has 10 white pixels and 6 red pixels
+  
+  Mat inputImg(4, 8, CV_8UC3, Scalar(0, 0, 0));
+  
+  for ( int i = 0; i < 16; i++ ) {
+    int x = 4 + (i % 4);
+    int y = i / 4;
+    inputImg.at<Vec3b>(y, x) = (i < 10) ? Vec3b(0xFF, 0xFF, 0xFF) : Vec3b(0, 0, 200);
+  }
+  
+  CoordGrid<HistogramForBlock> blockMap;
+  
+  Mat blockMat = genHistogramsForBlocks(inputImg, blockMap, 2, 1, 4);
+  
+  XCTAssert(blockMat.cols == 2 && blockMat.rows == 1, @"block dims");
+  XCTAssert(blockMap.size() == 2, @"num blocks");
+  
+  HistogramForBlock *hfb = blockMap.find(Coord(0, 0));
+  
+  XCTAssert(hfb->numPixels == 1, @"one pixel");
+  XCTAssert(hfb->counts[0] == 16, @"count");
+  XCTAssert(hfb->regionQuantPixel == 0x0, @"black");
+  
+  hfb = blockMap.find(Coord(1, 0));
+  
+  XCTAssert(hfb->numPixels == 2, @"two pixels");
+  XCTAssert(hfb->counts[0] == 10 && hfb->counts[1] == 6, @"counts");
+  XCTAssert(hfb->regionQuantPixel == 0x00FFFFFF, @"white");
+  XCTAssert(blockMat.at<Vec3b>(0, 1) == Vec3b(0xFF, 0xFF, 0xFF), @"block pixel");
+}
+
+// The palette offset of each pixel written by genHistogramsForBlocks() gives
+// the same cluster centers as mapping the region pixels again.
+
+- (void)testGenHistogramsForBlocksPaletteIndexes
+{
+  Mat inputImg(6, 7, CV_8UC3);
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      inputImg.at<Vec3b>(y, x) = (x < 3) ? Vec3b(0xFF, 0xFF, 0xFF) : Vec3b(0, 0, (y < 3) ? 200 : 0);
+    }
+  }
+  
+  CoordGrid<HistogramForBlock> blockMap;
+  Mat paletteIndexMat;
+  
+  genHistogramsForBlocks(inputImg, blockMap, 2, 2, 4, &paletteIndexMat);
+  
+  XCTAssert(paletteIndexMat.type() == CV_16UC1 && paletteIndexMat.size() == inputImg.size(), @"index dims");
+  
+  const SubdividedColors &subdividedColors = SubdividedColors::getInstance();
+  
+  vector<Coord> regionCoords;
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      uint32_t pixel = Vec3BToUID(inputImg.at<Vec3b>(y, x));
+      XCTAssert(paletteIndexMat.at<uint16_t>(y, x) == subdividedColors.lookupIndex(pixel), @"offset");
+      
+      if (x > 1) {
+        regionCoords.push_back(Coord(x, y));
+      }
+    }
+  }
+  
+  vector<uint32_t> clusterCenters;
+  vector<uint32_t> indexedClusterCenters;
+  
+  bool isVeryClose = estimateClusterCenters(inputImg, 1, regionCoords, clusterCenters);
+  bool indexedIsVeryClose = estimateClusterCenters(inputImg, 1, regionCoords, indexedClusterCenters, &paletteIndexMat);
+  
+  XCTAssert(isVeryClose == indexedIsVeryClose, @"very close");
+  XCTAssert(clusterCenters == indexedClusterCenters, @"cluster centers");
+}
+
+// The full 4x4 block histograms, the edge blocks and a 3x3 block grid all
+// count the palette offsets in the order each offset is first seen
+
+- (void)testGenHistogramsForBlocksDims
+{
+  Mat inputImg(10, 9, CV_8UC3);
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      int colori = ((x * 7) + (y * 3) + ((x * y) % 5)) % 4;
+      inputImg.at<Vec3b>(y, x) = Vec3b(colori * 80, 0xFF - (colori * 60), (colori & 0x1) * 200);
+    }
+  }
+  
+  const SubdividedColors &subdividedColors = SubdividedColors::getInstance();
+  
+  for ( int superpixelDim : { 4, 3 } ) {
+    const int blockWidth = (inputImg.cols + superpixelDim - 1) / superpixelDim;
+    const int blockHeight = (inputImg.rows + superpixelDim - 1) / superpixelDim;
+    
+    CoordGrid<HistogramForBlock> blockMap;
+    genHistogramsForBlocks(inputImg, blockMap, blockWidth, blockHeight, superpixelDim);
+    
+    for ( int by = 0; by < blockHeight; by++ ) {
+      for ( int bx = 0; bx < blockWidth; bx++ ) {
+        vector<uint8_t> offsets;
+        vector<uint8_t> counts;
+        
+        for ( int y = by * superpixelDim; y < min((by + 1) * superpixelDim, inputImg.rows); y++ ) {
+          for ( int x = bx * superpixelDim; x < min((bx + 1) * superpixelDim, inputImg.cols); x++ ) {
+            uint8_t offset = (uint8_t) subdividedColors.lookupIndex(Vec3BToUID(inputImg.at<Vec3b>(y, x)));
+            auto it = find(offsets.begin(), offsets.end(), offset);
+            if (it == offsets.end()) {
+              offsets.push_back(offset);
+              counts.push_back(1);
+            } else {
+              counts[it - offsets.begin()] += 1;
+            }
+          }
+        }
+        
+        HistogramForBlock *hfb = blockMap.find(Coord(bx, by));
+        
+        XCTAssert(hfb->numPixels == offsets.size(), @"num pixels");
+        XCTAssert(vector<uint8_t>(hfb->paletteOffsets, hfb->paletteOffsets + hfb->numPixels) == offsets, @"first seen order");
+        XCTAssert(vector<uint8_t>(hfb->counts, hfb->counts + hfb->numPixels) == counts, @"counts");
+      }
+    }
+  }
+}
+
+// RegionPixels reads the region pixels once, the pixel counts and a quant for
+// the same number of clusters are shared by each branch that asks for them.
+
+- (void)testRegionPixels
+{
+  Mat inputImg(4, 4, CV_8UC3, Scalar(0, 0, 0));
+  
+  for ( int x = 0; x < 4; x++ ) {
+    inputImg.at<Vec3b>(0, x) = Vec3b(0xFF, 0xFF, 0xFF);
+  }
+  
+  vector<Coord> regionCoords;
+  
+  for ( int y = 0; y < 2; y++ ) {
+    for ( int x = 0; x < 4; x++ ) {
+      regionCoords.push_back(Coord(x, y));
+    }
+  }
+  
+  Mat packedImg;
+  packPixels(inputImg, packedImg);
+  
+  RegionPixels regionPixels(packedImg, regionCoords);
+  
+  XCTAssert(regionPixels.size() == 8, @"size");
+  XCTAssert(regionPixels.getPixels()[0] == 0x00FFFFFF && regionPixels.getPixels()[4] == 0x0, @"pixels");
+  
+  const unordered_map<uint32_t, uint32_t> &pixelCounts = regionPixels.getPixelCounts();
+  
+  XCTAssert(pixelCounts.size() == 2, @"distinct pixels");
+  XCTAssert(pixelCounts.at(0x00FFFFFF) == 4 && pixelCounts.at(0x0) == 4, @"counts");
+  
+  XCTAssert(regionPixels.getPalettePixels()[0] == 0x00FFFFFF, @"palette pixel");
+  
+  const RegionPixelsQuant &quant = regionPixels.getQuant(4);
+  
+  XCTAssert(&quant == &regionPixels.getQuant(4), @"shared quant");
+  XCTAssert(quant.quantPixels.size() == 8, @"quant pixels");
+  XCTAssert(quant.colortable.size() >= 2 && quant.colortable.size() <= 4, @"clusters");
+  
+  vector<uint32_t> clusterCenters;
+  vector<uint32_t> sharedClusterCenters;
+  
+  bool isVeryClose = estimateClusterCenters(inputImg, 1, regionCoords, clusterCenters);
+  bool sharedIsVeryClose = estimateClusterCenters(inputImg, 1, regionPixels, sharedClusterCenters);
+  
+  XCTAssert(isVeryClose == sharedIsVeryClose, @"very close");
+  XCTAssert(clusterCenters.size() == sharedClusterCenters.size(), @"cluster centers");
+}
+
+// Integer peak detection finds the same peaks as detect_peak() on doubles
+
+- (void)testDetectPeakIntegerCounts
+{
+  vector<uint32_t> counts = { 0, 3, 3, 9, 2, 2, 5, 1, 7, 7, 0 };
+  vector<double> doubleCounts(counts.begin(), counts.end());
+  
+  int n = (int) counts.size();
+  
+  int emiPeaks[16], absorpPeaks[16];
+  int numEmi = 0, numAbsorp = 0;
+  
+  int result = detect_peak(doubleCounts.data(), n, emiPeaks, &numEmi, 16, absorpPeaks, &numAbsorp, 16, 1e-6, 0);
+  
+  XCTAssert(result == 0, @"detect_peak");
+  
+  vector<vector<uint32_t> > histograms;
+  histograms.push_back(counts);
+  histograms.push_back(counts);
+  
+  vector<vector<int> > batchEmiPeaks, batchAbsorpPeaks;
+  
+  int numFailed = detect_peaks_batch<uint32_t>(histograms, 0, 0, batchEmiPeaks, batchAbsorpPeaks);
+  
+  XCTAssert(numFailed == 0, @"batch");
+  XCTAssert(batchEmiPeaks.size() == 2, @"batch size");
+  
+  for ( int h = 0; h < 2; h++ ) {
+    XCTAssert(batchEmiPeaks[h] == vector<int>(emiPeaks, emiPeaks + numEmi), @"emission peaks");
+    XCTAssert(batchAbsorpPeaks[h] == vector<int>(absorpPeaks, absorpPeaks + numAbsorp), @"absorption peaks");
+  }
+  
+  XCTAssert(batchEmiPeaks[0] == vector<int>({3, 6, 8}), @"peak offsets");
+  
+  // Not enough space for the emission peaks
+  
+  result = detect_peak_t<uint32_t>(counts.data(), n, emiPeaks, &numEmi, 1, absorpPeaks, &numAbsorp, 16, 0, 0);
+  
+  XCTAssert(result == 1, @"too many peaks");
+}
+
+// Inside/outside votes for each colortable pixel based on the region coords
+
+- (void)testInsideOutsideTest
+{
+  vector<Coord> coords;
+  coords.push_back(Coord(1, 1));
+  coords.push_back(Coord(2, 1));
+  coords.push_back(Coord(3, 1));
+  
+  vector<Coord> regionCoords = coords;
+  regionCoords.push_back(Coord(0, 0));
+  regionCoords.push_back(Coord(1, 0));
+  regionCoords.push_back(Coord(2, 0));
+  
+  // The first 3 coords are inside
+  
+  uint32_t outPixels[] = { 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF };
+  
+  vector<uint32_t> sortedColortable;
+  sortedColortable.push_back(0xFF);
+  sortedColortable.push_back(0x00);
+  sortedColortable.push_back(0xFF00);
+  
+  unordered_map<uint32_t, InsideOutsideRecord> pixelToInsideMap;
+  
+  insideOutsideTest(4, 2, coords, 1, regionCoords, outPixels, sortedColortable, pixelToInsideMap);
+  
+  XCTAssert(pixelToInsideMap.size() == 3, @"size");
+  
+  InsideOutsideRecord &inOut1 = pixelToInsideMap[0xFF];
+  XCTAssert(inOut1.inside == 2 && inOut1.outside == 1, @"counts");
+  XCTAssert(inOut1.isInside == true, @"inside");
+  
+  InsideOutsideRecord &inOut2 = pixelToInsideMap[0x00];
+  XCTAssert(inOut2.inside == 1 && inOut2.outside == 2, @"counts");
+  XCTAssert(inOut2.isInside == false, @"outside");
+  
+  // A colortable pixel with no region pixels is assumed to be inside
+  
+  InsideOutsideRecord &inOut3 = pixelToInsideMap[0xFF00];
+  XCTAssert(inOut3.inside == 1 && inOut3.outside == 0, @"counts");
+  XCTAssert(inOut3.isInside == true && inOut3.confidence == 1.0f, @"inside");
+}
+
+// Contour of a small region in a larger Mat is returned in Mat coordinates
+
+- (void)testFindContourOutlineROI {
+  Mat binMat(64, 64, CV_8UC1, Scalar(0));
+  
+  for ( int y = 20; y < 23; y++ ) {
+    for ( int x = 30; x < 33; x++ ) {
+      binMat.at<uint8_t>(y, x) = 0xFF;
+    }
+  }
+  
+  vector<Point2i> contour;
+  findContourOutline(binMat, contour, false);
+  
+  XCTAssert(contour.size() == 8, @"contour");
+  
+  for ( Point2i p : contour ) {
+    XCTAssert(p.x >= 30 && p.x < 33, @"contour x");
+    XCTAssert(p.y >= 20 && p.y < 23, @"contour y");
+  }
+  
+  // A caller supplied ROI that is larger than the region gives the same contour
+  
+  vector<Point2i> roiContour;
+  findContourOutline(binMat, Rect(25, 15, 20, 20), roiContour, false);
+  
+  XCTAssert(roiContour == contour, @"roi contour");
+  
+  // A region on the edge of the Mat
+  
+  binMat = Scalar(0);
+  binMat.at<uint8_t>(0, 0) = 0xFF;
+  binMat.at<uint8_t>(0, 1) = 0xFF;
+  
+  vector<Point2i> edgeContour;
+  findContourOutline(binMat, edgeContour, false);
+  
+  XCTAssert(edgeContour.size() == 2, @"edge contour");
+  XCTAssert(edgeContour[0] == Point2i(0, 0), @"edge contour");
+  XCTAssert(edgeContour[1] == Point2i(1, 0), @"edge contour");
+}
+
+// Trace the outer boundary of tags directly from a tags image
+
+- (void)testTraceTagContour {
+  Mat tagsImg(4, 5, CV_8UC3, Scalar(0, 0, 0));
+  
+  // Tag 1 is a 1 pixel wide line across the top row, tag 2 is a 2x2 block and
+  // tag 0 fills the rest.
+  
+  Vec3b tag1 = PixelToVec3b(1);
+  Vec3b tag2 = PixelToVec3b(2);
+  
+  for ( int x = 0; x < 3; x++ ) {
+    tagsImg.at<Vec3b>(0, x) = tag1;
+  }
+  
+  tagsImg.at<Vec3b>(2, 3) = tag2;
+  tagsImg.at<Vec3b>(2, 4) = tag2;
+  tagsImg.at<Vec3b>(3, 3) = tag2;
+  tagsImg.at<Vec3b>(3, 4) = tag2;
+  
+  vector<Point2i> contour;
+  traceTagContour(tagsImg, 1, Coord(0, 0), contour);
+  
+  XCTAssert(contour.size() == 4, @"line contour");
+  XCTAssert(contour[0] == Point2i(1, 0), @"line contour");
+  XCTAssert(contour[1] == Point2i(2, 0), @"line contour");
+  XCTAssert(contour[2] == Point2i(1, 0), @"line contour");
+  XCTAssert(contour[3] == Point2i(0, 0), @"line contour");
+  
+  unordered_map<int32_t, vector<Point2i> > contours;
+  traceAllTagContours(tagsImg, contours);
+  
+  XCTAssert(contours.size() == 3, @"all contours");
+  XCTAssert(contours[1] == contour, @"all contours");
+  
+  // Clockwise around the block starting after the seed
+  
+  vector<Point2i> &blockContour = contours[2];
+  XCTAssert(blockContour.size() == 4, @"block contour");
+  XCTAssert(blockContour[0] == Point2i(4, 2), @"block contour");
+  XCTAssert(blockContour[1] == Point2i(4, 3), @"block contour");
+  XCTAssert(blockContour[2] == Point2i(3, 3), @"block contour");
+  XCTAssert(blockContour[3] == Point2i(3, 2), @"block contour");
+  
+  // Tag 0 starts at (3,0) and wraps around both of the other tags
+  
+  vector<Point2i> &bgContour = contours[0];
+  XCTAssert(bgContour.back() == Point2i(3, 0), @"background contour");
+  
+  // A single pixel
+  
+  tagsImg = Scalar(0, 0, 0);
+  tagsImg.at<Vec3b>(1, 1) = tag1;
+  
+  traceTagContour(tagsImg, 1, Coord(1, 1), contour);
+  XCTAssert(contour.size() == 1, @"single contour");
+  XCTAssert(contour[0] == Point2i(1, 1), @"single contour");
+}
+
+// A merged hull is the same as the hull of the union of the points
+
+- (void)testMergeConvexHulls {
+  vector<Point2i> points1;
+  points1.push_back(Point2i(0, 0));
+  points1.push_back(Point2i(2, 0));
+  points1.push_back(Point2i(1, 1));
+  points1.push_back(Point2i(0, 2));
+  points1.push_back(Point2i(2, 2));
+  
+  vector<Point2i> hull1;
+  convexHullOfPoints(points1, hull1);
+  
+  // The center point is not a vertex and the hull is clockwise from (0,0)
+  
+  XCTAssert(hull1.size() == 4, @"hull1");
+  XCTAssert(hull1[0] == Point2i(0, 0), @"hull1");
+  XCTAssert(hull1[1] == Point2i(2, 0), @"hull1");
+  XCTAssert(hull1[2] == Point2i(2, 2), @"hull1");
+  XCTAssert(hull1[3] == Point2i(0, 2), @"hull1");
+  
+  vector<Point2i> points2;
+  points2.push_back(Point2i(3, 1));
+  points2.push_back(Point2i(5, 1));
+  points2.push_back(Point2i(4, 4));
+  
+  vector<Point2i> hull2;
+  convexHullOfPoints(points2, hull2);
+  
+  vector<Point2i> mergedHull;
+  mergeConvexHulls(hull1, hull2, mergedHull);
+  
+  vector<Point2i> allPoints = points1;
+  allPoints.insert(allPoints.end(), points2.begin(), points2.end());
+  
+  vector<Point2i> allHull;
+  convexHullOfPoints(allPoints, allHull);
+  
+  XCTAssert(mergedHull == allHull, @"merged hull");
+  XCTAssert(mergedHull.size() == 5, @"merged hull");
+  
+  // A superpixel hull is merged when the superpixels are merged
+  
+  Superpixel sp1(1);
+  Superpixel sp2(2);
+  
+  for ( int x = 0; x < 4; x++ ) {
+    sp1.coords.push_back(Coord(x, 0));
+    sp2.coords.push_back(Coord(x, 3));
+  }
+  sp1.coords.push_back(Coord(0, 1));
+  
+  XCTAssert(sp1.convexHull().size() == 3, @"sp1 hull");
+  XCTAssert(sp2.convexHull().size() == 2, @"sp2 hull");
+  
+  sp1.mergeStats(&sp2);
+  sp1.coords.splice(sp2.coords);
+  
+  XCTAssert(sp1.hullNumCoords == 9, @"merged sp hull");
+  
+  const vector<Point2i> &spHull = sp1.convexHull();
+  XCTAssert(spHull.size() == 4, @"merged sp hull");
+  XCTAssert(spHull[0] == Point2i(0, 0), @"merged sp hull");
+  XCTAssert(spHull[1] == Point2i(3, 0), @"merged sp hull");
+  XCTAssert(spHull[2] == Point2i(3, 3), @"merged sp hull");
+  XCTAssert(spHull[3] == Point2i(0, 3), @"merged sp hull");
+}
+
+// Scanline fill of a polygon includes the edge pixels and the pixels inside
+
+- (void)testScanlineFillPolygon {
+  vector<Point2i> triangle;
+  triangle.push_back(Point2i(0, 0));
+  triangle.push_back(Point2i(4, 0));
+  triangle.push_back(Point2i(0, 4));
+  
+  vector<PolygonFillRun> runs;
+  scanlineFillPolygonRuns(triangle, runs);
+  
+  XCTAssert(runs.size() == 5, @"one run per row");
+  
+  for ( int y = 0; y < 5; y++ ) {
+    XCTAssert(runs[y].y == y && runs[y].startX == 0 && runs[y].endX == (4 - y), @"triangle row");
+  }
+  
+  // A concave U traced from a region fills back to the region and not the gap
+  
+  Mat binMat(6, 7, CV_8UC1, Scalar(0));
+  binMat(Rect(1, 1, 5, 4)) = Scalar(0xFF);
+  binMat(Rect(3, 1, 1, 3)) = Scalar(0);
+  
+  vector<Point2i> contour;
+  traceContourClockwise(binMat.cols, binMat.rows, Coord(1, 1), [&binMat](int x, int y)->bool {
+    return binMat.at<uint8_t>(y, x) != 0;
+  }, contour);
+  
+  RegionMask mask;
+  scanlineFillPolygon(contour, mask);
+  
+  XCTAssert(mask.roi == Rect(1, 1, 5, 4), @"bbox");
+  
+  Mat filledMat(binMat.size(), CV_8UC1, Scalar(0));
+  mask.copyTo(filledMat);
+  
+  XCTAssert(countNonZero(filledMat != binMat) == 0, @"same pixels");
+  
+  scanlineFillPolygonRuns(vector<Point2i>(), runs);
+  
+  XCTAssert(runs.empty(), @"empty polygon");
+}
+
+// Split a contour into line and curve spans that wrap around
+
+- (void)testSplitContourIntoLineSpans {
+  // Clockwise outline of a 6x4 rectangle, each side is a line
+  
+  vector<Point2i> contour;
+  
+  for ( int x = 0; x < 5; x++ ) {
+    contour.push_back(Point2i(x, 0));
+  }
+  for ( int y = 0; y < 3; y++ ) {
+    contour.push_back(Point2i(5, y));
+  }
+  for ( int x = 5; x > 0; x-- ) {
+    contour.push_back(Point2i(x, 3));
+  }
+  for ( int y = 3; y > 0; y-- ) {
+    contour.push_back(Point2i(0, y));
+  }
+  
+  vector<ContourSpan> spans = splitContourIntoLineSpans(contour, 0.5);
+  
+  XCTAssert(spans.size() == 4, @"spans");
+  
+  int total = 0;
+  
+  for ( ContourSpan &span : spans ) {
+    XCTAssert(span.isLine, @"line");
+    total += span.end - span.start;
+  }
+  
+  XCTAssert(total == (int) contour.size(), @"total");
+  
+  XCTAssert(spans[0].start == 0 && spans[0].end == 5, @"top");
+  XCTAssert(spans[0].slope == Point2f(1.0f, 0.0f), @"top");
+  XCTAssert(spans[1].start == 5 && spans[1].end == 8, @"right");
+  XCTAssert(spans[1].slope == Point2f(0.0f, 1.0f), @"right");
+  XCTAssert(spans[3].start == 13 && spans[3].end == 16, @"left");
+  XCTAssert(spans[3].slope == Point2f(0.0f, -1.0f), @"left");
+  
+  // Start the same contour in the middle of the top, the top line is
+  // the last span and it wraps around the end of the contour.
+  
+  std::rotate(contour.begin(), contour.begin() + 2, contour.end());
+  
+  spans = splitContourIntoLineSpans(contour, 0.5);
+  
+  XCTAssert(spans.size() == 4, @"rotated spans");
+  XCTAssert(spans.back().isLine, @"rotated spans");
+  XCTAssert(spans.back().end == (int) contour.size() + 3, @"wrap");
+  XCTAssert(spans.back().slope == Point2f(1.0f, 0.0f), @"wrap");
+  XCTAssert(spans.front().start == (spans.back().end - (int) contour.size()), @"wrap");
+  
+  // A single pixel is a curve
+  
+  contour.clear();
+  contour.push_back(Point2i(1, 1));
+  
+  spans = splitContourIntoLineSpans(contour, 1.4);
+  
+  XCTAssert(spans.size() == 1, @"pixel");
+  XCTAssert(spans[0].isLine == false, @"pixel");
+  XCTAssert(spans[0].start == 0 && spans[0].end == 1, @"pixel");
+}
+
+// Ray tables visit the same pixels as rendering each line
+
+- (void)testBboxRayTable {
+  const int width = 7;
+  const int height = 5;
+  Coord center(3, 2);
+  
+  std::shared_ptr<BboxRayTable> table = BboxRayTableCache::build(width, height, center);
+  
+  vector<Coord> outlineCoords = genRectangleOutline(width, height);
+  
+  XCTAssert(table->rayStarts.size() == (outlineCoords.size() + 1), @"num rays");
+  
+  Mat renderMat(height, width, CV_8UC1);
+  
+  for ( int stepi = 0; stepi < (int) outlineCoords.size(); stepi++ ) {
+    Coord edgeCoord = outlineCoords[stepi];
+    
+    renderMat = Scalar(0);
+    line(renderMat, Point2i(center.x, center.y), Point2i(edgeCoord.x, edgeCoord.y), Scalar(0xFF));
+    
+    vector<Point> locations;
+    findNonZero(renderMat, locations);
+    
+    vector<Coord> rayCoords(table->points.begin() + table->rayStarts[stepi], table->points.begin() + table->rayStarts[stepi+1]);
+    
+    XCTAssert(rayCoords.size() == locations.size(), @"ray size");
+    
+    for ( int i = 0; i < (int) locations.size(); i++ ) {
+      XCTAssert(rayCoords[i] == Coord(locations[i].x, locations[i].y), @"ray coord");
+    }
+  }
+  
+  BboxRayTableCache cache;
+  
+  std::shared_ptr<const BboxRayTable> cached1 = cache.lookup(width, height, center);
+  std::shared_ptr<const BboxRayTable> cached2 = cache.lookup(width, height, center);
+  
+  XCTAssert(cache.size() == 1, @"cache size");
+  XCTAssert(cached1 == cached2, @"cache hit");
+  XCTAssert(cached1->points == table->points, @"cache table");
+}
+
+// Line point iterators give the same points as the vector versions
+
+- (void)testPointsOnLine {
+  Point2i p1(1, 2);
+  Point2i p2(7, 5);
+  
+  vector<Point2i> points;
+  
+  for ( Point2i p : PointsOnLine<int>(p1, p2) ) {
+    points.push_back(p);
+  }
+  
+  XCTAssert(points == generatePointsOnLine(p1, p2), @"int points");
+  XCTAssert(points.front() == p1, @"int points");
+  XCTAssert(points.back() == p2, @"int points");
+  
+  // A zero length line is the one point
+  
+  points.clear();
+  
+  PointsOnLine<int>(p1, p1).forEach([&points](const Point2i &p) {
+    points.push_back(p);
+  });
+  
+  XCTAssert(points.size() == 1, @"zero length");
+  XCTAssert(points[0] == p1, @"zero length");
+  
+  Point2f f1(0.5f, 0.5f);
+  Point2f f2(3.25f, 1.75f);
+  
+  vector<Point2f> floatPoints;
+  
+  for ( Point2f p : PointsOnLine<float>(f1, f2) ) {
+    floatPoints.push_back(p);
+  }
+  
+  XCTAssert(floatPoints == generateFloatPointsOnLine(f1, f2), @"float points");
+  XCTAssert(floatPoints.front() == f1, @"float points");
+}
+
+// Batch contour normals point outside a clockwise contour and the rays share one buffer
+
+- (void)testContourNormalsBatch {
+  // Clockwise square with y down, 10 points on each side
+  
+  vector<Point2i> contour;
+  
+  for ( int x = 0; x < 10; x++ ) {
+    contour.push_back(Point2i(x, 0));
+  }
+  for ( int y = 0; y < 10; y++ ) {
+    contour.push_back(Point2i(10, y));
+  }
+  for ( int x = 10; x > 0; x-- ) {
+    contour.push_back(Point2i(x, 10));
+  }
+  for ( int y = 10; y > 0; y-- ) {
+    contour.push_back(Point2i(0, y));
+  }
+  
+  const int N = (int) contour.size();
+  
+  ContourSoA soa;
+  contourToSoA(contour, soa);
+  
+  XCTAssert(soa.x.size() == N, @"soa size");
+  XCTAssert(soa.x[12] == 10.0f && soa.y[12] == 2.0f, @"soa point");
+  
+  vector<float> normalX(N);
+  vector<float> normalY(N);
+  
+  const int radius = 2;
+  
+  calcContourNormalsBatch(soa.x.data(), soa.y.data(), N, radius, normalX.data(), normalY.data());
+  
+  for ( int i = 0; i < N; i++ ) {
+    Point2i pL = contour[(i - radius + N) % N];
+    Point2i pR = contour[(i + radius) % N];
+    Point2f tangent(pR.x - pL.x, pR.y - pL.y);
+    float len = sqrt(tangent.x * tangent.x + tangent.y * tangent.y);
+    
+    XCTAssert(fabs(normalX[i] - (tangent.y / len)) < 1e-5, @"normal x");
+    XCTAssert(fabs(normalY[i] - (-tangent.x / len)) < 1e-5, @"normal y");
+  }
+  
+  // Middle of the top side points up and middle of the right side points right
+  
+  XCTAssert(fabs(normalX[5] - 0.0f) < 1e-5 && fabs(normalY[5] - -1.0f) < 1e-5, @"top normal");
+  XCTAssert(fabs(normalX[15] - 1.0f) < 1e-5 && fabs(normalY[15] - 0.0f) < 1e-5, @"right normal");
+  
+  // A zero tangent gives a zero normal
+  
+  {
+    float xs[] = { 1.0f, 2.0f, 1.0f, 2.0f, 1.0f, 2.0f, 1.0f, 2.0f };
+    float ys[] = { 3.0f, 3.0f, 3.0f, 3.0f, 3.0f, 3.0f, 3.0f, 3.0f };
+    float nx[8], ny[8];
+    
+    calcContourNormalsBatch(xs, ys, 8, 2, nx, ny);
+    
+    for ( int i = 0; i < 8; i++ ) {
+      XCTAssert(nx[i] == 0.0f && ny[i] == 0.0f, @"zero normal");
+    }
+  }
+  
+  ContourNormalRays rays;
+  
+  calcContourNormalRaysBatch(soa.x.data(), soa.y.data(), normalX.data(), normalY.data(), N, 1.0f, rays);
+  
+  XCTAssert(rays.size() == N, @"num rays");
+  XCTAssert(rays.points.size() == (N * 3), @"num ray points");
+  
+  for ( int i = 0; i < N; i++ ) {
+    XCTAssert(rays.rayLength(i) == 3, @"ray length");
+    
+    const Point2f *ray = rays.ray(i);
+    
+    XCTAssert(ray[1] == Point2f(contour[i].x, contour[i].y), @"ray on point");
+    XCTAssert(ray[0] == ray[1] - Point2f(normalX[i], normalY[i]), @"ray inside point");
+    XCTAssert(ray[2] == ray[1] + Point2f(normalX[i], normalY[i]), @"ray outside point");
+  }
+  
+  rays.clear();
+  
+  XCTAssert(rays.size() == 0, @"clear");
+}
+
+// Nearest coord grid returns the same coords as closestToCoord()
+
+- (void)testCoordNearestGrid {
+  srand(11);
+  
+  vector<Coord> coords;
+  
+  for ( int i = 0; i < 300; i++ ) {
+    coords.push_back(Coord(10 + (rand() % 120), 20 + (rand() % 60)));
+  }
+  
+  // Duplicate coords return the first offset
+  
+  coords.push_back(coords[5]);
+  
+  vector<Coord> queries;
+  
+  for ( int i = 0; i < 500; i++ ) {
+    queries.push_back(Coord(rand() % 160, rand() % 120));
+  }
+  
+  queries.push_back(coords[5]);
+  
+  for ( int cellSize : { 0, 1, 7, 200 } ) {
+    CoordNearestGrid grid(coords, cellSize);
+    
+    XCTAssert(grid.size() == coords.size(), @"size");
+    
+    vector<int32_t> offsets;
+    grid.nearestOffsets(queries, offsets);
+    
+    XCTAssert(offsets.size() == queries.size(), @"offsets size");
+    
+    for ( int i = 0; i < (int) queries.size(); i++ ) {
+      Coord expected = closestToCoord(coords, queries[i]);
+      
+      XCTAssert(grid.nearest(queries[i]) == expected, @"nearest");
+      XCTAssert(coords[offsets[i]] == expected, @"nearest offset");
+    }
+    
+    XCTAssert(offsets.back() == 5, @"first duplicate");
+  }
+  
+  CoordNearestGrid emptyGrid((vector<Coord>()));
+  
+  XCTAssert(emptyGrid.nearestOffset(Coord(1, 1)) == -1, @"empty");
+}
+
+// Shape geometry is cached on the tag, the image size and the region coords
+
+- (void)testShapeBoundsGeometryCache {
+  ShapeBoundsGeometryCache cache;
+  
+  vector<Coord> regionCoords;
+  regionCoords.push_back(Coord(1, 1));
+  regionCoords.push_back(Coord(2, 1));
+  
+  cv::Size imageSize(10, 10);
+  
+  XCTAssert(cache.lookup(1, imageSize, regionCoords) == nullptr, @"empty cache");
+  
+  std::shared_ptr<ShapeBoundsGeometry> geometry(new ShapeBoundsGeometry());
+  geometry->imageSize = imageSize;
+  geometry->contourCoords = regionCoords;
+  geometry->regionCenterP = Point2i(1, 1);
+  
+  cache.insert(1, regionCoords, geometry);
+  
+  std::shared_ptr<const ShapeBoundsGeometry> cached = cache.lookup(1, imageSize, regionCoords);
+  
+  XCTAssert(cached == geometry, @"cached");
+  XCTAssert(cached->numCoords == 2, @"num coords");
+  XCTAssert(cached->contourCoords == regionCoords, @"contour coords");
+  
+  // A different tag, image size or set of coords is not cached
+  
+  XCTAssert(cache.lookup(2, imageSize, regionCoords) == nullptr, @"other tag");
+  XCTAssert(cache.lookup(1, cv::Size(20, 10), regionCoords) == nullptr, @"other image size");
+  
+  regionCoords.push_back(Coord(3, 1));
+  
+  XCTAssert(cache.lookup(1, imageSize, regionCoords) == nullptr, @"other coords");
+  XCTAssert(cache.size() == 1, @"size");
+  
+  cache.clear();
+  
+  XCTAssert(cache.size() == 0, @"cleared");
+}
+
+// Threaded distance transform gives the same distances as the serial transform
+
+- (void)testMeijsterParallel {
+  const int width = 37;
+  const int height = 23;
+  
+  Mat mask(height, width, CV_8UC1, Scalar(0));
+  
+  srand(5);
+  
+  for ( int i = 0; i < 40; i++ ) {
+    mask.at<uint8_t>(rand() % height, rand() % width) = 0xFF;
+  }
+  
+  auto isSetTest = [&mask](int x, int y)->bool {
+    return mask.at<uint8_t>(y, x) != 0;
+  };
+  
+  vf::DistanceTransform::Meijster::ManhattanMetric metric;
+  
+  Mat serialMat(height, width, CV_32SC1, Scalar(-1));
+  
+  vf::DistanceTransform::Meijster::calculate([serialMat](int x, int y, int d) mutable {
+    serialMat.at<int32_t>(y, x) = d;
+  }, isSetTest, width, height, metric);
+  
+  // A set pixel is at distance zero and each distance was written
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      int32_t d = serialMat.at<int32_t>(y, x);
+      XCTAssert(d >= 0 && ((d == 0) == isSetTest(x, y)), @"serial distance");
+    }
+  }
+  
+  auto numDiffs = [&serialMat](const Mat &mat)->int {
+    int num = 0;
+    for ( int y = 0; y < mat.rows; y++ ) {
+      for ( int x = 0; x < mat.cols; x++ ) {
+        num += (mat.at<int32_t>(y, x) != serialMat.at<int32_t>(y, x)) ? 1 : 0;
+      }
+    }
+    return num;
+  };
+  
+  vf::DistanceTransform::Meijster::Scratch scratch;
+  
+  for ( int numStripes : { 1, 3, 0, 100 } ) {
+    Mat parallelMat(height, width, CV_32SC1, Scalar(-1));
+    
+    vf::DistanceTransform::Meijster::calculateParallel([parallelMat](int x, int y, int d) mutable {
+      parallelMat.at<int32_t>(y, x) = d;
+    }, isSetTest, width, height, metric, scratch, numStripes);
+    
+    XCTAssert(numDiffs(parallelMat) == 0, @"parallel distances");
+  }
+  
+  // The serial transform reusing the scratch from the threaded runs
+  
+  Mat scratchMat(height, width, CV_32SC1, Scalar(-1));
+  
+  vf::DistanceTransform::Meijster::calculate([scratchMat](int x, int y, int d) mutable {
+    scratchMat.at<int32_t>(y, x) = d;
+  }, isSetTest, width, height, metric, scratch);
+  
+  XCTAssert(numDiffs(scratchMat) == 0, @"scratch distances");
+}
+
+// Scanline flood fill of zero pixels inside a roi
+
+- (void)testScanlineFloodFill {
+  // Zero pixels on the left and right of a wall, the wall has a diagonal gap
+  // at (4,2) and (5,3) that only 8 connected fills can pass through.
+  
+  Mat inMat(6, 10, CV_8UC1, Scalar(0));
+  
+  for ( int y = 0; y < 6; y++ ) {
+    inMat.at<uint8_t>(y, 4) = 0xFF;
+    inMat.at<uint8_t>(y, 5) = 0xFF;
+  }
+  
+  inMat.at<uint8_t>(2, 4) = 0;
+  inMat.at<uint8_t>(3, 5) = 0;
+  
+  // Surround the left side seed
+  
+  inMat.at<uint8_t>(1, 1) = 0xFF;
+  
+  FloodFillScratch scratch;
+  cv::Rect fullRect(0, 0, inMat.cols, inMat.rows);
+  cv::Rect filledRect;
+  
+  Mat outMat(inMat.size(), CV_8UC1, Scalar(0));
+  
+  int numFilled = scanlineFloodFill(inMat, outMat, Point2i(1, 1), 4, fullRect, scratch, &filledRect);
+  
+  // Left side is 4 x 6 plus the gap pixel at (4,2)
+  
+  XCTAssert(numFilled == 25, @"4 connected count");
+  XCTAssert(filledRect == cv::Rect(0, 0, 5, 6), @"4 connected bbox");
+  XCTAssert(countNonZero(outMat) == numFilled, @"4 connected pixels");
+  XCTAssert(outMat.at<uint8_t>(1, 1) == 0xFF, @"seed filled");
+  XCTAssert(outMat.at<uint8_t>(3, 5) == 0, @"gap not passed");
+  
+  outMat = Scalar(0);
+  
+  numFilled = scanlineFloodFill(inMat, outMat, Point2i(1, 1), 8, fullRect, scratch, &filledRect);
+  
+  // The fill passes the diagonal gap to reach the 4 x 6 right side
+  
+  XCTAssert(numFilled == 50, @"8 connected count");
+  XCTAssert(filledRect == fullRect, @"8 connected bbox");
+  XCTAssert(countNonZero(outMat) == numFilled, @"8 connected pixels");
+  
+  // Pixels outside the roi are not read or written
+  
+  outMat = Scalar(0x7F);
+  
+  numFilled = scanlineFloodFill(inMat, outMat, Point2i(1, 1), 8, cv::Rect(0, 0, 3, 3), scratch, &filledRect);
+  
+  XCTAssert(numFilled == 9, @"roi count");
+  XCTAssert(filledRect == cv::Rect(0, 0, 3, 3), @"roi bbox");
+  XCTAssert(outMat.at<uint8_t>(3, 0) == 0x7F, @"outside roi");
+  XCTAssert(outMat.at<uint8_t>(0, 3) == 0x7F, @"outside roi");
+  
+  // A seed outside the roi fills nothing
+  
+  XCTAssert(scanlineFloodFill(inMat, outMat, Point2i(8, 5), 8, cv::Rect(0, 0, 3, 3), scratch) == 0, @"seed outside roi");
+}
+
+// Palette offset votes match the votes for the pixel values and mask off pixels
+// outside the roi are neither voted on nor counted as neighbors.
+
+- (void)testIdenticalNeighborsPalette {
+  
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(0),
+                         @(1), @(1), @(1),
+                         @(2), @(2), @(3),
+                         ];
+  
+  Mat tagsImg(3, 3, CV_8UC3);
+  Mat maskImg(3, 3, CV_8UC1);
+  
+  maskImg = (Scalar) 0xFF;
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  Mat indexImg;
+  vector<uint32_t> palette;
+  
+  mapPixelsToPaletteIndexes(tagsImg, cv::Rect(0, 0, 3, 3), indexImg, palette);
+  
+  XCTAssert(palette.size() == 4, @"palette");
+  XCTAssert(palette[0] == 0 && palette[1] == 1 && palette[2] == 2 && palette[3] == 3, @"palette");
+  XCTAssert(indexImg.type() == CV_32SC1, @"type");
+  XCTAssert(indexImg.at<int32_t>(2, 2) == 3, @"offset");
+  
+  vector<uint32_t> votes;
+  
+  vote_for_identical_neighbors(votes, indexImg, maskImg, (int) palette.size(), cv::Rect(0, 0, 3, 3));
+  
+  XCTAssert(votes.size() == 4, @"size");
+  
+  XCTAssert(votes[0] == 4, @"votes");
+  XCTAssert(votes[1] == 4, @"votes");
+  XCTAssert(votes[2] == 2, @"votes");
+  XCTAssert(votes[3] == 0, @"votes");
+  
+  // 8 bit offsets with the top row masked off
+  
+  Mat index8Img;
+  indexImg.convertTo(index8Img, CV_8UC1);
+  
+  for ( int x = 0; x < 3; x++ ) {
+    maskImg.at<uint8_t>(0, x) = 0;
+  }
+  
+  vote_for_identical_neighbors(votes, index8Img, maskImg, (int) palette.size(), cv::Rect(0, 1, 3, 2));
+  
+  XCTAssert(votes[0] == 0, @"votes");
+  XCTAssert(votes[1] == 4, @"votes");
+  XCTAssert(votes[2] == 2, @"votes");
+  XCTAssert(votes[3] == 0, @"votes");
+  
+  return;
+}
+
+// Packed pixels have the same value as Vec3BToUID() for each BGR pixel, the
+// width covers both the 16 pixel loop and the scalar tail.
+
+- (void)testPackPixels {
+  Mat inputImg(3, 19, CV_8UC3);
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      inputImg.at<Vec3b>(y, x) = Vec3b(x * 13, y * 7 + x, 255 - x);
+    }
+  }
+  
+  Mat packedImg;
+  packPixels(inputImg, packedImg);
+  
+  XCTAssert(packedImg.type() == CV_32SC1, @"type");
+  XCTAssert(packedImg.size() == inputImg.size(), @"size");
+  
+  vector<Coord> coords;
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      uint32_t expected = (uint32_t) Vec3BToUID(inputImg.at<Vec3b>(y, x));
+      XCTAssert(packedImg.at<uint32_t>(y, x) == expected, @"packed");
+      coords.push_back(Coord(x, y));
+    }
+  }
+  
+  vector<uint32_t> packedPixels(coords.size());
+  vector<uint32_t> bgrPixels(coords.size());
+  
+  gatherPixels(packedImg, coords, packedPixels.data());
+  gatherPixels(inputImg, coords, bgrPixels.data());
+  
+  XCTAssert(packedPixels == bgrPixels, @"gather");
+  XCTAssert(packedPixels[20] == 0x00FE080D, @"gather");
+  
+  return;
+}
+
+// A row unpacked from words is the same as the BGR row it was packed from, the
+// top byte of a word is ignored.
+
+- (void)testUnpackPixelRow {
+  Mat inputImg(1, 37, CV_8UC3);
+  
+  for ( int x = 0; x < inputImg.cols; x++ ) {
+    inputImg.at<Vec3b>(0, x) = Vec3b(x * 7, 200 - x, x * 3 + 1);
+  }
+  
+  vector<uint32_t> pixels(inputImg.cols);
+  
+  packPixelRow(inputImg.ptr<uint8_t>(0), pixels.data(), inputImg.cols);
+  
+  for ( int x = 0; x < inputImg.cols; x++ ) {
+    XCTAssert(pixels[x] == (uint32_t) Vec3BToUID(inputImg.at<Vec3b>(0, x)), @"packed");
+    pixels[x] |= 0xFF000000;
+  }
+  
+  Mat outputImg(1, 37, CV_8UC3, Scalar(0, 0, 0));
+  
+  unpackPixelRow(pixels.data(), outputImg.ptr<uint8_t>(0), outputImg.cols);
+  
+  XCTAssert(countNonZero(outputImg.reshape(1) != inputImg.reshape(1)) == 0, @"unpacked");
+}
+
+// A CV_32SC1 tags image can hold tags larger than 24 bits, parse() finds the
+// same superpixels and edges as for a 24 bit image and the tags fill back into
+// a CV_32SC1 image. parseLabels() with a large offset writes the wide tags.
+
+- (void)testParseWideTags {
+  const int32_t wideBase = 0x01000000;
+  
+  Mat tagsImg(3, 4, CV_32SC1);
+  Mat narrowTagsImg(3, 4, CV_8UC3);
+  
+  for ( int y = 0; y < tagsImg.rows; y++ ) {
+    for ( int x = 0; x < tagsImg.cols; x++ ) {
+      int32_t tag = (x < 2) ? 0 : ((y == 0) ? 1 : 2);
+      tagsImg.at<int32_t>(y, x) = wideBase + tag;
+      narrowTagsImg.at<Vec3b>(y, x) = PixelToVec3b(tag);
+    }
+  }
+  
+  SuperpixelImage spImage;
+  SuperpixelImage narrowSpImage;
+  
+  XCTAssert(SuperpixelImage::parse(tagsImg, spImage), @"wide parse");
+  XCTAssert(SuperpixelImage::parse(narrowTagsImg, narrowSpImage), @"narrow parse");
+  
+  vector<int32_t> superpixels = spImage.getSuperpixelsVec();
+  vector<int32_t> narrowSuperpixels = narrowSpImage.getSuperpixelsVec();
+  
+  XCTAssert(superpixels.size() == 3, @"num superpixels");
+  XCTAssert(narrowSuperpixels.size() == superpixels.size(), @"num superpixels");
+  
+  for ( int i = 0; i < (int) superpixels.size(); i++ ) {
+    XCTAssert(superpixels[i] == narrowSuperpixels[i] + wideBase, @"tag");
+    XCTAssert(spImage.getSuperpixelPtr(superpixels[i])->size() == narrowSpImage.getSuperpixelPtr(narrowSuperpixels[i])->size(), @"coords");
+    XCTAssert(spImage.edgeTable.getNeighbors(superpixels[i]).size() == narrowSpImage.edgeTable.getNeighbors(narrowSuperpixels[i]).size(), @"neighbors");
+  }
+  
+  XCTAssert(spImage.getEdges().size() == narrowSpImage.getEdges().size(), @"num edges");
+  
+  Mat filledImg(tagsImg.size(), CV_32SC1, Scalar(0));
+  spImage.fillMatrixWithSuperpixelTags(filledImg);
+  
+  XCTAssert(countNonZero(filledImg != tagsImg) == 0, @"filled tags");
+  
+  // Labels 0, 1 and 2 with an offset past 24 bits
+  
+  Mat labels(3, 4, CV_32SC1);
+  
+  for ( int y = 0; y < labels.rows; y++ ) {
+    for ( int x = 0; x < labels.cols; x++ ) {
+      labels.at<int32_t>(y, x) = tagsImg.at<int32_t>(y, x) - wideBase - 1;
+    }
+  }
+  
+  Mat labelTagsImg;
+  SuperpixelImage labelSpImage;
+  
+  XCTAssert(SuperpixelImage::parseLabels(labels, wideBase + 1, labelTagsImg, labelSpImage, NULL, NULL, CV_32SC1), @"parseLabels");
+  
+  XCTAssert(labelTagsImg.type() == CV_32SC1, @"tags type");
+  XCTAssert(countNonZero(labelTagsImg != tagsImg) == 0, @"label tags");
+  XCTAssert(labelSpImage.getSuperpixelsVec() == superpixels, @"label superpixels");
+}
+
+// A 3 pixel thick bar thins to a 1 pixel line along the middle row, skelReduce()
+// with the bbox of the bar writes the same result.
+
+- (void)testSkelReduceBar {
+  Mat binMat(7, 12, CV_8UC1, Scalar(0));
+  
+  for ( int y = 2; y <= 4; y++ ) {
+    for ( int x = 1; x <= 10; x++ ) {
+      binMat.at<uint8_t>(y, x) = 0xFF;
+    }
+  }
+  
+  Mat roiBinMat = binMat.clone();
+  
+  skelReduce(binMat);
+  skelReduce(roiBinMat, cv::Rect(1, 2, 10, 3));
+  
+  int numOn = 0;
+  
+  for ( int y = 0; y < binMat.rows; y++ ) {
+    for ( int x = 0; x < binMat.cols; x++ ) {
+      uint8_t bVal = binMat.at<uint8_t>(y, x);
+      XCTAssert(bVal == roiBinMat.at<uint8_t>(y, x), @"roi");
+      if (bVal) {
+        XCTAssert(y == 3, @"middle row");
+        numOn += 1;
+      }
+    }
+  }
+  
+  XCTAssert(numOn >= 6 && numOn <= 10, @"numOn");
+  
+  return;
+}
+
+// Quant pixels map to colortable offsets with a duplicate entry mapped to the last
+// offset, the offset counts are generated in the same pass.
+
+- (void)testMapQuantPixelsToColortableIndexes {
+  NSArray *pixelsArr = @[
+                         @(0x00FF0000), @(0x00FF0000), @(0x0000FF00),
+                         @(0x000000FF), @(0x0000FF00), @(0x00FF0000),
+                         ];
+  
+  Mat quantImg(2, 3, CV_8UC3);
+  
+  [self.class fillImageWithPixels:pixelsArr img:quantImg];
+  
+  vector<uint32_t> colortable = { 0xFF0000FF, 0xFF00FF00, 0x00FF0000, 0x00FF0000 };
+  
+  ColortableIndex colortableIndex(colortable);
+  
+  XCTAssert(colortableIndex.lookup(0x000000FF) == 0, @"lookup");
+  XCTAssert(colortableIndex.lookup(0x0000FF00) == 1, @"lookup");
+  XCTAssert(colortableIndex.lookup(0x00FF0000) == 3, @"lookup");
+  XCTAssert(colortableIndex.lookup(0x00123456) == -1, @"lookup");
+  
+  vector<uint32_t> offsetCounts;
+  
+  Mat offsetsImg = mapQuantPixelsToColortableIndexes(quantImg, colortable, true, &offsetCounts);
+  
+  XCTAssert(offsetsImg.at<Vec3b>(0, 0) == Vec3b(3, 3, 3), @"offset");
+  XCTAssert(offsetsImg.at<Vec3b>(0, 2) == Vec3b(1, 1, 1), @"offset");
+  XCTAssert(offsetsImg.at<Vec3b>(1, 0) == Vec3b(0, 0, 0), @"offset");
+  
+  XCTAssert(offsetCounts.size() == 4, @"counts");
+  XCTAssert(offsetCounts[0] == 1, @"counts");
+  XCTAssert(offsetCounts[1] == 2, @"counts");
+  XCTAssert(offsetCounts[2] == 0, @"counts");
+  XCTAssert(offsetCounts[3] == 3, @"counts");
+  
+  unordered_map<uint32_t, uint32_t> pixelToCountTable;
+  
+  generatePixelHistogram(quantImg, pixelToCountTable);
+  
+  XCTAssert(pixelToCountTable.size() == 3, @"histogram");
+  XCTAssert(pixelToCountTable[0x00FF0000] == 3, @"histogram");
+  XCTAssert(pixelToCountTable[0x0000FF00] == 2, @"histogram");
+  XCTAssert(pixelToCountTable[0x000000FF] == 1, @"histogram");
+  
+  return;
+}
+
+// Batch CIE76 distance for 37 pairs of Lab pixels, 2 SIMD blocks and a tail
+
+- (void)testDeltaE76Batch {
+  const int N = 37;
+  
+  vector<Vec3b> labA(N);
+  vector<Vec3b> labB(N);
+  
+  for ( int i = 0; i < N; i++ ) {
+    labA[i] = Vec3b((i * 7) & 0xFF, 255 - i, (i * 31) & 0xFF);
+    labB[i] = Vec3b((i * 13) & 0xFF, i, 255 - ((i * 3) & 0xFF));
+  }
+  
+  labA[0] = Vec3b(0, 0, 0);
+  labB[0] = Vec3b(255, 255, 255);
+  labA[1] = labB[1];
+  
+  vector<uint32_t> squared(N);
+  vector<float> distances(N);
+  
+  deltaE76Squared(labA.data(), labB.data(), squared.data(), N);
+  deltaE76(labA.data(), labB.data(), distances.data(), N);
+  
+  XCTAssert(squared[0] == (3 * 255 * 255), @"squared");
+  XCTAssert(squared[1] == 0, @"squared");
+  XCTAssert(distances[1] == 0.0f, @"distance");
+  
+  for ( int i = 0; i < N; i++ ) {
+    Vec3b a = labA[i];
+    Vec3b b = labB[i];
+    
+    double expected = delta_e_1976(a[0], a[1], a[2], b[0], b[1], b[2]);
+    
+    XCTAssert(fabs(sqrt((double) squared[i]) - expected) < 1e-9, @"squared");
+    XCTAssert(fabs(distances[i] - expected) < 1e-4, @"distance");
+  }
+  
+  return;
+}
+
+// Cluster walk from the center closest to black to the next closest center,
+// of the two centers at the same distance from 0x000A0000 the first one in the
+// table is visited first
+
+- (void)testClusterWalkOnCenterDist {
+  vector<uint32_t> centers = { 0x00FFFFFF, 0x000A0005, 0x00000000, 0x000A0000, 0x000F0000, 0x00140000 };
+  
+  vector<uint32_t> order = generate_cluster_walk_on_center_dist(centers);
+  
+  vector<uint32_t> expected = { 2, 3, 1, 4, 5, 0 };
+  
+  XCTAssert(order == expected, @"walk");
+  
+  order = generate_cluster_walk_on_center_dist(centers, 0x00F0F0F0);
+  
+  XCTAssert(order.size() == centers.size(), @"walk");
+  XCTAssert(order[0] == 0, @"walk");
+  
+  return;
+}
+
+// Sort palette keys by a dense count, equal counts stay in palette order
+
+- (void)testSortKeysByDenseCount {
+  vector<uint32_t> palette = { 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00FFFFFF, 0x00000000 };
+  vector<uint32_t> counts = { 3, 0, 7, 3, 1 };
+  
+  vector<uint32_t> sortedKeys = sort_keys_by_count(counts, palette, true);
+  
+  vector<uint32_t> expected = { 0x000000FF, 0x00FF0000, 0x00FFFFFF, 0x00000000 };
+  
+  XCTAssert(sortedKeys == expected, @"big to small");
+  
+  sortedKeys = sort_keys_by_count(counts, palette, false, false);
+  
+  expected = { 0x0000FF00, 0x00000000, 0x00FF0000, 0x00FFFFFF, 0x000000FF };
+  
+  XCTAssert(sortedKeys == expected, @"small to big");
+  
+  // Counts much larger than the number of keys are radix sorted
+  
+  counts = { 0x10000000, 5, 0x00010001, 0x10000000, 0x00010000 };
+  
+  sortedKeys = sort_keys_by_count(counts, palette, true);
+  
+  expected = { 0x00FF0000, 0x00FFFFFF, 0x000000FF, 0x00000000, 0x0000FF00 };
+  
+  XCTAssert(sortedKeys == expected, @"radix");
+  
+  return;
+}
+
+// Tag images are equal when the partition is the same even if the tag values differ
+
+- (void)testTagsEqualUpToRelabel {
+  Mat tags1(2, 3, CV_8UC3);
+  Mat tags2(2, 3, CV_8UC3);
+  
+  Vec3b a(1, 0, 0), b(2, 0, 0), c(3, 0, 0);
+  
+  tags1.at<Vec3b>(0, 0) = a; tags1.at<Vec3b>(0, 1) = a; tags1.at<Vec3b>(0, 2) = b;
+  tags1.at<Vec3b>(1, 0) = a; tags1.at<Vec3b>(1, 1) = b; tags1.at<Vec3b>(1, 2) = b;
+  
+  // Same partition with a swapped and a new tag value
+  
+  tags2.at<Vec3b>(0, 0) = c; tags2.at<Vec3b>(0, 1) = c; tags2.at<Vec3b>(0, 2) = a;
+  tags2.at<Vec3b>(1, 0) = c; tags2.at<Vec3b>(1, 1) = a; tags2.at<Vec3b>(1, 2) = a;
+  
+  int numDifferentPixels = -1;
+  
+  XCTAssert(tagsEqualUpToRelabel(tags1, tags2, &numDifferentPixels), @"relabelled");
+  XCTAssert(numDifferentPixels == 0, @"relabelled");
+  
+  // Two regions merged into one is not the same partition
+  
+  tags2.at<Vec3b>(0, 2) = c;
+  tags2.at<Vec3b>(1, 1) = c;
+  tags2.at<Vec3b>(1, 2) = c;
+  
+  XCTAssert(!tagsEqualUpToRelabel(tags1, tags2, &numDifferentPixels), @"merged");
+  XCTAssert(numDifferentPixels == 3, @"merged");
+  
+  XCTAssert(!tagsEqualUpToRelabel(tags1, Mat(3, 3, CV_8UC3, Scalar(0, 0, 0))), @"size");
+  
+  return;
+}
+
+// A small region is captured from the color stats when distinct from its neighbors
+
+- (void)testCaptureSmallRegionWithStats
+{
+  // 40x8 pixels as 10x2 blocks of 4x4, tag 1 is white and tag 2 is close to the black background
+  
+  Mat tagsImg(8, 40, CV_8UC3, Scalar(0, 0, 0));
+  tagsImg(cv::Rect(4, 0, 4, 4)) = Scalar(1, 0, 0);
+  tagsImg(cv::Rect(16, 0, 4, 4)) = Scalar(2, 0, 0);
+  
+  Mat inputImg(8, 40, CV_8UC3, Scalar(0, 0, 0));
+  inputImg(cv::Rect(4, 0, 4, 4)) = Scalar(255, 255, 255);
+  inputImg(cv::Rect(16, 0, 4, 4)) = Scalar(5, 5, 5);
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  spImage.setColorStats(inputImg);
+  
+  Mat mask(8, 40, CV_8UC1, Scalar(0));
+  mask.at<uint8_t>(0, 4) = 0xFF;
+  
+  worked = captureRegionMask(spImage, inputImg, tagsImg, 1+1, 10, 2, 4, mask, Mat());
+  
+  XCTAssert(worked, @"distinct region captured");
+  XCTAssert(countNonZero(mask) == 15, @"unmerged region pixels");
+  XCTAssert(mask.at<uint8_t>(3, 7) == 0xFF && mask.at<uint8_t>(0, 4) == 0, @"region pixels");
+  
+  mask = Scalar(0);
+  
+  worked = captureRegionMask(spImage, inputImg, tagsImg, 2+1, 10, 2, 4, mask, Mat());
+  
+  XCTAssert(!worked, @"close region not captured");
+}
+
+// A flat region is captured as the expanded pixels close to its mean color
+
+- (void)testCaptureHomogeneousRegion
+{
+  // 48x24 pixels as 12x6 blocks of 4x4, tag 1 covers 20x16 pixels of a flat
+  // gray area that is 4 pixels wider than the tag.
+  
+  Mat tagsImg(24, 48, CV_8UC3, Scalar(0, 0, 0));
+  tagsImg(cv::Rect(8, 4, 20, 16)) = Scalar(1, 0, 0);
+  
+  Mat inputImg(24, 48, CV_8UC3, Scalar(0, 0, 0));
+  
+  for ( int y = 4; y < 20; y++ ) {
+    for ( int x = 8; x < 32; x++ ) {
+      uint8_t gray = 128 + ((x + y) % 3) - 1;
+      inputImg.at<Vec3b>(y, x) = Vec3b(gray, gray, gray);
+    }
+  }
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  spImage.setColorStats(inputImg);
+  
+  XCTAssert(getHomogeneousCaptureMaxVariance() > 0.0f, @"enabled by default");
+  
+  Mat mask(24, 48, CV_8UC1, Scalar(0));
+  
+  worked = captureRegionMask(spImage, inputImg, tagsImg, 1+1, 12, 6, 4, mask, Mat());
+  
+  XCTAssert(worked, @"homogeneous region captured");
+  XCTAssert(countNonZero(mask) == (24 * 16), @"gray pixels");
+  XCTAssert(mask.at<uint8_t>(4, 31) == 0xFF && mask.at<uint8_t>(4, 32) == 0 && mask.at<uint8_t>(3, 8) == 0, @"gray bounds");
+}
+
+// Parse of SRM style labels gives the same superpixels as a parse of the tags
+
+- (void)testParseLabels
+{
+  Mat labels(6, 8, CV_32SC1, Scalar(0));
+  labels(cv::Rect(2, 0, 3, 4)) = Scalar(1);
+  labels(cv::Rect(0, 4, 8, 2)) = Scalar(3);
+  
+  Mat tagsImg;
+  labelsToTags(labels, tagsImg, 1);
+  
+  SuperpixelImage spImage;
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  Mat labelTagsImg;
+  SuperpixelImage labelImage;
+  worked = SuperpixelImage::parseLabels(labels, 2, labelTagsImg, labelImage);
+  XCTAssert(worked, @"SuperpixelImage parseLabels");
+  
+  XCTAssert(countNonZero(labelTagsImg.reshape(1) != tagsImg.reshape(1)) == 0, @"same tags");
+  XCTAssert(labelImage.superpixels == spImage.superpixels, @"same superpixels");
+  XCTAssert(labelImage.superpixels.size() == 3, @"unused label 2 has no superpixel");
+  
+  for ( int32_t tag : spImage.superpixels ) {
+    XCTAssert(labelImage.getSuperpixelPtr(tag)->coords == spImage.getSuperpixelPtr(tag)->coords, @"same coords");
+    XCTAssert(labelImage.edgeTable.getNeighbors(tag) == spImage.edgeTable.getNeighbors(tag), @"same neighbors");
+  }
+  
+  // Known label counts build the superpixels in a single pass
+  
+  vector<int32_t> labelCounts = { 20, 12, 0, 16 };
+  
+  Mat countedTagsImg;
+  SuperpixelImage countedImage;
+  worked = SuperpixelImage::parseLabels(labels, 2, countedTagsImg, countedImage, &labelCounts);
+  XCTAssert(worked, @"SuperpixelImage parseLabels with counts");
+  
+  XCTAssert(countNonZero(countedTagsImg.reshape(1) != tagsImg.reshape(1)) == 0, @"same tags");
+  XCTAssert(countedImage.superpixels == spImage.superpixels, @"same superpixels");
+  
+  for ( int32_t tag : spImage.superpixels ) {
+    XCTAssert(countedImage.getSuperpixelPtr(tag)->coords == spImage.getSuperpixelPtr(tag)->coords, @"same coords");
+    XCTAssert(countedImage.edgeTable.getNeighbors(tag) == spImage.edgeTable.getNeighbors(tag), @"same neighbors");
+  }
+}
+
+// Block expansion is the 4 connected cross dilate, shifts carry across words
+
+- (void)testExpandBlockRegion
+{
+  vector<Coord> coords = { Coord(252, 8), Coord(253, 8), Coord(255, 11) };
+  
+  cv::Rect blockRoi;
+  Mat blockMat = expandBlockRegion(1, coords, 2, 100, 5, 4, &blockRoi);
+  
+  XCTAssert(blockMat.rows == 5 && blockMat.cols == 100, @"block grid size");
+  XCTAssert(blockRoi == cv::Rect(61, 0, 5, 5), @"white block bbox");
+  XCTAssert(countNonZero(blockMat) == 13, @"city block distance 2");
+  
+  XCTAssert(blockMat.at<uint8_t>(2, 65) == 0xFF && blockMat.at<uint8_t>(1, 64) == 0xFF, @"carry into next word");
+  XCTAssert(blockMat.at<uint8_t>(0, 63) == 0xFF && blockMat.at<uint8_t>(2, 61) == 0xFF, @"expanded");
+  XCTAssert(blockMat.at<uint8_t>(1, 65) == 0 && blockMat.at<uint8_t>(0, 62) == 0, @"outside of distance");
+  
+  // A region that grows over the whole grid stops early
+  
+  blockMat = expandBlockRegion(1, { Coord(0, 0) }, 10, 3, 2, 4, &blockRoi);
+  
+  XCTAssert(countNonZero(blockMat) == 6, @"all blocks white");
+  XCTAssert(blockRoi == cv::Rect(0, 0, 3, 2), @"whole grid");
+}
+
+// A superpixel image snapshot loads the same superpixels, neighbors and weights
+
+- (void)testSuperpixelImageSnapshot
+{
+  int pixels[25] = {
+    0, 0, 0, 0, 0,
+    0, 1, 1, 1, 0,
+    0, 1, 2, 1, 0,
+    0, 1, 1, 1, 3,
+    0, 0, 0, 3, 3
+  };
+  
+  Mat tags(5, 5, CV_8UC3);
+  
+  for ( int i = 0; i < 25; i++ ) {
+    tags.at<Vec3b>(i / 5, i % 5) = Vec3b(pixels[i], 0, 0);
+  }
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tags, spImage);
+  XCTAssert(worked, @"parse");
+  
+  spImage.edgeTable.edgeStrengthMap[SuperpixelEdge(1, 2)] = 0.5f;
+  spImage.getSuperpixelPtr(3)->mergedEdgeWeights.push_back(1.0f);
+  spImage.getSuperpixelPtr(3)->mergedEdgeWeights.push_back(3.0f);
+  spImage.getSuperpixelPtr(1)->coords.encodeRuns();
+  
+  string filename = string([NSTemporaryDirectory() UTF8String]) + "/test_spimage.snapshot";
+  
+  XCTAssert(spImage.save(filename), @"save");
+  
+  SuperpixelImage loadedImage;
+  
+  XCTAssert(SuperpixelImage::load(filename, loadedImage), @"load");
+  XCTAssert(loadedImage.superpixels == spImage.superpixels, @"same tags");
+  
+  for ( int32_t tag : spImage.superpixels ) {
+    Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+    Superpixel *loadedPtr = loadedImage.getSuperpixelPtr(tag);
+    
+    vector<Coord> coords;
+    spPtr->coords.forEachCoord([&coords](Coord coord) {
+      coords.push_back(coord);
+    });
+    
+    vector<Coord> loadedCoords;
+    loadedPtr->coords.forEachCoord([&loadedCoords](Coord coord) {
+      loadedCoords.push_back(coord);
+    });
+    
+    XCTAssert(coords == loadedCoords, @"same coords");
+    XCTAssert(spPtr->coords.isRunLength() == loadedPtr->coords.isRunLength(), @"same coords form");
+    XCTAssert(spImage.edgeTable.getNeighbors(tag) == loadedImage.edgeTable.getNeighbors(tag), @"same neighbors");
+    XCTAssert(spPtr->mergedEdgeWeights.mean() == loadedPtr->mergedEdgeWeights.mean(), @"same weights");
+  }
+  
+  XCTAssert(loadedImage.edgeTable.edgeStrengthMap[SuperpixelEdge(1, 2)] == 0.5f, @"edge weight");
+  XCTAssert(loadedImage.getSuperpixelPtr(3)->mergedEdgeWeights.stddev() == spImage.getSuperpixelPtr(3)->mergedEdgeWeights.stddev(), @"weights stddev");
+}
+
+// A region mask only holds the pixels of its bbox, coords are frame coords
+
+- (void)testRegionMask
+{
+  RegionMask mask(cv::Rect(4, 2, 3, 2));
+  
+  XCTAssert(mask.mat().size() == cv::Size(3, 2) && countNonZero(mask.mat()) == 0, @"cleared bbox");
+  XCTAssert(mask.nonZeroBounds().area() == 0, @"no pixels on");
+  
+  mask.set(Coord(5, 2));
+  mask.set(Coord(6, 3));
+  
+  XCTAssert(mask.contains(Coord(5, 2)) && mask.contains(Coord(6, 3)), @"on");
+  XCTAssert(!mask.contains(Coord(4, 2)) && !mask.contains(Coord(0, 0)), @"off or outside");
+  XCTAssert(mask.mat().at<uint8_t>(0, 1) == 0xFF, @"bbox pixel");
+  XCTAssert(mask.nonZeroBounds() == cv::Rect(5, 2, 2, 2), @"bounds");
+  
+  vector<cv::Point> locations;
+  mask.findNonZero(locations);
+  
+  XCTAssert(locations.size() == 2 && locations[0] == cv::Point(5, 2) && locations[1] == cv::Point(6, 3), @"raster order");
+  
+  // Only the bbox of a frame size mask is written
+  
+  Mat frameMask(6, 8, CV_8UC1);
+  frameMask = Scalar(0x7F);
+  mask.copyTo(frameMask);
+  
+  XCTAssert(frameMask.at<uint8_t>(2, 5) == 0xFF && frameMask.at<uint8_t>(2, 4) == 0 && frameMask.at<uint8_t>(0, 0) == 0x7F, @"copy to frame");
+  
+  // A smaller bbox reuses the storage and is cleared
+  
+  mask.reset(cv::Rect(0, 0, 2, 1));
+  
+  XCTAssert(mask.mat().size() == cv::Size(2, 1) && countNonZero(mask.mat()) == 0, @"reset");
+  
+  // The remerger merges the mask pixels the same as a frame size mask
+  
+  Mat tagsImg(6, 8, CV_8UC3);
+  tagsImg = Scalar(0, 0, 0);
+  
+  RegionRemerger remerger(tagsImg);
+  
+  mask.reset(cv::Rect(4, 2, 3, 2));
+  mask.set(Coord(5, 2));
+  mask.set(Coord(6, 3));
+  
+  cv::Rect mergedBounds = remerger.mergeFromMask(mask);
+  
+  XCTAssert(mergedBounds == cv::Rect(5, 2, 2, 2), @"merged bounds");
+  XCTAssert(remerger.mergedMask.at<uint8_t>(3, 6) == 0xFF && countNonZero(remerger.mergedMask) == 2, @"merged pixels");
+}
+
+// A released buffer is handed out again for the same size and type, a buffer
+// that is still shared with another Mat is not recycled.
+
+- (void)testMatPool
+{
+  MatPool pool;
+  
+  uint8_t *firstData = NULL;
+  
+  {
+    PooledMat pooled = pool.acquireZeroed(cv::Size(8, 4), CV_8UC1);
+    XCTAssert(pooled.mat.rows == 4 && pooled.mat.cols == 8, @"size");
+    XCTAssert(countNonZero(pooled.mat) == 0, @"zeroed");
+    pooled.mat.at<uint8_t>(1, 1) = 1;
+    firstData = pooled.mat.data;
+  }
+  
+  XCTAssert(pool.getNumAllocated() == 1 && pool.getNumReused() == 0, @"allocated");
+  
+  Mat kept;
+  
+  {
+    PooledMat pooled = pool.acquire(cv::Size(8, 4), CV_8UC1);
+    XCTAssert(pooled.mat.data == firstData, @"reused");
+    XCTAssert(pool.getNumReused() == 1, @"reused count");
+    kept = pooled.mat;
+  }
+  
+  // Type differs so a new buffer is allocated
+  
+  {
+    PooledMat pooled = pool.acquire(cv::Size(8, 4), CV_32SC1);
+    XCTAssert(pool.getNumAllocated() == 2, @"allocated for type");
+  }
+  
+  {
+    PooledMat pooled = pool.acquire(cv::Size(8, 4), CV_8UC1);
+    XCTAssert(pooled.mat.data != kept.data, @"shared buffer not recycled");
+    XCTAssert(pool.getNumAllocated() == 3, @"allocated again");
+  }
+  
+  // NULL pool is a plain allocation
+  
+  PooledMat plain = acquirePooledMat(NULL, cv::Size(3, 3), CV_8UC1, true);
+  XCTAssert(countNonZero(plain.mat) == 0, @"plain zeroed");
+}
+
+// With one thread parallelFor() runs the whole range on the calling thread, and
+// a loop nested inside a stripe is limited to one thread.
+
+- (void)testParallelFor
+{
+  std::mutex mutex;
+  vector<cv::Range> stripes;
+  vector<int> nestedThreads;
+  
+  setParallelThreads(1);
+  XCTAssert(getParallelThreads() == 1, @"one thread");
+  
+  parallelFor(cv::Range(0, 10), RecordStripesParallelBody(mutex, stripes, nestedThreads));
+  
+  XCTAssert(stripes.size() == 1 && stripes[0] == cv::Range(0, 10), @"one stripe");
+  
+  // An empty range does not invoke the body
+  
+  stripes.clear();
+  nestedThreads.clear();
+  parallelFor(cv::Range(4, 4), RecordStripesParallelBody(mutex, stripes, nestedThreads));
+  XCTAssert(stripes.size() == 0, @"empty range");
+  
+  setParallelThreads(0);
+  XCTAssert(getParallelThreads() == max(1, getNumThreads()), @"all threads");
+  
+  parallelFor(cv::Range(0, 64), RecordStripesParallelBody(mutex, stripes, nestedThreads));
+  
+  int numIndexes = 0;
+  for ( int i = 0; i < (int) stripes.size(); i++ ) {
+    numIndexes += stripes[i].size();
+    XCTAssert(nestedThreads[i] == 1, @"nested loop is serial");
+  }
+  XCTAssert(numIndexes == 64, @"each index once");
+  XCTAssert(getParallelThreads() == max(1, getNumThreads()), @"restored after the loop");
+}
+
+// A snapshot keeps the graph it was taken from while the image is merged, and
+// the nodes that a merge did not touch are shared with the next snapshot
+
+- (void)testSuperpixelGraphSnapshot
+{
+  int pixels[25] = {
+    0, 0, 0, 0, 0,
+    0, 1, 1, 1, 0,
+    0, 1, 2, 1, 0,
+    0, 1, 1, 1, 3,
+    0, 0, 0, 3, 3
+  };
+  
+  Mat tags(5, 5, CV_8UC3);
+  
+  for ( int i = 0; i < 25; i++ ) {
+    tags.at<Vec3b>(i / 5, i % 5) = Vec3b(pixels[i], 0, 0);
+  }
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tags, spImage);
+  XCTAssert(worked, @"parse");
+  
+  SuperpixelGraphSnapshot before = spImage.takeSnapshot();
+  
+  XCTAssert(before.size() == 4, @"4 superpixels");
+  XCTAssert(before.getVersion() == 0, @"no merges");
+  XCTAssert(before.getNumCoords(3) == 1, @"center");
+  XCTAssert(before.getNeighbors(3) == vector<int32_t>({2}), @"center neighbors");
+  
+  SuperpixelEdge edge(2, 3);
+  spImage.mergeEdge(edge);
+  
+  SuperpixelGraphSnapshot after = spImage.takeSnapshot();
+  
+  XCTAssert(after.size() == 3, @"3 superpixels");
+  XCTAssert(after.getVersion() == 1, @"one merge");
+  XCTAssert(!after.contains(3), @"merged away");
+  XCTAssert(after.getNumCoords(2) == 9, @"merged coords");
+  XCTAssert(after.getNeighbors(2) == vector<int32_t>({1, 4}), @"merged neighbors");
+  
+  // The older snapshot is not changed by the merge
+  
+  XCTAssert(before.size() == 4, @"4 superpixels");
+  XCTAssert(before.contains(3), @"center");
+  XCTAssert(before.getNumCoords(2) == 8, @"ring coords");
+  XCTAssert(before.getNeighbors(2) == vector<int32_t>({1, 3, 4}), @"ring neighbors");
+  
+  XCTAssert(before.getNode(1) == after.getNode(1), @"untouched node shared");
+  XCTAssert(before.getNode(2) != after.getNode(2), @"dst rebuilt");
+  
+  SuperpixelGraphSnapshot again = spImage.takeSnapshot();
+  
+  XCTAssert(again.getNode(2) == after.getNode(2), @"shared node");
+  XCTAssert(again.getNode(4) == after.getNode(4), @"shared node");
+  
+  vector<int32_t> snapshotTags;
+  again.forEach([&snapshotTags](const SuperpixelSnapshotNode &node) {
+    snapshotTags.push_back(node.tag);
+  });
+  
+  XCTAssert(snapshotTags == vector<int32_t>({1, 2, 4}), @"tag order");
+}
+
+// A long edge is compared at evenly spaced coords up to the sampling cap
+
+- (void)testCompareEdgesSampledCoords {
+  vector<int> offsets;
+  
+  SuperpixelEdgeFuncs::sampleEdgeCompareOffsets(10, 0, offsets);
+  XCTAssert(offsets.size() == 10, @"no cap");
+  
+  SuperpixelEdgeFuncs::sampleEdgeCompareOffsets(10, 16, offsets);
+  XCTAssert(offsets.size() == 10 && offsets[9] == 9, @"under cap");
+  
+  SuperpixelEdgeFuncs::sampleEdgeCompareOffsets(10, 4, offsets);
+  XCTAssert(offsets == vector<int>({0, 3, 5, 8}), @"middle of each stratum");
+  
+  SuperpixelEdgeFuncs::sampleEdgeCompareOffsets(1000, 7, offsets);
+  XCTAssert(offsets.size() == 7, @"capped");
+  
+  for (int i = 1; i < (int) offsets.size(); i++) {
+    XCTAssert(offsets[i] > offsets[i-1], @"increasing");
+  }
+  XCTAssert(offsets.back() < 1000, @"in range");
+  
+  // Left and right halves with a 256 pixel vertical edge, the right half has a
+  // gradient so that the distance varies along the edge.
+  
+  const int height = 256;
+  
+  Mat tagsImg(height, 4, CV_8UC3);
+  Mat rgbImg(height, 4, CV_8UC3);
+  
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < 4; x++) {
+      tagsImg.at<Vec3b>(y, x) = (x < 2) ? Vec3b(1, 0, 0) : Vec3b(2, 0, 0);
+      rgbImg.at<Vec3b>(y, x) = (x < 2) ? Vec3b(0, 0, 0) : Vec3b(y, y, y);
+    }
+  }
+  
+  MergeSuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  vector<int32_t> superpixels = spImage.getSuperpixelsVec();
+  XCTAssert(superpixels.size() == 2, @"num sumperpixels");
+  
+  const int maxCoords = SuperpixelEdgeFuncs::getMaxEdgeCompareCoords();
+  
+  vector<CompareNeighborTuple> results;
+  
+  SuperpixelEdgeFuncs::setMaxEdgeCompareCoords(0);
+  SuperpixelEdgeFuncs::compareNeighborEdges(spImage, rgbImg, superpixels[0], results, NULL, 0, false);
+  XCTAssert(results.size() == 1, @"results");
+  double fullDist = get<0>(results[0]);
+  
+  SuperpixelEdgeFuncs::setMaxEdgeCompareCoords(32);
+  SuperpixelEdgeFuncs::compareNeighborEdges(spImage, rgbImg, superpixels[0], results, NULL, 0, false);
+  XCTAssert(results.size() == 1, @"results");
+  double sampledDist = get<0>(results[0]);
+  
+  SuperpixelEdgeFuncs::setMaxEdgeCompareCoords(maxCoords);
+  
+  XCTAssert(fullDist > 0.0, @"different colors");
+  XCTAssert(fabs(sampledDist - fullDist) < (fullDist * 0.05), @"sampled mean is close to the full mean");
+}
+
+// Touching values are assigned with an explicit stack and the groups come from one union find pass
+
+- (void)testTouchingSuperpixels {
+  NSArray *pixelsArr = @[
+                         @(0), @(0), @(1),
+                         @(2), @(3), @(1),
+                         @(2), @(2), @(4),
+                         ];
+  
+  Mat tagsImg(3, 3, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  MergeSuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  vector<int32_t> superpixels = spImage.getSuperpixelsVec();
+  XCTAssert(superpixels.size() == 5, @"num sumperpixels");
+  
+  unordered_map<int32_t, int32_t> groupTable;
+  
+  XCTAssert(spImage.touchingGroups(groupTable) == 1, @"one connected group");
+  XCTAssert(groupTable.size() == 5, @"group of each superpixel");
+  
+  for ( int32_t tag : superpixels ) {
+    XCTAssert(groupTable[tag] == 0, @"group");
+  }
+  
+  // Every superpixel connected to the root gets a value, the neighbors of the
+  // root get the smallest value the root does not use.
+  
+  unordered_map<int32_t, int32_t> touchingTable;
+  
+  spImage.recurseTouchingSuperpixels(superpixels[0], 0, touchingTable);
+  
+  XCTAssert(touchingTable.size() == 5, @"every connected superpixel");
+  XCTAssert(touchingTable[superpixels[0]] == 0, @"root value");
+  XCTAssert(touchingTable[superpixels[1]] == 1, @"neighbor value");
+  
+  for ( int32_t tag : superpixels ) {
+    XCTAssert(touchingTable[tag] >= 0, @"value");
+  }
+  
+  unordered_map<int32_t, int32_t> batchTable;
+  
+  XCTAssert(spImage.generateTouchingTable(batchTable) == 1, @"one connected group");
+  XCTAssert(batchTable == touchingTable, @"same values from the smallest tag");
+}
+
+// Coord offsets sort by row then column up to the max value and the morton code interleaves the bits
+
+- (void)testCoordOffsetAndMortonCode {
+  XCTAssert(Coord(Coord::maxValue, (Coord::value_type) 0) < Coord(0, 1), @"last column before next row");
+  XCTAssert(Coord(5, 1) < Coord(4, 2), @"row order");
+  
+  Coord coord(1234, 567);
+  XCTAssert(Coord::fromOffset(coord.calcOffset()) == coord, @"fromOffset");
+  
+  XCTAssert(Coord(0, 0).mortonCode() == 0, @"morton");
+  XCTAssert(Coord(1, 0).mortonCode() == 1, @"morton");
+  XCTAssert(Coord(0, 1).mortonCode() == 2, @"morton");
+  XCTAssert(Coord(3, 3).mortonCode() == 15, @"morton");
+  XCTAssert(Coord(4, 0).mortonCode() == 16, @"morton");
+  
+  vector<Coord> coords;
+  coords.push_back(Coord(2, 0));
+  coords.push_back(Coord(1, 1));
+  coords.push_back(Coord(0, 0));
+  coords.push_back(Coord(1, 0));
+  
+  sort(coords.begin(), coords.end(), CoordMortonLess());
+  
+  XCTAssert(coords[0] == Coord(0, 0) && coords[1] == Coord(1, 0) && coords[2] == Coord(1, 1) && coords[3] == Coord(2, 0), @"z order");
+  
+  // Each coord of a 256 x 256 block is a unique key and the hash spreads the keys
+  
+  unordered_map<Coord, int> coordTable;
+  
+  for (int y = 0; y < 256; y++) {
+    for (int x = 0; x < 256; x++) {
+      coordTable[Coord(x, y)] = (y * 256) + x;
+    }
+  }
+  
+  XCTAssert(coordTable.size() == 256 * 256, @"unique keys");
+  
+  size_t maxBucketSize = 0;
+  
+  for (size_t i = 0; i < coordTable.bucket_count(); i++) {
+    maxBucketSize = max(maxBucketSize, coordTable.bucket_size(i));
+  }
+  
+  XCTAssert(maxBucketSize <= 16, @"no long chains");
+}
+
+// fusedSSIM is 1 for identical images, lower for a noisy region and the same for any tile size
+
+- (void)testFusedSSIM {
+  Mat img1(40, 50, CV_8UC3);
+  Mat img2(40, 50, CV_8UC3);
+  Mat labels(40, 50, CV_32SC1);
+  
+  for (int y = 0; y < img1.rows; y++) {
+    for (int x = 0; x < img1.cols; x++) {
+      Vec3b color((x * 5) & 0xFF, (y * 3) & 0xFF, ((x + y) * 2) & 0xFF);
+      img1.at<Vec3b>(y, x) = color;
+      // Noise only in the right half, label 1
+      if (x >= 25 && ((x + y) % 2) == 0) {
+        color = Vec3b(255 - color[0], color[1], 255 - color[2]);
+      }
+      img2.at<Vec3b>(y, x) = color;
+      labels.at<int32_t>(y, x) = (x >= 25) ? 1 : 0;
+    }
+  }
+  
+  cv::Scalar channelSSIM;
+  
+  double ssim = fusedSSIM(img1, img1, &channelSSIM);
+  XCTAssert(fabs(ssim - 1.0) < 1e-4, @"identical images");
+  XCTAssert(fabs(channelSSIM[0] - 1.0) < 1e-4 && fabs(channelSSIM[2] - 1.0) < 1e-4, @"identical channels");
+  
+  vector<double> regionSSIM;
+  
+  ssim = fusedSSIM(img2, img1, &channelSSIM, &labels, &regionSSIM);
+  XCTAssert(ssim < 0.9, @"noisy image");
+  XCTAssert(regionSSIM.size() == 2, @"two labels");
+  XCTAssert(regionSSIM[0] > 0.9, @"left region mostly the same");
+  XCTAssert(regionSSIM[1] < regionSSIM[0], @"noisy region lower");
+  XCTAssert(channelSSIM[1] > channelSSIM[0], @"unchanged channel");
+  
+  vector<double> tiledSSIM;
+  
+  double tiled = fusedSSIM(img2, img1, NULL, &labels, &tiledSSIM, 7);
+  XCTAssert(fabs(tiled - ssim) < 1e-6, @"same for a smaller tile");
+  XCTAssert(fabs(tiledSSIM[1] - regionSSIM[1]) < 1e-6, @"same region value for a smaller tile");
+  
+  XCTAssert(fusedSSIM(img1, Mat(10, 10, CV_8UC3)) < 0.0, @"different sizes");
+}
+
+// findRegionCenter returns the cached center for the same pixels and recomputes a grown region
+
+- (void)testFindRegionCenterCache {
+  clearRegionCenterCache();
+  
+  Mat binMat(30, 40, CV_8UC1, Scalar(0));
+  rectangle(binMat, Rect(5, 5, 10, 12), Scalar(0xFF), CV_FILLED);
+  
+  Rect roi(2, 2, 30, 20);
+  
+  Mat distMat1, distMat2;
+  
+  Coord center1 = findRegionCenter(binMat, roi, distMat1, 1);
+  Coord center2 = findRegionCenter(binMat, roi, distMat2, 1);
+  
+  XCTAssert(center1 == center2, @"cached center");
+  XCTAssert(distMat1.size() == distMat2.size() && countNonZero(distMat1 != distMat2) == 0, @"cached distances");
+  
+  // Grow the region to the right, the center moves with it
+  
+  rectangle(binMat, Rect(5, 5, 20, 12), Scalar(0xFF), CV_FILLED);
+  
+  Mat grownDistMat;
+  Coord grownCenter = findRegionCenter(binMat, roi, grownDistMat, 1);
+  
+  setRegionCenterCacheMaxPixels(0);
+  
+  Mat uncachedDistMat;
+  Coord uncachedCenter = findRegionCenter(binMat, roi, uncachedDistMat, 1);
+  
+  setRegionCenterCacheMaxPixels(4 * 1024 * 1024);
+  
+  XCTAssert(grownCenter == uncachedCenter, @"grown center");
+  XCTAssert(grownCenter.x > center1.x, @"center moved");
+  XCTAssert(countNonZero(grownDistMat != uncachedDistMat) == 0, @"grown distances");
+  
+  clearRegionCenterCache();
+}
+
+// InsideOutsideCounts gives the same records as insideOutsideTest and updates one bin for each moved coord
+
+- (void)testInsideOutsideCountsIncremental {
+  vector<Coord> regionCoords;
+  vector<uint32_t> outPixels;
+  
+  // Left half is red and right half is blue, one green pixel is not in the colortable
+  
+  for (int y = 0; y < 4; y++) {
+    for (int x = 0; x < 8; x++) {
+      regionCoords.push_back(Coord(x, y));
+      outPixels.push_back((x < 4) ? 0x00FF0000 : 0x000000FF);
+    }
+  }
+  
+  outPixels[0] = 0x0000FF00;
+  
+  vector<uint32_t> colortable;
+  colortable.push_back(0x00FF0000);
+  colortable.push_back(0x000000FF);
+  
+  vector<Coord> insideCoords;
+  
+  for ( Coord c : regionCoords ) {
+    if (c.x < 2) {
+      insideCoords.push_back(c);
+    }
+  }
+  
+  unordered_map<uint32_t, InsideOutsideRecord> testRecords;
+  
+  insideOutsideTest(8, 4, insideCoords, 0, regionCoords, outPixels.data(), colortable, testRecords);
+  
+  InsideOutsideCounts counts;
+  counts.init(insideCoords, regionCoords, outPixels.data(), colortable);
+  
+  unordered_map<uint32_t, InsideOutsideRecord> records;
+  counts.writeRecords(records);
+  
+  XCTAssert(records.size() == 3 && testRecords.size() == 3, @"two colors and the other pixel");
+  XCTAssert(records[0x00FF0000].inside == 7 && records[0x00FF0000].outside == 8, @"red counts");
+  XCTAssert(records[0x00FF0000].inside == testRecords[0x00FF0000].inside && records[0x00FF0000].outside == testRecords[0x00FF0000].outside, @"same red counts");
+  XCTAssert(records[0x00FF0000].isInside == false, @"red not inside yet");
+  XCTAssert(records[0x0000FF00].inside == 1 && records[0x0000FF00].outside == 0, @"other pixel counted");
+  XCTAssert(records[0x000000FF].outside == 16 && !records[0x000000FF].isInside, @"blue outside");
+  
+  // Expand the known region to x < 4, only the moved coords change a count
+  
+  for (int i = 0; i < counts.getNumRegionCoords(); i++) {
+    if (regionCoords[i].x < 4) {
+      counts.setInside(i, true);
+    }
+  }
+  
+  XCTAssert(counts.getInside(0) == 15 && counts.getOutside(0) == 0, @"red inside");
+  XCTAssert(counts.getConfidence(0) == 1.0f, @"red confidence");
+  XCTAssert(counts.getConfidence(1) == 0.0f, @"blue confidence");
+  
+  counts.writeRecords(records);
+  XCTAssert(records[0x00FF0000].isInside, @"red inside");
+  
+  // Contract again
+  
+  counts.setInside(1, false);
+  XCTAssert(counts.getInside(0) == 14 && counts.getOutside(0) == 1, @"red contracted");
+}
+
+// Neighbors ranked by size and the very large neighbor filtered out
+
+- (void)testRankNeighborsBySize {
+  // A 60 pixel region on top, a 20 pixel region below and the
+  // 4 pixel superpixel at 4 in between two 8 pixel regions.
+  
+  NSMutableArray *pixelsArr = [NSMutableArray array];
+  
+  for (int y = 0; y < 10; y++) {
+    for (int x = 0; x < 10; x++) {
+      int pixel;
+      if (y < 6) {
+        pixel = 0;
+      } else if (y >= 8) {
+        pixel = 3;
+      } else if (x < 4) {
+        pixel = 1;
+      } else if (x < 6) {
+        pixel = 4;
+      } else {
+        pixel = 2;
+      }
+      [pixelsArr addObject:@(pixel)];
+    }
+  }
+  
+  Mat tagsImg(10, 10, CV_MAKETYPE(CV_8U, 3));
+  
+  [self.class fillImageWithPixels:pixelsArr img:tagsImg];
+  
+  MergeSuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  const int32_t smallTag = 4+1;
+  
+  XCTAssert(spImage.getSuperpixelPtr(smallTag) != NULL, @"small superpixel");
+  
+  vector<int32_t> neighborTags;
+  vector<float> neighborSizes;
+  
+  spImage.rankNeighborsBySize(smallTag, neighborTags, neighborSizes);
+  
+  XCTAssert(neighborTags.size() == 4 && neighborSizes.size() == 4, @"num neighbors");
+  XCTAssert(neighborTags[0] == 0+1 && neighborSizes[0] == 60.0f, @"largest neighbor");
+  XCTAssert(neighborTags[1] == 3+1 && neighborSizes[1] == 20.0f, @"second neighbor");
+  XCTAssert(neighborSizes[2] == 8.0f && neighborSizes[3] == 8.0f, @"smallest neighbors");
+  
+  vector<int32_t> largeNeighbors;
+  
+  spImage.filterOutVeryLargeNeighbors(smallTag, largeNeighbors);
+  
+  XCTAssert(largeNeighbors.size() == 1 && largeNeighbors[0] == 0+1, @"only the 60 pixel neighbor is very large");
+}
+
+// Each captured region is passed to the merged callback as it is committed
+
+- (void)testCaptureRegionMasksMergedCallback
+{
+  // Same flat gray region as testCaptureHomogeneousRegion
+  
+  Mat tagsImg(24, 48, CV_8UC3, Scalar(0, 0, 0));
+  tagsImg(cv::Rect(8, 4, 20, 16)) = Scalar(1, 0, 0);
+  
+  Mat inputImg(24, 48, CV_8UC3, Scalar(0, 0, 0));
+  
+  for ( int y = 4; y < 20; y++ ) {
+    for ( int x = 8; x < 32; x++ ) {
+      uint8_t gray = 128 + ((x + y) % 3) - 1;
+      inputImg.at<Vec3b>(y, x) = Vec3b(gray, gray, gray);
+    }
+  }
+  
+  SuperpixelImage spImage;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  RegionRemerger remerger(tagsImg);
+  
+  vector<int32_t> mergedTags;
+  vector<int> mergedPixels;
+  vector<cv::Rect> mergedBounds;
+  vector<int> numCapturedRegions;
+  
+  auto mergedFunc = [&](int32_t tag, const RegionMask &mask) {
+    mergedTags.push_back(tag);
+    mergedPixels.push_back(countNonZero(mask.mat()));
+    mergedBounds.push_back(mask.nonZeroBounds());
+    numCapturedRegions.push_back(remerger.numCapturedRegions);
+  };
+  
+  vector<int32_t> tags = { 1+1 };
+  
+  int numCaptured = captureRegionMasks(spImage, inputImg, tagsImg, tags, 12, 6, 4, remerger, Mat(), mergedFunc);
+  
+  XCTAssert(numCaptured == 1, @"captured");
+  XCTAssert(mergedTags.size() == 1 && mergedTags[0] == (1+1), @"one callback");
+  XCTAssert(mergedPixels[0] == (24 * 16) && mergedBounds[0] == cv::Rect(8, 4, 24, 16), @"committed mask");
+  XCTAssert(numCapturedRegions[0] == 1 && remerger.numCapturedPixels == (24 * 16), @"already merged");
+}
+
+@end
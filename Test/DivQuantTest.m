@@ -318,4 +318,166 @@
   return;
 }
 
+// Sampled quant of 2 flat regions, more pixels than samples
+
+- (void)testQuantSampled {
+  const int numPixels = 4096;
+  uint32_t inPixels[numPixels];
+  uint32_t outPixels[numPixels];
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    inPixels[i] = (i < (numPixels / 2)) ? 0x00102030 : 0x00E0D0C0;
+  }
+  
+  const int numClusters = 2;
+  uint32_t colortable[numClusters];
+  
+  uint32_t numActualClusters = numClusters;
+  
+  QuantSampleStats stats;
+  
+  quant_recurse_sampled(numPixels, inPixels, outPixels, &numActualClusters, colortable, 0, 256, &stats);
+  
+  XCTAssert(numActualClusters == 2, @"colortable");
+  XCTAssert(stats.numSamples == 256, @"numSamples");
+  XCTAssert(stats.sampleMSE == 0.0, @"sampleMSE");
+  XCTAssert(stats.fullMSE == 0.0, @"fullMSE");
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(outPixels[i] == inPixels[i], @"outPixels");
+  }
+  
+  return;
+}
+
+// Seeded quant of 2 flat regions, a seed close to the 2 colors is refined to
+// the exact colors and a seed that does not fit falls back to quant_recurse()
+
+- (void)testQuantSeeded {
+  const int numPixels = 4096;
+  uint32_t inPixels[numPixels];
+  uint32_t outPixels[numPixels];
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    inPixels[i] = (i < (numPixels / 2)) ? 0x00102030 : 0x00E0D0C0;
+  }
+  
+  const int numClusters = 4;
+  uint32_t colortable[numClusters];
+  
+  uint32_t seedColortable[2] = { 0x00182028, 0x00D8D8C8 };
+  
+  uint32_t numActualClusters = numClusters;
+  
+  QuantSeedStats stats;
+  
+  quant_recurse_seeded(numPixels, inPixels, outPixels, &numActualClusters, colortable, 0, seedColortable, 2, 16.0, &stats);
+  
+  XCTAssert(stats.seeded == 1, @"seeded");
+  XCTAssert(stats.seedMSE == 0.0, @"seedMSE");
+  XCTAssert(numActualClusters == 2, @"colortable");
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(outPixels[i] == inPixels[i], @"outPixels");
+  }
+  
+  uint32_t grayColortable[1] = { 0x00808080 };
+  
+  numActualClusters = numClusters;
+  
+  quant_recurse_seeded(numPixels, inPixels, outPixels, &numActualClusters, colortable, 0, grayColortable, 1, 16.0, &stats);
+  
+  XCTAssert(stats.seeded == 0, @"not seeded");
+  XCTAssert(numActualClusters == 2, @"colortable");
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(outPixels[i] == inPixels[i], @"outPixels");
+  }
+  
+  return;
+}
+
+// A batch of 3 regions of different sizes gives the same result as one
+// quant_recurse() call per region
+
+- (void)testQuantBatch {
+  const int numJobs = 3;
+  const int numPixels = 2048;
+  uint32_t inPixels[numJobs][numPixels];
+  uint32_t outPixels[numJobs][numPixels];
+  uint32_t expectedPixels[numPixels];
+  
+  const int numClusters = 4;
+  uint32_t colortable[numJobs][numClusters];
+  uint32_t expectedColortable[numClusters];
+  
+  QuantBatchJob jobs[numJobs];
+  
+  for ( int j = 0; j < numJobs; j++ ) {
+    const int jobPixels = numPixels >> j;
+  
+    for ( int i = 0; i < jobPixels; i++ ) {
+      inPixels[j][i] = (i < (jobPixels / 2)) ? (0x00102030 + j) : (0x00E0D0C0 - j);
+    }
+  
+    jobs[j].numPixels = jobPixels;
+    jobs[j].inPixelsPtr = inPixels[j];
+    jobs[j].outPixelsPtr = outPixels[j];
+    jobs[j].numClusters = numClusters;
+    jobs[j].outColortablePtr = colortable[j];
+    jobs[j].allPixelsUnique = 0;
+  }
+  
+  quant_recurse_batch(jobs, numJobs);
+  
+  for ( int j = 0; j < numJobs; j++ ) {
+    uint32_t numActualClusters = numClusters;
+  
+    quant_recurse(jobs[j].numPixels, inPixels[j], expectedPixels, &numActualClusters, expectedColortable, 0);
+  
+    XCTAssert(jobs[j].numClusters == numActualClusters, @"colortable");
+  
+    for ( int i = 0; i < (int) numActualClusters; i++ ) {
+      XCTAssert(colortable[j][i] == expectedColortable[i], @"colortable");
+    }
+  
+    for ( int i = 0; i < (int) jobs[j].numPixels; i++ ) {
+      XCTAssert(outPixels[j][i] == expectedPixels[i], @"outPixels");
+    }
+  }
+  
+  return;
+}
+
+- (void)testQuantColorspaceLab {
+  const int numPixels = 4096;
+  uint32_t inPixels[numPixels];
+  uint32_t labPixels[numPixels];
+  uint32_t outPixels[numPixels];
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    inPixels[i] = (i < (numPixels / 2)) ? 0x00000000 : 0x00FFFFFF;
+  }
+  
+  divquant_rgb_to_colorspace(DIVQUANT_COLORSPACE_LAB, inPixels, numPixels, labPixels);
+  
+  XCTAssert(labPixels[0] == 0x00008080, @"black Lab");
+  XCTAssert(labPixels[numPixels-1] == 0x00FF8080, @"white Lab");
+  
+  const int numClusters = 2;
+  uint32_t colortable[numClusters];
+  
+  uint32_t numActualClusters = numClusters;
+  
+  quant_recurse_colorspace(numPixels, labPixels, outPixels, &numActualClusters, colortable, 0, DIVQUANT_COLORSPACE_LAB);
+  
+  XCTAssert(numActualClusters == 2, @"colortable");
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    XCTAssert(outPixels[i] == inPixels[i], @"outPixels");
+  }
+  
+  return;
+}
+
 @end
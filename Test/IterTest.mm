@@ -475,6 +475,100 @@
   return;
 }
 
+// ROI iterators only visit the pixels inside the roi
+
+- (void) testRoiIterators
+{
+  Mat binMat(4, 5, CV_8UC1, Scalar(0));
+  Mat tagsImg(4, 5, CV_8UC3, Scalar(1, 2, 3));
+  
+  cv::Rect roi(1, 1, 3, 2);
+  
+  for_each_byte(binMat, roi, [](uint8_t *bytePtr)->void {
+    *bytePtr = 0xFF;
+  });
+  
+  int numOn = 0;
+  
+  for ( int y = 0; y < binMat.rows; y++ ) {
+    for ( int x = 0; x < binMat.cols; x++ ) {
+      uint8_t bVal = binMat.at<uint8_t>(y, x);
+      if (roi.contains(cv::Point(x, y))) {
+        XCTAssert(bVal == 0xFF, @"inside");
+      } else {
+        XCTAssert(bVal == 0, @"outside");
+      }
+      numOn += (bVal != 0);
+    }
+  }
+  
+  XCTAssert(numOn == 6, @"numOn");
+  
+  int sum = 0;
+  
+  for_each_const_bgr(tagsImg, roi, [&sum](uint8_t B, uint8_t G, uint8_t R)->void {
+    sum += B + G + R;
+  });
+  
+  XCTAssert(sum == (6 * 6), @"sum");
+  
+  // Pair iterator clears tagsImg pixels where the mask is on
+  
+  for_each_bgr_const_byte(tagsImg, binMat, cv::Rect(0, 0, 5, 2), [](uint8_t B, uint8_t G, uint8_t R, uint8_t bVal)->Vec3b {
+    return bVal ? Vec3b(0, 0, 0) : Vec3b(B, G, R);
+  });
+  
+  XCTAssert(tagsImg.at<Vec3b>(1, 1) == Vec3b(0, 0, 0), @"cleared");
+  XCTAssert(tagsImg.at<Vec3b>(2, 1) == Vec3b(1, 2, 3), @"not in roi");
+  XCTAssert(tagsImg.at<Vec3b>(1, 0) == Vec3b(1, 2, 3), @"mask off");
+  
+  return;
+}
+
+// Parallel iterators write the same results as the serial iterators
+
+- (void) testParallelIterators
+{
+  Mat mat(67, 33, CV_8UC3);
+  
+  uint32_t offset = 0;
+  for_each_bgr (mat, [&offset](uint8_t B, uint8_t G, uint8_t R)->Vec3b {
+    offset++;
+    return Vec3b(offset & 0xFF, (offset >> 8) & 0xFF, 0);
+  });
+  
+  Mat serialMat = mat.clone();
+  Mat parMat = mat.clone();
+  
+  auto invert = [](uint8_t B, uint8_t G, uint8_t R)->Vec3b {
+    return Vec3b(~B, ~G, R + 1);
+  };
+  
+  for_each_bgr(serialMat, invert);
+  for_each_bgr_par(parMat, invert);
+  
+  XCTAssert(memcmp(serialMat.data, parMat.data, serialMat.total() * serialMat.elemSize()) == 0, @"bgr");
+  
+  Mat serialBin(mat.size(), CV_8UC1, Scalar(0));
+  Mat parBin(mat.size(), CV_8UC1, Scalar(0));
+  
+  auto isOdd = [](uint8_t *bytePtr, uint8_t B, uint8_t G, uint8_t R)->void {
+    *bytePtr = (B & 0x1) ? 0xFF : 0;
+  };
+  
+  cv::Rect roi(3, 5, 20, 40);
+  
+  for_each_byte_const_bgr(serialBin, mat, roi, isOdd);
+  for_each_byte_const_bgr_par(parBin, mat, roi, isOdd);
+  
+  XCTAssert(memcmp(serialBin.data, parBin.data, serialBin.total()) == 0, @"bin");
+  XCTAssert(serialBin.at<uint8_t>(5, 3) == 0xFF, @"odd");
+  XCTAssert(serialBin.at<uint8_t>(5, 4) == 0, @"even");
+  XCTAssert(serialBin.at<uint8_t>(4, 4) == 0, @"outside");
+  
+  return;
+}
+
 // Number of Mat iteration loops inside the main test method
 
 #define NUM_ITER_LOOPS 40
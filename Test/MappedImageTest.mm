@@ -0,0 +1,119 @@
+//
+//  MappedImageTest.mm
+//
+//  Test the image storage that differs from a plain Mat, a mapped .bgr
+//  file and the tiled copy of an image.
+
+#include <opencv2/opencv.hpp> // Include OpenCV before any Foundation headers
+
+#import <Foundation/Foundation.h>
+
+#include "OpenCVUtil.h"
+
+#include "Coord.h"
+#include "Superpixel.h"
+#include "SuperpixelImage.h"
+#include "MappedImage.h"
+#include "TiledImage.h"
+
+#import <XCTest/XCTest.h>
+
+@interface MappedImageTest : XCTestCase
+
+@end
+
+@implementation MappedImageTest
+
+// A mapped .bgr file is wrapped as is, a short file is rejected
+
+- (void)testMappedImageBGR
+{
+  string filename = string([NSTemporaryDirectory() UTF8String]) + "/test_input.bgr";
+  
+  FILE *fp = fopen(filename.c_str(), "wb");
+  fprintf(fp, "BGR 3 2\n");
+  for ( int i = 0; i < 3 * 2 * 3; i++ ) {
+    fputc(i, fp);
+  }
+  fclose(fp);
+  
+  MappedImage mappedImage;
+  
+  XCTAssert(mappedImage.open(filename), @"open");
+  XCTAssert(mappedImage.mat.cols == 3 && mappedImage.mat.rows == 2, @"size");
+  XCTAssert(mappedImage.mat.at<Vec3b>(1, 2) == Vec3b(15, 16, 17), @"pixel");
+  
+  fp = fopen(filename.c_str(), "wb");
+  fprintf(fp, "BGR 3 2\n");
+  fclose(fp);
+  
+  XCTAssert(mappedImage.open(filename) == false, @"too few pixels");
+  XCTAssert(mappedImage.mat.empty(), @"empty");
+}
+
+// Tiled copy of an image and region gathers from the tiles
+
+- (void)testTiledImage {
+  // 11x7 is not a whole number of tiles in either direction
+  
+  Mat inputImg(7, 11, CV_8UC3);
+  
+  for (int y = 0; y < inputImg.rows; y++) {
+    for (int x = 0; x < inputImg.cols; x++) {
+      inputImg.at<Vec3b>(y, x) = Vec3b(x * 20, y * 30, (x + y) % 4);
+    }
+  }
+  
+  for (int tileDim = 4; tileDim <= 8; tileDim += 4) {
+    TiledImage tiledImg;
+    bool worked = tiledImg.create(inputImg, tileDim);
+    XCTAssert(worked, @"create");
+    XCTAssert(tiledImg.getTileDim() == tileDim, @"tile dim");
+    XCTAssert(tiledImg.at<Vec3b>(10, 6) == inputImg.at<Vec3b>(6, 10), @"last pixel");
+    
+    Mat copyImg;
+    tiledImg.copyTo(copyImg);
+    XCTAssert(copyImg.size() == inputImg.size() && copyImg.type() == CV_8UC3, @"copy size");
+    XCTAssert(countNonZero(copyImg.reshape(1) != inputImg.reshape(1)) == 0, @"copy pixels");
+  }
+  
+  TiledImage tiledImg;
+  XCTAssert(tiledImg.create(inputImg, 5) == false, @"tile dim must be 4 or 8");
+  
+  // The tags are a tall narrow region on the left and the rest of the image
+  
+  Mat tagsImg(7, 11, CV_8UC3, Scalar(0, 0, 0));
+  tagsImg(cv::Rect(0, 0, 2, 7)) = Scalar(1, 0, 0);
+  
+  SuperpixelImage spImage;
+  spImage.tiledImageDim = 4;
+  
+  bool worked = SuperpixelImage::parse(tagsImg, spImage);
+  XCTAssert(worked, @"SuperpixelImage parse");
+  
+  Mat &labImg = spImage.getConvertedImage(inputImg, CV_BGR2Lab);
+  
+  XCTAssert(spImage.findTiledImage(inputImg) != NULL, @"input tiled");
+  XCTAssert(spImage.findTiledImage(labImg) != NULL, @"lab tiled");
+  
+  for ( int32_t tag : spImage.getSuperpixelsVec() ) {
+    Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+    
+    Mat tiledPixels, rowPixels;
+    spImage.fillMatrixFromCoords(labImg, tag, tiledPixels);
+    Superpixel::fillMatrixFromCoords(labImg, spPtr->coords, rowPixels);
+    XCTAssert(tiledPixels.cols == (int) spPtr->coords.size(), @"num pixels");
+    XCTAssert(countNonZero(tiledPixels.reshape(1) != rowPixels.reshape(1)) == 0, @"same lab pixels");
+    
+    vector<Coord> &coords = spPtr->coords;
+    vector<uint32_t> tiledPacked(coords.size());
+    vector<uint32_t> rowPacked(coords.size());
+    spImage.gatherPackedPixels(inputImg, coords, tiledPacked.data());
+    gatherPixels(inputImg, coords, rowPacked.data());
+    XCTAssert(tiledPacked == rowPacked, @"same packed pixels");
+    
+    XCTAssert(spImage.isAllSamePixels(inputImg, tag) == false, @"not all same");
+  }
+}
+
+@end
@@ -0,0 +1,105 @@
+//
+//  MetricsTest.mm
+//
+//  Test the trace events and the metrics registry that record timing
+//  and counts while segmenting.
+
+#include <opencv2/opencv.hpp> // Include OpenCV before any Foundation headers
+
+#import <Foundation/Foundation.h>
+
+#include "OpenCVUtil.h"
+
+#include "TraceEvents.h"
+#include "MetricsRegistry.h"
+
+#import <XCTest/XCTest.h>
+
+@interface MetricsTest : XCTestCase
+
+@end
+
+@implementation MetricsTest
+
+// A zone records one trace event only when tracing is enabled
+
+- (void)testTraceZone {
+  bool wasEnabled = isTraceEventsEnabled();
+  
+  setTraceEventsEnabled(false);
+  clearTraceEvents();
+  
+  {
+    TraceZone zone("disabled", 5, 10);
+  }
+  
+  XCTAssert(numTraceEvents() == 0, @"disabled");
+  
+  setTraceEventsEnabled(true);
+  
+  {
+    TraceZone zone("enabled", 5);
+    zone.setSize(10);
+  }
+  
+  XCTAssert(numTraceEvents() == 1, @"enabled");
+  
+  clearTraceEvents();
+  setTraceEventsEnabled(wasEnabled);
+  
+  return;
+}
+
+// Metrics are written in the Prometheus text format with cumulative buckets
+
+- (void)testMetricsRegistry {
+  clearMetrics();
+  
+  addMetricsCounter("test_images_total", "result=\"ok\"");
+  addMetricsCounter("test_images_total", "result=\"ok\"", 2.0);
+  addMetricsCounter("test_images_total", "result=\"ok\"", -1.0);
+  setMetricsGauge("test_queue_depth", NULL, 3.0);
+  addMetricsGauge("test_queue_depth", NULL, -1.0);
+  observeMetricsHistogram("test_stage_seconds", "stage=\"srm\"", 0.002);
+  observeMetricsHistogram("test_stage_seconds", "stage=\"srm\"", 0.2);
+  
+  // A name keeps the type it was first recorded as
+  
+  setMetricsGauge("test_images_total", "result=\"failed\"", 1.0);
+  
+  XCTAssert(numMetrics() == 3, @"num metrics");
+  
+  string filename = string([NSTemporaryDirectory() UTF8String]) + "/test_metrics.txt";
+  
+  FILE *fp = fopen(filename.c_str(), "w");
+  writeMetricsPrometheus(fp);
+  fclose(fp);
+  
+  string text;
+  
+  fp = fopen(filename.c_str(), "r");
+  
+  char buffer[1024];
+  size_t numRead;
+  
+  while ((numRead = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    text.append(buffer, numRead);
+  }
+  
+  fclose(fp);
+  
+  XCTAssert(text.find("# TYPE test_images_total counter\ntest_images_total{result=\"ok\"} 3\n") != string::npos, @"counter");
+  XCTAssert(text.find("test_images_total{result=\"failed\"}") == string::npos, @"other type ignored");
+  XCTAssert(text.find("test_queue_depth 2\n") != string::npos, @"gauge");
+  XCTAssert(text.find("test_stage_seconds_bucket{stage=\"srm\",le=\"0.001\"} 0\n") != string::npos, @"bucket");
+  XCTAssert(text.find("test_stage_seconds_bucket{stage=\"srm\",le=\"0.0025\"} 1\n") != string::npos, @"bucket");
+  XCTAssert(text.find("test_stage_seconds_bucket{stage=\"srm\",le=\"0.25\"} 2\n") != string::npos, @"cumulative bucket");
+  XCTAssert(text.find("test_stage_seconds_count{stage=\"srm\"} 2\n") != string::npos, @"count");
+  XCTAssert(text.find("process_peak_rss_bytes ") != string::npos, @"peak rss");
+  
+  clearMetrics();
+  
+  XCTAssert(numMetrics() == 0, @"cleared");
+}
+
+@end
@@ -0,0 +1,146 @@
+//
+//  SRMTest.mm
+//
+//  Test the SRM labels, the statistical region merging that gives the
+//  first regions that the clustering segmentation starts from.
+
+#include <opencv2/opencv.hpp> // Include OpenCV before any Foundation headers
+
+#import <Foundation/Foundation.h>
+
+#include "OpenCVUtil.h"
+
+#include "ClusteringSegmentation.hpp"
+
+#import <XCTest/XCTest.h>
+
+@interface SRMTest : XCTestCase
+
+@end
+
+@implementation SRMTest
+
+// SRM label counts and bounds gathered by the parallel finalize
+
+- (void)testSRMLabelCountsAndBounds
+{
+  Mat inputImg(150, 40, CV_8UC3, Scalar(0, 0, 0));
+  inputImg(cv::Rect(5, 10, 20, 120)) = Scalar(255, 255, 255);
+  inputImg(cv::Rect(30, 70, 10, 80)) = Scalar(0, 0, 255);
+  
+  SRMContext srmContext;
+  Mat labelsMat;
+  vector<int32_t> labelCounts;
+  vector<cv::Rect> labelBounds;
+  
+  int32_t numLabels = generateSRMLabels(inputImg, 64, labelsMat, srmContext, &labelCounts, &labelBounds);
+  
+  XCTAssert(numLabels == 3, @"num labels");
+  XCTAssert(labelCounts.size() == 3 && labelBounds.size() == 3, @"stats for each label");
+  
+  // Labels are in the order a row by row scan first sees them
+  
+  XCTAssert(labelsMat.at<int32_t>(0, 0) == 0, @"background label");
+  XCTAssert(labelsMat.at<int32_t>(10, 5) == 1, @"white label");
+  XCTAssert(labelsMat.at<int32_t>(70, 30) == 2, @"red label");
+  
+  XCTAssert(labelCounts[1] == 20*120 && labelCounts[2] == 10*80, @"label counts");
+  XCTAssert(labelCounts[0] == (150*40 - 20*120 - 10*80), @"background count");
+  
+  XCTAssert(labelBounds[0] == cv::Rect(0, 0, 40, 150), @"background bounds");
+  XCTAssert(labelBounds[1] == cv::Rect(5, 10, 20, 120), @"white bounds");
+  XCTAssert(labelBounds[2] == cv::Rect(30, 70, 10, 80), @"red bounds");
+}
+
+// Auto Q search gives a region count in the target range
+
+- (void)testSRMLabelsAutoQ
+{
+  Mat inputImg(150, 40, CV_8UC3, Scalar(0, 0, 0));
+  inputImg(cv::Rect(5, 10, 20, 120)) = Scalar(255, 255, 255);
+  inputImg(cv::Rect(30, 70, 10, 80)) = Scalar(0, 0, 255);
+  
+  SRMContext srmContext;
+  Mat labelsMat;
+  double Q = 0.0;
+  
+  int32_t numLabels = generateSRMLabelsAutoQ(inputImg, 2, 4, labelsMat, srmContext, &Q);
+  
+  XCTAssert(numLabels >= 2 && numLabels <= 4, @"num labels in range");
+  XCTAssert(Q >= 4.0 && Q <= 4096.0, @"Q in search range");
+  
+  Mat fixedLabelsMat;
+  int32_t numFixedLabels = generateSRMLabels(inputImg, Q, fixedLabelsMat, srmContext);
+  
+  XCTAssert(numFixedLabels == numLabels, @"same as a run with the chosen Q");
+  XCTAssert(countNonZero(fixedLabelsMat != labelsMat) == 0, @"same labels");
+}
+
+// A gray image and a BGRA frame segment the same as the image converted to BGR,
+// one context is reused for each channel count
+
+- (void)testSRMLabelsGrayAndBGRA
+{
+  Mat grayImg(150, 40, CV_8UC1, Scalar(0));
+  grayImg(cv::Rect(5, 10, 20, 120)) = Scalar(255);
+  grayImg(cv::Rect(30, 70, 10, 80)) = Scalar(128);
+  
+  Mat bgrImg;
+  cvtColor(grayImg, bgrImg, CV_GRAY2BGR);
+  
+  Mat bgraImg;
+  cvtColor(grayImg, bgraImg, CV_GRAY2BGRA);
+  
+  SRMContext srmContext;
+  Mat grayLabels, bgrLabels, bgraLabels;
+  
+  int32_t numGrayLabels = generateSRMLabels(grayImg, 64, grayLabels, srmContext);
+  int32_t numBGRLabels = generateSRMLabels(bgrImg, 64, bgrLabels, srmContext);
+  int32_t numBGRALabels = generateSRMLabels(bgraImg, 64, bgraLabels, srmContext);
+  
+  XCTAssert(numGrayLabels == 3, @"num labels");
+  XCTAssert(numBGRLabels == numGrayLabels && numBGRALabels == numGrayLabels, @"same count");
+  XCTAssert(countNonZero(grayLabels != bgrLabels) == 0, @"gray same labels");
+  XCTAssert(countNonZero(bgraLabels != bgrLabels) == 0, @"BGRA same labels");
+  
+  // The region colors are written in the input format and alpha is kept
+  
+  Mat grayOut, bgraOut;
+  generateSRM(grayImg, 64, grayOut, srmContext);
+  generateSRM(bgraImg, 64, bgraOut, srmContext);
+  
+  XCTAssert(grayOut.type() == CV_8UC1 && bgraOut.type() == CV_8UC4, @"output types");
+  XCTAssert(grayOut.at<uint8_t>(70, 30) == 128, @"gray region");
+  XCTAssert(bgraOut.at<Vec4b>(70, 30) == Vec4b(128, 128, 128, 255), @"BGRA region");
+}
+
+// SRM with the pair diffs from the OpenCL device gives the same labels as the CPU,
+// without a device the CPU diffs are used
+
+- (void)testSRMDeviceLabels {
+  Mat inputImg(90, 70, CV_8UC3, Scalar(20, 30, 40));
+  inputImg(cv::Rect(5, 10, 30, 50)) = Scalar(200, 180, 160);
+  inputImg(cv::Rect(40, 20, 25, 60)) = Scalar(0, 0, 255);
+  
+  for (int y = 0; y < inputImg.rows; y++) {
+    for (int x = 0; x < inputImg.cols; x++) {
+      Vec3b &pixel = inputImg.at<Vec3b>(y, x);
+      pixel[1] = (uint8_t) (pixel[1] + ((x * 7 + y * 13) % 5));
+    }
+  }
+  
+  SRMContext srmContext;
+  Mat cpuLabels;
+  Mat deviceLabels;
+  
+  int32_t numCPULabels = generateSRMLabels(inputImg, 64, cpuLabels, srmContext);
+  
+  setSRMDeviceEnabled(true);
+  int32_t numDeviceLabels = generateSRMLabels(inputImg, 64, deviceLabels, srmContext);
+  setSRMDeviceEnabled(false);
+  
+  XCTAssert(numCPULabels == numDeviceLabels, @"num labels");
+  XCTAssert(countNonZero(cpuLabels != deviceLabels) == 0, @"same labels");
+}
+
+@end
@@ -0,0 +1,230 @@
+//
+//  SegmentationAPITest.mm
+//
+//  Test the C API in ClusteringSegmentationAPI.h along with the roi and
+//  profile settings that it exposes.
+
+#include <opencv2/opencv.hpp> // Include OpenCV before any Foundation headers
+
+#import <Foundation/Foundation.h>
+
+#include "OpenCVUtil.h"
+
+#include "MergeSuperpixelImage.h"
+
+#include "quant_util.h"
+
+#include "ClusteringSegmentation.hpp"
+#include "ClusteringSegmentationAPI.h"
+
+#import <XCTest/XCTest.h>
+
+@interface SegmentationAPITest : XCTestCase
+
+@end
+
+@implementation SegmentationAPITest
+
+// Invalid pixels are rejected and the result stays empty
+
+- (void)testSegmentationAPIInvalidPixels
+{
+  ClusteringSegmentationConfig config;
+  clusteringSegmentationDefaultConfig(&config);
+  
+  XCTAssert(config.tileSize == 0 && config.tileApron == 64, @"default config");
+  
+  uint8_t pixels[2 * 2 * 3] = { 0 };
+  
+  ClusteringSegmentationResult result;
+  
+  int worked = clusteringSegmentationSegmentBGR(NULL, NULL, 2, 2, 6, &config, &result);
+  
+  XCTAssert(worked == 0, @"NULL pixels");
+  XCTAssert(result.labels == NULL && result.regions == NULL && result.numRegions == 0, @"empty result");
+  
+  worked = clusteringSegmentationSegmentBGR(NULL, pixels, 2, 2, 5, &config, &result);
+  
+  XCTAssert(worked == 0, @"stride smaller than a row");
+  XCTAssert(result.labels == NULL && result.width == 0, @"empty result");
+  
+  clusteringSegmentationResultFree(&result);
+}
+
+// Pixels with a padded stride segment into labels and region stats that match
+// the two halves of the image, and the free releases both buffers
+
+- (void)testSegmentationAPISegmentBGR
+{
+  const int32_t width = 64;
+  const int32_t height = 32;
+  const size_t stride = width * 3 + 16;
+  
+  const Vec3b leftPixel(20, 40, 60);
+  const Vec3b rightPixel(200, 160, 120);
+  
+  // The padding bytes at the end of each row are not pixels
+  
+  vector<uint8_t> pixels(stride * height, 0xFF);
+  
+  for ( int y = 0; y < height; y++ ) {
+    Vec3b *rowPtr = (Vec3b*) &pixels[y * stride];
+    for ( int x = 0; x < width; x++ ) {
+      rowPtr[x] = (x < (width / 2)) ? leftPixel : rightPixel;
+    }
+  }
+  
+  ClusteringSegmentationConfig config;
+  clusteringSegmentationDefaultConfig(&config);
+  config.randomSeed = 1;
+  
+  ClusteringSegmentationResult result;
+  
+  int worked = clusteringSegmentationSegmentBGR(NULL, pixels.data(), width, height, stride, &config, &result);
+  
+  XCTAssert(worked == 1, @"segment");
+  XCTAssert(result.width == width && result.height == height, @"result size");
+  XCTAssert(result.labels != NULL && result.regions != NULL, @"result buffers");
+  XCTAssert(result.numRegions >= 2, @"num regions");
+  
+  if (worked == 0) {
+    return;
+  }
+  
+  // Labels are in raster scan order and a label is only on one half
+  
+  XCTAssert(result.labels[0] == 0, @"first label");
+  XCTAssert(result.labels[width - 1] != result.labels[0], @"halves have different labels");
+  
+  vector<int32_t> numPixels(result.numRegions, 0);
+  vector<cv::Rect> bounds(result.numRegions);
+  
+  for ( int y = 0; y < height; y++ ) {
+    for ( int x = 0; x < width; x++ ) {
+      int32_t label = result.labels[y * width + x];
+  
+      XCTAssert(label >= 0 && label < result.numRegions, @"label in range");
+  
+      if (label < 0 || label >= result.numRegions) {
+        continue;
+      }
+  
+      const ClusteringSegmentationRegion &region = result.regions[label];
+      const Vec3b pixel = (x < (width / 2)) ? leftPixel : rightPixel;
+  
+      XCTAssert(region.meanB == pixel[0] && region.meanG == pixel[1] && region.meanR == pixel[2], @"region mean");
+  
+      if (numPixels[label] == 0) {
+        bounds[label] = cv::Rect(x, y, 1, 1);
+      } else {
+        bounds[label] |= cv::Rect(x, y, 1, 1);
+      }
+      numPixels[label] += 1;
+    }
+  }
+  
+  int32_t totalPixels = 0;
+  
+  for ( int32_t label = 0; label < result.numRegions; label++ ) {
+    const ClusteringSegmentationRegion &region = result.regions[label];
+  
+    XCTAssert(region.numPixels == numPixels[label], @"region count");
+    XCTAssert(cv::Rect(region.x, region.y, region.width, region.height) == bounds[label], @"region bbox");
+  
+    totalPixels += region.numPixels;
+  }
+  
+  XCTAssert(totalPixels == (width * height), @"every pixel in a region");
+  
+  clusteringSegmentationResultFree(&result);
+  
+  XCTAssert(result.labels == NULL && result.regions == NULL, @"buffers released");
+  XCTAssert(result.numRegions == 0 && result.width == 0, @"empty result");
+}
+
+// A roi that is not inside the image is rejected before anything is segmented
+
+- (void)testSegmentationROIOutsideImage
+{
+  Mat inputImg(4, 4, CV_8UC3);
+  
+  for ( int y = 0; y < inputImg.rows; y++ ) {
+    for ( int x = 0; x < inputImg.cols; x++ ) {
+      inputImg.at<Vec3b>(y, x) = Vec3b(x * 10, y * 10, 0);
+    }
+  }
+  
+  ClusteringCombineArtifacts artifacts;
+  Mat resultImg;
+  
+  bool worked = clusteringCombineROI(inputImg, resultImg, artifacts, Rect(2, 2, 4, 4), 1, 0);
+  XCTAssert(worked == false, @"roi past the image edge");
+  XCTAssert(resultImg.empty(), @"no result");
+  
+  worked = clusteringCombineROI(inputImg, resultImg, artifacts, Rect(1, 1, 0, 2), 1, 0);
+  XCTAssert(worked == false, @"empty roi");
+  
+  ClusteringSegmentationConfig config;
+  clusteringSegmentationDefaultConfig(&config);
+  
+  XCTAssert(config.roiWidth == 0 && config.roiMargin == 32, @"default roi");
+  
+  config.roiX = -1;
+  config.roiY = 0;
+  config.roiWidth = 2;
+  config.roiHeight = 2;
+  
+  ClusteringSegmentationResult result;
+  
+  int apiWorked = clusteringSegmentationSegmentBGR(NULL, inputImg.data, 4, 4, inputImg.step, &config, &result);
+  
+  XCTAssert(apiWorked == 0, @"roi left of the image");
+  XCTAssert(result.labels == NULL, @"empty result");
+}
+
+// Named profiles set the speed and quality knobs together
+
+- (void)testSegmentationProfiles {
+  SegmentationProfile balanced;
+  XCTAssert(findSegmentationProfile("balanced", balanced), @"balanced");
+  XCTAssert(balanced.srmQ == SRMContext().getQ(), @"balanced SRM Q is the default");
+  XCTAssert(balanced.superpixelDim == 4, @"balanced block size");
+  XCTAssert(balanced.captureExpandBlocks == getCaptureRegionExpandBlocks(), @"balanced expand blocks");
+  XCTAssert(balanced.histogramBinDim == getDefaultHistogramBinDim(), @"balanced histogram bins");
+  
+  int maxIters, decFactor, numBits;
+  quant_get_params(&maxIters, &decFactor, &numBits);
+  XCTAssert(balanced.quantMaxIters == maxIters && balanced.quantDecFactor == decFactor && balanced.quantNumBits == numBits, @"balanced quant params");
+  
+  SegmentationProfile fast;
+  SegmentationProfile quality;
+  XCTAssert(findSegmentationProfile("fast", fast), @"fast");
+  XCTAssert(findSegmentationProfile("quality", quality), @"quality");
+  XCTAssert(fast.srmQ < balanced.srmQ && quality.srmQ > balanced.srmQ, @"SRM Q order");
+  XCTAssert(fast.quantMaxIters < balanced.quantMaxIters && quality.quantMaxIters > balanced.quantMaxIters, @"quant iterations order");
+  
+  SegmentationProfile unknown;
+  XCTAssert(findSegmentationProfile("fastest", unknown) == false, @"unknown name");
+  
+  XCTAssert(setSegmentationProfile(fast), @"set fast");
+  XCTAssert(getSegmentationProfile().srmQ == fast.srmQ, @"fast SRM Q");
+  XCTAssert(getCaptureRegionExpandBlocks() == fast.captureExpandBlocks, @"fast expand blocks");
+  XCTAssert(getDefaultHistogramBinDim() == fast.histogramBinDim, @"fast histogram bins");
+  quant_get_params(&maxIters, &decFactor, &numBits);
+  XCTAssert(maxIters == fast.quantMaxIters && numBits == fast.quantNumBits, @"fast quant params");
+  
+  // A block larger than a block histogram is rejected and changes nothing
+  
+  SegmentationProfile invalid = quality;
+  invalid.superpixelDim = 8;
+  XCTAssert(setSegmentationProfile(invalid) == false, @"invalid block size");
+  XCTAssert(getCaptureRegionExpandBlocks() == fast.captureExpandBlocks, @"still fast");
+  
+  XCTAssert(setSegmentationProfile(balanced), @"restore balanced");
+  XCTAssert(clusteringSegmentationSetProfile("quality") == 1, @"API quality");
+  XCTAssert(getSegmentationProfile().srmQ == quality.srmQ, @"API set quality");
+  XCTAssert(clusteringSegmentationSetProfile("none") == 0, @"API unknown name");
+  XCTAssert(clusteringSegmentationSetProfile("balanced") == 1, @"API balanced");
+}
+
+@end
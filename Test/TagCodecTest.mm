@@ -0,0 +1,122 @@
+//
+//  TagCodecTest.mm
+//
+//  Test the tag codec and the region file, both write the tags image in
+//  a compact form that is read back to the same tags.
+
+#include <opencv2/opencv.hpp> // Include OpenCV before any Foundation headers
+
+#import <Foundation/Foundation.h>
+
+#include "OpenCVUtil.h"
+
+#include "RegionFile.h"
+#include "TagCodec.h"
+
+#include "ClusteringSegmentation.hpp"
+
+#import <XCTest/XCTest.h>
+
+@interface TagCodecTest : XCTestCase
+
+@end
+
+@implementation TagCodecTest
+
+// Region file holds the table and the label rows as runs, read back with mmap
+
+- (void)testRegionFileRoundTrip
+{
+  // A A B B
+  // A C C B
+  // A A B D
+  
+  const char *rowTags[3] = { "AABB", "ACCB", "AABD" };
+  
+  Mat tagsImg(3, 4, CV_8UC3);
+  Mat inputImg(3, 4, CV_8UC3);
+  
+  for ( int y = 0; y < 3; y++ ) {
+    for ( int x = 0; x < 4; x++ ) {
+      tagsImg.at<Vec3b>(y, x) = Vec3b(rowTags[y][x], 0, 0);
+      inputImg.at<Vec3b>(y, x) = Vec3b(x * 10, y * 10, 7);
+    }
+  }
+  
+  string filename = string([NSTemporaryDirectory() UTF8String]) + "/test_tags.regions";
+  
+  XCTAssert(writeRegionFile(filename, inputImg, tagsImg), @"write");
+  
+  RegionFile regionFile;
+  
+  XCTAssert(regionFile.open(filename), @"open");
+  XCTAssert(regionFile.header().numRegions == 4 && regionFile.header().numRuns == 8, @"regions and runs");
+  
+  const RegionFileRegion &regionB = regionFile.region(1);
+  
+  XCTAssert(regionB.tag == 'B' && regionB.numPixels == 4, @"first found order");
+  XCTAssert(regionB.x == 2 && regionB.y == 0 && regionB.width == 2 && regionB.height == 3, @"bbox");
+  XCTAssert(regionB.meanB == 25 && regionB.meanG == 8 && regionB.meanR == 7, @"mean color");
+  
+  uint32_t numNeighbors;
+  const uint32_t *neighbors = regionFile.neighbors(1, numNeighbors);
+  
+  XCTAssert(numNeighbors == 3 && neighbors[0] == 0 && neighbors[1] == 2 && neighbors[2] == 3, @"neighbors");
+  
+  Mat maskMat;
+  regionFile.regionMask(1, maskMat);
+  
+  XCTAssert(maskMat.size() == cv::Size(2, 3) && countNonZero(maskMat) == 4 && maskMat.at<uint8_t>(1, 0) == 0, @"mask");
+  
+  Mat readTagsImg;
+  regionFile.readTags(readTagsImg);
+  
+  XCTAssert(countNonZero(readTagsImg.reshape(1) != tagsImg.reshape(1)) == 0, @"same tags");
+}
+
+// Tags encoded with the tag codec decode to the same tags, for both tag types
+// and with bands that do not divide the rows evenly.
+
+- (void)testTagCodecRoundTrip
+{
+  Mat tagsImg(37, 29, CV_8UC3);
+  
+  for ( int y = 0; y < tagsImg.rows; y++ ) {
+    for ( int x = 0; x < tagsImg.cols; x++ ) {
+      uint32_t tag = ((y / 5) * 7 + (x / 4)) * 0x010203;
+      if (((x * 31 + y * 17) % 23) == 0) {
+        tag = x * 0x1111 + y;
+      }
+      tagsImg.at<Vec3b>(y, x) = PixelToVec3b(tag);
+    }
+  }
+  
+  vector<uint8_t> encoded;
+  
+  XCTAssert(encodeTagsImage(tagsImg, encoded, 8), @"encode");
+  XCTAssert(encoded.size() < (tagsImg.total() * 3), @"smaller than the pixels");
+  
+  Mat decodedImg;
+  
+  XCTAssert(decodeTagsImage(encoded.data(), encoded.size(), decodedImg), @"decode");
+  XCTAssert(decodedImg.type() == CV_8UC3 && decodedImg.size() == tagsImg.size(), @"type and size");
+  XCTAssert(countNonZero(decodedImg.reshape(1) != tagsImg.reshape(1)) == 0, @"same tags");
+  
+  Mat labelsImg;
+  labelConnectedTags(tagsImg, labelsImg);
+  
+  string filename = string([NSTemporaryDirectory() UTF8String]) + "/test_labels.tags";
+  
+  XCTAssert(writeTagsFile(filename, labelsImg), @"write");
+  
+  Mat readLabelsImg;
+  
+  XCTAssert(readTagsFile(filename, readLabelsImg), @"read");
+  XCTAssert(readLabelsImg.type() == CV_32SC1 && countNonZero(readLabelsImg != labelsImg) == 0, @"same labels");
+  
+  // A truncated encoding is rejected
+  
+  XCTAssert(!decodeTagsImage(encoded.data(), encoded.size() - 1, decodedImg), @"truncated");
+}
+
+@end
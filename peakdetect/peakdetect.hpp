@@ -0,0 +1,176 @@
+// Templated peak detection that finds the same peaks as detect_peak() in a
+// single pass. After a peak is found detect_peak() rescans the input from the
+// peak position, that rescan can only update the min (or max) that follows the
+// peak since no value between the peak and the current position can differ from
+// the peak by more than delta. This version keeps the extrema that follow the
+// current candidate as it scans, so only the run after a new extremum is read
+// again and the per value updates are plain selects instead of branches. Integer counts can be passed directly with a delta of 0,
+// which matches a tiny double delta on the same counts.
+
+#ifndef DETECT_PEAK_HPP
+#define	DETECT_PEAK_HPP
+
+#include <stddef.h>
+
+#include <vector>
+
+// Returns 0 on success, 1 if there is not enough space for the emission peaks
+// and 2 if there is not enough space for the absorption peaks.
+
+template <typename T>
+int detect_peak_t(
+                  const T*        data, // the data
+                  int             data_count, // row count of data
+                  int*            emi_peaks, // emission peaks will be put here
+                  int*            num_emi_peaks, // number of emission peaks found
+                  int             max_emi_peaks, // maximum number of emission peaks
+                  int*            absop_peaks, // absorption peaks will be put here
+                  int*            num_absop_peaks, // number of absorption peaks found
+                  int             max_absop_peaks, // maximum number of absorption peaks
+                  T               delta, // delta used for distinguishing peaks
+                  int             emi_first // should we search emission peak first of
+                                            // absorption peak first?
+                  )
+{
+  *num_emi_peaks = 0;
+  *num_absop_peaks = 0;
+
+  if (data_count <= 0) {
+    return 0;
+  }
+
+  T mx = data[0];
+  T mn = data[0];
+  int mx_pos = 0;
+  int mn_pos = 0;
+
+  // Min since mx_pos and max since mn_pos
+
+  T mnAfterMx = data[0];
+  int mnAfterMxPos = 0;
+  T mxAfterMn = data[0];
+  int mxAfterMnPos = 0;
+
+  bool is_detecting_emi = (emi_first != 0);
+
+  for ( int i = 1; i < data_count; ++i ) {
+    const T v = data[i];
+
+    // A new max restarts the min that follows the max
+
+    const bool newMx = v > mx;
+    mx = newMx ? v : mx;
+    mx_pos = newMx ? i : mx_pos;
+    const bool lowerAfterMx = newMx || (v < mnAfterMx);
+    mnAfterMx = lowerAfterMx ? v : mnAfterMx;
+    mnAfterMxPos = lowerAfterMx ? i : mnAfterMxPos;
+
+    const bool newMn = v < mn;
+    mn = newMn ? v : mn;
+    mn_pos = newMn ? i : mn_pos;
+    const bool higherAfterMn = newMn || (v > mxAfterMn);
+    mxAfterMn = higherAfterMn ? v : mxAfterMn;
+    mxAfterMnPos = higherAfterMn ? i : mxAfterMnPos;
+
+    if (is_detecting_emi && (v + delta < mx)) {
+      if (*num_emi_peaks >= max_emi_peaks) {
+        return 1;
+      }
+
+      emi_peaks[*num_emi_peaks] = mx_pos;
+      ++ (*num_emi_peaks);
+
+      is_detecting_emi = false;
+
+      // Same state as a rescan from mx_pos to i, the max stays at the peak
+
+      mn = mnAfterMx;
+      mn_pos = mnAfterMxPos;
+      mxAfterMn = mnAfterMx;
+      mxAfterMnPos = mnAfterMxPos;
+
+      // Values after the new min up to i are not more than delta above the
+      // min, the max of them only matters once a later value updates it.
+
+      for ( int j = mn_pos + 1; j <= i; j++ ) {
+        if (data[j] > mxAfterMn) {
+          mxAfterMn = data[j];
+          mxAfterMnPos = j;
+        }
+      }
+    } else if ((!is_detecting_emi) && (v > mn + delta)) {
+      if (*num_absop_peaks >= max_absop_peaks) {
+        return 2;
+      }
+
+      absop_peaks[*num_absop_peaks] = mn_pos;
+      ++ (*num_absop_peaks);
+
+      is_detecting_emi = true;
+
+      mx = mxAfterMn;
+      mx_pos = mxAfterMnPos;
+      mnAfterMx = mxAfterMn;
+      mnAfterMxPos = mxAfterMnPos;
+
+      for ( int j = mx_pos + 1; j <= i; j++ ) {
+        if (data[j] < mnAfterMx) {
+          mnAfterMx = data[j];
+          mnAfterMxPos = j;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Peaks for many histograms in one call, for example all the regions in a
+// capture wave. The peak vectors are resized to the number of histograms and
+// each entry holds the peak offsets for that histogram. Returns the number of
+// histograms where the peaks did not fit, zero when all were detected. The
+// capture waves still run each region end to end, so nothing calls this yet.
+
+template <typename T>
+int detect_peaks_batch(
+                       const std::vector<std::vector<T> > & histograms,
+                       T delta,
+                       int emi_first,
+                       std::vector<std::vector<int> > & emi_peaks,
+                       std::vector<std::vector<int> > & absop_peaks)
+{
+  int numFailed = 0;
+
+  emi_peaks.resize(histograms.size());
+  absop_peaks.resize(histograms.size());
+
+  for ( size_t h = 0; h < histograms.size(); h++ ) {
+    const std::vector<T> &data = histograms[h];
+    int data_count = (int) data.size();
+
+    // A peak is at least 2 positions from the next peak of the same kind, so
+    // data_count entries is always enough space.
+
+    std::vector<int> &emi = emi_peaks[h];
+    std::vector<int> &absop = absop_peaks[h];
+    emi.resize(data_count);
+    absop.resize(data_count);
+
+    int num_emi = 0;
+    int num_absop = 0;
+
+    if (detect_peak_t(data.data(), data_count,
+                      emi.data(), &num_emi, data_count,
+                      absop.data(), &num_absop, data_count,
+                      delta, emi_first)) {
+      numFailed += 1;
+    }
+
+    emi.resize(num_emi);
+    absop.resize(num_absop);
+  }
+
+  return numFailed;
+}
+
+#endif // DETECT_PEAK_HPP
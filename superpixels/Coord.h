@@ -14,10 +14,17 @@
 //  pair<int, int> which can consume 64 or or even 128 bits of mem.
 //  This coordinate object can also be used in an unordered map
 //  as a unique key.
+//
+//  The values are 16 bit by default, define SEGMENTATION_WIDE_COORDS
+//  to store 32 bit values for images or tiled inputs wider or taller
+//  than 0xFFFF pixels. A wide Coord is 64 bits and the offset and
+//  morton code of a wide Coord are 64 bit values.
 
 #ifndef __Superpixel__Coord__
 #define __Superpixel__Coord__
 
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -27,146 +34,223 @@
 
 using namespace std;
 
-class Coord {
+// Offset type that holds both values of a coord
+
+template <typename T>
+struct CoordOffsetType {
+};
+
+template <>
+struct CoordOffsetType<uint16_t> {
+  typedef uint32_t type;
+};
+
+template <>
+struct CoordOffsetType<uint32_t> {
+  typedef uint64_t type;
+};
+
+template <typename T>
+class CoordT {
 public:
-  uint16_t x;
-  uint16_t y;
+  typedef T value_type;
+  typedef typename CoordOffsetType<T>::type offset_type;
+  
+  static const int valueBits = (int) (sizeof(T) * 8);
+  
+  static const T maxValue = (T) ~((T) 0);
+  
+  T x;
+  T y;
 
-  Coord()
+  CoordT()
   :x(0), y(0)
   {
   }
   
-  Coord(uint16_t X, uint16_t Y)
+  CoordT(uint16_t X, uint16_t Y)
   :x(X), y(Y)
   {
   }
   
-  Coord(uint32_t X, uint32_t Y)
-    :x((uint16_t)X), y((uint16_t)Y)
+  CoordT(uint32_t X, uint32_t Y)
+    :x((T)X), y((T)Y)
   {
   }
   
-  Coord(int X, int Y)
+  CoordT(int X, int Y)
   {
-    assert(X >= 0 && X <= 0xFFFF);
-    x = (uint16_t) X;
-    assert(Y >= 0 && Y <= 0xFFFF);
-    y = (uint16_t) Y;
+    assert(X >= 0 && ((uint32_t) X) <= maxValue);
+    x = (T) X;
+    assert(Y >= 0 && ((uint32_t) Y) <= maxValue);
+    y = (T) Y;
   }
   
   // Calculate generic X/Y offset to enable single value compare
   // in terms of rows and then columns.
   
-  uint32_t calcOffset() const {
-    uint32_t offset = (y * 0xFFFF) + x;
+  offset_type calcOffset() const {
+    offset_type offset = (((offset_type) y) << valueBits) | x;
     return offset;
   }
   
+  // Inverse of calcOffset()
+  
+  static CoordT fromOffset(offset_type offset) {
+    CoordT coord;
+    coord.x = (T) offset;
+    coord.y = (T) (offset >> valueBits);
+    return coord;
+  }
+  
   // Calculate offset for a specific width, this implementation
   // is slower than calcOffset() and should be used when
   // looking up an offset in a real memory buffer.
   
-  uint32_t offsetFor(uint32_t width) const {
-    uint32_t offset = (y * width) + x;
+  offset_type offsetFor(uint32_t width) const {
+    offset_type offset = (((offset_type) y) * width) + x;
     return offset;
   }
   
-  bool operator==(const Coord &other) const {
+  // Z order key with the bits of X and Y interleaved, sorting by this key
+  // keeps coords that are close in 2D close in memory. See CoordMortonLess.
+  
+  offset_type mortonCode() const {
+    return (offset_type) (spreadBits(x) | (spreadBits(y) << 1));
+  }
+  
+  bool operator==(const CoordT &other) const {
     return (x == other.x && y == other.y);
   }
   
-  bool operator!=(const Coord &other) const {
+  bool operator!=(const CoordT &other) const {
     return !(*this == other);
   }
   
-  bool operator<(const Coord &other) const
+  bool operator<(const CoordT &other) const
   {
     return calcOffset() < other.calcOffset();
   }
 
-  bool operator<=(const Coord &other) const
+  bool operator<=(const CoordT &other) const
   {
     return calcOffset() <= other.calcOffset();
   }
   
-  bool operator>(const Coord &other) const
+  bool operator>(const CoordT &other) const
   {
     return calcOffset() > other.calcOffset();
   }
   
-  bool operator>=(const Coord &other) const
+  bool operator>=(const CoordT &other) const
   {
     return calcOffset() >= other.calcOffset();
   }
   
-  bool operator()(const Coord &lhs, const Coord &rhs) const
+  bool operator()(const CoordT &lhs, const CoordT &rhs) const
   {
     return lhs == rhs;
   }
   
-  Coord operator+(const Coord& rhs) const
+  CoordT operator+(const CoordT& rhs) const
   {
-    Coord tmp(*this);
+    CoordT tmp(*this);
     tmp.x += rhs.x;
     tmp.y += rhs.y;
     return tmp;
   }
 
-  Coord operator-(const Coord& rhs) const
+  CoordT operator-(const CoordT& rhs) const
   {
-    Coord tmp(*this);
+    CoordT tmp(*this);
     tmp.x -= rhs.x;
     tmp.y -= rhs.y;
     return tmp;
   }
   
-  Coord& operator+=(const Coord& rhs)
+  CoordT& operator+=(const CoordT& rhs)
   {
     x += rhs.x;
     y += rhs.y;
     return *this;
   }
 
-  Coord& operator-=(const Coord& rhs)
+  CoordT& operator-=(const CoordT& rhs)
   {
     x -= rhs.x;
     y -= rhs.y;
     return *this;
   }
   
+  // The offset is multiplied by the 64 bit golden ratio and the high bits
+  // are folded into the low bits, so that nearby coords land in different
+  // buckets whether the table uses a prime or a power of 2 bucket count.
+  
   size_t gethash() const
   {
-    size_t hashed;
-    size_t h1 = x;
-    size_t h2 = y;
-    hashed = h1 | (h2 << 16);
-    return hashed;
+    uint64_t hashed = ((uint64_t) calcOffset()) * 0x9E3779B97F4A7C15ULL;
+    hashed ^= (hashed >> 32);
+    return (size_t) hashed;
   }
   
   // Format the coord as a string with fixed width output for each tag
   
   string toString() const {
     char buffer[64];
-    snprintf(buffer, sizeof(buffer), "(%d, %d)", x, y);
+    snprintf(buffer, sizeof(buffer), "(%u, %u)", (unsigned int) x, (unsigned int) y);
     return string(buffer);
   }
   
   // Enable writing coord directly to stream via overloading
   
-  friend ostream& operator<<(ostream& os, const Coord& coord) {
+  friend ostream& operator<<(ostream& os, const CoordT& coord) {
     os << coord.toString();
     return os;
   }
+  
+private:
+  // Spread the low 32 bits of v out to the even bits
+  
+  static uint64_t spreadBits(uint64_t v) {
+    v &= 0xFFFFFFFFULL;
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+  }
+};
+
+template <typename T>
+const int CoordT<T>::valueBits;
+
+template <typename T>
+const T CoordT<T>::maxValue;
+
+#if defined(SEGMENTATION_WIDE_COORDS)
+typedef CoordT<uint32_t> Coord;
+#else
+typedef CoordT<uint16_t> Coord;
+#endif // SEGMENTATION_WIDE_COORDS
+
+// Sort coords in Z order with std::sort(), see mortonCode()
+
+class CoordMortonLess {
+public:
+  bool operator()(const Coord &lhs, const Coord &rhs) const
+  {
+    return lhs.mortonCode() < rhs.mortonCode();
+  }
 };
 
 // support hash function so that Coord can be an unordered map key
 
 namespace std {
-  template <>
-  class hash<Coord>{
+  template <typename T>
+  class hash<CoordT<T> >{
     public :
-    size_t operator()(const Coord &coord) const
+    size_t operator()(const CoordT<T> &coord) const
     {
       return coord.gethash();
     }
@@ -0,0 +1,446 @@
+// A CoordBitSet and a CoordGrid answer "is this coord in the set" and "what value
+// is stored for this coord" questions for coords inside a bounded cv::Rect. The
+// storage is a dense array with one entry for each coord in the rect, so insert,
+// test and erase are a direct index instead of a hash and a node allocation as
+// with an unordered_map keyed by Coord. Iteration visits the coords in sorted
+// order (by row and then by column), which is the same order as Coord::operator<.
+
+#ifndef COORD_GRID_H
+#define	COORD_GRID_H
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+#include "Coord.h"
+
+using namespace std;
+
+class CoordBitSet {
+  public:
+
+  cv::Rect roi;
+
+  CoordBitSet()
+  : count(0)
+  {
+  }
+
+  CoordBitSet(const cv::Rect &roi)
+  {
+    reset(roi);
+  }
+
+  // Bounds of the indicated coords
+
+  CoordBitSet(const vector<Coord> &coords)
+  {
+    reset(boundsOf(coords));
+  }
+
+  // Empty the set and use new bounds
+
+  void reset(const cv::Rect &roi) {
+    this->roi = roi;
+    bits.assign(roi.area(), 0);
+    count = 0;
+  }
+
+  // True when the coord is inside the bounds
+
+  bool inside(Coord c) const {
+    return ((int)c.x >= roi.x) && ((int)c.y >= roi.y) && ((int)c.x < (roi.x + roi.width)) && ((int)c.y < (roi.y + roi.height));
+  }
+
+  bool contains(Coord c) const {
+    return inside(c) && (bits[offsetOf(c)] != 0);
+  }
+
+  // Add a coord that must be inside the bounds, returns true if it was not already in the set
+
+  bool insert(Coord c) {
+#if defined(DEBUG)
+    assert(inside(c));
+#endif // DEBUG
+    uint8_t &bit = bits[offsetOf(c)];
+    if (bit) {
+      return false;
+    }
+    bit = 1;
+    count += 1;
+    return true;
+  }
+
+  // Add every coord inside the bounds
+
+  void insertAll() {
+    std::fill(bits.begin(), bits.end(), 1);
+    count = bits.size();
+  }
+
+  // Remove a coord, returns true if it was in the set
+
+  bool erase(Coord c) {
+    if (!inside(c)) {
+      return false;
+    }
+    uint8_t &bit = bits[offsetOf(c)];
+    if (!bit) {
+      return false;
+    }
+    bit = 0;
+    count -= 1;
+    return true;
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+  // Invoke f(Coord) for each coord in the set in sorted order
+
+  template <typename F>
+  void forEach(F f) const {
+    size_t offset = 0;
+    for ( int y = 0; y < roi.height; y++ ) {
+      for ( int x = 0; x < roi.width; x++, offset++ ) {
+        if (bits[offset]) {
+          f(Coord(roi.x + x, roi.y + y));
+        }
+      }
+    }
+  }
+
+  // Coords in the set in sorted order
+
+  vector<Coord> getCoords() const {
+    vector<Coord> coords;
+    coords.reserve(count);
+    forEach([&coords](Coord c) {
+      coords.push_back(c);
+    });
+    return coords;
+  }
+
+  // Offset of a coord inside the bounds
+
+  size_t offsetOf(Coord c) const {
+    return ((size_t)((int)c.y - roi.y) * roi.width) + ((int)c.x - roi.x);
+  }
+
+  // Smallest rect that contains all the coords, an empty rect for no coords
+
+  static cv::Rect boundsOf(const vector<Coord> &coords) {
+    if (coords.empty()) {
+      return cv::Rect();
+    }
+
+    int minX = coords[0].x;
+    int minY = coords[0].y;
+    int maxX = minX;
+    int maxY = minY;
+
+    for ( Coord c : coords ) {
+      minX = std::min(minX, (int)c.x);
+      minY = std::min(minY, (int)c.y);
+      maxX = std::max(maxX, (int)c.x);
+      maxY = std::max(maxY, (int)c.y);
+    }
+
+    return cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+  }
+
+  private:
+
+  // One byte for each coord so that a test is a single load
+
+  vector<uint8_t> bits;
+
+  size_t count;
+};
+
+// A value of type T for each coord in the set, operator[] inserts a coord with
+// a default constructed value just like an unordered_map.
+
+template <typename T>
+class CoordGrid {
+  public:
+
+  CoordGrid()
+  {
+  }
+
+  CoordGrid(const cv::Rect &roi)
+  {
+    reset(roi);
+  }
+
+  CoordGrid(const vector<Coord> &coords)
+  {
+    reset(CoordBitSet::boundsOf(coords));
+  }
+
+  void reset(const cv::Rect &roi) {
+    isSet.reset(roi);
+    values.assign(roi.area(), T());
+  }
+
+  const cv::Rect& getRoi() const {
+    return isSet.roi;
+  }
+
+  bool contains(Coord c) const {
+    return isSet.contains(c);
+  }
+
+  T& operator[](Coord c) {
+    isSet.insert(c);
+    return values[isSet.offsetOf(c)];
+  }
+
+  // Add every coord inside the bounds with the existing value
+
+  void insertAll() {
+    isSet.insertAll();
+  }
+
+  // Pointer to the value for a coord, NULL when the coord is not in the set
+
+  T* find(Coord c) {
+    return isSet.contains(c) ? &values[isSet.offsetOf(c)] : NULL;
+  }
+
+  const T* find(Coord c) const {
+    return isSet.contains(c) ? &values[isSet.offsetOf(c)] : NULL;
+  }
+
+  bool erase(Coord c) {
+    if (isSet.erase(c)) {
+      values[isSet.offsetOf(c)] = T();
+      return true;
+    }
+    return false;
+  }
+
+  size_t size() const {
+    return isSet.size();
+  }
+
+  bool empty() const {
+    return isSet.empty();
+  }
+
+  void clear() {
+    reset(cv::Rect());
+  }
+
+  // Invoke f(Coord, T&) for each coord in the set in sorted order
+
+  template <typename F>
+  void forEach(F f) {
+    isSet.forEach([this, &f](Coord c) {
+      f(c, values[isSet.offsetOf(c)]);
+    });
+  }
+
+  private:
+
+  CoordBitSet isSet;
+
+  vector<T> values;
+};
+
+// Nearest coord queries against a fixed set of coords. The coords are bucketed
+// into square cells over the bounds of the set, a query visits rings of cells
+// around the cell of the query until no coord outside the rings can be closer.
+// Ties are resolved to the smallest offset in the input vector, so a query
+// returns the same coord as a linear scan with closestToCoord().
+
+class CoordNearestGrid {
+  public:
+  
+  CoordNearestGrid()
+  : cellSize(1), numCellsX(0), numCellsY(0)
+  {
+  }
+  
+  // A cellSize of 0 picks a size from the number of coords and the bounds
+  
+  CoordNearestGrid(const vector<Coord> &coords, int cellSize = 0)
+  {
+    reset(coords, cellSize);
+  }
+  
+  void reset(const vector<Coord> &coords, int cellSize = 0) {
+    this->coords = coords;
+    roi = CoordBitSet::boundsOf(coords);
+    
+    const int N = (int) coords.size();
+    
+    if (cellSize <= 0) {
+      // About 2 coords per cell when the coords are spread over the bounds
+      double cellArea = (double) roi.area() / std::max(1, N / 2);
+      cellSize = std::max(1, (int) sqrt(cellArea));
+    }
+    
+    this->cellSize = cellSize;
+    numCellsX = (roi.width + cellSize - 1) / cellSize;
+    numCellsY = (roi.height + cellSize - 1) / cellSize;
+    
+    // Counting sort of the offsets by cell, offsets in a cell stay in order
+    
+    cellStarts.assign((numCellsX * numCellsY) + 1, 0);
+    
+    for ( Coord c : coords ) {
+      cellStarts[cellOf(c) + 1] += 1;
+    }
+    
+    for ( size_t i = 1; i < cellStarts.size(); i++ ) {
+      cellStarts[i] += cellStarts[i-1];
+    }
+    
+    cellOffsets.resize(N);
+    vector<int32_t> nextInCell(cellStarts.begin(), cellStarts.end() - 1);
+    
+    for ( int i = 0; i < N; i++ ) {
+      cellOffsets[nextInCell[cellOf(coords[i])]++] = i;
+    }
+  }
+  
+  size_t size() const {
+    return coords.size();
+  }
+  
+  // Offset of the coord closest to c, -1 when there are no coords
+  
+  int32_t nearestOffset(Coord c) const {
+    if (coords.empty()) {
+      return -1;
+    }
+    
+    const int qx = c.x;
+    const int qy = c.y;
+    const int cx = std::min(std::max(0, (qx - roi.x) / cellSize), numCellsX - 1);
+    const int cy = std::min(std::max(0, (qy - roi.y) / cellSize), numCellsY - 1);
+    
+    unsigned int minDist = (~0);
+    int32_t minOffset = -1;
+    
+    for ( int r = 0; ; r++ ) {
+      // Cells on the ring r around (cx, cy)
+      
+      for ( int y = cy - r; y <= cy + r; y++ ) {
+        if (y < 0 || y >= numCellsY) {
+          continue;
+        }
+        
+        const bool isEdgeRow = (y == cy - r) || (y == cy + r);
+        const int xStep = isEdgeRow ? 1 : (2 * r);
+        
+        for ( int x = cx - r; x <= cx + r; x += std::max(1, xStep) ) {
+          if (x < 0 || x >= numCellsX) {
+            continue;
+          }
+          
+          const int cell = (y * numCellsX) + x;
+          
+          for ( int32_t i = cellStarts[cell]; i < cellStarts[cell+1]; i++ ) {
+            int32_t offset = cellOffsets[i];
+            int dx = qx - (int)coords[offset].x;
+            int dy = qy - (int)coords[offset].y;
+            unsigned int d2 = (unsigned int) ((dx * dx) + (dy * dy));
+            
+            if (d2 < minDist || (d2 == minDist && offset < minOffset)) {
+              minDist = d2;
+              minOffset = offset;
+            }
+          }
+        }
+      }
+      
+      // Distance from c to the nearest coord that could be in a cell outside
+      // the rings visited so far, sides with no more cells are skipped.
+      
+      bool moreCells = false;
+      int minOutside = INT_MAX;
+      
+      if (cx - r > 0) {
+        moreCells = true;
+        minOutside = std::min(minOutside, qx - (roi.x + (cx - r) * cellSize) + 1);
+      }
+      if (cx + r < numCellsX - 1) {
+        moreCells = true;
+        minOutside = std::min(minOutside, (roi.x + (cx + r + 1) * cellSize) - qx);
+      }
+      if (cy - r > 0) {
+        moreCells = true;
+        minOutside = std::min(minOutside, qy - (roi.y + (cy - r) * cellSize) + 1);
+      }
+      if (cy + r < numCellsY - 1) {
+        moreCells = true;
+        minOutside = std::min(minOutside, (roi.y + (cy + r + 1) * cellSize) - qy);
+      }
+      
+      if (!moreCells) {
+        break;
+      }
+      
+      minOutside = std::max(0, minOutside);
+      
+      if (minOffset != -1 && minDist < (unsigned int) (minOutside * minOutside)) {
+        break;
+      }
+    }
+    
+    return minOffset;
+  }
+  
+  Coord nearest(Coord c) const {
+#if defined(DEBUG)
+    assert(!coords.empty());
+#endif // DEBUG
+    return coords[nearestOffset(c)];
+  }
+  
+  // Nearest offset for each query coord
+  
+  void nearestOffsets(const vector<Coord> &queries, vector<int32_t> &offsets) const {
+    offsets.resize(queries.size());
+    
+    for ( size_t i = 0; i < queries.size(); i++ ) {
+      offsets[i] = nearestOffset(queries[i]);
+    }
+  }
+  
+  private:
+  
+  vector<Coord> coords;
+  
+  cv::Rect roi;
+  
+  int cellSize;
+  
+  int numCellsX;
+  
+  int numCellsY;
+  
+  // Offsets into coords sorted by cell, the offsets for a cell are in the
+  // range from cellStarts[cell] up to cellStarts[cell+1].
+  
+  vector<int32_t> cellStarts;
+  
+  vector<int32_t> cellOffsets;
+  
+  int cellOf(Coord c) const {
+    return ((((int)c.y - roi.y) / cellSize) * numCellsX) + (((int)c.x - roi.x) / cellSize);
+  }
+};
+
+#endif // COORD_GRID_H
@@ -0,0 +1,165 @@
+// Memory mapped .bgr and .ppm input images, see MappedImage.h
+
+#include "MappedImage.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace cv;
+using namespace std;
+
+static
+bool hasFilenameExtension(const string &filename, const string &ext)
+{
+  return filename.size() >= ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Parse a PNM style header, the magic is followed by numValues decimal values
+// that are separated by whitespace or # comments, and the last value is ended
+// by a single whitespace char. Returns the size of the header or 0 when the
+// header is not valid.
+
+static
+size_t parseMappedImageHeader(const uint8_t *ptr, size_t size, const char *magic, int numValues, int *values)
+{
+  const size_t magicLen = strlen(magic);
+
+  if (size < magicLen || memcmp(ptr, magic, magicLen) != 0) {
+    return 0;
+  }
+
+  size_t offset = magicLen;
+
+  for ( int i = 0; i < numValues; i++ ) {
+    // Whitespace and comments before each value
+
+    while (offset < size) {
+      if (isspace(ptr[offset])) {
+        offset++;
+      } else if (ptr[offset] == '#') {
+        while (offset < size && ptr[offset] != '\n') {
+          offset++;
+        }
+      } else {
+        break;
+      }
+    }
+
+    if (offset == magicLen || offset >= size || !isdigit(ptr[offset])) {
+      return 0;
+    }
+
+    int64_t value = 0;
+
+    while (offset < size && isdigit(ptr[offset])) {
+      value = (value * 10) + (ptr[offset] - '0');
+      if (value > 0x7FFFFFFF) {
+        return 0;
+      }
+      offset++;
+    }
+
+    values[i] = (int) value;
+  }
+
+  if (offset >= size || !isspace(ptr[offset])) {
+    return 0;
+  }
+
+  return offset + 1;
+}
+
+MappedImage::MappedImage()
+: mapPtr(NULL), mapSize(0)
+{
+}
+
+MappedImage::~MappedImage()
+{
+  close();
+}
+
+bool MappedImage::isMappedImageFilename(const string &filename)
+{
+  return hasFilenameExtension(filename, ".bgr") || hasFilenameExtension(filename, ".ppm");
+}
+
+void MappedImage::close()
+{
+  mat = Mat();
+
+  if (mapPtr != NULL) {
+    munmap(mapPtr, mapSize);
+    mapPtr = NULL;
+    mapSize = 0;
+  }
+}
+
+bool MappedImage::open(const string &filename)
+{
+  close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat statBuf;
+
+  if (fstat(fd, &statBuf) != 0 || statBuf.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // Copy on write so that the Mat can be passed where a writable Mat is expected
+
+  void *ptr = mmap(NULL, (size_t) statBuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+  ::close(fd);
+
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+
+  mapPtr = ptr;
+  mapSize = (size_t) statBuf.st_size;
+
+  const uint8_t *bytes = (const uint8_t*) mapPtr;
+  const bool isPPM = hasFilenameExtension(filename, ".ppm");
+
+  int values[3] = { 0, 0, 255 };
+  size_t headerSize;
+
+  if (isPPM) {
+    headerSize = parseMappedImageHeader(bytes, mapSize, "P6", 3, values);
+  } else {
+    headerSize = parseMappedImageHeader(bytes, mapSize, "BGR", 2, values);
+  }
+
+  const int width = values[0];
+  const int height = values[1];
+
+  if (headerSize == 0 || width == 0 || height == 0 || values[2] != 255 ||
+      (uint64_t) width * height * 3 > (mapSize - headerSize)) {
+    cerr << "error : \"" << filename << "\" does not have a valid " << (isPPM ? "P6" : "BGR") << " header" << endl;
+    close();
+    return false;
+  }
+
+  Mat pixelsMat(height, width, CV_8UC3, (uint8_t*) mapPtr + headerSize);
+
+  if (isPPM) {
+    cvtColor(pixelsMat, mat, CV_RGB2BGR);
+    munmap(mapPtr, mapSize);
+    mapPtr = NULL;
+    mapSize = 0;
+  } else {
+    mat = pixelsMat;
+  }
+
+  return true;
+}
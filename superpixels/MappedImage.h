@@ -0,0 +1,43 @@
+// Input pixels read with mmap() instead of being decoded by imread(). A .bgr
+// file is a text header "BGR WIDTH HEIGHT" ended by a single newline followed
+// by WIDTH x HEIGHT packed BGR pixels, the mapped pixels are wrapped by a Mat
+// with no copy. A binary .ppm (P6 with a max value of 255) is mapped the same
+// way, but since PPM pixels are RGB they are converted into a BGR Mat in one
+// pass. The mapping is private, so a write to the Mat never reaches the file.
+
+#ifndef MAPPED_IMAGE_H
+#define	MAPPED_IMAGE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <string>
+
+class MappedImage
+{
+public:
+  MappedImage();
+
+  ~MappedImage();
+
+  // True when the filename ends with .bgr or .ppm
+
+  static bool isMappedImageFilename(const std::string &filename);
+
+  // Map the file and set mat, returns false if the file could not be read or
+  // the header is not valid. The mat is only valid until close().
+
+  bool open(const std::string &filename);
+
+  void close();
+
+  cv::Mat mat;
+
+private:
+  void *mapPtr;
+  size_t mapSize;
+
+  MappedImage(const MappedImage &);
+  MappedImage& operator=(const MappedImage &);
+};
+
+#endif // MAPPED_IMAGE_H
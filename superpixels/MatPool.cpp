@@ -0,0 +1,131 @@
+// Recycled frame size Mat buffers, see MatPool.h
+
+#include "MatPool.h"
+
+#include <string.h>
+
+#include "srm_alloc.h"
+
+using namespace cv;
+using namespace std;
+
+PooledMat::PooledMat(PooledMat &&other)
+: mat(other.mat), pool(other.pool)
+{
+  other.mat.release();
+  other.pool = NULL;
+}
+
+PooledMat& PooledMat::operator=(PooledMat &&other)
+{
+  if (this != &other) {
+    release();
+    mat = other.mat;
+    pool = other.pool;
+    other.mat.release();
+    other.pool = NULL;
+  }
+  return *this;
+}
+
+void PooledMat::release()
+{
+  if (pool != NULL) {
+    pool->recycle(mat);
+    pool = NULL;
+  }
+  mat.release();
+}
+
+MatPool::MatPool(int maxFreeMats)
+: maxFreeMats(max(maxFreeMats, 1)), numAllocated(0), numReused(0)
+{
+}
+
+PooledMat MatPool::acquire(Size size, int type)
+{
+  PooledMat pooled;
+  pooled.pool = this;
+
+  {
+    std::unique_lock<std::mutex> lock(poolMutex);
+
+    // Most recently released first so that the pages are likely still cached
+
+    for ( int i = (int) freeMats.size() - 1; i >= 0; i-- ) {
+      Mat &freeMat = freeMats[i];
+      if (freeMat.size() == size && freeMat.type() == type) {
+        pooled.mat = freeMat;
+        freeMats.erase(freeMats.begin() + i);
+        numReused += 1;
+        return pooled;
+      }
+    }
+
+    numAllocated += 1;
+  }
+
+  pooled.mat.create(size, type);
+  srm_advise_large(pooled.mat.data, pooled.mat.total() * pooled.mat.elemSize());
+  return pooled;
+}
+
+PooledMat MatPool::acquireZeroed(Size size, int type)
+{
+  PooledMat pooled = acquire(size, type);
+  memset(pooled.mat.data, 0, pooled.mat.total() * pooled.mat.elemSize());
+  return pooled;
+}
+
+void MatPool::clear()
+{
+  std::unique_lock<std::mutex> lock(poolMutex);
+  freeMats.clear();
+}
+
+int MatPool::getNumAllocated()
+{
+  std::unique_lock<std::mutex> lock(poolMutex);
+  return numAllocated;
+}
+
+int MatPool::getNumReused()
+{
+  std::unique_lock<std::mutex> lock(poolMutex);
+  return numReused;
+}
+
+// A buffer is only kept when no other Mat refers to the pixels, otherwise a
+// later acquire() would hand out pixels that are still in use.
+
+void MatPool::recycle(Mat &mat)
+{
+  if (mat.empty() || mat.u == NULL || mat.u->refcount != 1 || !mat.isContinuous() || mat.data != mat.datastart) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(poolMutex);
+
+  if ((int) freeMats.size() >= maxFreeMats) {
+    freeMats.erase(freeMats.begin());
+  }
+
+  freeMats.push_back(mat);
+}
+
+PooledMat acquirePooledMat(MatPool *pool, Size size, int type, bool zeroed)
+{
+  if (pool != NULL) {
+    return zeroed ? pool->acquireZeroed(size, type) : pool->acquire(size, type);
+  }
+
+  PooledMat pooled;
+  pooled.mat.create(size, type);
+  srm_advise_large(pooled.mat.data, pooled.mat.total() * pooled.mat.elemSize());
+
+  if (zeroed) {
+    memset(pooled.mat.data, 0, pooled.mat.total() * pooled.mat.elemSize());
+  }
+
+  return pooled;
+}
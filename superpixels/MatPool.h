@@ -0,0 +1,95 @@
+// A MatPool recycles the frame size buffers that a segmentation run allocates
+// for its temporaries. A buffer is checked out with acquire() as a PooledMat,
+// and when the PooledMat goes out of scope the buffer goes back to the pool so
+// that the next run on an image of the same size reuses the pages instead of
+// a fresh malloc, memset and first touch page faults. A buffer that is still
+// shared with another Mat when it is released, or that was reallocated to a
+// different size or type, is not recycled. A worker that segments many images
+// keeps one pool and passes it in ClusteringCombineArtifacts::matPool. The pool
+// is thread safe, a PooledMat must not outlive its pool. A new buffer follows
+// the SRM allocation policy in srm_alloc.h, so the frame size label and mask
+// buffers can use huge pages and are first touched on the acquiring worker.
+
+#ifndef MAT_POOL_H
+#define	MAT_POOL_H
+
+#include <opencv2/opencv.hpp>
+
+#include <mutex>
+#include <vector>
+
+class MatPool;
+
+class PooledMat {
+public:
+  cv::Mat mat;
+
+  PooledMat()
+  : pool(NULL)
+  {
+  }
+
+  PooledMat(PooledMat &&other);
+
+  PooledMat& operator=(PooledMat &&other);
+
+  ~PooledMat() {
+    release();
+  }
+
+  // Return the buffer to the pool, mat is empty after this call
+
+  void release();
+
+private:
+  friend class MatPool;
+
+  MatPool *pool;
+
+  PooledMat(const PooledMat &);
+  PooledMat& operator=(const PooledMat &);
+};
+
+class MatPool {
+public:
+  // At most maxFreeMats buffers are kept, the least recently released buffer
+  // is freed first.
+
+  MatPool(int maxFreeMats = 16);
+
+  // The pixels are not initialized
+
+  PooledMat acquire(cv::Size size, int type);
+
+  PooledMat acquireZeroed(cv::Size size, int type);
+
+  // Free the buffers held by the pool
+
+  void clear();
+
+  // Number of buffers allocated and number of buffers reused by acquire()
+
+  int getNumAllocated();
+
+  int getNumReused();
+
+private:
+  friend class PooledMat;
+
+  void recycle(cv::Mat &mat);
+
+  std::mutex poolMutex;
+
+  std::vector<cv::Mat> freeMats;
+
+  int maxFreeMats;
+
+  int numAllocated;
+  int numReused;
+};
+
+// Acquire from pool or allocate a plain Mat when pool is NULL
+
+PooledMat acquirePooledMat(MatPool *pool, cv::Size size, int type, bool zeroed);
+
+#endif // MAT_POOL_H
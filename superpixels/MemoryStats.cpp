@@ -0,0 +1,264 @@
+// Memory counters for Mat pixel data and for the heap
+
+#include "MemoryStats.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+typedef struct {
+  atomic<int64_t> bytes;
+  atomic<int64_t> peakBytes;
+  atomic<int64_t> numAllocations;
+} AtomicMemoryCounters;
+
+static void countAlloc(AtomicMemoryCounters &counters, int64_t numBytes)
+{
+  int64_t bytes = counters.bytes.fetch_add(numBytes) + numBytes;
+  counters.numAllocations++;
+
+  int64_t peakBytes = counters.peakBytes.load();
+  while (bytes > peakBytes && !counters.peakBytes.compare_exchange_weak(peakBytes, bytes)) {
+  }
+}
+
+static void countFree(AtomicMemoryCounters &counters, int64_t numBytes)
+{
+  counters.bytes.fetch_sub(numBytes);
+}
+
+static MemoryCounters loadCounters(const AtomicMemoryCounters &counters)
+{
+  MemoryCounters result;
+  result.bytes = counters.bytes.load();
+  result.peakBytes = counters.peakBytes.load();
+  result.numAllocations = counters.numAllocations.load();
+  return result;
+}
+
+// Zero initialized before any constructor runs, so that the heap counters are
+// valid for allocations made by static constructors.
+
+static AtomicMemoryCounters matCounters;
+static AtomicMemoryCounters heapCounters;
+
+// Wraps the OpenCV std allocator. Each UMatData allocated here points back to
+// this allocator so that its deallocation is counted, it is handed back to the
+// std allocator to be freed. Pixel data passed in by the caller is not counted.
+
+class CountingMatAllocator : public cv::MatAllocator
+{
+public:
+  CountingMatAllocator(cv::MatAllocator *stdAllocator)
+  : stdAllocator(stdAllocator)
+  {
+  }
+
+  cv::UMatData* allocate(int dims, const int* sizes, int type,
+                         void* data, size_t* step, int flags, cv::UMatUsageFlags usageFlags) const
+  {
+    cv::UMatData *u = stdAllocator->allocate(dims, sizes, type, data, step, flags, usageFlags);
+
+    if (u != NULL) {
+      u->currAllocator = this;
+      if (data == NULL) {
+        countAlloc(matCounters, u->size);
+      }
+    }
+
+    return u;
+  }
+
+  bool allocate(cv::UMatData* u, int accessFlags, cv::UMatUsageFlags usageFlags) const
+  {
+    return stdAllocator->allocate(u, accessFlags, usageFlags);
+  }
+
+  void deallocate(cv::UMatData* u) const
+  {
+    if (u == NULL) {
+      return;
+    }
+
+    if ((u->flags & cv::UMatData::USER_ALLOCATED) == 0) {
+      countFree(matCounters, u->size);
+    }
+
+    u->currAllocator = stdAllocator;
+    stdAllocator->deallocate(u);
+  }
+
+private:
+  cv::MatAllocator *stdAllocator;
+};
+
+static atomic<bool> memoryStatsEnabled(false);
+static once_flag memoryStatsInitFlag;
+
+// Allocated once and never freed since a Mat allocated while the stats were
+// enabled can be released after the stats are disabled or as the process exits.
+
+static CountingMatAllocator *countingMatAllocator = NULL;
+
+static void setMatAllocatorEnabled(bool enable)
+{
+  if (countingMatAllocator == NULL) {
+    countingMatAllocator = new CountingMatAllocator(cv::Mat::getStdAllocator());
+  }
+
+  cv::Mat::setDefaultAllocator(enable ? countingMatAllocator : cv::Mat::getStdAllocator());
+}
+
+// Check the environment once, the first time any stats method is invoked
+
+static void initMemoryStats()
+{
+  const char *value = getenv("SEGMENTATION_MEMORY_STATS");
+
+  if (value != NULL && *value != '\0' && *value != '0') {
+    memoryStatsEnabled = true;
+    setMatAllocatorEnabled(true);
+  }
+}
+
+void setMemoryStatsEnabled(bool enable)
+{
+  call_once(memoryStatsInitFlag, initMemoryStats);
+
+  if (enable != memoryStatsEnabled) {
+    memoryStatsEnabled = enable;
+    setMatAllocatorEnabled(enable);
+  }
+}
+
+bool isMemoryStatsEnabled()
+{
+  call_once(memoryStatsInitFlag, initMemoryStats);
+  return memoryStatsEnabled;
+}
+
+bool isHeapMemoryStatsAvailable()
+{
+#if defined(SEGMENTATION_COUNT_HEAP_ALLOCATIONS)
+  return true;
+#else
+  return false;
+#endif // SEGMENTATION_COUNT_HEAP_ALLOCATIONS
+}
+
+MemoryCounters getMatMemoryCounters()
+{
+  return loadCounters(matCounters);
+}
+
+MemoryCounters getHeapMemoryCounters()
+{
+  return loadCounters(heapCounters);
+}
+
+void resetMemoryPeaks()
+{
+  matCounters.peakBytes = matCounters.bytes.load();
+  heapCounters.peakBytes = heapCounters.bytes.load();
+}
+
+int64_t getPeakResidentBytes()
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+
+#if defined(__APPLE__)
+  // Bytes on Darwin
+  return (int64_t) usage.ru_maxrss;
+#else
+  // Kilobytes on Linux
+  return ((int64_t) usage.ru_maxrss) * 1024;
+#endif // __APPLE__
+}
+
+#if defined(SEGMENTATION_COUNT_HEAP_ALLOCATIONS)
+
+// Each heap block starts with a header that holds the requested size, so that
+// operator delete knows how many bytes are freed. The header is as large as
+// the malloc alignment so the returned pointer keeps that alignment. Every
+// allocation is counted, stats enabled or not, since a block can be freed
+// after the stats setting has changed.
+
+static const size_t heapHeaderSize = 16;
+
+static void* countedMalloc(size_t size)
+{
+  uint8_t *block = (uint8_t*) malloc(heapHeaderSize + size);
+  if (block == NULL) {
+    return NULL;
+  }
+  *((size_t*)block) = size;
+  countAlloc(heapCounters, size);
+  return block + heapHeaderSize;
+}
+
+static void countedFree(void *ptr)
+{
+  if (ptr == NULL) {
+    return;
+  }
+  uint8_t *block = ((uint8_t*)ptr) - heapHeaderSize;
+  countFree(heapCounters, *((size_t*)block));
+  free(block);
+}
+
+void* operator new(size_t size)
+{
+  void *ptr = countedMalloc(size);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+  return countedMalloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+  return countedMalloc(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  countedFree(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  countedFree(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) noexcept
+{
+  countedFree(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept
+{
+  countedFree(ptr);
+}
+
+#endif // SEGMENTATION_COUNT_HEAP_ALLOCATIONS
@@ -0,0 +1,48 @@
+// Counters for the memory allocated while the segmentation logic runs. The
+// pixel data of each cv::Mat is counted by a MatAllocator that is installed
+// as the OpenCV default allocator while the stats are enabled. Other heap
+// memory (vectors, maps and the like) is counted only when the project is
+// compiled with SEGMENTATION_COUNT_HEAP_ALLOCATIONS defined, which replaces
+// the global operator new and operator delete. The stats are disabled by
+// default, they are enabled by calling setMemoryStatsEnabled() or by setting
+// the SEGMENTATION_MEMORY_STATS environment variable to 1.
+
+#ifndef MEMORY_STATS_H
+#define	MEMORY_STATS_H
+
+#include <stdint.h>
+
+typedef struct {
+  // Bytes allocated and not yet freed
+  int64_t bytes;
+  // Largest value of bytes since the last resetMemoryPeaks()
+  int64_t peakBytes;
+  // Number of allocations since the process started
+  int64_t numAllocations;
+} MemoryCounters;
+
+void setMemoryStatsEnabled(bool enable);
+
+bool isMemoryStatsEnabled();
+
+// True when compiled with SEGMENTATION_COUNT_HEAP_ALLOCATIONS
+
+bool isHeapMemoryStatsAvailable();
+
+MemoryCounters getMatMemoryCounters();
+
+// All zero when heap memory stats are not available
+
+MemoryCounters getHeapMemoryCounters();
+
+// Set the peak of each counter to the bytes currently allocated, so that the
+// next peak is the high water mark of the logic that runs after this call.
+
+void resetMemoryPeaks();
+
+// High water mark of the resident set size of the process from getrusage(),
+// this counts all memory whether or not the stats are enabled.
+
+int64_t getPeakResidentBytes();
+
+#endif // MEMORY_STATS_H
@@ -16,10 +16,27 @@
 
 #include <iomanip>      // setprecision
 
+#include <atomic>
+#include <queue>
+
+#include <opencv2/core/ocl.hpp>
+
 #include "SuperpixelEdgeFuncs.h"
 
 const int MaxSmallNumPixelsVal = 10;
 
+static std::atomic<int> defaultHistogramBinDim(16);
+
+void setDefaultHistogramBinDim(int binDim)
+{
+  defaultHistogramBinDim = (binDim >= 2 && binDim <= 256) ? binDim : 16;
+}
+
+int getDefaultHistogramBinDim()
+{
+  return defaultHistogramBinDim;
+}
+
 void parse3DHistogram(Mat *histInputPtr,
                       Mat *histPtr,
                       Mat *backProjectInputPtr,
@@ -27,12 +44,34 @@ void parse3DHistogram(Mat *histInputPtr,
                       int conversion,
                       int numBins);
 
+void parse3DBackProjection(UMat &backProjectInput,
+                           Mat &hist,
+                           Mat &backProjection);
+
 bool pos_sample_within_bound(vector<float> &weights, float currentWeight);
 
 void writeSuperpixelMergeMask(SuperpixelImage &spImage, Mat &resultImg, vector<int32_t> merges, vector<float> weights, unordered_map<int32_t, bool> *lockedTablePtr);
 
 void generateStaticColortable(Mat &inputImg, SuperpixelImage &spImage);
 
+// Read the values of a CV_8UC1 image in coords order into a 1 x N matrix, this is
+// the gray version of fillMatrixFromCoords().
+
+static
+void fillGrayMatrixFromCoords(const Mat &input, const SuperpixelCoords &coords, Mat &output)
+{
+  assert(input.type() == CV_8UC1);
+  
+  output.create(1, (int) coords.size(), CV_8UC1);
+  
+  uint8_t *outPtr = output.ptr<uint8_t>(0);
+  
+  coords.forEachRun([&input, &outPtr](const CoordRun &run) {
+    memcpy(outPtr, input.ptr<uint8_t>(run.y) + run.x, run.length);
+    outPtr += run.length;
+  });
+}
+
 // Compare method for CompareNeighborTuple type, in the case of a tie the second column
 // is sorted in terms of decreasing int values.
 
@@ -90,17 +129,16 @@ MergeSuperpixelImage::compareNeighborSuperpixels(Mat &inputImg,
   const bool debugShowSorted = false;
   const bool debugDumpSuperpixels = false;
   
-  Mat srcSuperpixelMat;
-  Mat srcSuperpixelHist;
-  Mat srcSuperpixelBackProjection;
-  
-  // Read RGB pixel data from main image into matrix for this one superpixel and then gen histogram.
-  
-  fillMatrixFromCoords(inputImg, tag, srcSuperpixelMat);
+  // Histograms are read from the cache so that the pixels of a superpixel are only
+  // read again after the superpixel changes. The cached bins are not normalized,
+  // the BHATTACHARYYA compare is not changed by scaling either histogram.
   
-  parse3DHistogram(&srcSuperpixelMat, &srcSuperpixelHist, NULL, NULL, 0, -1);
+  const SparseColorHistogram &srcSuperpixelHist = getHistogram(inputImg, tag);
   
   if (debugDumpSuperpixels) {
+    Mat srcSuperpixelMat;
+    fillMatrixFromCoords(inputImg, tag, srcSuperpixelMat);
+    
     std::ostringstream stringStream;
     if (step == -1) {
       stringStream << "superpixel_" << tag << ".png";
@@ -111,7 +149,7 @@ MergeSuperpixelImage::compareNeighborSuperpixels(Mat &inputImg,
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << srcSuperpixelMat.cols << " x " << srcSuperpixelMat.rows << " )" << endl;
-    imwrite(filename, srcSuperpixelMat);
+    debugImwrite(filename, srcSuperpixelMat);
   }
   
   if (!results.empty()) {
@@ -132,33 +170,30 @@ MergeSuperpixelImage::compareNeighborSuperpixels(Mat &inputImg,
       continue;
     }
     
-    Mat neighborSuperpixelMat;
-    Mat neighborSuperpixelHist;
-    Mat neighborBackProjection;
-    
-    fillMatrixFromCoords(inputImg, neighborTag, neighborSuperpixelMat);
+    const SparseColorHistogram &neighborSuperpixelHist = getHistogram(inputImg, neighborTag);
     
-    parse3DHistogram(&neighborSuperpixelMat, &neighborSuperpixelHist, NULL, NULL, 0, -1);
+    int32_t numNeighborCoords = (int32_t) getSuperpixelPtr(neighborTag)->coords.size();
     
     if (debugDumpSuperpixels) {
+      Mat neighborSuperpixelMat;
+      fillMatrixFromCoords(inputImg, neighborTag, neighborSuperpixelMat);
+      
       std::ostringstream stringStream;
       stringStream << "superpixel_" << neighborTag << ".png";
       std::string str = stringStream.str();
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << neighborSuperpixelMat.cols << " x " << neighborSuperpixelMat.rows << " )" << endl;
-      imwrite(filename, neighborSuperpixelMat);
+      debugImwrite(filename, neighborSuperpixelMat);
     }
     
-    assert(srcSuperpixelHist.dims == neighborSuperpixelHist.dims);
-    
-    double compar_bh = cv::compareHist(srcSuperpixelHist, neighborSuperpixelHist, CV_COMP_BHATTACHARYYA);
+    double compar_bh = srcSuperpixelHist.bhattacharyya(neighborSuperpixelHist);
     
     if (debug) {
     cout << "BHATTACHARYYA " << compar_bh << endl;
     }
     
-    CompareNeighborTuple tuple = make_tuple(compar_bh, neighborSuperpixelMat.cols, neighborTag);
+    CompareNeighborTuple tuple = make_tuple(compar_bh, numNeighborCoords, neighborTag);
     
     results.push_back(tuple);
   }
@@ -196,6 +231,124 @@ MergeSuperpixelImage::compareNeighborSuperpixels(Mat &inputImg,
   return;
 }
 
+// Threshold the back projection of the pixels in a neighbor superpixel, returns true and
+// sets tuple to (PERCENT NUM_COORDS TAG) when enough of the pixels are at least minGraylevel.
+
+static
+bool backprojectNeighborPercent(const Mat &neighborBackProjection,
+                                int32_t neighborTag,
+                                int numPercentRanges,
+                                int numTopPercent,
+                                bool roundPercent,
+                                int minGraylevel,
+                                CompareNeighborTuple &tuple)
+{
+  const bool debug = false;
+  
+  //const int minGraylevel = 200;
+  //const float minPercent = 0.95f;
+  
+  float oneRange = (1.0f / numPercentRanges);
+  float minPercent = 1.0f - (oneRange * numTopPercent);
+  
+  int count = 0;
+  int N = neighborBackProjection.cols;
+  
+  assert(neighborBackProjection.rows == 1);
+  for (int i = 0; i < N; i++) {
+    uint8_t gray = neighborBackProjection.at<uchar>(0, i);
+    if (gray >= minGraylevel) {
+      count += 1;
+    }
+  }
+  
+  float per = ((double)count) / N;
+  
+  if (debug) {
+    cout << setprecision(3); // 3.141
+    cout << showpoint;
+    cout << setw(10);
+    
+    cout << "for neighbor " << neighborTag << " found " << count << " non-zero out of " << N << " pixels : per " << per << endl;
+  }
+  
+  if (per >= minPercent) {
+    if (debug) {
+      cout << "added neighbor to merge list" << endl;
+    }
+    
+    // If roundPercent is true then round the percentage in terms of the width of percentage range.
+    
+    if (roundPercent) {
+      float rounded = round(per / oneRange) * oneRange;
+      
+      if (debug) {
+        char buffer[1024];
+        snprintf(buffer, sizeof(buffer), "rounded per %0.4f to %0.4f", per, rounded);
+        cout << (char*)buffer << endl;
+      }
+      
+      per = rounded;
+    }
+    
+    tuple = CompareNeighborTuple(per, N, neighborTag);
+    
+    return true;
+  }
+  
+  return false;
+}
+
+// Parallel loop body that back projects the source histogram onto each neighbor. Each
+// neighbor is a distinct superpixel and the source histogram and the input image are
+// only read, so the neighbors can be evaluated at the same time. The result for each
+// neighbor is written to the slot with the same index.
+
+class BackprojectNeighborsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  BackprojectNeighborsParallelBody(SuperpixelImage &_spImage,
+                                   Mat &_histInputImg,
+                                   const SparseColorHistogram &_srcSuperpixelHist,
+                                   const vector<int32_t> &_neighborTags,
+                                   int _numPercentRanges,
+                                   int _numTopPercent,
+                                   bool _roundPercent,
+                                   int _minGraylevel,
+                                   vector<CompareNeighborTuple> &_neighborTuples,
+                                   vector<uint8_t> &_accepted)
+  : spImage(_spImage), histInputImg(_histInputImg), srcSuperpixelHist(_srcSuperpixelHist), neighborTags(_neighborTags),
+  numPercentRanges(_numPercentRanges), numTopPercent(_numTopPercent), roundPercent(_roundPercent), minGraylevel(_minGraylevel),
+  neighborTuples(_neighborTuples), accepted(_accepted) {}
+  
+  void operator()(const cv::Range& range) const {
+    Mat neighborSuperpixelMat;
+    Mat neighborBackProjection;
+    
+    for ( int i = range.start; i < range.end; i++ ) {
+      int32_t neighborTag = neighborTags[i];
+      
+      spImage.fillMatrixFromCoords(histInputImg, neighborTag, neighborSuperpixelMat);
+      
+      srcSuperpixelHist.backproject(neighborSuperpixelMat, neighborBackProjection);
+      
+      accepted[i] = backprojectNeighborPercent(neighborBackProjection, neighborTag, numPercentRanges, numTopPercent, roundPercent, minGraylevel, neighborTuples[i]);
+    }
+  }
+  
+private:
+  SuperpixelImage &spImage;
+  Mat &histInputImg;
+  const SparseColorHistogram &srcSuperpixelHist;
+  const vector<int32_t> &neighborTags;
+  int numPercentRanges;
+  int numTopPercent;
+  bool roundPercent;
+  int minGraylevel;
+  vector<CompareNeighborTuple> &neighborTuples;
+  vector<uint8_t> &accepted;
+};
+
 // This method is invoked to do a histogram based backprojection to return alikeness
 // info about the neighbors of the superpixel. This method uses a histogram based compare
 // to return a list sorted by decreasing normalized value determined by averaging the
@@ -216,6 +369,8 @@ MergeSuperpixelImage::compareNeighborSuperpixels(Mat &inputImg,
 //          total acceptable range is then 10%.
 // minGraylevel: A percentage value must be GTEQ this grayscale
 //          prob value to be considered.
+// parallel : evaluate the neighbors on multiple threads, the results
+//          are the same as the serial evaluation.
 //
 // Return tuples : (PERCENT NUM_COORDS TAG)
 
@@ -224,14 +379,15 @@ MergeSuperpixelImage::backprojectNeighborSuperpixels(SuperpixelImage &spImage,
                                                 Mat &inputImg,
                                                 int32_t tag,
                                                 vector<CompareNeighborTuple> &results,
-                                                unordered_map<int32_t, bool> *lockedTablePtr,
+                                                const SuperpixelTagBitset *lockedTablePtr,
                                                 int32_t step,
                                                 int conversion,
                                                 int numPercentRanges,
                                                 int numTopPercent,
                                                 bool roundPercent,
                                                 int minGraylevel,
-                                                int numBins)
+                                                int numBins,
+                                                bool parallel)
 {
   const bool debug = false;
   const bool debugDumpSuperpixels = false;
@@ -254,7 +410,7 @@ MergeSuperpixelImage::backprojectNeighborSuperpixels(SuperpixelImage &spImage,
   bool allNeighborsLocked = true;
   
   for ( int32_t neighborTag : spImage.edgeTable.getNeighborsSet(tag) ) {
-    if (lockedTablePtr->count(neighborTag) != 0) {
+    if (lockedTablePtr->contains(neighborTag)) {
       // Neighbor is locked
     } else {
       // Neighbor is not locked
@@ -272,21 +428,25 @@ MergeSuperpixelImage::backprojectNeighborSuperpixels(SuperpixelImage &spImage,
   }
   
   Mat srcSuperpixelMat;
-  Mat srcSuperpixelHist;
+  SparseColorHistogram srcSuperpixelHist;
   Mat srcSuperpixelBackProjection;
   
-  // Read RGB pixels for the largest superpixel identified by tag from the input image.
-  // Gen histogram and then create a back projected output image that shows the percentage
-  // values for each pixel in the connected neighbors.
+  // Read pixels for the largest superpixel identified by tag from the input image
+  // converted to the conversion colorspace. Gen histogram and then create a back
+  // projected output image that shows the percentage values for each pixel in the
+  // connected neighbors. The sparse histogram only looks up the bins used by the
+  // superpixel, the results are the same as parse3DHistogram().
+  
+  Mat &histInputImg = spImage.getConvertedImage(inputImg, conversion);
+  
+  spImage.fillMatrixFromCoords(histInputImg, tag, srcSuperpixelMat);
   
-  spImage.fillMatrixFromCoords(inputImg, tag, srcSuperpixelMat);
+  srcSuperpixelHist.parse(srcSuperpixelMat, (numBins < 0) ? getDefaultHistogramBinDim() : numBins);
   
   if (debugDumpAllBackProjection == true) {
-    // Create histogram and generate back projection for entire image
-    parse3DHistogram(&srcSuperpixelMat, &srcSuperpixelHist, &inputImg, &srcSuperpixelBackProjection, conversion, numBins);
-  } else {
-    // Create histogram but do not generate back projection for entire image
-    parse3DHistogram(&srcSuperpixelMat, &srcSuperpixelHist, NULL, NULL, conversion, numBins);
+    // Generate back projection for entire image
+    
+    srcSuperpixelHist.backproject(histInputImg, srcSuperpixelBackProjection);
   }
   
   if (debugDumpSuperpixels) {
@@ -300,7 +460,7 @@ MergeSuperpixelImage::backprojectNeighborSuperpixels(SuperpixelImage &spImage,
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << srcSuperpixelMat.cols << " x " << srcSuperpixelMat.rows << " )" << endl;
-    imwrite(filename, srcSuperpixelMat);
+    debugImwrite(filename, srcSuperpixelMat);
   }
   
   if (debugDumpAllBackProjection) {
@@ -315,7 +475,7 @@ MergeSuperpixelImage::backprojectNeighborSuperpixels(SuperpixelImage &spImage,
     
     cout << "write " << filename << " ( " << srcSuperpixelBackProjection.cols << " x " << srcSuperpixelBackProjection.rows << " )" << endl;
     
-    imwrite(filename, srcSuperpixelBackProjection);
+    debugImwrite(filename, srcSuperpixelBackProjection);
   }
   
   if (debugDumpCombinedBackProjection) {
@@ -332,155 +492,137 @@ MergeSuperpixelImage::backprojectNeighborSuperpixels(SuperpixelImage &spImage,
     spImage.reverseFillMatrixFromCoords(srcSuperpixelGreen, false, tag, srcSuperpixelBackProjection);
   }
   
-  for ( int32_t neighborTag : spImage.edgeTable.getNeighborsSet(tag) ) {
-    // Do back projection on neighbor pixels using histogram from biggest superpixel
+  // The debug output writes to shared images, so neighbors are only evaluated in
+  // parallel when all the debug output is disabled.
+  
+  if (parallel && !debugDumpSuperpixels && !debugDumpAllBackProjection && !debugDumpCombinedBackProjection) {
+    vector<int32_t> neighborTags;
     
-    if (lockedTablePtr && (lockedTablePtr->count(neighborTag) != 0)) {
-      // If a locked down table is provided then do not consider a neighbor that appears
-      // in the locked table.
-      
-      if (debug) {
-        cout << "skipping consideration of locked neighbor " << neighborTag << endl;
+    for ( int32_t neighborTag : spImage.edgeTable.getNeighborsSet(tag) ) {
+      if (!lockedTablePtr->contains(neighborTag)) {
+        neighborTags.push_back(neighborTag);
       }
-      
-      continue;
     }
     
-    Mat neighborSuperpixelMat;
-    //Mat neighborSuperpixelHist;
-    Mat neighborBackProjection;
+    vector<CompareNeighborTuple> neighborTuples(neighborTags.size());
+    vector<uint8_t> accepted(neighborTags.size(), 0);
     
-    // Back project using the 3D histogram parsed from the largest superpixel only
+    parallelFor(Range(0, (int) neighborTags.size()),
+                  BackprojectNeighborsParallelBody(spImage, histInputImg, srcSuperpixelHist, neighborTags,
+                                                   numPercentRanges, numTopPercent, roundPercent, minGraylevel,
+                                                   neighborTuples, accepted));
     
-    spImage.fillMatrixFromCoords(inputImg, neighborTag, neighborSuperpixelMat);
-      
-    parse3DHistogram(NULL, &srcSuperpixelHist, &neighborSuperpixelMat, &neighborBackProjection, conversion, numBins);
+    // Gather in neighbor order so that the sort below gives the serial result
     
-    if (debugDumpSuperpixels) {
-      std::ostringstream stringStream;
-      stringStream << "superpixel_" << neighborTag << ".png";
-      std::string str = stringStream.str();
-      const char *filename = str.c_str();
-      
-      cout << "write " << filename << " ( " << neighborSuperpixelMat.cols << " x " << neighborSuperpixelMat.rows << " )" << endl;
-      imwrite(filename, neighborSuperpixelMat);
+    for ( int i = 0; i < (int) neighborTags.size(); i++ ) {
+      if (accepted[i]) {
+        results.push_back(neighborTuples[i]);
+      }
     }
-    
-    if (debugDumpAllBackProjection) {
-      // BackProject prediction for just the pixels in the neighbor as compared to the src. Pass
-      // the input image generated from the neighbor superpixel and then recreate the original
-      // pixel layout by writing the pixels back to the output image in the same order.
+  } else {
+    for ( int32_t neighborTag : spImage.edgeTable.getNeighborsSet(tag) ) {
+      // Do back projection on neighbor pixels using histogram from biggest superpixel
       
-      std::ostringstream stringStream;
-      if (step == -1) {
-        stringStream << "backproject_neighbor_" << neighborTag << "_from" << tag << ".png";
-      } else {
-        stringStream << "backproject_step_" << step << "_neighbor_" << neighborTag << "_from_" << tag << ".png";
+      if (lockedTablePtr && lockedTablePtr->contains(neighborTag)) {
+        // If a locked down table is provided then do not consider a neighbor that appears
+        // in the locked table.
+        
+        if (debug) {
+          cout << "skipping consideration of locked neighbor " << neighborTag << endl;
+        }
+        
+        continue;
       }
-      std::string str = stringStream.str();
-      const char *filename = str.c_str();
       
-      // The back projected input is normalized grayscale as a float value
+      Mat neighborSuperpixelMat;
+      //Mat neighborSuperpixelHist;
+      Mat neighborBackProjection;
       
-      //cout << "neighborBackProjection:" << endl << neighborBackProjection << endl;
+      // Back project using the 3D histogram parsed from the largest superpixel only
       
-      Mat neighborBackProjectionGrayOrigSize(inputImg.size(), CV_8UC(3), (Scalar)0);
+      spImage.fillMatrixFromCoords(histInputImg, neighborTag, neighborSuperpixelMat);
       
-      spImage.reverseFillMatrixFromCoords(neighborBackProjection, true, neighborTag, neighborBackProjectionGrayOrigSize);
+      srcSuperpixelHist.backproject(neighborSuperpixelMat, neighborBackProjection);
       
-      cout << "write " << filename << " ( " << neighborBackProjectionGrayOrigSize.cols << " x " << neighborBackProjectionGrayOrigSize.rows << " )" << endl;
+      if (debugDumpSuperpixels) {
+        std::ostringstream stringStream;
+        stringStream << "superpixel_" << neighborTag << ".png";
+        std::string str = stringStream.str();
+        const char *filename = str.c_str();
+        
+        cout << "write " << filename << " ( " << neighborSuperpixelMat.cols << " x " << neighborSuperpixelMat.rows << " )" << endl;
+        debugImwrite(filename, neighborSuperpixelMat);
+      }
       
-      imwrite(filename, neighborBackProjectionGrayOrigSize);
-    }
-    
-    if (debugDumpCombinedBackProjection) {
-      // Write combined back projection values to combined image.
+      if (debugDumpAllBackProjection) {
+        // BackProject prediction for just the pixels in the neighbor as compared to the src. Pass
+        // the input image generated from the neighbor superpixel and then recreate the original
+        // pixel layout by writing the pixels back to the output image in the same order.
+        
+        std::ostringstream stringStream;
+        if (step == -1) {
+          stringStream << "backproject_neighbor_" << neighborTag << "_from" << tag << ".png";
+        } else {
+          stringStream << "backproject_step_" << step << "_neighbor_" << neighborTag << "_from_" << tag << ".png";
+        }
+        std::string str = stringStream.str();
+        const char *filename = str.c_str();
+        
+        // The back projected input is normalized grayscale as a float value
+        
+        //cout << "neighborBackProjection:" << endl << neighborBackProjection << endl;
+        
+        Mat neighborBackProjectionGrayOrigSize(inputImg.size(), CV_8UC(3), (Scalar)0);
+        
+        spImage.reverseFillMatrixFromCoords(neighborBackProjection, true, neighborTag, neighborBackProjectionGrayOrigSize);
+        
+        cout << "write " << filename << " ( " << neighborBackProjectionGrayOrigSize.cols << " x " << neighborBackProjectionGrayOrigSize.rows << " )" << endl;
+        
+        debugImwrite(filename, neighborBackProjectionGrayOrigSize);
+      }
+      
+      if (debugDumpCombinedBackProjection) {
+        // Write combined back projection values to combined image.
 
-      spImage.reverseFillMatrixFromCoords(neighborBackProjection, true, neighborTag, srcSuperpixelBackProjection);
-    }
-    
-    // Threshold the neighbor pixels and then choose a path for expansion that considers all the neighbors
-    // via a fill. Any value larger than 200 becomes 255 while any value below becomes zero
-    
-    /*
-    
-    threshold(neighborBackProjection, neighborBackProjection, 200.0, 255.0, THRESH_BINARY);
-    
-    if (debugDumpBackProjection) {
-    
-      std::ostringstream stringStream;
-      if (step == -1) {
-        stringStream << "backproject_threshold_neighbor_" << neighborTag << "_from" << tag << ".png";
-      } else {
-        stringStream << "backproject_threshold_step_" << step << "_neighbor_" << neighborTag << "_from_" << tag << ".png";
+        spImage.reverseFillMatrixFromCoords(neighborBackProjection, true, neighborTag, srcSuperpixelBackProjection);
       }
-      std::string str = stringStream.str();
-      const char *filename = str.c_str();
       
-      cout << "write " << filename << " ( " << neighborBackProjection.cols << " x " << neighborBackProjection.rows << " )" << endl;
-    
-      imwrite(filename, neighborBackProjection);
-    }
-    
-    */
-     
-    // If more than 95% of the back projection threshold values are on then treat this neighbor superpixel
-    // as one that should be merged in this expansion step.
-    
-    if (1) {
-      //const int minGraylevel = 200;
-      //const float minPercent = 0.95f;
+      // Threshold the neighbor pixels and then choose a path for expansion that considers all the neighbors
+      // via a fill. Any value larger than 200 becomes 255 while any value below becomes zero
       
-      float oneRange = (1.0f / numPercentRanges);
-      float minPercent = 1.0f - (oneRange * numTopPercent);
+      /*
       
-      int count = 0;
-      int N = neighborBackProjection.cols;
+      threshold(neighborBackProjection, neighborBackProjection, 200.0, 255.0, THRESH_BINARY);
       
-      assert(neighborBackProjection.rows == 1);
-      for (int i = 0; i < N; i++) {
-        uint8_t gray = neighborBackProjection.at<uchar>(0, i);
-        if (gray >= minGraylevel) {
-          count += 1;
+      if (debugDumpBackProjection) {
+      
+        std::ostringstream stringStream;
+        if (step == -1) {
+          stringStream << "backproject_threshold_neighbor_" << neighborTag << "_from" << tag << ".png";
+        } else {
+          stringStream << "backproject_threshold_step_" << step << "_neighbor_" << neighborTag << "_from_" << tag << ".png";
         }
+        std::string str = stringStream.str();
+        const char *filename = str.c_str();
+        
+        cout << "write " << filename << " ( " << neighborBackProjection.cols << " x " << neighborBackProjection.rows << " )" << endl;
+      
+        debugImwrite(filename, neighborBackProjection);
       }
       
-      float per = ((double)count) / N;
+      */
+       
+      // If more than 95% of the back projection threshold values are on then treat this neighbor superpixel
+      // as one that should be merged in this expansion step.
       
-      if (debug) {
-        cout << setprecision(3); // 3.141
-        cout << showpoint;
-        cout << setw(10);
-        
-        cout << "for neighbor " << neighborTag << " found " << count << " non-zero out of " << N << " pixels : per " << per << endl;
-      }
+      CompareNeighborTuple tuple;
       
-      if (per >= minPercent) {
-        if (debug) {
-          cout << "added neighbor to merge list" << endl;
-        }
-        
-        // If roundPercent is true then round the percentage in terms of the width of percentage range.
-        
-        if (roundPercent) {
-          float rounded = round(per / oneRange) * oneRange;
-          
-          if (debug) {
-            char buffer[1024];
-            snprintf(buffer, sizeof(buffer), "rounded per %0.4f to %0.4f", per, rounded);
-            cout << (char*)buffer << endl;
-          }
-          
-          per = rounded;
-        }
-        
-        CompareNeighborTuple tuple(per, N, neighborTag);
-        
+      if (backprojectNeighborPercent(neighborBackProjection, neighborTag, numPercentRanges, numTopPercent, roundPercent, minGraylevel, tuple)) {
         results.push_back(tuple);
       }
-    }
-    
-  } // end neighbors loop
+      
+    } // end neighbors loop
+  }
   
   if (debug) {
     cout << "unsorted tuples (N = " << results.size() << ") from src superpixel " << tag << endl;
@@ -524,7 +666,7 @@ MergeSuperpixelImage::backprojectNeighborSuperpixels(SuperpixelImage &spImage,
     
     cout << "write " << filename << " ( " << srcSuperpixelBackProjection.cols << " x " << srcSuperpixelBackProjection.rows << " )" << endl;
     
-    imwrite(filename, srcSuperpixelBackProjection);
+    debugImwrite(filename, srcSuperpixelBackProjection);
   }
   
   return;
@@ -538,7 +680,7 @@ void
 MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
                                                            int32_t tag,
                                                            vector<int32_t> &results,
-                                                           unordered_map<int32_t, bool> *lockedTablePtr,
+                                                           const SuperpixelTagBitset *lockedTablePtr,
                                                            int32_t step,
                                                            int conversion,
                                                            int numPercentRanges,
@@ -566,7 +708,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
   bool allNeighborsLocked = true;
   
   for ( int32_t neighborTag : edgeTable.getNeighborsSet(tag) ) {
-    if (lockedTablePtr->count(neighborTag) != 0) {
+    if (lockedTablePtr->contains(neighborTag)) {
       // Neighbor is locked
     } else {
       // Neighbor is not locked
@@ -587,18 +729,42 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
   Mat srcSuperpixelHist;
   Mat srcSuperpixelBackProjection;
   
-  // Read RGB pixels for the largest superpixel identified by tag from the input image.
-  // Gen histogram and then create a back projected output image that shows the percentage
-  // values for each pixel in the connected neighbors.
+  // Read pixels for the largest superpixel identified by tag from the input image
+  // converted to the conversion colorspace, so that the histogram does not need to
+  // convert the pixels again. Gen histogram and then create a back projected output
+  // image that shows the percentage values for each pixel in the connected neighbors.
+  
+  Mat &histInputImg = getConvertedImage(inputImg, conversion);
   
-  fillMatrixFromCoords(inputImg, tag, srcSuperpixelMat);
+  fillMatrixFromCoords(histInputImg, tag, srcSuperpixelMat);
   
   if (debugDumpAllBackProjection == true) {
     // Create histogram and generate back projection for entire image
-    parse3DHistogram(&srcSuperpixelMat, &srcSuperpixelHist, &inputImg, &srcSuperpixelBackProjection, conversion, numBins);
+    parse3DHistogram(&srcSuperpixelMat, &srcSuperpixelHist, &histInputImg, &srcSuperpixelBackProjection, 0, numBins);
   } else {
     // Create histogram but do not generate back projection for entire image
-    parse3DHistogram(&srcSuperpixelMat, &srcSuperpixelHist, NULL, NULL, conversion, numBins);
+    parse3DHistogram(&srcSuperpixelMat, &srcSuperpixelHist, NULL, NULL, 0, numBins);
+  }
+  
+  // With OpenCL the histogram is back projected over the entire converted image
+  // once and the value for each neighbor pixel is read from that result. This is
+  // only done when the unlocked neighbors cover a large part of the image, since
+  // otherwise back projecting just the neighbor pixels on the CPU reads less.
+  
+  Mat wholeImageBackProjection;
+  
+  if (isOpenCLBackProjection()) {
+    size_t numNeighborCoords = 0;
+    
+    for ( int32_t neighborTag : edgeTable.getNeighborsSet(tag) ) {
+      if (!lockedTablePtr->contains(neighborTag)) {
+        numNeighborCoords += getSuperpixelPtr(neighborTag)->coords.size();
+      }
+    }
+    
+    if (numNeighborCoords >= (size_t) (histInputImg.rows * histInputImg.cols / 8)) {
+      parse3DBackProjection(getConvertedUMat(inputImg, conversion), srcSuperpixelHist, wholeImageBackProjection);
+    }
   }
   
   if (debugDumpSuperpixels) {
@@ -612,7 +778,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << srcSuperpixelMat.cols << " x " << srcSuperpixelMat.rows << " )" << endl;
-    imwrite(filename, srcSuperpixelMat);
+    debugImwrite(filename, srcSuperpixelMat);
   }
   
   if (debugDumpAllBackProjection) {
@@ -627,7 +793,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
     
     cout << "write " << filename << " ( " << srcSuperpixelBackProjection.cols << " x " << srcSuperpixelBackProjection.rows << " )" << endl;
     
-    imwrite(filename, srcSuperpixelBackProjection);
+    debugImwrite(filename, srcSuperpixelBackProjection);
   }
   
   if (debugDumpCombinedBackProjection) {
@@ -644,11 +810,12 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
     reverseFillMatrixFromCoords(srcSuperpixelGreen, false, tag, srcSuperpixelBackProjection);
   }
 
-  // Table of superpixels already seen via DFS as compared to src superpixel.
+  // Superpixels already seen via DFS as compared to src superpixel, each neighbor is
+  // back projected at most once for this src histogram.
   
-  unordered_map<int32_t, bool> seenTable;
+  SuperpixelTagBitset seenTable;
   
-  seenTable[tag] = true;
+  seenTable.insert(tag);
   
   // Fill queue with initial neighbors of this superpixel
   
@@ -656,7 +823,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
   
   for ( int32_t neighborTag : edgeTable.getNeighborsSet(tag) ) {
     queue.push_back(neighborTag);
-    seenTable[neighborTag] = true;
+    seenTable.insert(neighborTag);
   }
   
   // This foreach logic must descend into neighbors and then neighbors of neighbors until the backprojection returns
@@ -688,7 +855,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
     // Pop first element off queue
     
     int32_t neighborTag = queue[sizeNow-1];
-    queue.erase(queue.end()-1);
+    queue.pop_back();
     
 #if defined(DEBUG)
     int sizeAfterPop = (int) queue.size();
@@ -699,7 +866,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
       cout << "popped neighbor tag " << neighborTag << endl;
     }
     
-    if (lockedTablePtr->count(neighborTag) != 0) {
+    if (lockedTablePtr->contains(neighborTag)) {
       // If a locked down table is provided then do not consider a neighbor that appears
       // in the locked table.
       
@@ -716,9 +883,15 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
     
     // Back project using the 3D histogram parsed from the largest superpixel only
     
-    fillMatrixFromCoords(inputImg, neighborTag, neighborSuperpixelMat);
+    if (wholeImageBackProjection.empty() || debugDumpSuperpixels) {
+      fillMatrixFromCoords(histInputImg, neighborTag, neighborSuperpixelMat);
+    }
     
-    parse3DHistogram(NULL, &srcSuperpixelHist, &neighborSuperpixelMat, &neighborBackProjection, conversion, numBins);
+    if (wholeImageBackProjection.empty()) {
+      parse3DHistogram(NULL, &srcSuperpixelHist, &neighborSuperpixelMat, &neighborBackProjection, 0, numBins);
+    } else {
+      fillGrayMatrixFromCoords(wholeImageBackProjection, getSuperpixelPtr(neighborTag)->coords, neighborBackProjection);
+    }
     
     if (debugDumpSuperpixels) {
       std::ostringstream stringStream;
@@ -727,7 +900,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << neighborSuperpixelMat.cols << " x " << neighborSuperpixelMat.rows << " )" << endl;
-      imwrite(filename, neighborSuperpixelMat);
+      debugImwrite(filename, neighborSuperpixelMat);
     }
     
     if (debugDumpAllBackProjection) {
@@ -754,7 +927,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
       
       cout << "write " << filename << " ( " << neighborBackProjectionGrayOrigSize.cols << " x " << neighborBackProjectionGrayOrigSize.rows << " )" << endl;
       
-      imwrite(filename, neighborBackProjectionGrayOrigSize);
+      debugImwrite(filename, neighborBackProjectionGrayOrigSize);
     }
     
     if (debugDumpCombinedBackProjection) {
@@ -805,8 +978,8 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
         }
         
         for ( int32_t neighborTag : edgeTable.getNeighborsSet(neighborTag) ) {
-          if (seenTable.count(neighborTag) == 0) {
-            seenTable[neighborTag] = true;
+          if (!seenTable.contains(neighborTag)) {
+            seenTable.insert(neighborTag);
             
             if (debug) {
               for (auto it = queue.begin(); it != queue.end(); ++it) {
@@ -852,7 +1025,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
         
         cout << "write " << filename << " ( " << dfsBack.cols << " x " << dfsBack.rows << " )" << endl;
         
-        imwrite(filename, dfsBack);
+        debugImwrite(filename, dfsBack);
       }
       
     }
@@ -871,7 +1044,7 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
     
     cout << "write " << filename << " ( " << srcSuperpixelBackProjection.cols << " x " << srcSuperpixelBackProjection.rows << " )" << endl;
     
-    imwrite(filename, srcSuperpixelBackProjection);
+    debugImwrite(filename, srcSuperpixelBackProjection);
   }
   
   if (debugDumpCombinedBackProjection) {
@@ -912,13 +1085,131 @@ MergeSuperpixelImage::backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
     
     cout << "write " << filename << " ( " << srcSuperpixelBackProjection.cols << " x " << srcSuperpixelBackProjection.rows << " )" << endl;
     
-    imwrite(filename, dfsScope);
+    debugImwrite(filename, dfsScope);
     
   }
   
   return;
 }
 
+// An edge cost in the merge heap. An entry is stale when the generation of
+// either superpixel has changed since the cost was calculated, stale entries
+// are skipped when popped instead of being removed from the heap.
+
+typedef struct MergeHeapEntry {
+  double cost;
+  int32_t A;
+  int32_t B;
+  uint32_t genA;
+  uint32_t genB;
+  
+  // Order by increasing cost and then by tags so that ties are deterministic
+  
+  bool operator>(const MergeHeapEntry &other) const {
+    if (cost != other.cost) {
+      return cost > other.cost;
+    } else if (A != other.A) {
+      return A > other.A;
+    } else {
+      return B > other.B;
+    }
+  }
+} MergeHeapEntry;
+
+int MergeSuperpixelImage::mergeMinCostEdges(Mat &inputImg, double maxCost, int startStep)
+{
+  const bool debug = false;
+  
+  int mergeStep = startStep;
+  
+  // The generation of a tag is incremented each time the superpixel changes
+  // size, merged tags are no longer in the superpixels set.
+  
+  unordered_map<int32_t, uint32_t> generations;
+  
+  priority_queue<MergeHeapEntry, vector<MergeHeapEntry>, greater<MergeHeapEntry> > heap;
+  
+  for ( int32_t tag : superpixels ) {
+    generations[tag] = 0;
+  }
+  
+  for ( int32_t tag : superpixels ) {
+    const SparseColorHistogram &hist = getHistogram(inputImg, tag);
+    
+    for ( int32_t neighborTag : edgeTable.getNeighborsSet(tag) ) {
+      if (neighborTag < tag) {
+        // Each edge is added once
+        continue;
+      }
+      
+      MergeHeapEntry entry;
+      entry.cost = hist.bhattacharyya(getHistogram(inputImg, neighborTag));
+      entry.A = tag;
+      entry.B = neighborTag;
+      entry.genA = 0;
+      entry.genB = 0;
+      heap.push(entry);
+    }
+  }
+  
+  if (debug) {
+    cout << "mergeMinCostEdges with " << heap.size() << " edges" << endl;
+  }
+  
+  while (!heap.empty()) {
+    MergeHeapEntry entry = heap.top();
+    heap.pop();
+    
+    if (entry.cost > maxCost) {
+      break;
+    }
+    
+    auto itA = generations.find(entry.A);
+    auto itB = generations.find(entry.B);
+    
+    if (itA == generations.end() || itB == generations.end() ||
+        itA->second != entry.genA || itB->second != entry.genB) {
+      // Stale entry
+      continue;
+    }
+    
+    if (debug) {
+      cout << "merge edge (" << entry.A << " " << entry.B << ") with cost " << entry.cost << endl;
+    }
+    
+    SuperpixelEdge edge(entry.A, entry.B);
+    mergeEdge(edge, (float) entry.cost);
+    mergeStep += 1;
+    
+    // The larger superpixel is kept, the tag of the other one is gone
+    
+    int32_t mergedTag = (superpixels.count(entry.A) > 0) ? entry.B : entry.A;
+    int32_t keptTag = (mergedTag == entry.A) ? entry.B : entry.A;
+    
+    generations.erase(mergedTag);
+    
+    uint32_t keptGen = ++generations[keptTag];
+    
+    const SparseColorHistogram &hist = getHistogram(inputImg, keptTag);
+    
+    for ( int32_t neighborTag : edgeTable.getNeighborsSet(keptTag) ) {
+      MergeHeapEntry updated;
+      updated.cost = hist.bhattacharyya(getHistogram(inputImg, neighborTag));
+      updated.A = keptTag;
+      updated.B = neighborTag;
+      updated.genA = keptGen;
+      updated.genB = generations[neighborTag];
+      heap.push(updated);
+    }
+  }
+  
+  if (debug) {
+    cout << "mergeMinCostEdges done after " << (mergeStep - startStep) << " merges" << endl;
+  }
+  
+  return mergeStep;
+}
+
 // Repeated merge of the largest superpixels up until the
 // easily merged superpixels have been merged.
 
@@ -1037,7 +1328,7 @@ void MergeSuperpixelImage::mergeAlikeSuperpixels(Mat &inputImg)
         std::string str = stringStream.str();
         const char *filename = str.c_str();
         
-        imwrite(filename, resultImg);
+        debugImwrite(filename, resultImg);
         
         cout << "wrote " << filename << endl;
       }
@@ -1102,7 +1393,7 @@ void MergeSuperpixelImage::mergeAlikeSuperpixels(Mat &inputImg)
           std::string str = stringStream.str();
           const char *filename = str.c_str();
           
-          imwrite(filename, resultImg);
+          debugImwrite(filename, resultImg);
           
           cout << "wrote " << filename << endl;
         }
@@ -1125,16 +1416,73 @@ void MergeSuperpixelImage::mergeAlikeSuperpixels(Mat &inputImg)
         
         locked[maxTag] = true;
       }
-    } // end of while ! locked loop
+    } // end of while ! locked loop
+    
+  } // end of while (!allLocked) loop
+  
+  if (debug) {
+    cout << "left allLocked loop with " << superpixels.size() << " merged superpixels" << endl;
+  }
+  
+  return;
+}
+
+// Max heap of superpixel tags ordered by size with ties going to the smaller tag,
+// the same order as sortSuperpixelsBySize(). Entries are invalidated lazily, a
+// tag that was merged away or locked after it was pushed is skipped when it
+// reaches the top, and a tag that grew is pushed again with the new size. Only
+// the expanding superpixel grows while it is the largest one, so popping the
+// next unlocked superpixel does not scan or sort the superpixels again.
+
+class SuperpixelSizeQueue {
+public:
+  void push(SuperpixelImage &spImage, int32_t tag) {
+    Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+    
+    if (spPtr != NULL) {
+      heap.push(make_pair((int32_t) spPtr->coords.size(), -tag));
+    }
+  }
+  
+  void pushAll(SuperpixelImage &spImage) {
+    for ( int32_t tag : spImage.superpixels ) {
+      push(spImage, tag);
+    }
+  }
+  
+  // Returns -1 once all the superpixels are locked or merged away
+  
+  int32_t popLargest(SuperpixelImage &spImage, const SuperpixelTagBitset &locked) {
+    while (!heap.empty()) {
+      pair<int32_t, int32_t> top = heap.top();
+      heap.pop();
+      
+      int32_t tag = -top.second;
+      
+      if (locked.contains(tag)) {
+        continue;
+      }
+      
+      Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+      
+      if (spPtr == NULL) {
+        continue;
+      }
+      
+      if ((int32_t) spPtr->coords.size() != top.first) {
+        push(spImage, tag);
+        continue;
+      }
+      
+      return tag;
+    }
     
-  } // end of while (!allLocked) loop
-  
-  if (debug) {
-    cout << "left allLocked loop with " << superpixels.size() << " merged superpixels" << endl;
+    return -1;
   }
   
-  return;
-}
+private:
+  priority_queue<pair<int32_t, int32_t> > heap;
+};
 
 // Bredth first merge approach where the largest superpixel merges the next N neighbor
 // superpixels that are of equal sameness as determined by a backproject fill on the
@@ -1146,7 +1494,7 @@ void MergeSuperpixelImage::mergeAlikeSuperpixels(Mat &inputImg)
 
 int MergeSuperpixelImage::mergeBackprojectSuperpixels(SuperpixelImage &spImage, Mat &inputImg, int colorspace, int startStep, BackprojectRange range)
 {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   const bool dumpEachMergeStepImage = false;
   
   // Each iteration will examine the list of superpixels and pick the biggest one
@@ -1163,74 +1511,24 @@ int MergeSuperpixelImage::mergeBackprojectSuperpixels(SuperpixelImage &spImage,
   int numLockClear = 0;
   unordered_map<int32_t, bool> mergesSinceLockClear;
   
-  unordered_map<int32_t, bool> locked;
+  SuperpixelTagBitset locked;
   
-  // Do initial sort of the superpixels list so that superpixels are ordered by
-  // the number of coordinates in the superpixel. While the sort takes time
-  // it means that looking for the largest superpixel can be done by simply
-  // finding the next superpixel since superpixels will always be processed
-  // from largest to smallest.
+  // Superpixels are processed from largest to smallest, the size queue is
+  // filled once and then only the superpixels unlocked by a lock clear are
+  // pushed again.
   
-  vector<int32_t> sortedSuperpixels = spImage.sortSuperpixelsBySize();
+  SuperpixelSizeQueue sizeQueue;
+  sizeQueue.pushAll(spImage);
   
-  auto spIter = sortedSuperpixels.begin();
   int32_t maxTag = -1;
   
   while (!done) {
-    // Get the next superpixel, it will be LTEQ the size of the current superpixel since
-    // the superpixels list was sorted and then only deletes would happen via a merge.
-
-#if defined(DEBUG)
-    if (spIter != sortedSuperpixels.begin() && spIter != sortedSuperpixels.end()) {
-      spIter--;
-      int prevTag = *spIter;
-      spIter++;
-      assert(maxTag == prevTag);
-    }
-#endif // DEBUG
+    maxTag = sizeQueue.popLargest(spImage, locked);
     
-    if (spIter == sortedSuperpixels.end()) {
-      // At end of superpixels list
-      maxTag = -1;
-    } else {
-      // Find next unlocked superpixel
-
-      maxTag = -1;
-      while (spIter != sortedSuperpixels.end()) {
-        int32_t nextTag = *spIter;
-        
-        Superpixel *spPtr = spImage.getSuperpixelPtr(nextTag);
-        
-        if (spPtr == NULL) {
-          locked[nextTag] = true;
-        }
-        
-        if (debug) {
-          if (spPtr != NULL) {
-            int numCoords = (int) spPtr->coords.size();
-            cout << "next max superpixel " << nextTag << " N = " << numCoords << endl;
-          }
-        }
-        
-        spIter++;
-        
-        if (locked[nextTag]) {
-          if (debug) {
-            cout << "next max superpixel locked" << endl;
-          }
-        } else {
-          // Not locked, use it now
-          maxTag = nextTag;
-          break;
-        }
-      }
-      
-#if defined(DEBUG)
-      if (maxTag != -1) {
-        bool isLocked = locked[maxTag];
-        assert(isLocked == false);
-      }
-#endif // DEBUG
+    if (debug && maxTag != -1) {
+      Superpixel *spPtr = spImage.getSuperpixelPtr(maxTag);
+      int numCoords = (int) spPtr->coords.size();
+      cout << "next max superpixel " << maxTag << " N = " << numCoords << endl;
     }
     
     if (maxTag == -1) {
@@ -1239,7 +1537,7 @@ int MergeSuperpixelImage::mergeBackprojectSuperpixels(SuperpixelImage &spImage,
       }
       
       if (debug) {
-        cout << "found that all superpixels are locked with " << sortedSuperpixels.size() << " superpixels" << endl;
+        cout << "found that all superpixels are locked with " << spImage.superpixels.size() << " superpixels" << endl;
         cout << "mergesSinceLockClear.size() " << mergesSinceLockClear.size() << " numLockClear " << numLockClear << endl;
       }
       
@@ -1255,26 +1553,26 @@ int MergeSuperpixelImage::mergeBackprojectSuperpixels(SuperpixelImage &spImage,
       for (auto it = mergesSinceLockClear.begin(); it != mergesSinceLockClear.end(); ++it) {
         int32_t merged = it->first;
 
-        if (locked.count(merged) == 0) {
+        if (!locked.contains(merged)) {
           if (debug) {
             cout << "expanded superpixel has no lock entry to erase (it was merged into another superpixel) " << merged << endl;
           }
         } else {
           if (debug) {
-            int sizeBefore = (int) locked.size();
+            int sizeBefore = locked.count;
             cout << "erase expanded superpixel lock " << merged << endl;
             locked.erase(merged);
-            int sizeAfter = (int) locked.size();
+            int sizeAfter = locked.count;
             assert(sizeBefore == sizeAfter+1);
           } else {
             locked.erase(merged);
           }
         }
+        
+        sizeQueue.push(spImage, merged);
       }
       
       mergesSinceLockClear.clear();
-      sortedSuperpixels = spImage.sortSuperpixelsBySize();
-      spIter = sortedSuperpixels.begin();
       numLockClear++;
       continue;
     }
@@ -1309,17 +1607,17 @@ int MergeSuperpixelImage::mergeBackprojectSuperpixels(SuperpixelImage &spImage,
       vector<CompareNeighborTuple> resultTuples;
       
       if (range == BACKPROJECT_HIGH_FIVE) {
-        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 1, false, 200, 16);
+        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 1, false, 200, 16, true);
       } else if (range == BACKPROJECT_HIGH_FIVE8) {
-        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 2, false, 200, 8);
+        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 2, false, 200, 8, true);
       } else if (range == BACKPROJECT_HIGH_TEN) {
-        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 2, false, 200, 16);
+        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 2, false, 200, 16, true);
       } else if (range == BACKPROJECT_HIGH_15) {
-        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 3, false, 200, 16);
+        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 3, false, 200, 16, true);
       } else if (range == BACKPROJECT_HIGH_20) {
-        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 4, false, 200, 16);
+        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 4, false, 200, 16, true);
       } else if (range == BACKPROJECT_HIGH_50) {
-        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 10, false, 128, 8);
+        backprojectNeighborSuperpixels(spImage, inputImg, maxTag, resultTuples, &locked, mergeIter, colorspace, 20, 10, false, 128, 8, true);
       } else {
         assert(0);
       }
@@ -1333,7 +1631,7 @@ int MergeSuperpixelImage::mergeBackprojectSuperpixels(SuperpixelImage &spImage,
           cout << "no alike or unlocked neighbors so marking this superpixel as locked also" << endl;
         }
         
-        locked[maxTag] = true;
+        locked.insert(maxTag);
         break;
       }
       
@@ -1370,7 +1668,7 @@ int MergeSuperpixelImage::mergeBackprojectSuperpixels(SuperpixelImage &spImage,
           std::string str = stringStream.str();
           const char *filename = str.c_str();
           
-          imwrite(filename, resultImg);
+          debugImwrite(filename, resultImg);
           
           cout << "wrote " << filename << endl;
         }
@@ -1432,7 +1730,7 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
   int numLockClear = 0;
   unordered_map<int32_t, bool> mergesSinceLockClear;
   
-  unordered_map<int32_t, bool> locked;
+  SuperpixelTagBitset locked;
   
   // Lock each very large superpixel so that the BFS will expand outward towards the
   // largest superpixels but it will not merge contained superpixels into the existing
@@ -1440,7 +1738,7 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
   
   for (auto it = largeSuperpixels.begin(); it != largeSuperpixels.end(); ++it) {
     int32_t tag = *it;
-    locked[tag] = true;
+    locked.insert(tag);
   }
   
   if (dumpLockedSuperpixels) {
@@ -1465,8 +1763,8 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
     
     // Use mask to copy colortable image values for just the locked superpixels
     
-    //imwrite("tags_colortable_before_mask.png", outputTagsImg);
-    //imwrite("locked_mask.png", lockedSuperpixelsMask);
+    //debugImwrite("tags_colortable_before_mask.png", outputTagsImg);
+    //debugImwrite("locked_mask.png", lockedSuperpixelsMask);
     
     Mat maskedOutput;
     
@@ -1477,70 +1775,26 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
     std::string str = stringStream.str();
     const char *filename = str.c_str();
     
-    imwrite(filename, maskedOutput);
+    debugImwrite(filename, maskedOutput);
     
     cout << "wrote " << filename << endl;
   }
   
-  // Do initial sort of the superpixels list so that superpixels are ordered by
-  // the number of coordinates in the superpixel. While the sort takes time
-  // it means that looking for the largest superpixel can be done by simply
-  // finding the next superpixel since superpixels will always be processed
-  // from largest to smallest.
+  // Superpixels are processed from largest to smallest, the size queue skips
+  // the superpixels that were locked or merged away since they were pushed.
   
-  vector<int32_t> sortedSuperpixels = sortSuperpixelsBySize();
+  SuperpixelSizeQueue sizeQueue;
+  sizeQueue.pushAll(*this);
   
-  auto spIter = sortedSuperpixels.begin();
   int32_t maxTag = -1;
   
   while (!done) {
-    // Get the next superpixel, it will be LTEQ the size of the current superpixel since
-    // the superpixels list was sorted and then only deletes would happen via a merge.
-    
-#if defined(DEBUG)
-    if (spIter != sortedSuperpixels.begin() && spIter != sortedSuperpixels.end()) {
-      spIter--;
-      int prevTag = *spIter;
-      spIter++;
-      assert(maxTag == prevTag);
-    }
-#endif // DEBUG
+    maxTag = sizeQueue.popLargest(*this, locked);
     
-    if (spIter == sortedSuperpixels.end()) {
-      // At end of superpixels list
-      maxTag = -1;
-    } else {
-      // Find next unlocked superpixel
-      
-      maxTag = -1;
-      while (spIter != sortedSuperpixels.end()) {
-        int32_t nextTag = *spIter;
-        
-        if (debug) {
-          Superpixel *spPtr = getSuperpixelPtr(nextTag);
-          int numCoords = (int) spPtr->coords.size();
-          cout << "next max superpixel " << nextTag << " N = " << numCoords << endl;
-        }
-        
-        spIter++;
-        
-        if (locked[nextTag]) {
-          if (debug) {
-            cout << "next max superpixel locked" << endl;
-          }
-        } else {
-          // Not locked, use it now
-          maxTag = nextTag;
-          break;
-        }
-      }
-      
-#if defined(DEBUG)
-      if (maxTag != -1) {
-        bool isLocked = locked[maxTag];
-        assert(isLocked == false);
-      }
-#endif // DEBUG
+    if (debug && maxTag != -1) {
+      Superpixel *spPtr = getSuperpixelPtr(maxTag);
+      int numCoords = (int) spPtr->coords.size();
+      cout << "next max superpixel " << maxTag << " N = " << numCoords << endl;
     }
     
     if (maxTag == -1) {
@@ -1577,26 +1831,26 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
       for (auto it = mergesSinceLockClear.begin(); it != mergesSinceLockClear.end(); ++it) {
         int32_t merged = it->first;
         
-        if (locked.count(merged) == 0) {
+        if (!locked.contains(merged)) {
           if (debug) {
             cout << "expanded superpixel has no lock entry to erase (it was merged into another superpixel) " << merged << endl;
           }
         } else {
           if (debug) {
-            int sizeBefore = (int) locked.size();
+            int sizeBefore = locked.count;
             cout << "erase expanded superpixel lock " << merged << endl;
             locked.erase(merged);
-            int sizeAfter = (int) locked.size();
+            int sizeAfter = locked.count;
             assert(sizeBefore == sizeAfter+1);
           } else {
             locked.erase(merged);
           }
         }
+        
+        sizeQueue.push(*this, merged);
       }
       
       mergesSinceLockClear.clear();
-      sortedSuperpixels = sortSuperpixelsBySize();
-      spIter = sortedSuperpixels.begin();
       numLockClear++;
       continue;
     }
@@ -1700,7 +1954,7 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
           SuperpixelEdgeFuncs::addUnmergedEdgeWeights(*this, maxTag, unmergedEdgeWeights);
         }
         
-        locked[maxTag] = true;
+        locked.insert(maxTag);
         break;
       }
       
@@ -1940,7 +2194,7 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
             
             unmergedEdgeWeights.push_back(edgeWeight);
               
-            locked[maxTag] = true;
+            locked.insert(maxTag);
             
             continue;
           }
@@ -1975,7 +2229,7 @@ int MergeSuperpixelImage::mergeBredthFirstRecursive(Mat &inputImg, int colorspac
             std::string str = stringStream.str();
             const char *filename = str.c_str();
             
-            imwrite(filename, resultImg);
+            debugImwrite(filename, resultImg);
             
             cout << "wrote " << filename << endl;
           }
@@ -2025,7 +2279,7 @@ int MergeSuperpixelImage::mergeBackprojectSmallestSuperpixels(Mat &inputImg, int
   int numLockClear = 0;
   unordered_map<int32_t, bool> mergesSinceLockClear;
   
-  unordered_map<int32_t, bool> locked;
+  SuperpixelTagBitset locked;
 
   // The largest superpixel in the entire list of superpixels is stored
   // so that the smaller inner pixels do not merge with the largest one.
@@ -2055,7 +2309,7 @@ int MergeSuperpixelImage::mergeBackprojectSmallestSuperpixels(Mat &inputImg, int
         maxTag = tag;
       }
       
-      if (numCoords < minThisIter && (locked.count(tag) == 0)) {
+      if (numCoords < minThisIter && !locked.contains(tag)) {
         minThisIter = numCoords;
         minTag = tag;
       }
@@ -2085,16 +2339,16 @@ int MergeSuperpixelImage::mergeBackprojectSmallestSuperpixels(Mat &inputImg, int
       for (auto it = mergesSinceLockClear.begin(); it != mergesSinceLockClear.end(); ++it) {
         int32_t merged = it->first;
         
-        if (locked.count(merged) == 0) {
+        if (!locked.contains(merged)) {
           if (debug) {
             cout << "expanded superpixel has no lock entry to erase (it was merged into another superpixel) " << merged << endl;
           }
         } else {
           if (debug) {
-            int sizeBefore = (int) locked.size();
+            int sizeBefore = locked.count;
             cout << "erase expanded superpixel lock " << merged << endl;
             locked.erase(merged);
-            int sizeAfter = (int) locked.size();
+            int sizeAfter = locked.count;
             assert(sizeBefore == sizeAfter+1);
           } else {
             locked.erase(merged);
@@ -2113,7 +2367,7 @@ int MergeSuperpixelImage::mergeBackprojectSmallestSuperpixels(Mat &inputImg, int
     
     if (doLockMaxTag) {
       // Do not let the search compare to the max tag since it contains a lot of pixels (typically the BG)
-      locked[maxTag] = true;
+      locked.insert(maxTag);
       doLockMaxTag = false;
     }
     
@@ -2124,7 +2378,7 @@ int MergeSuperpixelImage::mergeBackprojectSmallestSuperpixels(Mat &inputImg, int
     
     // FIMME: only loop once since smallest will be merged into larger (or possible a tie)
     
-    while ((locked.count(minTag) == 0) && (getSuperpixelPtr(minTag) != NULL)) {
+    while (!locked.contains(minTag) && (getSuperpixelPtr(minTag) != NULL)) {
       if (debug) {
         cout << "start iter step " << mergeIter << endl;
       }
@@ -2166,7 +2420,7 @@ int MergeSuperpixelImage::mergeBackprojectSmallestSuperpixels(Mat &inputImg, int
           cout << "no alike or unlocked neighbors so marking this superpixel as locked also" << endl;
         }
         
-        locked[minTag] = true;
+        locked.insert(minTag);
         break;
       }
       
@@ -2202,7 +2456,7 @@ int MergeSuperpixelImage::mergeBackprojectSmallestSuperpixels(Mat &inputImg, int
           std::string str = stringStream.str();
           const char *filename = str.c_str();
           
-          imwrite(filename, resultImg);
+          debugImwrite(filename, resultImg);
           
           cout << "wrote " << filename << endl;
         }
@@ -2259,34 +2513,21 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
   int numLockClear = 0;
   unordered_map<int32_t, bool> mergesSinceLockClear;
   
-  unordered_map<int32_t, bool> locked;
+  SuperpixelTagBitset locked;
+  
+  // Each superpixel is filled from once and then locked, so the size queue
+  // hands out the largest unlocked superpixel without a scan of all the
+  // superpixels for each fill.
+  
+  SuperpixelSizeQueue sizeQueue;
+  sizeQueue.pushAll(*this);
   
   while (!done) {
-    
-    int maxThisIter = -1;
-    int numChecked = 0;
-    int32_t maxTag = -1;
-    
-    for (auto it = superpixels.begin(); it != superpixels.end(); ++it) {
-      int32_t tag = *it;
-      
-      Superpixel *spPtr = getSuperpixelPtr(tag);
-      
-      auto &coords = spPtr->coords;
-      
-      int numCoords = (int) coords.size();
-      
-      if (numCoords > maxThisIter && (locked.count(tag) == 0)) {
-        maxThisIter = numCoords;
-        maxTag = tag;
-      }
-      
-      numChecked++;
-    }
+    int32_t maxTag = sizeQueue.popLargest(*this, locked);
     
     if (maxTag == -1) {
       if (debug) {
-        cout << "checked " << numChecked << " superpixels but all were locked" << endl;
+        cout << "checked superpixels but all were locked" << endl;
       }
       
       if (debug) {
@@ -2314,16 +2555,16 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
       for (auto it = mergesSinceLockClear.begin(); it != mergesSinceLockClear.end(); ++it) {
         int32_t merged = it->first;
         
-        if (locked.count(merged) == 0) {
+        if (!locked.contains(merged)) {
           if (debug) {
             cout << "expanded superpixel has no lock entry to erase (it was merged into another superpixel) " << merged << endl;
           }
         } else {
           if (debug) {
-            int sizeBefore = (int) locked.size();
+            int sizeBefore = locked.count;
             cout << "erase expanded superpixel lock " << merged << endl;
             locked.erase(merged);
-            int sizeAfter = (int) locked.size();
+            int sizeAfter = locked.count;
             assert(sizeBefore == sizeAfter+1);
           } else {
             locked.erase(merged);
@@ -2337,7 +2578,7 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
     }
     
     if (debug) {
-      cout << "checked " << numChecked << " superpixels and found largest superpixel " << maxTag << " with N=" << maxThisIter << " pixels" << endl;
+      cout << "found largest superpixel " << maxTag << " with N=" << getSuperpixelPtr(maxTag)->coords.size() << " pixels" << endl;
     }
     
     // Since this superpixel is the largest one currently, merging with another superpixel will always increase the size
@@ -2345,7 +2586,7 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
     // superpixel, so this approach of using the largest superpixel means that smaller superpixel will always be merged
     // into the current largest superpixel.
     
-    while ((locked.count(maxTag) == 0)){
+    while (!locked.contains(maxTag)) {
       if (debug) {
         cout << "start iter step " << mergeIter << endl;
       }
@@ -2370,7 +2611,7 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
           cout << "no alike or unlocked neighbors so marking this superpixel as locked also" << endl;
         }
         
-        locked[maxTag] = true;
+        locked.insert(maxTag);
         break;
       }
       
@@ -2406,7 +2647,7 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
           std::string str = stringStream.str();
           const char *filename = str.c_str();
           
-          imwrite(filename, resultImg);
+          debugImwrite(filename, resultImg);
           
           cout << "wrote " << filename << endl;
         }
@@ -2416,7 +2657,7 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
         cout << "done with merge of " << results.size() << " edges" << endl;
       }
       
-      locked[maxTag] = true;
+      locked.insert(maxTag);
       
     } // end of while not locked loop
     
@@ -2429,33 +2670,27 @@ int MergeSuperpixelImage::fillMergeBackprojectSuperpixels(Mat &inputImg, int col
   return mergeIter;
 }
 
-// Given a superpixel uid scan the neighbors list and generate a stddev to determine if any of the neighbors
-// is significantly larger than other neighbors. Return a vector that contains the large neighbors.
+// Gather the neighbors of a superpixel and the number of coords of each, sorted
+// by decreasing number of coords. The sizes are read once here so that the
+// callers can scan the ranking without looking the neighbors up again.
 
-void MergeSuperpixelImage::filterOutVeryLargeNeighbors(int32_t tag, vector<int32_t> &largeNeighbors)
+void MergeSuperpixelImage::rankNeighborsBySize(int32_t tag, vector<int32_t> &neighborTags, vector<float> &neighborSizes)
 {
-  const bool debug = false;
+  neighborTags.clear();
+  neighborSizes.clear();
   
-  if (debug) {
-    cout << "filterOutVeryLargeNeighbors for superpixel " << tag << endl;
-  }
-  
-  largeNeighbors.clear();
-
   vector<CompareNeighborTuple> tuples;
   
-  for ( int32_t neighborTag : edgeTable.getNeighborsSet(tag) ) {
+  SuperpixelNeighbors &neighbors = edgeTable.getNeighborsSet(tag);
+  
+  tuples.reserve(neighbors.size());
+  
+  for ( int32_t neighborTag : neighbors ) {
     Superpixel *spPtr = getSuperpixelPtr(neighborTag);
     assert(spPtr);
     
     int32_t numCoords = (int32_t) spPtr->coords.size();
     
-    if (debug) {
-      char buffer[1024];
-      snprintf(buffer, sizeof(buffer), "neighbor %10d has N = %10d coords", neighborTag, numCoords);
-      cout << (char*)buffer << endl;
-    }
-    
     // Tuple: (UNUSED, UID, SIZE)
     
     CompareNeighborTuple tuple(0.0f, neighborTag, numCoords);
@@ -2466,60 +2701,73 @@ void MergeSuperpixelImage::filterOutVeryLargeNeighbors(int32_t tag, vector<int32
     sort(tuples.begin(), tuples.end(), CompareNeighborTupleSortByDecreasingLargestNumCoordsFunc);
   }
   
+  neighborTags.reserve(tuples.size());
+  neighborSizes.reserve(tuples.size());
+  
+  for ( CompareNeighborTuple &tuple : tuples ) {
+    neighborTags.push_back(get<1>(tuple));
+    neighborSizes.push_back((float) get<2>(tuple));
+  }
+}
+
+// Given a superpixel uid scan the neighbors list and generate a stddev to determine if any of the neighbors
+// is significantly larger than other neighbors. Return a vector that contains the large neighbors.
+
+void MergeSuperpixelImage::filterOutVeryLargeNeighbors(int32_t tag, vector<int32_t> &largeNeighbors)
+{
+  const bool debug = false;
+  
+  if (debug) {
+    cout << "filterOutVeryLargeNeighbors for superpixel " << tag << endl;
+  }
+  
+  largeNeighbors.clear();
+  
+  vector<int32_t> neighborTags;
+  vector<float> sizesVec;
+  
+  rankNeighborsBySize(tag, neighborTags, sizesVec);
+  
   // Sorted results are now in decreasing num coords order
 
   if (debug) {
     char buffer[1024];
     
-    cout << "sorted tuples:" << endl;
+    cout << "sorted neighbors:" << endl;
     
-    for (auto it = tuples.begin(); it != tuples.end(); ++it) {
-      CompareNeighborTuple tuple = *it;
-      snprintf(buffer, sizeof(buffer), "neighbor %10d has N = %10d coords", get<1>(tuple), get<2>(tuple));
+    for (int i = 0; i < (int) neighborTags.size(); i++) {
+      snprintf(buffer, sizeof(buffer), "neighbor %10d has N = %10d coords", neighborTags[i], (int) sizesVec[i]);
       cout << (char*)buffer << endl;
     }
   }
-
-  vector<float> sizesVec;
   
-  while (1) {
-    // If there is only 1 element left in the tuples at this point, break right away since
+  // Each large neighbor is removed from the front of the ranking by moving the
+  // start offset, the stddev is then run on the sizes that remain.
+  
+  const int numNeighbors = (int) sizesVec.size();
+  
+  int first = 0;
+  
+  while (first < numNeighbors) {
+    // If there is only 1 element left at this point, break right away since
     // there is no need to run stddev on one element.
     
-    if (tuples.size() == 1) {
+    const int numLeft = numNeighbors - first;
+    
+    if (numLeft == 1) {
       if (debug) {
-        cout << "exit stddev loop since only 1 tuple left" << endl;
+        cout << "exit stddev loop since only 1 neighbor left" << endl;
       }
       
       break;
     }
     
     float mean, stddev;
-  
-    sizesVec.clear();
-    
-    for (auto it = tuples.begin(); it != tuples.end(); ++it) {
-      CompareNeighborTuple tuple = *it;
-      int numCoords = get<2>(tuple);
-      sizesVec.push_back((float)numCoords);
-    }
-    
-    if (debug) {
-      char buffer[1024];
-      
-      cout << "stddev on " << tuples.size() << " tuples:" << endl;
-      
-      for (auto it = tuples.begin(); it != tuples.end(); ++it) {
-        CompareNeighborTuple tuple = *it;
-        snprintf(buffer, sizeof(buffer), "neighbor %10d has N = %10d coords", get<1>(tuple), get<2>(tuple));
-        cout << (char*)buffer << endl;
-      }
-    }
     
-    sample_mean(sizesVec, &mean);
-    sample_mean_delta_squared_div(sizesVec, mean, &stddev);
+    sample_mean(&sizesVec[first], numLeft, &mean);
+    sample_mean_delta_squared_div(&sizesVec[first], numLeft, mean, &stddev);
   
-    int32_t maxSize = sizesVec[0];
+    int32_t maxSize = sizesVec[first];
     
     // Larger than 1/2 stddev indicates size is larger than 68% of all others
     
@@ -2539,7 +2787,7 @@ void MergeSuperpixelImage::filterOutVeryLargeNeighbors(int32_t tag, vector<int32
     
     if (debug) {
       char buffer[1024];
-      snprintf(buffer, sizeof(buffer), "mean      %10.2f, stddev %10.2f", mean, stddev);
+      snprintf(buffer, sizeof(buffer), "stddev on %d neighbors, mean %10.2f, stddev %10.2f", numLeft, mean, stddev);
       cout << (char*)buffer << endl;
       
       snprintf(buffer, sizeof(buffer), "stddevMin %10.2f, max N  %10d", stddevMin, maxSize);
@@ -2548,16 +2796,14 @@ void MergeSuperpixelImage::filterOutVeryLargeNeighbors(int32_t tag, vector<int32
     
     if (maxSize > stddevMin) {
       // The current largest neighbor size is significantly larger than the others, ignore it by
-      // removing the first element from the tuples vector.
+      // moving past it in the ranking.
       
-      CompareNeighborTuple tuple = tuples[0];
-      int32_t neighborTag = get<1>(tuple);
-      largeNeighbors.push_back(neighborTag);
+      largeNeighbors.push_back(neighborTags[first]);
       
-      tuples.erase(tuples.begin());
+      first += 1;
       
       if (debug) {
-        cout << "erased first element in tuples, size now " << tuples.size() << endl;
+        cout << "skipped largest neighbor, " << (numNeighbors - first) << " neighbors left" << endl;
       }
       
     } else {
@@ -2801,7 +3047,7 @@ int MergeSuperpixelImage::mergeEdgySuperpixels(Mat &inputImg, int colorspace, in
       continue;
     }
     
-    set<int32_t> &neighbors = edgeTable.getNeighborsSet(tag);
+    SuperpixelNeighbors &neighbors = edgeTable.getNeighborsSet(tag);
     
     // FIXME: might be better to remove this contained in one superpixel check.
     
@@ -2839,14 +3085,14 @@ int MergeSuperpixelImage::mergeEdgySuperpixels(Mat &inputImg, int colorspace, in
       vector<Coord> edgeCoordsSrc;
       vector<Coord> edgeCoordsDst;
       
-      Superpixel::filterEdgeCoords(spPtr, edgeCoordsSrc, neighborPtr, edgeCoordsDst);
+      filterEdgeCoords(tag, edgeCoordsSrc, neighborTag, edgeCoordsDst);
       
       for (auto coordsIter = edgeCoordsSrc.begin(); coordsIter != edgeCoordsSrc.end(); ++coordsIter) {
         Coord coord = *coordsIter;
         edgeCoordsVec.push_back(coord);
       }
       
-      int32_t numNeighborCoords = (int32_t) spPtr->coords.size();
+      int32_t numNeighborCoords = (int32_t) neighborPtr->coords.size();
       int32_t numSrcEdgeCoords = (int32_t) edgeCoordsSrc.size();
       
       float per = numSrcEdgeCoords / ((float) numSrcCoords);
@@ -2904,7 +3150,7 @@ int MergeSuperpixelImage::mergeEdgySuperpixels(Mat &inputImg, int colorspace, in
       }
       
       cout << "write " << filename << " ( " << edgeGrayValues.cols << " x " << edgeGrayValues.rows << " )" << endl;
-      imwrite(filename, edgeGrayValues);
+      debugImwrite(filename, edgeGrayValues);
     }
     
     if (per > 0.90f) {
@@ -2934,7 +3180,7 @@ int MergeSuperpixelImage::mergeEdgySuperpixels(Mat &inputImg, int colorspace, in
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << edgyMat.cols << " x " << edgyMat.rows << " )" << endl;
-      imwrite(filename, edgyMat);
+      debugImwrite(filename, edgyMat);
     }
   }
   
@@ -3053,7 +3299,7 @@ int MergeSuperpixelImage::mergeEdgySuperpixels(Mat &inputImg, int colorspace, in
         std::string str = stringStream.str();
         const char *filename = str.c_str();
         
-        imwrite(filename, resultImg);
+        debugImwrite(filename, resultImg);
         
         cout << "wrote " << filename << endl;
       }
@@ -3106,12 +3352,18 @@ int MergeSuperpixelImage::mergeEdgySuperpixels(Mat &inputImg, int colorspace, in
 // Iterate over superpixels starting from (0,0) and generate a "touching table" that
 // maps superpixel UIDs to unique but small numerical values that should require
 // less space to store as compared to a raw tags file.
+//
+// The neighbors of a superpixel that do not have a value yet get the smallest
+// value not used by the superpixel or its neighbors that already have a value, and
+// the neighbors are then visited depth first. The walk is done with an explicit
+// stack and a dense value per tag so that a large connected group neither recurses
+// deeply nor rehashes touchingTable as it grows.
 
 void MergeSuperpixelImage::recurseTouchingSuperpixels(int32_t rootUID,
                                                  int32_t rootValue,
                                                  unordered_map<int32_t, int32_t> &touchingTable)
 {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
   if (debug) {
     cout << "recurseTouchingSuperpixels(" << rootUID << ", " << rootValue << ") with " << touchingTable.size() << " table entries" << endl;
@@ -3122,141 +3374,198 @@ void MergeSuperpixelImage::recurseTouchingSuperpixels(int32_t rootUID,
   Superpixel *rootPtr = getSuperpixelPtr(rootUID);
   assert(rootPtr);
   
-  touchingTable[rootUID] = rootValue;
-  
-  // Iterate over all neighbors and generate a list of
-  // neighbors that already have a mapping. Then select
-  // the next lowest number that is not currently used.
+  // Value of each tag up to the largest superpixel tag, -1 when not set
   
-  vector<int32_t> neighbors = edgeTable.getNeighbors(rootUID);
+  const int32_t maxTag = *superpixels.rbegin();
   
-  vector<CompareNeighborTuple> alreadyInTouchingEntry;
-  vector<CompareNeighborTuple> needsTouchingEntry;
+  vector<int32_t> tagValues(maxTag + 1, -1);
   
-  {
-    CompareNeighborTuple tuple(1.0, rootUID, rootValue);
-    alreadyInTouchingEntry.push_back(tuple);
+  for ( auto &pair : touchingTable ) {
+    if (pair.first >= 0 && pair.first <= maxTag) {
+      tagValues[pair.first] = pair.second;
+    }
   }
   
-  for (auto it = begin(neighbors); it != end(neighbors); ++it) {
-    int32_t neighborTag = *it;
+  // Each frame is a superpixel whose neighbors children[childrenStart, childrenEnd)
+  // are visited with childValue unless a deeper frame got to them first.
+  
+  typedef struct {
+    size_t childrenStart;
+    size_t childrenEnd;
+    size_t nextChild;
+    int32_t childValue;
+  } TouchingFrame;
+  
+  vector<TouchingFrame> frames;
+  vector<int32_t> children;
+  vector<int32_t> visitedTags;
+  vector<int32_t> usedValues;
+  
+  auto visitFunc = [&](int32_t tag, int32_t value)->void {
+    tagValues[tag] = value;
+    visitedTags.push_back(tag);
     
-    if (debug) {
-      cout << "checking neighbor " << neighborTag << endl;
+    const size_t childrenStart = children.size();
+    
+    usedValues.clear();
+    usedValues.push_back(value);
+    
+    for ( int32_t neighborTag : edgeTable.getNeighborsRange(tag) ) {
+      if (tagValues[neighborTag] >= 0) {
+        usedValues.push_back(tagValues[neighborTag]);
+      } else {
+        children.push_back(neighborTag);
+      }
     }
     
-    if (touchingTable.count(neighborTag) > 0) {
-      CompareNeighborTuple tuple(1.0, neighborTag, touchingTable[neighborTag]);
-      alreadyInTouchingEntry.push_back(tuple);
-    } else {
-      CompareNeighborTuple tuple(0.0, neighborTag, -1);
-      needsTouchingEntry.push_back(tuple);
+    if (children.size() == childrenStart) {
+      return;
     }
-  }
-  
-  // Sort alreadyInTouchingEntry so that N unused by neighbors ids
-  // can be determined.
-  
-  if (debug) {
-    cout << "sorted alreadyInTouchingEntry: " << endl;
     
-    sort(begin(alreadyInTouchingEntry), end(alreadyInTouchingEntry),
-         [](CompareNeighborTuple const &t1, CompareNeighborTuple const &t2) {
-           return get<2>(t1) < get<2>(t2); // sort ascending
-         });
+    // Next smallest value not used by this superpixel or a neighbor
     
-    for (auto it = begin(alreadyInTouchingEntry); it != end(alreadyInTouchingEntry); ++it) {
-      CompareNeighborTuple tuple = *it;
-      
-      if (debug) {
-        cout << get<1>(tuple) << " -> " << get<2>(tuple) << endl;
+    sort(begin(usedValues), end(usedValues));
+    
+    int32_t childValue = 0;
+    
+    for ( int32_t usedValue : usedValues ) {
+      if (usedValue == childValue) {
+        childValue += 1;
+      } else if (usedValue > childValue) {
+        break;
       }
     }
     
-    cout << "num needsTouchingEntry " << needsTouchingEntry.size() << endl;
+    if (debug) {
+      cout << "superpixel " << tag << " -> " << value << " assigns " << childValue << " to " << (children.size() - childrenStart) << " neighbors" << endl;
+    }
+    
+    TouchingFrame frame;
+    frame.childrenStart = childrenStart;
+    frame.childrenEnd = children.size();
+    frame.nextChild = childrenStart;
+    frame.childValue = childValue;
+    frames.push_back(frame);
+  };
+  
+  visitFunc(rootUID, rootValue);
+  
+  while (!frames.empty()) {
+    TouchingFrame &frame = frames.back();
+    
+    if (frame.nextChild == frame.childrenEnd) {
+      children.resize(frame.childrenStart);
+      frames.pop_back();
+      continue;
+    }
+    
+    int32_t childTag = children[frame.nextChild++];
+    
+    if (tagValues[childTag] == -1) {
+      visitFunc(childTag, frame.childValue);
+    }
   }
   
-  if (needsTouchingEntry.size() == 0) {
-    return;
+  touchingTable.reserve(touchingTable.size() + visitedTags.size());
+  
+  for ( int32_t tag : visitedTags ) {
+    touchingTable[tag] = tagValues[tag];
   }
   
-  unordered_map<int32_t, int32_t> isSet;
+  return;
+}
+
+// Union find root with path halving
+
+static inline
+int32_t touchingGroupsFind(vector<int32_t> &parents, int32_t index)
+{
+  while (parents[index] != index) {
+    parents[index] = parents[parents[index]];
+    index = parents[index];
+  }
+  return index;
+}
+
+int32_t MergeSuperpixelImage::touchingGroups(unordered_map<int32_t, int32_t> &groupTable)
+{
+  groupTable.clear();
   
-  for (auto it = begin(alreadyInTouchingEntry); it != end(alreadyInTouchingEntry); ++it) {
-    CompareNeighborTuple tuple = *it;
-    int32_t uid = get<1>(tuple);
-    int32_t usedNum = get<2>(tuple);
-    assert(usedNum >= 0);
-    isSet[usedNum] = uid;
+  if (superpixels.empty()) {
+    return 0;
   }
   
-  if (debug) {
-    cout << "isSet: " << endl;
-    
-    for (auto it = begin(isSet); it != end(isSet); ++it) {
-      if (debug) {
-        cout << it->first << " -> " << it->second << endl;
+  // Union find over the tags, a root is always the smallest tag in its group
+  
+  const int32_t maxTag = *superpixels.rbegin();
+  
+  vector<int32_t> parents(maxTag + 1);
+  
+  for ( int32_t tag : superpixels ) {
+    parents[tag] = tag;
+  }
+  
+  for ( int32_t tag : superpixels ) {
+    for ( int32_t neighborTag : edgeTable.getNeighborsRange(tag) ) {
+      if (neighborTag < tag) {
+        continue;
+      }
+      
+      int32_t root1 = touchingGroupsFind(parents, tag);
+      int32_t root2 = touchingGroupsFind(parents, neighborTag);
+      
+      if (root1 < root2) {
+        parents[root2] = root1;
+      } else if (root2 < root1) {
+        parents[root1] = root2;
       }
     }
   }
   
-  vector<CompareNeighborTuple> toRecurseTuples;
+  // Groups are numbered in tag order since the tags are sorted and the root
+  // of a group is its smallest tag.
   
-  for (auto it = begin(needsTouchingEntry); it != end(needsTouchingEntry); ++it) {
-    CompareNeighborTuple tuple = *it;
-    
-    if (debug) {
-      cout << "needsTouchingEntry neighbor search " << get<1>(tuple) << endl;
-    }
-   
-    // Get next smallest int not used by a neighbor
+  vector<int32_t> rootGroups(maxTag + 1, -1);
+  
+  int32_t numGroups = 0;
+  
+  groupTable.reserve(superpixels.size());
+  
+  for ( int32_t tag : superpixels ) {
+    int32_t root = touchingGroupsFind(parents, tag);
     
-    for (int32_t i = 0; 1; i++) {
-      if (isSet.count(i) > 0) {
-        // This number is used by a neighbor, continue
-        if (debug) {
-          cout << "i value " << i << " is used by a neighbor" << endl;
-        }
-      } else {
-        if (debug) {
-          cout << "i value " << i << " is unused by a neighbor" << endl;
-        }
-        
-        tuple = CompareNeighborTuple(1.0, get<1>(tuple), i);
-        break;
-      }
+    if (rootGroups[root] == -1) {
+      rootGroups[root] = numGroups++;
     }
     
-    toRecurseTuples.push_back(tuple);
+    groupTable[tag] = rootGroups[root];
   }
+  
+  return numGroups;
+}
 
-  if (debug) {
-    cout << "toRecurseTuples: " << endl;
-    
-    for (auto it = begin(toRecurseTuples); it != end(toRecurseTuples); ++it) {
-      CompareNeighborTuple tuple = *it;
-      
-      if (debug) {
-        cout << get<1>(tuple) << " -> " << get<2>(tuple) << endl;
-      }
-    }
-  }
+int32_t MergeSuperpixelImage::generateTouchingTable(unordered_map<int32_t, int32_t> &touchingTable)
+{
+  touchingTable.clear();
   
-  // Recurse after coordinating int values to use, note that the recursion
-  // could have already processed a specific superpixel so check for that
-  // condition.
+  unordered_map<int32_t, int32_t> groupTable;
   
-  for (auto it = begin(toRecurseTuples); it != end(toRecurseTuples); ++it) {
-    CompareNeighborTuple tuple = *it;
-    
-    int32_t neighborTag = get<1>(tuple);
+  int32_t numGroups = touchingGroups(groupTable);
+  
+  // The first tag of each group is the smallest one
+  
+  vector<bool> groupVisited(numGroups, false);
+  
+  for ( int32_t tag : superpixels ) {
+    int32_t group = groupTable[tag];
     
-    if (touchingTable.count(neighborTag) == 0) {
-      recurseTouchingSuperpixels(neighborTag, get<2>(tuple), touchingTable);
+    if (!groupVisited[group]) {
+      groupVisited[group] = true;
+      recurseTouchingSuperpixels(tag, 0, touchingTable);
     }
   }
   
-  return;
+  return numGroups;
 }
 
 // Generate a 3D histogram and or a 3D back projection with the configured settings.
@@ -3289,7 +3598,7 @@ void parse3DHistogram(Mat *histInputPtr,
   
   int binDim = numBins;
   if (binDim < 0) {
-    binDim = 16;
+    binDim = getDefaultHistogramBinDim();
   }
   
   int sizes[] = {binDim, binDim, binDim};
@@ -3426,6 +3735,34 @@ void parse3DHistogram(Mat *histInputPtr,
   return;
 }
 
+// Back project a histogram returned by parse3DHistogram() over an input image that
+// has already been uploaded as a UMat. calcBackProject() runs on the OpenCL device
+// when it can and falls back to the CPU otherwise, the result is the same as the
+// back projection done by parse3DHistogram() with no conversion.
+
+void parse3DBackProjection(UMat &backProjectInput,
+                           Mat &hist,
+                           Mat &backProjection)
+{
+  assert(backProjectInput.type() == CV_8UC3);
+  assert(hist.dims == 3);
+  
+  vector<UMat> backProjectSrcArr;
+  backProjectSrcArr.push_back(backProjectInput);
+  
+  vector<int> channels = {0, 1, 2};
+  
+  vector<float> ranges = {0, 256, 0, 256, 0, 256};
+  
+  UMat backProjectionUMat;
+  
+  calcBackProject(backProjectSrcArr, channels, hist, backProjectionUMat, ranges, 255.0);
+  
+  backProjectionUMat.copyTo(backProjection);
+  
+  return;
+}
+
 // Given a set of weights that could show positive or negative deltas,
 // calculate a bound and determine if the currentWeight falls within
 // this bound. This method returns true if the expansion of a superpixel
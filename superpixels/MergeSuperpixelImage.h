@@ -14,6 +14,8 @@ using namespace cv;
 
 #include "SuperpixelImage.h"
 
+#include "SuperpixelMergeManager.h"
+
 typedef enum {
   BACKPROJECT_HIGH_FIVE, // top 95% with gray = 200
   BACKPROJECT_HIGH_FIVE8, // top 95% with gray = 200 (8 bins per channel)
@@ -23,6 +25,14 @@ typedef enum {
   BACKPROJECT_HIGH_50,  // top 80% with gray 200
 } BackprojectRange;
 
+// Bins per channel of the 3D histograms of the superpixel compares and back
+// projections when a numBins of -1 is passed, 16 by default. The value is
+// process wide.
+
+void setDefaultHistogramBinDim(int binDim);
+
+int getDefaultHistogramBinDim();
+
 class MergeSuperpixelImage : public SuperpixelImage {
   
   public:
@@ -39,6 +49,14 @@ class MergeSuperpixelImage : public SuperpixelImage {
 
   int fillMergeBackprojectSuperpixels(Mat &inputImg, int colorspace, int startStep);
 
+  // Merge the neighbor pair with the smallest histogram BHATTACHARYYA distance
+  // over the whole image, one pair at a time, until the smallest distance is
+  // larger than maxCost. Edge costs are kept in a min heap and only the edges
+  // of the merged superpixel are recalculated after each merge, so the merge
+  // takes O(E log E) time. Returns the merge step count.
+  
+  int mergeMinCostEdges(Mat &inputImg, double maxCost, int startStep);
+  
   // Merge small superpixels away from the largest neighbor.
   
   int mergeSmallSuperpixels(Mat &inputImg, int colorspace, int startStep);
@@ -55,26 +73,28 @@ class MergeSuperpixelImage : public SuperpixelImage {
                                   unordered_map<int32_t, bool> *lockedTablePtr,
                                   int32_t step);
     
-  // Evaluate backprojection of superpixel to the connected neighbors
+  // Evaluate backprojection of superpixel to the connected neighbors, pass true
+  // for parallel to evaluate the neighbors on multiple threads.
 
   static
   void backprojectNeighborSuperpixels(SuperpixelImage &spImage,
                                       Mat &inputImg,
                                       int32_t tag,
                                       vector<CompareNeighborTuple> &results,
-                                      unordered_map<int32_t, bool> *lockedTablePtr,
+                                      const SuperpixelTagBitset *lockedTablePtr,
                                       int32_t step,
                                       int conversion,
                                       int numPercentRanges,
                                       int numTopPercent,
                                       bool roundPercent,
                                       int minGraylevel,
-                                      int numBins);
+                                      int numBins,
+                                      bool parallel = false);
   
   void backprojectDepthFirstRecurseIntoNeighbors(Mat &inputImg,
                                                  int32_t tag,
                                                  vector<int32_t> &results,
-                                                 unordered_map<int32_t, bool> *lockedTablePtr,
+                                                 const SuperpixelTagBitset *lockedTablePtr,
                                                  int32_t step,
                                                  int conversion,
                                                  int numPercentRanges,
@@ -90,13 +110,31 @@ class MergeSuperpixelImage : public SuperpixelImage {
   
   int mergeBredthFirstRecursive(Mat &inputImg, int colorspace, int startStep, vector<int32_t> *largeSuperpixelsPtr, int numBins);
   
+  // Neighbors of tag and the number of coords of each in decreasing size order
+  
+  void rankNeighborsBySize(int32_t tag, vector<int32_t> &neighborTags, vector<float> &neighborSizes);
+  
   void filterOutVeryLargeNeighbors(int32_t tag, vector<int32_t> &neighbors);
   
   bool shouldMergeEdge(int32_t tag, float edgeWeight);
       
+  // Assign touching values to the superpixels connected to rootUID, see the
+  // impl for how the values are picked.
+  
   void recurseTouchingSuperpixels(int32_t rootUID,
                                   int32_t rootValue,
                                   unordered_map<int32_t, int32_t> &touchingTable);
+  
+  // Map each superpixel tag to the group of superpixels it is connected to through
+  // its edges, in one union find pass over the edges. The groups are numbered from
+  // 0 in the order of the smallest tag of each group, returns the number of groups.
+  
+  int32_t touchingGroups(unordered_map<int32_t, int32_t> &groupTable);
+  
+  // Touching values for every superpixel, each group from touchingGroups() is
+  // walked from its smallest tag with a value of 0. Returns the number of groups.
+  
+  int32_t generateTouchingTable(unordered_map<int32_t, int32_t> &touchingTable);
 
 };
 
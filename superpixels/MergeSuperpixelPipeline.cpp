@@ -0,0 +1,149 @@
+// A merge pipeline runs a declared sequence of MergeSuperpixelImage passes
+
+#include "MergeSuperpixelPipeline.h"
+
+#include <assert.h>
+
+#include <chrono>
+
+void MergeSuperpixelPipeline::addPass(const string &name, MergeSuperpixelPassFunc func, bool stopIfNoMerges)
+{
+  MergeSuperpixelPass pass;
+  pass.name = name;
+  pass.func = func;
+  pass.stopIfNoMerges = stopIfNoMerges;
+  passes.push_back(pass);
+}
+
+void MergeSuperpixelPipeline::addMergeIdenticalPass(bool stopIfNoMerges)
+{
+  addPass("mergeIdenticalSuperpixels", [](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    spImage.mergeIdenticalSuperpixels(inputImg);
+    return mergeStep;
+  }, stopIfNoMerges);
+}
+
+void MergeSuperpixelPipeline::addBackprojectPass(int colorspace, BackprojectRange range, bool stopIfNoMerges)
+{
+  addPass("mergeBackprojectSuperpixels", [colorspace, range](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    return MergeSuperpixelImage::mergeBackprojectSuperpixels(spImage, inputImg, colorspace, mergeStep, range);
+  }, stopIfNoMerges);
+}
+
+void MergeSuperpixelPipeline::addBredthFirstPass(int colorspace, int numBins, bool stopIfNoMerges)
+{
+  addPass("mergeBredthFirstRecursive", [colorspace, numBins](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    return spImage.mergeBredthFirstRecursive(inputImg, colorspace, mergeStep, NULL, numBins);
+  }, stopIfNoMerges);
+}
+
+void MergeSuperpixelPipeline::addFillMergeBackprojectPass(int colorspace, bool stopIfNoMerges)
+{
+  addPass("fillMergeBackprojectSuperpixels", [colorspace](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    return spImage.fillMergeBackprojectSuperpixels(inputImg, colorspace, mergeStep);
+  }, stopIfNoMerges);
+}
+
+void MergeSuperpixelPipeline::addMinCostEdgesPass(double maxCost, bool stopIfNoMerges)
+{
+  addPass("mergeMinCostEdges", [maxCost](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    return spImage.mergeMinCostEdges(inputImg, maxCost, mergeStep);
+  }, stopIfNoMerges);
+}
+
+void MergeSuperpixelPipeline::addMergeSmallPass(int colorspace, bool stopIfNoMerges)
+{
+  addPass("mergeSmallSuperpixels", [colorspace](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    return spImage.mergeSmallSuperpixels(inputImg, colorspace, mergeStep);
+  }, stopIfNoMerges);
+}
+
+void MergeSuperpixelPipeline::addMergeEdgyPass(int colorspace, bool stopIfNoMerges)
+{
+  addPass("mergeEdgySuperpixels", [colorspace](MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep) {
+    return spImage.mergeEdgySuperpixels(inputImg, colorspace, mergeStep, NULL);
+  }, stopIfNoMerges);
+}
+
+// Each merge removes one superpixel, so the number of merges done by a pass is
+// the change in the number of superpixels.
+
+int MergeSuperpixelPipeline::run(MergeSuperpixelImage &spImage, Mat &inputImg, int startStep)
+{
+  const bool debug = false;
+
+  passStats.clear();
+
+  if (setColorStats) {
+    spImage.setColorStats(inputImg);
+  }
+
+  int mergeStep = startStep;
+
+  for ( int round = 0; round < maxRounds; round++ ) {
+    int roundMerges = 0;
+
+    for ( MergeSuperpixelPass &pass : passes ) {
+      int numBefore = (int) spImage.superpixels.size();
+      int stepBefore = mergeStep;
+
+      if (spImage.mergeLog != NULL) {
+        spImage.mergeLog->markPass();
+      }
+
+      auto startTime = std::chrono::steady_clock::now();
+
+      mergeStep = pass.func(spImage, inputImg, mergeStep);
+
+      auto endTime = std::chrono::steady_clock::now();
+
+      MergeSuperpixelPassStats stats;
+      stats.name = pass.name;
+      stats.round = round;
+      stats.numMerges = numBefore - (int) spImage.superpixels.size();
+      stats.numSteps = mergeStep - stepBefore;
+      stats.seconds = std::chrono::duration<double>(endTime - startTime).count();
+      passStats.push_back(stats);
+
+      if (debug) {
+        cout << "pass " << pass.name << " merged " << stats.numMerges << " superpixels in " << stats.seconds << " seconds" << endl;
+      }
+
+      roundMerges += stats.numMerges;
+
+      if (pass.stopIfNoMerges && stats.numMerges == 0) {
+        if (debug) {
+          cout << "pipeline stopped since " << pass.name << " did not merge" << endl;
+        }
+
+        return mergeStep;
+      }
+    }
+
+    if (roundMerges == 0) {
+      break;
+    }
+  }
+
+  return mergeStep;
+}
+
+int MergeSuperpixelPipeline::numMerges(const string &name) const
+{
+  int total = 0;
+  for ( const MergeSuperpixelPassStats &stats : passStats ) {
+    if (stats.name == name) {
+      total += stats.numMerges;
+    }
+  }
+  return total;
+}
+
+void MergeSuperpixelPipeline::printStats(ostream &os) const
+{
+  for ( const MergeSuperpixelPassStats &stats : passStats ) {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "round %d %-32s : %6d merges %6d steps %10.4f seconds", stats.round, stats.name.c_str(), stats.numMerges, stats.numSteps, stats.seconds);
+    os << (char*)buffer << endl;
+  }
+}
@@ -0,0 +1,102 @@
+// A merge pipeline runs a declared sequence of MergeSuperpixelImage passes on
+// one superpixel image. Each pass is a function that accepts the merge step
+// count and returns the updated step count, as the merge methods already do.
+// The runner records the wall time and the number of merges done by each pass
+// so that the cost of a pass can be compared to the merges it finds. All the
+// passes read the same input image, so the color stats, histograms and color
+// conversions cached by SuperpixelImage for that image are shared between the
+// passes instead of being rebuilt by each one. When the image has a merge log
+// the start of each pass that is run is marked in the log.
+
+#ifndef MERGE_SUPERPIXEL_PIPELINE_H
+#define	MERGE_SUPERPIXEL_PIPELINE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+#include "MergeSuperpixelImage.h"
+
+typedef std::function<int(MergeSuperpixelImage &spImage, Mat &inputImg, int mergeStep)> MergeSuperpixelPassFunc;
+
+typedef struct {
+  string name;
+  MergeSuperpixelPassFunc func;
+  // When true the pipeline stops after this pass if it did not merge anything
+  bool stopIfNoMerges;
+} MergeSuperpixelPass;
+
+// Results for one run of a pass, numMerges is the number of superpixels that
+// were merged away and numSteps is the change in the merge step count.
+
+typedef struct {
+  string name;
+  int round;
+  int numMerges;
+  int numSteps;
+  double seconds;
+} MergeSuperpixelPassStats;
+
+class MergeSuperpixelPipeline {
+  public:
+
+  vector<MergeSuperpixelPass> passes;
+
+  // Stats for each pass that was run, in the order the passes were run
+
+  vector<MergeSuperpixelPassStats> passStats;
+
+  // The list of passes is run up to maxRounds times, a round that does not
+  // merge anything ends the run.
+
+  int maxRounds;
+
+  // When true the color stats are read from the input image once before the
+  // first pass so that isAllSamePixels() and the mean and variance queries of
+  // every pass do not read pixels.
+
+  bool setColorStats;
+
+  MergeSuperpixelPipeline()
+  : maxRounds(1), setColorStats(true)
+  {
+  }
+
+  void addPass(const string &name, MergeSuperpixelPassFunc func, bool stopIfNoMerges = false);
+
+  // Passes for the MergeSuperpixelImage merge methods
+
+  void addMergeIdenticalPass(bool stopIfNoMerges = false);
+
+  void addBackprojectPass(int colorspace, BackprojectRange range, bool stopIfNoMerges = false);
+
+  void addBredthFirstPass(int colorspace, int numBins, bool stopIfNoMerges = false);
+
+  void addFillMergeBackprojectPass(int colorspace, bool stopIfNoMerges = false);
+
+  void addMinCostEdgesPass(double maxCost, bool stopIfNoMerges = false);
+
+  void addMergeSmallPass(int colorspace, bool stopIfNoMerges = false);
+
+  void addMergeEdgyPass(int colorspace, bool stopIfNoMerges = false);
+
+  // Run the passes and return the final merge step count, any stats from a
+  // previous run are discarded.
+
+  int run(MergeSuperpixelImage &spImage, Mat &inputImg, int startStep = 0);
+
+  // Total merges done by all the passes with this name
+
+  int numMerges(const string &name) const;
+
+  // Write a line of stats for each pass that was run
+
+  void printStats(ostream &os) const;
+};
+
+#endif // MERGE_SUPERPIXEL_PIPELINE_H
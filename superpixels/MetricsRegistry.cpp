@@ -0,0 +1,303 @@
+// Counters, gauges and latency histograms written as Prometheus text or JSON
+
+#include "MetricsRegistry.h"
+
+#include <float.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MemoryStats.h"
+
+using namespace std;
+
+typedef enum {
+  METRICS_COUNTER = 0,
+  METRICS_GAUGE = 1,
+  METRICS_HISTOGRAM = 2
+} MetricsType;
+
+// Upper bound of each histogram bucket, the +Inf bucket is the count
+
+static const double metricsHistogramBuckets[] = {
+  0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0
+};
+
+static const int metricsNumHistogramBuckets = (int) (sizeof(metricsHistogramBuckets) / sizeof(metricsHistogramBuckets[0]));
+
+typedef struct {
+  MetricsType type;
+  // Counter or gauge value, histogram sum
+  double value;
+  // Histogram values
+  int64_t count;
+  double minValue;
+  double maxValue;
+  int64_t bucketCounts[metricsNumHistogramBuckets];
+} MetricsValue;
+
+// Ordered by name then labels so that the labels of a name are written together
+
+typedef pair<string, string> MetricsKey;
+
+static mutex metricsMutex;
+static map<MetricsKey, MetricsValue> metrics;
+
+// Find or create a metric, a name recorded as another type keeps its first type
+// and the value is ignored.
+
+static MetricsValue* lockedMetricsValue(const char *name, const char *labels, MetricsType type)
+{
+  MetricsKey key(name, (labels == NULL) ? "" : labels);
+
+  auto it = metrics.find(key);
+
+  if (it != metrics.end()) {
+    return (it->second.type == type) ? &it->second : NULL;
+  }
+
+  // The first metric of the name, if any, sorts at the empty labels
+
+  auto nameIt = metrics.lower_bound(MetricsKey(key.first, ""));
+
+  if (nameIt != metrics.end() && nameIt->first.first == key.first && nameIt->second.type != type) {
+    return NULL;
+  }
+
+  MetricsValue &value = metrics[key];
+  value.type = type;
+  value.value = 0.0;
+  value.count = 0;
+  value.minValue = DBL_MAX;
+  value.maxValue = -DBL_MAX;
+  for (int i = 0; i < metricsNumHistogramBuckets; i++) {
+    value.bucketCounts[i] = 0;
+  }
+  return &value;
+}
+
+void addMetricsCounter(const char *name, const char *labels, double value)
+{
+  if (value < 0.0) {
+    return;
+  }
+
+  lock_guard<mutex> lock(metricsMutex);
+
+  MetricsValue *metricsValue = lockedMetricsValue(name, labels, METRICS_COUNTER);
+
+  if (metricsValue != NULL) {
+    metricsValue->value += value;
+  }
+}
+
+void setMetricsGauge(const char *name, const char *labels, double value)
+{
+  lock_guard<mutex> lock(metricsMutex);
+
+  MetricsValue *metricsValue = lockedMetricsValue(name, labels, METRICS_GAUGE);
+
+  if (metricsValue != NULL) {
+    metricsValue->value = value;
+  }
+}
+
+void addMetricsGauge(const char *name, const char *labels, double delta)
+{
+  lock_guard<mutex> lock(metricsMutex);
+
+  MetricsValue *metricsValue = lockedMetricsValue(name, labels, METRICS_GAUGE);
+
+  if (metricsValue != NULL) {
+    metricsValue->value += delta;
+  }
+}
+
+void observeMetricsHistogram(const char *name, const char *labels, double seconds)
+{
+  lock_guard<mutex> lock(metricsMutex);
+
+  MetricsValue *metricsValue = lockedMetricsValue(name, labels, METRICS_HISTOGRAM);
+
+  if (metricsValue == NULL) {
+    return;
+  }
+
+  metricsValue->value += seconds;
+  metricsValue->count += 1;
+
+  if (seconds < metricsValue->minValue) {
+    metricsValue->minValue = seconds;
+  }
+  if (seconds > metricsValue->maxValue) {
+    metricsValue->maxValue = seconds;
+  }
+
+  // Only the first bucket that holds the value is counted, the buckets are
+  // made cumulative as they are written.
+
+  for (int i = 0; i < metricsNumHistogramBuckets; i++) {
+    if (seconds <= metricsHistogramBuckets[i]) {
+      metricsValue->bucketCounts[i] += 1;
+      break;
+    }
+  }
+}
+
+void clearMetrics()
+{
+  lock_guard<mutex> lock(metricsMutex);
+
+  metrics.clear();
+}
+
+size_t numMetrics()
+{
+  lock_guard<mutex> lock(metricsMutex);
+
+  return metrics.size();
+}
+
+static const char* metricsTypeName(MetricsType type)
+{
+  switch (type) {
+    case METRICS_COUNTER:
+      return "counter";
+    case METRICS_GAUGE:
+      return "gauge";
+    default:
+      return "histogram";
+  }
+}
+
+// name{labels} or name{labels,extra}, no braces when there are no labels
+
+static void writePrometheusSeries(FILE *fp, const string &name, const char *suffix, const string &labels, const char *extraLabel)
+{
+  fprintf(fp, "%s%s", name.c_str(), suffix);
+
+  if (!labels.empty() || extraLabel != NULL) {
+    fprintf(fp, "{%s%s%s}", labels.c_str(), (!labels.empty() && extraLabel != NULL) ? "," : "", (extraLabel != NULL) ? extraLabel : "");
+  }
+}
+
+void writeMetricsPrometheus(FILE *fp)
+{
+  setMetricsGauge("process_peak_rss_bytes", NULL, (double) getPeakResidentBytes());
+
+  lock_guard<mutex> lock(metricsMutex);
+
+  const string *lastName = NULL;
+
+  for ( auto &pair : metrics ) {
+    const string &name = pair.first.first;
+    const string &labels = pair.first.second;
+    const MetricsValue &value = pair.second;
+
+    if (lastName == NULL || *lastName != name) {
+      fprintf(fp, "# TYPE %s %s\n", name.c_str(), metricsTypeName(value.type));
+      lastName = &name;
+    }
+
+    if (value.type != METRICS_HISTOGRAM) {
+      writePrometheusSeries(fp, name, "", labels, NULL);
+      fprintf(fp, " %.17g\n", value.value);
+      continue;
+    }
+
+    int64_t cumulativeCount = 0;
+
+    for (int i = 0; i < metricsNumHistogramBuckets; i++) {
+      char leLabel[64];
+      snprintf(leLabel, sizeof(leLabel), "le=\"%g\"", metricsHistogramBuckets[i]);
+      cumulativeCount += value.bucketCounts[i];
+      writePrometheusSeries(fp, name, "_bucket", labels, leLabel);
+      fprintf(fp, " %lld\n", (long long) cumulativeCount);
+    }
+
+    writePrometheusSeries(fp, name, "_bucket", labels, "le=\"+Inf\"");
+    fprintf(fp, " %lld\n", (long long) value.count);
+    writePrometheusSeries(fp, name, "_sum", labels, NULL);
+    fprintf(fp, " %.17g\n", value.value);
+    writePrometheusSeries(fp, name, "_count", labels, NULL);
+    fprintf(fp, " %lld\n", (long long) value.count);
+  }
+}
+
+// The JSON key of a metric is the Prometheus series name, name{labels}
+
+static void writeMetricsJSONKey(FILE *fp, const MetricsKey &key)
+{
+  fputc('"', fp);
+  string str = key.first;
+  if (!key.second.empty()) {
+    str += "{" + key.second + "}";
+  }
+  for ( char c : str ) {
+    if (c == '"' || c == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+void writeMetricsJSON(FILE *fp)
+{
+  setMetricsGauge("process_peak_rss_bytes", NULL, (double) getPeakResidentBytes());
+
+  lock_guard<mutex> lock(metricsMutex);
+
+  fprintf(fp, "{\n");
+
+  const MetricsType types[] = { METRICS_COUNTER, METRICS_GAUGE, METRICS_HISTOGRAM };
+  const char *sectionNames[] = { "counters", "gauges", "histograms" };
+
+  for (int ti = 0; ti < 3; ti++) {
+    fprintf(fp, "  \"%s\": {", sectionNames[ti]);
+
+    bool first = true;
+
+    for ( auto &pair : metrics ) {
+      const MetricsValue &value = pair.second;
+
+      if (value.type != types[ti]) {
+        continue;
+      }
+
+      fprintf(fp, "%s\n    ", first ? "" : ",");
+      first = false;
+
+      writeMetricsJSONKey(fp, pair.first);
+
+      if (value.type != METRICS_HISTOGRAM) {
+        fprintf(fp, ": %.17g", value.value);
+        continue;
+      }
+
+      const bool empty = (value.count == 0);
+
+      fprintf(fp, ": {\"count\": %lld, \"sum\": %.17g, \"mean\": %.17g, \"min\": %.17g, \"max\": %.17g, \"buckets\": [",
+              (long long) value.count, value.value,
+              empty ? 0.0 : (value.value / value.count),
+              empty ? 0.0 : value.minValue,
+              empty ? 0.0 : value.maxValue);
+
+      int64_t cumulativeCount = 0;
+
+      for (int i = 0; i < metricsNumHistogramBuckets; i++) {
+        cumulativeCount += value.bucketCounts[i];
+        fprintf(fp, "%s[%g, %lld]", (i == 0) ? "" : ", ", metricsHistogramBuckets[i], (long long) cumulativeCount);
+      }
+
+      fprintf(fp, "]}");
+    }
+
+    fprintf(fp, "%s}%s\n", first ? "" : "\n  ", (ti < 2) ? "," : "");
+  }
+
+  fprintf(fp, "}\n");
+}
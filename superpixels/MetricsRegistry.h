@@ -0,0 +1,50 @@
+// Process wide registry of counters, gauges and latency histograms for a long
+// running segmentation process. A metric is named by a Prometheus metric name
+// and an optional set of labels in Prometheus form, like stage="srm", and is
+// created the first time a value is recorded for it. Recording takes a mutex,
+// so a metric is meant to be recorded once for each stage or image and not for
+// each region. The metrics are written in the Prometheus text format for a
+// scrape and as a JSON object for a summary at the end of a batch.
+
+#ifndef METRICS_REGISTRY_H
+#define	METRICS_REGISTRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Add value to a counter, a counter only goes up
+
+void addMetricsCounter(const char *name, const char *labels, double value = 1.0);
+
+// Set a gauge, or add a positive or negative delta to it
+
+void setMetricsGauge(const char *name, const char *labels, double value);
+
+void addMetricsGauge(const char *name, const char *labels, double delta);
+
+// Record one value of a histogram, the buckets are latency buckets in seconds
+// from 1 ms to 60 s.
+
+void observeMetricsHistogram(const char *name, const char *labels, double seconds);
+
+// Remove every metric
+
+void clearMetrics();
+
+// Number of metrics, each set of labels of a name counts as one metric
+
+size_t numMetrics();
+
+// The process_peak_rss_bytes gauge is set to getPeakResidentBytes() as the
+// metrics are written.
+
+// Write the metrics in the Prometheus text exposition format
+
+void writeMetricsPrometheus(FILE *fp);
+
+// Write the metrics as a JSON object with counters, gauges and histograms,
+// the mean, min and max of each histogram are written along with the buckets.
+
+void writeMetricsJSON(FILE *fp);
+
+#endif // METRICS_REGISTRY_H
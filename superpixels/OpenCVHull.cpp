@@ -2,6 +2,8 @@
 
 #include "OpenCVHull.hpp"
 
+#include <opencv2/core/hal/intrin.hpp>
+
 #include "OpenCVUtil.h"
 
 #include "Superpixel.h"
@@ -10,6 +12,8 @@
 
 #include "Util.h"
 
+#include "CoordGrid.h"
+
 #define HULL_DUMP_IMAGE_PREFIX "srm_tag_"
 
 // Get a range of contour values given a starting point and and ending point.
@@ -67,14 +71,45 @@ void appendCoordsInRangeOnContour(int startIdx,
 // and exit.
 
 void findContourOutline(const cv::Mat &binMat, vector<Point2i> &contour, bool simplify) {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  // Bounds of the non-zero pixels, an empty rect when all pixels are zero
+  
+  int minX = binMat.cols;
+  int minY = binMat.rows;
+  int maxX = -1;
+  int maxY = -1;
+  
+  for ( int y = 0; y < binMat.rows; y++ ) {
+    const uint8_t *rowPtr = binMat.ptr<uint8_t>(y);
+    
+    for ( int x = 0; x < binMat.cols; x++ ) {
+      if (rowPtr[x] != 0) {
+        minX = mini(minX, x);
+        maxX = maxi(maxX, x);
+        minY = mini(minY, y);
+        maxY = y;
+      }
+    }
+  }
+  
+  Rect roi;
+  
+  if (maxX >= 0) {
+    roi = Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+  }
+  
+  findContourOutline(binMat, roi, contour, simplify);
+}
+
+void findContourOutline(const cv::Mat &binMat, const cv::Rect &roi, vector<Point2i> &contour, bool simplify) {
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugStageImagesEnabled();
   
   if (debug) {
-    cout << "findContourOutline" << endl;
+    cout << "findContourOutline in roi " << roi << endl;
   }
   
   assert(contour.size() == 0);
+  assert((roi & Rect(0, 0, binMat.cols, binMat.rows)) == roi);
   
   vector<vector<Point2i> > contours;
   vector<Vec4i> hierarchy;
@@ -83,24 +118,22 @@ void findContourOutline(const cv::Mat &binMat, vector<Point2i> &contour, bool si
     writeWroteImg("find_contour_input.png", binMat);
   }
   
-  // FIXME: detect ROI+1 and use that rect as the ROI size for new detection Mat
-  
   // The findContours() method returns funny results when an on pixel is on one
   // of the edges of the Mat. So, allocate a Mat that has one additional pixel
-  // of spacing and then copy the existing pixels into the larger mat via a ROI
-  // copy.
-  
-  Mat largerMat(binMat.rows + 2, binMat.cols + 2, CV_8UC1, Scalar(0));
-  assert(largerMat.cols == binMat.cols+2);
-  assert(largerMat.rows == binMat.rows+2);
-  
-  Rect borderedROI(1, 1, binMat.cols, binMat.rows);
+  // of spacing around the ROI and then copy the ROI pixels into the larger mat
+  // via a ROI copy.
   
-  Mat largerROIMat = largerMat(borderedROI);
+  Mat largerMat(roi.height + 2, roi.width + 2, CV_8UC1, Scalar(0));
+  assert(largerMat.cols == roi.width+2);
+  assert(largerMat.rows == roi.height+2);
   
-  assert(largerROIMat.size() == binMat.size());
-  
-  binMat.copyTo(largerROIMat);
+  if (roi.area() > 0) {
+    Rect borderedROI(1, 1, roi.width, roi.height);
+    
+    Mat largerROIMat = largerMat(borderedROI);
+    
+    binMat(roi).copyTo(largerROIMat);
+  }
   
   if (debugDumpImages) {
     writeWroteImg("find_contour_uncropped_input.png", largerMat);
@@ -131,7 +164,7 @@ void findContourOutline(const cv::Mat &binMat, vector<Point2i> &contour, bool si
     assert(0);
   }
   
-  if (contours.size() > 1) {
+  if (contours.size() > 1 && debugDumpImages) {
     // Emit contours as N outlines
     
     int ci = 0;
@@ -177,7 +210,9 @@ void findContourOutline(const cv::Mat &binMat, vector<Point2i> &contour, bool si
     }
     
     writeWroteImg("contour_failed_n_bbox.png", imageWithBbox);
-    
+  }
+  
+  if (contours.size() > 1) {
     fprintf(stderr, "error: found %d distinct contour regions in input image\n", (int)contours.size());
 //    exit(1);
     assert(0);
@@ -205,13 +240,13 @@ void findContourOutline(const cv::Mat &binMat, vector<Point2i> &contour, bool si
     writeWroteImg("find_contour_output.png", largerMat);
   }
   
-  // The ROI region is defined such that (1,1) is actually (0,0) from the
+  // The ROI region is defined such that (1,1) is actually the ROI origin in the
   // original image.
   
   // At this point the contour is a vector of points, but (1,1) must be subtracted
-  // from each point to account for the ROI region.
+  // and the ROI origin added to each point to account for the ROI region.
   
-  const Point2i offset11(1, 1);
+  const Point2i offset11(1 - roi.x, 1 - roi.y);
   
   if (debug) {
     cout << "points before offset adjust:" << endl;
@@ -273,6 +308,377 @@ void findContourOutline(const cv::Mat &binMat, vector<Point2i> &contour, bool si
   return;
 }
 
+void traceTagContour(const Mat &tagsImg, int32_t tag, Coord seed, vector<Point2i> &contour)
+{
+  assert(tagsImg.type() == CV_8UC3);
+  
+  traceContourClockwise(tagsImg.cols, tagsImg.rows, seed, [&tagsImg, tag](int x, int y)->bool {
+    return Vec3BToUID(tagsImg.at<Vec3b>(y, x)) == tag;
+  }, contour);
+}
+
+void traceAllTagContours(const Mat &tagsImg, unordered_map<int32_t, vector<Point2i> > &contours)
+{
+  assert(tagsImg.type() == CV_8UC3);
+  
+  contours.clear();
+  
+  vector<uint32_t> rowTags(tagsImg.cols);
+  
+  for ( int y = 0; y < tagsImg.rows; y++ ) {
+    packPixelRow(tagsImg.ptr<uint8_t>(y), rowTags.data(), tagsImg.cols);
+    
+    int32_t prevTag = -1;
+    
+    for ( int x = 0; x < tagsImg.cols; x++ ) {
+      int32_t tag = (int32_t) rowTags[x];
+      
+      // Runs of the same tag along a row only need one lookup
+      
+      if (tag == prevTag) {
+        continue;
+      }
+      prevTag = tag;
+      
+      if (contours.count(tag) > 0) {
+        continue;
+      }
+      
+      traceTagContour(tagsImg, tag, Coord(x, y), contours[tag]);
+    }
+  }
+}
+
+// Points are ordered by X and then by Y for the monotone chain
+
+static inline
+bool hullPointLessThan(const Point2i &p1, const Point2i &p2)
+{
+  return (p1.x < p2.x) || ((p1.x == p2.x) && (p1.y < p2.y));
+}
+
+static inline
+int64_t hullCross(const Point2i &o, const Point2i &a, const Point2i &b)
+{
+  return ((int64_t)(a.x - o.x) * (b.y - o.y)) - ((int64_t)(a.y - o.y) * (b.x - o.x));
+}
+
+// Andrew's monotone chain over points sorted with hullPointLessThan(), duplicate
+// points are allowed.
+
+static
+void convexHullOfSortedPoints(const vector<Point2i> &points, vector<Point2i> &hull)
+{
+  hull.clear();
+  
+  int numPoints = (int) points.size();
+  
+  if (numPoints == 0) {
+    return;
+  }
+  
+  hull.resize(numPoints * 2);
+  
+  int k = 0;
+  
+  // Lower chain in increasing X order then the upper chain in decreasing X order,
+  // with y going down this is clockwise on screen.
+  
+  for ( int i = 0; i < numPoints; i++ ) {
+    while (k >= 2 && hullCross(hull[k-2], hull[k-1], points[i]) <= 0) {
+      k--;
+    }
+    hull[k++] = points[i];
+  }
+  
+  for ( int i = numPoints - 2, t = k + 1; i >= 0; i-- ) {
+    while (k >= t && hullCross(hull[k-2], hull[k-1], points[i]) <= 0) {
+      k--;
+    }
+    hull[k++] = points[i];
+  }
+  
+  // The last point is the same as the first unless all points are the same
+  
+  hull.resize((k > 1) ? (k - 1) : 1);
+  
+  // Start with the first vertex in raster order
+  
+  int startOffset = 0;
+  
+  for ( int i = 1; i < (int) hull.size(); i++ ) {
+    const Point2i &p = hull[i];
+    const Point2i &start = hull[startOffset];
+    if ((p.y < start.y) || ((p.y == start.y) && (p.x < start.x))) {
+      startOffset = i;
+    }
+  }
+  
+  std::rotate(hull.begin(), hull.begin() + startOffset, hull.end());
+}
+
+void convexHullOfPoints(vector<Point2i> &points, vector<Point2i> &hull)
+{
+  std::sort(points.begin(), points.end(), hullPointLessThan);
+  convexHullOfSortedPoints(points, hull);
+}
+
+// Append the vertices of a convex hull as the two sorted chains that go from the
+// smallest to the largest vertex in X then Y order.
+
+static
+void appendSortedHullChains(const vector<Point2i> &hull, vector<Point2i> &chain1, vector<Point2i> &chain2)
+{
+  int numPoints = (int) hull.size();
+  
+  int minOffset = 0;
+  int maxOffset = 0;
+  
+  for ( int i = 1; i < numPoints; i++ ) {
+    if (hullPointLessThan(hull[i], hull[minOffset])) {
+      minOffset = i;
+    }
+    if (hullPointLessThan(hull[maxOffset], hull[i])) {
+      maxOffset = i;
+    }
+  }
+  
+  for ( int i = minOffset; ; i = (i + 1) % numPoints ) {
+    chain1.push_back(hull[i]);
+    if (i == maxOffset) {
+      break;
+    }
+  }
+  
+  for ( int i = minOffset; ; i = (i + numPoints - 1) % numPoints ) {
+    chain2.push_back(hull[i]);
+    if (i == maxOffset) {
+      break;
+    }
+  }
+}
+
+void mergeConvexHulls(const vector<Point2i> &hull1, const vector<Point2i> &hull2, vector<Point2i> &mergedHull)
+{
+  if (hull1.empty() || hull2.empty()) {
+    mergedHull = hull1.empty() ? hull2 : hull1;
+    return;
+  }
+  
+  vector<Point2i> chain1, chain2, chain3, chain4;
+  
+  appendSortedHullChains(hull1, chain1, chain2);
+  appendSortedHullChains(hull2, chain3, chain4);
+  
+  vector<Point2i> merged12, merged34;
+  merged12.reserve(chain1.size() + chain2.size());
+  merged34.reserve(chain3.size() + chain4.size());
+  
+  std::merge(chain1.begin(), chain1.end(), chain2.begin(), chain2.end(), back_inserter(merged12), hullPointLessThan);
+  std::merge(chain3.begin(), chain3.end(), chain4.begin(), chain4.end(), back_inserter(merged34), hullPointLessThan);
+  
+  vector<Point2i> sortedPoints;
+  sortedPoints.reserve(merged12.size() + merged34.size());
+  
+  std::merge(merged12.begin(), merged12.end(), merged34.begin(), merged34.end(), back_inserter(sortedPoints), hullPointLessThan);
+  
+  convexHullOfSortedPoints(sortedPoints, mergedHull);
+}
+
+// Append the pixels of an edge in the same order and with the same error term
+// as the 8-connected left to right cv::LineIterator that cv::line() uses, so
+// that the edge pixels are exactly the pixels cv::line() would draw.
+
+static
+void appendPolygonEdgeRuns(Point2i p1, Point2i p2, vector<PolygonFillRun> &runs)
+{
+  if (p1.x > p2.x) {
+    std::swap(p1, p2);
+  }
+  
+  int dx = p2.x - p1.x;
+  int dy = p2.y - p1.y;
+  const int stepY = (dy < 0) ? -1 : 1;
+  dy = abs(dy);
+  
+  const bool steep = (dy > dx);
+  
+  if (steep) {
+    std::swap(dx, dy);
+  }
+  
+  int err = dx - (dy + dy);
+  const int plusDelta = dx + dx;
+  const int minusDelta = -(dy + dy);
+  
+  int x = p1.x;
+  int y = p1.y;
+  
+  for ( int i = 0; i <= dx; i++ ) {
+    if (!runs.empty() && runs.back().y == y && (runs.back().endX + 1) == x) {
+      runs.back().endX = x;
+    } else {
+      PolygonFillRun run = { y, x, x };
+      runs.push_back(run);
+    }
+    
+    const bool minorStep = (err < 0);
+    err += minusDelta + (minorStep ? plusDelta : 0);
+    
+    if (steep) {
+      y += stepY;
+      x += minorStep ? 1 : 0;
+    } else {
+      x += 1;
+      y += minorStep ? stepY : 0;
+    }
+  }
+}
+
+typedef struct {
+  int32_t startY;
+  // Row after the last row the edge crosses
+  int32_t endY;
+  int32_t startX;
+  int32_t deltaX;
+  int32_t deltaY;
+} PolygonScanEdge;
+
+void scanlineFillPolygonRuns(const vector<Point2i> &polygon, vector<PolygonFillRun> &runs)
+{
+  runs.clear();
+  
+  const int numPoints = (int) polygon.size();
+  
+  if (numPoints == 0) {
+    return;
+  }
+  
+  vector<PolygonScanEdge> edges;
+  edges.reserve(numPoints);
+  
+  int minY = polygon[0].y;
+  int maxY = polygon[0].y;
+  
+  for ( int i = 0; i < numPoints; i++ ) {
+    Point2i p1 = polygon[i];
+    Point2i p2 = polygon[(i + 1) % numPoints];
+    
+    appendPolygonEdgeRuns(p1, p2, runs);
+    
+    minY = mini(minY, p1.y);
+    maxY = maxi(maxY, p1.y);
+    
+    // A horizontal edge never crosses a row center and is only drawn
+    
+    if (p1.y == p2.y) {
+      continue;
+    }
+    
+    if (p1.y > p2.y) {
+      std::swap(p1, p2);
+    }
+    
+    PolygonScanEdge edge = { p1.y, p2.y, p1.x, p2.x - p1.x, p2.y - p1.y };
+    edges.push_back(edge);
+  }
+  
+  std::sort(edges.begin(), edges.end(), [](const PolygonScanEdge &e1, const PolygonScanEdge &e2) {
+    return e1.startY < e2.startY;
+  });
+  
+  // Each edge is active for the rows startY <= y < endY, so a vertex shared by
+  // two edges is crossed once when the polygon passes through it and twice or
+  // not at all when the polygon turns at it, as the even-odd rule needs. The
+  // crossing is exact when it lands on a pixel center since the quotient of two
+  // integers is correctly rounded.
+  
+  vector<PolygonScanEdge> activeEdges;
+  vector<double> crossings;
+  
+  int nextEdge = 0;
+  
+  for ( int y = minY; y <= maxY; y++ ) {
+    for ( ; nextEdge < (int) edges.size() && edges[nextEdge].startY == y; nextEdge++ ) {
+      activeEdges.push_back(edges[nextEdge]);
+    }
+    
+    activeEdges.erase(std::remove_if(activeEdges.begin(), activeEdges.end(), [y](const PolygonScanEdge &edge) {
+      return edge.endY <= y;
+    }), activeEdges.end());
+    
+    crossings.clear();
+    
+    for ( const PolygonScanEdge &edge : activeEdges ) {
+      crossings.push_back(edge.startX + ((double) ((int64_t) (y - edge.startY) * edge.deltaX)) / edge.deltaY);
+    }
+    
+    std::sort(crossings.begin(), crossings.end());
+    
+    for ( int i = 0; (i + 1) < (int) crossings.size(); i += 2 ) {
+      const int startX = (int) ceil(crossings[i]);
+      const int endX = (int) floor(crossings[i + 1]);
+      if (startX <= endX) {
+        PolygonFillRun run = { y, startX, endX };
+        runs.push_back(run);
+      }
+    }
+  }
+  
+  // Merge the edge runs and the interior runs that overlap or touch
+  
+  std::sort(runs.begin(), runs.end(), [](const PolygonFillRun &r1, const PolygonFillRun &r2) {
+    return (r1.y != r2.y) ? (r1.y < r2.y) : (r1.startX < r2.startX);
+  });
+  
+  int numMerged = 0;
+  
+  for ( const PolygonFillRun &run : runs ) {
+    if (numMerged > 0) {
+      PolygonFillRun &lastRun = runs[numMerged - 1];
+      if (lastRun.y == run.y && run.startX <= (lastRun.endX + 1)) {
+        lastRun.endX = maxi(lastRun.endX, run.endX);
+        continue;
+      }
+    }
+    runs[numMerged++] = run;
+  }
+  
+  runs.resize(numMerged);
+}
+
+void scanlineFillPolygon(const vector<Point2i> &polygon, RegionMask &mask)
+{
+  vector<PolygonFillRun> runs;
+  scanlineFillPolygonRuns(polygon, runs);
+  
+  if (runs.empty()) {
+    mask.reset(Rect());
+    return;
+  }
+  
+  // The vertices are edge pixels, so the runs have the bbox of the polygon
+  
+  int minX = runs[0].startX;
+  int maxX = runs[0].endX;
+  
+  for ( const PolygonFillRun &run : runs ) {
+    minX = mini(minX, run.startX);
+    maxX = maxi(maxX, run.endX);
+  }
+  
+  Rect bbox(minX, runs.front().y, maxX - minX + 1, runs.back().y - runs.front().y + 1);
+  
+  mask.reset(bbox);
+  
+  Mat &maskMat = mask.mat();
+  
+  for ( const PolygonFillRun &run : runs ) {
+    uint8_t *rowPtr = maskMat.ptr<uint8_t>(run.y - bbox.y);
+    memset(rowPtr + (run.startX - bbox.x), 0xFF, run.endX - run.startX + 1);
+  }
+}
+
 // Given a set of coordinates that make up all the points of a region, calculate
 // a contour region and return the contour coordinates split up into convex vs
 // concave parts.
@@ -283,8 +689,8 @@ clockwiseScanOfHullCoords(
                           int32_t tag,
                           const vector<Coord> &regionCoords)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "clockwiseScanOfHullCoords " << tag << endl;
@@ -294,10 +700,13 @@ clockwiseScanOfHullCoords(
   // smallish straight lines so that perpendicular lines can be computed as compared
   // to each line segment in order to find the shape normals.
   
-  Mat binMat(tagsImg.size(), CV_8UC1, Scalar(0));
+  // The contour is traced directly from the region coords, the bbox limited
+  // set is the only per pixel state.
+  
+  CoordBitSet regionSet(regionCoords);
   
   for ( Coord c : regionCoords ) {
-    binMat.at<uint8_t>(c.y, c.x) = 0xFF;
+    regionSet.insert(c);
   }
   
   if (debugDumpImages) {
@@ -305,37 +714,38 @@ clockwiseScanOfHullCoords(
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_contour_detect" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    Mat binMat(tagsImg.size(), CV_8UC1, Scalar(0));
+    
+    for ( Coord c : regionCoords ) {
+      binMat.at<uint8_t>(c.y, c.x) = 0xFF;
+    }
+    
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
   
-  // Convert point into a simplified contour of straight lines
+  // The seed is the first coord in raster order
   
-  // CHAIN_APPROX_NONE or CV_CHAIN_APPROX_SIMPLE
+  Coord seed = regionCoords[0];
+  
+  for ( Coord c : regionCoords ) {
+    if (c < seed) {
+      seed = c;
+    }
+  }
   
   // Note that in cases of a tight angle, a certain coord can be
   // repeated in the generated contour.
   
-  //findContours(binMat, contours, CV_RETR_LIST, CHAIN_APPROX_NONE);
-  //  assert(contours.size() >= 1);
-  //  vector<Point> contour = contours[0];
+  vector<Point2i> contour;
   
-  vector<Point> contour;
-  findContourOutline(binMat, contour, false);
+  traceContourClockwise(tagsImg.cols, tagsImg.rows, seed, [&regionSet](int x, int y)->bool {
+    return regionSet.contains(Coord(x, y));
+  }, contour);
   
   assert(contour.size() > 0);
   
-  // Invert the default counter clockwise contour orientation
-  
-  vector<Point2i> tmp = contour;
-  contour.clear();
-  for ( auto it = tmp.rbegin(); it != tmp.rend(); ++it ) {
-    Point2i p = *it;
-    contour.push_back(p);
-  }
-  tmp.clear();
-  
   if (debug) {
     int i = 0;
     for ( Point2i p : contour ) {
@@ -367,14 +777,20 @@ clockwiseScanOfHullContour(CvSize size,
                            int32_t tag,
                            const vector<Point2i> &contour)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
 
   vector<vector<Point2i> > contours;
   
   contours.push_back(contour);
   
-  Mat binMat(size, CV_8UC1, Scalar(0));
+  // The frame size render target is only needed for the debug images
+  
+  Mat binMat;
+  
+  if (debugDumpImages) {
+    binMat = Mat(size, CV_8UC1, Scalar(0));
+  }
   
   // Render as contour
   
@@ -387,7 +803,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_contour" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -431,7 +847,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_contour_order" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -479,7 +895,9 @@ clockwiseScanOfHullContour(CvSize size,
   
   convexityDefects(contour, hull, defectVec);
   
-  binMat = Scalar(0);
+  if (debugDumpImages) {
+    binMat = Scalar(0);
+  }
   
   Mat colorMat;
   
@@ -525,7 +943,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_defectpoints" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -535,7 +953,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_defect_render" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, colorMat);
+    debugImwrite(fname, colorMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -611,7 +1029,7 @@ clockwiseScanOfHullContour(CvSize size,
       fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_defect_" << cDefIt << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, colorMat2);
+      debugImwrite(fname, colorMat2);
       cout << "wrote " << fname << endl;
       cout << "" << endl;
     }
@@ -736,7 +1154,7 @@ clockwiseScanOfHullContour(CvSize size,
       fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_defect_" << cDefIt << "_angle_" << angleBetweenStartAndDefectDegrees << "_and_" << angleBetweenEndAndDefectDegrees << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, colorMat2);
+      debugImwrite(fname, colorMat2);
       cout << "wrote " << fname << endl;
       cout << "" << endl;
     }
@@ -807,25 +1225,25 @@ clockwiseScanOfHullContour(CvSize size,
         fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_defect_" << cDefIt << "_only_line" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, roiMat);
+        debugImwrite(fname, roiMat);
         cout << "wrote " << fname << endl;
         cout << "" << endl;
       }
       
       vector<Point2i> hullLinePoints;
       findNonZero(roiMat, hullLinePoints);
-      unordered_map<Coord, bool> lineLookupTable;
+      CoordBitSet lineLookupTable(Rect(0, 0, roiMat.cols, roiMat.rows));
       
       for ( Point2i p : hullLinePoints ) {
         int x = p.x;
         int y = p.y;
         Coord c(x, y);
-        lineLookupTable[c] = true;
+        lineLookupTable.insert(c);
       }
       
-      // Capture filled contour points in the region
-      
-      roiMat = Scalar(0);
+      // Capture filled contour points in the region, the scanline fill emits
+      // the same pixels in the same raster order as a filled drawContours()
+      // followed by findNonZero() without clearing and scanning roiMat again.
       
       vector<Point2i> contour;
       
@@ -837,26 +1255,21 @@ clockwiseScanOfHullContour(CvSize size,
         contour.push_back(roiP);
       }
       
-      vector<vector<Point2i> > contours;
-      contours.push_back(contour);
+      vector<PolygonFillRun> filledContourRuns;
+      scanlineFillPolygonRuns(contour, filledContourRuns);
       
-      drawContours(roiMat, contours, 0, Scalar(0xFF), CV_FILLED, 8);
-      
-      vector<Point2i> filledContourPoints;
-      findNonZero(roiMat, filledContourPoints);
-      
-      assert(filledContourPoints.size() > 0);
+      assert(filledContourRuns.size() > 0);
       
       vector<Coord> nonHullLinePoints;
       
-      for ( Point2i p : filledContourPoints ) {
-        int x = p.x;
-        int y = p.y;
-        Coord c(x, y);
-        
-        if (lineLookupTable.count(c) == 0) {
-          // Add coord if it was not on the line
-          nonHullLinePoints.push_back(c);
+      for ( const PolygonFillRun &run : filledContourRuns ) {
+        for ( int x = run.startX; x <= run.endX; x++ ) {
+          Coord c(x, run.y);
+          
+          if (!lineLookupTable.contains(c)) {
+            // Add coord if it was not on the line
+            nonHullLinePoints.push_back(c);
+          }
         }
       }
       
@@ -876,7 +1289,7 @@ clockwiseScanOfHullContour(CvSize size,
         fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_defect_" << cDefIt << "_not_on_line" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, binMat2);
+        debugImwrite(fname, binMat2);
         cout << "wrote " << fname << endl;
         cout << "" << endl;
       }
@@ -902,7 +1315,7 @@ clockwiseScanOfHullContour(CvSize size,
         fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_defect_" << cDefIt << "_combined_line_defect" << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, colorMat);
+        debugImwrite(fname, colorMat);
         cout << "wrote " << fname << endl;
         cout << "" << endl;
       }
@@ -1242,7 +1655,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_type" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -1254,12 +1667,10 @@ clockwiseScanOfHullContour(CvSize size,
   if (debugDumpImages) {
     Mat colorMat(binMat.size(), CV_8UC3, Scalar(0,0,0));
     
+    uint32_t colorIndex = 0;
+    
     for ( TypedHullCoords &typedHullCoords : hullCoords ) {
-      uint32_t pixel = 0;
-      pixel |= (rand() % 256);
-      pixel |= ((rand() % 256) << 8);
-      pixel |= ((rand() % 256) << 16);
-      pixel |= (0xFF << 24);
+      uint32_t pixel = randomPixelForIndex(colorIndex++);
       
       Vec3b vec = PixelToVec3b(pixel);
       
@@ -1272,7 +1683,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_segments" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, colorMat);
+    debugImwrite(fname, colorMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -1282,13 +1693,16 @@ clockwiseScanOfHullContour(CvSize size,
   if (debugDumpImages) {
     Mat colorMat(binMat.size(), CV_8UC3, Scalar(0,0,0));
     
+    uint32_t colorIndex = 0;
+    
     for ( TypedHullCoords &typedHullCoords : hullCoords ) {
       auto vecOfCoords = typedHullCoords.coords;
       auto vecOfPoints = convertCoordsToPoints(vecOfCoords);
       auto startP = vecOfPoints[0];
       auto endP = vecOfPoints[vecOfPoints.size() - 1];
       
-      Scalar color = Scalar((rand() % 256), (rand() % 256), (rand() % 256));
+      uint32_t pixel = randomPixelForIndex(colorIndex++);
+      Scalar color = Scalar(pixel & 0xFF, (pixel >> 8) & 0xFF, (pixel >> 16) & 0xFF);
       line(colorMat, startP, endP, color, 1, 8);
     }
     
@@ -1296,7 +1710,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_lines_segments" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, colorMat);
+    debugImwrite(fname, colorMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -1421,7 +1835,7 @@ clockwiseScanOfHullContour(CvSize size,
         fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_lines_segment_" << i << "_angle_" << angleDeg << (mergeLineSegments ? "_merged" : "_notmerged" ) << ".png";
         string fname = fnameStream.str();
         
-        imwrite(fname, colorMat);
+        debugImwrite(fname, colorMat);
         cout << "wrote " << fname << endl;
         cout << "" << endl;
       }
@@ -1500,13 +1914,16 @@ clockwiseScanOfHullContour(CvSize size,
   if (debugDumpImages) {
     Mat colorMat(binMat.size(), CV_8UC3, Scalar(0,0,0));
     
+    uint32_t colorIndex = 0;
+    
     for ( TypedHullCoords &typedHullCoords : hullCoords ) {
       auto vecOfCoords = typedHullCoords.coords;
       auto vecOfPoints = convertCoordsToPoints(vecOfCoords);
       auto startP = vecOfPoints[0];
       auto endP = vecOfPoints[vecOfPoints.size() - 1];
       
-      Scalar color = Scalar((rand() % 256), (rand() % 256), (rand() % 256));
+      uint32_t pixel = randomPixelForIndex(colorIndex++);
+      Scalar color = Scalar(pixel & 0xFF, (pixel >> 8) & 0xFF, (pixel >> 16) & 0xFF);
       line(colorMat, startP, endP, color, 1, 8);
     }
     
@@ -1514,7 +1931,7 @@ clockwiseScanOfHullContour(CvSize size,
     fnameStream << HULL_DUMP_IMAGE_PREFIX << tag << "_hull_lines_combined_segments" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, colorMat);
+    debugImwrite(fname, colorMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -1541,8 +1958,8 @@ splitContourIntoLinesSegments(int32_t tag, CvSize size, CvRect roi, const vector
 vector<HullLineOrCurveSegment>
 splitContourIntoLinesSegments(int32_t tag, CvSize size, CvRect roi, const vector<Point2i> &contour, double epsilon)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
   if (debug) {
     cout << "splitContourIntoLinesSegments" << endl;
@@ -1612,7 +2029,8 @@ splitContourIntoLinesSegments(int32_t tag, CvSize size, CvRect roi, const vector
       Point2i p1 = approxContour[i];
       Point2i p2 = approxContour[vecOffsetAround((int)approxContour.size(), i+1)];
       
-      Scalar color = Scalar((rand() % 256), (rand() % 256), (rand() % 256));
+      uint32_t pixel = randomPixelForIndex(i);
+      Scalar color = Scalar(pixel & 0xFF, (pixel >> 8) & 0xFF, (pixel >> 16) & 0xFF);
       
       line(colorMat, p1, p2, color, 2, 8);
     }
@@ -1911,8 +2329,10 @@ splitContourIntoLinesSegments(int32_t tag, CvSize size, CvRect roi, const vector
   if (debugDumpImages) {
     Mat colorMat(size, CV_8UC3, Scalar(0,0,0));
     
+    uint32_t colorIndex = 0;
+    
     for ( auto &locSeg : segments ) {
-      Vec3b color((rand() % 256), (rand() % 256), (rand() % 256));
+      Vec3b color = PixelToVec3b(randomPixelForIndex(colorIndex++));
       
       for ( Point2i p : locSeg.points ) {
         colorMat.at<Vec3b>(p.y, p.x) = color;
@@ -1929,3 +2349,304 @@ splitContourIntoLinesSegments(int32_t tag, CvSize size, CvRect roi, const vector
   
   return segments;
 }
+
+// Last contour offset in the range (start, limit] that can be reached from start
+// with all the points in between within epsilon of the line, start when the
+// very next point is already outside.
+
+static
+int fitContourLine(const vector<Point2i> &contour, int start, int limit, double epsilon)
+{
+  const int numPoints = (int) contour.size();
+  const Point2i anchor = contour[start % numPoints];
+  
+  bool haveCone = false;
+  double refAngle = 0.0;
+  double minAngle = 0.0;
+  double maxAngle = 0.0;
+  double maxDist = 0.0;
+  
+  int last = start;
+  
+  for ( int i = start + 1; i <= limit; i++ ) {
+    Point2i p = contour[i % numPoints];
+    double dx = p.x - anchor.x;
+    double dy = p.y - anchor.y;
+    double dist = sqrt(dx * dx + dy * dy);
+    
+    // A line moves away from the first point at every step, a contour that
+    // turns back on itself ends the line.
+    
+    if (dist <= maxDist) {
+      break;
+    }
+    maxDist = dist;
+    
+    if (dist <= epsilon) {
+      // Any line through the first point is within epsilon of this point
+      last = i;
+      continue;
+    }
+    
+    // Angle relative to the first direction so that the cone never wraps
+    
+    double angle = atan2(dy, dx);
+    
+    if (!haveCone) {
+      refAngle = angle;
+    }
+    
+    angle -= refAngle;
+    
+    if (angle > M_PI) {
+      angle -= 2.0 * M_PI;
+    } else if (angle <= -M_PI) {
+      angle += 2.0 * M_PI;
+    }
+    
+    if (haveCone && (angle < minAngle || angle > maxAngle)) {
+      break;
+    }
+    
+    double halfAngle = asin(epsilon / dist);
+    
+    if (!haveCone) {
+      minAngle = angle - halfAngle;
+      maxAngle = angle + halfAngle;
+      haveCone = true;
+    } else {
+      minAngle = max(minAngle, angle - halfAngle);
+      maxAngle = min(maxAngle, angle + halfAngle);
+    }
+    
+    last = i;
+  }
+  
+  return last;
+}
+
+static inline
+bool isContour8Connected(const Point2i &p1, const Point2i &p2)
+{
+  return (abs(p2.x - p1.x) < 2) && (abs(p2.y - p1.y) < 2);
+}
+
+// Unit vector from the first point of a line span to the point at end
+
+static inline
+Point2f contourSpanSlope(const vector<Point2i> &contour, int start, int end)
+{
+  const int numPoints = (int) contour.size();
+  Point2f vec = contour[end % numPoints] - contour[start % numPoints];
+  makeUnitVector(vec);
+  return vec;
+}
+
+vector<ContourSpan>
+splitContourIntoLineSpans(const vector<Point2i> &contour, double epsilon)
+{
+  vector<ContourSpan> spans;
+  
+  const int numPoints = (int) contour.size();
+  
+  if (numPoints == 0) {
+    return spans;
+  }
+  
+  // Append one offset to the curve span at the end or start a new one
+  
+  auto appendCurve = [&spans](int offset) {
+    if (spans.empty() || spans.back().isLine || spans.back().end != offset) {
+      ContourSpan span;
+      span.start = offset;
+      span.end = offset;
+      span.isLine = false;
+      span.slope = Point2f(0.0f, 0.0f);
+      spans.push_back(span);
+    }
+    spans.back().end = offset + 1;
+  };
+  
+  int offset = 0;
+  
+  while (offset < numPoints) {
+    // The point at numPoints is the first point again, so the last line can
+    // end on it.
+    
+    int last = fitContourLine(contour, offset, numPoints, epsilon);
+    
+    if ((last - offset) < 2 || isContour8Connected(contour[offset], contour[last % numPoints])) {
+      appendCurve(offset);
+      offset += 1;
+    } else {
+      ContourSpan span;
+      span.start = offset;
+      span.end = last;
+      span.isLine = true;
+      span.slope = contourSpanSlope(contour, offset, last);
+      spans.push_back(span);
+      offset = last;
+    }
+  }
+  
+  // Join the spans across the wrap around, a curve at each end is one curve,
+  // a line at each end is one line when all the points fit and a line at the
+  // end can continue into a curve at the front.
+  
+  if (spans.size() > 1) {
+    ContourSpan &first = spans.front();
+    ContourSpan &lastSpan = spans.back();
+    
+    if (!first.isLine && !lastSpan.isLine) {
+      lastSpan.end = first.end + numPoints;
+      spans.erase(spans.begin());
+    } else if (first.isLine && lastSpan.isLine && lastSpan.end == numPoints) {
+      int joinedEnd = first.end + numPoints;
+      
+      if (fitContourLine(contour, lastSpan.start, joinedEnd, epsilon) == joinedEnd) {
+        lastSpan.end = joinedEnd;
+        lastSpan.slope = contourSpanSlope(contour, lastSpan.start, joinedEnd);
+        spans.erase(spans.begin());
+      }
+    } else if (lastSpan.isLine && !first.isLine && lastSpan.end == numPoints) {
+      int last = fitContourLine(contour, lastSpan.start, first.end + numPoints - 1, epsilon);
+      
+      if (last > lastSpan.end) {
+        lastSpan.end = last;
+        lastSpan.slope = contourSpanSlope(contour, lastSpan.start, last);
+        first.start = last - numPoints;
+      }
+    }
+  }
+  
+#if defined(DEBUG)
+  {
+    // Spans are contiguous and cover each offset once
+    
+    int total = 0;
+    
+    for ( int i = 0; i < (int) spans.size(); i++ ) {
+      const ContourSpan &span = spans[i];
+      assert(span.end > span.start);
+      total += span.end - span.start;
+      
+      if (i > 0) {
+        assert(span.start == spans[i-1].end);
+      }
+    }
+    
+    assert(total == numPoints);
+  }
+#endif // DEBUG
+  
+  return spans;
+}
+
+void contourToSoA(const vector<Point2i> &contour, ContourSoA &soa)
+{
+  const int N = (int) contour.size();
+  
+  soa.x.resize(N);
+  soa.y.resize(N);
+  
+  for ( int i = 0; i < N; i++ ) {
+    soa.x[i] = (float) contour[i].x;
+    soa.y[i] = (float) contour[i].y;
+  }
+}
+
+// Normal from a tangent, (ty, -tx) points left of the direction of travel which
+// is outside for a clockwise contour when y increases downward.
+
+static inline
+void contourNormalFromTangent(float tx, float ty, float *nx, float *ny)
+{
+  float lenSq = tx * tx + ty * ty;
+  
+  if (lenSq == 0.0f) {
+    *nx = 0.0f;
+    *ny = 0.0f;
+  } else {
+    float scale = 1.0f / sqrt(lenSq);
+    *nx = ty * scale;
+    *ny = -tx * scale;
+  }
+}
+
+void calcContourNormalsBatch(const float *x, const float *y, int N, int radius,
+                             float *normalX, float *normalY)
+{
+#if defined(DEBUG)
+  assert(radius >= 1);
+#endif // DEBUG
+  
+  if (N <= 0) {
+    return;
+  }
+  
+  // Points near the start and end read offsets that wrap around, the radius can
+  // be larger than a very small contour.
+  
+  const int firstInside = mini(radius, N);
+  const int endInside = maxi(firstInside, N - radius);
+  
+  for ( int i = 0; i < firstInside; i++ ) {
+    int iL = (((i - radius) % N) + N) % N;
+    int iR = (i + radius) % N;
+    contourNormalFromTangent(x[iR] - x[iL], y[iR] - y[iL], &normalX[i], &normalY[i]);
+  }
+  
+  int i = firstInside;
+  
+#if CV_SIMD128
+  {
+    // A zero tangent is clamped to a tiny length so that the normal is 0 * finite
+    
+    const cv::v_float32x4 minLenSq = cv::v_setall_f32(1e-20f);
+    const cv::v_float32x4 zero = cv::v_setzero_f32();
+    
+    for ( ; i + 4 <= endInside; i += 4 ) {
+      cv::v_float32x4 tx = cv::v_load(x + i + radius) - cv::v_load(x + i - radius);
+      cv::v_float32x4 ty = cv::v_load(y + i + radius) - cv::v_load(y + i - radius);
+      cv::v_float32x4 lenSq = cv::v_muladd(tx, tx, ty * ty);
+      cv::v_float32x4 scale = cv::v_invsqrt(cv::v_max(lenSq, minLenSq));
+      cv::v_store(normalX + i, ty * scale);
+      cv::v_store(normalY + i, (zero - tx) * scale);
+    }
+  }
+#endif // CV_SIMD128
+  
+  for ( ; i < endInside; i++ ) {
+    contourNormalFromTangent(x[i + radius] - x[i - radius], y[i + radius] - y[i - radius], &normalX[i], &normalY[i]);
+  }
+  
+  for ( i = endInside; i < N; i++ ) {
+    int iL = (((i - radius) % N) + N) % N;
+    int iR = (i + radius) % N;
+    contourNormalFromTangent(x[iR] - x[iL], y[iR] - y[iL], &normalX[i], &normalY[i]);
+  }
+}
+
+void calcContourNormalRaysBatch(const float *x, const float *y,
+                                const float *normalX, const float *normalY,
+                                int N, float scale,
+                                ContourNormalRays &rays)
+{
+  rays.reserve(rays.size() + N, 3);
+  
+  int start = (int) rays.points.size();
+  rays.points.resize(start + (N * 3));
+  Point2f *outPtr = rays.points.data() + start;
+  
+  for ( int i = 0; i < N; i++ ) {
+    Point2f p(x[i], y[i]);
+    Point2f n(normalX[i] * scale, normalY[i] * scale);
+    
+    *outPtr++ = p - n;
+    *outPtr++ = p;
+    *outPtr++ = p + n;
+    
+    start += 3;
+    rays.rayStarts.push_back(start);
+  }
+}
@@ -10,6 +10,7 @@ using namespace std;
 using namespace cv;
 
 #include "Coord.h"
+#include "RegionMask.h"
 
 // This utility method does the nasty job of parsing a binary shape from an input Mat
 // where the non-zero pixels are treated as 0xFF. This logic is very tricky because
@@ -22,6 +23,124 @@ using namespace cv;
 
 void findContourOutline(const cv::Mat &binMat, vector<Point2i> &contour, bool simplify);
 
+// Same as above except that only the pixels inside roi are read, roi must contain
+// every non-zero pixel in binMat. The padded copy and the contour trace are the
+// size of roi instead of the size of binMat and the contour points are returned
+// in binMat coordinates.
+
+void findContourOutline(const cv::Mat &binMat, const cv::Rect &roi, vector<Point2i> &contour, bool simplify);
+
+// Moore neighbor tracing of the 8-connected outer boundary of the region that
+// contains seed. The seed must be the first region pixel in raster order (the
+// topmost row and the leftmost column in that row) and isInside(x, y) must
+// return true for region pixels, coords outside the image are never passed.
+// The contour is clockwise and uses the same order as the reversed outer
+// contour from findContours(), so it starts with the pixel after the seed and
+// ends with the seed. A pixel is repeated when the boundary passes through it
+// twice, as with a 1 pixel wide line.
+
+template <typename F>
+void traceContourClockwise(int width, int height, Coord seed, F isInside, vector<Point2i> &contour)
+{
+  // Direction 0 is east, increasing values rotate clockwise with y going down
+  
+  static const int dx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+  static const int dy[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+  
+  contour.clear();
+  
+  const Point2i start(seed.x, seed.y);
+  
+  // First region pixel in clockwise order starting at dir, -1 if none
+  
+  auto nextDir = [&](Point2i p, int dir)->int {
+    for ( int i = 0; i < 8; i++, dir = (dir + 1) & 0x7 ) {
+      int x = p.x + dx[dir];
+      int y = p.y + dy[dir];
+      if (x >= 0 && y >= 0 && x < width && y < height && isInside(x, y)) {
+        return dir;
+      }
+    }
+    return -1;
+  };
+  
+  // The pixel to the west of the seed is known to be outside
+  
+  const int firstDir = nextDir(start, 5);
+  
+  if (firstDir == -1) {
+    contour.push_back(start);
+    return;
+  }
+  
+  Point2i p = start;
+  int dir = firstDir;
+  
+  while (1) {
+    p.x += dx[dir];
+    p.y += dy[dir];
+    
+    // Search starts at the outside pixel that was checked just before the move,
+    // done when the seed would be left in the same direction as the first move.
+    
+    int next = nextDir(p, (dir + 6) & 0x7);
+    
+    if (p == start && next == firstDir) {
+      break;
+    }
+    
+    contour.push_back(p);
+    dir = next;
+  }
+  
+  contour.push_back(start);
+}
+
+// Trace the outer boundary of the region identified by tag in a tags image
+// without rendering a mask, seed is the first pixel of the region in raster order.
+
+void traceTagContour(const Mat &tagsImg, int32_t tag, Coord seed, vector<Point2i> &contour);
+
+// Trace the outer boundary for each tag in one raster sweep of a tags image,
+// the first pixel found for a tag is the seed. When a tag is split into more
+// than one connected region only the first region is traced.
+
+void traceAllTagContours(const Mat &tagsImg, unordered_map<int32_t, vector<Point2i> > &contours);
+
+// Convex hull of a set of points with collinear points removed. The hull is
+// clockwise on screen (y going down) and starts with the first vertex in
+// raster order. The points are sorted by this method.
+
+void convexHullOfPoints(vector<Point2i> &points, vector<Point2i> &hull);
+
+// Convex hull of the union of two hulls returned by convexHullOfPoints(), each
+// hull is split into two chains that are already sorted, the chains are merged
+// and the hull of the merged points is found in a single pass, so the cost is
+// linear in the number of hull vertices.
+
+void mergeConvexHulls(const vector<Point2i> &hull1, const vector<Point2i> &hull2, vector<Point2i> &mergedHull);
+
+// A run of filled pixels on row y from startX to endX inclusive
+
+typedef struct {
+  int32_t y;
+  int32_t startX;
+  int32_t endX;
+} PolygonFillRun;
+
+// Even-odd scanline fill of the closed polygon, the result is the same as
+// drawContours() with CV_FILLED: the pixels with a center inside the polygon
+// are on and each edge is drawn as an 8-connected cv::line(), so a contour
+// traced from a region fills back to the region. The runs are sorted by y
+// and then x and the runs on one row do not touch. Only the edges and runs
+// are allocated, no Mat is.
+
+void scanlineFillPolygonRuns(const vector<Point2i> &polygon, vector<PolygonFillRun> &runs);
+
+// Reset mask to the bbox of the polygon and fill it, see scanlineFillPolygonRuns()
+
+void scanlineFillPolygon(const vector<Point2i> &polygon, RegionMask &mask);
+
 // This function scans a region and returns the hull coords split
 // into convex and concave regions.
 
@@ -101,4 +220,111 @@ splitContourIntoLinesSegments(int32_t tag, CvSize size, CvRect roi, const vector
 vector<HullLineOrCurveSegment>
 splitContourIntoLinesSegments(int32_t tag, CvSize size, CvRect roi, const vector<Coord> &contourCoords, double epsilon);
 
+// A line or curve segment represented as a span of offsets into a contour, the
+// points are read from the contour so they are not copied into each segment.
+// The contour is treated as circular, so end can be larger than the contour
+// size for a span that wraps around. Offset i in the span is the contour
+// point at (i % contour.size()).
+
+typedef struct {
+  int32_t start; // First contour offset
+  int32_t end; // One past the last contour offset
+  bool isLine;
+  Point2f slope; // Unit vector from the first point to the point at end, lines only
+} ContourSpan;
+
+// Split a contour that is 8 connected and not simplified into line and curve
+// spans in a single pass. Starting from the first point of a span, points are
+// added while every point is within epsilon of the line from the first point to
+// the newest point. The set of directions that keep all the points within
+// epsilon is a cone around the first point, each point narrows the cone in
+// constant time so the whole split is linear in the contour size. A line must
+// at least reach a point that is not 8 connected to the first point, other
+// points become part of curve spans. The spans cover every contour offset once
+// and are in contour order.
+
+vector<ContourSpan>
+splitContourIntoLineSpans(const vector<Point2i> &contour, double epsilon);
+
+// A contour stored as separate x and y arrays of float values so that batch
+// operations can read 4 points at a time with vector loads.
+
+typedef struct {
+  vector<float> x;
+  vector<float> y;
+} ContourSoA;
+
+void contourToSoA(const vector<Point2i> &contour, ContourSoA &soa);
+
+// Normal rays for all the points on a contour stored in one buffer instead of
+// a vector for each point. The ray for contour point i is the points from
+// rayStarts[i] up to rayStarts[i+1], so rayStarts has one more entry than the
+// number of rays.
+
+class ContourNormalRays {
+  public:
+  
+  vector<int32_t> rayStarts;
+  
+  vector<Point2f> points;
+  
+  ContourNormalRays()
+  : rayStarts(1, 0)
+  {
+  }
+  
+  void clear() {
+    rayStarts.assign(1, 0);
+    points.clear();
+  }
+  
+  // Reserve space for numRays rays of pointsPerRay points
+  
+  void reserve(int numRays, int pointsPerRay) {
+    rayStarts.reserve(numRays + 1);
+    points.reserve(numRays * pointsPerRay);
+  }
+  
+  int size() const {
+    return (int) rayStarts.size() - 1;
+  }
+  
+  int rayLength(int i) const {
+    return rayStarts[i+1] - rayStarts[i];
+  }
+  
+  const Point2f* ray(int i) const {
+    return points.data() + rayStarts[i];
+  }
+  
+  // Add a ray with numPoints points and return a pointer to the points, the
+  // pointer is valid until the next ray is added.
+  
+  Point2f* appendRay(int numPoints) {
+    int start = (int) points.size();
+    points.resize(start + numPoints);
+    rayStarts.push_back(start + numPoints);
+    return points.data() + start;
+  }
+};
+
+// Unit normal for each of the N points of a contour in SoA form. The tangent
+// at point i is p[i+radius] - p[i-radius] with offsets that wrap around the
+// contour and the normal is the tangent rotated so that it points outside a
+// clockwise contour. A point where the tangent is zero gets a zero normal.
+// Points that do not wrap are processed 4 at a time with an approximate
+// inverse square root refined by one Newton step, so results agree with the
+// scalar path to about 1e-6.
+
+void calcContourNormalsBatch(const float *x, const float *y, int N, int radius,
+                             float *normalX, float *normalY);
+
+// Append a 3 point ray (p - n*scale, p, p + n*scale) for each contour point, this
+// is the inside, on and outside layout used by calcNormalsOnContour().
+
+void calcContourNormalRaysBatch(const float *x, const float *y,
+                                const float *normalX, const float *normalY,
+                                int N, float scale,
+                                ContourNormalRays &rays);
+
 #endif // OPENCV_HULL_H
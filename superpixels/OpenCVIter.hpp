@@ -10,6 +10,8 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "OpenCVUtil.h"
+
 using namespace std;
 using namespace cv;
 
@@ -326,4 +328,234 @@ void for_each_byte_const_bgr (Mat & binMat, const Mat & mat, F f) noexcept
   return;
 }
 
+// ROI iterators invoke the same functions as the iterators above but only
+// for the pixels inside roi. The roi must be inside the bounds of the Mats.
+
+template <typename F>
+void for_each_const_byte (const Mat & binMat, const cv::Rect & roi, F f) noexcept
+{
+  for_each_const_byte(binMat(roi), f);
+}
+
+template <typename F>
+void for_each_byte (Mat & binMat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat = binMat(roi);
+  for_each_byte(roiMat, f);
+}
+
+template <typename F>
+void for_each_byte (Mat & binMat1, const Mat & binMat2, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat1 = binMat1(roi);
+  for_each_byte(roiMat1, binMat2(roi), f);
+}
+
+template <typename F>
+void for_each_const_bgr (const Mat & mat, const cv::Rect & roi, F f) noexcept
+{
+  for_each_const_bgr(mat(roi), f);
+}
+
+template <typename F>
+void for_each_bgr (Mat & mat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat = mat(roi);
+  for_each_bgr(roiMat, f);
+}
+
+template <typename F>
+void for_each_bgr (Mat & mat1, const Mat & mat2, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat1 = mat1(roi);
+  for_each_bgr(roiMat1, mat2(roi), f);
+}
+
+template <typename F>
+void for_each_bgr_const_byte (Mat & mat, const Mat & binMat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat = mat(roi);
+  for_each_bgr_const_byte(roiMat, binMat(roi), f);
+}
+
+template <typename F>
+void for_each_byte_const_bgr (Mat & binMat, const Mat & mat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiBinMat = binMat(roi);
+  for_each_byte_const_bgr(roiBinMat, mat(roi), f);
+}
+
+// Invoke f(startRow, endRow) for stripes of rows in parallel
+
+template <typename F>
+class OpenCVIterRowsParallelBody : public cv::ParallelLoopBody
+{
+  F & f;
+  
+  public:
+  
+  OpenCVIterRowsParallelBody(F & f)
+  : f(f)
+  {
+  }
+  
+  void operator()(const cv::Range & range) const {
+    f(range.start, range.end);
+  }
+};
+
+template <typename F>
+void for_each_row_stripe (int numRows, F f)
+{
+  OpenCVIterRowsParallelBody<F> body(f);
+  parallelFor(cv::Range(0, numRows), body);
+}
+
+// Parallel iterators split the rows into stripes and run the iterators above
+// on each stripe. The function is invoked from multiple threads at the same
+// time, so it must only read and write the pixels passed to it. Each stripe
+// gets a copy of the function, so state captured by value is not shared.
+
+template <typename F>
+void for_each_const_byte_par (const Mat & binMat, F f) noexcept
+{
+  for_each_row_stripe(binMat.rows, [&binMat, &f](int startY, int endY) {
+    for_each_const_byte(binMat.rowRange(startY, endY), f);
+  });
+}
+
+template <typename F>
+void for_each_byte_par (Mat & binMat, F f) noexcept
+{
+  for_each_row_stripe(binMat.rows, [&binMat, &f](int startY, int endY) {
+    Mat stripe = binMat.rowRange(startY, endY);
+    for_each_byte(stripe, f);
+  });
+}
+
+template <typename F>
+void for_each_byte_par (Mat & binMat1, const Mat & binMat2, F f) noexcept
+{
+#if defined(DEBUG)
+  assert(binMat1.size() == binMat2.size());
+#endif // DEBUG
+  
+  for_each_row_stripe(binMat1.rows, [&binMat1, &binMat2, &f](int startY, int endY) {
+    Mat stripe1 = binMat1.rowRange(startY, endY);
+    for_each_byte(stripe1, binMat2.rowRange(startY, endY), f);
+  });
+}
+
+template <typename F>
+void for_each_const_bgr_par (const Mat & mat, F f) noexcept
+{
+  for_each_row_stripe(mat.rows, [&mat, &f](int startY, int endY) {
+    for_each_const_bgr(mat.rowRange(startY, endY), f);
+  });
+}
+
+template <typename F>
+void for_each_bgr_par (Mat & mat, F f) noexcept
+{
+  for_each_row_stripe(mat.rows, [&mat, &f](int startY, int endY) {
+    Mat stripe = mat.rowRange(startY, endY);
+    for_each_bgr(stripe, f);
+  });
+}
+
+template <typename F>
+void for_each_bgr_par (Mat & mat1, const Mat & mat2, F f) noexcept
+{
+#if defined(DEBUG)
+  assert(mat1.size() == mat2.size());
+#endif // DEBUG
+  
+  for_each_row_stripe(mat1.rows, [&mat1, &mat2, &f](int startY, int endY) {
+    Mat stripe1 = mat1.rowRange(startY, endY);
+    for_each_bgr(stripe1, mat2.rowRange(startY, endY), f);
+  });
+}
+
+template <typename F>
+void for_each_bgr_const_byte_par (Mat & mat, const Mat & binMat, F f) noexcept
+{
+#if defined(DEBUG)
+  assert(mat.size() == binMat.size());
+#endif // DEBUG
+  
+  for_each_row_stripe(mat.rows, [&mat, &binMat, &f](int startY, int endY) {
+    Mat stripe = mat.rowRange(startY, endY);
+    for_each_bgr_const_byte(stripe, binMat.rowRange(startY, endY), f);
+  });
+}
+
+template <typename F>
+void for_each_byte_const_bgr_par (Mat & binMat, const Mat & mat, F f) noexcept
+{
+#if defined(DEBUG)
+  assert(mat.size() == binMat.size());
+#endif // DEBUG
+  
+  for_each_row_stripe(binMat.rows, [&binMat, &mat, &f](int startY, int endY) {
+    Mat stripe = binMat.rowRange(startY, endY);
+    for_each_byte_const_bgr(stripe, mat.rowRange(startY, endY), f);
+  });
+}
+
+// ROI versions of the parallel iterators
+
+template <typename F>
+void for_each_const_byte_par (const Mat & binMat, const cv::Rect & roi, F f) noexcept
+{
+  for_each_const_byte_par(binMat(roi), f);
+}
+
+template <typename F>
+void for_each_byte_par (Mat & binMat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat = binMat(roi);
+  for_each_byte_par(roiMat, f);
+}
+
+template <typename F>
+void for_each_byte_par (Mat & binMat1, const Mat & binMat2, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat1 = binMat1(roi);
+  for_each_byte_par(roiMat1, binMat2(roi), f);
+}
+
+template <typename F>
+void for_each_const_bgr_par (const Mat & mat, const cv::Rect & roi, F f) noexcept
+{
+  for_each_const_bgr_par(mat(roi), f);
+}
+
+template <typename F>
+void for_each_bgr_par (Mat & mat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat = mat(roi);
+  for_each_bgr_par(roiMat, f);
+}
+
+template <typename F>
+void for_each_bgr_par (Mat & mat1, const Mat & mat2, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat1 = mat1(roi);
+  for_each_bgr_par(roiMat1, mat2(roi), f);
+}
+
+template <typename F>
+void for_each_bgr_const_byte_par (Mat & mat, const Mat & binMat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiMat = mat(roi);
+  for_each_bgr_const_byte_par(roiMat, binMat(roi), f);
+}
+
+template <typename F>
+void for_each_byte_const_bgr_par (Mat & binMat, const Mat & mat, const cv::Rect & roi, F f) noexcept
+{
+  Mat roiBinMat = binMat(roi);
+  for_each_byte_const_bgr_par(roiBinMat, mat(roi), f);
+}
+
 #endif // OPENCV_MAT_ITER_H
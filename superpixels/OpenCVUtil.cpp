@@ -8,203 +8,324 @@
 
 #include "OpenCVIter.hpp"
 
-// Print SSIM for two images to cout
+#include <opencv2/core/hal/intrin.hpp>
 
-int printSSIM(Mat inImage1, Mat inImage2)
-{
-  // default settings
-  double C1 = 6.5025, C2 = 58.5225;
-  
-  IplImage
-		*img1=NULL, *img2=NULL, *img1_img2=NULL,
-		*img1_temp=NULL, *img2_temp=NULL,
-		*img1_sq=NULL, *img2_sq=NULL,
-		*mu1=NULL, *mu2=NULL,
-		*mu1_sq=NULL, *mu2_sq=NULL, *mu1_mu2=NULL,
-		*sigma1_sq=NULL, *sigma2_sq=NULL, *sigma12=NULL,
-		*ssim_map=NULL, *temp1=NULL, *temp2=NULL, *temp3=NULL;
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
 
-  IplImage tmpCopy1 = inImage1;
-  IplImage tmpCopy2 = inImage2;
-  
-  img1_temp = &tmpCopy1;
-  img2_temp = &tmpCopy2;
-  
-  int x=img1_temp->width, y=img1_temp->height;
-  int nChan=img1_temp->nChannels, d=IPL_DEPTH_32F;
-  CvSize size = cvSize(x, y);
-  
-  img1 = cvCreateImage(size, d, nChan);
-  img2 = cvCreateImage(size, d, nChan);
-  
-  cvConvert(img1_temp, img1);
-  cvConvert(img2_temp, img2);
-  cvReleaseImage(&img1_temp);
-  img1_temp = NULL;
-  cvReleaseImage(&img2_temp);
-  img2_temp = NULL;
-  
-  img1_sq = cvCreateImage( size, d, nChan);
-  img2_sq = cvCreateImage( size, d, nChan);
-  img1_img2 = cvCreateImage( size, d, nChan);
-  
-  cvPow( img1, img1_sq, 2 );
-  cvPow( img2, img2_sq, 2 );
-  cvMul( img1, img2, img1_img2, 1 );
+// Gaussian window and constants of the SSIM index, the same 11x11 window with
+// sigma 1.5 as the original matlab program.
+
+static const int fusedSSIMRadius = 5;
+static const int fusedSSIMTaps = 2 * fusedSSIMRadius + 1;
+
+static const float fusedSSIMC1 = 6.5025f;
+static const float fusedSSIMC2 = 58.5225f;
+
+// The 5 moments of each pixel, a, b, a*a, b*b and a*b
+
+static const int fusedSSIMNumMoments = 5;
+
+typedef struct {
+  // Sum of the SSIM of each channel over the pixels of the tile
+  double channelSums[4];
+  // Sum and count of the channel mean SSIM of each label in the tile
+  unordered_map<int32_t, pair<double, int64_t> > regionSums;
+} FusedSSIMTileResult;
+
+// SSIM of each tile of output pixels. The rows of a tile plus the window radius
+// above and below are filtered horizontally into a buffer of moments for the
+// tile, then each output pixel is filtered vertically from the buffer and
+// reduced to the SSIM formula, so no full size float image is allocated.
+
+class FusedSSIMParallelBody : public cv::ParallelLoopBody
+{
+public:
+  FusedSSIMParallelBody(const Mat &_img1, const Mat &_img2, const Mat *_labels, int _tileSize, const float *_weights, vector<FusedSSIMTileResult> &_tileResults)
+  : img1(_img1), img2(_img2), labels(_labels), tileSize(_tileSize), weights(_weights), tileResults(_tileResults) {}
   
-  mu1 = cvCreateImage( size, d, nChan);
-  mu2 = cvCreateImage( size, d, nChan);
+  void operator()(const cv::Range& range) const {
+    const int width = img1.cols;
+    const int height = img1.rows;
+    const int nChan = img1.channels();
+    const int numTilesX = (width + tileSize - 1) / tileSize;
+    
+    // Moments of a row are stored as [x][channel][moment]
+    
+    const int pixelStride = nChan * fusedSSIMNumMoments;
+    
+    vector<float> momentRows((tileSize + 2 * fusedSSIMRadius) * tileSize * pixelStride);
+    
+    for ( int tilei = range.start; tilei < range.end; tilei++ ) {
+      const int x0 = (tilei % numTilesX) * tileSize;
+      const int y0 = (tilei / numTilesX) * tileSize;
+      const int tileWidth = mini(tileSize, width - x0);
+      const int tileHeight = mini(tileSize, height - y0);
+      
+      FusedSSIMTileResult &result = tileResults[tilei];
+      
+      for ( int c = 0; c < 4; c++ ) {
+        result.channelSums[c] = 0.0;
+      }
+      
+      // Horizontal pass, edge rows and columns are replicated as with cvSmooth()
+      
+      for ( int ry = 0; ry < tileHeight + 2 * fusedSSIMRadius; ry++ ) {
+        const int y = mini(maxi(y0 + ry - fusedSSIMRadius, 0), height - 1);
+        const uint8_t *row1 = img1.ptr<uint8_t>(y);
+        const uint8_t *row2 = img2.ptr<uint8_t>(y);
+        float *outPtr = &momentRows[ry * tileSize * pixelStride];
+        
+        for ( int tx = 0; tx < tileWidth; tx++ ) {
+          float *pixelPtr = outPtr + tx * pixelStride;
+          
+          for ( int i = 0; i < pixelStride; i++ ) {
+            pixelPtr[i] = 0.0f;
+          }
+          
+          for ( int k = 0; k < fusedSSIMTaps; k++ ) {
+            const int x = mini(maxi(x0 + tx + k - fusedSSIMRadius, 0), width - 1);
+            const float w = weights[k];
+            
+            for ( int c = 0; c < nChan; c++ ) {
+              const float a = row1[x * nChan + c];
+              const float b = row2[x * nChan + c];
+              float *momentPtr = pixelPtr + c * fusedSSIMNumMoments;
+              momentPtr[0] += w * a;
+              momentPtr[1] += w * b;
+              momentPtr[2] += w * (a * a);
+              momentPtr[3] += w * (b * b);
+              momentPtr[4] += w * (a * b);
+            }
+          }
+        }
+      }
+      
+      // Vertical pass and the SSIM formula
+      
+      int32_t lastLabel = -1;
+      pair<double, int64_t> *lastRegionSums = NULL;
+      
+      for ( int ty = 0; ty < tileHeight; ty++ ) {
+        const int32_t *labelsRow = (labels == NULL) ? NULL : labels->ptr<int32_t>(y0 + ty);
+        
+        for ( int tx = 0; tx < tileWidth; tx++ ) {
+          float moments[4 * fusedSSIMNumMoments];
+          
+          for ( int i = 0; i < pixelStride; i++ ) {
+            moments[i] = 0.0f;
+          }
+          
+          for ( int k = 0; k < fusedSSIMTaps; k++ ) {
+            const float *pixelPtr = &momentRows[((ty + k) * tileSize + tx) * pixelStride];
+            const float w = weights[k];
+            
+            for ( int i = 0; i < pixelStride; i++ ) {
+              moments[i] += w * pixelPtr[i];
+            }
+          }
+          
+          float pixelSum = 0.0f;
+          
+          for ( int c = 0; c < nChan; c++ ) {
+            const float *momentPtr = &moments[c * fusedSSIMNumMoments];
+            const float mu1 = momentPtr[0];
+            const float mu2 = momentPtr[1];
+            const float mu1mu2 = mu1 * mu2;
+            const float mu1Sq = mu1 * mu1;
+            const float mu2Sq = mu2 * mu2;
+            const float sigma1Sq = momentPtr[2] - mu1Sq;
+            const float sigma2Sq = momentPtr[3] - mu2Sq;
+            const float sigma12 = momentPtr[4] - mu1mu2;
+            
+            const float ssim = ((2.0f * mu1mu2 + fusedSSIMC1) * (2.0f * sigma12 + fusedSSIMC2)) /
+              ((mu1Sq + mu2Sq + fusedSSIMC1) * (sigma1Sq + sigma2Sq + fusedSSIMC2));
+            
+            result.channelSums[c] += ssim;
+            pixelSum += ssim;
+          }
+          
+          if (labelsRow != NULL) {
+            const int32_t label = labelsRow[x0 + tx];
+            
+            if (label != lastLabel || lastRegionSums == NULL) {
+              lastLabel = label;
+              lastRegionSums = &result.regionSums[label];
+            }
+            
+            lastRegionSums->first += pixelSum / nChan;
+            lastRegionSums->second += 1;
+          }
+        }
+      }
+    }
+  }
   
-  mu1_sq = cvCreateImage( size, d, nChan);
-  mu2_sq = cvCreateImage( size, d, nChan);
-  mu1_mu2 = cvCreateImage( size, d, nChan);
+private:
+  const Mat &img1;
+  const Mat &img2;
+  const Mat *labels;
+  const int tileSize;
+  const float *weights;
+  vector<FusedSSIMTileResult> &tileResults;
+};
+
+double fusedSSIM(const Mat &img1, const Mat &img2, cv::Scalar *channelSSIM, const Mat *labels, vector<double> *regionSSIM, int tileSize)
+{
+  if (img1.size() != img2.size() || img1.type() != img2.type()) {
+    cerr << "error : fusedSSIM images must be the same size and type" << endl;
+    return -1.0;
+  }
   
+  if (img1.type() != CV_8UC1 && img1.type() != CV_8UC3) {
+    cerr << "error : fusedSSIM images must be CV_8UC1 or CV_8UC3" << endl;
+    return -1.0;
+  }
   
-  sigma1_sq = cvCreateImage( size, d, nChan);
-  sigma2_sq = cvCreateImage( size, d, nChan);
-  sigma12 = cvCreateImage( size, d, nChan);
+  if (labels != NULL && (labels->type() != CV_32SC1 || labels->size() != img1.size())) {
+    cerr << "error : fusedSSIM labels must be CV_32SC1 and the size of the images" << endl;
+    return -1.0;
+  }
   
-  temp1 = cvCreateImage( size, d, nChan);
-  temp2 = cvCreateImage( size, d, nChan);
-  temp3 = cvCreateImage( size, d, nChan);
+  if (img1.empty()) {
+    return 1.0;
+  }
   
-  ssim_map = cvCreateImage( size, d, nChan);
+  if (tileSize < 1) {
+    tileSize = 64;
+  }
   
-  // ************************** END INITS **********************************
+  // Normalized Gaussian weights
   
-  //////////////////////////////////////////////////////////////////////////
-  // PRELIMINARY COMPUTING
-  cvSmooth( img1, mu1, CV_GAUSSIAN, 11, 11, 1.5 );
-  cvSmooth( img2, mu2, CV_GAUSSIAN, 11, 11, 1.5 );
+  float weights[fusedSSIMTaps];
   
-  cvPow( mu1, mu1_sq, 2 );
-  cvPow( mu2, mu2_sq, 2 );
-  cvMul( mu1, mu2, mu1_mu2, 1 );
+  {
+    const double sigma = 1.5;
+    double sum = 0.0;
+    double dWeights[fusedSSIMTaps];
+    
+    for ( int k = 0; k < fusedSSIMTaps; k++ ) {
+      const double d = k - fusedSSIMRadius;
+      dWeights[k] = exp(-(d * d) / (2.0 * sigma * sigma));
+      sum += dWeights[k];
+    }
+    
+    for ( int k = 0; k < fusedSSIMTaps; k++ ) {
+      weights[k] = (float) (dWeights[k] / sum);
+    }
+  }
   
+  const int numTilesX = (img1.cols + tileSize - 1) / tileSize;
+  const int numTilesY = (img1.rows + tileSize - 1) / tileSize;
   
-  cvSmooth( img1_sq, sigma1_sq, CV_GAUSSIAN, 11, 11, 1.5 );
-  cvAddWeighted( sigma1_sq, 1, mu1_sq, -1, 0, sigma1_sq );
+  vector<FusedSSIMTileResult> tileResults(numTilesX * numTilesY);
   
-  cvSmooth( img2_sq, sigma2_sq, CV_GAUSSIAN, 11, 11, 1.5 );
-  cvAddWeighted( sigma2_sq, 1, mu2_sq, -1, 0, sigma2_sq );
+  parallelFor(Range(0, (int) tileResults.size()), FusedSSIMParallelBody(img1, img2, labels, tileSize, weights, tileResults));
   
-  cvSmooth( img1_img2, sigma12, CV_GAUSSIAN, 11, 11, 1.5 );
-  cvAddWeighted( sigma12, 1, mu1_mu2, -1, 0, sigma12 );
+  // Reduce in tile order so that the sums do not depend on the threads
   
+  const int nChan = img1.channels();
+  double channelSums[4] = { 0.0, 0.0, 0.0, 0.0 };
   
-  //////////////////////////////////////////////////////////////////////////
-  // FORMULA
+  if (regionSSIM != NULL) {
+    regionSSIM->clear();
+  }
   
-  // (2*mu1_mu2 + C1)
-  cvScale( mu1_mu2, temp1, 2 );
-  cvAddS( temp1, cvScalarAll(C1), temp1 );
+  vector<int64_t> regionCounts;
   
-  // (2*sigma12 + C2)
-  cvScale( sigma12, temp2, 2 );
-  cvAddS( temp2, cvScalarAll(C2), temp2 );
+  for ( FusedSSIMTileResult &result : tileResults ) {
+    for ( int c = 0; c < nChan; c++ ) {
+      channelSums[c] += result.channelSums[c];
+    }
+    
+    if (regionSSIM == NULL) {
+      continue;
+    }
+    
+    for ( auto &pair : result.regionSums ) {
+      const int32_t label = pair.first;
+      
+      if (label < 0) {
+        continue;
+      }
+      
+      if ((size_t) label >= regionSSIM->size()) {
+        regionSSIM->resize(label + 1, 0.0);
+        regionCounts.resize(label + 1, 0);
+      }
+      
+      (*regionSSIM)[label] += pair.second.first;
+      regionCounts[label] += pair.second.second;
+    }
+  }
   
-  // ((2*mu1_mu2 + C1).*(2*sigma12 + C2))
-  cvMul( temp1, temp2, temp3, 1 );
+  if (regionSSIM != NULL) {
+    for ( size_t i = 0; i < regionSSIM->size(); i++ ) {
+      if (regionCounts[i] > 0) {
+        (*regionSSIM)[i] /= regionCounts[i];
+      }
+    }
+  }
   
-  // (mu1_sq + mu2_sq + C1)
-  cvAdd( mu1_sq, mu2_sq, temp1 );
-  cvAddS( temp1, cvScalarAll(C1), temp1 );
+  const double numPixels = (double) img1.total();
+  double sum = 0.0;
   
-  // (sigma1_sq + sigma2_sq + C2)
-  cvAdd( sigma1_sq, sigma2_sq, temp2 );
-  cvAddS( temp2, cvScalarAll(C2), temp2 );
+  if (channelSSIM != NULL) {
+    *channelSSIM = cv::Scalar::all(0.0);
+  }
   
-  // ((mu1_sq + mu2_sq + C1).*(sigma1_sq + sigma2_sq + C2))
-  cvMul( temp1, temp2, temp1, 1 );
+  for ( int c = 0; c < nChan; c++ ) {
+    const double channelMean = channelSums[c] / numPixels;
+    if (channelSSIM != NULL) {
+      (*channelSSIM)[c] = channelMean;
+    }
+    sum += channelMean;
+  }
   
-  // ((2*mu1_mu2 + C1).*(2*sigma12 + C2))./((mu1_sq + mu2_sq + C1).*(sigma1_sq + sigma2_sq + C2))
-  cvDiv( temp3, temp1, ssim_map, 1 );
+  return sum / nChan;
+}
+
+// Print SSIM for two images to cout
+
+int printSSIM(Mat inImage1, Mat inImage2)
+{
+  cv::Scalar channelSSIM;
   
-  CvScalar index_scalar = cvAvg( ssim_map );
+  if (fusedSSIM(inImage1, inImage2, &channelSSIM) < 0.0) {
+    return 1;
+  }
   
   // through observation, there is approximately
   // 1% error max with the original matlab program
   
   cout << "(R, G & B SSIM index)" << endl ;
-  cout << index_scalar.val[2] * 100 << "%" << endl ;
-  cout << index_scalar.val[1] * 100 << "%" << endl ;
-  cout << index_scalar.val[0] * 100 << "%" << endl ;
-  
-  // Release the images
-  
-  if (img1) {
-    cvReleaseImage(&img1);
-  }
-  if (img2) {
-    cvReleaseImage(&img2);
-  }
-  if (img1_img2) {
-    cvReleaseImage(&img1_img2);
-  }
-  if (img1_temp) {
-    cvReleaseImage(&img1_temp);
-  }
-  if (img2_temp) {
-    cvReleaseImage(&img2_temp);
-  }
-  if (img1_sq) {
-    cvReleaseImage(&img1_sq);
-  }
-  if (img2_sq) {
-    cvReleaseImage(&img2_sq);
-  }
-  if (mu1) {
-    cvReleaseImage(&mu1);
-  }
-  if (mu2) {
-    cvReleaseImage(&mu2);
-  }
-  if (mu1_sq) {
-    cvReleaseImage(&mu1_sq);
-  }
-  if (mu2_sq) {
-    cvReleaseImage(&mu2_sq);
-  }
-  if (mu1_mu2) {
-    cvReleaseImage(&mu1_mu2);
-  }
-  if (sigma1_sq) {
-    cvReleaseImage(&sigma1_sq);
-  }
-  if (sigma2_sq) {
-    cvReleaseImage(&sigma2_sq);
-  }
-  if (sigma12) {
-    cvReleaseImage(&sigma12);
-  }
-  if (ssim_map) {
-    cvReleaseImage(&ssim_map);
-  }
-  if (temp1) {
-    cvReleaseImage(&temp1);
-  }
-  if (temp2) {
-    cvReleaseImage(&temp2);
-  }
-  if (temp3) {
-    cvReleaseImage(&temp3);
-  }
+  cout << channelSSIM.val[2] * 100 << "%" << endl ;
+  cout << channelSSIM.val[1] * 100 << "%" << endl ;
+  cout << channelSSIM.val[0] * 100 << "%" << endl ;
   
   return 0;
 }
 
-// Find a single "center" pixel in region of interest matrix. This logic
-// accepts an input matrix that contains binary pixel values (0x0 or 0xFF)
-// and computes a consistent center pixel. When this method returns the
-// region binMat is unchanged. The orderMat is set to the size of the roi and
-// it is filled with distance transformed gray values. Note that this method
-// has to create a buffer zone of 1 pixel so that pixels on the edge have
-// a very small distance.
+// Distance transform buffers for each thread, so that the transform of each region
+// reuses the buffers from the previous region.
 
-Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
+static thread_local vf::DistanceTransform::Meijster::Scratch meijsterScratch;
+
+// Images with at least this many pixels are transformed with calculateParallel()
+
+static const int parallelDistanceTransformMinPixels = 512 * 512;
+
+// findRegionCenter() without the cache
+
+static
+Coord calcRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
 {
-  const bool debug = true;
-  const bool debugDumpAllImages = true;
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpAllImages = isDebugTagImagesEnabled(tag);
   
   assert(binMat.channels() == 1);
   
@@ -247,7 +368,7 @@ Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << regionMat.cols << " x " << regionMat.rows << " )" << endl;
-    imwrite(filename, regionMat);
+    debugImwrite(filename, regionMat);
   }
   
   // Run distance transform
@@ -284,7 +405,11 @@ Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
   //vf::DistanceTransform::Meijster::EuclideanMetric metric;
   vf::DistanceTransform::Meijster::ManhattanMetric metric;
   
-  vf::DistanceTransform::Meijster::calculate(distMatOut, whiteTest, distMat.cols, distMat.rows, metric);
+  if ((distMat.cols * distMat.rows) >= parallelDistanceTransformMinPixels) {
+    vf::DistanceTransform::Meijster::calculateParallel(distMatOut, whiteTest, distMat.cols, distMat.rows, metric, meijsterScratch);
+  } else {
+    vf::DistanceTransform::Meijster::calculate(distMatOut, whiteTest, distMat.cols, distMat.rows, metric, meijsterScratch);
+  }
   
   if (debugDumpAllImages) {
     std::ostringstream stringStream;
@@ -293,7 +418,7 @@ Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << distMat.cols << " x " << distMat.rows << " )" << endl;
-    imwrite(filename, distMat);
+    debugImwrite(filename, distMat);
   }
   
   // Check the distance transform matrix here, the number of non-zero values must
@@ -342,7 +467,7 @@ Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << distMat.cols << " x " << distMat.rows << " )" << endl;
-    imwrite(filename, distMat);
+    debugImwrite(filename, distMat);
   }
   
   // Threshold so that only those pixels with the value 255 are left and save into regionMat
@@ -358,7 +483,7 @@ Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << regionMat.cols << " x " << regionMat.rows << " )" << endl;
-    imwrite(filename, regionMat);
+    debugImwrite(filename, regionMat);
   }
   
   // If the distance transform returns more than 1 pixel with the maximum
@@ -590,7 +715,7 @@ Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
     const char *filename = str.c_str();
     
     cout << "write " << filename << " ( " << colorMat.cols << " x " << colorMat.rows << " )" << endl;
-    imwrite(filename, colorMat);
+    debugImwrite(filename, colorMat);
   }
   
   // Copy the dist values back into distMat taking the border into account
@@ -617,6 +742,139 @@ Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
   return centerPair;
 }
 
+// Distance fields of the regions most recently centered on this thread keyed by
+// tag. An entry is only used when the roi has the same size, hash and pixels as
+// the roi it was computed from.
+
+typedef struct {
+  uint64_t hash;
+  Mat mask;
+  Mat distMat;
+  Coord center;
+} RegionCenterCacheEntry;
+
+static thread_local unordered_map<int, RegionCenterCacheEntry> regionCenterCache;
+
+static thread_local int64_t regionCenterCachePixels = 0;
+
+static atomic<int> regionCenterCacheMaxPixels(4 * 1024 * 1024);
+
+void setRegionCenterCacheMaxPixels(int maxPixels)
+{
+  regionCenterCacheMaxPixels = maxi(maxPixels, 0);
+}
+
+int getRegionCenterCacheMaxPixels()
+{
+  return regionCenterCacheMaxPixels;
+}
+
+void clearRegionCenterCache()
+{
+  regionCenterCache.clear();
+  regionCenterCachePixels = 0;
+}
+
+// Hash of the pixels of a CV_8UC1 roi, 8 pixels at a time
+
+static uint64_t hashRegionMask(const Mat &binROIMat)
+{
+  uint64_t hash = ((uint64_t) binROIMat.cols << 32) ^ (uint64_t) binROIMat.rows;
+  
+  for ( int y = 0; y < binROIMat.rows; y++ ) {
+    const uint8_t *rowPtr = binROIMat.ptr<uint8_t>(y);
+    int x = 0;
+    
+    for ( ; x + 8 <= binROIMat.cols; x += 8 ) {
+      uint64_t word;
+      memcpy(&word, rowPtr + x, sizeof(word));
+      hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+      hash ^= hash >> 29;
+    }
+    
+    for ( ; x < binROIMat.cols; x++ ) {
+      hash = (hash ^ rowPtr[x]) * 0x100000001B3ULL;
+    }
+  }
+  
+  return hash;
+}
+
+static bool isSameRegionMask(const Mat &cachedMask, const Mat &binROIMat)
+{
+  if (cachedMask.size() != binROIMat.size()) {
+    return false;
+  }
+  
+  for ( int y = 0; y < binROIMat.rows; y++ ) {
+    if (memcmp(cachedMask.ptr<uint8_t>(y), binROIMat.ptr<uint8_t>(y), binROIMat.cols) != 0) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+// Find a single "center" pixel in region of interest matrix. This logic
+// accepts an input matrix that contains binary pixel values (0x0 or 0xFF)
+// and computes a consistent center pixel. When this method returns the
+// region binMat is unchanged. The orderMat is set to the size of the roi and
+// it is filled with distance transformed gray values. Note that this method
+// has to create a buffer zone of 1 pixel so that pixels on the edge have
+// a very small distance.
+
+Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag)
+{
+  const int64_t maxPixels = regionCenterCacheMaxPixels;
+  const int64_t numPixels = (int64_t) roi.width * roi.height;
+  
+  // Debug images are written each time the center is found
+  
+  if (maxPixels == 0 || numPixels > maxPixels || isDebugTagImagesEnabled(tag)) {
+    return calcRegionCenter(binMat, roi, outDistMat, tag);
+  }
+  
+  Mat binROIMat = binMat(roi);
+  
+  const uint64_t hash = hashRegionMask(binROIMat);
+  
+  auto it = regionCenterCache.find(tag);
+  
+  if (it != regionCenterCache.end()) {
+    RegionCenterCacheEntry &entry = it->second;
+    
+    if (entry.hash == hash && isSameRegionMask(entry.mask, binROIMat)) {
+      if (isDebugTraceEnabled()) {
+        cout << "region center cache hit for tag " << tag << endl;
+      }
+      
+      entry.distMat.copyTo(outDistMat);
+      return entry.center;
+    }
+    
+    // The region changed, the new field replaces the old one
+    
+    regionCenterCachePixels -= (int64_t) entry.mask.total();
+    regionCenterCache.erase(it);
+  }
+  
+  Coord center = calcRegionCenter(binMat, roi, outDistMat, tag);
+  
+  if ((regionCenterCachePixels + numPixels) > maxPixels) {
+    clearRegionCenterCache();
+  }
+  
+  RegionCenterCacheEntry &entry = regionCenterCache[tag];
+  entry.hash = hash;
+  entry.mask = binROIMat.clone();
+  entry.distMat = outDistMat.clone();
+  entry.center = center;
+  
+  regionCenterCachePixels += numPixels;
+  
+  return center;
+}
+
 // Given an input binary Mat (0x0 or 0xFF) perform a dilate() operation that will expand
 // the white region inside a black region. This makes use of a circular operator and
 // an expansion size indicated by the caller.
@@ -664,72 +922,402 @@ Mat decreaseWhiteInRegion(const Mat &binMat, int decreaseNumPixelsSize, int tag)
 // Given a superpixel tag that indicates a region segmented into 4x4 squares
 // map (X,Y) coordinates to a minimized Mat representation that can be
 // quickly morphed with minimal CPU and memory usage.
+//
+// Each expand step is a dilate() with the 3x3 MORPH_ELLIPSE element, which is
+// the 4 connected cross, so after N steps a block is white when it is within
+// N blocks in city block distance of a region block. The blocks are expanded
+// as rows of 64 bit words that only cover the region block bbox grown by the
+// number of steps, a step shifts and ORs each word with its left and right
+// neighbors and the words above and below.
+
+// Write the white blocks in the bit rows into a block Mat at roi
+
+static
+void blockBitsToMat(const vector<uint64_t> &bits, int numWords, const cv::Rect &roi, Mat &blockMat)
+{
+  for ( int y = 0; y < roi.height; y++ ) {
+    const uint64_t *rowBits = &bits[y * numWords];
+    uint8_t *rowPtr = blockMat.ptr<uint8_t>(roi.y + y) + roi.x;
+    
+    for ( int x = 0; x < roi.width; x++ ) {
+      rowPtr[x] = ((rowBits[x >> 6] >> (x & 63)) & 0x1) ? 0xFF : 0x0;
+    }
+  }
+}
+
+// Set the bit for the block of each coord, the bits cover roi in block coords
+
+template <int BlockDim>
+static
+void setBlockBitsForCoords(const vector<Coord> &coords, int superpixelDim, const cv::Rect &roi, int numWords, vector<uint64_t> &bits)
+{
+  // Consecutive coords usually map to the same block, so a block is only set
+  // when it differs from the block of the previous coord.
+  
+  int lastBlockX = -1;
+  int lastBlockY = -1;
+  
+  for ( Coord c : coords ) {
+    int blockX = BlockGridCoord<BlockDim>::toBlock(c.x, superpixelDim);
+    int blockY = BlockGridCoord<BlockDim>::toBlock(c.y, superpixelDim);
+    
+    if (blockX == lastBlockX && blockY == lastBlockY) {
+      continue;
+    }
+    
+    int x = blockX - roi.x;
+    int y = blockY - roi.y;
+    
+    bits[(y * numWords) + (x >> 6)] |= ((uint64_t) 1) << (x & 63);
+    
+    lastBlockX = blockX;
+    lastBlockY = blockY;
+  }
+}
 
 Mat expandBlockRegion(int32_t tag,
                       const vector<Coord> &coords,
                       int expandNum,
                       int blockWidth, int blockHeight,
-                      int superpixelDim)
+                      int superpixelDim,
+                      cv::Rect *blockRoi)
 {
   const bool debug = false;
-  const bool debugDumpImages = true;
+  const bool debugDumpImages = isDebugTagImagesEnabled(tag);
   
-  Mat morphBlockMat = Mat(blockHeight, blockWidth, CV_8UC1);
-  morphBlockMat = (Scalar) 0;
+  Mat expandedBlockMat(blockHeight, blockWidth, CV_8UC1, Scalar(0));
   
-  // Iterate over input coords and calcualte block coord to activate
+  if (blockRoi != NULL) {
+    *blockRoi = cv::Rect();
+  }
   
-//  int lastOffset = -1;
+  if (coords.empty()) {
+    return expandedBlockMat;
+  }
   
-  for ( Coord c : coords ) {
-    // Convert (X,Y) to block (X,Y)
-    
-    int blockX = c.x / superpixelDim;
-    int blockY = c.y / superpixelDim;
-    
-    if (debug) {
-      cout << "block with tag " << tag << " cooresponds to (X,Y) (" << c.x << "," << c.y << ")" << endl;
-      cout << "maps to block (X,Y) (" << blockX << "," << blockY << ")" << endl;
-    }
-    
-    // FIXME: optimize for case where (X,Y) is exactly the same as in the previous iteration and avoid
-    // writing to the Mat in that case. This shift is cheap.
-    
-    morphBlockMat.at<uint8_t>(blockY, blockX) = 0xFF;
+  // Block bbox of the region grown by expandNum and clipped to the block grid,
+  // no expand step can reach a block outside of this roi.
+  
+  int32_t originX, originY, regionWidth, regionHeight;
+  bbox(originX, originY, regionWidth, regionHeight, coords);
+  
+  int minBlockX = originX / superpixelDim;
+  int minBlockY = originY / superpixelDim;
+  int maxBlockX = (originX + regionWidth - 1) / superpixelDim;
+  int maxBlockY = (originY + regionHeight - 1) / superpixelDim;
+  
+  cv::Rect roi(minBlockX - expandNum, minBlockY - expandNum,
+               (maxBlockX - minBlockX + 1) + (expandNum * 2), (maxBlockY - minBlockY + 1) + (expandNum * 2));
+  roi &= cv::Rect(0, 0, blockWidth, blockHeight);
+  
+  const int numWords = (roi.width + 63) / 64;
+  const uint64_t lastWordMask = ((roi.width & 63) == 0) ? ~((uint64_t) 0) : ((((uint64_t) 1) << (roi.width & 63)) - 1);
+  const bool roiIsGrid = (roi.width == blockWidth) && (roi.height == blockHeight);
+  
+  vector<uint64_t> bits(roi.height * numWords, 0);
+  
+  if (superpixelDim == 4) {
+    setBlockBitsForCoords<4>(coords, superpixelDim, roi, numWords, bits);
+  } else {
+    setBlockBitsForCoords<0>(coords, superpixelDim, roi, numWords, bits);
   }
   
-  Mat expandedBlockMat;
-      
+  vector<uint64_t> expandedBits;
+  
   for (int expandStep = 0; expandStep <= expandNum; expandStep++ ) {
-    if (expandStep == 0) {
-      expandedBlockMat = morphBlockMat;
-    } else {
-      expandedBlockMat = expandWhiteInRegion(expandedBlockMat, 1, tag);
-    }
-    
-    int nzc = countNonZero(expandedBlockMat);
-    
-    if (nzc == (blockHeight * blockWidth)) {
-      if (debug) {
-      cout << "all pixels in Mat now white " << endl;
-      }
-      break;
+    if (expandStep > 0) {
+      expandedBits.resize(bits.size());
+      
+      for ( int y = 0; y < roi.height; y++ ) {
+        const uint64_t *rowBits = &bits[y * numWords];
+        const uint64_t *prevRowBits = (y > 0) ? (rowBits - numWords) : NULL;
+        const uint64_t *nextRowBits = (y < (roi.height - 1)) ? (rowBits + numWords) : NULL;
+        uint64_t *outBits = &expandedBits[y * numWords];
+        
+        for ( int w = 0; w < numWords; w++ ) {
+          uint64_t word = rowBits[w];
+          
+          uint64_t expanded = word | (word << 1) | (word >> 1);
+          
+          if (w > 0) {
+            expanded |= rowBits[w-1] >> 63;
+          }
+          if (w < (numWords - 1)) {
+            expanded |= rowBits[w+1] << 63;
+          }
+          if (prevRowBits != NULL) {
+            expanded |= prevRowBits[w];
+          }
+          if (nextRowBits != NULL) {
+            expanded |= nextRowBits[w];
+          }
+          
+          outBits[w] = expanded;
+        }
+        
+        outBits[numWords - 1] &= lastWordMask;
+      }
+      
+      bits.swap(expandedBits);
     }
     
     if (debugDumpImages) {
+      blockBitsToMat(bits, numWords, roi, expandedBlockMat);
+      
       std::stringstream fnameStream;
       fnameStream << "srm" << "_tag_" << tag << "_morph_block_" << expandStep << ".png";
       string fname = fnameStream.str();
       
-      imwrite(fname, expandedBlockMat);
+      debugImwrite(fname, expandedBlockMat);
       cout << "wrote " << fname << endl;
     }
     
+    // When the roi is the whole grid and every block is white the next
+    // steps cannot change anything.
+    
+    if (roiIsGrid) {
+      bool allWhite = true;
+      
+      for ( int y = 0; y < roi.height && allWhite; y++ ) {
+        const uint64_t *rowBits = &bits[y * numWords];
+        
+        for ( int w = 0; w < numWords; w++ ) {
+          uint64_t wordMask = (w == (numWords - 1)) ? lastWordMask : ~((uint64_t) 0);
+          
+          if (rowBits[w] != wordMask) {
+            allWhite = false;
+            break;
+          }
+        }
+      }
+      
+      if (allWhite) {
+        if (debug) {
+          cout << "all pixels in Mat now white " << endl;
+        }
+        break;
+      }
+    }
   } // for expandStep
   
+  blockBitsToMat(bits, numWords, roi, expandedBlockMat);
+  
+  if (blockRoi != NULL) {
+    *blockRoi = roi;
+  }
+  
   return expandedBlockMat;
 }
 
+void packPixels(const Mat &inImage, Mat &packedImage)
+{
+  assert(inImage.type() == CV_8UC3);
+  
+  packedImage.create(inImage.size(), CV_32SC1);
+  
+  for ( int y = 0; y < inImage.rows; y++ ) {
+    packPixelRow(inImage.ptr<uint8_t>(y), packedImage.ptr<uint32_t>(y), inImage.cols);
+  }
+}
+
+void packPixelRow(const uint8_t *bgr, uint32_t *pixels, int n)
+{
+  int x = 0;
+  
+#if CV_SIMD128
+  // Storing B G R 0 bytes interleaved writes little endian words equal to (R << 16) | (G << 8) | B
+  
+  const v_uint8x16 zero = v_setzero_u8();
+  
+  for ( ; x <= n - 16; x += 16 ) {
+    v_uint8x16 B, G, R;
+    v_load_deinterleave(bgr + (x * 3), B, G, R);
+    v_store_interleave((uint8_t*) (pixels + x), B, G, R, zero);
+  }
+#endif // CV_SIMD128
+  
+  for ( ; x < n; x++ ) {
+    const uint8_t *pixelPtr = bgr + (x * 3);
+    pixels[x] = ((uint32_t)pixelPtr[2] << 16) | ((uint32_t)pixelPtr[1] << 8) | pixelPtr[0];
+  }
+}
+
+void unpackPixelRow(const uint32_t *pixels, uint8_t *bgr, int n)
+{
+  int x = 0;
+  
+#if CV_SIMD128
+  // The bytes of each little endian word are B G R and the ignored top byte
+  
+  for ( ; x <= n - 16; x += 16 ) {
+    v_uint8x16 B, G, R, A;
+    v_load_deinterleave((const uint8_t*) (pixels + x), B, G, R, A);
+    v_store_interleave(bgr + (x * 3), B, G, R);
+  }
+#endif // CV_SIMD128
+  
+  for ( ; x < n; x++ ) {
+    uint32_t pixel = pixels[x];
+    uint8_t *pixelPtr = bgr + (x * 3);
+    pixelPtr[0] = pixel & 0xFF;
+    pixelPtr[1] = (pixel >> 8) & 0xFF;
+    pixelPtr[2] = (pixel >> 16) & 0xFF;
+  }
+}
+
+void gatherPixels(const Mat &image, const vector<Coord> &coords, uint32_t *pixels)
+{
+  const int numCoords = (int) coords.size();
+  
+  if (image.type() == CV_32SC1 && image.isContinuous()) {
+    const uint32_t *packedPtr = (const uint32_t *) image.data;
+    const int width = image.cols;
+    
+    for ( int i = 0; i < numCoords; i++ ) {
+      Coord c = coords[i];
+      pixels[i] = packedPtr[(c.y * width) + c.x] & 0x00FFFFFF;
+    }
+  } else {
+    assert(image.type() == CV_8UC3);
+    
+    for ( int i = 0; i < numCoords; i++ ) {
+      Coord c = coords[i];
+      Vec3b vec = image.at<Vec3b>(c.y, c.x);
+      pixels[i] = Vec3BToUID(vec);
+    }
+  }
+}
+
+#if CV_SIMD128
+// Sum of the squared channel deltas for 16 pairs of pixels as 4 vectors of 4 sums
+
+static inline
+void deltaE76SquaredSIMD(const Vec3b *labA, const Vec3b *labB, v_uint32x4 sums[4])
+{
+  v_uint8x16 A[3], B[3];
+  v_load_deinterleave((const uint8_t*) labA, A[0], A[1], A[2]);
+  v_load_deinterleave((const uint8_t*) labB, B[0], B[1], B[2]);
+  
+  for ( int i = 0; i < 4; i++ ) {
+    sums[i] = v_setzero_u32();
+  }
+  
+  for ( int c = 0; c < 3; c++ ) {
+    // A squared 8 bit delta fits in 16 bits
+    
+    v_uint16x8 d0, d1;
+    v_expand(v_absdiff(A[c], B[c]), d0, d1);
+    d0 = d0 * d0;
+    d1 = d1 * d1;
+    
+    v_uint32x4 s0, s1, s2, s3;
+    v_expand(d0, s0, s1);
+    v_expand(d1, s2, s3);
+    
+    sums[0] += s0;
+    sums[1] += s1;
+    sums[2] += s2;
+    sums[3] += s3;
+  }
+}
+#endif // CV_SIMD128
+
+static inline
+uint32_t deltaE76SquaredScalar(Vec3b a, Vec3b b)
+{
+  int dL = (int)a[0] - (int)b[0];
+  int dA = (int)a[1] - (int)b[1];
+  int dB = (int)a[2] - (int)b[2];
+  return (uint32_t) ((dL * dL) + (dA * dA) + (dB * dB));
+}
+
+void deltaE76Squared(const Vec3b *labA, const Vec3b *labB, uint32_t *out, int n)
+{
+  int i = 0;
+  
+#if CV_SIMD128
+  for ( ; i <= n - 16; i += 16 ) {
+    v_uint32x4 sums[4];
+    deltaE76SquaredSIMD(labA + i, labB + i, sums);
+    
+    for ( int j = 0; j < 4; j++ ) {
+      v_store(out + i + (j * 4), sums[j]);
+    }
+  }
+#endif // CV_SIMD128
+  
+  for ( ; i < n; i++ ) {
+    out[i] = deltaE76SquaredScalar(labA[i], labB[i]);
+  }
+}
+
+void deltaE76(const Vec3b *labA, const Vec3b *labB, float *out, int n)
+{
+  int i = 0;
+  
+#if CV_SIMD128
+  for ( ; i <= n - 16; i += 16 ) {
+    v_uint32x4 sums[4];
+    deltaE76SquaredSIMD(labA + i, labB + i, sums);
+    
+    // The largest sum is 3 * 255 * 255 so the sums are exact as floats
+    
+    for ( int j = 0; j < 4; j++ ) {
+      v_float32x4 f = v_cvt_f32(v_reinterpret_as_s32(sums[j]));
+      v_store(out + i + (j * 4), v_sqrt(f));
+    }
+  }
+#endif // CV_SIMD128
+  
+  for ( ; i < n; i++ ) {
+    out[i] = sqrtf((float) deltaE76SquaredScalar(labA[i], labB[i]));
+  }
+}
+
+bool tagsEqualUpToRelabel(const Mat &tags1, const Mat &tags2, int *numDifferentPixels)
+{
+  if (tags1.size() != tags2.size()) {
+    if (numDifferentPixels != NULL) {
+      *numDifferentPixels = maxi(tags1.rows * tags1.cols, tags2.rows * tags2.cols);
+    }
+    return false;
+  }
+  
+  Mat packed1, packed2;
+  packPixels(tags1, packed1);
+  packPixels(tags2, packed2);
+  
+  // A tag in either image is mapped to the tag at the first pixel where it is
+  // found, a pixel differs if either tag maps to something else.
+  
+  unordered_map<uint32_t, uint32_t> forward;
+  unordered_map<uint32_t, uint32_t> backward;
+  
+  int numDifferent = 0;
+  
+  const int numPixels = tags1.rows * tags1.cols;
+  const uint32_t *pixels1 = (const uint32_t *) packed1.data;
+  const uint32_t *pixels2 = (const uint32_t *) packed2.data;
+  
+  for ( int i = 0; i < numPixels; i++ ) {
+    uint32_t tag1 = pixels1[i];
+    uint32_t tag2 = pixels2[i];
+    
+    auto forwardIt = forward.insert(make_pair(tag1, tag2)).first;
+    auto backwardIt = backward.insert(make_pair(tag2, tag1)).first;
+    
+    if (forwardIt->second != tag2 || backwardIt->second != tag1) {
+      numDifferent += 1;
+    }
+  }
+  
+  if (numDifferentPixels != NULL) {
+    *numDifferentPixels = numDifferent;
+  }
+  
+  return numDifferent == 0;
+}
+
 // Given a Mat that contains pixels count each pixel and return a histogram
 // of the number of times each pixel is found in the image.
 
@@ -738,15 +1326,18 @@ void generatePixelHistogram(const Mat & inQuantPixels,
 {
   const bool debugOutput = false;
   
-  Mat quantOutputMat = inQuantPixels.clone();
-  quantOutputMat = (Scalar) 0;
-  
   if (inQuantPixels.channels() == 3) {
-    for(int y = 0; y < quantOutputMat.rows; y++) {
-      for(int x = 0; x < quantOutputMat.cols; x++) {
-        Vec3b vec = inQuantPixels.at<Vec3b>(y, x);
-        uint32_t pixel = Vec3BToUID(vec);
-        pixel &= 0x00FFFFFF; // Opaque 24BPP
+    // Quant pixels come in runs, so a run of the same pixel is counted
+    // before the table is updated.
+    
+    uint32_t runPixel = 0;
+    uint32_t runCount = 0;
+    
+    for(int y = 0; y < inQuantPixels.rows; y++) {
+      const Vec3b *rowPtr = inQuantPixels.ptr<Vec3b>(y);
+      
+      for(int x = 0; x < inQuantPixels.cols; x++) {
+        uint32_t pixel = Vec3BToUID(rowPtr[x]);
         
         if ((debugOutput)) {
           char buffer[1024];
@@ -754,12 +1345,24 @@ void generatePixelHistogram(const Mat & inQuantPixels,
           cout << buffer << endl;
         }
         
-        pixelToCountTable[pixel] += 1;
+        if (pixel != runPixel) {
+          if (runCount > 0) {
+            pixelToCountTable[runPixel] += runCount;
+          }
+          runPixel = pixel;
+          runCount = 0;
+        }
+        
+        runCount += 1;
       }
     }
+    
+    if (runCount > 0) {
+      pixelToCountTable[runPixel] += runCount;
+    }
   } else if (inQuantPixels.channels() == 4) {
-    for(int y = 0; y < quantOutputMat.rows; y++) {
-      for(int x = 0; x < quantOutputMat.cols; x++) {
+    for(int y = 0; y < inQuantPixels.rows; y++) {
+      for(int x = 0; x < inQuantPixels.cols; x++) {
         Vec4b vec = inQuantPixels.at<Vec4b>(y, x);
         uint32_t pixel = Vec4BToPixel(vec);
         
@@ -784,49 +1387,81 @@ void generatePixelHistogram(const Mat & inQuantPixels,
 // pixels to indexes in the colortable. If the asGreyscale) flag is true
 // then each index is assumed to be a byte and is written as a greyscale pixel.
 
-Mat mapQuantPixelsToColortableIndexes(const Mat & inQuantPixels, const vector<uint32_t> &colortable, bool asGreyscale)
+ColortableIndex::ColortableIndex(const vector<uint32_t> &colortable)
+{
+  vector<pair<uint32_t, int32_t> > pixelOffsets;
+  pixelOffsets.reserve(colortable.size());
+  
+  for ( int i = 0; i < (int) colortable.size(); i++ ) {
+    uint32_t pixel = colortable[i] & 0x00FFFFFF; // Opaque 24BPP
+    pixelOffsets.push_back(make_pair(pixel, i));
+  }
+  
+  sort(pixelOffsets.begin(), pixelOffsets.end());
+  
+  sortedPixels.reserve(pixelOffsets.size());
+  sortedOffsets.reserve(pixelOffsets.size());
+  
+  for ( auto &pair : pixelOffsets ) {
+    if (!sortedPixels.empty() && sortedPixels.back() == pair.first) {
+      // Sorted by offset, so the last duplicate has the largest offset
+      sortedOffsets.back() = pair.second;
+    } else {
+      sortedPixels.push_back(pair.first);
+      sortedOffsets.push_back(pair.second);
+    }
+  }
+}
+
+Mat mapQuantPixelsToColortableIndexes(const Mat & inQuantPixels, const vector<uint32_t> &colortable, bool asGreyscale, vector<uint32_t> *offsetCounts)
 {
   const bool debugOutput = false;
   
+  assert(inQuantPixels.type() == CV_8UC3);
+  
   // Map pixels to sorted colortable offset
   
-  unordered_map<uint32_t, uint32_t> pixel_to_sorted_offset;
+  ColortableIndex colortableIndex(colortable);
   
-  for (int i = 0; i < colortable.size(); i++) {
-    uint32_t pixel = colortable[i];
-    pixel &= 0x00FFFFFF; // Opaque 24BPP
-    pixel_to_sorted_offset[pixel] = i;
-#if defined(DEBUG)
-    assert(pixel_to_sorted_offset[pixel] <= 0xFF);
-    assert(pixel_to_sorted_offset[pixel] == i);
-#endif // DEBUG
-    
-    if ((debugOutput)) {
+  if ((debugOutput)) {
+    for (int i = 0; i < (int) colortable.size(); i++) {
       char buffer[1024];
-      snprintf(buffer, sizeof(buffer), "colortable[%4d] = 0x%08X", i, pixel);
+      snprintf(buffer, sizeof(buffer), "colortable[%4d] = 0x%08X", i, colortable[i] & 0x00FFFFFF);
       cout << buffer << endl;
     }
   }
   
-  Mat quantOutputMat = inQuantPixels.clone();
-  quantOutputMat = (Scalar) 0;
+  if (offsetCounts != NULL) {
+    offsetCounts->assign(colortable.size(), 0);
+  }
+  
+  Mat quantOutputMat(inQuantPixels.size(), CV_8UC3);
+  
+  // Neighbor quant pixels are often the same, so the last lookup is checked first
+  
+  uint32_t lastPixel = 0;
+  int32_t lastOffset = -1;
   
   for(int y = 0; y < quantOutputMat.rows; y++) {
+    const Vec3b *inRow = inQuantPixels.ptr<Vec3b>(y);
+    Vec3b *outRow = quantOutputMat.ptr<Vec3b>(y);
+    
     for(int x = 0; x < quantOutputMat.cols; x++) {
-      Vec3b vec = inQuantPixels.at<Vec3b>(y, x);
-      uint32_t pixel = Vec3BToUID(vec);
-      pixel &= 0x00FFFFFF; // Opaque 24BPP
+      uint32_t pixel = Vec3BToUID(inRow[x]);
       
-      auto it = pixel_to_sorted_offset.find(pixel);
-      
-      if (it == pixel_to_sorted_offset.end()) {
-        char buffer[1024];
-        snprintf(buffer, sizeof(buffer), "for (%4d,%4d) pixel is 0x%08X (%d) but this pixel has no matching colortable entry \n", x, y, pixel, pixel);
-        cerr << buffer;
-        assert(0);
+      if (lastOffset == -1 || pixel != lastPixel) {
+        lastOffset = colortableIndex.lookup(pixel);
+        lastPixel = pixel;
+        
+        if (lastOffset == -1) {
+          char buffer[1024];
+          snprintf(buffer, sizeof(buffer), "for (%4d,%4d) pixel is 0x%08X (%d) but this pixel has no matching colortable entry \n", x, y, pixel, pixel);
+          cerr << buffer;
+          assert(0);
+        }
       }
       
-      uint32_t offset = it->second;
+      uint32_t offset = (uint32_t) lastOffset;
       
       if ((debugOutput)) {
         char buffer[1024];
@@ -834,23 +1469,31 @@ Mat mapQuantPixelsToColortableIndexes(const Mat & inQuantPixels, const vector<ui
         cout << buffer << endl;
       }
       
+      if (offsetCounts != NULL) {
+        (*offsetCounts)[offset] += 1;
+      }
+      
       if (asGreyscale) {
         assert(offset < 256);
-        uint32_t grayscalePixel = (offset << 16) | (offset << 8) | offset;
-        vec = PixelToVec3b(grayscalePixel);
+        outRow[x] = Vec3b(offset, offset, offset);
       } else {
-        vec = PixelToVec3b(offset);
+        outRow[x] = PixelToVec3b(offset);
       }
-      quantOutputMat.at<Vec3b>(y, x) = vec;
     }
   }
   
   return quantOutputMat;
 }
 
-// Return color cube with divided by 5 points along each axis.
+#define SUBDIVIDED_COLORS_NUM_STEPS 5
 
-vector<uint32_t> getSubdividedColors() {
+static const uint32_t subdividedColorsSteps[SUBDIVIDED_COLORS_NUM_STEPS] = { 0, 63, 127, 191, 255 };
+
+// Color cube with divided by 5 points along each axis, this palette
+// is generated once by the SubdividedColors singleton.
+
+static
+vector<uint32_t> generateSubdividedColors() {
   // quant ranges:
   //
   // 0 <- (0,31)    = 32
@@ -863,8 +1506,8 @@ vector<uint32_t> getSubdividedColors() {
   // 0x00, 0x3F, 0x7F, 0xBE, 0xFF
   // 0     63    127   191   255
   
-  const uint32_t vals[] = { 0, 63, 127, 191, 255 };
-  const int numSteps = (sizeof(vals) / sizeof(uint32_t));
+  const uint32_t *vals = subdividedColorsSteps;
+  const int numSteps = SUBDIVIDED_COLORS_NUM_STEPS;
   
   if ((0)) {
     for (int i = 0; i < numSteps; i++) {
@@ -896,6 +1539,57 @@ vector<uint32_t> getSubdividedColors() {
   return pixels;
 }
 
+// The palette is the product of the same steps for R, G and B, so the nearest
+// entry can be found for each channel on its own. Each channel table holds the
+// nearest step for each byte value premultiplied by the offset stride of that
+// channel, ties go to the lower step so that the lowest palette offset wins.
+
+SubdividedColors::SubdividedColors()
+{
+  colors = generateSubdividedColors();
+  
+  const int numSteps = SUBDIVIDED_COLORS_NUM_STEPS;
+  
+  for (int v = 0; v < 256; v++) {
+    int bestStep = 0;
+    int bestDelta = abs(v - (int)subdividedColorsSteps[0]);
+    
+    for (int i = 1; i < numSteps; i++) {
+      int delta = abs(v - (int)subdividedColorsSteps[i]);
+      if (delta < bestDelta) {
+        bestDelta = delta;
+        bestStep = i;
+      }
+    }
+    
+    redOffsets[v] = bestStep * numSteps * numSteps;
+    greenOffsets[v] = bestStep * numSteps;
+    blueOffsets[v] = bestStep;
+  }
+}
+
+// C++11 guarantees that a function local static is initialized once even if
+// multiple threads call this method at the same time.
+
+const SubdividedColors & SubdividedColors::getInstance()
+{
+  static const SubdividedColors instance;
+  return instance;
+}
+
+void SubdividedColors::mapColors(const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr) const
+{
+  for (uint32_t i = 0; i < numPixels; i++) {
+    outPixelsPtr[i] = lookupColor(inPixelsPtr[i]);
+  }
+}
+
+// Return color cube with divided by 5 points along each axis.
+
+vector<uint32_t> getSubdividedColors() {
+  return SubdividedColors::getInstance().getColors();
+}
+
 // Vote for pixels that have neighbors that are the exact same value, this method examines each
 // pixel by getting the 8 connected neighbors and recoring a vote for a given pixel when it has
 // a neighbor that is exactly the same.
@@ -975,6 +1669,172 @@ void vote_for_identical_neighbors(unordered_map<uint32_t, uint32_t> &pixelToNumV
   return;
 }
 
+// Votes for one row of palette offsets, the neighbor rows are NULL at the top and bottom
+// of the image. Pixels away from the left and right edges compare all 8 neighbors without
+// branching on the mask, a neighbor adds a vote when its mask is on and it has the same offset.
+
+template <typename T>
+static inline
+void vote_for_identical_neighbors_row(uint32_t *votes,
+                                      const T *above, const T *row, const T *below,
+                                      const uint8_t *maskAbove, const uint8_t *maskRow, const uint8_t *maskBelow,
+                                      int width, int xStart, int xEnd,
+                                      int numColors)
+{
+  for ( int x = xStart; x < xEnd; x++ ) {
+    if (maskRow[x] == 0) {
+      continue;
+    }
+    
+    const T v = row[x];
+    
+#if defined(DEBUG)
+    assert(v >= 0 && (int)v < numColors);
+#endif // DEBUG
+    
+    uint32_t count;
+    
+    if (above != NULL && below != NULL && x > 0 && x < (width - 1)) {
+      count =
+      ((maskAbove[x-1] != 0) & (above[x-1] == v)) +
+      ((maskAbove[x] != 0) & (above[x] == v)) +
+      ((maskAbove[x+1] != 0) & (above[x+1] == v)) +
+      ((maskRow[x-1] != 0) & (row[x-1] == v)) +
+      ((maskRow[x+1] != 0) & (row[x+1] == v)) +
+      ((maskBelow[x-1] != 0) & (below[x-1] == v)) +
+      ((maskBelow[x] != 0) & (below[x] == v)) +
+      ((maskBelow[x+1] != 0) & (below[x+1] == v));
+    } else {
+      count = 0;
+      
+      const int xMin = maxi(0, x - 1);
+      const int xMax = mini(width - 1, x + 1);
+      
+      for ( int nx = xMin; nx <= xMax; nx++ ) {
+        if (above != NULL) {
+          count += (maskAbove[nx] != 0) & (above[nx] == v);
+        }
+        if (nx != x) {
+          count += (maskRow[nx] != 0) & (row[nx] == v);
+        }
+        if (below != NULL) {
+          count += (maskBelow[nx] != 0) & (below[nx] == v);
+        }
+      }
+    }
+    
+    votes[v] += count;
+  }
+}
+
+template <typename T>
+static
+void vote_for_identical_neighbors_typed(vector<uint32_t> &votes,
+                                        const Mat &indexImage,
+                                        const Mat &inMaskImage,
+                                        int numColors,
+                                        const cv::Rect &roi)
+{
+  const int width = indexImage.cols;
+  const int height = indexImage.rows;
+  
+  for ( int y = roi.y; y < (roi.y + roi.height); y++ ) {
+    const bool hasAbove = (y > 0);
+    const bool hasBelow = (y < (height - 1));
+    
+    vote_for_identical_neighbors_row<T>(votes.data(),
+                                        hasAbove ? indexImage.ptr<T>(y-1) : NULL,
+                                        indexImage.ptr<T>(y),
+                                        hasBelow ? indexImage.ptr<T>(y+1) : NULL,
+                                        hasAbove ? inMaskImage.ptr<uint8_t>(y-1) : NULL,
+                                        inMaskImage.ptr<uint8_t>(y),
+                                        hasBelow ? inMaskImage.ptr<uint8_t>(y+1) : NULL,
+                                        width, roi.x, roi.x + roi.width,
+                                        numColors);
+  }
+}
+
+void vote_for_identical_neighbors(vector<uint32_t> &votes,
+                                  const Mat &indexImage,
+                                  const Mat &inMaskImage,
+                                  int numColors,
+                                  cv::Rect roi)
+{
+  assert(indexImage.channels() == 1);
+  assert(inMaskImage.type() == CV_8UC1);
+  assert(indexImage.size() == inMaskImage.size());
+  
+  votes.assign(numColors, 0);
+  
+  roi &= cv::Rect(0, 0, indexImage.cols, indexImage.rows);
+  
+  switch (indexImage.depth()) {
+    case CV_8U: {
+      vote_for_identical_neighbors_typed<uint8_t>(votes, indexImage, inMaskImage, numColors, roi);
+      break;
+    }
+    case CV_16U: {
+      vote_for_identical_neighbors_typed<uint16_t>(votes, indexImage, inMaskImage, numColors, roi);
+      break;
+    }
+    case CV_32S: {
+      vote_for_identical_neighbors_typed<int32_t>(votes, indexImage, inMaskImage, numColors, roi);
+      break;
+    }
+    default: {
+      assert(0);
+    }
+  }
+}
+
+void mapPixelsToPaletteIndexes(const Mat &inImage,
+                               cv::Rect roi,
+                               Mat &indexImage,
+                               vector<uint32_t> &palette)
+{
+  assert(inImage.type() == CV_8UC3);
+  
+  indexImage.create(inImage.size(), CV_32SC1);
+  
+  roi &= cv::Rect(0, 0, inImage.cols, inImage.rows);
+  
+  unordered_map<uint32_t, int32_t> pixelToIndex;
+  
+  for ( int i = 0; i < (int) palette.size(); i++ ) {
+    pixelToIndex[palette[i]] = i;
+  }
+  
+  // Neighbor pixels are often the same, so the last lookup is checked first
+  
+  uint32_t lastPixel = 0;
+  int32_t lastIndex = -1;
+  
+  for ( int y = roi.y; y < (roi.y + roi.height); y++ ) {
+    const Vec3b *inRow = inImage.ptr<Vec3b>(y);
+    int32_t *outRow = indexImage.ptr<int32_t>(y);
+    
+    for ( int x = roi.x; x < (roi.x + roi.width); x++ ) {
+      uint32_t pixel = Vec3BToUID(inRow[x]);
+      
+      if (lastIndex == -1 || pixel != lastPixel) {
+        auto it = pixelToIndex.find(pixel);
+        
+        if (it == pixelToIndex.end()) {
+          lastIndex = (int32_t) palette.size();
+          pixelToIndex[pixel] = lastIndex;
+          palette.push_back(pixel);
+        } else {
+          lastIndex = it->second;
+        }
+        
+        lastPixel = pixel;
+      }
+      
+      outRow[x] = lastIndex;
+    }
+  }
+}
+
 // Given a series of 3D points, generate a center of mass in (x,y,z) for the points.
 
 Vec3b centerOfMass3d(const vector<Vec3b> &points)
@@ -1041,7 +1901,7 @@ uint32_t centerOfMassPixels(const vector<uint32_t> & pixels)
 
 vector<uint32_t> generateVector(uint32_t fromPixel, uint32_t toPixel)
 {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
   int32_t sR, sG, sB;
   
@@ -1146,40 +2006,8 @@ vector<Point2i> generatePointsOnLine(Point2i startP, Point2i endP)
   
   vector<Point2i> outPointsVec;
   
-  bool done = false;
-  
-  int numSteps = round(scale) + 2;
-  
-  Point2f startF = startP;
-  
-  for ( int i = 0; !done && i < numSteps; i++ ) {
-    Point2f pointVec = startF + (deltaUnit * i);
-    
-    if (debug && 1) {
-      cout << "at step " << i << " scaled vec " << (deltaUnit * i) << endl;
-      cout << "at step " << i << " point vec " << pointVec << endl;
-    }
-    
-    round(pointVec);
-    
-    if (debug) {
-      cout << "at step " << i << " rounded point vec " << pointVec << endl;
-    }
-    
-    Point2i pointVecP = pointVec;
-    
-    if (pointVecP == endP) {
-      // Reached the end point, stop processing now
-      done = true;
-    } else if (outPointsVec.size() > 0) {
-      Point2i lastP = outPointsVec[outPointsVec.size() - 1];
-      if (pointVecP == lastP) {
-        // In this case, the delta is so small that the int value did not change, skip
-        continue;
-      }
-    }
-    
-    outPointsVec.push_back(pointVecP);
+  for ( Point2i p : PointsOnLine<int>(startP, endP) ) {
+    outPointsVec.push_back(p);
   }
   
   // Verify that first point matches insidePixel and that last point matches outsidePixel
@@ -1211,7 +2039,7 @@ vector<Point2i> generatePointsOnLine(Point2i startP, Point2i endP)
 
 vector<Point2f> generateFloatPointsOnLine(const Point2f & startP, const Point2f & endP)
 {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
   Point2f deltaP = endP - startP;
   Point2f deltaUnit = deltaP;
@@ -1225,43 +2053,9 @@ vector<Point2f> generateFloatPointsOnLine(const Point2f & startP, const Point2f
   
   vector<Point2f> outPointsVec;
   
-  bool done = false;
-  
-  int numSteps = round(scale);
-  
-  if (numSteps < scale) {
-    // Rounded down, add 1
-    numSteps += 1;
-  }
-  
-  // Add 1 more point at end
-  numSteps += 1;
-  
-  Point2f startF = startP;
-  
-  for ( int i = 0; !done && i < numSteps; i++ ) {
-    Point2f pointVec = startF + (deltaUnit * i);
-    
-    if (debug && 1) {
-      cout << "at step " << i << " scaled vec " << (deltaUnit * i) << endl;
-      cout << "at step " << i << " point vec " << pointVec << endl;
-    }
-    
-    //Point2f deltaToEnd = endP - pointVec;
-    //float closeF = 0.75f;
-    
-    //if (debug) {
-    //  cout << "at step " << i << " deltaToEnd " << deltaToEnd << endl;
-    //}
-    
-//    if (fabs(deltaToEnd.x) < closeF && fabs(deltaToEnd.y) < closeF) {
-//      // Reached the end point, stop processing now
-//      //pointVec = endP;
-//      done = true;
-//    }
-    
-    outPointsVec.push_back(pointVec);
-  }
+  for ( Point2f p : PointsOnLine<float>(startP, endP) ) {
+    outPointsVec.push_back(p);
+  }
   
   // Verify that first point matches insidePixel and that last point matches outsidePixel
   
@@ -1288,148 +2082,183 @@ vector<Point2f> generateFloatPointsOnLine(const Point2f & startP, const Point2f
   return outPointsVec;
 }
 
-// Flood fill based on region of zero values. Input comes from inBinMask and the results
-// are written to outBinMask. Black pixels are filled and white pixels are not filled.
-
-int floodFillMask(Mat &inBinMask, Mat &outBinMask, Point2i startPoint, int connectivity)
+int scanlineFloodFill(const Mat &inBinMask,
+                      Mat &outBinMask,
+                      Point2i seed,
+                      int connectivity,
+                      cv::Rect roi,
+                      FloodFillScratch &scratch,
+                      cv::Rect *filledRect)
 {
-  const bool debug = true;
-  const bool debugDumpImages = true;
-  
+#if defined(DEBUG)
+  assert(inBinMask.type() == CV_8UC1);
+  assert(outBinMask.type() == CV_8UC1);
   assert(inBinMask.size() == outBinMask.size());
   assert(connectivity == 4 || connectivity == 8);
+#endif // DEBUG
   
-  if (debug) {
-    cout << "input dimensions " << inBinMask.cols << " x " << inBinMask.rows << endl;
-  }
+  roi &= cv::Rect(0, 0, inBinMask.cols, inBinMask.rows);
   
-  if (debugDumpImages) {
-    imwrite("flood_bin_mask_input.png", inBinMask);
+  if (!roi.contains(seed)) {
+    if (filledRect != NULL) {
+      *filledRect = cv::Rect();
+    }
+    return 0;
   }
   
-  Mat expandedMask(inBinMask.rows+2, inBinMask.cols+2, CV_8UC1);
-  
-  Rect filledRect;
-  
-  Rect borderRect(0, 0, inBinMask.cols+2, inBinMask.rows+2);
-  Rect maskROI(1, 1, inBinMask.cols, inBinMask.rows);
-  
-  Scalar scalarZero(0);
-  uint8_t maskFillByte = 0xFF;
-  Scalar maskFillColor(maskFillByte);
-  
-  int flags = connectivity + (maskFillByte << 8) | FLOODFILL_FIXED_RANGE | FLOODFILL_MASK_ONLY;
-  
-  Point seed(0, 0);
-  
-  // Flood fill into mask and determine which pixels are non-zero.
+  const int x0 = roi.x;
+  const int y0 = roi.y;
+  const int x1 = roi.x + roi.width;
+  const int y1 = roi.y + roi.height;
   
-  expandedMask = Scalar::all(0);
-  rectangle(expandedMask, borderRect, maskFillColor);
+  // Only the roi part of the visited flags is cleared
   
-  // Create a cropped mask that is the same size as the original input
+  vector<uint8_t> &visited = scratch.visited;
   
-  Mat croppedMask = expandedMask(maskROI);
-  
-  inBinMask.copyTo(croppedMask);
-  
-  if (debugDumpImages) {
-    imwrite("flood_bin_mask_input_with_border.png", expandedMask);
+  if (visited.size() < (size_t) roi.area()) {
+    visited.resize(roi.area());
   }
+  memset(visited.data(), 0, roi.area());
   
-  Mat copyOfInBinMask = inBinMask.clone();
+  auto visitedPtr = [&](int y)->uint8_t* {
+    return visited.data() + ((y - y0) * roi.width) - x0;
+  };
   
-  // Input is set to all on and then the fill is with black pixels
+  auto isFillable = [&](const uint8_t *inRow, const uint8_t *visitedRow, int x)->bool {
+    return visitedRow[x] == 0 && inRow[x] == 0;
+  };
   
-  inBinMask = Scalar(0);
+  vector<Point2i> &stack = scratch.stack;
+  stack.clear();
   
-  // Define seed point as the center of the image region.
+  int numFilled = 0;
+  int minX = seed.x, maxX = seed.x, minY = seed.y, maxY = seed.y;
   
-  seed.x = startPoint.x;
-  seed.y = startPoint.y;
+  const int diag = (connectivity == 8) ? 1 : 0;
   
-  if (debug) {
-    cout << "seed (" << seed.x << "," << seed.y << ") " << endl;
-  }
+  // Fill the span around the seed and then spans on the rows above and below,
+  // the seed is the only pixel that is filled without checking the input.
   
-  // Verify that the seed point is a non-zero value in mask taking
-  // into account the (+1, +1) ROI delta
+  bool isSeed = true;
+  stack.push_back(seed);
   
-  if (1) {
-    int maskX = maskROI.x + seed.x;
-    int maskY = maskROI.y + seed.y;
+  while (!stack.empty()) {
+    Point2i p = stack.back();
+    stack.pop_back();
     
-    if (debug) {
-      cout << "seed in mask (" << maskX << "," << maskY << ") " << endl;
+    const uint8_t *inRow = inBinMask.ptr<uint8_t>(p.y);
+    uint8_t *vRow = visitedPtr(p.y);
+    
+    if (isSeed) {
+      isSeed = false;
+    } else if (!isFillable(inRow, vRow, p.x)) {
+      continue;
     }
     
-    uint8_t bVal = expandedMask.at<uint8_t>(maskY, maskX);
-    assert(bVal != 0);
+    int xl = p.x;
+    int xr = p.x;
     
-    // In order for the fill to work, the seed point must be explicitly set to zero
+    while (xl > x0 && isFillable(inRow, vRow, xl - 1)) {
+      xl--;
+    }
+    while ((xr + 1) < x1 && isFillable(inRow, vRow, xr + 1)) {
+      xr++;
+    }
     
-    expandedMask.at<uint8_t>(maskY, maskX) = 0;
-  }
-
-  if (debugDumpImages) {
-    imwrite("flood_fill_input.png", inBinMask);
+    uint8_t *outRow = outBinMask.ptr<uint8_t>(p.y);
+    
+    for ( int x = xl; x <= xr; x++ ) {
+      vRow[x] = 1;
+      outRow[x] = 0xFF;
+    }
+    
+    numFilled += (xr - xl + 1);
+    minX = mini(minX, xl);
+    maxX = maxi(maxX, xr);
+    minY = mini(minY, p.y);
+    maxY = maxi(maxY, p.y);
+    
+    // Push the first pixel of each fillable run next to the span
+    
+    const int scanL = maxi(x0, xl - diag);
+    const int scanR = mini(x1 - 1, xr + diag);
+    
+    for ( int ny = p.y - 1; ny <= p.y + 1; ny += 2 ) {
+      if (ny < y0 || ny >= y1) {
+        continue;
+      }
+      
+      const uint8_t *nInRow = inBinMask.ptr<uint8_t>(ny);
+      const uint8_t *nvRow = visitedPtr(ny);
+      
+      bool inRun = false;
+      
+      for ( int x = scanL; x <= scanR; x++ ) {
+        if (isFillable(nInRow, nvRow, x)) {
+          if (!inRun) {
+            stack.push_back(Point2i(x, ny));
+            inRun = true;
+          }
+        } else {
+          inRun = false;
+        }
+      }
+    }
   }
   
-  if (debugDumpImages) {
-    imwrite("flood_fill_mask_expanded_input.png", expandedMask);
+  if (filledRect != NULL) {
+    *filledRect = cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
   }
   
-  int numFilled = floodFill(inBinMask, expandedMask, seed, maskFillColor, &filledRect, scalarZero, scalarZero, flags);
+  return numFilled;
+}
 
+// Flood fill based on region of zero values. Input comes from inBinMask and the results
+// are written to outBinMask. Black pixels are filled and white pixels are not filled.
+
+int floodFillMask(Mat &inBinMask, Mat &outBinMask, Point2i startPoint, int connectivity)
+{
+  const bool debug = isDebugTraceEnabled();
+  const bool debugDumpImages = isDebugStageImagesEnabled();
+  
+  assert(inBinMask.size() == outBinMask.size());
+  assert(connectivity == 4 || connectivity == 8);
+  
   if (debug) {
-    cout << "numFilled " << numFilled << endl;
-    cout << "flood fill bbox (" << filledRect.x << "," << filledRect.y << ") " << filledRect.width << " x " << filledRect.height << endl;
+    cout << "input dimensions " << inBinMask.cols << " x " << inBinMask.rows << endl;
+    cout << "seed (" << startPoint.x << "," << startPoint.y << ") " << endl;
   }
   
   if (debugDumpImages) {
-    imwrite("flood_fill_output.png", inBinMask);
-    
-    imwrite("flood_fill_mask_expanded_output.png", expandedMask);
+    debugImwrite("flood_bin_mask_input.png", inBinMask);
   }
   
-  // Fill must have at least filled 1 pixel
+  // The seed point must be a non-zero value in the input
   
-  assert(numFilled > 0);
-  assert(filledRect.width > 0);
-  assert(filledRect.height > 0);
-  
-  // FIXME: optimization when filledRect defines bbox that fill operated on, good for large mats
+  assert(inBinMask.at<uint8_t>(startPoint.y, startPoint.x) != 0);
   
-  // Any non-zero pixel in inBinMask is set to zero now so that only the flood pixels remain
-  // as non-zero values.
+  static thread_local FloodFillScratch scratch;
   
-  for(int y = 0; y < croppedMask.rows; y++) {
-    for(int x = 0; x < croppedMask.cols; x++) {
-      uint8_t bVal = copyOfInBinMask.at<uint8_t>(y, x);
-      if (bVal != 0) {
-        croppedMask.at<uint8_t>(y, x) = 0;
-      }
-    }
-  }
+  outBinMask = Scalar(0);
   
-//  expandedMask *= 255.0;
+  Rect filledRect;
   
-  croppedMask.at<uint8_t>(seed.y, seed.x) = 0xFF;
+  int numFilled = scanlineFloodFill(inBinMask, outBinMask, startPoint, connectivity, Rect(0, 0, inBinMask.cols, inBinMask.rows), scratch, &filledRect);
   
-  if (debugDumpImages) {
-    imwrite("flood_mask_output.png", expandedMask);
+  if (debug) {
+    cout << "numFilled " << numFilled << endl;
+    cout << "flood fill bbox (" << filledRect.x << "," << filledRect.y << ") " << filledRect.width << " x " << filledRect.height << endl;
   }
   
-  // The filledRect identified pixels are now in terms of the cropped mask image
-  
   if (debugDumpImages) {
-    imwrite("flood_mask_not_cropped.png", expandedMask);
-    imwrite("flood_mask_cropped.png", croppedMask);
+    debugImwrite("flood_mask_output.png", outBinMask);
   }
   
-  outBinMask = Scalar(0);
+  // Fill must have at least filled 1 pixel
   
-  croppedMask.copyTo(outBinMask);
+  assert(numFilled > 0);
+  assert(filledRect.width > 0);
+  assert(filledRect.height > 0);
   
   return numFilled;
 }
@@ -1449,175 +2278,61 @@ void binMatInvert(Mat &binMat) {
   });
 }
 
-// Generate a skeleton based on simple morphological operations.
-//
-// http://felix.abecassis.me/2011/09/opencv-morphological-skeleton/
-// http://www-prima.inrialpes.fr/perso/Tran/Draft/gateway.cfm.pdf
-// http://answers.opencv.org/question/3207/what-is-a-good-thinning-algorithm-for-getting-the-skeleton-of-characters-for-ocr/
-
-void ThinSubiteration1(Mat & pSrc, Mat & pDst) {
-  int rows = pSrc.rows;
-  int cols = pSrc.cols;
-  pSrc.copyTo(pDst);
-  for(int i = 0; i < rows; i++) {
-    for(int j = 0; j < cols; j++) {
-      if(pSrc.at<float>(i, j) == 1.0f) {
-        /// get 8 neighbors
-        /// calculate C(p)
-        int neighbor0 = (int) pSrc.at<float>( i-1, j-1);
-        int neighbor1 = (int) pSrc.at<float>( i-1, j);
-        int neighbor2 = (int) pSrc.at<float>( i-1, j+1);
-        int neighbor3 = (int) pSrc.at<float>( i, j+1);
-        int neighbor4 = (int) pSrc.at<float>( i+1, j+1);
-        int neighbor5 = (int) pSrc.at<float>( i+1, j);
-        int neighbor6 = (int) pSrc.at<float>( i+1, j-1);
-        int neighbor7 = (int) pSrc.at<float>( i, j-1);
-        int C = int(~neighbor1 & ( neighbor2 | neighbor3)) +
-        int(~neighbor3 & ( neighbor4 | neighbor5)) +
-        int(~neighbor5 & ( neighbor6 | neighbor7)) +
-        int(~neighbor7 & ( neighbor0 | neighbor1));
-        if(C == 1) {
-          /// calculate N
-          int N1 = int(neighbor0 | neighbor1) +
-          int(neighbor2 | neighbor3) +
-          int(neighbor4 | neighbor5) +
-          int(neighbor6 | neighbor7);
-          int N2 = int(neighbor1 | neighbor2) +
-          int(neighbor3 | neighbor4) +
-          int(neighbor5 | neighbor6) +
-          int(neighbor7 | neighbor0);
-          int N = min(N1,N2);
-          if ((N == 2) || (N == 3)) {
-            /// calculate criteria 3
-            int c3 = ( neighbor1 | neighbor2 | ~neighbor4) & neighbor3;
-            if(c3 == 0) {
-              pDst.at<float>( i, j) = 0.0f;
-            }
-          }
-        }
-      }
-    }
-  }
-}
+// The thinning is the Zhang-Suen two subiteration method. The 8 neighbors of a pixel are
+// packed into a byte with bit k set when neighbor k is on, the neighbors are numbered
+// clockwise from the upper left: 0 = (-1,-1), 1 = (0,-1), 2 = (1,-1), 3 = (1,0),
+// 4 = (1,1), 5 = (0,1), 6 = (-1,1), 7 = (-1,0). A table entry is 1 when an on pixel
+// with that neighbor byte is deleted by the subiteration.
 
+typedef struct {
+  uint8_t first[256];
+  uint8_t second[256];
+} ThinDeleteTables;
 
-void ThinSubiteration2(Mat & pSrc, Mat & pDst) {
-  int rows = pSrc.rows;
-  int cols = pSrc.cols;
-  pSrc.copyTo( pDst);
-  for(int i = 0; i < rows; i++) {
-    for(int j = 0; j < cols; j++) {
-      if (pSrc.at<float>( i, j) == 1.0f) {
-        /// get 8 neighbors
-        /// calculate C(p)
-        int neighbor0 = (int) pSrc.at<float>( i-1, j-1);
-        int neighbor1 = (int) pSrc.at<float>( i-1, j);
-        int neighbor2 = (int) pSrc.at<float>( i-1, j+1);
-        int neighbor3 = (int) pSrc.at<float>( i, j+1);
-        int neighbor4 = (int) pSrc.at<float>( i+1, j+1);
-        int neighbor5 = (int) pSrc.at<float>( i+1, j);
-        int neighbor6 = (int) pSrc.at<float>( i+1, j-1);
-        int neighbor7 = (int) pSrc.at<float>( i, j-1);
-        int C = int(~neighbor1 & ( neighbor2 | neighbor3)) +
-        int(~neighbor3 & ( neighbor4 | neighbor5)) +
-        int(~neighbor5 & ( neighbor6 | neighbor7)) +
-        int(~neighbor7 & ( neighbor0 | neighbor1));
-        if(C == 1) {
-          /// calculate N
-          int N1 = int(neighbor0 | neighbor1) +
-          int(neighbor2 | neighbor3) +
-          int(neighbor4 | neighbor5) +
-          int(neighbor6 | neighbor7);
-          int N2 = int(neighbor1 | neighbor2) +
-          int(neighbor3 | neighbor4) +
-          int(neighbor5 | neighbor6) +
-          int(neighbor7 | neighbor0);
-          int N = min(N1,N2);
-          if((N == 2) || (N == 3)) {
-            int E = (neighbor5 | neighbor6 | ~neighbor0) & neighbor7;
-            if(E == 0) {
-              pDst.at<float>(i, j) = 0.0f;
-            }
-          }
-        }
-      }
-    }
-  }
-}
-
-void NormalizeLetter(Mat & inputarray, Mat & outputarray) {
-  bool bDone = false;
-  int rows = inputarray.rows;
-  int cols = inputarray.cols;
-  
-  /*
-  
-  inputarray.convertTo(inputarray,CV_32FC1);
-  
-  inputarray.copyTo(outputarray);
-  
-  outputarray.convertTo(outputarray,CV_32FC1);
-   
-  */
-  
-//  inputarray.copyTo(outputarray);
-  
-  /// pad source
-  Mat p_enlarged_src = Mat(rows + 2, cols + 2, CV_32FC1);
-  for(int i = 0; i < (rows+2); i++) {
-    p_enlarged_src.at<float>(i, 0) = 0.0f;
-    p_enlarged_src.at<float>( i, cols+1) = 0.0f;
-  }
-  for(int j = 0; j < (cols+2); j++) {
-    p_enlarged_src.at<float>(0, j) = 0.0f;
-    p_enlarged_src.at<float>(rows+1, j) = 0.0f;
-  }
-  for(int y = 0; y < rows; y++) {
-    for(int x = 0; x < cols; x++) {
-      float f = inputarray.at<float>(y, x);
-      assert(f == 0.0f || f == 1.0f);
-      //int roundF = round(f);
-      //assert(roundF == 0 || roundF == 1);
-      //p_enlarged_src.at<float>(y+1, x+1) = (float)roundF;
-      p_enlarged_src.at<float>(y+1, x+1) = f;
-    }
-  }
-  
-  /// start to thin
-  Mat p_thinMat1 = Mat::zeros(rows + 2, cols + 2, CV_32FC1);
-  Mat p_thinMat2 = Mat::zeros(rows + 2, cols + 2, CV_32FC1);
-  Mat p_cmp = Mat::zeros(rows + 2, cols + 2, CV_8UC1);
-  
-  while (bDone != true) {
-    /// sub-iteration 1
-    ThinSubiteration1(p_enlarged_src, p_thinMat1);
-    /// sub-iteration 2
-    ThinSubiteration2(p_thinMat1, p_thinMat2);
-    /// compare
-    compare(p_enlarged_src, p_thinMat2, p_cmp, CV_CMP_EQ);
-    /// check
-    int num_non_zero = countNonZero(p_cmp);
-    if (num_non_zero == (rows + 2) * (cols + 2)) {
-      bDone = true;
-    }
-    /// copy
-    p_thinMat2.copyTo(p_enlarged_src);
-  }
-  
-  // copy result
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
-      float f = p_enlarged_src.at<float>(i+1, j+1);
-      assert(f == 0.0f || f == 1.0f);
-      outputarray.at<float>(i, j) = f;
+static
+ThinDeleteTables makeThinDeleteTables() {
+  ThinDeleteTables tables;
+  
+  for ( int code = 0; code < 256; code++ ) {
+    int n[8];
+    for ( int k = 0; k < 8; k++ ) {
+      n[k] = (code >> k) & 0x1;
     }
+    
+    int C = ((!n[1]) & (n[2] | n[3])) +
+    ((!n[3]) & (n[4] | n[5])) +
+    ((!n[5]) & (n[6] | n[7])) +
+    ((!n[7]) & (n[0] | n[1]));
+    
+    int N1 = (n[0] | n[1]) + (n[2] | n[3]) + (n[4] | n[5]) + (n[6] | n[7]);
+    int N2 = (n[1] | n[2]) + (n[3] | n[4]) + (n[5] | n[6]) + (n[7] | n[0]);
+    int N = mini(N1, N2);
+    
+    bool isCandidate = (C == 1) && (N == 2 || N == 3);
+    
+    int c3 = (n[1] | n[2] | (!n[4])) & n[3];
+    int E = (n[5] | n[6] | (!n[0])) & n[7];
+    
+    tables.first[code] = (isCandidate && c3 == 0) ? 1 : 0;
+    tables.second[code] = (isCandidate && E == 0) ? 1 : 0;
   }
   
-  return;
+  return tables;
 }
 
-void skelReduce(Mat &binMat) {
-  const bool debugDumpImages = true;
+// Generate a skeleton based on simple morphological operations.
+//
+// http://felix.abecassis.me/2011/09/opencv-morphological-skeleton/
+// http://www-prima.inrialpes.fr/perso/Tran/Draft/gateway.cfm.pdf
+// http://answers.opencv.org/question/3207/what-is-a-good-thinning-algorithm-for-getting-the-skeleton-of-characters-for-ocr/
+//
+// A pixel can only change its deleted state in a subiteration when one of its neighbors
+// was deleted since the last time that subiteration tested it, so each subiteration
+// only tests the on neighbors of pixels deleted since then. The result is the same as
+// testing every on pixel in each subiteration.
+
+void skelReduce(Mat &binMat, cv::Rect roi) {
+  const bool debugDumpImages = isDebugStageImagesEnabled();
   
 #if defined(DEBUG)
   assert(binMat.channels() == 1);
@@ -1632,54 +2347,132 @@ void skelReduce(Mat &binMat) {
     fnameStream << "skel_" << "input" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
-
-  // FIXME: output should be bin Mat
   
-  Mat inFloatMat(binMat.size(), CV_32FC1, 0.0f);
-  Mat outFloatMat(binMat.size(), CV_32FC1, 0.0f);
+  static const ThinDeleteTables tables = makeThinDeleteTables();
   
-  for ( int y = 0; y < binMat.rows; y++ ) {
-    for ( int x = 0; x < binMat.cols; x++ ) {
-      uint8_t bVal = binMat.at<uint8_t>(y, x);
-      float fVal;
-      if (bVal) {
-        fVal = 1.0f;
-      } else {
-        fVal = 0.0f;
-      }
-      inFloatMat.at<float>(y, x) = fVal;
+  roi &= cv::Rect(0, 0, binMat.cols, binMat.rows);
+  
+  if (roi.area() > 0) {
+    // Pixels inside roi with a 1 pixel border of off pixels, so that every on
+    // pixel has 8 neighbors in the buffer.
+    
+    const int width = roi.width + 2;
+    const int height = roi.height + 2;
+    
+    vector<uint8_t> pixels(width * height, 0);
+    
+    // Bit 0x1 is set while a pixel is in candidates[0] and 0x2 for candidates[1]
+    
+    vector<uint8_t> marks(width * height, 0);
+    vector<int32_t> candidates[2];
+    
+    for ( int y = 0; y < roi.height; y++ ) {
+      const uint8_t *rowPtr = binMat.ptr<uint8_t>(roi.y + y) + roi.x;
+      int32_t offset = ((y + 1) * width) + 1;
       
-//      if (bVal) {
-//        cout << "wrote TRUE " << x << "," << y << " = " << inFloatMat.at<float>(y, x) << endl;
-//      } else {
-//        cout << "wrote FALSE " << x << "," << y << " = " << inFloatMat.at<float>(y, x) << endl;
-//      }
+      for ( int x = 0; x < roi.width; x++, offset++ ) {
+        if (rowPtr[x]) {
+          pixels[offset] = 1;
+          marks[offset] = 0x3;
+          candidates[0].push_back(offset);
+          candidates[1].push_back(offset);
+        }
+      }
     }
-  }
-  
-  NormalizeLetter(inFloatMat, outFloatMat);
-  
-  binMat = Scalar(0);
-  
-  for ( int y = 0; y < outFloatMat.rows; y++ ) {
-    for ( int x = 0; x < outFloatMat.cols; x++ ) {
-      float fVal = outFloatMat.at<float>(y, x);
-      //printf("mat[%5d,%5d] = %0.4f\n", x, y, fVal);
+    
+    const int32_t neighborOffsets[8] = {
+      -width - 1, -width, -width + 1, 1, width + 1, width, width - 1, -1
+    };
+    
+    vector<int32_t> deleted;
+    int numDeletedInIteration = 0;
+    
+    for ( int sub = 0; ; sub = 1 - sub ) {
+      const uint8_t *table = (sub == 0) ? tables.first : tables.second;
+      vector<int32_t> &subCandidates = candidates[sub];
+      const uint8_t subBit = (uint8_t) (1 << sub);
       
-      uint8_t outByte = 0;
-      if (fVal == 0.0f) {
-        outByte = 0;
-      } else if (fVal == 1.0f) {
-        outByte = 0xFF;
-      } else {
-        assert(0);
+      // Test all the candidates before deleting so that each test reads the
+      // pixels from before this subiteration.
+      
+      deleted.clear();
+      
+      for ( int32_t offset : subCandidates ) {
+        marks[offset] &= ~subBit;
+        
+        if (pixels[offset] == 0) {
+          continue;
+        }
+        
+        const uint8_t *p = &pixels[offset];
+        
+        uint32_t code =
+        (p[neighborOffsets[0]]) |
+        (p[neighborOffsets[1]] << 1) |
+        (p[neighborOffsets[2]] << 2) |
+        (p[neighborOffsets[3]] << 3) |
+        (p[neighborOffsets[4]] << 4) |
+        (p[neighborOffsets[5]] << 5) |
+        (p[neighborOffsets[6]] << 6) |
+        (p[neighborOffsets[7]] << 7);
+        
+        if (table[code]) {
+          deleted.push_back(offset);
+        }
+      }
+      
+      subCandidates.clear();
+      
+      for ( int32_t offset : deleted ) {
+        pixels[offset] = 0;
+      }
+      
+      // The on neighbors of a deleted pixel are tested again by both subiterations
+      
+      for ( int32_t offset : deleted ) {
+        for ( int k = 0; k < 8; k++ ) {
+          int32_t neighborOffset = offset + neighborOffsets[k];
+          
+          if (pixels[neighborOffset] == 0) {
+            continue;
+          }
+          
+          uint8_t mark = marks[neighborOffset];
+          
+          if ((mark & 0x1) == 0) {
+            candidates[0].push_back(neighborOffset);
+          }
+          if ((mark & 0x2) == 0) {
+            candidates[1].push_back(neighborOffset);
+          }
+          
+          marks[neighborOffset] = 0x3;
+        }
+      }
+      
+      numDeletedInIteration += (int) deleted.size();
+      
+      // Done when both subiterations of an iteration did not delete a pixel
+      
+      if (sub == 1) {
+        if (numDeletedInIteration == 0) {
+          break;
+        }
+        numDeletedInIteration = 0;
       }
+    }
+    
+    for ( int y = 0; y < roi.height; y++ ) {
+      uint8_t *rowPtr = binMat.ptr<uint8_t>(roi.y + y) + roi.x;
+      const uint8_t *pixelsPtr = &pixels[((y + 1) * width) + 1];
       
-      binMat.at<uint8_t>(y, x) = outByte;
+      for ( int x = 0; x < roi.width; x++ ) {
+        rowPtr[x] = pixelsPtr[x] ? 0xFF : 0;
+      }
     }
   }
   
@@ -1688,7 +2481,7 @@ void skelReduce(Mat &binMat) {
     fnameStream << "skel_" << "output" << ".png";
     string fname = fnameStream.str();
     
-    imwrite(fname, binMat);
+    debugImwrite(fname, binMat);
     cout << "wrote " << fname << endl;
     cout << "" << endl;
   }
@@ -1696,6 +2489,34 @@ void skelReduce(Mat &binMat) {
   return;
 }
 
+void skelReduce(Mat &binMat) {
+  int minX = binMat.cols;
+  int minY = binMat.rows;
+  int maxX = -1;
+  int maxY = -1;
+  
+  for ( int y = 0; y < binMat.rows; y++ ) {
+    const uint8_t *rowPtr = binMat.ptr<uint8_t>(y);
+    
+    for ( int x = 0; x < binMat.cols; x++ ) {
+      if (rowPtr[x]) {
+        minX = mini(minX, x);
+        maxX = maxi(maxX, x);
+        minY = mini(minY, y);
+        maxY = y;
+      }
+    }
+  }
+  
+  cv::Rect roi;
+  
+  if (maxX >= 0) {
+    roi = cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+  }
+  
+  skelReduce(binMat, roi);
+}
+
 // Like cv::drawContours() except that this simplified method
 // renders just one contour.
 
@@ -1899,7 +2720,7 @@ bbox(int32_t &originX, int32_t &originY, int32_t &width, int32_t &height, const
 // bbox with optional +-N around the bbox
 
 cv::Rect bboxPlusN(const vector<Coord> &coords, CvSize imgSize, int numPixels) {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
   int32_t originX, originY, regionWidth, regionHeight;
   bbox(originX, originY, regionWidth, regionHeight, coords);
@@ -1933,3 +2754,241 @@ cv::Rect bboxPlusN(const vector<Coord> &coords, CvSize imgSize, int numPixels) {
   cv::Rect expandedRoi(originX, originY, regionWidth, regionHeight);
   return expandedRoi;
 }
+
+static thread_local string debugImageOutputDirname;
+
+void setDebugImageDirname(const string &dirname)
+{
+  debugImageOutputDirname = dirname;
+}
+
+// Write one debug image in the indicated format
+
+static
+bool writeDebugImage(const string &filename, const Mat &img, DebugImageFormat format)
+{
+  if (format == DEBUG_IMAGE_FORMAT_RAW) {
+    string rawFilename = filename;
+    size_t dotOffset = rawFilename.rfind('.');
+    size_t slashOffset = rawFilename.rfind('/');
+    if (dotOffset != string::npos && (slashOffset == string::npos || dotOffset > slashOffset)) {
+      rawFilename = rawFilename.substr(0, dotOffset);
+    }
+    rawFilename += ".raw";
+    
+    std::ofstream rawFile(rawFilename.c_str(), std::ios::binary);
+    if (!rawFile) {
+      return false;
+    }
+    
+    int32_t header[3] = { img.rows, img.cols, img.type() };
+    rawFile.write((const char *) header, sizeof(header));
+    
+    const size_t rowNumBytes = img.cols * img.elemSize();
+    
+    for ( int y = 0; y < img.rows; y++ ) {
+      rawFile.write((const char *) img.ptr(y), rowNumBytes);
+    }
+    
+    return (bool) rawFile;
+  } else if (format == DEBUG_IMAGE_FORMAT_FAST_PNG) {
+    vector<int> params;
+    params.push_back(IMWRITE_PNG_COMPRESSION);
+    params.push_back(1);
+    return imwrite(filename, img, params);
+  } else {
+    return imwrite(filename, img);
+  }
+}
+
+typedef struct {
+  string filename;
+  Mat img;
+} DebugImageWriteRequest;
+
+// Bounded queue of debug images drained by the encoder threads
+
+class DebugImageWriter {
+  public:
+  
+  DebugImageFormat format;
+  
+  size_t maxQueued;
+  
+  std::mutex queueMutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  
+  std::deque<DebugImageWriteRequest> queue;
+  
+  bool stopping;
+  
+  vector<std::thread> threads;
+  
+  DebugImageWriter(int numThreads, int maxQueued, DebugImageFormat format)
+  : format(format), maxQueued(max(maxQueued, 1)), stopping(false)
+  {
+    for ( int i = 0; i < max(numThreads, 1); i++ ) {
+      threads.push_back(std::thread(&DebugImageWriter::run, this));
+    }
+  }
+  
+  ~DebugImageWriter()
+  {
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      stopping = true;
+    }
+    notEmpty.notify_all();
+    
+    for ( std::thread &thread : threads ) {
+      thread.join();
+    }
+  }
+  
+  void push(const string &filename, const Mat &img)
+  {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    notFull.wait(lock, [this]{ return queue.size() < maxQueued; });
+    
+    DebugImageWriteRequest request;
+    request.filename = filename;
+    request.img = img.clone();
+    queue.push_back(request);
+    
+    lock.unlock();
+    notEmpty.notify_one();
+  }
+  
+  // Encode queued images until stopped, the queue is empty once a thread returns
+  
+  void run()
+  {
+    while (1) {
+      DebugImageWriteRequest request;
+      
+      {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        notEmpty.wait(lock, [this]{ return stopping || !queue.empty(); });
+        
+        if (queue.empty()) {
+          return;
+        }
+        
+        request = queue.front();
+        queue.pop_front();
+      }
+      
+      notFull.notify_one();
+      
+      if (!writeDebugImage(request.filename, request.img, format)) {
+        cerr << "could not write debug image \"" << request.filename << "\"" << endl;
+      }
+    }
+  }
+};
+
+static DebugImageWriter *debugImageWriter = NULL;
+
+static DebugImageFormat debugImageFormat = DEBUG_IMAGE_FORMAT_DEFAULT;
+
+void startDebugImageWriter(int numThreads, int maxQueued, DebugImageFormat format)
+{
+  stopDebugImageWriter();
+  debugImageFormat = format;
+  debugImageWriter = new DebugImageWriter(numThreads, maxQueued, format);
+}
+
+void stopDebugImageWriter()
+{
+  if (debugImageWriter != NULL) {
+    delete debugImageWriter;
+    debugImageWriter = NULL;
+  }
+}
+
+static thread_local int parallelThreads = 0;
+
+void setParallelThreads(int numThreads)
+{
+  parallelThreads = max(numThreads, 0);
+}
+
+int getParallelThreads()
+{
+  int numThreads = max(1, getNumThreads());
+  
+  if (parallelThreads > 0) {
+    numThreads = min(numThreads, parallelThreads);
+  }
+  
+  return numThreads;
+}
+
+// Limit the thread that runs a stripe to one thread while the stripe runs
+
+class SerialNestedParallelBody : public ParallelLoopBody {
+public:
+  SerialNestedParallelBody(const ParallelLoopBody &_body)
+  : body(_body)
+  {
+  }
+  
+  virtual void operator()(const Range &range) const {
+    const int savedThreads = parallelThreads;
+    parallelThreads = 1;
+    
+    try {
+      body(range);
+    } catch (...) {
+      parallelThreads = savedThreads;
+      throw;
+    }
+    
+    parallelThreads = savedThreads;
+  }
+  
+private:
+  const ParallelLoopBody &body;
+};
+
+void parallelFor(const Range &range, const ParallelLoopBody &body)
+{
+  if (range.end <= range.start) {
+    return;
+  }
+  
+  const int numThreads = getParallelThreads();
+  
+  if (numThreads == 1 || (range.end - range.start) == 1) {
+    body(range);
+  } else if (parallelThreads == 0) {
+    // All the threads, one stripe for each index as with parallel_for_()
+    parallel_for_(range, SerialNestedParallelBody(body));
+  } else {
+    parallel_for_(range, SerialNestedParallelBody(body), numThreads);
+  }
+}
+
+// When the writer is running the image is copied into the queue and true is
+// returned, a failed write is reported by the encoder thread.
+
+bool debugImwrite(const string &filename, const Mat &img)
+{
+  if (!isDebugStageImagesEnabled()) {
+    return false;
+  }
+  
+  string path = filename;
+  
+  if (!debugImageOutputDirname.empty()) {
+    path = debugImageOutputDirname + "/" + filename;
+  }
+  
+  if (debugImageWriter != NULL) {
+    debugImageWriter->push(path, img);
+    return true;
+  } else {
+    return writeDebugImage(path, img, debugImageFormat);
+  }
+}
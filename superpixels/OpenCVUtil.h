@@ -4,12 +4,14 @@
 #define	OPENCV_UTIL_H
 
 #include <opencv2/opencv.hpp>
+#include <algorithm>
 #include <unordered_map>
 
 using namespace std;
 using namespace cv;
 
 #include "Coord.h"
+#include "Util.h"
 
 // Convert a vector of 3 bytes into a signed 32bit integer.
 // The values range for a 3 byte tag is 0 -> 0x00FFFFFF and
@@ -124,6 +126,22 @@ void binMatInvert(Mat &binMat);
 
 void skelReduce(Mat &binMat);
 
+// Same as skelReduce() when all the on pixels of binMat are inside roi, only the
+// pixels inside roi are read and written.
+
+void skelReduce(Mat &binMat, cv::Rect roi);
+
+// SSIM index of two CV_8UC1 or CV_8UC3 images of the same size with the 11x11
+// Gaussian window of the original matlab program. The moments and the index are
+// computed in one pass over tiles of tileSize x tileSize pixels in parallel, so
+// the memory used is a buffer for each tile and not a float image for each moment.
+// The mean SSIM of each channel is written to channelSSIM. When labels is a
+// CV_32SC1 image of region labels the mean SSIM over the pixels of each label
+// is written to regionSSIM indexed by label, with 0 for a label with no pixels.
+// Returns the mean over the channels, or -1 when the images cannot be compared.
+
+double fusedSSIM(const Mat &img1, const Mat &img2, cv::Scalar *channelSSIM = NULL, const Mat *labels = NULL, vector<double> *regionSSIM = NULL, int tileSize = 64);
+
 // Print SSIM for two images to cout
 
 int printSSIM(Mat inImage1, Mat inImage2);
@@ -134,10 +152,23 @@ int printSSIM(Mat inImage1, Mat inImage2);
 // region binMat is unchanged. The orderMat is set to the size of the roi and
 // it is filled with distance transformed gray values. Note that this method
 // has to create a buffer zone of 1 pixel so that pixels on the edge have
-// a very small distance.
+// a very small distance. The distance field and center of the last roi of each
+// tag are cached for the calling thread, so a tag asked for again with the same
+// pixels in the roi is not transformed again.
 
 Coord findRegionCenter(Mat &binMat, cv::Rect roi, Mat &outDistMat, int tag);
 
+// Max pixels of the cached rois of findRegionCenter() on each thread, a larger
+// roi is not cached and 0 disables the cache. Defaults to 4M pixels.
+
+void setRegionCenterCacheMaxPixels(int maxPixels);
+
+int getRegionCenterCacheMaxPixels();
+
+// Drop the cached distance fields of the calling thread
+
+void clearRegionCenterCache();
+
 // Given an input binary Mat (0x0 or 0xFF) perform a dilate() operation that will expand
 // the white region inside a black region. This makes use of a circular operator and
 // an expansion size indicated by the caller.
@@ -150,21 +181,145 @@ Mat expandWhiteInRegion(const Mat &binMat, int expandNumPixelsSize, int tag);
 
 Mat decreaseWhiteInRegion(const Mat &binMat, int decreaseNumPixelsSize, int tag);
 
+// Block coord of a pixel coord for blocks of superpixelDim x superpixelDim
+// pixels. Code that maps each coord of a region to a block is templated on
+// BlockDim so that the 4x4 blocks clusteringCombine() uses are a shift, the
+// generic form divides by the runtime superpixelDim.
+
+template <int BlockDim>
+struct BlockGridCoord {
+  static inline int toBlock(int v, int superpixelDim) {
+    return v / superpixelDim;
+  }
+};
+
+template <>
+struct BlockGridCoord<4> {
+  static inline int toBlock(int v, int superpixelDim) {
+#if defined(DEBUG)
+    assert(superpixelDim == 4 && v >= 0);
+#endif // DEBUG
+    return v >> 2;
+  }
+};
+
 // Given a superpixel tag that indicates a region segmented into 4x4 squares
 // map (X,Y) coordinates to a minimized Mat representation that can be
-// quickly morphed with minimal CPU and memory usage.
+// quickly morphed with minimal CPU and memory usage. When blockRoi is not
+// NULL it is set to the bbox of the white blocks, the blocks outside of it
+// are all black.
 
 Mat expandBlockRegion(int32_t tag,
                       const vector<Coord> &coords,
                       int expandNum,
                       int blockWidth, int blockHeight,
-                      int superpixelDim);
+                      int superpixelDim,
+                      cv::Rect *blockRoi = NULL);
+
+// Offsets of colortable entries for pixels that are exactly a colortable entry. The
+// 24 bit entries are sorted once for a colortable so that a lookup is a binary search
+// instead of a hash, when a pixel appears more than once the last offset is found.
+
+class ColortableIndex {
+public:
+  ColortableIndex(const vector<uint32_t> &colortable);
+  
+  // Offset of the 24 bit pixel in the colortable, -1 when it is not an entry
+  
+  int32_t lookup(uint32_t pixel) const {
+    pixel &= 0x00FFFFFF;
+    auto it = std::lower_bound(sortedPixels.begin(), sortedPixels.end(), pixel);
+    if (it == sortedPixels.end() || *it != pixel) {
+      return -1;
+    }
+    return sortedOffsets[it - sortedPixels.begin()];
+  }
+  
+private:
+  vector<uint32_t> sortedPixels;
+  
+  vector<int32_t> sortedOffsets;
+};
 
 // Given a Mat that contains quant pixels and a colortable, map the quant
 // pixels to indexes in the colortable. If the asGreyscale) flag is true
 // then each index is assumed to be a byte and is written as a greyscale pixel.
+// When offsetCounts is not NULL it is resized to the colortable size and the
+// number of pixels mapped to each offset is counted in the same pass.
+
+Mat mapQuantPixelsToColortableIndexes(const Mat & inQuantPixels, const vector<uint32_t> &colortable, bool asGreyscale, vector<uint32_t> *offsetCounts = NULL);
+
+// Pack each BGR pixel of inImage into a 32 bit word with the same value as
+// Vec3BToUID(), the packedImage is a continuous CV_32SC1 Mat the same size as
+// inImage. The pixels are converted 16 at a time with SIMD.
+
+void packPixels(const Mat &inImage, Mat &packedImage);
+
+// Pack n BGR pixels from one row into 32 bit words with the same value as
+// Vec3BToUID(), so that a tags row can be scanned by comparing words. The
+// pixels are converted 16 at a time with SIMD.
 
-Mat mapQuantPixelsToColortableIndexes(const Mat & inQuantPixels, const vector<uint32_t> &colortable, bool asGreyscale);
+void packPixelRow(const uint8_t *bgr, uint32_t *pixels, int n);
+
+// Inverse of packPixelRow(), the top byte of each word is ignored as it is
+// by PixelToVec3b().
+
+void unpackPixelRow(const uint32_t *pixels, uint8_t *bgr, int n);
+
+// A tags image is either a CV_8UC3 Mat with 24 bit tags as written by
+// Vec3BToUID() or a CV_32SC1 Mat with 32 bit tags.
+
+static inline
+bool isTagsImageType(const Mat &tagsImg) {
+  return (tagsImg.type() == CV_8UC3 || tagsImg.type() == CV_32SC1);
+}
+
+// Tag at (x, y) of a tags image
+
+static inline
+int32_t readTag(const Mat &tagsImg, int x, int y) {
+  if (tagsImg.type() == CV_32SC1) {
+    return tagsImg.at<int32_t>(y, x);
+  } else {
+    return Vec3BToUID(tagsImg.at<Vec3b>(y, x));
+  }
+}
+
+// Tags in row y of a tags image as words, a CV_32SC1 row is returned in place
+// and a CV_8UC3 row is packed into rowBuffer which must hold tagsImg.cols words.
+
+static inline
+const uint32_t* readTagsRow(const Mat &tagsImg, int y, uint32_t *rowBuffer) {
+  if (tagsImg.type() == CV_32SC1) {
+    return tagsImg.ptr<uint32_t>(y);
+  } else {
+    packPixelRow(tagsImg.ptr<uint8_t>(y), rowBuffer, tagsImg.cols);
+    return rowBuffer;
+  }
+}
+
+// Read the 24 bit pixel value at each coord into pixels. The image can be a BGR
+// Mat or a packed Mat from packPixels(), the words of a packed Mat are read by
+// offset without a conversion.
+
+void gatherPixels(const Mat &image, const vector<Coord> &coords, uint32_t *pixels);
+
+// CIE76 Delta-E between each pair of 8 bit Lab pixels labA[i] and labB[i], the
+// same value as delta_e_1976() for the components of the pixels. The squared
+// distance is exact and can be compared to a squared threshold without a sqrt.
+// The pixels are processed 16 at a time with SIMD.
+
+void deltaE76Squared(const Vec3b *labA, const Vec3b *labB, uint32_t *out, int n);
+
+void deltaE76(const Vec3b *labA, const Vec3b *labB, float *out, int n);
+
+// True when two BGR tag images are the same partition of the pixels, so that the
+// tags of one image map one to one onto the tags of the other. The tag values
+// themselves can differ. When numDifferentPixels is not NULL it is set to the
+// number of pixels that do not agree with the mapping set by the first pixel of
+// each tag, all the pixels differ when the sizes do not match.
+
+bool tagsEqualUpToRelabel(const Mat &tags1, const Mat &tags2, int *numDifferentPixels = NULL);
 
 // Given a Mat that contains pixels count each pixel and return a histogram
 // of the number of times each pixel is found in the image.
@@ -176,6 +331,50 @@ void generatePixelHistogram(const Mat & inQuantPixels,
 
 vector<uint32_t> getSubdividedColors();
 
+// Process wide immutable copy of the getSubdividedColors() palette along with
+// a direct RGB to palette offset lookup. The instance is built on first use
+// and can then be used from any thread without locking.
+
+class SubdividedColors {
+public:
+  static const SubdividedColors & getInstance();
+  
+  // Palette entries, each pixel includes an alpha of 0xFF
+  
+  const vector<uint32_t> & getColors() const {
+    return colors;
+  }
+  
+  // Offset of the palette entry nearest to pixel
+  
+  uint32_t lookupIndex(uint32_t pixel) const {
+    uint32_t B = pixel & 0xFF;
+    uint32_t G = (pixel >> 8) & 0xFF;
+    uint32_t R = (pixel >> 16) & 0xFF;
+    return redOffsets[R] + greenOffsets[G] + blueOffsets[B];
+  }
+  
+  // Nearest palette entry as a RGB pixel without alpha
+  
+  uint32_t lookupColor(uint32_t pixel) const {
+    return colors[lookupIndex(pixel)] & 0x00FFFFFF;
+  }
+  
+  // Write the nearest palette entry for each pixel, the output is the same
+  // RGB format without alpha that map_colors_mps() writes.
+  
+  void mapColors(const uint32_t *inPixelsPtr, uint32_t numPixels, uint32_t *outPixelsPtr) const;
+  
+private:
+  SubdividedColors();
+  
+  vector<uint32_t> colors;
+  
+  uint32_t redOffsets[256];
+  uint32_t greenOffsets[256];
+  uint32_t blueOffsets[256];
+};
+
 // Vote for pixels that have neighbors that are the exact same value, this method examines each
 // pixel by getting the 8 connected neighbors and recoring a vote for a given pixel when it has
 // a neighbor that is exactly the same.
@@ -184,6 +383,27 @@ void vote_for_identical_neighbors(unordered_map<uint32_t, uint32_t> &pixelToNumV
                                   const Mat &inImage,
                                   const Mat &inMaskImage);
 
+// Same votes as vote_for_identical_neighbors() for an image that is already mapped to
+// palette offsets. The indexImage is CV_8UC1, CV_16UC1 or CV_32SC1 and each value is an
+// offset less than numColors. The votes vector is resized to numColors and votes[i] is
+// the vote count for palette entry i. Only pixels inside roi are voted on, so the roi
+// must contain all the pixels that are on in the mask.
+
+void vote_for_identical_neighbors(vector<uint32_t> &votes,
+                                  const Mat &indexImage,
+                                  const Mat &inMaskImage,
+                                  int numColors,
+                                  cv::Rect roi);
+
+// Map each BGR pixel inside roi to an offset in palette, pixels not already in palette are
+// appended in the order they are found. The indexImage is set to a CV_32SC1 Mat the size of
+// inImage and only the roi pixels are written.
+
+void mapPixelsToPaletteIndexes(const Mat &inImage,
+                               cv::Rect roi,
+                               Mat &indexImage,
+                               vector<uint32_t> &palette);
+
 // Given a series of 3D points, generate a center of mass in (x,y,z) for the points.
 
 Vec3b centerOfMass3d(const vector<Vec3b> &points);
@@ -234,8 +454,30 @@ vector<Point2i> filterPointsOutsideROI(const vector<Point2i> &points, CvRect roi
   return filtered;
 }
 
+// Buffers for scanlineFloodFill() that a caller keeps between fills, the visited
+// flags and the stack only grow when a fill is done in a larger roi.
+
+typedef struct {
+  vector<uint8_t> visited;
+  vector<Point2i> stack;
+} FloodFillScratch;
+
+// Scanline flood fill of the zero pixels in inBinMask that are connected to the
+// seed, the seed itself is always filled. Only pixels inside roi are read and
+// only the filled pixels in outBinMask are written (set to 0xFF). Returns the
+// number of pixels filled and sets filledRect to the bbox of the filled pixels.
+
+int scanlineFloodFill(const Mat &inBinMask,
+                      Mat &outBinMask,
+                      Point2i seed,
+                      int connectivity,
+                      cv::Rect roi,
+                      FloodFillScratch &scratch,
+                      cv::Rect *filledRect = NULL);
+
 // Flood fill based on region of zero values. Input comes from inBinMask and the results
 // are written to outBinMask. Black pixels are filled and white pixels are not filled.
+// Pixels in outBinMask that are not filled are set to zero.
 
 int floodFillMask(Mat &inBinMask, Mat &outBinMask, Point2i startPoint, int connectivity);
 
@@ -267,11 +509,64 @@ void drawLine(
               int thickness,
               int lineType );
 
+// Debug and intermediate images are written with debugImwrite(). The output
+// directory is set for each thread, so a worker thread that segments one image
+// while other threads segment other images can write its debug images into its
+// own directory instead of over the same files in the CWD. A worker can also
+// turn off its debug images with setDebugOutputLevel().
+
+void setDebugImageDirname(const string &dirname);
+
+// Write img to filename, or to dirname/filename when a directory was set for
+// this thread. Returns false without writing when stage images are disabled
+// by the debug output level.
+
+bool debugImwrite(const string &filename, const Mat &img);
+
+// Debug image file format, DEBUG_IMAGE_FORMAT_FAST_PNG uses the lowest PNG
+// compression level and DEBUG_IMAGE_FORMAT_RAW replaces the extension with
+// .raw and writes the int32_t rows, cols and type followed by the pixel rows.
+
+typedef enum {
+  DEBUG_IMAGE_FORMAT_DEFAULT = 0,
+  DEBUG_IMAGE_FORMAT_FAST_PNG = 1,
+  DEBUG_IMAGE_FORMAT_RAW = 2
+} DebugImageFormat;
+
+// Queue debug images and encode them on numThreads background threads, once
+// maxQueued images are waiting debugImwrite() blocks until one is written.
+// The writer must be started before and stopped after the threads that write
+// debug images run, stopDebugImageWriter() waits for the queued images. The
+// format is also used by later writes done without the writer.
+
+void startDebugImageWriter(int numThreads = 1, int maxQueued = 32, DebugImageFormat format = DEBUG_IMAGE_FORMAT_DEFAULT);
+
+void stopDebugImageWriter();
+
+// Number of threads the parallel loops started on this thread may use, so that
+// a process that runs several segmentations at once splits the cores between
+// them instead of each one striping its loops over all the cores. 0 means all
+// getNumThreads() threads. Like the debug output level this is set per thread,
+// a worker thread sets its share once before it segments.
+
+void setParallelThreads(int numThreads);
+
+// Threads the parallel loops on this thread may use, at least 1
+
+int getParallelThreads();
+
+// parallel_for_ over range with at most getParallelThreads() stripes running at
+// once, with one thread the body is invoked on the calling thread. A parallel
+// loop started from inside the body runs serially, so that nested loops do not
+// oversubscribe the cores.
+
+void parallelFor(const cv::Range &range, const cv::ParallelLoopBody &body);
+
 // Write image Mat and dump filename and dimensions to stdout
 
 static inline
 void writeWroteImg(string filename, cv::Mat mat) {
-  cv::imwrite(filename.c_str(), mat);
+  debugImwrite(filename, mat);
   char buffer[1024];
   snprintf(buffer, sizeof(buffer), "wrote %s : %d x %d\n", filename.c_str(), mat.cols, mat.rows);
   std::cout << buffer << endl;
@@ -354,6 +649,145 @@ void round(Point2f &p) {
   p.y = round(p.y);
 }
 
+// Points on a line from startP to endP generated one at a time, so that a loop
+// over the points does not allocate. Iterating PointsOnLine<int> gives the same
+// points as generatePointsOnLine() and PointsOnLine<float> gives the same points
+// as generateFloatPointsOnLine().
+//
+// for ( Point2i p : PointsOnLine<int>(p1, p2) ) { ... }
+
+template <typename T>
+class PointsOnLine {
+public:
+  typedef cv::Point_<T> PointType;
+  
+  PointsOnLine(const PointType &startP, const PointType &endP)
+  : startF(startP), endP(endP)
+  {
+    deltaUnit = Point2f(endP) - startF;
+    float scale = makeUnitVector(deltaUnit);
+    numSteps = calcNumSteps(scale);
+  }
+  
+  class Iterator {
+  public:
+    Iterator(const PointsOnLine *linePtr, int step, const PointType &point)
+    : linePtr(linePtr), step(step), point(point)
+    {
+    }
+    
+    const PointType & operator*() const {
+      return point;
+    }
+    
+    Iterator & operator++() {
+      step = linePtr->nextStep(step, point);
+      return *this;
+    }
+    
+    bool operator!=(const Iterator &other) const {
+      return step != other.step;
+    }
+    
+  private:
+    const PointsOnLine *linePtr;
+    int step;
+    PointType point;
+  };
+  
+  // The start point is always the first point
+  
+  Iterator begin() const {
+    return Iterator(this, 0, PointType(startF));
+  }
+  
+  Iterator end() const {
+    return Iterator(this, -1, PointType());
+  }
+  
+  // Invoke f(const PointType &p) for each point
+  
+  template <typename F>
+  void forEach(F f) const {
+    for ( const PointType &p : *this ) {
+      f(p);
+    }
+  }
+  
+private:
+  Point2f startF;
+  PointType endP;
+  Point2f deltaUnit;
+  int numSteps;
+  
+  int calcNumSteps(float scale) const;
+  
+  // Set point to the point after step and return the new step, -1 when done
+  
+  int nextStep(int step, PointType &point) const;
+};
+
+// Unit steps with each point rounded to a pixel, a point that rounds to the
+// same pixel as the previous point is skipped and the end point is the last one.
+
+template <>
+inline
+int PointsOnLine<int>::calcNumSteps(float scale) const {
+  return (int) round(scale) + 2;
+}
+
+template <>
+inline
+int PointsOnLine<int>::nextStep(int step, Point2i &point) const {
+  if (point == endP) {
+    return -1;
+  }
+  for ( int i = step + 1; i < numSteps; i++ ) {
+    Point2f pointVec = startF + (deltaUnit * i);
+    round(pointVec);
+    Point2i pointVecP = pointVec;
+    if (pointVecP != point) {
+      point = pointVecP;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Unit steps up to one step past the rounded up length
+
+template <>
+inline
+int PointsOnLine<float>::calcNumSteps(float scale) const {
+  int numSteps = (int) round(scale);
+  if (numSteps < scale) {
+    numSteps += 1;
+  }
+  return numSteps + 1;
+}
+
+template <>
+inline
+int PointsOnLine<float>::nextStep(int step, Point2f &point) const {
+  int i = step + 1;
+  if (i >= numSteps) {
+    return -1;
+  }
+  point = startF + (deltaUnit * i);
+  return i;
+}
+
+// Invoke f(Point p) for each pixel that line() with 8 connectivity would render
+// from p1 to p2 in a Mat, this walks a cv::LineIterator so nothing is allocated.
+
+template <typename F>
+void forEachPixelOnLine(const Mat &mat, Point2i p1, Point2i p2, F f) {
+  LineIterator it(mat, p1, p2, 8);
+  for ( int i = 0; i < it.count; i++, ++it ) {
+    f(it.pos());
+  }
+}
+
 // Calculate bbox
 
 void
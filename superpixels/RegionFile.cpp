@@ -0,0 +1,417 @@
+// Region file writer and memory mapped reader, see RegionFile.h
+
+#include "RegionFile.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+
+#include "Util.h"
+
+using namespace cv;
+using namespace std;
+
+// Each section starts on an 8 byte boundary so that mapped values are aligned
+
+static inline
+uint64_t alignRegionFileOffset(uint64_t offset)
+{
+  return (offset + 7) & ~((uint64_t) 7);
+}
+
+// Record both directions of a neighbor pair as (region << 32) | neighbor
+
+static inline
+void addRegionNeighborPair(vector<uint64_t> &pairs, uint32_t region1, uint32_t region2)
+{
+  pairs.push_back((((uint64_t) region1) << 32) | region2);
+  pairs.push_back((((uint64_t) region2) << 32) | region1);
+}
+
+// Write zero bytes until the stream is at offset
+
+static
+void padRegionFile(std::ofstream &outFile, uint64_t &offset, uint64_t toOffset)
+{
+  static const char zeros[8] = { 0 };
+  
+  assert(toOffset >= offset && (toOffset - offset) <= sizeof(zeros));
+  
+  outFile.write(zeros, (std::streamsize) (toOffset - offset));
+  offset = toOffset;
+}
+
+bool writeRegionFile(const string &filename, const Mat &inputImg, const Mat &tagsImg)
+{
+  assert(tagsImg.type() == CV_8UC3);
+  assert(inputImg.type() == CV_8UC3);
+  assert(inputImg.size() == tagsImg.size());
+  
+  const int width = tagsImg.cols;
+  const int height = tagsImg.rows;
+  
+  vector<RegionFileRegion> regions;
+  vector<int64_t> sums;
+  
+  vector<RegionFileRun> runs;
+  vector<uint64_t> rowOffsets;
+  rowOffsets.reserve(height + 1);
+  
+  vector<uint64_t> neighborPairs;
+  
+  // Region index for each tag, only looked up as a run starts
+  
+  unordered_map<uint32_t, uint32_t> tagToRegion;
+  
+  for ( int y = 0; y < height; y++ ) {
+    const uint8_t *tagsRowPtr = tagsImg.ptr<uint8_t>(y);
+    const Vec3b *inputRowPtr = inputImg.ptr<Vec3b>(y);
+  
+    const size_t rowStart = runs.size();
+    rowOffsets.push_back(rowStart);
+  
+    int x = 0;
+  
+    while (x < width) {
+      const uint8_t *runPtr = tagsRowPtr + (x * 3);
+      uint32_t tag = runPtr[0] | (runPtr[1] << 8) | (runPtr[2] << 16);
+  
+      int runEnd = x + 1;
+  
+      for ( const uint8_t *ptr = runPtr + 3; runEnd < width; runEnd++, ptr += 3 ) {
+        if ((uint32_t) (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16)) != tag) {
+          break;
+        }
+      }
+  
+      auto it = tagToRegion.find(tag);
+      uint32_t regionIndex;
+  
+      if (it == tagToRegion.end()) {
+        regionIndex = (uint32_t) regions.size();
+        tagToRegion[tag] = regionIndex;
+  
+        RegionFileRegion region;
+        memset(&region, 0, sizeof(region));
+        region.tag = tag;
+        region.x = x;
+        region.y = y;
+        regions.push_back(region);
+  
+        sums.push_back(0);
+        sums.push_back(0);
+        sums.push_back(0);
+      } else {
+        regionIndex = it->second;
+      }
+  
+      // The bbox keeps x and y as is until the max is known, width and height
+      // hold the max x and max y plus one.
+  
+      RegionFileRegion &region = regions[regionIndex];
+      region.numPixels += (runEnd - x);
+      region.x = mini(region.x, x);
+      region.width = maxi(region.width, runEnd);
+      region.height = y + 1;
+  
+      int64_t *sumPtr = &sums[regionIndex * 3];
+  
+      for ( int i = x; i < runEnd; i++ ) {
+        const Vec3b &pixel = inputRowPtr[i];
+        sumPtr[0] += pixel[0];
+        sumPtr[1] += pixel[1];
+        sumPtr[2] += pixel[2];
+      }
+  
+      if (runs.size() > rowStart && runs.back().region != regionIndex) {
+        addRegionNeighborPair(neighborPairs, runs.back().region, regionIndex);
+      }
+  
+      RegionFileRun run;
+      run.length = runEnd - x;
+      run.region = regionIndex;
+      runs.push_back(run);
+  
+      x = runEnd;
+    }
+  
+    // Runs in the row above that overlap a run in this row are 4 connected
+  
+    if (y > 0) {
+      size_t prevRun = rowOffsets[y-1];
+      size_t prevEnd = rowStart;
+      size_t currentRun = rowStart;
+      size_t currentEnd = runs.size();
+  
+      int prevX = 0;
+      int currentX = 0;
+  
+      while (prevRun < prevEnd && currentRun < currentEnd) {
+        uint32_t prevRegion = runs[prevRun].region;
+        uint32_t currentRegion = runs[currentRun].region;
+  
+        if (prevRegion != currentRegion) {
+          addRegionNeighborPair(neighborPairs, prevRegion, currentRegion);
+        }
+  
+        int prevRunEnd = prevX + runs[prevRun].length;
+        int currentRunEnd = currentX + runs[currentRun].length;
+  
+        if (prevRunEnd <= currentRunEnd) {
+          prevX = prevRunEnd;
+          prevRun++;
+        }
+        if (currentRunEnd <= prevRunEnd) {
+          currentX = currentRunEnd;
+          currentRun++;
+        }
+      }
+    }
+  }
+  
+  rowOffsets.push_back(runs.size());
+  
+  sort(neighborPairs.begin(), neighborPairs.end());
+  neighborPairs.erase(unique(neighborPairs.begin(), neighborPairs.end()), neighborPairs.end());
+  
+  vector<uint32_t> neighbors;
+  neighbors.reserve(neighborPairs.size());
+  
+  for ( uint64_t pair : neighborPairs ) {
+    RegionFileRegion &region = regions[pair >> 32];
+    if (region.numNeighbors == 0) {
+      region.firstNeighbor = (uint32_t) neighbors.size();
+    }
+    region.numNeighbors += 1;
+    neighbors.push_back((uint32_t) (pair & 0xFFFFFFFF));
+  }
+  
+  for ( uint32_t regionIndex = 0; regionIndex < regions.size(); regionIndex++ ) {
+    RegionFileRegion &region = regions[regionIndex];
+  
+    region.width = region.width - region.x;
+    region.height = region.height - region.y;
+  
+    if (region.numNeighbors == 0) {
+      region.firstNeighbor = (uint32_t) neighbors.size();
+    }
+  
+    int64_t numPixels = region.numPixels;
+    const int64_t *sumPtr = &sums[regionIndex * 3];
+  
+    region.meanB = (uint8_t) ((sumPtr[0] + (numPixels / 2)) / numPixels);
+    region.meanG = (uint8_t) ((sumPtr[1] + (numPixels / 2)) / numPixels);
+    region.meanR = (uint8_t) ((sumPtr[2] + (numPixels / 2)) / numPixels);
+  }
+  
+  RegionFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, REGION_FILE_MAGIC, sizeof(header.magic));
+  header.version = REGION_FILE_VERSION;
+  header.headerSize = sizeof(RegionFileHeader);
+  header.width = width;
+  header.height = height;
+  header.numRegions = (uint32_t) regions.size();
+  header.numNeighbors = (uint32_t) neighbors.size();
+  header.numRuns = runs.size();
+  header.regionsOffset = alignRegionFileOffset(sizeof(RegionFileHeader));
+  header.neighborsOffset = alignRegionFileOffset(header.regionsOffset + regions.size() * sizeof(RegionFileRegion));
+  header.rowsOffset = alignRegionFileOffset(header.neighborsOffset + neighbors.size() * sizeof(uint32_t));
+  header.runsOffset = alignRegionFileOffset(header.rowsOffset + rowOffsets.size() * sizeof(uint64_t));
+  header.fileSize = header.runsOffset + runs.size() * sizeof(RegionFileRun);
+  
+  std::ofstream outFile(filename.c_str(), std::ios::binary | std::ios::trunc);
+  
+  if (!outFile) {
+    return false;
+  }
+  
+  uint64_t offset = 0;
+  
+  outFile.write((const char*) &header, sizeof(header));
+  offset += sizeof(header);
+  
+  padRegionFile(outFile, offset, header.regionsOffset);
+  outFile.write((const char*) regions.data(), regions.size() * sizeof(RegionFileRegion));
+  offset += regions.size() * sizeof(RegionFileRegion);
+  
+  padRegionFile(outFile, offset, header.neighborsOffset);
+  outFile.write((const char*) neighbors.data(), neighbors.size() * sizeof(uint32_t));
+  offset += neighbors.size() * sizeof(uint32_t);
+  
+  padRegionFile(outFile, offset, header.rowsOffset);
+  outFile.write((const char*) rowOffsets.data(), rowOffsets.size() * sizeof(uint64_t));
+  offset += rowOffsets.size() * sizeof(uint64_t);
+  
+  padRegionFile(outFile, offset, header.runsOffset);
+  outFile.write((const char*) runs.data(), runs.size() * sizeof(RegionFileRun));
+  
+  return (bool) outFile;
+}
+
+RegionFile::RegionFile()
+: mapPtr(NULL), mapSize(0)
+{
+}
+
+RegionFile::~RegionFile()
+{
+  close();
+}
+
+void RegionFile::close()
+{
+  if (mapPtr != NULL) {
+    munmap(mapPtr, mapSize);
+    mapPtr = NULL;
+    mapSize = 0;
+  }
+}
+
+// True when count records of recordSize bytes at offset end inside the file
+
+static inline
+bool regionFileSectionFits(uint64_t offset, uint64_t count, uint64_t recordSize, uint64_t fileSize)
+{
+  return (offset % 8) == 0 && offset <= fileSize && count <= (fileSize - offset) / recordSize;
+}
+
+bool RegionFile::open(const string &filename)
+{
+  close();
+  
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  
+  if (fd == -1) {
+    return false;
+  }
+  
+  struct stat statBuf;
+  
+  if (fstat(fd, &statBuf) != 0 || statBuf.st_size < (off_t) sizeof(RegionFileHeader)) {
+    ::close(fd);
+    return false;
+  }
+  
+  void *ptr = mmap(NULL, (size_t) statBuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  
+  ::close(fd);
+  
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+  
+  mapPtr = ptr;
+  mapSize = (size_t) statBuf.st_size;
+  
+  const RegionFileHeader &h = header();
+  
+  bool valid = memcmp(h.magic, REGION_FILE_MAGIC, sizeof(h.magic)) == 0 &&
+    h.version == REGION_FILE_VERSION &&
+    h.headerSize == sizeof(RegionFileHeader) &&
+    h.fileSize == mapSize &&
+    h.width >= 0 && h.height >= 0 &&
+    regionFileSectionFits(h.regionsOffset, h.numRegions, sizeof(RegionFileRegion), mapSize) &&
+    regionFileSectionFits(h.neighborsOffset, h.numNeighbors, sizeof(uint32_t), mapSize) &&
+    regionFileSectionFits(h.rowsOffset, (uint64_t) h.height + 1, sizeof(uint64_t), mapSize) &&
+    regionFileSectionFits(h.runsOffset, h.numRuns, sizeof(RegionFileRun), mapSize);
+  
+  if (valid) {
+    const uint64_t *rowOffsets = (const uint64_t*) ((const uint8_t*) mapPtr + h.rowsOffset);
+    valid = (rowOffsets[h.height] == h.numRuns);
+  }
+  
+  for ( uint32_t regionIndex = 0; valid && regionIndex < h.numRegions; regionIndex++ ) {
+    const RegionFileRegion &r = region(regionIndex);
+    valid = r.x >= 0 && r.y >= 0 && r.width <= h.width - r.x && r.height <= h.height - r.y &&
+      r.firstNeighbor <= h.numNeighbors && r.numNeighbors <= h.numNeighbors - r.firstNeighbor;
+  }
+  
+  if (!valid) {
+    cerr << "error : \"" << filename << "\" is not a valid region file" << endl;
+    close();
+    return false;
+  }
+  
+  return true;
+}
+
+const RegionFileRegion& RegionFile::region(uint32_t regionIndex) const
+{
+  const RegionFileHeader &h = header();
+  assert(regionIndex < h.numRegions);
+  const RegionFileRegion *regions = (const RegionFileRegion*) ((const uint8_t*) mapPtr + h.regionsOffset);
+  return regions[regionIndex];
+}
+
+const uint32_t* RegionFile::neighbors(uint32_t regionIndex, uint32_t &numNeighbors) const
+{
+  const RegionFileRegion &r = region(regionIndex);
+  const uint32_t *neighbors = (const uint32_t*) ((const uint8_t*) mapPtr + header().neighborsOffset);
+  numNeighbors = r.numNeighbors;
+  return neighbors + r.firstNeighbor;
+}
+
+const RegionFileRun* RegionFile::rowRuns(int32_t y, uint32_t &numRuns) const
+{
+  const RegionFileHeader &h = header();
+  assert(y >= 0 && y < h.height);
+  const uint64_t *rowOffsets = (const uint64_t*) ((const uint8_t*) mapPtr + h.rowsOffset);
+  const RegionFileRun *runs = (const RegionFileRun*) ((const uint8_t*) mapPtr + h.runsOffset);
+  numRuns = (uint32_t) (rowOffsets[y+1] - rowOffsets[y]);
+  return runs + rowOffsets[y];
+}
+
+void RegionFile::regionMask(uint32_t regionIndex, Mat &maskMat) const
+{
+  const RegionFileRegion &r = region(regionIndex);
+  
+  maskMat.create(r.height, r.width, CV_8UC1);
+  
+  for ( int32_t y = r.y; y < r.y + r.height; y++ ) {
+    uint32_t numRuns;
+    const RegionFileRun *runs = rowRuns(y, numRuns);
+    uint8_t *maskRowPtr = maskMat.ptr<uint8_t>(y - r.y);
+    memset(maskRowPtr, 0, r.width);
+  
+    int32_t x = 0;
+  
+    for ( uint32_t i = 0; i < numRuns && x < r.x + r.width; i++ ) {
+      if (runs[i].region == regionIndex) {
+        memset(maskRowPtr + (x - r.x), 0xFF, runs[i].length);
+      }
+      x += runs[i].length;
+    }
+  }
+}
+
+void RegionFile::readTags(Mat &tagsMat) const
+{
+  const RegionFileHeader &h = header();
+  
+  tagsMat.create(h.height, h.width, CV_8UC3);
+  
+  for ( int32_t y = 0; y < h.height; y++ ) {
+    uint32_t numRuns;
+    const RegionFileRun *runs = rowRuns(y, numRuns);
+    uint8_t *tagsRowPtr = tagsMat.ptr<uint8_t>(y);
+  
+    for ( uint32_t i = 0; i < numRuns; i++ ) {
+      uint32_t tag = region(runs[i].region).tag;
+  
+      for ( uint32_t j = 0; j < runs[i].length; j++ ) {
+        tagsRowPtr[0] = tag & 0xFF;
+        tagsRowPtr[1] = (tag >> 8) & 0xFF;
+        tagsRowPtr[2] = (tag >> 16) & 0xFF;
+        tagsRowPtr += 3;
+      }
+    }
+  }
+}
@@ -0,0 +1,121 @@
+// Compact binary output for a segmentation. Instead of a 24 bit PNG that has to
+// be decoded and parsed back into regions, a region file holds a table with the
+// tag, pixel count, bbox, mean color and neighbors of each region followed by
+// the label rows as runs. All the sections are fixed size records at offsets
+// given in the header, so that a reader can mmap() the file and query one
+// region, or decode only the rows in its bbox, without reading the whole image.
+//
+// Layout, all values in little endian byte order:
+//
+// RegionFileHeader
+// RegionFileRegion x numRegions, in the order a raster scan first finds them
+// uint32_t x numNeighbors, the sorted neighbor region indexes of each region
+// uint64_t x (height + 1), index of the first run of each row
+// RegionFileRun x numRuns
+
+#ifndef REGION_FILE_H
+#define	REGION_FILE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+
+#include <string>
+
+#define REGION_FILE_MAGIC "CSREGION"
+#define REGION_FILE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  int32_t width;
+  int32_t height;
+  uint32_t numRegions;
+  uint32_t numNeighbors;
+  uint64_t numRuns;
+  uint64_t regionsOffset;
+  uint64_t neighborsOffset;
+  uint64_t rowsOffset;
+  uint64_t runsOffset;
+  uint64_t fileSize;
+} RegionFileHeader;
+
+typedef struct {
+  // 24 bit tag of the region in the tags image
+  uint32_t tag;
+  uint32_t numPixels;
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  uint8_t meanB;
+  uint8_t meanG;
+  uint8_t meanR;
+  uint8_t reserved;
+  // Neighbors are numNeighbors values starting at firstNeighbor
+  uint32_t firstNeighbor;
+  uint32_t numNeighbors;
+} RegionFileRegion;
+
+typedef struct {
+  uint32_t length;
+  uint32_t region;
+} RegionFileRun;
+
+// Write the tags of a 24 bit tags image as a region file, the mean colors are
+// those of the inputImg pixels. Two regions are neighbors when a pixel of one
+// is 4 connected to a pixel of the other. Returns false if the file could not
+// be written.
+
+bool writeRegionFile(const std::string &filename, const cv::Mat &inputImg, const cv::Mat &tagsImg);
+
+// Read only view of a region file mapped into memory
+
+class RegionFile
+{
+public:
+  RegionFile();
+
+  ~RegionFile();
+
+  // Map the file and check that each section and each region fits inside it,
+  // returns false if the file could not be read or is not a valid region file.
+  // The runs are not checked so that opening does not touch every page.
+
+  bool open(const std::string &filename);
+
+  void close();
+
+  const RegionFileHeader& header() const {
+    return *((const RegionFileHeader*) mapPtr);
+  }
+
+  const RegionFileRegion& region(uint32_t regionIndex) const;
+
+  // Neighbor region indexes of a region, numNeighbors is set to the count
+
+  const uint32_t* neighbors(uint32_t regionIndex, uint32_t &numNeighbors) const;
+
+  // Runs of row y, numRuns is set to the count
+
+  const RegionFileRun* rowRuns(int32_t y, uint32_t &numRuns) const;
+
+  // Write a CV_8UC1 mask the size of the region bbox where 0xFF means that the
+  // pixel is in the region, only the rows of the bbox are decoded.
+
+  void regionMask(uint32_t regionIndex, cv::Mat &maskMat) const;
+
+  // Decode all the rows back into a 24 bit tags image
+
+  void readTags(cv::Mat &tagsMat) const;
+
+private:
+  void *mapPtr;
+  size_t mapSize;
+
+  RegionFile(const RegionFile &);
+  RegionFile& operator=(const RegionFile &);
+};
+
+#endif // REGION_FILE_H
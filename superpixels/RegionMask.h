@@ -0,0 +1,165 @@
+// A RegionMask is a CV_8UC1 mask that only has storage for the pixels inside a
+// bounded cv::Rect of a larger frame. A region is captured from a small set of
+// coords, so a mask the size of the region bbox means that clearing, scanning
+// and copying the mask costs the size of the region and not the size of the
+// frame. Coords are frame coords, mat() is a Mat header over the bbox pixels for
+// OpenCV calls, where the frame pixel (x, y) is at (x - roi.x, y - roi.y). The
+// storage is kept by reset() so that a mask reused for the next region does
+// not allocate unless that region has a larger bbox. A copy shares the pixels
+// just like a Mat.
+
+#ifndef REGION_MASK_H
+#define	REGION_MASK_H
+
+#include <opencv2/opencv.hpp>
+
+#include <string.h>
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+#include "Coord.h"
+
+class RegionMask {
+  public:
+
+  cv::Rect roi;
+
+  RegionMask()
+  {
+  }
+
+  RegionMask(const cv::Rect &roi)
+  {
+    reset(roi);
+  }
+
+  // Clear the mask and use new bounds
+
+  void reset(const cv::Rect &roi) {
+    this->roi = roi;
+
+    const int area = roi.width * roi.height;
+
+    if (area <= 0) {
+      buffer = cv::Mat();
+      return;
+    }
+
+    if (storage.cols < area) {
+      storage.create(1, area, CV_8UC1);
+    }
+
+    buffer = storage.colRange(0, area).reshape(1, roi.height);
+    memset(buffer.data, 0, area);
+  }
+
+  bool empty() const {
+    return buffer.empty();
+  }
+
+  // True when the coord is inside the bounds
+
+  bool inside(Coord c) const {
+    return ((int)c.x >= roi.x) && ((int)c.y >= roi.y) && ((int)c.x < (roi.x + roi.width)) && ((int)c.y < (roi.y + roi.height));
+  }
+
+  // True when the coord is inside the bounds and on
+
+  bool contains(Coord c) const {
+    return inside(c) && (buffer.at<uint8_t>((int)c.y - roi.y, (int)c.x - roi.x) != 0);
+  }
+
+  // Turn on a coord that must be inside the bounds
+
+  void set(Coord c) {
+#if defined(DEBUG)
+    assert(inside(c));
+#endif // DEBUG
+    buffer.at<uint8_t>((int)c.y - roi.y, (int)c.x - roi.x) = 0xFF;
+  }
+
+  // Header over the bbox pixels
+
+  cv::Mat& mat() {
+    return buffer;
+  }
+
+  const cv::Mat& mat() const {
+    return buffer;
+  }
+
+  // Read the bbox pixels from a frame size mask
+
+  void copyFrom(const cv::Mat &frameMask) {
+    frameMask(roi).copyTo(buffer);
+  }
+
+  // Write the bbox pixels into a frame size mask, the frame pixels outside the
+  // bbox are not changed.
+
+  void copyTo(cv::Mat &frameMask) const {
+    if (!buffer.empty()) {
+      cv::Mat frameRoiMat = frameMask(roi);
+      buffer.copyTo(frameRoiMat);
+    }
+  }
+
+  // Invoke f(Coord) for each coord that is on in sorted order
+
+  template <typename F>
+  void forEach(F f) const {
+    for ( int y = 0; y < buffer.rows; y++ ) {
+      const uint8_t *rowPtr = buffer.ptr<uint8_t>(y);
+      for ( int x = 0; x < buffer.cols; x++ ) {
+        if (rowPtr[x]) {
+          f(Coord(roi.x + x, roi.y + y));
+        }
+      }
+    }
+  }
+
+  // Frame coords of the pixels that are on, in the same order as findNonZero()
+  // on a frame size mask.
+
+  void findNonZero(std::vector<cv::Point> &locations) const {
+    locations.clear();
+    forEach([&locations](Coord c) {
+      locations.push_back(cv::Point(c.x, c.y));
+    });
+  }
+
+  // Bounds of the pixels that are on in frame coords, an empty rect when no
+  // pixel is on.
+
+  cv::Rect nonZeroBounds() const {
+    int minX = INT_MAX;
+    int minY = INT_MAX;
+    int maxX = -1;
+    int maxY = -1;
+
+    forEach([&](Coord c) {
+      minX = std::min(minX, (int)c.x);
+      minY = std::min(minY, (int)c.y);
+      maxX = std::max(maxX, (int)c.x);
+      maxY = std::max(maxY, (int)c.y);
+    });
+
+    if (maxX < 0) {
+      return cv::Rect();
+    }
+
+    return cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
+  }
+
+  private:
+
+  // One row that is at least as large as the largest bbox so far
+
+  cv::Mat storage;
+
+  cv::Mat buffer;
+};
+
+#endif // REGION_MASK_H
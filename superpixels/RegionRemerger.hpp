@@ -16,6 +16,8 @@
 
 #include "OpenCVUtil.h"
 #include "OpenCVIter.hpp"
+#include "RegionMask.h"
+#include "MatPool.h"
 
 using cv::Mat;
 using std::string;
@@ -30,58 +32,104 @@ using std::vector;
 
 class RegionRemerger {
 public:
+  // Buffers checked out of the pool passed to the constructor, declared before
+  // the Mats that refer to them so that the Mats release the pixels first.
+  
+  PooledMat mergeMatBuffer;
+  PooledMat maskMatBuffer;
+  PooledMat mergedMaskBuffer;
+  
   CvSize size;
   Mat maskMat;
   Mat mergeMat;
   
+  // 0xFF for each pixel that has been set in mergeMat. The merge methods set
+  // this mask for the pixels they write, so mergeMat does not need to be
+  // scanned to find the pixels that are already merged.
+  
+  Mat mergedMask;
+  
   // tag that should be used next. This tag increases in value
   // each time a new set of pixels is merged in.
   
   int32_t mergedTag = 1;
   
-  uint32_t tagsAdlerBeforeMerge = 0;
+  // Number of regions and pixels written by mergeFromMask(), the leftover pixels
+  // written by mergeLeftovers() are not counted. When no region was captured the
+  // merged tags are the original tags.
+  
+  int numCapturedRegions = 0;
+  
+  int numCapturedPixels = 0;
   
-  RegionRemerger(const Mat &_tagsImg)
+  // Adler of the pixel locations of each captured region in merge order, updated
+  // as the pixels are written so that the merged tags need not be rescanned to
+  // tell one capture result from another.
+  
+  uint32_t captureFingerprint = 1;
+  
+  // When matPool is not NULL the frame size Mats are recycled buffers
+  
+  RegionRemerger(const Mat &_tagsImg, MatPool *matPool = NULL)
   {
-    mergeMat = _tagsImg.clone();
-    mergeMat = Scalar(0,0,0);
     size = _tagsImg.size();
-    maskMat = Mat(size, CV_8UC1, Scalar(0));
+    mergeMatBuffer = acquirePooledMat(matPool, size, _tagsImg.type(), true);
+    maskMatBuffer = acquirePooledMat(matPool, size, CV_8UC1, true);
+    mergedMaskBuffer = acquirePooledMat(matPool, size, CV_8UC1, true);
+    mergeMat = mergeMatBuffer.mat;
+    maskMat = maskMatBuffer.mat;
+    mergedMask = mergedMaskBuffer.mat;
   }
   
   // Reset the state of maskMat to be 0xFF for each pixel that is non-zero in mergeMat
   
   void mergeMatToMask() {
-
-    for_each_byte_const_bgr(maskMat, mergeMat, [](uint8_t *maskBPtr, uint8_t B, uint8_t G, uint8_t R) {
-      if (B == 0 && G == 0 && R == 0) {
-        *maskBPtr = 0;
-      } else {
-        *maskBPtr = 0xFF;
-      }
-    });
-    
+    mergedMask.copyTo(maskMat);
     return;
   }
 
   // When maskMat is written then scan for non-zero values in maskMat and then generate a new
-  // tag and set each corresponding pixel in mergeMat.
+  // tag and set each corresponding pixel in mergeMat. Returns the bbox of the merged pixels.
   
-  void mergeFromMask() {
+  cv::Rect mergeFromMask() {
     vector<Point> locations;
     findNonZero(maskMat, locations);
-    
+    return mergeLocations(locations);
+  }
+  
+  // Merge the pixels that are on in a region mask, only the bbox of the mask is
+  // scanned so maskMat is not used.
+  
+  cv::Rect mergeFromMask(const RegionMask &mask) {
+    vector<Point> locations;
+    mask.findNonZero(locations);
+    return mergeLocations(locations);
+  }
+  
+  // Set a new tag for each location in mergeMat, the locations are in raster order
+  
+  cv::Rect mergeLocations(const vector<Point> &locations) {
     assert(locations.size() > 0);
     
     Vec3b mergedVec = Vec3BToUID(mergedTag);
     
+    int minX = size.width;
+    int minY = size.height;
+    int maxX = -1;
+    int maxY = -1;
+    
     for ( Point p : locations ) {
       int x = p.x;
       int y = p.y;
       
-      Vec3b vec = mergeMat.at<Vec3b>(y, x);
+      minX = std::min(minX, x);
+      minY = std::min(minY, y);
+      maxX = std::max(maxX, x);
+      maxY = std::max(maxY, y);
+      
+      uint8_t &merged = mergedMask.at<uint8_t>(y, x);
       
-      if (vec[0] == 0x0 && vec[1] == 0x0 && vec[2] == 0x0) {
+      if (merged == 0x0) {
         // This pixel has not been seen before, define new merge tag value
         
         if (false) {
@@ -89,10 +137,11 @@ public:
         }
         
         mergeMat.at<Vec3b>(y, x) = mergedVec;
+        merged = 0xFF;
       } else {
         // A region must not attempt to include pixels from a previously merged region ever!
         
-        uint32_t alreadySetTag = Vec3BToUID(vec);
+        uint32_t alreadySetTag = Vec3BToUID(mergeMat.at<Vec3b>(y, x));
         
         printf("coord (%5d, %5d) = attempted remerge when tag already set to 0x%08X aka %d\n", x, y, alreadySetTag, alreadySetTag);
         assert(0);
@@ -101,45 +150,73 @@ public:
     
     // Update merge tag after setting all pixel values
     mergedTag += 1;
+    
+    numCapturedRegions += 1;
+    numCapturedPixels += (int) locations.size();
+    captureFingerprint = my_adler32(captureFingerprint, (unsigned char const *) locations.data(), (uint32_t) (locations.size() * sizeof(Point)), 0);
+    
+    if (maxX < 0) {
+      return cv::Rect();
+    }
+    
+    return cv::Rect(minX, minY, maxX - minX + 1, maxY - minY + 1);
   }
   
   // FIXME: no need to pass tagMat, simply merge using next uid
   
+  // Each remaining tag that has not been merged becomes a new region. The
+  // pixels are written in one pass over the rows, a new merged tag is given
+  // to each srm tag in the order the rows first reach it and a run of pixels
+  // with the same srm tag only does one lookup. The tagMat is CV_8UC3 or
+  // CV_32SC1.
+  
   void mergeLeftovers(const Mat &tagMat) {
-    // Gather any remaining tags that have not been merged
-    // and add these as new sets of pixels.
+    const bool debug = isDebugTraceEnabled();
+    
+    unordered_map<uint32_t, int32_t> srmTagToMergedTag;
+    
+    uint32_t lastSrmTag = 0;
+    int32_t lastMergedTag = 0;
+    Vec3b lastMergedVec;
+    bool hasLastTag = false;
     
-    unordered_map<uint32_t, vector<Coord>> mergeTagsToCoords;
+    vector<uint32_t> rowBuffer(tagMat.cols);
     
     for ( int y = 0; y < mergeMat.rows; y++ ) {
+      const uint32_t *tagPtr = readTagsRow(tagMat, y, rowBuffer.data());
+      Vec3b *mergePtr = mergeMat.ptr<Vec3b>(y);
+      uint8_t *mergedPtr = mergedMask.ptr<uint8_t>(y);
+      
       for ( int x = 0; x < mergeMat.cols; x++ ) {
-        Vec3b vec = mergeMat.at<Vec3b>(y, x);
+        if (mergedPtr[x] != 0x0) {
+          continue;
+        }
         
-        if (vec[0] == 0x0 && vec[1] == 0x0 && vec[2] == 0x0) {
-          vec = tagMat.at<Vec3b>(y, x);
-          uint32_t srmTag = Vec3BToUID(vec);
+        uint32_t srmTag = tagPtr[x];
+        
+        if (!hasLastTag || srmTag != lastSrmTag) {
+          auto it = srmTagToMergedTag.find(srmTag);
+          
+          if (it == srmTagToMergedTag.end()) {
+            it = srmTagToMergedTag.insert(it, std::make_pair(srmTag, mergedTag));
+            mergedTag += 1;
+          }
           
-          vector<Coord> &vecRef = mergeTagsToCoords[srmTag];
-          vecRef.push_back(Coord(x, y));
+          lastSrmTag = srmTag;
+          lastMergedTag = it->second;
+          lastMergedVec = Vec3BToUID(lastMergedTag);
+          hasLastTag = true;
         }
-      }
-    }
-    
-    for ( auto & pair : mergeTagsToCoords ) {
-      vector<Coord> &vecRef = pair.second;
-      
-      for ( Coord c : vecRef ) {
-        Vec3b mergedVec = Vec3BToUID(mergedTag); // FIXME: do outside loop
-        mergeMat.at<Vec3b>(c.y, c.x) = mergedVec;
         
-        if (true) {
-          fprintf(stdout, "merge unmerged srm tag at (%5d, %5d) = 0X%08X\n", c.x, c.y, mergedTag);
+        mergePtr[x] = lastMergedVec;
+        mergedPtr[x] = 0xFF;
+        
+        if (debug) {
+          fprintf(stdout, "merge unmerged srm tag at (%5d, %5d) = 0X%08X\n", x, y, lastMergedTag);
         }
       }
-      
-      mergedTag += 1;
     }
-
+    
     return;
   }
   
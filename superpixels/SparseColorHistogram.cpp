@@ -0,0 +1,252 @@
+// A sparse color histogram stores only the non-zero bins of a 3D color histogram
+
+#include "SparseColorHistogram.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+static
+bool CompareSparseColorHistogramBinFunc (const SparseColorHistogramBin &bin1, const SparseColorHistogramBin &bin2) {
+  return (bin1.bin < bin2.bin);
+}
+
+// Bin indexes are collected for each pixel and then sorted, runs of the same
+// index are then counted. A run of the same pixel skips the bin calculation.
+
+void SparseColorHistogram::parse(const Mat &pixels, int binDim)
+{
+  assert(pixels.type() == CV_8UC3);
+  assert(binDim > 0 && binDim <= 256);
+
+  this->binDim = binDim;
+  bins.clear();
+
+  vector<uint32_t> binIndexes;
+  binIndexes.reserve(pixels.rows * pixels.cols);
+
+  uint32_t lastPixel = 0xFFFFFFFF;
+  uint32_t lastIndex = 0;
+
+  for ( int y = 0; y < pixels.rows; y++ ) {
+    const Vec3b *rowPtr = pixels.ptr<Vec3b>(y);
+
+    for ( int x = 0; x < pixels.cols; x++ ) {
+      const Vec3b &vec = rowPtr[x];
+      uint32_t pixel = (vec[0] << 16) | (vec[1] << 8) | vec[2];
+
+      if (pixel != lastPixel) {
+        lastPixel = pixel;
+        lastIndex = ((channelBin(vec[0], binDim) * binDim) + channelBin(vec[1], binDim)) * binDim + channelBin(vec[2], binDim);
+      }
+
+      binIndexes.push_back(lastIndex);
+    }
+  }
+
+  sort(binIndexes.begin(), binIndexes.end());
+
+  for ( uint32_t binIndex : binIndexes ) {
+    if (!bins.empty() && bins.back().bin == binIndex) {
+      bins.back().count += 1.0f;
+    } else {
+      SparseColorHistogramBin bin;
+      bin.bin = binIndex;
+      bin.count = 1.0f;
+      bins.push_back(bin);
+    }
+  }
+}
+
+// Merge of two sorted bin lists
+
+void SparseColorHistogram::add(const SparseColorHistogram &other)
+{
+  if (other.bins.empty()) {
+    return;
+  }
+  if (bins.empty()) {
+    *this = other;
+    return;
+  }
+
+  assert(binDim == other.binDim);
+
+  vector<SparseColorHistogramBin> merged;
+  merged.reserve(bins.size() + other.bins.size());
+
+  auto it1 = bins.begin();
+  auto it2 = other.bins.begin();
+
+  while (it1 != bins.end() && it2 != other.bins.end()) {
+    if (it1->bin < it2->bin) {
+      merged.push_back(*it1++);
+    } else if (it2->bin < it1->bin) {
+      merged.push_back(*it2++);
+    } else {
+      SparseColorHistogramBin bin = *it1++;
+      bin.count += (it2++)->count;
+      merged.push_back(bin);
+    }
+  }
+
+  merged.insert(merged.end(), it1, bins.end());
+  merged.insert(merged.end(), it2, other.bins.end());
+
+  bins.swap(merged);
+}
+
+void SparseColorHistogram::normalize(float maxValue)
+{
+  float maxVal = maxCount();
+
+  if (maxVal == 0.0f) {
+    return;
+  }
+
+  double scale = maxValue / maxVal;
+
+  for ( SparseColorHistogramBin &bin : bins ) {
+    bin.count = (float) (bin.count * scale);
+  }
+}
+
+double SparseColorHistogram::sum() const
+{
+  double total = 0.0;
+  for ( const SparseColorHistogramBin &bin : bins ) {
+    total += bin.count;
+  }
+  return total;
+}
+
+float SparseColorHistogram::maxCount() const
+{
+  float maxVal = 0.0f;
+  for ( const SparseColorHistogramBin &bin : bins ) {
+    if (bin.count > maxVal) {
+      maxVal = bin.count;
+    }
+  }
+  return maxVal;
+}
+
+// Same formula as compareHist() with CV_COMP_BHATTACHARYYA, only the bins
+// that are non-zero in both histograms add to the result.
+
+double SparseColorHistogram::bhattacharyya(const SparseColorHistogram &other) const
+{
+  assert(binDim == other.binDim);
+
+  double s1 = sum();
+  double s2 = other.sum();
+  double result = 0.0;
+
+  auto it1 = bins.begin();
+  auto it2 = other.bins.begin();
+
+  while (it1 != bins.end() && it2 != other.bins.end()) {
+    if (it1->bin < it2->bin) {
+      ++it1;
+    } else if (it2->bin < it1->bin) {
+      ++it2;
+    } else {
+      result += std::sqrt(it1->count * it2->count);
+      ++it1;
+      ++it2;
+    }
+  }
+
+  s1 *= s2;
+  s1 = fabs(s1) > FLT_EPSILON ? 1.0 / sqrt(s1) : 1.0;
+  result = 1.0 - result * s1;
+  return sqrt(std::max(result, 0.0));
+}
+
+// Same formula as compareHist() with CV_COMP_CHISQR, a bin only adds to the
+// result when it is non-zero in this histogram.
+
+double SparseColorHistogram::chiSquare(const SparseColorHistogram &other) const
+{
+  assert(binDim == other.binDim);
+
+  double result = 0.0;
+
+  auto it2 = other.bins.begin();
+
+  for ( const SparseColorHistogramBin &bin : bins ) {
+    while (it2 != other.bins.end() && it2->bin < bin.bin) {
+      ++it2;
+    }
+
+    double a = bin.count;
+    double b = (it2 != other.bins.end() && it2->bin == bin.bin) ? it2->count : 0.0;
+
+    if (fabs(a) > DBL_EPSILON) {
+      result += (a - b) * (a - b) / a;
+    }
+  }
+
+  return result;
+}
+
+// Each pixel is looked up with a binary search over the sorted bins, the
+// result for the last pixel is reused for a run of the same pixel.
+
+void SparseColorHistogram::backproject(const Mat &pixels, Mat &output) const
+{
+  assert(pixels.type() == CV_8UC3);
+
+  output.create(pixels.rows, pixels.cols, CV_8UC1);
+
+  // Scale counts the same way as parse3DHistogram() and calcBackProject()
+
+  float maxVal = maxCount();
+  double normScale = (maxVal > 1.0f) ? (1.0 / maxVal) : 1.0;
+
+  uint32_t lastPixel = 0xFFFFFFFF;
+  uint8_t lastValue = 0;
+
+  SparseColorHistogramBin key;
+  key.count = 0.0f;
+
+  for ( int y = 0; y < pixels.rows; y++ ) {
+    const Vec3b *rowPtr = pixels.ptr<Vec3b>(y);
+    uint8_t *outPtr = output.ptr<uint8_t>(y);
+
+    for ( int x = 0; x < pixels.cols; x++ ) {
+      const Vec3b &vec = rowPtr[x];
+      uint32_t pixel = (vec[0] << 16) | (vec[1] << 8) | vec[2];
+
+      if (pixel != lastPixel) {
+        lastPixel = pixel;
+        key.bin = ((channelBin(vec[0], binDim) * binDim) + channelBin(vec[1], binDim)) * binDim + channelBin(vec[2], binDim);
+
+        auto it = lower_bound(bins.begin(), bins.end(), key, CompareSparseColorHistogramBinFunc);
+
+        if (it != bins.end() && it->bin == key.bin) {
+          float normalized = (float) (it->count * normScale);
+          lastValue = saturate_cast<uint8_t>(normalized * 255.0);
+        } else {
+          lastValue = 0;
+        }
+      }
+
+      outPtr[x] = lastValue;
+    }
+  }
+}
+
+void SparseColorHistogram::toMat(Mat &hist) const
+{
+  int sizes[] = {binDim, binDim, binDim};
+
+  hist.create(3, sizes, CV_32F);
+  hist = Scalar(0);
+
+  float *histPtr = (float *) hist.data;
+
+  for ( const SparseColorHistogramBin &bin : bins ) {
+    histPtr[bin.bin] = bin.count;
+  }
+}
@@ -0,0 +1,98 @@
+// A sparse color histogram stores only the non-zero bins of a 3D histogram of
+// B, G, R pixels as a vector of (bin, count) pairs sorted by bin index. Most
+// superpixels are small and cover only a few bins, so a sparse histogram is
+// much smaller than a dense 16x16x16 float Mat and the compare methods only
+// visit the bins that are in use. The bin layout and the compare results are
+// the same as calcHist() and compareHist() with uniform ranges of 0 to 256.
+
+#ifndef SPARSE_COLOR_HISTOGRAM_H
+#define	SPARSE_COLOR_HISTOGRAM_H
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+typedef struct {
+  uint32_t bin;
+  float count;
+} SparseColorHistogramBin;
+
+class SparseColorHistogram {
+  public:
+
+  // Number of bins for each channel
+
+  int binDim;
+
+  // The non-zero bins sorted by increasing bin index. The bin index for a
+  // pixel is ((B * binDim) + G) * binDim + R where each of B, G, R is the
+  // channel value scaled to the range of the bins.
+
+  vector<SparseColorHistogramBin> bins;
+
+  SparseColorHistogram()
+  : binDim(16)
+  {
+  }
+
+  // Parse CV_8UC3 pixels, any existing bins are discarded
+
+  void parse(const Mat &pixels, int binDim = 16);
+
+  // Add the counts from other to this histogram, both must have the same binDim
+
+  void add(const SparseColorHistogram &other);
+
+  // Scale the counts so that the largest count is maxValue
+
+  void normalize(float maxValue = 1.0f);
+
+  // Sum of the counts in all bins
+
+  double sum() const;
+
+  // Largest count in any bin, zero when empty
+
+  float maxCount() const;
+
+  bool empty() const {
+    return bins.empty();
+  }
+
+  // BHATTACHARYYA distance, 0.0 for the same distribution and 1.0 when no
+  // bins are shared. This compare is not changed by scaling either histogram.
+
+  double bhattacharyya(const SparseColorHistogram &other) const;
+
+  // CV_COMP_CHISQR distance where this histogram is the first argument
+
+  double chiSquare(const SparseColorHistogram &other) const;
+
+  // Write a CV_8UC1 back projection of the CV_8UC3 pixels, each output value is
+  // the count for the bin of the pixel scaled so that the largest count is 255.
+  // The result is the same as calcBackProject() with a histogram normalized by
+  // parse3DHistogram().
+
+  void backproject(const Mat &pixels, Mat &output) const;
+
+  // Create a dense histogram Mat with the same layout as calcHist()
+
+  void toMat(Mat &hist) const;
+
+  private:
+
+  // Index of the bin for a channel value
+
+  static inline
+  uint32_t channelBin(uint8_t value, int binDim) {
+    if (binDim == 16) {
+      return value >> 4;
+    } else {
+      return (uint32_t) ((value * binDim) >> 8);
+    }
+  }
+};
+
+#endif // SPARSE_COLOR_HISTOGRAM_H
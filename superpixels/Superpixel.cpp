@@ -9,8 +9,10 @@
 
 #include "OpenCVUtil.h"
 
+#include "OpenCVHull.hpp"
+
 Superpixel::Superpixel()
-:tag(0), assocDataPtr(NULL), flags(0)
+:tag(0), flags(0), bboxNumCoords(0), colorStatsPtr(NULL), hullPtr(NULL), hullNumCoords(0), assocDataPtr(NULL)
 {
   ;
 }
@@ -20,9 +22,21 @@ Superpixel::Superpixel(int32_t tag)
   this->tag = tag;
   this->assocDataPtr = NULL;
   this->flags = 0;
+  this->bboxNumCoords = 0;
+  this->colorStatsPtr = NULL;
+  this->hullPtr = NULL;
+  this->hullNumCoords = 0;
 }
 
 Superpixel::~Superpixel()
+{
+  delete colorStatsPtr;
+  delete hullPtr;
+  
+  releaseAssocData();
+}
+
+void Superpixel::releaseAssocData()
 {
 #if defined(ENABLE_SUPERPIXEL_ASSOC_DATA)
   if (this->assocDataPtr) {
@@ -47,6 +61,24 @@ Superpixel::~Superpixel()
 #endif // ENABLE_SUPERPIXEL_ASSOC_DATA
 }
 
+void Superpixel::recycle(int32_t tag)
+{
+  this->tag = tag;
+  this->flags = 0;
+  coords.clearKeepCapacity();
+  mergedEdgeWeights.clear();
+  unmergedEdgeWeights.clear();
+  this->bboxNumCoords = 0;
+  
+  delete colorStatsPtr;
+  this->colorStatsPtr = NULL;
+  delete hullPtr;
+  this->hullPtr = NULL;
+  this->hullNumCoords = 0;
+  
+  releaseAssocData();
+}
+
 void Superpixel::appendCoord(int x, int y)
 {
 #if defined(DEBUG)
@@ -76,29 +108,64 @@ void Superpixel::fillMatrixFromCoords(Mat &input, int32_t tag, Mat &output) {
   fillMatrixFromCoords(input, coords, output);
 }
 
+// Coords are typically in raster order, so the coords are processed as runs of
+// pixels with consecutive X values on the same row. Each run is copied with one
+// memcpy instead of one at<>() lookup per pixel.
+
+static inline
+int coordsRunLength(const vector<Coord> &coords, int i, int numCoords) {
+  const Coord &start = coords[i];
+  int runLength = 1;
+  
+  while ((i + runLength) < numCoords) {
+    const Coord &next = coords[i + runLength];
+    if (next.y != start.y || next.x != (start.x + runLength)) {
+      break;
+    }
+    runLength += 1;
+  }
+  
+  return runLength;
+}
+
 void Superpixel::fillMatrixFromCoords(Mat &input, vector<Coord> &coords, Mat &output) {
   const bool debug = false;
   
+  assert(input.type() == CV_8UC3);
+  
   int numCoords = (int) coords.size();
   
   output.create(1, numCoords, CV_8UC(3));
   
-  output = Scalar(0, 0, 0);
+  if (numCoords == 0) {
+    return;
+  }
   
-  int i = 0;
+  Vec3b *outPtr = output.ptr<Vec3b>(0);
   
-  for (auto coordsIter = coords.begin(); coordsIter != coords.end(); ++coordsIter, i++) {
-    Coord coord = *coordsIter;
-    int32_t X = coord.x;
-    int32_t Y = coord.y;
+  for ( int i = 0; i < numCoords; ) {
+    const Coord &coord = coords[i];
+    int runLength = coordsRunLength(coords, i, numCoords);
     
-    Vec3b pixelVec = input.at<Vec3b>(Y, X);
-    output.at<Vec3b>(0, i) = pixelVec;
+    const Vec3b *inPtr = input.ptr<Vec3b>(coord.y) + coord.x;
     
-    if (debug) {
+    if (runLength == 1) {
+      outPtr[i] = *inPtr;
+    } else {
+      memcpy((uint8_t*) &outPtr[i], (const uint8_t*) inPtr, runLength * sizeof(Vec3b));
+    }
+    
+    i += runLength;
+  }
+  
+  if (debug) {
+    for ( int i = 0; i < numCoords; i++ ) {
+      int32_t X = coords[i].x;
+      int32_t Y = coords[i].y;
+      
       // Print BGRA format
       
-      int32_t pixel = Vec3BToUID(pixelVec);
+      int32_t pixel = Vec3BToUID(outPtr[i]);
       char buffer[6+1];
       snprintf(buffer, 6+1, "%06X", pixel);
       
@@ -146,31 +213,65 @@ void Superpixel::reverseFillMatrixFromCoords(Mat &input, bool isGray, vector<Coo
     assert(isGray);
   }
   
-  int i = 0;
+  if (numCoords == 0) {
+    return;
+  }
   
-  for (auto coordsIter = coords.begin(); coordsIter != coords.end(); ++coordsIter, i++) {
-    Coord coord = *coordsIter;
-    int32_t X = coord.x;
-    int32_t Y = coord.y;
-    
-    Vec3b pixelVec;
-    
-    if (isGray) {
-      uint8_t gray = input.at<uint8_t>(0, i);
-      pixelVec[0] = gray;
-      pixelVec[1] = gray;
-      pixelVec[2] = gray;
-    } else {
-      pixelVec = input.at<Vec3b>(0, i);
+  const Vec3b *inPtr = isGray ? NULL : input.ptr<Vec3b>(0);
+  const uint8_t *inGrayPtr = isGray ? input.ptr<uint8_t>(0) : NULL;
+  
+  if (writeGrayscale) {
+    for ( int i = 0; i < numCoords; ) {
+      const Coord &coord = coords[i];
+      int runLength = coordsRunLength(coords, i, numCoords);
+      
+      uint8_t *outPtr = output.ptr<uint8_t>(coord.y) + coord.x;
+      
+      if (runLength == 1) {
+        *outPtr = inGrayPtr[i];
+      } else {
+        memcpy(outPtr, &inGrayPtr[i], runLength);
+      }
+      
+      i += runLength;
     }
-    
-    if (writeGrayscale) {
-      output.at<uint8_t>(Y, X) = pixelVec[0];
-    } else {
-      output.at<Vec3b>(Y, X) = pixelVec;
+  } else if (isGray) {
+    for ( int i = 0; i < numCoords; i++ ) {
+      const Coord &coord = coords[i];
+      uint8_t gray = inGrayPtr[i];
+      output.ptr<Vec3b>(coord.y)[coord.x] = Vec3b(gray, gray, gray);
     }
-    
-    if (debug) {
+  } else {
+    for ( int i = 0; i < numCoords; ) {
+      const Coord &coord = coords[i];
+      int runLength = coordsRunLength(coords, i, numCoords);
+      
+      Vec3b *outPtr = output.ptr<Vec3b>(coord.y) + coord.x;
+      
+      if (runLength == 1) {
+        *outPtr = inPtr[i];
+      } else {
+        memcpy((uint8_t*) outPtr, (const uint8_t*) &inPtr[i], runLength * sizeof(Vec3b));
+      }
+      
+      i += runLength;
+    }
+  }
+  
+  if (debug) {
+    for ( int i = 0; i < numCoords; i++ ) {
+      int32_t X = coords[i].x;
+      int32_t Y = coords[i].y;
+      
+      Vec3b pixelVec;
+      
+      if (isGray) {
+        uint8_t gray = inGrayPtr[i];
+        pixelVec = Vec3b(gray, gray, gray);
+      } else {
+        pixelVec = inPtr[i];
+      }
+      
       // Print BGRA format
       
       int32_t pixel = Vec3BToUID(pixelVec);
@@ -190,7 +291,151 @@ void Superpixel::reverseFillMatrixFromCoords(Mat &input, bool isGray, vector<Coo
 void
 Superpixel::bbox(int32_t &originX, int32_t &originY, int32_t &width, int32_t &height)
 {
-  ::bbox(originX, originY, width, height, this->coords);
+  if (bboxNumCoords == 0 || bboxNumCoords != coords.size()) {
+    // Scan the runs so that the coords are not flattened or expanded
+    
+    assert(!coords.empty());
+    
+    int32_t minX = INT32_MAX, minY = INT32_MAX, maxX = 0, maxY = 0;
+    
+    coords.forEachRun([&](const CoordRun &run) {
+      minX = mini(minX, run.x);
+      minY = mini(minY, run.y);
+      maxX = maxi(maxX, run.x + run.length - 1);
+      maxY = maxi(maxY, run.y);
+    });
+    
+    originX = minX;
+    originY = minY;
+    width = (maxX - minX) + 1;
+    height = (maxY - minY) + 1;
+    
+    cachedBbox = cv::Rect(originX, originY, width, height);
+    bboxNumCoords = (uint32_t) coords.size();
+    return;
+  }
+  
+  originX = cachedBbox.x;
+  originY = cachedBbox.y;
+  width = cachedBbox.width;
+  height = cachedBbox.height;
+}
+
+// Only the first and last coord of each run can be a hull vertex
+
+const vector<Point2i> &
+Superpixel::convexHull()
+{
+  if (hullPtr == NULL) {
+    hullPtr = new vector<Point2i>();
+  } else if (hullNumCoords != 0 && hullNumCoords == coords.size()) {
+    return *hullPtr;
+  }
+  
+  vector<Point2i> points;
+  
+  coords.forEachRun([&points](const CoordRun &run) {
+    points.push_back(Point2i(run.x, run.y));
+    if (run.length > 1) {
+      points.push_back(Point2i(run.x + run.length - 1, run.y));
+    }
+  });
+  
+  convexHullOfPoints(points, *hullPtr);
+  hullNumCoords = (uint32_t) coords.size();
+  
+  return *hullPtr;
+}
+
+void
+Superpixel::setColorStats(const Mat &input)
+{
+  assert(input.type() == CV_8UC3);
+  
+  if (colorStatsPtr == NULL) {
+    colorStatsPtr = new SuperpixelColorStats();
+  }
+  
+  uint64_t sum[3] = { 0, 0, 0 };
+  uint64_t sumSq[3] = { 0, 0, 0 };
+  
+  coords.forEachRun([&](const CoordRun &run) {
+    const Vec3b *rowPtr = input.ptr<Vec3b>(run.y) + run.x;
+    
+    for ( int j = 0; j < run.length; j++ ) {
+      const Vec3b &pixelVec = rowPtr[j];
+      
+      for ( int i = 0; i < 3; i++ ) {
+        uint32_t v = pixelVec[i];
+        sum[i] += v;
+        sumSq[i] += v * v;
+      }
+    }
+  });
+  
+  for ( int i = 0; i < 3; i++ ) {
+    colorStatsPtr->sum[i] = sum[i];
+    colorStatsPtr->sumSq[i] = sumSq[i];
+  }
+}
+
+bool
+Superpixel::colorMeanAndVariance(Vec3f &mean, Vec3f &variance)
+{
+  size_t numCoords = coords.size();
+  
+  if (colorStatsPtr == NULL || numCoords == 0) {
+    return false;
+  }
+  
+  for ( int i = 0; i < 3; i++ ) {
+    double m = (double) colorStatsPtr->sum[i] / numCoords;
+    double v = (double) colorStatsPtr->sumSq[i] / numCoords - m * m;
+    mean[i] = (float) m;
+    variance[i] = (float) ((v < 0.0) ? 0.0 : v);
+  }
+  
+  return true;
+}
+
+// The bbox is the union of the two boxes, the hulls are merged and the color sums
+// are added. When either superpixel does not have a value then the merged value
+// is not known.
+
+void
+Superpixel::mergeStats(Superpixel *srcPtr)
+{
+  bool dstBboxValid = (bboxNumCoords != 0 && bboxNumCoords == coords.size());
+  bool srcBboxValid = (srcPtr->bboxNumCoords != 0 && srcPtr->bboxNumCoords == srcPtr->coords.size());
+  
+  if (dstBboxValid && srcBboxValid) {
+    cachedBbox |= srcPtr->cachedBbox;
+    bboxNumCoords += srcPtr->bboxNumCoords;
+  } else {
+    bboxNumCoords = 0;
+  }
+  
+  bool dstHullValid = (hullPtr != NULL && hullNumCoords != 0 && hullNumCoords == coords.size());
+  bool srcHullValid = (srcPtr->hullPtr != NULL && srcPtr->hullNumCoords != 0 && srcPtr->hullNumCoords == srcPtr->coords.size());
+  
+  if (dstHullValid && srcHullValid) {
+    vector<Point2i> mergedHull;
+    mergeConvexHulls(*hullPtr, *srcPtr->hullPtr, mergedHull);
+    hullPtr->swap(mergedHull);
+    hullNumCoords += srcPtr->hullNumCoords;
+  } else {
+    hullNumCoords = 0;
+  }
+  
+  if (colorStatsPtr != NULL && srcPtr->colorStatsPtr != NULL) {
+    for ( int i = 0; i < 3; i++ ) {
+      colorStatsPtr->sum[i] += srcPtr->colorStatsPtr->sum[i];
+      colorStatsPtr->sumSq[i] += srcPtr->colorStatsPtr->sumSq[i];
+    }
+  } else {
+    delete colorStatsPtr;
+    colorStatsPtr = NULL;
+  }
 }
 
 // Filter the coords and return a vector that contains only the coordinates that share
@@ -457,262 +702,152 @@ Superpixel::filterEdgeCoords(Superpixel *superpixe1Ptr,
   return;
 }
 
-// This logic executes the heavy process of scanning the initial input tags to remove splay
-// pixels Seeds generated superpixels. This process is really just a workaround for what
-// appears to be a buggy edge case in the Seeds algo.
+// Find the root of a provisional label and halve the path along the way
 
-void Superpixel::splitSplayPixels(Mat &inOutTagImg)
+static inline
+int32_t splitSplayPixelsFind(vector<int32_t> &parents, int32_t label)
 {
-  const bool debug = false;
-
-  Mat mask(inOutTagImg.rows+2, inOutTagImg.cols+2, CV_8UC1);
-  Mat croppedMask(inOutTagImg.rows, inOutTagImg.cols, CV_8UC1);
-  
-  Rect filledRect;
+  while (parents[label] != label) {
+    parents[label] = parents[parents[label]];
+    label = parents[label];
+  }
+  return label;
+}
 
-  Rect borderRect(0, 0, inOutTagImg.cols+2, inOutTagImg.rows+2);
-  Rect maskROI(1, 1, inOutTagImg.cols, inOutTagImg.rows);
+// This logic scans the initial input tags to remove splay pixels from Seeds generated
+// superpixels. This process is really just a workaround for what appears to be a buggy
+// edge case in the Seeds algo where one tag is used by pixels that are not connected.
+// The 8 connected pieces of each tag are labelled in a single two pass connected
+// component sweep. The first piece of each tag in raster order keeps the tag and each
+// other piece is written with a new tag that is larger than any tag in the image.
 
-  Scalar scalarZero(0);
-  Scalar maskFillColor(255);
-  
-  int connectivity = 8;
-  
-  int flags = connectivity | FLOODFILL_FIXED_RANGE | FLOODFILL_MASK_ONLY;
-  
-  Point seed(0, 0);
-  
-  // Neighbor iter
-  
-  int32_t neighborOffsetsArr[] = {
-    -1, -1, // UL
-    0, -1, // U
-    1, -1, // UR
-    -1,  0, // L
-    1,  0, // R
-    -1,  1, // DL
-    0,  1, // D
-    1,  1  // DR
-  };
+void Superpixel::splitSplayPixels(Mat &inOutTagImg)
+{
+  const bool debug = false;
   
-  vector<pair<int32_t, int32_t> > neighborOffsets;
+  assert(inOutTagImg.type() == CV_8UC3);
   
-  for (int i = 0; i < sizeof(neighborOffsetsArr)/sizeof(int32_t); i += 2) {
-    pair<int32_t,int32_t> p(neighborOffsetsArr[i], neighborOffsetsArr[i+1]);
-    neighborOffsets.push_back(p);
-  }
+  const int width = inOutTagImg.cols;
+  const int height = inOutTagImg.rows;
   
-  assert(neighborOffsets.size() == 8);
+  // Provisional label of each pixel, the tag of each provisional label and the
+  // equivalence of labels that are found to be connected
   
-  // The seen table will contain an entry for each superpixel tag that has already been
-  // processed. When a new superpixel tag is seen, all neighbor pixels will be flood filled
-  // and as a result any duplicate pixels seen later on should have been processed by
-  // the flood fill.
+  vector<int32_t> labels(width * height);
+  vector<uint32_t> labelTags;
+  vector<int32_t> parents;
   
-  unordered_map<int32_t,bool> seen;
+  uint32_t maxTag = 0;
   
-  for( int y = 0; y < inOutTagImg.rows; y++ ) {
-    for( int x = 0; x < inOutTagImg.cols; x++ ) {
-      Vec3b tagVec = inOutTagImg.at<Vec3b>(y, x);
-      
-      int32_t centerTag = Vec3BToUID(tagVec);
-      
-      if (debug) {
-        cout << "center (" << x << "," << y << ") with tag " << centerTag << endl;
-      }
-      
-      // If this specific superpixel has not been processed yet then do a BFS
-      // to find the bounds of the superpixel.
-      
-      if (seen.count(centerTag) > 0) {
-        if (debug) {
-          cout << "tag already processed " << centerTag << endl;
-        }
-        
-        // Already seen so skip rest of processing
-        continue;
-      }
-      
-      // Flood fill into mask and determine which pixels are non-zero.
-      
-      mask = Scalar::all(0);
-      rectangle(mask, borderRect, maskFillColor);
-      
-      seed.x = x;
-      seed.y = y;
-      
-      if (debug) {
-        cout << "seed (" << seed.x << "," << seed.y << ") " << endl;
-      }
-      
-      if (debug) {
-      imwrite("flood_tags_input.png", inOutTagImg);
-      imwrite("flood_mask_input.png", mask);
-      }
-      
-      int numFilled = floodFill(inOutTagImg, mask, seed, maskFillColor, &filledRect, scalarZero, scalarZero, flags);
-      
-      mask *= 255.0;
-      
-      // Fill must have at least filled 1 pixel
-      
-      assert(filledRect.width > 0);
-      assert(filledRect.height > 0);
-
-      if (debug) {
-        cout << "flood fill bbox (" << filledRect.x << "," << filledRect.y << ") " << filledRect.width << " x " << filledRect.height << endl;
-        cout << "numFilled " << numFilled << endl;
+  for ( int y = 0; y < height; y++ ) {
+    const Vec3b *tagsRowPtr = inOutTagImg.ptr<Vec3b>(y);
+    const Vec3b *prevTagsRowPtr = (y > 0) ? inOutTagImg.ptr<Vec3b>(y-1) : NULL;
+    int32_t *labelsRowPtr = labels.data() + (y * width);
+    const int32_t *prevLabelsRowPtr = (y > 0) ? (labelsRowPtr - width) : NULL;
+    
+    for ( int x = 0; x < width; x++ ) {
+      uint32_t tag = Vec3BToUID(tagsRowPtr[x]);
+      if (tag > maxTag) {
+        maxTag = tag;
       }
       
-      // Create an initial cropped ROI that does not include the 1 pixel border
-      
-      Mat croppedMask = mask(maskROI);
-      
-      // The filledRect identified pixels are now in terms of the cropped mask image
-      
-      if (debug) {
-      Mat tagsCopy = inOutTagImg.clone();
-      rectangle(tagsCopy, filledRect, Scalar(255,255,255));
-      imwrite("flood_tags_rectangle_over.png", tagsCopy);
+      int32_t label = -1;
       
-      tagsCopy = Scalar(0, 0, 0);
-      rectangle(tagsCopy, filledRect, Scalar(255,255,255));
-      imwrite("flood_rectangle_over.png", tagsCopy);
+      // Check the W, NW, N and NE neighbors that were already labelled
       
-      imwrite("flood_tags.png", inOutTagImg);
-      imwrite("flood_mask2.png", mask);
-      imwrite("flood_mask.png", croppedMask);
+      if (x > 0 && labelTags[labelsRowPtr[x-1]] == tag) {
+        label = labelsRowPtr[x-1];
       }
       
-      // Iteration is defined in terms of checking for non-zero pixels in the range of the containing rect
-
-      int maxY = filledRect.y + filledRect.height;
-      int maxX = filledRect.x + filledRect.width;
-      
-      int countNonZero = 0;
-      
-      vector<pair<int32_t, int32_t> > likelyLineCoords;
-
-      for( int32_t rY = filledRect.y; rY < maxY; rY++ ) {
-        for( int32_t rX = filledRect.x; rX < maxX; rX++ ) {
-          uint8_t bVal = croppedMask.at<uint8_t>(rY, rX);
-          
-          if (bVal == 0) {
+      if (prevTagsRowPtr != NULL) {
+        for ( int nX = maxi(x - 1, 0); nX <= mini(x + 1, width - 1); nX++ ) {
+          if ((uint32_t) Vec3BToUID(prevTagsRowPtr[nX]) != tag) {
             continue;
           }
           
-          if (debug) {
-            cout << "found non-zero pixel " << (int)bVal << " at " << "(" << rX << "," << rY << ")" << endl;
-          }
-          
-          countNonZero += 1;
-          
-          uint8_t neighborsArr[9] =
-          {
-            0, 0, 0,
-            0, 0, 0,
-            0, 0, 0
-          };
-          int32_t neighborsArrOffset = 0;
-          
-          // Record any pixels that have just 2 non-zero neighbors. These will typically be straight lines.
-          
-          int numNeighbors = 0;
-          
-          // Loop over each neighbor around (X,Y) and lookup tag
-          
-          for (auto pairIter = neighborOffsets.begin() ; pairIter != neighborOffsets.end(); ++pairIter) {
-            int dX = pairIter->first;
-            int dY = pairIter->second;
-            
-            uint8_t neighborVal = 0;
-            
-            int nX = rX + dX;
-            int nY = rY + dY;
-            
-            if (nX < 0 || nX >= maxX) {
-              //neighborVal = 0;
-            } else if (nY < 0 || nY >= maxY) {
-              //neighborVal = 0;
-            } else {
-              neighborVal = croppedMask.at<uint8_t>(nY, nX);
-            }
-            
-            neighborsArr[neighborsArrOffset++] = neighborVal;
-            
-            if (neighborsArrOffset == 4) {
-              neighborsArrOffset++; // skip center
-            }
-            
-            if (neighborVal != 0) {
-              numNeighbors += 1;
-              
-              if (debug) {
-                cout << "neighbor on  at (" << nX << "," << nY << ")" << endl;
-              }
-            } else {
-              if (debug) {
-                cout << "neighbor off at (" << nX << "," << nY << ")" << endl;
-              }
-            }
-          } // end neighbor loop
-          
-          if (debug) {
-            cout << "num neighbors for (" << rX << "," << rY << ") is " << numNeighbors << endl;
-          }
-          
-          if (numFilled == 1) {
-            assert(numNeighbors == 0);
-          } else {
-            assert(numNeighbors > 0);
-          }
+          int32_t neighborLabel = prevLabelsRowPtr[nX];
           
-          assert(neighborsArr[4] == 0);
-          
-          // Detect a coord that is most likely to be either a horizontal or vertical line
-          // by looking for N=2 neighbors and (LEFT and RIGHT) or (UP AND DOWN)
-          
-          if (numNeighbors == 2) {
+          if (label == -1) {
+            label = neighborLabel;
+          } else if (neighborLabel != label) {
+            int32_t root1 = splitSplayPixelsFind(parents, label);
+            int32_t root2 = splitSplayPixelsFind(parents, neighborLabel);
             
-            bool leftAndRight = false;
-            bool upAndDown = false;
-            
-            if (neighborsArr[3] != 0 && neighborsArr[5] != 0) {
-              leftAndRight = true;
-            } else if (neighborsArr[1] != 0 && neighborsArr[7] != 0) {
-              upAndDown = true;
-            }
-            
-            if (leftAndRight || upAndDown) {
-              pair<int32_t, int32_t> coord(rX, rY);
-              likelyLineCoords.push_back(coord);
+            if (root1 < root2) {
+              parents[root2] = root1;
+            } else if (root2 < root1) {
+              parents[root1] = root2;
             }
           }
-          
         }
-      } // end rect iter loop
-      
-      if (debug) {
-        cout << "countNonZero " << countNonZero << endl;
       }
       
-      if (debug) {
-        cout << "done iter looking for likely line coords" << endl;
-        cout << "found " << likelyLineCoords.size() << endl;
+      if (label == -1) {
+        label = (int32_t) parents.size();
+        parents.push_back(label);
+        labelTags.push_back(tag);
       }
       
-      // Long straight lines typically that SEEDS is running along a simple gradient.
-      // Detect only the case of vertical or horizontal long connected lines and then
-      // modify the original tags data to add a new tag to replace each pixel that is
-      // currently in the straight line.
-      
-      // The coords were scanned by row and then col so the first one will be the
-      // closest to the top left.
-      
-      seen[centerTag] = true;
+      labelsRowPtr[x] = label;
+    }
+  }
+  
+  // A root is always the smallest label in its set, so the roots are visited in
+  // the order the pieces are first found. The first piece of a tag keeps the tag.
+  
+  const int32_t numLabels = (int32_t) parents.size();
+  
+  vector<uint32_t> finalTags(numLabels);
+  unordered_map<uint32_t, bool> seen;
+  
+  uint32_t nextTag = maxTag + 1;
+  int numSplit = 0;
+  
+  for ( int32_t label = 0; label < numLabels; label++ ) {
+    int32_t root = splitSplayPixelsFind(parents, label);
+    
+    if (root != label) {
+      finalTags[label] = finalTags[root];
+      continue;
+    }
+    
+    uint32_t tag = labelTags[label];
+    
+    if (seen.insert(make_pair(tag, true)).second) {
+      finalTags[label] = tag;
+    } else {
+      finalTags[label] = nextTag++;
+      numSplit += 1;
     }
   }
   
+  if (debug) {
+    cout << "split " << numSplit << " splay pieces from " << seen.size() << " tags" << endl;
+  }
+  
+  if (numSplit == 0) {
+    return;
+  }
+  
+  // The value for all white is not a valid tag, see SuperpixelImage::parse()
+  
+  if ((nextTag - 1) >= 0x00FFFFFF) {
+    cerr << "error : splitting " << numSplit << " splay pieces does not fit into a 24 bit tag" << endl;
+    return;
+  }
+  
+  for ( int y = 0; y < height; y++ ) {
+    Vec3b *tagsRowPtr = inOutTagImg.ptr<Vec3b>(y);
+    const int32_t *labelsRowPtr = labels.data() + (y * width);
+    
+    for ( int x = 0; x < width; x++ ) {
+      uint32_t finalTag = finalTags[labelsRowPtr[x]];
+      
+      if (finalTag != labelTags[labelsRowPtr[x]]) {
+        tagsRowPtr[x] = PixelToVec3b(finalTag);
+      }
+    }
+  }
   
   return;
 }
@@ -737,15 +872,14 @@ bool Superpixel::shouldMergeEdge(float edgeWeight)
     return true;
   }
   
-  float mergedMean, mergedMeanStddev;
-  
-  sample_mean(mergedEdgeWeights, &mergedMean);
-  sample_mean_delta_squared_div(mergedEdgeWeights, mergedMean, &mergedMeanStddev);
+  // The running stats make this check constant time no matter how many
+  // weights have been seen
   
-  float unMergedMean, unMergedMeanStddev;
+  float mergedMean = mergedEdgeWeights.mean();
+  float mergedMeanStddev = mergedEdgeWeights.stddev();
   
-  sample_mean(unmergedEdgeWeights, &unMergedMean);
-  sample_mean_delta_squared_div(unmergedEdgeWeights, unMergedMean, &unMergedMeanStddev);
+  float unMergedMean = unmergedEdgeWeights.mean();
+  float unMergedMeanStddev = unmergedEdgeWeights.stddev();
   
   if (debug) {
     char buffer[1024];
@@ -19,6 +19,404 @@ using namespace cv;
 
 #define ENABLE_SUPERPIXEL_ASSOC_DATA
 
+// The coords of a superpixel are a chain of segments so that merging the coords
+// of one superpixel into another splices the segments in O(1) instead of copying.
+// The chain is flattened into one vector the first time the coords are accessed
+// as a contiguous vector, so code that reads coords in between merges pays the
+// same copy that an immediate append would have. The size is always known without
+// flattening. This class can be used just like the vector<Coord> it replaces.
+// The segments are only allocated once a merge splices coords into a non-empty
+// list, so an unmerged superpixel only pays for the head vector and one pointer.
+//
+// The coords can optionally be stored as runs of consecutive X values on one row,
+// see encodeRuns(). This is a lot smaller for large smooth regions, forEachRun()
+// and forEachCoord() read the coords in either form without expanding the runs.
+// Accessing the coords as a vector expands the runs and leaves run mode.
+
+typedef struct {
+  Coord::value_type x;
+  Coord::value_type y;
+  uint16_t length;
+} CoordRun;
+
+class SuperpixelCoords {
+  public:
+
+  SuperpixelCoords()
+  : segmentsPtr(NULL)
+  {
+  }
+
+  SuperpixelCoords(const SuperpixelCoords &other)
+  : head(other.head), segmentsPtr(NULL)
+  {
+    if (other.segmentsPtr != NULL) {
+      segmentsPtr = new Segments(*other.segmentsPtr);
+    }
+  }
+
+  SuperpixelCoords & operator=(const SuperpixelCoords &other) {
+    if (this != &other) {
+      SuperpixelCoords copy(other);
+      head.swap(copy.head);
+      std::swap(segmentsPtr, copy.segmentsPtr);
+    }
+    return *this;
+  }
+
+  ~SuperpixelCoords() {
+    delete segmentsPtr;
+  }
+
+  // The size of the head vector is not cached since a caller can modify it
+  // through the vector reference.
+
+  size_t size() const {
+    return head.size() + ((segmentsPtr == NULL) ? 0 : segmentsPtr->numCoords);
+  }
+
+  bool empty() const {
+    return (size() == 0);
+  }
+
+  // Move all of the coords from src to the end of this list, src is empty after this call
+
+  void splice(SuperpixelCoords &src) {
+    if (src.empty()) {
+      return;
+    }
+    if (empty()) {
+      head.swap(src.head);
+      std::swap(segmentsPtr, src.segmentsPtr);
+    } else {
+      if (segmentsPtr == NULL) {
+        segmentsPtr = new Segments();
+      }
+      segmentsPtr->numCoords += src.size();
+      if (isRunLength()) {
+        // Append the runs of src, coords in src are encoded first
+        src.encodeRuns();
+        vector<CoordRun> &runs = segmentsPtr->runs;
+        runs.insert(runs.end(), src.segmentsPtr->runs.begin(), src.segmentsPtr->runs.end());
+      } else {
+        if (src.isRunLength()) {
+          src.flatten();
+        }
+        vector<vector<Coord> > &segments = segmentsPtr->segments;
+        segments.push_back(vector<Coord>());
+        segments.back().swap(src.head);
+        if (src.segmentsPtr != NULL) {
+          for ( auto &segment : src.segmentsPtr->segments ) {
+            segments.push_back(vector<Coord>());
+            segments.back().swap(segment);
+          }
+        }
+      }
+    }
+    src.clear();
+  }
+  
+  // True when the coords are stored as runs
+  
+  bool isRunLength() const {
+    return (segmentsPtr != NULL && !segmentsPtr->runs.empty());
+  }
+  
+  // Store the coords as runs of consecutive X values on the same row. The
+  // order of the coords is not changed, so expanding the runs gives back
+  // exactly the same coords.
+  
+  void encodeRuns() {
+    if (isRunLength() || empty()) {
+      return;
+    }
+    if (segmentsPtr == NULL) {
+      segmentsPtr = new Segments();
+    }
+    vector<CoordRun> &runs = segmentsPtr->runs;
+    forEachRun([&runs](const CoordRun &run) {
+      runs.push_back(run);
+    });
+    runs.shrink_to_fit();
+    segmentsPtr->numCoords = head.size() + segmentsPtr->numCoords;
+    vector<Coord>().swap(head);
+    vector<vector<Coord> >().swap(segmentsPtr->segments);
+  }
+  
+  // Number of runs, this scans the coords unless they are stored as runs
+  
+  size_t numRuns() {
+    if (isRunLength()) {
+      return segmentsPtr->runs.size();
+    }
+    size_t count = 0;
+    forEachRun([&count](const CoordRun &) {
+      count++;
+    });
+    return count;
+  }
+  
+  // Invoke f(const CoordRun &run) for each run of coords in order. When the
+  // coords are not stored as runs then each run is found while scanning.
+  // F = std::function<void(const CoordRun &run)>
+  
+  template <typename F>
+  void forEachRun(F f) const {
+    if (isRunLength()) {
+      for ( const CoordRun &run : segmentsPtr->runs ) {
+        f(run);
+      }
+      return;
+    }
+    
+    CoordRun run;
+    run.length = 0;
+    
+    auto scan = [&run, &f](const vector<Coord> &vec) {
+      for ( const Coord &coord : vec ) {
+        if (run.length > 0 && coord.y == run.y && coord.x == (run.x + run.length) && run.length < 0xFFFF) {
+          run.length++;
+        } else {
+          if (run.length > 0) {
+            f(run);
+          }
+          run.x = coord.x;
+          run.y = coord.y;
+          run.length = 1;
+        }
+      }
+    };
+    
+    scan(head);
+    if (segmentsPtr != NULL) {
+      for ( const vector<Coord> &segment : segmentsPtr->segments ) {
+        scan(segment);
+      }
+    }
+    if (run.length > 0) {
+      f(run);
+    }
+  }
+  
+  // Invoke f(Coord coord) for each coord in order without flattening the
+  // segments or expanding runs.
+  // F = std::function<void(Coord coord)>
+  
+  template <typename F>
+  void forEachCoord(F f) const {
+    if (isRunLength()) {
+      for ( const CoordRun &run : segmentsPtr->runs ) {
+        Coord coord(run.x, run.y);
+        for ( int i = 0; i < run.length; i++, coord.x++ ) {
+          f(coord);
+        }
+      }
+      return;
+    }
+    
+    for ( Coord coord : head ) {
+      f(coord);
+    }
+    if (segmentsPtr != NULL) {
+      for ( const vector<Coord> &segment : segmentsPtr->segments ) {
+        for ( Coord coord : segment ) {
+          f(coord);
+        }
+      }
+    }
+  }
+
+  // Access as one contiguous vector, this flattens any spliced segments
+
+  vector<Coord> & getVector() {
+    if (segmentsPtr != NULL) {
+      flatten();
+    }
+    return head;
+  }
+
+  operator vector<Coord> & () {
+    return getVector();
+  }
+
+  void push_back(const Coord &coord) {
+    getVector().push_back(coord);
+  }
+
+  void reserve(size_t n) {
+    getVector().reserve(n);
+  }
+
+  void resize(size_t n) {
+    getVector().resize(n);
+  }
+
+  void clear() {
+    vector<Coord>().swap(head);
+    delete segmentsPtr;
+    segmentsPtr = NULL;
+  }
+
+  // Remove all coords but keep the capacity of the head vector, so that coords
+  // added to a recycled superpixel do not allocate again.
+
+  void clearKeepCapacity() {
+    head.clear();
+    delete segmentsPtr;
+    segmentsPtr = NULL;
+  }
+
+  vector<Coord>::iterator begin() {
+    return getVector().begin();
+  }
+
+  vector<Coord>::iterator end() {
+    return getVector().end();
+  }
+
+  Coord & operator[](size_t i) {
+    return getVector()[i];
+  }
+
+  Coord & front() {
+    return getVector().front();
+  }
+
+  Coord & back() {
+    return getVector().back();
+  }
+
+  Coord * data() {
+    return getVector().data();
+  }
+
+  private:
+
+  // The runs are only non-empty in run mode, the head and segments are
+  // empty in that case and numCoords is the number of coords in the runs.
+
+  typedef struct {
+    vector<vector<Coord> > segments;
+    vector<CoordRun> runs;
+    size_t numCoords;
+  } Segments;
+
+  void flatten() {
+    head.reserve(head.size() + segmentsPtr->numCoords);
+    if (isRunLength()) {
+      for ( const CoordRun &run : segmentsPtr->runs ) {
+        for ( int i = 0; i < run.length; i++ ) {
+          head.push_back(Coord((int) (run.x + i), (int) run.y));
+        }
+      }
+    }
+    for ( auto &segment : segmentsPtr->segments ) {
+      head.insert(head.end(), segment.begin(), segment.end());
+    }
+    delete segmentsPtr;
+    segmentsPtr = NULL;
+  }
+
+  vector<Coord> head;
+  Segments *segmentsPtr;
+};
+
+// Running count, mean and sum of squared deltas (M2) of the edge weights seen by
+// a superpixel. Only the mean and stddev of the weights are ever read, so the
+// weights themselves are not kept. Adding a weight and appending the weights of
+// a merged superpixel are both constant time. This class can be used like the
+// vector<float> it replaces for push_back(), size() and empty().
+
+class SuperpixelWeights {
+  public:
+
+  SuperpixelWeights()
+  : count(0), meanValue(0.0f), m2(0.0f)
+  {
+  }
+
+  SuperpixelWeights(uint32_t count, float mean, float m2)
+  : count(count), meanValue(mean), m2(m2)
+  {
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  bool empty() const {
+    return (count == 0);
+  }
+
+  // Welford update for one weight
+
+  void push_back(float weight) {
+    count += 1;
+    float delta = weight - meanValue;
+    meanValue += delta / count;
+    m2 += delta * (weight - meanValue);
+  }
+
+  // Combine the weights of src with this list, src is empty after this call
+
+  void append(SuperpixelWeights &src) {
+    if (src.empty()) {
+      return;
+    }
+    if (empty()) {
+      *this = src;
+    } else {
+      uint32_t total = count + src.count;
+      float delta = src.meanValue - meanValue;
+      meanValue += delta * ((float) src.count / total);
+      m2 += src.m2 + delta * delta * ((float) count * src.count / total);
+      count = total;
+    }
+    src.clear();
+  }
+
+  void clear() {
+    count = 0;
+    meanValue = 0.0f;
+    m2 = 0.0f;
+  }
+
+  // Same results as sample_mean() and sample_mean_delta_squared_div()
+
+  float mean() const {
+    return meanValue;
+  }
+
+  float stddev() const {
+    if (count < 2 || m2 <= 0.0f) {
+      return 0.0f;
+    }
+    return sqrt(m2 / (count - 1));
+  }
+
+  // Sum of squared deltas from the mean, along with size() and mean() this
+  // is all the state needed to save and restore the weights.
+
+  float sumSquaredDeltas() const {
+    return m2;
+  }
+
+  private:
+
+  uint32_t count;
+  float meanValue;
+  float m2;
+};
+
+// Sums of the B, G, R channel values and squared values of the pixels in a
+// superpixel. The sums of two superpixels are added when they are merged so
+// that the mean and variance are known without reading the pixels again.
+
+typedef struct {
+  uint64_t sum[3];
+  uint64_t sumSq[3];
+} SuperpixelColorStats;
+
 typedef enum {
   SuperpixelFlagsNotAllSame = (1 << 0),
   SuperpixelFlagsAllSame = (1 << 1),
@@ -34,19 +432,36 @@ class Superpixel {
 
   int32_t tag;
   
-  vector<Coord> coords;
+  // Flags that apply to all pixels in the superpixel grouping, 0 when no flags set.
+  uint32_t flags;
+  
+  SuperpixelCoords coords;
 
-  // This vector stores superpixel edges that have been successfully merged.
+  // This list stores superpixel edges that have been successfully merged.
   
-  vector<float> mergedEdgeWeights;
+  SuperpixelWeights mergedEdgeWeights;
   
-  // This vector stores superpixel edges that were not merged and are seen
+  // This list stores superpixel edges that were not merged and are seen
   // as hard edges. These values could chang
   
-  vector<float> unmergedEdgeWeights;
+  SuperpixelWeights unmergedEdgeWeights;
   
-  // Flags that apply to all pixels in the superpixel grouping, 0 when no flags set.
-  uint32_t flags;
+  // Bounding box of the coords, only valid when bboxNumCoords is the number
+  // of coords. This is cached by bbox() and kept up to date by a merge.
+  
+  cv::Rect cachedBbox;
+  uint32_t bboxNumCoords;
+  
+  // Color stats for the image passed to setColorStats(), NULL when not known
+  
+  SuperpixelColorStats *colorStatsPtr;
+  
+  // Convex hull of the coords, only valid when hullNumCoords is the number
+  // of coords. This is cached by convexHull() and a merge of two superpixels
+  // that both have a hull merges the hulls instead of scanning the coords.
+  
+  vector<Point2i> *hullPtr;
+  uint32_t hullNumCoords;
   
   void setAllSame() {
     this->flags = SuperpixelFlagsAllSame;
@@ -82,6 +497,10 @@ class Superpixel {
   
 #endif // ENABLE_SUPERPIXEL_ASSOC_DATA
   
+  // Reset to the state of a new Superpixel(tag), the coords capacity is kept.
+  
+  void recycle(int32_t tag);
+  
   void appendCoord(int x, int y);
   
   // Read RGB values from larger input image and create a matrix that is the width
@@ -116,13 +535,35 @@ class Superpixel {
                         Superpixel *superpixe2Ptr,
                         vector<Coord> &edgeCoords2);
   
-  // Get bounding box of superpixel.
+  // Get bounding box of superpixel, the coords are only scanned the first time.
   
   void bbox(int32_t &originX, int32_t &originY, int32_t &width, int32_t &height);
   
+  // Read the pixels at each coord to set the color stats
+  
+  void setColorStats(const Mat &input);
+  
+  // Mean and variance of each channel, returns false when the color stats are not known
+  
+  bool colorMeanAndVariance(Vec3f &mean, Vec3f &variance);
+  
+  // Convex hull of the coords, clockwise and starting with the first vertex in
+  // raster order. The coords are only scanned the first time.
+  
+  const vector<Point2i> & convexHull();
+  
+  // Merge the cached bbox, hull and color stats of src into this superpixel, this must be
+  // invoked before the coords are merged.
+  
+  void mergeStats(Superpixel *srcPtr);
+  
   static void splitSplayPixels(Mat &inOutTagImg);
   
   bool shouldMergeEdge(float edgeWeight);
+  
+  private:
+  
+  void releaseAssocData();
 };
 
 // Find bounding box of a superpixel. This is the (X,Y) of the upper right corner and the width and height.
@@ -0,0 +1,57 @@
+// Block allocated Superpixel objects, see SuperpixelArena.h
+
+#include "SuperpixelArena.h"
+
+#include "Superpixel.h"
+
+using namespace std;
+
+SuperpixelArena::SuperpixelArena()
+: numUsed(0)
+{
+}
+
+SuperpixelArena::SuperpixelArena(SuperpixelArena &&other)
+: blocks(std::move(other.blocks)), numUsed(other.numUsed)
+{
+  other.blocks.clear();
+  other.numUsed = 0;
+}
+
+SuperpixelArena& SuperpixelArena::operator=(SuperpixelArena &&other)
+{
+  if (this != &other) {
+    blocks = std::move(other.blocks);
+    numUsed = other.numUsed;
+    other.blocks.clear();
+    other.numUsed = 0;
+  }
+  return *this;
+}
+
+SuperpixelArena::~SuperpixelArena()
+{
+}
+
+Superpixel* SuperpixelArena::create(int32_t tag)
+{
+  const size_t blocki = numUsed / SUPERPIXEL_ARENA_BLOCK_SIZE;
+
+  if (blocki == blocks.size()) {
+    blocks.push_back(unique_ptr<Superpixel[]>(new Superpixel[SUPERPIXEL_ARENA_BLOCK_SIZE]));
+  }
+
+  // An object that was handed out before the last reset() still holds the
+  // state of the previous superpixel.
+
+  Superpixel *spPtr = &blocks[blocki][numUsed % SUPERPIXEL_ARENA_BLOCK_SIZE];
+  spPtr->recycle(tag);
+  numUsed += 1;
+  return spPtr;
+}
+
+void SuperpixelArena::release()
+{
+  vector<unique_ptr<Superpixel[]> >().swap(blocks);
+  numUsed = 0;
+}
@@ -0,0 +1,66 @@
+// A SuperpixelArena owns the Superpixel objects of a SuperpixelImage. The
+// objects are allocated in blocks of SUPERPIXEL_ARENA_BLOCK_SIZE, so parsing an
+// image does one allocation per block instead of one per superpixel, and all the
+// objects are freed together when the arena is destroyed. reset() makes every
+// object available again in O(1) without freeing anything. An object is
+// recycled when create() hands it out again, so the coords vector of a recycled
+// superpixel keeps the capacity it had in the previous parse. A merged
+// superpixel is not given back to the arena, it stays allocated until reset().
+
+#ifndef SUPERPIXEL_ARENA_H
+#define	SUPERPIXEL_ARENA_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+class Superpixel;
+
+#define SUPERPIXEL_ARENA_BLOCK_SIZE 1024
+
+class SuperpixelArena {
+public:
+  SuperpixelArena();
+
+  SuperpixelArena(SuperpixelArena &&other);
+
+  SuperpixelArena& operator=(SuperpixelArena &&other);
+
+  ~SuperpixelArena();
+
+  // Superpixel in the state of a new Superpixel(tag), the pointer is valid
+  // until reset() or until the arena is destroyed.
+
+  Superpixel* create(int32_t tag);
+
+  // All the objects are available to create() again, nothing is freed
+
+  void reset() {
+    numUsed = 0;
+  }
+
+  // Free all the blocks
+
+  void release();
+
+  // Number of objects handed out by create() since the last reset()
+
+  size_t size() const {
+    return numUsed;
+  }
+
+  size_t capacity() const {
+    return blocks.size() * SUPERPIXEL_ARENA_BLOCK_SIZE;
+  }
+
+private:
+  std::vector<std::unique_ptr<Superpixel[]> > blocks;
+
+  size_t numUsed;
+
+  SuperpixelArena(const SuperpixelArena &);
+  SuperpixelArena& operator=(const SuperpixelArena &);
+};
+
+#endif // SUPERPIXEL_ARENA_H
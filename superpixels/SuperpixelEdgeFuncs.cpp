@@ -8,6 +8,46 @@
 
 #include "SuperpixelEdgeFuncs.h"
 
+#include <atomic>
+
+static std::atomic<int> maxEdgeCompareCoords(2048);
+
+void
+SuperpixelEdgeFuncs::setMaxEdgeCompareCoords(int maxCoords)
+{
+  maxEdgeCompareCoords = (maxCoords > 0) ? maxCoords : 0;
+}
+
+int
+SuperpixelEdgeFuncs::getMaxEdgeCompareCoords()
+{
+  return maxEdgeCompareCoords;
+}
+
+void
+SuperpixelEdgeFuncs::sampleEdgeCompareOffsets(int numCoords, int maxCoords, vector<int> &offsets)
+{
+  offsets.clear();
+  
+  if (maxCoords <= 0 || numCoords <= maxCoords) {
+    offsets.reserve(numCoords);
+    for (int i = 0; i < numCoords; i++) {
+      offsets.push_back(i);
+    }
+    return;
+  }
+  
+  // Stratum k covers [k*N/M, (k+1)*N/M), each stratum holds at least one offset
+  
+  offsets.reserve(maxCoords);
+  
+  for (int k = 0; k < maxCoords; k++) {
+    int64_t start = ((int64_t) k * numCoords) / maxCoords;
+    int64_t end = ((int64_t) (k + 1) * numCoords) / maxCoords;
+    offsets.push_back((int) ((start + end - 1) / 2));
+  }
+}
+
 // Compare method for CompareNeighborTuple type, in the case of a tie the second column
 // is sorted in terms of decreasing int values.
 
@@ -28,7 +68,7 @@ SuperpixelEdgeFuncs::checkNeighborEdgeWeights(SuperpixelImage &spImage,
                                               Mat &inputImg,
                                               int32_t tag,
                                               vector<int32_t> *neighborsPtr,
-                                              unordered_map<SuperpixelEdge, float> &edgeStrengthMap,
+                                              SuperpixelEdgeWeights &edgeStrengthMap,
                                               int step)
 {
   const bool debug = false;
@@ -147,6 +187,21 @@ SuperpixelEdgeFuncs::compareNeighborEdges(SuperpixelImage &spImage,
   Superpixel *srcSpPtr = spImage.getSuperpixelPtr(tag);
   assert(srcSpPtr);
   
+  // Note that inputImg is assumed to be in BGR colorspace here, the Lab image is
+  // converted once and then cached by spImage.
+  
+  Mat &labImg = spImage.getConvertedImage(inputImg, CV_BGR2Lab);
+  
+  // When the gradient sums were computed for this image the mean gradient over
+  // the boundary pixels is the edge weight, an edge without a sum falls back to
+  // comparing the pixels on each side.
+  
+  unordered_map<SuperpixelEdge, SuperpixelEdgeGradient> *gradientMapPtr = NULL;
+  
+  if (spImage.hasEdgeGradients(inputImg) && !spImage.edgeTable.edgeGradientMap.empty()) {
+    gradientMapPtr = &spImage.edgeTable.edgeGradientMap;
+  }
+  
   for ( int32_t neighborTag : spImage.edgeTable.getNeighborsSet(tag) ) {
     if (lockedTablePtr && (lockedTablePtr->count(neighborTag) != 0)) {
       // If a locked down table is provided then do not consider a neighbor that appears
@@ -166,30 +221,55 @@ SuperpixelEdgeFuncs::compareNeighborEdges(SuperpixelImage &spImage,
       cout << "compare edge between " << tag << " and " << neighborTag << endl;
     }
     
+    if (gradientMapPtr != NULL) {
+      auto gradientIt = gradientMapPtr->find(SuperpixelEdge(tag, neighborTag));
+      
+      if (gradientIt != gradientMapPtr->end() && gradientIt->second.numPixels > 0) {
+        double distAve = gradientIt->second.sum / gradientIt->second.numPixels;
+        
+        if (debug) {
+          cout << "mean edge gradient " << distAve << " from " << gradientIt->second.numPixels << " boundary pixels" << endl;
+        }
+        
+        results.push_back(make_tuple(distAve, neighborSpPtr->coords.size(), neighborTag));
+        continue;
+      }
+    }
+    
     // Get edge coordinates that are shared between src and neighbor
     
     vector<Coord> edgeCoords1;
     vector<Coord> edgeCoords2;
     
-    Superpixel::filterEdgeCoords(srcSpPtr, edgeCoords1, neighborSpPtr, edgeCoords2);
+    spImage.filterEdgeCoords(tag, edgeCoords1, neighborTag, edgeCoords2);
     
-    // Gather pixels based on the edge coords only
+    // Determine smaller num coords of the two and use that as the N
     
-    Mat srcEdgeMat;
+    int numCoordsToCompare = mini((int) edgeCoords1.size(), (int) edgeCoords2.size());
     
-    Superpixel::fillMatrixFromCoords(inputImg, edgeCoords1, srcEdgeMat);
+    if (debug) {
+      cout << "will compare " << numCoordsToCompare << " coords on edge" << endl;
+    }
     
-    // Note that inputImg is assumed to be in BGR colorspace here
+    assert(numCoordsToCompare >= 1);
     
-    cvtColor(srcEdgeMat, srcEdgeMat, CV_BGR2Lab);
+    // A long edge is compared at evenly spaced src coords, see setMaxEdgeCompareCoords()
     
-    Mat neighborEdgeMat;
+    vector<int> srcOffsets;
     
-    Superpixel::fillMatrixFromCoords(inputImg, edgeCoords2, neighborEdgeMat);
+    sampleEdgeCompareOffsets(numCoordsToCompare, getMaxEdgeCompareCoords(), srcOffsets);
     
-    cvtColor(neighborEdgeMat, neighborEdgeMat, CV_BGR2Lab);
+    if (debug && (int) srcOffsets.size() < numCoordsToCompare) {
+      cout << "sampled " << srcOffsets.size() << " of " << numCoordsToCompare << " src coords on edge" << endl;
+    }
     
     if (debugDumpSuperpixelEdges) {
+      Mat srcEdgeMat;
+      Mat neighborEdgeMat;
+      
+      Superpixel::fillMatrixFromCoords(labImg, edgeCoords1, srcEdgeMat);
+      Superpixel::fillMatrixFromCoords(labImg, edgeCoords2, neighborEdgeMat);
+      
       std::ostringstream stringStream;
       stringStream << "edge_between_" << tag << "_" << neighborTag << ".png";
       std::string str = stringStream.str();
@@ -209,78 +289,86 @@ SuperpixelEdgeFuncs::compareNeighborEdges(SuperpixelImage &spImage,
       Superpixel::reverseFillMatrixFromCoords(neighborEdgeGreen, false, edgeCoords2, outputMat);
       
       cout << "write " << filename << " ( " << outputMat.cols << " x " << outputMat.rows << " )" << endl;
-      imwrite(filename, outputMat);
-    }
-    
-    // Determine smaller num coords of the two and use that as the N
-    
-    int numCoordsToCompare = mini((int) edgeCoords1.size(), (int) edgeCoords2.size());
-    
-    if (debug) {
-      cout << "will compare " << numCoordsToCompare << " coords on edge" << endl;
+      debugImwrite(filename, outputMat);
     }
     
-    assert(numCoordsToCompare >= 1);
+    // Only a dst coord within 1.5 of the src coord is compared, so the closest
+    // dst coord is found in the 3x3 neighborhood of the src coord. The table
+    // maps each dst coord to its offset, -1 once that coord has been used.
     
-    // One each iteration, select the closest coord and mark that slot as used.
-    
-    uint8_t neighborEdgeMatUsed[numCoordsToCompare];
+    unordered_map<Coord, int> neighborOffsetTable;
+    neighborOffsetTable.reserve(numCoordsToCompare);
     
     for (int j = 0; j < numCoordsToCompare; j++) {
-      neighborEdgeMatUsed[j] = false;
+      const Coord &neighborCoord = edgeCoords2[j];
+      neighborOffsetTable[neighborCoord] = j;
     }
     
-    // FIXME: use float instead of double here. The hypot(float, float) func should
-    // be faster since the arith has limited range. Also possible to use an optimized
-    // impl
-    // https://en.wikipedia.org/wiki/Alpha_max_plus_beta_min_algorithm
-    // http://www.dspguru.com/dsp/tricks/magnitude-estimator
+    // Matched pairs of Lab pixels, the distances are calculated in one batch
     
-    double distSum = 0.0;
-    int numSum = 0;
+    vector<Vec3b> srcPairVecs;
+    vector<Vec3b> dstPairVecs;
+    srcPairVecs.reserve(srcOffsets.size());
+    dstPairVecs.reserve(srcOffsets.size());
     
-    for (int i = 0; i < numCoordsToCompare; i++) {
-      // FIXME: this is doing a costly pair copy, use iterator instead, same as below.
-      Coord srcCoord = edgeCoords1[i];
-      Vec3b srcVec = srcEdgeMat.at<Vec3b>(0, i);
+    for ( int i : srcOffsets ) {
+      const Coord &srcCoord = edgeCoords1[i];
       
-      // Determine which is the dst coordinates is the closest to this src coord via a distance measure.
-      // This should give slightly better results.
+      // Determine which of the dst coordinates is the closest to this src coord via a distance measure,
+      // a tie goes to the dst coord that appears first.
       
-      double minCoordDist = (double) 0xFFFFFFFF;
+      int minCoordDist = 3;
       int minCoordOffset = -1;
-      
-      for (int j = 0; j < numCoordsToCompare; j++) {
-        if (neighborEdgeMatUsed[j]) {
-          // Already compared to this coord
-          continue;
+      int *minOffsetPtr = NULL;
+      
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          int64_t y = (int64_t) srcCoord.y + dy;
+          int64_t x = (int64_t) srcCoord.x + dx;
+          
+          if (x < 0 || y < 0 || x > Coord::maxValue || y > Coord::maxValue) {
+            continue;
+          }
+          
+          auto it = neighborOffsetTable.find(Coord((uint32_t) x, (uint32_t) y));
+          
+          if (it == neighborOffsetTable.end() || it->second == -1) {
+            // Not a dst coord or already compared to this coord
+            continue;
+          }
+          
+          // Squared distance is 0, 1 or 2
+          
+          int coordDist = (dx * dx) + (dy * dy);
+          
+          if (coordDist < minCoordDist || (coordDist == minCoordDist && it->second < minCoordOffset)) {
+            minCoordDist = coordDist;
+            minCoordOffset = it->second;
+            minOffsetPtr = &it->second;
+          }
         }
-        
-        Coord neighborCoord = edgeCoords2[j];
-        
-        double coordDist = hypot( neighborCoord.x - srcCoord.x, neighborCoord.y - srcCoord.y );
+      }
+      
+      if (minCoordOffset == -1) {
+        // Not close enough to an available pixel to compare, just skip this src pixel
+        // and use the next one without adding to the sum.
         
         if (debug) {
           char buffer[1024];
-          snprintf(buffer, sizeof(buffer), "coord dist from (%5d, %5d) to (%5d, %5d) is %12.4f",
-                   srcCoord.x, srcCoord.y,
-                   neighborCoord.x, neighborCoord.y,
-                   coordDist);
+          snprintf(buffer, sizeof(buffer), "no available coord near (%5d, %5d)", srcCoord.x, srcCoord.y);
           cout << (char*)buffer << endl;
         }
         
-        if (coordDist < minCoordDist) {
-          minCoordDist = coordDist;
-          minCoordOffset = j;
-        }
+        continue;
       }
-      assert(minCoordOffset != -1);
+      
+      const Coord &neighborCoord = edgeCoords2[minCoordOffset];
       
       if (debug) {
         char buffer[1024];
         snprintf(buffer, sizeof(buffer), "closest to (%5d, %5d) found as (%5d, %5d) dist is %0.4f",
                  srcCoord.x, srcCoord.y,
-                 edgeCoords2[minCoordOffset].x, edgeCoords2[minCoordOffset].y, minCoordDist);
+                 neighborCoord.x, neighborCoord.y, sqrt((double) minCoordDist));
         cout << (char*)buffer << endl;
       }
       
@@ -294,11 +382,8 @@ SuperpixelEdgeFuncs::compareNeighborEdges(SuperpixelImage &spImage,
         
         outputMat = Scalar(255, 0, 0);
         
-        Mat srcEdgeRed = srcEdgeMat.clone();
-        srcEdgeRed = Scalar(0, 0, 255);
-        
-        Mat neighborEdgeGreen = neighborEdgeMat.clone();
-        neighborEdgeGreen = Scalar(0, 255, 0);
+        Mat srcEdgeRed(1, (int) edgeCoords1.size(), CV_8UC3, Scalar(0, 0, 255));
+        Mat neighborEdgeGreen(1, (int) edgeCoords2.size(), CV_8UC3, Scalar(0, 255, 0));
         
         srcEdgeRed.at<Vec3b>(0, i) = Vec3b(255, 255, 255);
         neighborEdgeGreen.at<Vec3b>(0, minCoordOffset) = Vec3b(128, 128, 128);
@@ -307,26 +392,31 @@ SuperpixelEdgeFuncs::compareNeighborEdges(SuperpixelImage &spImage,
         Superpixel::reverseFillMatrixFromCoords(neighborEdgeGreen, false, edgeCoords2, outputMat);
         
         cout << "write " << filename << " ( " << outputMat.cols << " x " << outputMat.rows << " )" << endl;
-        imwrite(filename, outputMat);
-      }
-      
-      if (minCoordDist > 1.5) {
-        // Not close enough to an available pixel to compare, just skip this src pixel
-        // and use the next one without adding to the sum.
-        continue;
+        debugImwrite(filename, outputMat);
       }
       
-      Vec3b dstVec = neighborEdgeMat.at<Vec3b>(0, minCoordOffset);
-      neighborEdgeMatUsed[minCoordOffset] = true;
-      
-      // Calc color Delta-E distance in 3D vector space
+      *minOffsetPtr = -1;
       
-      double distance = delta_e_1976(srcVec[0], srcVec[1], srcVec[2],
-                                     dstVec[0], dstVec[1], dstVec[2]);
+      srcPairVecs.push_back(labImg.at<Vec3b>(srcCoord.y, srcCoord.x));
+      dstPairVecs.push_back(labImg.at<Vec3b>(neighborCoord.y, neighborCoord.x));
+    }
+    
+    // Calc color Delta-E distance in 3D vector space
+    
+    int numSum = (int) srcPairVecs.size();
+    
+    vector<float> distances(numSum);
+    
+    deltaE76(srcPairVecs.data(), dstPairVecs.data(), distances.data(), numSum);
+    
+    double distSum = 0.0;
+    
+    for (int i = 0; i < numSum; i++) {
+      double distance = distances[i];
       
       if (debug) {
-        int32_t srcPixel = Vec3BToUID(srcVec);
-        int32_t dstPixel = Vec3BToUID(dstVec);
+        int32_t srcPixel = Vec3BToUID(srcPairVecs[i]);
+        int32_t dstPixel = Vec3BToUID(dstPairVecs[i]);
         
         char buffer[1024];
         snprintf(buffer, sizeof(buffer), "LAB dist between pixels 0x%08X and 0x%08X = %0.12f", srcPixel, dstPixel, distance);
@@ -334,7 +424,6 @@ SuperpixelEdgeFuncs::compareNeighborEdges(SuperpixelImage &spImage,
       }
       
       distSum += distance;
-      numSum += 1;
     }
     
     assert(numSum > 0);
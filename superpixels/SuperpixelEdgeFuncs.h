@@ -27,7 +27,7 @@ public:
                                 Mat &inputImg,
                                 int32_t tag,
                                 vector<int32_t> *neighborsPtr,
-                                unordered_map<SuperpixelEdge, float> &edgeStrengthMap,
+                                SuperpixelEdgeWeights &edgeStrengthMap,
                                 int step);
 
   // Compare function that examines neighbor edges
@@ -41,6 +41,24 @@ public:
                             int32_t step,
                             bool normalize);
 
+  // A long edge is compared at no more than maxCoords src coords, 0 compares every
+  // coord. The coords are sampled one from the middle of each of maxCoords even
+  // strata along the edge, so the mean distance of the edge is stratified over the
+  // whole boundary and its error shrinks with 1/sqrt(maxCoords). Default is 2048.
+  
+  static
+  void setMaxEdgeCompareCoords(int maxCoords);
+  
+  static
+  int getMaxEdgeCompareCoords();
+  
+  // Fill offsets with the 0 to numCoords-1 offsets that are compared when at most
+  // maxCoords can be compared, all the offsets when maxCoords is 0 or numCoords
+  // is not larger.
+  
+  static
+  void sampleEdgeCompareOffsets(int numCoords, int maxCoords, vector<int> &offsets);
+  
   static
   void addUnmergedEdgeWeights(SuperpixelImage &spImage, int32_t tag, vector<float> &edgeWeights);
   
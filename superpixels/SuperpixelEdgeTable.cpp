@@ -6,6 +6,7 @@
 #include "SuperpixelEdgeTable.h"
 
 SuperpixelEdgeTable::SuperpixelEdgeTable()
+: lazyMerge(false), numLazyMerges(0)
 {
 }
 
@@ -60,7 +61,7 @@ vector<SuperpixelEdge> SuperpixelEdgeTable::getAllEdges()
 // in sorted order. The caller must take care to not hold an
 // iterator during a merge since that can change the neighbor list.
 
-set<int32_t>&
+SuperpixelNeighbors&
 SuperpixelEdgeTable::getNeighborsSet(int32_t tag)
 {
   auto iter = neighbors.find(tag);
@@ -72,6 +73,10 @@ SuperpixelEdgeTable::getNeighborsSet(int32_t tag)
     // Otherwise the key exists in the table, return ref to vector in table
     // with the assumption that the caller will not change it.
     
+    if (iter->second.resolvedMerges != numLazyMerges) {
+      resolveNeighbors(iter->second, tag);
+    }
+    
     return iter->second;
   }
 }
@@ -84,13 +89,25 @@ vector<int32_t> SuperpixelEdgeTable::getNeighbors(int32_t tag)
   if ( it == neighbors.end()) {
     return vector<int32_t>();
   }
-  auto &neighborsSet = it->second;
-  vector<int32_t> neighborVec;
-  neighborVec.reserve(neighborsSet.size());
-  for ( int32_t neighborTag : neighborsSet ) {
-    neighborVec.push_back(neighborTag);
+  if (it->second.resolvedMerges != numLazyMerges) {
+    resolveNeighbors(it->second, tag);
+  }
+  return it->second.getTags();
+}
+
+// This impl returns a range over the neighbors vector in the table
+
+SuperpixelTagRange SuperpixelEdgeTable::getNeighborsRange(int32_t tag)
+{
+  auto it = neighbors.find(tag);
+  if ( it == neighbors.end()) {
+    return SuperpixelTagRange();
+  }
+  if (it->second.resolvedMerges != numLazyMerges) {
+    resolveNeighbors(it->second, tag);
   }
-  return neighborVec;
+  const vector<int32_t> &tags = it->second.getTags();
+  return SuperpixelTagRange(tags.data(), tags.data() + tags.size());
 }
 
 // Set initial list of neighbors for a superpixel or rest the list after making
@@ -100,17 +117,10 @@ vector<int32_t> SuperpixelEdgeTable::getNeighbors(int32_t tag)
 
 void SuperpixelEdgeTable::setNeighbors(int32_t tag, vector<int32_t> neighborUIDsVec)
 {
-  set<int32_t> neighborsSet;
+  sort(neighborUIDsVec.begin(), neighborUIDsVec.end());
+  auto last = unique(neighborUIDsVec.begin(), neighborUIDsVec.end());
   
-  for ( int32_t tag : neighborUIDsVec ) {
-    neighborsSet.insert(tag);
-  }
-  // FIXME: use faster impl of insert
-  //neighborsSet.insert(neighbors.begin(), neighbors.end);
-  
-  //sort (neighborsUIDsVec.begin(), neighborsUIDsVec.end());
-  
-  neighbors[tag] = neighborsSet;
+  neighbors[tag].assignSorted(neighborUIDsVec.data(), last - neighborUIDsVec.begin());
 }
 
 // Set initial list of neighbors for a superpixel or rest the list after making
@@ -120,7 +130,9 @@ void SuperpixelEdgeTable::setNeighbors(int32_t tag, vector<int32_t> neighborUIDs
 
 void SuperpixelEdgeTable::setNeighbors(int32_t tag, set<int32_t> neighborsSet)
 {
-  neighbors[tag] = neighborsSet;
+  vector<int32_t> sortedTags(neighborsSet.begin(), neighborsSet.end());
+  
+  neighbors[tag].assignSorted(sortedTags.data(), sortedTags.size());
 }
 
 // When deleting a node, remove the neighbor entries
@@ -130,6 +142,86 @@ void SuperpixelEdgeTable::removeNeighbors(int32_t tag)
   neighbors.erase(tag);
 }
 
+// Find the root of a tag in the lazy merge union-find, each tag on the path
+// is pointed at its grandparent so that later finds are shorter.
+
+int32_t SuperpixelEdgeTable::findMergedTag(int32_t tag)
+{
+  const size_t numParents = mergedParent.size();
+  
+  while ((size_t) tag < numParents && mergedParent[tag] != 0) {
+    int32_t parentTag = mergedParent[tag];
+    
+    if ((size_t) parentTag < numParents && mergedParent[parentTag] != 0) {
+      mergedParent[tag] = mergedParent[parentTag];
+    }
+    
+    tag = mergedParent[tag];
+  }
+  
+  return tag;
+}
+
+// Rewrite neighbor tags that were lazy merged into another tag. A merged tag
+// can map to a tag that is already a neighbor or to this tag, so the result
+// is sorted and made unique again only when a tag changes.
+
+void SuperpixelEdgeTable::resolveNeighbors(SuperpixelNeighbors &neighborsOfTag, int32_t tag)
+{
+  vector<int32_t> &tags = neighborsOfTag.tags;
+  
+  bool changed = false;
+  
+  const size_t numParents = mergedParent.size();
+  
+  for ( int32_t &neighborTag : tags ) {
+    if ((size_t) neighborTag < numParents && mergedParent[neighborTag] != 0) {
+      neighborTag = findMergedTag(neighborTag);
+      changed = true;
+    }
+  }
+  
+  if (changed) {
+    sort(tags.begin(), tags.end());
+    tags.erase(unique(tags.begin(), tags.end()), tags.end());
+    auto it = lower_bound(tags.begin(), tags.end(), tag);
+    if (it != tags.end() && *it == tag) {
+      tags.erase(it);
+    }
+  }
+  
+  neighborsOfTag.resolvedMerges = numLazyMerges;
+}
+
+// Merge src into dst without touching the neighbors of src, each neighbor of
+// src is rewritten to refer to dst when it is next accessed.
+
+void SuperpixelEdgeTable::mergeNeighborsLazy(int32_t srcTag, int32_t dstTag)
+{
+  assert(srcTag != dstTag);
+  
+  SuperpixelNeighbors &neighborsOfDst = getNeighborsSet(dstTag);
+  SuperpixelNeighbors &neighborsOfSrc = getNeighborsSet(srcTag);
+  
+  neighborsOfDst.erase(srcTag);
+  
+  for ( int32_t neighborTag : neighborsOfSrc.tags ) {
+    if (neighborTag != dstTag) {
+      neighborsOfDst.insert(neighborTag);
+    }
+  }
+  
+  if ((size_t) srcTag >= mergedParent.size()) {
+    mergedParent.resize(max((size_t) srcTag + 1, mergedParent.size() * 2), 0);
+  }
+  mergedParent[srcTag] = dstTag;
+  numLazyMerges += 1;
+  
+  neighborsOfDst.resolvedMerges = numLazyMerges;
+  
+  removeNeighbors(srcTag);
+}
+
 // Return a vector of tags that have an entry in the neighbors table.
 // Even if the vector contains zero elements, this method is not fast.
 
@@ -143,3 +235,67 @@ vector<int32_t> SuperpixelEdgeTable::getAllTagsInNeighborsTable()
   sort (vec.begin(), vec.end());
   return vec;
 }
+
+static
+bool CompareCoordRasterOrderFunc (const Coord &c1, const Coord &c2) {
+  return (c1.y < c2.y) || (c1.y == c2.y && c1.x < c2.x);
+}
+
+// Boundary pixels of src stay boundary pixels once src is part of dst, so the
+// lists are merged in raster order. A pixel of a neighbor can touch both src
+// and dst, so the neighbor side is a union of the two lists.
+
+void SuperpixelEdgeTable::mergeEdgeBoundaries(int32_t srcTag, int32_t dstTag)
+{
+  if (edgeBoundaryMap.empty()) {
+    return;
+  }
+  
+  edgeBoundaryMap.erase(SuperpixelEdge(srcTag, dstTag));
+  edgeGradientMap.erase(SuperpixelEdge(srcTag, dstTag));
+  
+  for ( int32_t neighborTag : getNeighborsSet(srcTag) ) {
+    if (neighborTag == dstTag) {
+      continue;
+    }
+    
+    auto srcIt = edgeBoundaryMap.find(SuperpixelEdge(srcTag, neighborTag));
+    
+    if (srcIt == edgeBoundaryMap.end()) {
+      continue;
+    }
+    
+    SuperpixelEdgeBoundary &srcBoundary = srcIt->second;
+    
+    vector<Coord> &srcSideCoords = (srcTag < neighborTag) ? srcBoundary.coordsA : srcBoundary.coordsB;
+    vector<Coord> &srcNeighborCoords = (srcTag < neighborTag) ? srcBoundary.coordsB : srcBoundary.coordsA;
+    
+    SuperpixelEdgeBoundary &dstBoundary = edgeBoundaryMap[SuperpixelEdge(dstTag, neighborTag)];
+    
+    vector<Coord> &dstSideCoords = (dstTag < neighborTag) ? dstBoundary.coordsA : dstBoundary.coordsB;
+    vector<Coord> &dstNeighborCoords = (dstTag < neighborTag) ? dstBoundary.coordsB : dstBoundary.coordsA;
+    
+    vector<Coord> merged;
+    merged.reserve(dstSideCoords.size() + srcSideCoords.size());
+    std::merge(dstSideCoords.begin(), dstSideCoords.end(), srcSideCoords.begin(), srcSideCoords.end(), back_inserter(merged), CompareCoordRasterOrderFunc);
+    dstSideCoords.swap(merged);
+    
+    merged.clear();
+    merged.reserve(dstNeighborCoords.size() + srcNeighborCoords.size());
+    std::set_union(dstNeighborCoords.begin(), dstNeighborCoords.end(), srcNeighborCoords.begin(), srcNeighborCoords.end(), back_inserter(merged), CompareCoordRasterOrderFunc);
+    dstNeighborCoords.swap(merged);
+    
+    edgeBoundaryMap.erase(srcIt);
+    
+    if (!edgeGradientMap.empty()) {
+      auto srcGradientIt = edgeGradientMap.find(SuperpixelEdge(srcTag, neighborTag));
+      
+      if (srcGradientIt != edgeGradientMap.end()) {
+        SuperpixelEdgeGradient &dstGradient = edgeGradientMap[SuperpixelEdge(dstTag, neighborTag)];
+        dstGradient.sum += srcGradientIt->second.sum;
+        dstGradient.numPixels += srcGradientIt->second.numPixels;
+        edgeGradientMap.erase(srcGradientIt);
+      }
+    }
+  }
+}
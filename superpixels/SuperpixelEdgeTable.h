@@ -7,12 +7,542 @@
 
 #include <unordered_map>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
 
 #include "SuperpixelEdge.h"
+#include "Coord.h"
 
 using namespace std;
 using namespace cv;
 
+// The neighbors of a superpixel are stored as a sorted vector of tags, most
+// superpixels have only a few neighbors so a search over one contiguous
+// vector is faster than walking the nodes of a set. This class provides the
+// part of the set<int32_t> interface that the edge code uses.
+//
+// An iterator holds the tag it points to along with the offset, so that it
+// keeps working after the neighbors are modified. Incrementing an iterator
+// moves to the smallest tag larger than the current one, which is what a
+// set iterator does when elements other than the current one are inserted
+// or erased. Merge loops depend on this since they advance the iterator
+// and then merge, which modifies the neighbors being iterated.
+
+class SuperpixelNeighbors {
+  public:
+  
+  class const_iterator {
+    public:
+    
+    typedef forward_iterator_tag iterator_category;
+    typedef int32_t value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const int32_t* pointer;
+    typedef const int32_t& reference;
+    
+    const_iterator()
+    : owner(NULL), offset(0), tag(0)
+    {
+    }
+    
+    const_iterator(const SuperpixelNeighbors *owner, size_t offset)
+    : owner(owner), offset(offset), tag(0)
+    {
+      if (offset < owner->tags.size()) {
+        tag = owner->tags[offset];
+      } else {
+        this->offset = npos();
+      }
+    }
+    
+    const int32_t & operator*() const {
+      return tag;
+    }
+    
+    const_iterator & operator++() {
+      const vector<int32_t> &tags = owner->tags;
+      size_t next;
+      if (offset < tags.size() && tags[offset] == tag) {
+        next = offset + 1;
+      } else {
+        next = upper_bound(tags.begin(), tags.end(), tag) - tags.begin();
+      }
+      if (next < tags.size()) {
+        offset = next;
+        tag = tags[next];
+      } else {
+        offset = npos();
+      }
+      return *this;
+    }
+    
+    const_iterator operator++(int) {
+      const_iterator prev = *this;
+      ++(*this);
+      return prev;
+    }
+    
+    bool operator==(const const_iterator &other) const {
+      if (offset == npos() || other.offset == npos()) {
+        return offset == other.offset;
+      }
+      return tag == other.tag;
+    }
+    
+    bool operator!=(const const_iterator &other) const {
+      return !(*this == other);
+    }
+    
+    private:
+    
+    static size_t npos() {
+      return (size_t) -1;
+    }
+    
+    const SuperpixelNeighbors *owner;
+    size_t offset;
+    int32_t tag;
+  };
+  
+  typedef const_iterator iterator;
+  
+  SuperpixelNeighbors()
+  : resolvedMerges(0)
+  {
+  }
+  
+  size_t size() const {
+    return tags.size();
+  }
+  
+  bool empty() const {
+    return tags.empty();
+  }
+  
+  const_iterator begin() const {
+    return const_iterator(this, 0);
+  }
+  
+  const_iterator end() const {
+    return const_iterator(this, tags.size());
+  }
+  
+  const_iterator find(int32_t tag) const {
+    auto it = lower_bound(tags.begin(), tags.end(), tag);
+    if (it == tags.end() || *it != tag) {
+      return end();
+    }
+    return const_iterator(this, it - tags.begin());
+  }
+  
+  size_t count(int32_t tag) const {
+    return binary_search(tags.begin(), tags.end(), tag) ? 1 : 0;
+  }
+  
+  pair<const_iterator, bool> insert(int32_t tag) {
+    auto it = lower_bound(tags.begin(), tags.end(), tag);
+    size_t offset = it - tags.begin();
+    if (it != tags.end() && *it == tag) {
+      return make_pair(const_iterator(this, offset), false);
+    }
+    tags.insert(it, tag);
+    return make_pair(const_iterator(this, offset), true);
+  }
+  
+  // Insert hint is ignored, this exists for compatibility with set
+  
+  const_iterator insert(const_iterator hint, int32_t tag) {
+    return insert(tag).first;
+  }
+  
+  size_t erase(int32_t tag) {
+    auto it = lower_bound(tags.begin(), tags.end(), tag);
+    if (it == tags.end() || *it != tag) {
+      return 0;
+    }
+    tags.erase(it);
+    return 1;
+  }
+  
+  void clear() {
+    tags.clear();
+  }
+  
+  // Append a tag that is larger than all of the current tags
+  
+  void appendSorted(int32_t tag) {
+#if defined(DEBUG)
+    assert(tags.empty() || tags.back() < tag);
+#endif // DEBUG
+    tags.push_back(tag);
+  }
+  
+  // Replace contents with tags that are already sorted and unique
+  
+  void assignSorted(const int32_t *sortedTags, size_t n) {
+    tags.assign(sortedTags, sortedTags + n);
+  }
+  
+  // Direct access to the sorted tags
+  
+  const vector<int32_t> & getTags() const {
+    return tags;
+  }
+  
+  private:
+  
+  vector<int32_t> tags;
+  
+  // The number of lazy merges in the edge table when these tags were last
+  // resolved, the tags can only be stale when this is behind the table.
+  
+  uint32_t resolvedMerges;
+  
+  friend class SuperpixelEdgeTable;
+};
+
+// A read only view of sorted tags that does not copy them. A range returned
+// by SuperpixelEdgeTable::getNeighborsRange() points into the neighbors of a
+// superpixel, so it is invalidated by any merge, setNeighbors() or
+// removeNeighbors() and must not be held across one. Use getNeighbors() for a
+// copy that can be held while the graph is modified.
+
+class SuperpixelTagRange {
+  public:
+  
+  typedef const int32_t* const_iterator;
+  typedef const_iterator iterator;
+  
+  SuperpixelTagRange()
+  : first(NULL), last(NULL)
+  {
+  }
+  
+  SuperpixelTagRange(const int32_t *first, const int32_t *last)
+  : first(first), last(last)
+  {
+  }
+  
+  const_iterator begin() const {
+    return first;
+  }
+  
+  const_iterator end() const {
+    return last;
+  }
+  
+  size_t size() const {
+    return (size_t) (last - first);
+  }
+  
+  bool empty() const {
+    return first == last;
+  }
+  
+  int32_t operator[](size_t i) const {
+    return first[i];
+  }
+  
+  size_t count(int32_t tag) const {
+    return binary_search(first, last, tag) ? 1 : 0;
+  }
+  
+  private:
+  
+  const int32_t *first;
+  const int32_t *last;
+};
+
+// Edge weights stored in a flat open addressing table with linear probing, an
+// edge is keyed by the canonical (A << 32) | B value so that a lookup reads a
+// few adjacent slots and inserting an edge does not allocate a node. This
+// class provides the part of the unordered_map<SuperpixelEdge, float>
+// interface that the edge code uses. Erase shifts the following entries back
+// instead of leaving a tombstone, so an iterator must not be held across an
+// insert or an erase.
+
+class SuperpixelEdgeWeights {
+  public:
+  
+  typedef struct {
+    SuperpixelEdge first;
+    float second;
+  } value_type;
+  
+  class iterator {
+    public:
+    
+    typedef forward_iterator_tag iterator_category;
+    typedef SuperpixelEdgeWeights::value_type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef value_type* pointer;
+    typedef value_type& reference;
+    
+    iterator()
+    : owner(NULL), offset(0)
+    {
+    }
+    
+    iterator(SuperpixelEdgeWeights *owner, size_t offset)
+    : owner(owner), offset(offset)
+    {
+      skipEmpty();
+    }
+    
+    value_type & operator*() const {
+      return owner->slots[offset];
+    }
+    
+    value_type * operator->() const {
+      return &owner->slots[offset];
+    }
+    
+    iterator & operator++() {
+      offset++;
+      skipEmpty();
+      return *this;
+    }
+    
+    bool operator==(const iterator &other) const {
+      return offset == other.offset;
+    }
+    
+    bool operator!=(const iterator &other) const {
+      return offset != other.offset;
+    }
+    
+    private:
+    
+    SuperpixelEdgeWeights *owner;
+    size_t offset;
+    
+    void skipEmpty() {
+      while (offset < owner->slots.size() && isEmptySlot(owner->slots[offset])) {
+        offset++;
+      }
+    }
+  };
+  
+  SuperpixelEdgeWeights()
+  : numEdges(0), hashShift(64)
+  {
+  }
+  
+  size_t size() const {
+    return numEdges;
+  }
+  
+  bool empty() const {
+    return numEdges == 0;
+  }
+  
+  void clear() {
+    slots.clear();
+    numEdges = 0;
+    hashShift = 64;
+  }
+  
+  // Grow the table so that n edges can be inserted without a rehash
+  
+  void reserve(size_t n) {
+    size_t capacity = 16;
+    while ((capacity * 7) < (n * 10)) {
+      capacity *= 2;
+    }
+    if (capacity > slots.size()) {
+      rehash(capacity);
+    }
+  }
+  
+  iterator begin() {
+    return iterator(this, 0);
+  }
+  
+  iterator end() {
+    return iterator(this, slots.size());
+  }
+  
+  iterator find(const SuperpixelEdge &edge) {
+    size_t offset = findOffset(edge);
+    return (offset == npos()) ? end() : iterator(this, offset);
+  }
+  
+  size_t count(const SuperpixelEdge &edge) const {
+    return (findOffset(edge) == npos()) ? 0 : 1;
+  }
+  
+  // Weight of an edge, an edge that is not found is inserted with a zero weight
+  
+  float & operator[](const SuperpixelEdge &edge) {
+    size_t offset = findOffset(edge);
+    
+    if (offset != npos()) {
+      return slots[offset].second;
+    }
+    
+    if (((numEdges + 1) * 10) > (slots.size() * 7)) {
+      rehash(std::max((size_t) 16, slots.size() * 2));
+    }
+    
+    offset = homeOffset(edgeKey(edge));
+    
+    while (!isEmptySlot(slots[offset])) {
+      offset = (offset + 1) & (slots.size() - 1);
+    }
+    
+    slots[offset].first = edge;
+    slots[offset].second = 0.0f;
+    numEdges += 1;
+    
+    return slots[offset].second;
+  }
+  
+  size_t erase(const SuperpixelEdge &edge) {
+    size_t offset = findOffset(edge);
+    
+    if (offset == npos()) {
+      return 0;
+    }
+    
+    eraseOffset(offset);
+    return 1;
+  }
+  
+  // Erase the edges between tag and each neighbor, this is invoked with the
+  // neighbors of a merged superpixel since those edges no longer exist.
+  
+  template <typename T>
+  size_t eraseEdges(int32_t tag, const T &neighbors) {
+    size_t numErased = 0;
+    
+    if (numEdges == 0) {
+      return 0;
+    }
+    
+    for ( int32_t neighborTag : neighbors ) {
+      numErased += erase(SuperpixelEdge(tag, neighborTag));
+    }
+    
+    return numErased;
+  }
+  
+  private:
+  
+  vector<value_type> slots;
+  
+  size_t numEdges;
+  
+  // 64 minus the log2 of the number of slots
+  
+  int hashShift;
+  
+  static size_t npos() {
+    return (size_t) -1;
+  }
+  
+  static uint64_t edgeKey(const SuperpixelEdge &edge) {
+    return (((uint64_t) (uint32_t) edge.A) << 32) | ((uint64_t) (uint32_t) edge.B);
+  }
+  
+  // An empty slot holds (-1, -1) which is not a valid edge
+  
+  static bool isEmptySlot(const value_type &slot) {
+    return slot.first.A == -1 && slot.first.B == -1;
+  }
+  
+  // Fibonacci hash of the key to the top bits, the tags of neighbor edges
+  // differ in the low bits of the key.
+  
+  size_t homeOffset(uint64_t key) const {
+    return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> hashShift);
+  }
+  
+  size_t findOffset(const SuperpixelEdge &edge) const {
+    if (numEdges == 0) {
+      return npos();
+    }
+    
+    const size_t mask = slots.size() - 1;
+    
+    for ( size_t offset = homeOffset(edgeKey(edge)); ; offset = (offset + 1) & mask ) {
+      const value_type &slot = slots[offset];
+      if (slot.first == edge) {
+        return offset;
+      }
+      if (isEmptySlot(slot)) {
+        return npos();
+      }
+    }
+  }
+  
+  // Remove the entry at offset and shift back each following entry that
+  // would no longer be found from its home slot.
+  
+  void eraseOffset(size_t offset) {
+    const size_t mask = slots.size() - 1;
+    
+    size_t hole = offset;
+    
+    for ( size_t next = (hole + 1) & mask; !isEmptySlot(slots[next]); next = (next + 1) & mask ) {
+      size_t home = homeOffset(edgeKey(slots[next].first));
+      
+      // The distance probed from home to next must cover the hole
+      
+      if (((next - home) & mask) >= ((next - hole) & mask)) {
+        slots[hole] = slots[next];
+        hole = next;
+      }
+    }
+    
+    slots[hole].first = SuperpixelEdge(-1, -1);
+    numEdges -= 1;
+  }
+  
+  void rehash(size_t capacity) {
+    vector<value_type> oldSlots;
+    oldSlots.swap(slots);
+    
+    value_type emptySlot = { SuperpixelEdge(-1, -1), 0.0f };
+    slots.assign(capacity, emptySlot);
+    
+    hashShift = 64;
+    for ( size_t c = capacity; c > 1; c >>= 1 ) {
+      hashShift -= 1;
+    }
+    
+    const size_t mask = capacity - 1;
+    
+    for ( const value_type &slot : oldSlots ) {
+      if (isEmptySlot(slot)) {
+        continue;
+      }
+      size_t offset = homeOffset(edgeKey(slot.first));
+      while (!isEmptySlot(slots[offset])) {
+        offset = (offset + 1) & mask;
+      }
+      slots[offset] = slot;
+    }
+  }
+};
+
+// The boundary pixels of an edge (A, B) with A < B. The coords of A that touch
+// a pixel of B in the 8 neighborhood and the coords of B that touch a pixel of
+// A, each list is in raster order.
+
+typedef struct {
+  vector<Coord> coordsA;
+  vector<Coord> coordsB;
+} SuperpixelEdgeBoundary;
+
+// Sum of the Lab gradient magnitude over the boundary pixels of an edge, see
+// SuperpixelImage::computeEdgeGradients().
+
+typedef struct {
+  double sum;
+  int32_t numPixels;
+} SuperpixelEdgeGradient;
+
 class SuperpixelEdgeTable {
   
   public:
@@ -24,17 +554,45 @@ class SuperpixelEdgeTable {
   // for an edge that can be used by both superpixels that the edge
   // applies to.
   
-  unordered_map<SuperpixelEdge, float> edgeStrengthMap;
+  SuperpixelEdgeWeights edgeStrengthMap;
+  
+  // Boundary pixels for each edge, the key is the edge with A < B. This is only
+  // filled in by a parse when SuperpixelImage::recordEdgeBoundaries is set and
+  // merges keep the boundaries up to date.
+  
+  unordered_map<SuperpixelEdge, SuperpixelEdgeBoundary> edgeBoundaryMap;
+  
+  // Gradient sums for each edge with A < B, filled in for all the edges in
+  // edgeBoundaryMap by SuperpixelImage::computeEdgeGradients(). A merge adds
+  // the sums of src into dst along with the boundaries, so a neighbor pixel
+  // that touches both src and dst is counted twice in the merged sum.
+  
+  unordered_map<SuperpixelEdge, SuperpixelEdgeGradient> edgeGradientMap;
+  
+  // When lazyMerge is true a merge only records src -> dst in a union-find over
+  // tags and merges the neighbors of src into dst. The neighbors of the other
+  // superpixels that still refer to src are rewritten the next time they are
+  // accessed with getNeighborsSet() or getNeighbors(), so a reference returned
+  // by getNeighborsSet() must be fetched again after a merge unless it is the
+  // neighbors of the merge dst. False by default.
+  
+  bool lazyMerge;
     
   // Return the neighbors of a superpixel UID as a vector of int32_t
   
   vector<int32_t> getNeighbors(int32_t tag);
   
+  // Return the sorted neighbors of a superpixel UID without a copy, the range
+  // is empty when the tag is not in the table. See SuperpixelTagRange for when
+  // the range is invalidated.
+  
+  SuperpixelTagRange getNeighborsRange(int32_t tag);
+  
   // A neighbor iterator supports fast access to the neighbors list
   // in sorted order. The caller must take care to not hold an
   // iterator during a merge since that can change the neighbor list.
   
-  set<int32_t>&
+  SuperpixelNeighbors&
   getNeighborsSet(int32_t tag);
   
   // Set list of neighbor nodes for a given superpixel UID.
@@ -49,25 +607,75 @@ class SuperpixelEdgeTable {
   
   void removeNeighbors(int32_t tag);
   
+  // Lazy merge of the neighbors of src into the neighbors of dst, the src
+  // neighbors entry is removed.
+  
+  void mergeNeighborsLazy(int32_t srcTag, int32_t dstTag);
+  
+  // Move the boundaries of src into the boundaries of dst, this must be invoked
+  // before the neighbors of src are merged. The boundary between src and dst is
+  // removed since those pixels are now inside dst. The gradient sums are moved
+  // the same way.
+  
+  void mergeEdgeBoundaries(int32_t srcTag, int32_t dstTag);
+  
+  // Return the tag that a tag was merged into by lazy merges, this is the
+  // same tag when it was not merged.
+  
+  int32_t findMergedTag(int32_t tag);
+  
   // Return all edges as a flat list of SuperpixelEdge objects, this is useful
   // for inspection purposes but should not be called in real code since
   // the entire graphs is iterated over.
   
   vector<SuperpixelEdge> getAllEdges();
   
+  // Invoke f(const SuperpixelEdge&) once for each edge with A < B without
+  // building a list of edges. The edges are visited in table order and not
+  // sorted order, f must not modify the graph.
+  
+  template <typename F>
+  void forEachEdge(F f) {
+    for ( auto &pair : neighbors ) {
+      const int32_t tag = pair.first;
+      SuperpixelNeighbors &neighborsOfTag = pair.second;
+      
+      if (neighborsOfTag.resolvedMerges != numLazyMerges) {
+        resolveNeighbors(neighborsOfTag, tag);
+      }
+      
+      // Tags are sorted so the edges with A < B come after tag
+      
+      const vector<int32_t> &tags = neighborsOfTag.tags;
+      
+      for ( auto it = upper_bound(tags.begin(), tags.end(), tag); it != tags.end(); ++it ) {
+        f(SuperpixelEdge(tag, *it));
+      }
+    }
+  }
+  
   vector<int32_t> getAllTagsInNeighborsTable();
 
   // Accessor for neighbors member
   
   inline
-  unordered_map <int32_t, set<int32_t> > &getNeighborsRef()
+  unordered_map <int32_t, SuperpixelNeighbors> &getNeighborsRef()
   {
     return neighbors;
   }
   
   private:
   
-  unordered_map <int32_t, set<int32_t> > neighbors;
+  unordered_map <int32_t, SuperpixelNeighbors> neighbors;
+  
+  // Union-find parent indexed by tag, zero for a tag that was not lazy merged.
+  // Tags are always larger than zero after a parse.
+  
+  vector<int32_t> mergedParent;
+  
+  uint32_t numLazyMerges;
+  
+  void resolveNeighbors(SuperpixelNeighbors &neighborsOfTag, int32_t tag);
   
 };
 
@@ -0,0 +1,113 @@
+// A SuperpixelGraphSnapshot is a read only view of the superpixel graph, the
+// tags, the number of coords and the neighbors of each superpixel, as of one
+// version of a SuperpixelImage. A snapshot is taken with takeSnapshot() on the
+// thread that merges, and it can then be copied to and read from any number of
+// threads while the merge thread goes on to modify the image. A copy shares the
+// nodes, the nodes are held in blocks of 64 tags and a block is only copied
+// when a merge modifies a tag in a block that an older snapshot still holds,
+// so taking a snapshot after a few merges only rebuilds the nodes those merges
+// touched.
+
+#ifndef SUPERPIXEL_GRAPH_SNAPSHOT_H
+#define	SUPERPIXEL_GRAPH_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+typedef struct {
+  int32_t tag;
+  int32_t numCoords;
+  // Sorted neighbor tags
+  std::vector<int32_t> neighbors;
+} SuperpixelSnapshotNode;
+
+#define SUPERPIXEL_SNAPSHOT_BLOCK_BITS 6
+#define SUPERPIXEL_SNAPSHOT_BLOCK_SIZE (1 << SUPERPIXEL_SNAPSHOT_BLOCK_BITS)
+
+typedef struct {
+  std::shared_ptr<const SuperpixelSnapshotNode> nodes[SUPERPIXEL_SNAPSHOT_BLOCK_SIZE];
+} SuperpixelSnapshotBlock;
+
+class SuperpixelGraphSnapshot {
+  public:
+
+  SuperpixelGraphSnapshot()
+  : version(0), numSuperpixels(0)
+  {
+  }
+
+  // Number of merges done by the image when the snapshot was taken
+
+  uint32_t getVersion() const {
+    return version;
+  }
+
+  size_t size() const {
+    return numSuperpixels;
+  }
+
+  bool contains(int32_t tag) const {
+    return getNode(tag) != NULL;
+  }
+
+  // Node of a superpixel or NULL when the tag is not a superpixel
+
+  const SuperpixelSnapshotNode* getNode(int32_t tag) const {
+    if (tag < 0) {
+      return NULL;
+    }
+    const size_t blocki = ((size_t) tag) >> SUPERPIXEL_SNAPSHOT_BLOCK_BITS;
+    if (blocki >= blocks.size() || !blocks[blocki]) {
+      return NULL;
+    }
+    return blocks[blocki]->nodes[tag & (SUPERPIXEL_SNAPSHOT_BLOCK_SIZE - 1)].get();
+  }
+
+  // Zero when the tag is not a superpixel
+
+  int32_t getNumCoords(int32_t tag) const {
+    const SuperpixelSnapshotNode *nodePtr = getNode(tag);
+    return (nodePtr == NULL) ? 0 : nodePtr->numCoords;
+  }
+
+  // Empty when the tag is not a superpixel
+
+  const std::vector<int32_t>& getNeighbors(int32_t tag) const {
+    static const std::vector<int32_t> noNeighbors;
+    const SuperpixelSnapshotNode *nodePtr = getNode(tag);
+    return (nodePtr == NULL) ? noNeighbors : nodePtr->neighbors;
+  }
+
+  // Invoke f(const SuperpixelSnapshotNode&) for each superpixel in tag order
+
+  template <typename F>
+  void forEach(F f) const {
+    for ( const std::shared_ptr<SuperpixelSnapshotBlock> &blockPtr : blocks ) {
+      if (!blockPtr) {
+        continue;
+      }
+      for ( const std::shared_ptr<const SuperpixelSnapshotNode> &nodePtr : blockPtr->nodes ) {
+        if (nodePtr) {
+          f(*nodePtr);
+        }
+      }
+    }
+  }
+
+  private:
+
+  friend class SuperpixelImage;
+
+  uint32_t version;
+
+  size_t numSuperpixels;
+
+  // Blocks indexed by tag >> SUPERPIXEL_SNAPSHOT_BLOCK_BITS, a block is not
+  // modified once it is shared with a snapshot.
+
+  std::vector<std::shared_ptr<SuperpixelSnapshotBlock> > blocks;
+};
+
+#endif // SUPERPIXEL_GRAPH_SNAPSHOT_H
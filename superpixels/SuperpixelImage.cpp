@@ -17,8 +17,30 @@
 
 #include <iomanip>      // setprecision
 
+#include <opencv2/core/ocl.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <fstream>
+
 const int MaxSmallNumPixelsVal = 10;
 
+static atomic<int> defaultTiledImageDim(0);
+
+void setDefaultTiledImageDim(int tileDim)
+{
+  defaultTiledImageDim = (tileDim == 4 || tileDim == 8) ? tileDim : 0;
+}
+
+int getDefaultTiledImageDim()
+{
+  return defaultTiledImageDim;
+}
+
 void parse3DHistogram(Mat *histInputPtr,
                       Mat *histPtr,
                       Mat *backProjectInputPtr,
@@ -26,6 +48,10 @@ void parse3DHistogram(Mat *histInputPtr,
                       int conversion,
                       int numBins);
 
+void parse3DBackProjection(UMat &backProjectInput,
+                           Mat &hist,
+                           Mat &backProjection);
+
 bool pos_sample_within_bound(vector<float> &weights, float currentWeight);
 
 void generateStaticColortable(Mat &inputImg, SuperpixelImage &spImage);
@@ -76,280 +102,1568 @@ ForwardIterator binary_search_iter (ForwardIterator first, ForwardIterator last,
   }
 }
 
+// Superpixels are looked up through a direct indexed table when the tags are
+// dense enough, either because the tags are small or because most of the
+// tag values are used.
+
+static
+void fillTagToSuperpixelTable(SuperpixelImage &spImage, int32_t denseLimit)
+{
+  TagToSuperpixelMap &tagToSuperpixelMap = spImage.tagToSuperpixelMap;
+  
+  int32_t maxTag = 0;
+  
+  for ( auto &pair : tagToSuperpixelMap ) {
+    maxTag = maxi(maxTag, pair.first);
+  }
+  
+  if (maxTag < denseLimit || maxTag < (4 * (int32_t) tagToSuperpixelMap.size())) {
+    vector<Superpixel*> &table = spImage.tagToSuperpixelTable;
+    table.assign(maxTag + 1, NULL);
+    
+    for ( auto &pair : tagToSuperpixelMap ) {
+      table[pair.first] = pair.second;
+    }
+  } else {
+    vector<Superpixel*>().swap(spImage.tagToSuperpixelTable);
+  }
+}
+
+// Parse is done in two passes. The first pass adds 1 to each tag in the tags
+// image and relabels each tag to a compact label that is stored in a label
+// buffer while counting the pixels with each label. The second pass creates
+// one superpixel per label with exactly sized coords and then fills the coords
+// from the label buffer. Tags are relabeled through a direct indexed table
+// when the tag values are dense enough and through a hash table otherwise,
+// a run of pixels with the same tag only does one relabel. A CV_32SC1 tags
+// image is read and incremented in place as words.
+
 bool SuperpixelImage::parse(Mat &tags, SuperpixelImage &spImage) {
   const bool debug = false;
   
-  assert(tags.channels() == 3);
+  assert(isTagsImageType(tags));
+  
+  TagToSuperpixelMap &tagToSuperpixelMap = spImage.tagToSuperpixelMap;
+  
+  auto &superpixels = spImage.superpixels;
+  
+  const int numPixels = tags.rows * tags.cols;
+  
+  // Tags smaller than denseLimit are relabeled with a table, the limit keeps
+  // the table small enough to stay in cache since a random tag order would
+  // otherwise miss on each change of tag.
+  
+  const int32_t denseLimit = (1 << 20);
+  
+  vector<int32_t> denseLabels;
+  unordered_map<int32_t, int32_t> sparseLabels;
+  
+  vector<int32_t> labelToTag;
+  vector<int32_t> labelCounts;
+  
+  vector<int32_t> labels(numPixels);
+  
+  int32_t lastTag = -1;
+  int32_t lastLabel = -1;
+  int runLength = 0;
+  
+  int offset = 0;
+  
+  // A 24 bit row is packed to words, incremented and then written back
+  
+  const bool wideTags = (tags.type() == CV_32SC1);
+  
+  const int32_t tagLimit = wideTags ? INT32_MAX : 0x00FFFFFF;
+  
+  vector<uint32_t> rowBuffer(wideTags ? 0 : tags.cols);
+  
+  for( int y = 0; y < tags.rows; y++ ) {
+    uint8_t *rowPtr = tags.ptr<uint8_t>(y);
+    
+    uint32_t *rowTags = wideTags ? (uint32_t *) rowPtr : rowBuffer.data();
+    
+    if (!wideTags) {
+      packPixelRow(rowPtr, rowTags, tags.cols);
+    }
+    
+    for( int x = 0; x < tags.cols; x++ ) {
+      int32_t tag = (int32_t) rowTags[x];
+      
+      // Note that an input tag value must always be smaller than tagLimit
+      // since this logic will implicitly add 1 to each pixel value to make
+      // sure that zero is not used as a valid tag value while processing.
+      // This means that a 24 bit image cannot use the value for all white as
+      // a valid tag value, but that is not a big deal since every other value
+      // can be used. A 32 bit tag must not be negative.
+      
+      if (tag < 0 || tag >= tagLimit) {
+        cerr << "error : tag pixel has the value " << tag << " which is not supported" << endl;
+        return false;
+      }
+      tag += 1;
+      rowTags[x] = (uint32_t) tag;
+      
+      if (tag != lastTag) {
+        if (lastLabel != -1) {
+          labelCounts[lastLabel] += runLength;
+        }
+        runLength = 0;
+        
+        int32_t *labelPtr;
+        
+        if (tag < denseLimit) {
+          if (tag >= (int32_t) denseLabels.size()) {
+            denseLabels.resize(mini(denseLimit, maxi(tag + 1, (int) denseLabels.size() * 2)), -1);
+          }
+          labelPtr = &denseLabels[tag];
+        } else {
+          labelPtr = &sparseLabels.insert(make_pair(tag, -1)).first->second;
+        }
+        
+        if (*labelPtr == -1) {
+          *labelPtr = (int32_t) labelToTag.size();
+          labelToTag.push_back(tag);
+          labelCounts.push_back(0);
+        }
+        
+        lastTag = tag;
+        lastLabel = *labelPtr;
+      }
+      
+      labels[offset++] = lastLabel;
+      runLength += 1;
+    }
+    
+    if (!wideTags) {
+      unpackPixelRow(rowTags, rowPtr, tags.cols);
+    }
+  }
+  
+  if (lastLabel != -1) {
+    labelCounts[lastLabel] += runLength;
+  }
+  
+  const int numLabels = (int) labelToTag.size();
+  
+  vector<Superpixel*> labelToSuperpixel(numLabels);
+  
+  for ( int label = 0; label < numLabels; label++ ) {
+    int32_t tag = labelToTag[label];
+    
+    auto iter = tagToSuperpixelMap.find(tag);
+    
+    if (iter == tagToSuperpixelMap.end()) {
+      // A Superpixel has not been created for this UID since no key
+      // exists in the table. Create a superpixel in the arena, the
+      // table holds the only reference to the Superpixel object.
+      
+      if (debug) {
+        cout << "create Superpixel for UID " << tag << endl;
+      }
+      
+      Superpixel *spPtr = spImage.superpixelArena.create(tag);
+      iter = tagToSuperpixelMap.insert(iter, make_pair(tag, spPtr));
+      superpixels.insert(tag);
+    } else {
+      if (debug) {
+        cout << "exists  Superpixel for UID " << tag << endl;
+      }
+    }
+    
+    Superpixel *spPtr = iter->second;
+    assert(spPtr->tag == tag);
+    
+    spPtr->coords.reserve(spPtr->coords.size() + labelCounts[label]);
+    labelToSuperpixel[label] = spPtr;
+  }
+  
+  fillTagToSuperpixelTable(spImage, denseLimit);
+  
+  const int32_t *labelsPtr = labels.data();
+  
+  for( int y = 0; y < tags.rows; y++ ) {
+    for( int x = 0; x < tags.cols; x++ ) {
+      Superpixel *spPtr = labelToSuperpixel[*labelsPtr++];
+      spPtr->coords.push_back(Coord(x, y));
+    }
+  }
+  
+  assert(superpixels.size() == tagToSuperpixelMap.size());
+  
+  // Print superpixel info
+  
+  if (debug) {
+    cout << "added " << (tags.rows * tags.cols) << " pixels as " << superpixels.size() << " superpixels" << endl;
+    
+    for (auto it = superpixels.begin(); it != superpixels.end(); ++it) {
+      int32_t tag = *it;
+      
+      assert(tagToSuperpixelMap.count(tag) > 0);
+      Superpixel *spPtr = tagToSuperpixelMap[tag];
+      
+      cout << "superpixel UID = " << tag << " contains " << spPtr->coords.size() << " coords" << endl;
+      
+      for (auto coordsIt = spPtr->coords.begin(); coordsIt != spPtr->coords.end(); ++coordsIt) {
+        int32_t X = coordsIt->x;
+        int32_t Y = coordsIt->y;
+        cout << "X,Y" << " " << X << "," << Y << endl;
+      }
+    }
+  }
+  
+  // Generate edges for each superpixel by looking at superpixel UID's around a given X,Y coordinate
+  // and determining the other superpixels that are connected to each superpixel.
+  
+  bool worked = SuperpixelImage::parseSuperpixelEdgesParallel(tags, spImage);
+  
+  if (!worked) {
+    return false;
+  }
+  
+  // Deallocate original input tags image since it could be quite large
+  
+  //tags.release();
+  
+  return true;
+}
+
+// Parse a label image where each pixel holds a label that is smaller than the
+// number of pixels, for example the labels generated by SRM. Since the labels
+// are already compact they index the superpixel table directly, so the tag
+// hashing and the label buffer in parse() are not needed. The first pass
+// writes label + labelOffset into tags while counting the pixels with each
+// label, the second pass fills the coords. When the caller already has the
+// label counts the superpixels are created up front and a single pass writes
+// the tags and fills the coords. The result is the same as writing the tags
+// with label + labelOffset - 1 and then invoking parse().
+
+bool SuperpixelImage::parseLabels(const Mat &labels, int32_t labelOffset, Mat &tags, SuperpixelImage &spImage,
+                                  const vector<int32_t> *labelCounts,
+                                  const vector<cv::Rect> *labelBounds,
+                                  int tagsType) {
+  assert(labels.type() == CV_32SC1);
+  assert(labelOffset > 0);
+  assert(spImage.tagToSuperpixelMap.empty());
+  assert(tagsType == CV_8UC3 || tagsType == CV_32SC1);
   
   TagToSuperpixelMap &tagToSuperpixelMap = spImage.tagToSuperpixelMap;
   
   auto &superpixels = spImage.superpixels;
   
-  for( int y = 0; y < tags.rows; y++ ) {
-    for( int x = 0; x < tags.cols; x++ ) {
-      Vec3b tagVec = tags.at<Vec3b>(y, x);
-      int32_t tag = Vec3BToUID(tagVec);
-      
-      // Note that each tag value is modified here so that no superpixel
-      // will have the tag zero.
-      
-      if (1) {
-        // Note that an input tag value must always be smaller than 0x00FFFFFF
-        // since this logic will implicitly add 1 to each pixel value to make
-        // sure that zero is not used as a valid tag value while processing.
-        // This means that the image cannot use the value for all white as
-        // a valid tag value, but that is not a big deal since every other value
-        // can be used.
-        
-        if (tag == 0xFFFFFF) {
-          cerr << "error : tag pixel has the value 0xFFFFFF which is not supported" << endl;
-          return false;
-        }
-        assert(tag < 0x00FFFFFF);
-        tag += 1;
-        tagVec[0] = tag & 0xFF;
-        tagVec[1] = (tag >> 8) & 0xFF;
-        tagVec[2] = (tag >> 16) & 0xFF;
-        tags.at<Vec3b>(y, x) = tagVec;
-      }
+  const int numPixels = labels.rows * labels.cols;
+  
+  vector<int32_t> countedLabels;
+  
+  // The label bounds are only used along with the label counts
+  
+  const bool cacheBounds = (labelCounts != NULL && labelBounds != NULL);
+  
+  if (cacheBounds && labelBounds->size() != labelCounts->size()) {
+    cerr << "error : " << labelBounds->size() << " label bounds do not match " << labelCounts->size() << " label counts" << endl;
+    return false;
+  }
+  
+  // A label is always smaller than the number of pixels, so only 24 bit tags
+  // can be too large.
+  
+  const bool wideTags = (tagsType == CV_32SC1);
+  
+  const int32_t tagLimit = wideTags ? INT32_MAX : 0x00FFFFFF;
+  
+  if (wideTags && (int64_t) numPixels + labelOffset >= INT32_MAX) {
+    cerr << "error : " << numPixels << " labels do not fit into a 32 bit tag" << endl;
+    return false;
+  }
+  
+  tags.create(labels.size(), tagsType);
+  
+  auto writeTag = [wideTags](uint8_t *&tagsRowPtr, int32_t tag) {
+    if (wideTags) {
+      *((int32_t *) tagsRowPtr) = tag;
+      tagsRowPtr += sizeof(int32_t);
+    } else {
+      *tagsRowPtr++ = tag & 0xFF;
+      *tagsRowPtr++ = (tag >> 8) & 0xFF;
+      *tagsRowPtr++ = (tag >> 16) & 0xFF;
+    }
+  };
+  
+  if (labelCounts == NULL) {
+    for( int y = 0; y < labels.rows; y++ ) {
+      const int32_t *labelsRowPtr = labels.ptr<int32_t>(y);
+      uint8_t *tagsRowPtr = tags.ptr<uint8_t>(y);
+      
+      for( int x = 0; x < labels.cols; x++ ) {
+        int32_t label = labelsRowPtr[x];
+        
+        if (label < 0 || label >= numPixels || (label + labelOffset) >= tagLimit) {
+          cerr << "error : label " << label << " at " << x << "," << y << " is not a valid label" << endl;
+          return false;
+        }
+        
+        if (label >= (int32_t) countedLabels.size()) {
+          countedLabels.resize(mini(numPixels, maxi(label + 1, (int) countedLabels.size() * 2)), 0);
+        }
+        countedLabels[label] += 1;
+        
+        writeTag(tagsRowPtr, label + labelOffset);
+      }
+    }
+    
+    labelCounts = &countedLabels;
+  } else if ((int) labelCounts->size() + labelOffset >= tagLimit) {
+    cerr << "error : " << labelCounts->size() << " labels do not fit into a 24 bit tag" << endl;
+    return false;
+  }
+  
+  // A label that no pixel uses does not get a superpixel
+  
+  const int numLabels = (int) labelCounts->size();
+  
+  vector<Superpixel*> labelToSuperpixel(numLabels, NULL);
+  
+  for ( int label = 0; label < numLabels; label++ ) {
+    if ((*labelCounts)[label] == 0) {
+      continue;
+    }
+    
+    int32_t tag = label + labelOffset;
+    
+    Superpixel *spPtr = spImage.superpixelArena.create(tag);
+    tagToSuperpixelMap.insert(make_pair(tag, spPtr));
+    superpixels.insert(tag);
+    
+    spPtr->coords.reserve((*labelCounts)[label]);
+    labelToSuperpixel[label] = spPtr;
+    
+    if (cacheBounds) {
+      spPtr->cachedBbox = (*labelBounds)[label];
+      spPtr->bboxNumCoords = (uint32_t) (*labelCounts)[label];
+    }
+  }
+  
+  fillTagToSuperpixelTable(spImage, (1 << 20));
+  
+  const bool writeTags = (labelCounts != &countedLabels);
+  
+  for( int y = 0; y < labels.rows; y++ ) {
+    const int32_t *labelsRowPtr = labels.ptr<int32_t>(y);
+    uint8_t *tagsRowPtr = tags.ptr<uint8_t>(y);
+    
+    for( int x = 0; x < labels.cols; x++ ) {
+      int32_t label = labelsRowPtr[x];
+      
+      if (writeTags) {
+        if (label < 0 || label >= numLabels || labelToSuperpixel[label] == NULL) {
+          cerr << "error : label " << label << " at " << x << "," << y << " does not match the label counts" << endl;
+          return false;
+        }
+        
+        writeTag(tagsRowPtr, label + labelOffset);
+      }
+      
+      Superpixel *spPtr = labelToSuperpixel[label];
+      spPtr->coords.push_back(Coord(x, y));
+    }
+  }
+  
+  assert(superpixels.size() == tagToSuperpixelMap.size());
+  
+#if defined(DEBUG)
+  for ( int label = 0; label < numLabels; label++ ) {
+    if (labelToSuperpixel[label] != NULL) {
+      assert((int32_t) labelToSuperpixel[label]->coords.size() == (*labelCounts)[label]);
+    }
+  }
+#endif // DEBUG
+  
+  return SuperpixelImage::parseSuperpixelEdgesParallel(tags, spImage);
+}
+
+// Snapshot layout, each section starts on an 8 byte boundary:
+//
+// SuperpixelImageSnapshotHeader
+// SuperpixelSnapshotRecord x numSuperpixels, in increasing tag order
+// Coord x numCoords, the coords of each superpixel in order
+// int32_t x numNeighbors, the sorted neighbor tags of each superpixel
+// SuperpixelEdgeWeightRecord x numEdgeWeights, sorted by edge
+
+#define SUPERPIXEL_IMAGE_SNAPSHOT_MAGIC "SPXIMAGE"
+// A build with SEGMENTATION_WIDE_COORDS writes 64 bit coords with a different
+// version, so a snapshot is only read by a build with the same Coord.
+
+#if defined(SEGMENTATION_WIDE_COORDS)
+#define SUPERPIXEL_IMAGE_SNAPSHOT_VERSION 2
+#else
+#define SUPERPIXEL_IMAGE_SNAPSHOT_VERSION 1
+#endif // SEGMENTATION_WIDE_COORDS
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t numSuperpixels;
+  uint32_t numEdgeWeights;
+  uint64_t numCoords;
+  uint64_t numNeighbors;
+  uint64_t superpixelsOffset;
+  uint64_t coordsOffset;
+  uint64_t neighborsOffset;
+  uint64_t edgeWeightsOffset;
+  uint64_t fileSize;
+} SuperpixelImageSnapshotHeader;
+
+typedef enum {
+  SuperpixelSnapshotBboxValid = (1 << 0),
+  SuperpixelSnapshotRunLength = (1 << 1),
+} SuperpixelSnapshotFlags;
+
+typedef struct {
+  int32_t tag;
+  uint32_t flags;
+  uint64_t firstCoord;
+  uint64_t firstNeighbor;
+  uint32_t numCoords;
+  uint32_t numNeighbors;
+  int32_t bboxX;
+  int32_t bboxY;
+  int32_t bboxWidth;
+  int32_t bboxHeight;
+  uint32_t snapshotFlags;
+  uint32_t mergedCount;
+  float mergedMean;
+  float mergedM2;
+  uint32_t unmergedCount;
+  float unmergedMean;
+  float unmergedM2;
+  uint32_t reserved;
+} SuperpixelSnapshotRecord;
+
+typedef struct {
+  int32_t A;
+  int32_t B;
+  float weight;
+} SuperpixelEdgeWeightRecord;
+
+static_assert(sizeof(Coord) == 2 * sizeof(Coord::value_type), "Coord must not be padded");
+
+static inline
+uint64_t alignSnapshotOffset(uint64_t offset)
+{
+  return (offset + 7) & ~((uint64_t) 7);
+}
+
+// Write numBytes at offset and zero bytes before it, offset is the current
+// offset in the stream and is updated.
+
+static
+void writeSnapshotSection(std::ofstream &outFile, uint64_t &offset, uint64_t toOffset, const void *ptr, size_t numBytes)
+{
+  static const char zeros[8] = { 0 };
+  
+  assert(toOffset >= offset && (toOffset - offset) <= sizeof(zeros));
+  
+  outFile.write(zeros, (std::streamsize) (toOffset - offset));
+  outFile.write((const char*) ptr, (std::streamsize) numBytes);
+  offset = toOffset + numBytes;
+}
+
+bool SuperpixelImage::save(const string &filename)
+{
+  vector<SuperpixelSnapshotRecord> records;
+  records.reserve(superpixels.size());
+  
+  vector<Coord> allCoords;
+  vector<int32_t> allNeighbors;
+  
+  auto &neighborsMap = edgeTable.getNeighborsRef();
+  
+  for ( int32_t tag : superpixels ) {
+    Superpixel *spPtr = getSuperpixelPtr(tag);
+    
+    SuperpixelSnapshotRecord record;
+    memset(&record, 0, sizeof(record));
+    record.tag = tag;
+    record.flags = spPtr->flags;
+    record.firstCoord = allCoords.size();
+    record.numCoords = (uint32_t) spPtr->coords.size();
+    
+    spPtr->coords.forEachCoord([&allCoords](Coord coord) {
+      allCoords.push_back(coord);
+    });
+    
+    if (spPtr->coords.isRunLength()) {
+      record.snapshotFlags |= SuperpixelSnapshotRunLength;
+    }
+    
+    if (spPtr->bboxNumCoords == record.numCoords) {
+      record.snapshotFlags |= SuperpixelSnapshotBboxValid;
+      record.bboxX = spPtr->cachedBbox.x;
+      record.bboxY = spPtr->cachedBbox.y;
+      record.bboxWidth = spPtr->cachedBbox.width;
+      record.bboxHeight = spPtr->cachedBbox.height;
+    }
+    
+    record.firstNeighbor = allNeighbors.size();
+    
+    if (neighborsMap.count(tag) > 0) {
+      const vector<int32_t> &neighborTags = edgeTable.getNeighborsSet(tag).getTags();
+      allNeighbors.insert(allNeighbors.end(), neighborTags.begin(), neighborTags.end());
+      record.numNeighbors = (uint32_t) neighborTags.size();
+    }
+    
+    record.mergedCount = (uint32_t) spPtr->mergedEdgeWeights.size();
+    record.mergedMean = spPtr->mergedEdgeWeights.mean();
+    record.mergedM2 = spPtr->mergedEdgeWeights.sumSquaredDeltas();
+    record.unmergedCount = (uint32_t) spPtr->unmergedEdgeWeights.size();
+    record.unmergedMean = spPtr->unmergedEdgeWeights.mean();
+    record.unmergedM2 = spPtr->unmergedEdgeWeights.sumSquaredDeltas();
+    
+    records.push_back(record);
+  }
+  
+  vector<SuperpixelEdgeWeightRecord> edgeWeights;
+  edgeWeights.reserve(edgeTable.edgeStrengthMap.size());
+  
+  for ( auto &pair : edgeTable.edgeStrengthMap ) {
+    SuperpixelEdgeWeightRecord record;
+    record.A = pair.first.A;
+    record.B = pair.first.B;
+    record.weight = pair.second;
+    edgeWeights.push_back(record);
+  }
+  
+  sort(edgeWeights.begin(), edgeWeights.end(), [](const SuperpixelEdgeWeightRecord &r1, const SuperpixelEdgeWeightRecord &r2) {
+    return (r1.A != r2.A) ? (r1.A < r2.A) : (r1.B < r2.B);
+  });
+  
+  SuperpixelImageSnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SUPERPIXEL_IMAGE_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SUPERPIXEL_IMAGE_SNAPSHOT_VERSION;
+  header.headerSize = sizeof(SuperpixelImageSnapshotHeader);
+  header.numSuperpixels = (uint32_t) records.size();
+  header.numEdgeWeights = (uint32_t) edgeWeights.size();
+  header.numCoords = allCoords.size();
+  header.numNeighbors = allNeighbors.size();
+  header.superpixelsOffset = alignSnapshotOffset(sizeof(header));
+  header.coordsOffset = alignSnapshotOffset(header.superpixelsOffset + records.size() * sizeof(SuperpixelSnapshotRecord));
+  header.neighborsOffset = alignSnapshotOffset(header.coordsOffset + allCoords.size() * sizeof(Coord));
+  header.edgeWeightsOffset = alignSnapshotOffset(header.neighborsOffset + allNeighbors.size() * sizeof(int32_t));
+  header.fileSize = header.edgeWeightsOffset + edgeWeights.size() * sizeof(SuperpixelEdgeWeightRecord);
+  
+  std::ofstream outFile(filename.c_str(), std::ios::binary | std::ios::trunc);
+  
+  if (!outFile) {
+    return false;
+  }
+  
+  uint64_t offset = 0;
+  
+  writeSnapshotSection(outFile, offset, 0, &header, sizeof(header));
+  writeSnapshotSection(outFile, offset, header.superpixelsOffset, records.data(), records.size() * sizeof(SuperpixelSnapshotRecord));
+  writeSnapshotSection(outFile, offset, header.coordsOffset, allCoords.data(), allCoords.size() * sizeof(Coord));
+  writeSnapshotSection(outFile, offset, header.neighborsOffset, allNeighbors.data(), allNeighbors.size() * sizeof(int32_t));
+  writeSnapshotSection(outFile, offset, header.edgeWeightsOffset, edgeWeights.data(), edgeWeights.size() * sizeof(SuperpixelEdgeWeightRecord));
+  
+  return (bool) outFile;
+}
+
+// True when count records of recordSize bytes at offset end inside the file
+
+static inline
+bool snapshotSectionFits(uint64_t offset, uint64_t count, uint64_t recordSize, uint64_t fileSize)
+{
+  return (offset % 8) == 0 && offset <= fileSize && count <= (fileSize - offset) / recordSize;
+}
+
+bool SuperpixelImage::load(const string &filename, SuperpixelImage &spImage)
+{
+  if (!spImage.tagToSuperpixelMap.empty()) {
+    cerr << "error : snapshot must be loaded into an empty superpixel image" << endl;
+    return false;
+  }
+  
+  int fd = open(filename.c_str(), O_RDONLY);
+  
+  if (fd == -1) {
+    return false;
+  }
+  
+  struct stat statBuf;
+  
+  if (fstat(fd, &statBuf) != 0 || statBuf.st_size < (off_t) sizeof(SuperpixelImageSnapshotHeader)) {
+    close(fd);
+    return false;
+  }
+  
+  const size_t mapSize = (size_t) statBuf.st_size;
+  
+  void *mapPtr = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  
+  close(fd);
+  
+  if (mapPtr == MAP_FAILED) {
+    return false;
+  }
+  
+  const uint8_t *bytes = (const uint8_t*) mapPtr;
+  const SuperpixelImageSnapshotHeader &header = *((const SuperpixelImageSnapshotHeader*) bytes);
+  
+  bool valid = memcmp(header.magic, SUPERPIXEL_IMAGE_SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+    header.version == SUPERPIXEL_IMAGE_SNAPSHOT_VERSION &&
+    header.headerSize == sizeof(SuperpixelImageSnapshotHeader) &&
+    header.fileSize == mapSize &&
+    snapshotSectionFits(header.superpixelsOffset, header.numSuperpixels, sizeof(SuperpixelSnapshotRecord), mapSize) &&
+    snapshotSectionFits(header.coordsOffset, header.numCoords, sizeof(Coord), mapSize) &&
+    snapshotSectionFits(header.neighborsOffset, header.numNeighbors, sizeof(int32_t), mapSize) &&
+    snapshotSectionFits(header.edgeWeightsOffset, header.numEdgeWeights, sizeof(SuperpixelEdgeWeightRecord), mapSize);
+  
+  const SuperpixelSnapshotRecord *records = (const SuperpixelSnapshotRecord*) (bytes + header.superpixelsOffset);
+  const Coord *allCoords = (const Coord*) (bytes + header.coordsOffset);
+  const int32_t *allNeighbors = (const int32_t*) (bytes + header.neighborsOffset);
+  const SuperpixelEdgeWeightRecord *edgeWeights = (const SuperpixelEdgeWeightRecord*) (bytes + header.edgeWeightsOffset);
+  
+  for ( uint32_t i = 0; valid && i < header.numSuperpixels; i++ ) {
+    const SuperpixelSnapshotRecord &record = records[i];
+    valid = record.firstCoord <= header.numCoords && record.numCoords <= (header.numCoords - record.firstCoord) &&
+      record.firstNeighbor <= header.numNeighbors && record.numNeighbors <= (header.numNeighbors - record.firstNeighbor) &&
+      (i == 0 || records[i-1].tag < record.tag);
+  }
+  
+  if (!valid) {
+    cerr << "error : \"" << filename << "\" is not a valid superpixel image snapshot" << endl;
+    munmap(mapPtr, mapSize);
+    return false;
+  }
+  
+  TagToSuperpixelMap &tagToSuperpixelMap = spImage.tagToSuperpixelMap;
+  auto &neighborsMap = spImage.edgeTable.getNeighborsRef();
+  
+  tagToSuperpixelMap.reserve(header.numSuperpixels);
+  neighborsMap.reserve(header.numSuperpixels);
+  
+  for ( uint32_t i = 0; i < header.numSuperpixels; i++ ) {
+    const SuperpixelSnapshotRecord &record = records[i];
+    
+    Superpixel *spPtr = spImage.superpixelArena.create(record.tag);
+    spPtr->flags = record.flags;
+    
+    const Coord *coordsPtr = allCoords + record.firstCoord;
+    spPtr->coords.getVector().assign(coordsPtr, coordsPtr + record.numCoords);
+    
+    if (record.snapshotFlags & SuperpixelSnapshotRunLength) {
+      spPtr->coords.encodeRuns();
+    }
+    
+    if (record.snapshotFlags & SuperpixelSnapshotBboxValid) {
+      spPtr->cachedBbox = cv::Rect(record.bboxX, record.bboxY, record.bboxWidth, record.bboxHeight);
+      spPtr->bboxNumCoords = record.numCoords;
+    }
+    
+    spPtr->mergedEdgeWeights = SuperpixelWeights(record.mergedCount, record.mergedMean, record.mergedM2);
+    spPtr->unmergedEdgeWeights = SuperpixelWeights(record.unmergedCount, record.unmergedMean, record.unmergedM2);
+    
+    tagToSuperpixelMap[record.tag] = spPtr;
+    spImage.superpixels.insert(spImage.superpixels.end(), record.tag);
+    
+    neighborsMap[record.tag].assignSorted(allNeighbors + record.firstNeighbor, record.numNeighbors);
+  }
+  
+  auto &edgeStrengthMap = spImage.edgeTable.edgeStrengthMap;
+  edgeStrengthMap.reserve(header.numEdgeWeights);
+  
+  for ( uint32_t i = 0; i < header.numEdgeWeights; i++ ) {
+    const SuperpixelEdgeWeightRecord &record = edgeWeights[i];
+    edgeStrengthMap[SuperpixelEdge(record.A, record.B)] = record.weight;
+  }
+  
+  munmap(mapPtr, mapSize);
+  
+  fillTagToSuperpixelTable(spImage, (1 << 20));
+  
+  return true;
+}
+
+// Examine superpixels in an image and parse edges from the superpixel coords
+
+bool SuperpixelImage::parseSuperpixelEdges(Mat &tags, SuperpixelImage &spImage) {
+  const bool debug = false;
+  
+#if defined(DEBUG)
+  auto &superpixels = spImage.superpixels;
+#endif // DEBUG
+  
+  SuperpixelEdgeTable &edgeTable = spImage.edgeTable;
+  
+  // For each (X,Y) tag value find all the other tags defined in suppounding 8 pixels
+  // and dedup the list of neighbor tags for each superpixel.
+
+  int32_t neighborOffsetsArr[] = {
+    -1, -1, // UL
+     0, -1, // U
+     1, -1, // UR
+    -1,  0, // L
+     1,  0, // R
+    -1,  1, // DL
+     0,  1, // D
+     1,  1  // DR
+  };
+  
+  vector<pair<int32_t, int32_t> > neighborOffsets;
+  
+  for (int i = 0; i < sizeof(neighborOffsetsArr)/sizeof(int32_t); i += 2) {
+    pair<int32_t,int32_t> p(neighborOffsetsArr[i], neighborOffsetsArr[i+1]);
+    neighborOffsets.push_back(p);
+  }
+  
+  assert(neighborOffsets.size() == 8);
+  
+  unordered_map<int32_t, SuperpixelNeighbors> &tagToNeighborMap = edgeTable.getNeighborsRef();
+
+  // The neighbors lookup only needs to be done when the center tag changes
+  
+  int32_t lastCenterTag = -1;
+  SuperpixelNeighbors *neighborUIDsSetPtr = NULL;
+  
+  // The previous, current and next rows as words, each 24 bit row is packed
+  // once and the buffers are rotated as the scan moves down. The rows of a
+  // 32 bit tags image are read in place.
+  
+  vector<uint32_t> rowTagsBuffer(3 * tags.cols);
+  uint32_t *rowBuffers[3] = { rowTagsBuffer.data(), rowTagsBuffer.data() + tags.cols, rowTagsBuffer.data() + (2 * tags.cols) };
+  const uint32_t *rowTags[3] = { NULL, NULL, NULL };
+  
+  if (tags.rows > 0) {
+    rowTags[2] = readTagsRow(tags, 0, rowBuffers[2]);
+  }
+  
+  for( int y = 0; y < tags.rows; y++ ) {
+    std::swap(rowBuffers[0], rowBuffers[1]);
+    std::swap(rowBuffers[1], rowBuffers[2]);
+    rowTags[0] = rowTags[1];
+    rowTags[1] = rowTags[2];
+    
+    if (y < (tags.rows - 1)) {
+      rowTags[2] = readTagsRow(tags, y + 1, rowBuffers[2]);
+    }
+    
+    const uint32_t *rowPtrs[3];
+    rowPtrs[0] = (y > 0) ? rowTags[0] : NULL;
+    rowPtrs[1] = rowTags[1];
+    rowPtrs[2] = (y < (tags.rows - 1)) ? rowTags[2] : NULL;
+    
+    for( int x = 0; x < tags.cols; x++ ) {
+      int32_t centerTag = (int32_t) rowPtrs[1][x];
+      
+      if (debug) {
+      cout << "center (" << x << "," << y << ") with tag " << centerTag << endl;
+      }
+      
+      if (centerTag != lastCenterTag) {
+        auto iter = tagToNeighborMap.find(centerTag);
+        
+        if (iter == tagToNeighborMap.end()) {
+          // A Superpixel has not been created for this UID since no key
+          // exists in the table.
+          
+          if (debug) {
+            cout << "create neighbor vector for UID " << centerTag << endl;
+          }
+          
+          iter = tagToNeighborMap.insert(iter, make_pair(centerTag, SuperpixelNeighbors()));
+        } else {
+          if (debug) {
+            cout << "exits  neighbor vector for UID " << centerTag << endl;
+          }
+        }
+        
+        lastCenterTag = centerTag;
+        neighborUIDsSetPtr = &iter->second;
+      }
+      
+      SuperpixelNeighbors &neighborUIDsSet = *neighborUIDsSetPtr;
+
+      // Loop over each neighbor around (X,Y) and lookup tag
+      
+      int32_t lastNeighborUID = -1;
+      
+      for (auto pairIter = neighborOffsets.begin() ; pairIter != neighborOffsets.end(); ++pairIter) {
+        int dX = pairIter->first;
+        int dY = pairIter->second;
+        
+        int32_t foundNeighborUID;
+        
+        int nX = x + dX;
+        
+        const uint32_t *neighborRowPtr = rowPtrs[dY + 1];
+        
+        if (nX < 0 || nX >= tags.cols || neighborRowPtr == NULL) {
+          foundNeighborUID = -1;
+        } else {
+          foundNeighborUID = (int32_t) neighborRowPtr[nX];
+        }
+
+        if (foundNeighborUID == -1 || foundNeighborUID == centerTag || foundNeighborUID == lastNeighborUID) {
+          if (debug) {
+            cout << "ignoring (" << nX << "," << (y + dY) << ") with tag " << foundNeighborUID << " since invalid, identity, or just added" << endl;
+          }
+        } else {
+          if (debug) {
+            cout << "checking (" << nX << "," << (y + dY) << ") with tag " << foundNeighborUID << " to see if known neighbor" << endl;
+          }
+          
+          // Insert is a nop when the tag is already a neighbor
+          
+          neighborUIDsSet.insert(foundNeighborUID);
+          lastNeighborUID = foundNeighborUID;
+        }
+      }
+      
+      if (debug) {
+        cout << "after searching all neighbors of (" << x << "," << y << ") the neighbors array (len " << neighborUIDsSet.size() << ") is:" << endl;
+        
+        for ( int32_t knownNeighborUID : neighborUIDsSet ) {
+          cout << knownNeighborUID << endl;
+        }
+      }
+      
+    }
+  }
+  
+#if defined(DEBUG)
+  
+  // Each superpixel now has a vector of values for each neighbor. Create unique list of edges by
+  // iterating over the superpixels and only creating an edge object when a pair (A, B) is
+  // found where A < B.
+  
+  for (auto it = superpixels.begin(); it != superpixels.end(); ++it) {
+    int32_t tag = *it;
+    
+    // Foreach superpixel, collect all the connected neighbors and generate edges
+    
+    assert(tagToNeighborMap.count(tag) > 0);
+    
+    auto &neighborUIDsSet = tagToNeighborMap[tag];
+
+    if (debug) {
+    cout << "superpixel UID = " << tag << " neighbors len = " << neighborUIDsSet.size() << endl;
+    }
+    
+    // Every superpixel must have at least 1 neighbor or the input is invalid, unless there
+    // is only 1 superpixel to begin with which could happen if all input was same pixel.
+    
+    if (superpixels.size() > 1) {
+      assert(neighborUIDsSet.size() > 0);
+    }
+    
+    // edgeTable.setNeighbors(tag, neighborUIDsSet);
+  }
+  
+  if (debug) {
+    int numEdges = 0;
+    edgeTable.forEachEdge([&numEdges](const SuperpixelEdge &edge) {
+      numEdges += 1;
+    });
+    cout << "created " << numEdges << " edges in edge table" << endl;
+  }
+  
+#endif // DEBUG
+
+  // Final verification
+  
+#if defined(DEBUG)
+  if (superpixels.size() > 1) {
+    for ( int32_t tag : superpixels ) {
+      SuperpixelNeighbors &neighborsOfNeighborSet = spImage.edgeTable.getNeighborsSet(tag);
+      assert(neighborsOfNeighborSet.size() > 0);
+    }
+  }
+#endif // DEBUG
+  
+  return true;
+}
+
+// A boundary pixel found by the edge parse. The key is (A << 33 | B << 1 | side)
+// where side is 1 when the pixel is in B, the offset is Coord::calcOffset() so
+// that sorting gives the pixels for each side of an edge in raster order.
+
+typedef struct {
+  uint64_t key;
+  Coord::offset_type offset;
+} ParsedBoundaryPixel;
+
+static
+bool CompareParsedBoundaryPixelFunc (const ParsedBoundaryPixel &p1, const ParsedBoundaryPixel &p2) {
+  return (p1.key < p2.key) || (p1.key == p2.key && p1.offset < p2.offset);
+}
+
+static inline
+bool operator==(const ParsedBoundaryPixel &p1, const ParsedBoundaryPixel &p2) {
+  return (p1.key == p2.key && p1.offset == p2.offset);
+}
+
+// Parallel loop body that collects the edges for a stripe of rows. Each pixel
+// is compared to the 4 forward neighbors R, DL, D, DR since the neighbor
+// relation is symmetric, so the 4 backward neighbors are covered when the
+// neighbor pixel is the center. An edge is only emitted where the tag changes,
+// each edge is recorded once as a (A << 32 | B) pair with A < B and the pairs
+// for a stripe are sorted and made unique before the stripe is done. When
+// stripeBoundariesPtr is not NULL both pixels of each tag change are also
+// recorded as boundary pixels.
+
+class ParseEdgesStripeParallelBody : public cv::ParallelLoopBody
+{
+public:
+  ParseEdgesStripeParallelBody(const Mat &_tags, int _stripeRows, vector<vector<uint64_t> > &_stripeEdges, vector<vector<ParsedBoundaryPixel> > *_stripeBoundariesPtr)
+  : tags(_tags), stripeRows(_stripeRows), stripeEdges(_stripeEdges), stripeBoundariesPtr(_stripeBoundariesPtr) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int stripe = range.start; stripe < range.end; stripe++ ) {
+      parseStripe(stripe);
+    }
+  }
+  
+private:
+  const Mat &tags;
+  int stripeRows;
+  vector<vector<uint64_t> > &stripeEdges;
+  vector<vector<ParsedBoundaryPixel> > *stripeBoundariesPtr;
+  
+  void parseStripe(int stripe) const {
+    vector<uint64_t> &edges = stripeEdges[stripe];
+    vector<ParsedBoundaryPixel> *boundariesPtr = (stripeBoundariesPtr == NULL) ? NULL : &(*stripeBoundariesPtr)[stripe];
+    
+    // (dX, dY) of each forward neighbor
+    
+    const int forwardOffsets[4][2] = { {1, 0}, {-1, 1}, {0, 1}, {1, 1} };
+    
+    const int startY = stripe * stripeRows;
+    const int endY = mini(tags.rows, startY + stripeRows);
+    const int lastX = tags.cols - 1;
+    
+    // A boundary emits the same pair over and over, so a pair is skipped when
+    // it is found in a small direct mapped cache of recently emitted pairs.
+    // The cache only filters duplicates, the sort below does the real dedup.
+    
+    const int cacheSize = 1024;
+    vector<uint64_t> recentEdges(cacheSize, 0);
+    
+    // The current and next rows as words, the next row becomes the current
+    // row so each 24 bit row of the stripe is only packed once.
+    
+    vector<uint32_t> rowTagsBuffer(2 * tags.cols);
+    uint32_t *rowBuffer = rowTagsBuffer.data();
+    uint32_t *nextRowBuffer = rowTagsBuffer.data() + tags.cols;
+    const uint32_t *nextRowTags = NULL;
+    
+    if (startY < endY) {
+      nextRowTags = readTagsRow(tags, startY, nextRowBuffer);
+    }
+    
+    for( int y = startY; y < endY; y++ ) {
+      std::swap(rowBuffer, nextRowBuffer);
+      
+      const uint32_t *rowPtr = nextRowTags;
+      const uint32_t *nextRowPtr = NULL;
+      
+      if (y < (tags.rows - 1)) {
+        nextRowTags = readTagsRow(tags, y + 1, nextRowBuffer);
+        nextRowPtr = nextRowTags;
+      }
+      
+      int32_t centerTag = (int32_t) rowPtr[0];
+      
+      for( int x = 0; x < tags.cols; x++ ) {
+        int32_t rightTag = (x < lastX) ? (int32_t) rowPtr[x+1] : -1;
+        
+        int32_t forwardTags[4];
+        forwardTags[0] = rightTag;
+        
+        if (nextRowPtr != NULL) {
+          forwardTags[1] = (x > 0) ? (int32_t) nextRowPtr[x-1] : -1;
+          forwardTags[2] = (int32_t) nextRowPtr[x];
+          forwardTags[3] = (x < lastX) ? (int32_t) nextRowPtr[x+1] : -1;
+        } else {
+          forwardTags[1] = forwardTags[2] = forwardTags[3] = -1;
+        }
+        
+        for ( int i = 0; i < 4; i++ ) {
+          int32_t neighborTag = forwardTags[i];
+          
+          if (neighborTag == -1 || neighborTag == centerTag) {
+            continue;
+          }
+          
+          uint32_t A = (uint32_t) mini(centerTag, neighborTag);
+          uint32_t B = (uint32_t) maxi(centerTag, neighborTag);
+          
+          uint64_t edge = ((uint64_t) A << 32) | B;
+          
+          if (boundariesPtr != NULL) {
+            uint64_t key = ((uint64_t) A << 33) | ((uint64_t) B << 1);
+            uint32_t centerSide = (centerTag == (int32_t) B) ? 1 : 0;
+            
+            ParsedBoundaryPixel centerPixel;
+            centerPixel.key = key | centerSide;
+            centerPixel.offset = Coord(x, y).calcOffset();
+            boundariesPtr->push_back(centerPixel);
+            
+            ParsedBoundaryPixel neighborPixel;
+            neighborPixel.key = key | (centerSide ^ 1);
+            neighborPixel.offset = Coord(x + forwardOffsets[i][0], y + forwardOffsets[i][1]).calcOffset();
+            boundariesPtr->push_back(neighborPixel);
+          }
+          
+          uint64_t &recentEdge = recentEdges[((A * 0x9E3779B1) ^ B) & (cacheSize - 1)];
+          
+          if (edge == recentEdge) {
+            continue;
+          }
+          
+          edges.push_back(edge);
+          recentEdge = edge;
+        }
+        
+        centerTag = rightTag;
+      }
+    }
+    
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+    
+    if (boundariesPtr != NULL) {
+      sort(boundariesPtr->begin(), boundariesPtr->end(), CompareParsedBoundaryPixelFunc);
+      boundariesPtr->erase(unique(boundariesPtr->begin(), boundariesPtr->end()), boundariesPtr->end());
+    }
+  }
+};
+
+// Fill the edge boundary map from the boundary pixels of each stripe, the stripes
+// are in row order but a pixel on the row after a stripe can also be found by the
+// next stripe, so the pixels are sorted and made unique again.
+
+static
+void parseEdgeBoundaries(vector<vector<ParsedBoundaryPixel> > &stripeBoundaries, SuperpixelImage &spImage)
+{
+  vector<ParsedBoundaryPixel> pixels;
+  
+  if (stripeBoundaries.size() == 1) {
+    pixels.swap(stripeBoundaries[0]);
+  } else {
+    for ( auto &stripe : stripeBoundaries ) {
+      pixels.insert(pixels.end(), stripe.begin(), stripe.end());
+      vector<ParsedBoundaryPixel>().swap(stripe);
+    }
+    
+    sort(pixels.begin(), pixels.end(), CompareParsedBoundaryPixelFunc);
+    pixels.erase(unique(pixels.begin(), pixels.end()), pixels.end());
+  }
+  
+  auto &edgeBoundaryMap = spImage.edgeTable.edgeBoundaryMap;
+  edgeBoundaryMap.clear();
+  
+  spImage.edgeTable.edgeGradientMap.clear();
+  spImage.edgeGradientsData = NULL;
+  
+  uint64_t lastEdgeKey = 0;
+  SuperpixelEdgeBoundary *boundaryPtr = NULL;
+  
+  for ( const ParsedBoundaryPixel &pixel : pixels ) {
+    uint64_t edgeKey = pixel.key >> 1;
+    
+    if (boundaryPtr == NULL || edgeKey != lastEdgeKey) {
+      int32_t A = (int32_t) (edgeKey >> 32);
+      int32_t B = (int32_t) (uint32_t) edgeKey;
+      boundaryPtr = &edgeBoundaryMap[SuperpixelEdge(A, B)];
+      lastEdgeKey = edgeKey;
+    }
+    
+    Coord coord = Coord::fromOffset(pixel.offset);
+    
+    if (pixel.key & 0x1) {
+      boundaryPtr->coordsB.push_back(coord);
+    } else {
+      boundaryPtr->coordsA.push_back(coord);
+    }
+  }
+}
+
+// Parallel version of parseSuperpixelEdges(), the image is split into stripes of
+// stripeRows rows and the edges for each stripe are collected on a separate thread.
+// The stripes are merged once all are done and the neighbor lists are then
+// filled from the sorted (A, B) pairs. Pass zero as stripeRows to split the image
+// into one stripe for each thread. The results are exactly the same as the
+// serial parse.
+
+bool SuperpixelImage::parseSuperpixelEdgesParallel(Mat &tags, SuperpixelImage &spImage, int stripeRows) {
+  const bool debug = false;
+  
+  auto &superpixels = spImage.superpixels;
+  
+  unordered_map<int32_t, SuperpixelNeighbors> &tagToNeighborMap = spImage.edgeTable.getNeighborsRef();
+  
+  if (tags.rows == 0 || tags.cols == 0) {
+    return true;
+  }
+  
+  if (stripeRows <= 0) {
+    int numThreads = max(1, getNumThreads());
+    stripeRows = (tags.rows + numThreads - 1) / numThreads;
+  }
+  
+  const int numStripes = (tags.rows + stripeRows - 1) / stripeRows;
+  
+  vector<vector<uint64_t> > stripeEdges(numStripes);
+  
+  vector<vector<ParsedBoundaryPixel> > stripeBoundaries;
+  
+  if (spImage.recordEdgeBoundaries) {
+    stripeBoundaries.resize(numStripes);
+  }
+  
+  parallelFor(Range(0, numStripes), ParseEdgesStripeParallelBody(tags, stripeRows, stripeEdges, spImage.recordEdgeBoundaries ? &stripeBoundaries : NULL));
+  
+  if (spImage.recordEdgeBoundaries) {
+    parseEdgeBoundaries(stripeBoundaries, spImage);
+  }
+  
+  // Merge the stripes, an edge along a stripe seam can appear in both stripes
+  
+  vector<uint64_t> edges;
+  
+  if (numStripes == 1) {
+    edges.swap(stripeEdges[0]);
+  } else {
+    size_t numEdges = 0;
+    for ( auto &stripe : stripeEdges ) {
+      numEdges += stripe.size();
+    }
+    
+    edges.reserve(numEdges);
+    
+    for ( auto &stripe : stripeEdges ) {
+      edges.insert(edges.end(), stripe.begin(), stripe.end());
+      vector<uint64_t>().swap(stripe);
+    }
+    
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+  }
+  
+  if (debug) {
+    cout << "parsed " << edges.size() << " edges in " << numStripes << " stripes" << endl;
+  }
+  
+  // Each superpixel gets a neighbors entry even when it has no neighbors
+  
+  tagToNeighborMap.reserve(superpixels.size());
+  
+  for ( int32_t tag : superpixels ) {
+    tagToNeighborMap[tag];
+  }
+  
+  // Since the pairs are sorted by A then B, each neighbor list is appended to
+  // in ascending order. The lower tags of B are all appended to the list for
+  // B before the pairs where B is the lower tag are reached.
+  
+  int32_t lastA = -1;
+  SuperpixelNeighbors *neighborsAPtr = NULL;
+  
+  for ( uint64_t edge : edges ) {
+    int32_t A = (int32_t) (edge >> 32);
+    int32_t B = (int32_t) (uint32_t) edge;
+    
+    if (A != lastA) {
+      neighborsAPtr = &tagToNeighborMap[A];
+      lastA = A;
+    }
+    
+    neighborsAPtr->appendSorted(B);
+    tagToNeighborMap[B].appendSorted(A);
+  }
+  
+#if defined(DEBUG)
+  if (superpixels.size() > 1) {
+    for ( int32_t tag : superpixels ) {
+      assert(tagToNeighborMap[tag].size() > 0);
+    }
+  }
+#endif // DEBUG
+  
+  return true;
+}
+
+// Read the pixels of each superpixel once to set the color stats, merges
+// then keep the stats up to date without reading the pixels again.
+
+void SuperpixelImage::setColorStats(Mat &inputImg) {
+  for ( int32_t tag : superpixels ) {
+    Superpixel *spPtr = getSuperpixelPtr(tag);
+    spPtr->setColorStats(inputImg);
+  }
+  
+  colorStatsData = inputImg.data;
+}
+
+void SuperpixelImage::filterEdgeCoords(int32_t tag1,
+                                       vector<Coord> &edgeCoords1,
+                                       int32_t tag2,
+                                       vector<Coord> &edgeCoords2)
+{
+  auto &edgeBoundaryMap = edgeTable.edgeBoundaryMap;
+  
+  if (!edgeBoundaryMap.empty()) {
+    auto it = edgeBoundaryMap.find(SuperpixelEdge(tag1, tag2));
+    
+    if (it != edgeBoundaryMap.end()) {
+      SuperpixelEdgeBoundary &boundary = it->second;
+      edgeCoords1 = (tag1 < tag2) ? boundary.coordsA : boundary.coordsB;
+      edgeCoords2 = (tag1 < tag2) ? boundary.coordsB : boundary.coordsA;
+      return;
+    }
+  }
+  
+  Superpixel::filterEdgeCoords(getSuperpixelPtr(tag1), edgeCoords1, getSuperpixelPtr(tag2), edgeCoords2);
+}
+
+void SuperpixelImage::encodeCoordRuns() {
+  for ( int32_t tag : superpixels ) {
+    Superpixel *spPtr = getSuperpixelPtr(tag);
+    spPtr->coords.encodeRuns();
+  }
+}
+
+// Discard the cached images when inputImg is not the image they were made
+// from. The tiles of a new input image are made right away so that the tiles
+// are only ever written by the thread that caches the images.
+
+void SuperpixelImage::discardConvertedImages(const Mat &inputImg) {
+  if (inputImg.data == convertedImagesData) {
+    return;
+  }
+  
+  convertedImages.clear();
+  convertedUMats.clear();
+  packedPixels.release();
+  labGradients.release();
+  tiledImages.clear();
+  tiledPackedPixels.release();
+  convertedImagesData = inputImg.data;
+  
+  if (tiledImageDim != 0 && inputImg.type() == CV_8UC3) {
+    tiledImages[0].create(inputImg, tiledImageDim);
+  }
+}
+
+Mat & SuperpixelImage::getConvertedImage(Mat &inputImg, int conversion) {
+  if (conversion == 0) {
+    return inputImg;
+  }
+  
+  discardConvertedImages(inputImg);
+  
+  Mat &convertedImg = convertedImages[conversion];
+  
+  if (convertedImg.empty()) {
+    cvtColor(inputImg, convertedImg, conversion);
+    
+    if (tiledImageDim != 0 && convertedImg.type() == CV_8UC3) {
+      tiledImages[conversion].create(convertedImg, tiledImageDim);
+    }
+  }
+  
+  return convertedImg;
+}
+
+UMat & SuperpixelImage::getConvertedUMat(Mat &inputImg, int conversion) {
+  discardConvertedImages(inputImg);
+  
+  UMat &convertedUMat = convertedUMats[conversion];
+  
+  if (convertedUMat.empty()) {
+    getConvertedImage(inputImg, conversion).copyTo(convertedUMat);
+  }
+  
+  return convertedUMat;
+}
+
+const Mat & SuperpixelImage::getPackedPixels(const Mat &inputImg) {
+  discardConvertedImages(inputImg);
+  
+  if (packedPixels.empty()) {
+    packPixels(inputImg, packedPixels);
+    
+    if (tiledImageDim != 0) {
+      tiledPackedPixels.create(packedPixels, tiledImageDim);
+    }
+  }
+  
+  return packedPixels;
+}
+
+void SuperpixelImage::gatherPackedPixels(const Mat &inputImg, const vector<Coord> &coords, uint32_t *pixels) {
+  const Mat &packedImg = getPackedPixels(inputImg);
+  
+  if (!tiledPackedPixels.empty()) {
+    tiledPackedPixels.gatherPixels(coords, pixels);
+  } else {
+    gatherPixels(packedImg, coords, pixels);
+  }
+}
+
+const TiledImage* SuperpixelImage::findTiledImage(const Mat &img) const {
+  if (tiledImages.empty() || img.data == NULL) {
+    return NULL;
+  }
+  
+  int conversion = -1;
+  
+  if (img.data == convertedImagesData) {
+    conversion = 0;
+  } else {
+    for ( auto &pair : convertedImages ) {
+      if (pair.second.data == img.data) {
+        conversion = pair.first;
+        break;
+      }
+    }
+  }
+  
+  auto it = tiledImages.find(conversion);
+  
+  if (it == tiledImages.end() || it->second.getCols() != img.cols || it->second.getRows() != img.rows || it->second.type() != img.type()) {
+    return NULL;
+  }
+  
+  return &it->second;
+}
+
+// Scharr gradient magnitude of each row of a Lab image, the rows of the
+// output only depend on the input so any number of rows can be done at once.
+
+class LabGradientsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  LabGradientsParallelBody(const Mat &_labImg, Mat &_gradients)
+  : labImg(_labImg), gradients(_gradients) {}
+  
+  void operator()(const cv::Range& range) const {
+    const int lastX = labImg.cols - 1;
+    const int lastY = labImg.rows - 1;
+    
+    for ( int y = range.start; y < range.end; y++ ) {
+      // Edge rows and columns are replicated
       
-      auto iter = tagToSuperpixelMap.find(tag);
+      const uint8_t *prevRow = labImg.ptr<uint8_t>(maxi(y - 1, 0));
+      const uint8_t *row = labImg.ptr<uint8_t>(y);
+      const uint8_t *nextRow = labImg.ptr<uint8_t>(mini(y + 1, lastY));
       
-      if (iter == tagToSuperpixelMap.end()) {
-        // A Superpixel has not been created for this UID since no key
-        // exists in the table. Create a superpixel and wrap into a
-        // unique smart pointer so that the table contains the only
-        // live object reference to the Superpixel object.
+      float *outPtr = gradients.ptr<float>(y);
+      
+      for ( int x = 0; x <= lastX; x++ ) {
+        const int xm = maxi(x - 1, 0) * 3;
+        const int xc = x * 3;
+        const int xp = mini(x + 1, lastX) * 3;
         
-        if (debug) {
-          cout << "create Superpixel for UID " << tag << endl;
-        }
+        int sumSquares = 0;
         
-        Superpixel *spPtr = new Superpixel(tag);
-        iter = tagToSuperpixelMap.insert(iter, make_pair(tag, spPtr));
-        superpixels.insert(tag);
-      } else {
-        if (debug) {
-          cout << "exists  Superpixel for UID " << tag << endl;
+        for ( int c = 0; c < 3; c++ ) {
+          int dx = 3 * (prevRow[xp + c] - prevRow[xm + c]) + 10 * (row[xp + c] - row[xm + c]) + 3 * (nextRow[xp + c] - nextRow[xm + c]);
+          int dy = 3 * (nextRow[xm + c] - prevRow[xm + c]) + 10 * (nextRow[xc + c] - prevRow[xc + c]) + 3 * (nextRow[xp + c] - prevRow[xp + c]);
+          sumSquares += (dx * dx) + (dy * dy);
         }
+        
+        outPtr[x] = sqrtf((float) sumSquares) * (1.0f / 16.0f);
       }
-
-      Superpixel *spPtr = iter->second;
-      assert(spPtr->tag == tag);
-      
-      spPtr->appendCoord(x, y);
     }
   }
+  
+private:
+  const Mat &labImg;
+  Mat &gradients;
+};
 
-  assert(superpixels.size() == tagToSuperpixelMap.size());
+const Mat & SuperpixelImage::getLabGradients(Mat &inputImg) {
+  // Converting drops the cached gradients when inputImg is a different image
   
-  // Print superpixel info
+  Mat &labImg = getConvertedImage(inputImg, CV_BGR2Lab);
   
-  if (debug) {
-    cout << "added " << (tags.rows * tags.cols) << " pixels as " << superpixels.size() << " superpixels" << endl;
-    
-    for (auto it = superpixels.begin(); it != superpixels.end(); ++it) {
-      int32_t tag = *it;
+  if (labGradients.empty()) {
+    labGradients.create(labImg.size(), CV_32FC1);
+    parallelFor(Range(0, labImg.rows), LabGradientsParallelBody(labImg, labGradients));
+  }
+  
+  return labGradients;
+}
+
+// Sum the gradients over the boundary pixels of each edge, the boundaries and
+// the gradients are only read so the edges can be summed at the same time.
+
+class EdgeGradientsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  EdgeGradientsParallelBody(const Mat &_gradients, const vector<const SuperpixelEdgeBoundary*> &_boundaries, vector<SuperpixelEdgeGradient> &_edgeGradients)
+  : gradients(_gradients), boundaries(_boundaries), edgeGradients(_edgeGradients) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int i = range.start; i < range.end; i++ ) {
+      const SuperpixelEdgeBoundary *boundaryPtr = boundaries[i];
       
-      assert(tagToSuperpixelMap.count(tag) > 0);
-      Superpixel *spPtr = tagToSuperpixelMap[tag];
+      double sum = 0.0;
       
-      cout << "superpixel UID = " << tag << " contains " << spPtr->coords.size() << " coords" << endl;
+      for ( const Coord &c : boundaryPtr->coordsA ) {
+        sum += gradients.at<float>(c.y, c.x);
+      }
       
-      for (auto coordsIt = spPtr->coords.begin(); coordsIt != spPtr->coords.end(); ++coordsIt) {
-        int32_t X = coordsIt->x;
-        int32_t Y = coordsIt->y;
-        cout << "X,Y" << " " << X << "," << Y << endl;
+      for ( const Coord &c : boundaryPtr->coordsB ) {
+        sum += gradients.at<float>(c.y, c.x);
       }
+      
+      edgeGradients[i].sum = sum;
+      edgeGradients[i].numPixels = (int32_t) (boundaryPtr->coordsA.size() + boundaryPtr->coordsB.size());
     }
   }
   
-  // Generate edges for each superpixel by looking at superpixel UID's around a given X,Y coordinate
-  // and determining the other superpixels that are connected to each superpixel.
+private:
+  const Mat &gradients;
+  const vector<const SuperpixelEdgeBoundary*> &boundaries;
+  vector<SuperpixelEdgeGradient> &edgeGradients;
+};
+
+bool SuperpixelImage::computeEdgeGradients(Mat &inputImg) {
+  auto &edgeBoundaryMap = edgeTable.edgeBoundaryMap;
+  auto &edgeGradientMap = edgeTable.edgeGradientMap;
   
-  bool worked = SuperpixelImage::parseSuperpixelEdges(tags, spImage);
+  edgeGradientMap.clear();
+  edgeGradientsData = NULL;
   
-  if (!worked) {
+  if (edgeBoundaryMap.empty()) {
+    cerr << "error : edge gradients require the edge boundaries recorded by parse" << endl;
     return false;
   }
   
-  // Deallocate original input tags image since it could be quite large
+  // Computed before the threads read it
   
-  //tags.release();
+  const Mat &gradients = getLabGradients(inputImg);
   
-  return true;
-}
-
-// Examine superpixels in an image and parse edges from the superpixel coords
-
-bool SuperpixelImage::parseSuperpixelEdges(Mat &tags, SuperpixelImage &spImage) {
-  const bool debug = false;
+  vector<SuperpixelEdge> edges;
+  vector<const SuperpixelEdgeBoundary*> boundaries;
+  edges.reserve(edgeBoundaryMap.size());
+  boundaries.reserve(edgeBoundaryMap.size());
   
-#if defined(DEBUG)
-  auto &superpixels = spImage.superpixels;
-#endif // DEBUG
+  for ( auto &pair : edgeBoundaryMap ) {
+    edges.push_back(pair.first);
+    boundaries.push_back(&pair.second);
+  }
   
-  SuperpixelEdgeTable &edgeTable = spImage.edgeTable;
+  vector<SuperpixelEdgeGradient> edgeGradients(edges.size());
   
-  // For each (X,Y) tag value find all the other tags defined in suppounding 8 pixels
-  // and dedup the list of neighbor tags for each superpixel.
-
-  int32_t neighborOffsetsArr[] = {
-    -1, -1, // UL
-     0, -1, // U
-     1, -1, // UR
-    -1,  0, // L
-     1,  0, // R
-    -1,  1, // DL
-     0,  1, // D
-     1,  1  // DR
-  };
+  parallelFor(Range(0, (int) edges.size()), EdgeGradientsParallelBody(gradients, boundaries, edgeGradients));
   
-  vector<pair<int32_t, int32_t> > neighborOffsets;
+  edgeGradientMap.reserve(edges.size());
   
-  for (int i = 0; i < sizeof(neighborOffsetsArr)/sizeof(int32_t); i += 2) {
-    pair<int32_t,int32_t> p(neighborOffsetsArr[i], neighborOffsetsArr[i+1]);
-    neighborOffsets.push_back(p);
+  for ( int i = 0; i < (int) edges.size(); i++ ) {
+    edgeGradientMap[edges[i]] = edgeGradients[i];
   }
   
-  assert(neighborOffsets.size() == 8);
+  edgeGradientsData = inputImg.data;
   
-  unordered_map<int32_t, set<int32_t> > &tagToNeighborMap = edgeTable.getNeighborsRef();
-
-  for( int y = 0; y < tags.rows; y++ ) {
-    for( int x = 0; x < tags.cols; x++ ) {
-      Vec3b tagVec = tags.at<Vec3b>(y, x);
-      
-      int32_t centerTag = Vec3BToUID(tagVec);
-      
-      if (debug) {
-      cout << "center (" << x << "," << y << ") with tag " << centerTag << endl;
-      }
-      
-      auto iter = tagToNeighborMap.find(centerTag);
-      
-      if (iter == tagToNeighborMap.end()) {
-        // A Superpixel has not been created for this UID since no key
-        // exists in the table.
-        
-        if (debug) {
-          cout << "create neighbor vector for UID " << centerTag << endl;
-        }
-        
-        set<int32_t> neighbors;
-        iter = tagToNeighborMap.insert(iter, make_pair(centerTag, neighbors));
-      } else {
-        if (debug) {
-          cout << "exits  neighbor vector for UID " << centerTag << endl;
-        }
-      }
-      
-      set<int32_t> &neighborUIDsSet = iter->second;
+  return true;
+}
 
-      // Loop over each neighbor around (X,Y) and lookup tag
-      
-      for (auto pairIter = neighborOffsets.begin() ; pairIter != neighborOffsets.end(); ++pairIter) {
-        int dX = pairIter->first;
-        int dY = pairIter->second;
-        
-        int foundNeighborUID;
-        
-        int nX = x + dX;
-        int nY = y + dY;
-        
-        if (nX < 0 || nX >= tags.cols) {
-          foundNeighborUID = -1;
-        } else if (nY < 0 || nY >= tags.rows) {
-          foundNeighborUID = -1;
-        } else {
-          Vec3b neighborTagVec = tags.at<Vec3b>(nY, nX);
-          foundNeighborUID = Vec3BToUID(neighborTagVec);
-        }
+bool SuperpixelImage::isOpenCLBackProjection() {
+  return useOpenCL && ocl::useOpenCL();
+}
 
-        if (foundNeighborUID == -1 || foundNeighborUID == centerTag) {
-          if (debug) {
-            cout << "ignoring (" << nX << "," << nY << ") with tag " << foundNeighborUID << " since invalid or identity" << endl;
-          }
-        } else {
-          if (debug) {
-            cout << "checking (" << nX << "," << nY << ") with tag " << foundNeighborUID << " to see if known neighbor" << endl;
-          }
-          
-          // if (!found) add_to_set()
-          
-          auto findIter = neighborUIDsSet.find(foundNeighborUID);
-          
-          if (findIter == neighborUIDsSet.end()) {
-            neighborUIDsSet.insert(findIter, foundNeighborUID);
-            
-            if (debug) {
-            cout << "added new neighbor tag " << foundNeighborUID << endl;
-            }
-          }
-        }
-      }
-      
-      if (debug) {
-        cout << "after searching all neighbors of (" << x << "," << y << ") the neighbors array (len " << neighborUIDsSet.size() << ") is:" << endl;
-        
-        for ( int32_t knownNeighborUID : neighborUIDsSet ) {
-          cout << knownNeighborUID << endl;
-        }
-      }
-      
-    }
+const SparseColorHistogram & SuperpixelImage::getHistogram(Mat &inputImg, int32_t tag) {
+  if (inputImg.data != histogramData) {
+    histogramCache.clear();
+    histogramData = inputImg.data;
   }
   
-#if defined(DEBUG)
+  Superpixel *spPtr = getSuperpixelPtr(tag);
+  assert(spPtr);
   
-  // Each superpixel now has a vector of values for each neighbor. Create unique list of edges by
-  // iterating over the superpixels and only creating an edge object when a pair (A, B) is
-  // found where A < B.
+  SuperpixelHistogram &entry = histogramCache[tag];
   
-  for (auto it = superpixels.begin(); it != superpixels.end(); ++it) {
-    int32_t tag = *it;
+  if (entry.hist.empty() || entry.numCoords != spPtr->coords.size()) {
+    Mat superpixelMat;
+    fillMatrixFromCoords(inputImg, tag, superpixelMat);
     
-    // Foreach superpixel, collect all the connected neighbors and generate edges
-    
-    assert(tagToNeighborMap.count(tag) > 0);
+    entry.hist.parse(superpixelMat, 16);
     
-    auto &neighborUIDsSet = tagToNeighborMap[tag];
+    entry.numCoords = spPtr->coords.size();
+  }
+  
+  return entry.hist;
+}
 
-    if (debug) {
-    cout << "superpixel UID = " << tag << " neighbors len = " << neighborUIDsSet.size() << endl;
+// Only the tags modified since the last snapshot are rebuilt, a block that an
+// older snapshot still holds is copied before a node in it is replaced.
+
+SuperpixelGraphSnapshot SuperpixelImage::takeSnapshot()
+{
+  vector<shared_ptr<SuperpixelSnapshotBlock> > &blocks = lastSnapshot.blocks;
+  
+  if (!hasSnapshot) {
+    blocks.clear();
+    snapshotDirtyTags.assign(superpixels.begin(), superpixels.end());
+    hasSnapshot = true;
+  } else {
+    sort(snapshotDirtyTags.begin(), snapshotDirtyTags.end());
+    snapshotDirtyTags.erase(unique(snapshotDirtyTags.begin(), snapshotDirtyTags.end()), snapshotDirtyTags.end());
+  }
+  
+  for ( int32_t tag : snapshotDirtyTags ) {
+    assert(tag >= 0);
+    
+    const size_t blocki = ((size_t) tag) >> SUPERPIXEL_SNAPSHOT_BLOCK_BITS;
+    
+    if (blocki >= blocks.size()) {
+      blocks.resize(blocki + 1);
     }
     
-    // Every superpixel must have at least 1 neighbor or the input is invalid, unless there
-    // is only 1 superpixel to begin with which could happen if all input was same pixel.
+    shared_ptr<SuperpixelSnapshotBlock> &blockPtr = blocks[blocki];
     
-    if (superpixels.size() > 1) {
-      assert(neighborUIDsSet.size() > 0);
+    if (!blockPtr) {
+      blockPtr = make_shared<SuperpixelSnapshotBlock>();
+    } else if (blockPtr.use_count() > 1) {
+      blockPtr = make_shared<SuperpixelSnapshotBlock>(*blockPtr);
     }
     
-    // edgeTable.setNeighbors(tag, neighborUIDsSet);
-  }
-  
-  if (debug) {
-    cout << "created " << edgeTable.getAllEdges().size() << " edges in edge table" << endl;
+    shared_ptr<const SuperpixelSnapshotNode> &slot = blockPtr->nodes[tag & (SUPERPIXEL_SNAPSHOT_BLOCK_SIZE - 1)];
+    
+    Superpixel *spPtr = getSuperpixelPtr(tag);
+    
+    if (spPtr == NULL) {
+      slot.reset();
+    } else {
+      shared_ptr<SuperpixelSnapshotNode> nodePtr = make_shared<SuperpixelSnapshotNode>();
+      nodePtr->tag = tag;
+      nodePtr->numCoords = (int32_t) spPtr->coords.size();
+      SuperpixelTagRange neighborsOfTag = edgeTable.getNeighborsRange(tag);
+      nodePtr->neighbors.assign(neighborsOfTag.begin(), neighborsOfTag.end());
+      slot = nodePtr;
+    }
   }
   
-#endif // DEBUG
-
-  // Final verification
+  snapshotDirtyTags.clear();
   
-#if defined(DEBUG)
-  if (superpixels.size() > 1) {
-    for ( int32_t tag : superpixels ) {
-      set<int32_t> &neighborsOfNeighborSet = spImage.edgeTable.getNeighborsSet(tag);
-      assert(neighborsOfNeighborSet.size() > 0);
-    }
-  }
-#endif // DEBUG
+  lastSnapshot.version = numMerges;
+  lastSnapshot.numSuperpixels = superpixels.size();
   
-  return true;
+  return lastSnapshot;
+}
+
+void SuperpixelImage::invalidateSnapshot()
+{
+  hasSnapshot = false;
+  snapshotDirtyTags.clear();
+  lastSnapshot = SuperpixelGraphSnapshot();
 }
 
-void SuperpixelImage::mergeEdge(SuperpixelEdge &edgeToMerge) {
+void SuperpixelImage::mergeEdge(SuperpixelEdge &edgeToMerge, float mergeCost) {
   const bool debug = false;
   
   if (debug) {
@@ -362,6 +1676,10 @@ void SuperpixelImage::mergeEdge(SuperpixelEdge &edgeToMerge) {
   mergeOrder.push_back(edgeToMerge);
 #endif
   
+  if (mergeLog != NULL) {
+    mergeLog->appendMerge(edgeToMerge);
+  }
+  
   // Get Superpixel object pointers (not copies of the objects)
   
   Superpixel *spAPtr = getSuperpixelPtr(edgeToMerge.A);
@@ -406,8 +1724,65 @@ void SuperpixelImage::mergeEdge(SuperpixelEdge &edgeToMerge) {
     cout << "will merge " << srcPtr->coords.size() << " coords from smaller into larger superpixel" << endl;
   }
 
-  append_to_vector(dstPtr->coords, srcPtr->coords);
-  srcPtr->coords.resize(0);
+  numMerges += 1;
+  
+  if (mergeTree != NULL) {
+    mergeTree->addMerge(srcPtr->tag, dstPtr->tag, mergeCost);
+  }
+  
+  if (hasSnapshot) {
+    // The neighbors of src will refer to dst after the merge
+    
+    snapshotDirtyTags.push_back(srcPtr->tag);
+    snapshotDirtyTags.push_back(dstPtr->tag);
+    
+    SuperpixelTagRange neighborsOfSrc = edgeTable.getNeighborsRange(srcPtr->tag);
+    snapshotDirtyTags.insert(snapshotDirtyTags.end(), neighborsOfSrc.begin(), neighborsOfSrc.end());
+  }
+  
+  dstPtr->mergeStats(srcPtr);
+  
+  if (!histogramCache.empty()) {
+    // Histograms are additive so the histogram of src is added to dst
+    
+    auto srcIt = histogramCache.find(srcPtr->tag);
+    auto dstIt = histogramCache.find(dstPtr->tag);
+    
+    if (dstIt != histogramCache.end()) {
+      SuperpixelHistogram &dstEntry = dstIt->second;
+      
+      if (srcIt != histogramCache.end() &&
+          srcIt->second.numCoords == srcPtr->coords.size() &&
+          dstEntry.numCoords == dstPtr->coords.size()) {
+        dstEntry.hist.add(srcIt->second.hist);
+        dstEntry.numCoords += srcIt->second.numCoords;
+      } else {
+        histogramCache.erase(dstIt);
+      }
+    }
+    
+    if (srcIt != histogramCache.end()) {
+      histogramCache.erase(srcIt);
+    }
+  }
+  
+  edgeTable.mergeEdgeBoundaries(srcPtr->tag, dstPtr->tag);
+  
+  if (!sizeOrder.empty()) {
+    // Replace the keys of src and dst with one key for the merged dst, a key
+    // that is not found means the order is out of date and will be rebuilt.
+    
+    int numErasedKeys = (int) sizeOrder.erase(make_pair(-((int32_t) numCoordsA), spAPtr->tag));
+    numErasedKeys += (int) sizeOrder.erase(make_pair(-((int32_t) numCoordsB), spBPtr->tag));
+    
+    if (numErasedKeys == 2) {
+      sizeOrder.insert(make_pair(-((int32_t) (numCoordsA + numCoordsB)), dstPtr->tag));
+    } else {
+      sizeOrder.clear();
+    }
+  }
+  
+  dstPtr->coords.splice(srcPtr->coords);
   
   // This logic assumes that the superpixels list is in increasing int order since the
   // parse logic explicitly sorts the generated tags. As superpixels are merged the
@@ -432,179 +1807,182 @@ void SuperpixelImage::mergeEdge(SuperpixelEdge &edgeToMerge) {
   int numErased = (int) superpixels.erase(tag);
   assert (numErased == 1);
 
-  bool hasEdgeStrengthMap;
-  int numRemoved;
+  if (edgeTable.lazyMerge) {
+    // Lazy merge of neighbors, the neighbors of src are rewritten on access
+    
+    // The weights of every edge of src, including the edge to dst, are erased
+    // since src no longer exists after the merge.
+    
+    edgeTable.edgeStrengthMap.eraseEdges(srcPtr->tag, edgeTable.getNeighborsSet(srcPtr->tag));
+    
+    edgeTable.mergeNeighborsLazy(srcPtr->tag, dstPtr->tag);
+  } else {
+    bool hasEdgeStrengthMap;
+    int numRemoved;
   
-  // Remove edge between src and dst by removing src from dst neighbors set
+    // Remove edge between src and dst by removing src from dst neighbors set
 
-  hasEdgeStrengthMap = (edgeTable.edgeStrengthMap.size() > 0);
+    hasEdgeStrengthMap = (edgeTable.edgeStrengthMap.size() > 0);
   
-  if (hasEdgeStrengthMap) {
-    // Clear edge strength cache of dst->src edge
-    SuperpixelEdge cachedKey(dstPtr->tag, srcPtr->tag);
-    edgeTable.edgeStrengthMap.erase(cachedKey);
-  }
+    if (hasEdgeStrengthMap) {
+      // Clear edge strength cache of every src edge, including the src->dst
+      // edge, while the neighbors of src are still known.
+      edgeTable.edgeStrengthMap.eraseEdges(srcPtr->tag, edgeTable.getNeighborsSet(srcPtr->tag));
+    }
   
-  set<int32_t> &neighborsOfDst = edgeTable.getNeighborsSet(dstPtr->tag);
+    SuperpixelNeighbors &neighborsOfDst = edgeTable.getNeighborsSet(dstPtr->tag);
   
-  if (debug) {
-    cout << "initial dst neighbor set :" << endl;
-    for ( int32_t neighborTag : neighborsOfDst ) {
-      cout << neighborTag << endl;
+    if (debug) {
+      cout << "initial dst neighbor set :" << endl;
+      for ( int32_t neighborTag : neighborsOfDst ) {
+        cout << neighborTag << endl;
+      }
     }
-  }
   
 #if defined(DEBUG)
-  {
-  // Verify that src is a neighbor of dst
-  assert(srcPtr->tag > 0);
+    {
+    // Verify that src is a neighbor of dst
+    assert(srcPtr->tag > 0);
   
-  bool found = false;
-  for ( int32_t neighborOfDstTag : neighborsOfDst ) {
-    if (neighborOfDstTag == srcPtr->tag) {
-      found = true;
+    bool found = false;
+    for ( int32_t neighborOfDstTag : neighborsOfDst ) {
+      if (neighborOfDstTag == srcPtr->tag) {
+        found = true;
+      }
+    }
+    assert(found);
     }
-  }
-  assert(found);
-  }
 #endif // DEBUG
   
-  // Remove src tag from neighbors of dst set
+    // Remove src tag from neighbors of dst set
   
-  numRemoved = (int) neighborsOfDst.erase(srcPtr->tag);
-  assert(numRemoved == 1);
+    numRemoved = (int) neighborsOfDst.erase(srcPtr->tag);
+    assert(numRemoved == 1);
   
 #if defined(DEBUG)
-  if (superpixels.size() > 1) {
-    assert(neighborsOfDst.size() > 0);
-  }
+    if (superpixels.size() > 1) {
+      assert(neighborsOfDst.size() > 0);
+    }
 #endif // DEBUG
   
-  if (debug) {
-    cout << "final dst neighbor set :" << endl;
-    for ( int32_t neighborTag : neighborsOfDst ) {
-      cout << neighborTag << endl;
+    if (debug) {
+      cout << "final dst neighbor set :" << endl;
+      for ( int32_t neighborTag : neighborsOfDst ) {
+        cout << neighborTag << endl;
+      }
     }
-  }
   
-  // Update neighbors of src by adding dst as a neighbor.
-  // In the case where dst is already a neighbor,
-  // the duplicate entry in the set is ignored.
-  
-  if (hasEdgeStrengthMap) {
-    // Clear edge strength cache of src->dst edge
-    SuperpixelEdge cachedKey(srcPtr->tag, dstPtr->tag);
-    edgeTable.edgeStrengthMap.erase(cachedKey);
-  }
+    // Update neighbors of src by adding dst as a neighbor.
+    // In the case where dst is already a neighbor,
+    // the duplicate entry in the set is ignored.
   
-  set<int32_t> &neighborsOfSrc = edgeTable.getNeighborsSet(srcPtr->tag);
+    SuperpixelNeighbors &neighborsOfSrc = edgeTable.getNeighborsSet(srcPtr->tag);
   
-  if (debug) {
-    cout << "all neighbors of src = " << srcPtr->tag << endl;
-    for ( int32_t neighborTag : neighborsOfSrc ) {
-      cout << neighborTag << endl;
+    if (debug) {
+      cout << "all neighbors of src = " << srcPtr->tag << endl;
+      for ( int32_t neighborTag : neighborsOfSrc ) {
+        cout << neighborTag << endl;
+      }
     }
-  }
   
 #if defined(DEBUG)
-  {
-  // Verify that dst is a neighbor of src
-  assert(dstPtr->tag > 0);
+    {
+    // Verify that dst is a neighbor of src
+    assert(dstPtr->tag > 0);
   
-  bool found = false;
-  for ( int32_t neighborOfSrcTag : neighborsOfSrc ) {
-    if (neighborOfSrcTag == dstPtr->tag) {
-      found = true;
+    bool found = false;
+    for ( int32_t neighborOfSrcTag : neighborsOfSrc ) {
+      if (neighborOfSrcTag == dstPtr->tag) {
+        found = true;
+      }
+    }
+    assert(found);
     }
-  }
-  assert(found);
-  }
 #endif // DEBUG
   
-  for ( int32_t neighborOfSrcTag : neighborsOfSrc ) {
-    if (debug) {
-      cout << "iter neighbor of src = " << neighborOfSrcTag << endl;
-    }
-   
-    if (neighborOfSrcTag == dstPtr->tag) {
-      // Ignore dst so that src is deleted as a neighbor
-      
+    for ( int32_t neighborOfSrcTag : neighborsOfSrc ) {
       if (debug) {
-        cout << "ignore neighbor of src since it is the dst node" << endl;
+        cout << "iter neighbor of src = " << neighborOfSrcTag << endl;
       }
-    } else {
-      set<int32_t> &neighbors = edgeTable.getNeighborsSet(neighborOfSrcTag);
+   
+      if (neighborOfSrcTag == dstPtr->tag) {
+        // Ignore dst so that src is deleted as a neighbor
       
-      if (debug) {
-        cout << "update neighbor of src " << neighborOfSrcTag << endl;
-        cout << "initial neighbor of src neighbor set :" << endl;
-        for ( int32_t neighborTag : neighbors ) {
-          cout << neighborTag << endl;
+        if (debug) {
+          cout << "ignore neighbor of src since it is the dst node" << endl;
+        }
+      } else {
+        SuperpixelNeighbors &neighbors = edgeTable.getNeighborsSet(neighborOfSrcTag);
+      
+        if (debug) {
+          cout << "update neighbor of src " << neighborOfSrcTag << endl;
+          cout << "initial neighbor of src neighbor set :" << endl;
+          for ( int32_t neighborTag : neighbors ) {
+            cout << neighborTag << endl;
+          }
         }
-      }
       
-      // Add edge between neighbor and dst (if it does not exist)
+        // Add edge between neighbor and dst (if it does not exist)
       
-      neighbors.insert(dstPtr->tag);
+        neighbors.insert(dstPtr->tag);
       
-      // Remove edge between neighbor and src
+        // Remove edge between neighbor and src
       
-      numRemoved = (int) neighbors.erase(srcPtr->tag);
-      assert(numRemoved == 1);
+        numRemoved = (int) neighbors.erase(srcPtr->tag);
+        assert(numRemoved == 1);
       
 #if defined(DEBUG)
-      assert(neighbors.size() > 0);
+        assert(neighbors.size() > 0);
 #endif // DEBUG
       
-      if (debug) {
-        cout << "final neighbor of src neighbor set :" << endl;
-        for ( int32_t neighborTag : neighbors ) {
-          cout << neighborTag << endl;
+        if (debug) {
+          cout << "final neighbor of src neighbor set :" << endl;
+          for ( int32_t neighborTag : neighbors ) {
+            cout << neighborTag << endl;
+          }
         }
-      }
       
-      // If this neighbor is not currently a neighbor of dst then
-      // add it now with an add that is a nop for duplicate entries
+        // If this neighbor is not currently a neighbor of dst then
+        // add it now with an add that is a nop for duplicate entries
       
-      neighborsOfDst.insert(neighborOfSrcTag);
+        neighborsOfDst.insert(neighborOfSrcTag);
       
-      if (debug) {
-        cout << "final neighbors dst set :" << endl;
-        for ( int32_t neighborTag : neighborsOfDst ) {
-          cout << neighborTag << endl;
+        if (debug) {
+          cout << "final neighbors dst set :" << endl;
+          for ( int32_t neighborTag : neighborsOfDst ) {
+            cout << neighborTag << endl;
+          }
         }
       }
     }
-  }
   
-  if (debug) {
-    cout << "final edge results for merged UID " << dstPtr->tag << endl;
+    if (debug) {
+      cout << "final edge results for merged UID " << dstPtr->tag << endl;
     
-    set<int32_t> &neighbors = edgeTable.getNeighborsSet(dstPtr->tag);
+      SuperpixelNeighbors &neighbors = edgeTable.getNeighborsSet(dstPtr->tag);
     
-    cout << "final dst neighbor set :" << endl;
-    for ( int32_t neighborTag : neighbors ) {
-      cout << neighborTag << endl;
+      cout << "final dst neighbor set :" << endl;
+      for ( int32_t neighborTag : neighbors ) {
+        cout << neighborTag << endl;
+      }
     }
-  }
     
-  edgeTable.removeNeighbors(srcPtr->tag);
+    edgeTable.removeNeighbors(srcPtr->tag);
+  }
   
   // Move edge weights from src to dst
   
-  if (srcPtr->mergedEdgeWeights.size() > 0) {
-    append_to_vector(dstPtr->mergedEdgeWeights, srcPtr->mergedEdgeWeights);
-  }
-
-  if (srcPtr->unmergedEdgeWeights.size() > 0) {
-    append_to_vector(dstPtr->unmergedEdgeWeights, srcPtr->unmergedEdgeWeights);
-  }
+  dstPtr->mergedEdgeWeights.append(srcPtr->mergedEdgeWeights);
+  dstPtr->unmergedEdgeWeights.append(srcPtr->unmergedEdgeWeights);
   
-  // Finally remove the Superpixel object from the lookup table and free the memory
+  // Finally remove the Superpixel object from the lookup table, the object
+  // stays in the arena until the next reset()
   
   int32_t tagToRemove = srcPtr->tag;
   tagToSuperpixelMap.erase(tagToRemove);
-  delete srcPtr;
+  if ((size_t) tagToRemove < tagToSuperpixelTable.size()) {
+    tagToSuperpixelTable[tagToRemove] = NULL;
+  }
   
 #if defined(DEBUG)
   // When compiled in DEBUG mode in Xcode enable additional runtime checks that
@@ -645,7 +2023,7 @@ void SuperpixelImage::mergeEdge(SuperpixelEdge &edgeToMerge) {
     
     // Check that src is not a neighbor of any superpixel
     
-    set<int32_t> &neighbors = edgeTable.getNeighborsSet(tag);
+    SuperpixelNeighbors &neighbors = edgeTable.getNeighborsSet(tag);
     
     for ( int32_t neighborTag : neighbors ) {
       if (neighborTag == tagToRemove) {
@@ -660,8 +2038,28 @@ void SuperpixelImage::mergeEdge(SuperpixelEdge &edgeToMerge) {
 
 // Lookup Superpixel* given a UID, checks to make sure key is defined in table in DEBUG mode
 
+// The containers are replaced by empty ones, the arena is kept so that the
+// next parse reuses the Superpixel objects.
+
+void SuperpixelImage::reset()
+{
+  SuperpixelArena arena(std::move(superpixelArena));
+  arena.reset();
+  
+  *this = SuperpixelImage();
+  
+  superpixelArena = std::move(arena);
+}
+
 Superpixel* SuperpixelImage::getSuperpixelPtr(int32_t uid)
 {
+  // Each superpixel with a tag in the range of the direct table is in the
+  // table, the entry is NULL once the superpixel has been merged away.
+  
+  if ((uint32_t) uid < tagToSuperpixelTable.size()) {
+    return tagToSuperpixelTable[uid];
+  }
+  
   TagToSuperpixelMap::iterator iter = tagToSuperpixelMap.find(uid);
   
   if (iter == tagToSuperpixelMap.end()) {
@@ -678,6 +2076,81 @@ Superpixel* SuperpixelImage::getSuperpixelPtr(int32_t uid)
   }
 }
 
+// Parallel loop body that reduces the pixels of each superpixel to the min and max
+// packed pixel value. Each superpixel writes only to its own slot and the coords and
+// the packed image are only read, so the superpixels can be scanned at the same time.
+
+class ScanAllSamePixelsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  ScanAllSamePixelsParallelBody(SuperpixelImage &_spImage, const Mat &_packedImg, const vector<int32_t> &_tags, vector<uint32_t> &_minPixels, vector<uint32_t> &_maxPixels)
+  : spImage(_spImage), packedImg(_packedImg), tags(_tags), minPixels(_minPixels), maxPixels(_maxPixels) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int i = range.start; i < range.end; i++ ) {
+      Superpixel *spPtr = spImage.getSuperpixelPtr(tags[i]);
+      
+      uint32_t minPixel = 0xFFFFFFFF;
+      uint32_t maxPixel = 0;
+      
+      const Mat &input = packedImg;
+      
+      spPtr->coords.forEachRun([&input, &minPixel, &maxPixel](const CoordRun &run) {
+        const uint32_t *rowPtr = input.ptr<uint32_t>(run.y) + run.x;
+        
+        for ( int j = 0; j < run.length; j++ ) {
+          uint32_t pixel = rowPtr[j];
+          minPixel = std::min(minPixel, pixel);
+          maxPixel = std::max(maxPixel, pixel);
+        }
+      });
+      
+      minPixels[i] = minPixel;
+      maxPixels[i] = maxPixel;
+    }
+  }
+  
+private:
+  SuperpixelImage &spImage;
+  const Mat &packedImg;
+  const vector<int32_t> &tags;
+  vector<uint32_t> &minPixels;
+  vector<uint32_t> &maxPixels;
+};
+
+// Read every pixel of every superpixel once and set the all same or not all same flag
+// for each superpixel. The pixels are all the same exactly when the min and the max
+// packed pixel are equal, so there is no early exit and no branch per pixel. The tag
+// and the packed pixel of each all same superpixel is returned in allSamePixels.
+
+void SuperpixelImage::scanAllSamePixels(Mat &inputImg, unordered_map<int32_t, uint32_t> &allSamePixels) {
+  assert(inputImg.type() == CV_8UC3);
+  
+  allSamePixels.clear();
+  
+  vector<int32_t> tags(superpixels.begin(), superpixels.end());
+  
+  vector<uint32_t> minPixels(tags.size());
+  vector<uint32_t> maxPixels(tags.size());
+  
+  // Packed before the threads read it
+  
+  const Mat &packedImg = getPackedPixels(inputImg);
+  
+  parallelFor(Range(0, (int) tags.size()), ScanAllSamePixelsParallelBody(*this, packedImg, tags, minPixels, maxPixels));
+  
+  for ( int i = 0; i < (int) tags.size(); i++ ) {
+    Superpixel *spPtr = getSuperpixelPtr(tags[i]);
+    
+    if (minPixels[i] == maxPixels[i]) {
+      spPtr->setAllSame();
+      allSamePixels[tags[i]] = minPixels[i];
+    } else {
+      spPtr->setNotAllSame();
+    }
+  }
+}
+
 // Scan superpixels looking for the case where all pixels in one superpixel exactly match all
 // the superpixels in a neighbor superpixel. This exact matching situation can happen in flat
 // image areas so removing the duplication can significantly simplify the graph before the
@@ -693,21 +2166,19 @@ void SuperpixelImage::mergeIdenticalSuperpixels(Mat &inputImg) {
   // create a new list that will not be mutated in the case of a superpixel
   // merge.
   
+  // A merge of two identical superpixels is also identical with the same pixel, so
+  // once the pixels have been scanned the merges below only need the graph.
+  
+  unordered_map<int32_t, uint32_t> allSamePixels;
+  
+  scanAllSamePixels(inputImg, allSamePixels);
+  
   vector<int32_t> identicalSuperpixels;
-  identicalSuperpixels.reserve(4096);
+  identicalSuperpixels.reserve(allSamePixels.size());
   
-  for (auto it = superpixels.begin(); it != superpixels.end(); ++it) {
-    int32_t tag = *it;
-    
-    bool isAllSame = isAllSamePixels(inputImg, tag);
-    
-    Superpixel *spPtr = getSuperpixelPtr(tag);
-    
-    if (isAllSame) {
-      spPtr->setAllSame();
+  for ( int32_t tag : superpixels ) {
+    if (allSamePixels.count(tag) != 0) {
       identicalSuperpixels.push_back(tag);
-    } else {
-      spPtr->setNotAllSame();
     }
   }
   
@@ -751,12 +2222,16 @@ void SuperpixelImage::mergeIdenticalSuperpixels(Mat &inputImg) {
     
     bool mergedNeighbor = false;
     
+    uint32_t knownPixel = allSamePixels[tag];
+    
     for ( auto neighborIter = neighborsSet.begin(); neighborIter != neighborsSet.end(); ) {
       int32_t neighborTag = *neighborIter;
       // Advance the iterator to the next neighbor before a possible merge
       ++neighborIter;
-
-      bool isAllSame = isAllSamePixels(inputImg, spPtr, neighborTag);
+      
+      auto allSameIter = allSamePixels.find(neighborTag);
+      
+      bool isAllSame = (allSameIter != allSamePixels.end() && allSameIter->second == knownPixel);
       
       if (debug) {
         cout << "neighbor " << neighborTag << " isAllSamePixels() -> " << isAllSame << endl;
@@ -850,7 +2325,7 @@ SuperpixelImage::checkPredicate(Mat &input, Superpixel *spPtr, int32_t otherTag)
 // with a neighbor based on a merge predicate.
 
 void SuperpixelImage::mergeSuperpixelsWithPredicate(Mat &inputImg) {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
   // Do initial scan of all the superpixels looking for superpixels that
   // are known to be identical so that an optimal branch in the predicate
@@ -966,43 +2441,62 @@ void SuperpixelImage::mergeSuperpixelsWithPredicate(Mat &inputImg) {
 }
 
 // Sort superpixels by size and sort ties so that smaller pixel tag values appear
-// before larger tag values.
+// before larger tag values. The sizeOrder keys are checked against the coords
+// as the tags are read, so the full sort is only done when the order is first
+// used or was changed by something other than mergeEdge().
 
 vector<int32_t>
 SuperpixelImage::sortSuperpixelsBySize()
 {
   const bool debug = false;
   
-  vector<SuperpixelSortStruct> sortedSuperpixels;
-  sortedSuperpixels.reserve(superpixels.size());
-  
-  for (auto it = superpixels.begin(); it != superpixels.end(); ++it) {
-    int32_t tag = *it;
-    SuperpixelSortStruct ss;
-    ss.spPtr = getSuperpixelPtr(tag);
-    sortedSuperpixels.push_back(ss);
-  }
-  
-  sort(sortedSuperpixels.begin(), sortedSuperpixels.end(), CompareSuperpixelSizeDecreasingFunc);
-  
-  assert(sortedSuperpixels.size() == superpixels.size());
-  
-  int i = 0;
-  
   vector<int32_t> retVec;
   retVec.reserve(superpixels.size());
   
-  for (auto it = sortedSuperpixels.begin(); it != sortedSuperpixels.end(); ++it, i++) {
-    SuperpixelSortStruct ss = *it;
-    int32_t tag = ss.spPtr->tag;
-
-    retVec.push_back(tag);
-    
+  bool isValid = (sizeOrder.size() == superpixels.size());
+  
+  if (isValid) {
+    for ( const pair<int32_t, int32_t> &key : sizeOrder ) {
+      int32_t tag = key.second;
+      Superpixel *spPtr = getSuperpixelPtr(tag);
+      
+      if (spPtr == NULL || -key.first != (int32_t) spPtr->coords.size()) {
+        isValid = false;
+        break;
+      }
+      
+      retVec.push_back(tag);
+    }
+  }
+  
+  if (!isValid) {
     if (debug) {
-      cout << "sorted superpixel at offset " << i << " now has tag " << tag << " with N = " << ss.spPtr->coords.size() << endl;
+      cout << "rebuild size order for " << superpixels.size() << " superpixels" << endl;
+    }
+    
+    vector<pair<int32_t, int32_t> > keys;
+    keys.reserve(superpixels.size());
+    
+    for ( int32_t tag : superpixels ) {
+      Superpixel *spPtr = getSuperpixelPtr(tag);
+      assert(spPtr);
+      keys.push_back(make_pair(-((int32_t) spPtr->coords.size()), tag));
+    }
+    
+    sort(keys.begin(), keys.end());
+    
+    sizeOrder.clear();
+    sizeOrder.insert(keys.begin(), keys.end());
+    
+    retVec.clear();
+    
+    for ( const pair<int32_t, int32_t> &key : keys ) {
+      retVec.push_back(key.second);
     }
   }
   
+  assert(retVec.size() == superpixels.size());
+  
 #if defined(DEBUG)
   // Loop over sorted pixels and verify that sizes decrease as list is iterated
   int prevSize = 0;
@@ -1023,6 +2517,14 @@ SuperpixelImage::sortSuperpixelsBySize()
   return retVec;
 }
 
+vector<int32_t>
+SuperpixelImage::sortSuperpixelsBySizeIncreasing()
+{
+  vector<int32_t> retVec = sortSuperpixelsBySize();
+  reverse(retVec.begin(), retVec.end());
+  return retVec;
+}
+
 // This util method scans the current list of superpixels and returns the largest superpixels
 // using a stddev measure. These largest superpixels are highly unlikely to be useful when
 // scanning for edges on smaller elements, for example. This method should be run after
@@ -1042,19 +2544,11 @@ SuperpixelImage::scanLargestSuperpixels(vector<int32_t> &results, int minSuperpi
   vector<float> superpixelsSizes;
   vector<uint32_t> superpixelsForSizes;
   
-  vector<int32_t> inputVec;
-  
-  if (results.size() == 0) {
-    inputVec = getSuperpixelsVec();
-  } else {
-    inputVec = results;
-    results.clear();
-  }
-  
   // First, scan for very small superpixels and treat them as edges automatically so that
-  // edge pixels scanning need not consider these small pixels.
+  // edge pixels scanning need not consider these small pixels. The sizes are gathered
+  // in tag order so that the stats are summed in the same order on each call.
   
-  for ( int32_t tag : inputVec ) {
+  auto gatherSize = [&](int32_t tag) {
     Superpixel *spPtr = getSuperpixelPtr(tag);
     assert(spPtr);
     
@@ -1066,6 +2560,23 @@ SuperpixelImage::scanLargestSuperpixels(vector<int32_t> &results, int minSuperpi
       superpixelsSizes.push_back((float)numCoords);
       superpixelsForSizes.push_back(tag);
     }
+  };
+  
+  if (results.size() == 0) {
+    // Read the tags from the superpixels set instead of a copy of all the tags
+    
+    superpixelsSizes.reserve(superpixels.size());
+    superpixelsForSizes.reserve(superpixels.size());
+    
+    for ( int32_t tag : superpixels ) {
+      gatherSize(tag);
+    }
+  } else {
+    for ( int32_t tag : results ) {
+      gatherSize(tag);
+    }
+    
+    results.clear();
   }
   
   if (debug) {
@@ -1216,12 +2727,16 @@ void SuperpixelImage::rescanLargestSuperpixels(Mat &inputImg, Mat &outputImg, ve
       reverseFillMatrixFromCoords(srcSuperpixelMat, false, tag, revMat);
       
       cout << "write " << filename << " ( " << revMat.cols << " x " << revMat.rows << " )" << endl;
-      imwrite(filename, revMat);
+      debugImwrite(filename, revMat);
     }
 
     // Generate back projection for entire image
     
-    parse3DHistogram(NULL, &srcSuperpixelHist, &inputImg, &srcSuperpixelBackProjection, 0, -1);
+    if (isOpenCLBackProjection()) {
+      parse3DBackProjection(getConvertedUMat(inputImg, 0), srcSuperpixelHist, srcSuperpixelBackProjection);
+    } else {
+      parse3DHistogram(NULL, &srcSuperpixelHist, &inputImg, &srcSuperpixelBackProjection, 0, -1);
+    }
     
     // srcSuperpixelBackProjection is a grayscale 1 channel image
 
@@ -1233,7 +2748,7 @@ void SuperpixelImage::rescanLargestSuperpixels(Mat &inputImg, Mat &outputImg, ve
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << srcSuperpixelBackProjection.cols << " x " << srcSuperpixelBackProjection.rows << " )" << endl;
-      imwrite(filename, srcSuperpixelBackProjection);
+      debugImwrite(filename, srcSuperpixelBackProjection);
     }
     
     // A back projection is more efficient if we actually know a range to indicate how near to the edge the detected edge line is.
@@ -1258,7 +2773,7 @@ void SuperpixelImage::rescanLargestSuperpixels(Mat &inputImg, Mat &outputImg, ve
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << erodeBWMat.cols << " x " << erodeBWMat.rows << " )" << endl;
-      imwrite(filename, erodeBWMat);
+      debugImwrite(filename, erodeBWMat);
     }
     
     // Erode to pull superpixel edges back by a few pixels
@@ -1297,7 +2812,7 @@ void SuperpixelImage::rescanLargestSuperpixels(Mat &inputImg, Mat &outputImg, ve
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << minBWMat.cols << " x " << minBWMat.rows << " )" << endl;
-      imwrite(filename, minBWMat);
+      debugImwrite(filename, minBWMat);
     }
     
     // Apply a dilate to expand the white area
@@ -1312,7 +2827,7 @@ void SuperpixelImage::rescanLargestSuperpixels(Mat &inputImg, Mat &outputImg, ve
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << maxBWMat.cols << " x " << maxBWMat.rows << " )" << endl;
-      imwrite(filename, maxBWMat);
+      debugImwrite(filename, maxBWMat);
     }
     
     // Calculate gradient x 2 which is erode and dialate and then intersection.
@@ -1331,7 +2846,7 @@ void SuperpixelImage::rescanLargestSuperpixels(Mat &inputImg, Mat &outputImg, ve
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << gradMat.cols << " x " << gradMat.rows << " )" << endl;
-      imwrite(filename, gradMat);
+      debugImwrite(filename, gradMat);
     }
     
     // The white pixels indicate where histogram backprojection should be examined, a mask on whole image.
@@ -1397,7 +2912,7 @@ void SuperpixelImage::rescanLargestSuperpixels(Mat &inputImg, Mat &outputImg, ve
       const char *filename = str.c_str();
       
       cout << "write " << filename << " ( " << maskedGradientMat.cols << " x " << maskedGradientMat.rows << " )" << endl;
-      imwrite(filename, maskedGradientMat);
+      debugImwrite(filename, maskedGradientMat);
     }
     
     // The generated back projection takes the existing edge around the foreground object into
@@ -1425,7 +2940,24 @@ vector<SuperpixelEdge> SuperpixelImage::getEdges()
 
 void SuperpixelImage::fillMatrixFromCoords(Mat &input, int32_t tag, Mat &output) {
   Superpixel *spPtr = getSuperpixelPtr(tag);
-  spPtr->fillMatrixFromCoords(input, tag, output);
+  
+  const TiledImage *tiledPtr = findTiledImage(input);
+  
+  if (tiledPtr != NULL) {
+    tiledPtr->gather(spPtr->coords, output);
+  } else {
+    spPtr->fillMatrixFromCoords(input, tag, output);
+  }
+}
+
+void SuperpixelImage::fillMatrixFromCoords(Mat &input, vector<Coord> &coords, Mat &output) {
+  const TiledImage *tiledPtr = findTiledImage(input);
+  
+  if (tiledPtr != NULL) {
+    tiledPtr->gather(coords, output);
+  } else {
+    Superpixel::fillMatrixFromCoords(input, coords, output);
+  }
 }
 
 // This method is the inverse of fillMatrixFromCoords(), it reads pixel values from a matrix
@@ -1441,27 +2973,78 @@ void SuperpixelImage::reverseFillMatrixFromCoords(Mat &input, bool isGray, int32
   spPtr->reverseFillMatrixFromCoords(input, isGray, tag, output);
 }
 
+// Parallel loop body that fills the coord runs of each superpixel with the value
+// for that superpixel. The superpixels do not share any pixels, so each superpixel
+// writes to its own rows of the output without a lock.
+
+template <typename T>
+class FillSuperpixelRunsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  FillSuperpixelRunsParallelBody(const vector<Superpixel*> &_superpixelPtrs, const vector<T> &_values, Mat &_outputImg)
+  : superpixelPtrs(_superpixelPtrs), values(_values), outputImg(_outputImg) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int i = range.start; i < range.end; i++ ) {
+      const T value = values[i];
+      Mat &output = outputImg;
+      
+      superpixelPtrs[i]->coords.forEachRun([&output, &value](const CoordRun &run) {
+        T *rowPtr = output.ptr<T>(run.y) + run.x;
+        std::fill(rowPtr, rowPtr + run.length, value);
+      });
+    }
+  }
+  
+private:
+  const vector<Superpixel*> &superpixelPtrs;
+  const vector<T> &values;
+  Mat &outputImg;
+};
+
+// Write the value for each superpixel to all of its coords. The values are looked
+// up once per superpixel by the caller and the coords are written as runs.
+
+template <typename T>
+static
+void fillSuperpixelRuns(const vector<Superpixel*> &superpixelPtrs, const vector<T> &values, Mat &outputImg)
+{
+  assert(superpixelPtrs.size() == values.size());
+  assert(outputImg.elemSize() == sizeof(T));
+  
+  parallelFor(Range(0, (int) superpixelPtrs.size()), FillSuperpixelRunsParallelBody<T>(superpixelPtrs, values, outputImg));
+}
+
 // Fill a matrix using the superpixel tag as the RGB value, this method makes it
-// easy to lookup the tag at a specific (X,Y) coordinate.
+// easy to lookup the tag at a specific (X,Y) coordinate. A CV_32SC1 matrix
+// is filled with the tag values.
 
 void SuperpixelImage::fillMatrixWithSuperpixelTags(Mat &outputTagsImg) {
-  // Sort superpixel by size
+  assert(isTagsImageType(outputTagsImg));
   
-  vector<SuperpixelSortStruct> sortedSuperpixels;
+  vector<Superpixel*> superpixelPtrs;
+  
+  superpixelPtrs.reserve(superpixels.size());
   
   for ( int32_t tag : superpixels ) {
     Superpixel *spPtr = getSuperpixelPtr(tag);
     assert(spPtr);
     
-    auto &coords = spPtr->coords;
-    
-    Vec3b tagVec = PixelToVec3b(tag);
+    superpixelPtrs.push_back(spPtr);
+  }
+  
+  if (outputTagsImg.type() == CV_32SC1) {
+    vector<int32_t> tagValues(superpixels.begin(), superpixels.end());
+    fillSuperpixelRuns(superpixelPtrs, tagValues, outputTagsImg);
+  } else {
+    vector<Vec3b> tagVecs;
+    tagVecs.reserve(superpixels.size());
     
-    for ( Coord coord : coords ) {
-      int32_t X = coord.x;
-      int32_t Y = coord.y;
-      outputTagsImg.at<Vec3b>(Y, X) = tagVec;
+    for ( int32_t tag : superpixels ) {
+      tagVecs.push_back(PixelToVec3b(tag));
     }
+    
+    fillSuperpixelRuns(superpixelPtrs, tagVecs, outputTagsImg);
   }
 }
 
@@ -1481,6 +3064,15 @@ bool SuperpixelImage::isAllSamePixels(Mat &input, int32_t tag) {
     cout << "checking for superpixel all same pixels for " << tag << " with coords N=" << numCoords << endl;
   }
   
+  // When the color stats were read from this image the pixels are all the
+  // same exactly when the variance of each channel is zero
+  
+  Vec3f mean, variance;
+  
+  if (input.data == colorStatsData && spPtr->colorMeanAndVariance(mean, variance)) {
+    return (variance[0] == 0.0f && variance[1] == 0.0f && variance[2] == 0.0f);
+  }
+  
   Coord coord = coords[0];
   int32_t X = coord.x;
   int32_t Y = coord.y;
@@ -1516,6 +3108,17 @@ bool SuperpixelImage::isAllSamePixels(Mat &input, Superpixel *spPtr, int32_t oth
     return false;
   }
   
+  // With color stats the other superpixel matches when it has zero variance
+  // and the same mean as the all same pixels of this superpixel
+  
+  Vec3f mean, variance, otherMean, otherVariance;
+  
+  if (input.data == colorStatsData &&
+      spPtr->colorMeanAndVariance(mean, variance) &&
+      otherSpPtr->colorMeanAndVariance(otherMean, otherVariance)) {
+    return (otherVariance[0] == 0.0f && otherVariance[1] == 0.0f && otherVariance[2] == 0.0f && mean == otherMean);
+  }
+  
   // Get pixel value from first coord in first superpixel
   
   Coord coord = spPtr->coords[0];
@@ -1573,18 +3176,21 @@ bool SuperpixelImage::isAllSamePixels(Mat &input, uint32_t knownFirstPixel, vect
   
   // FIXME: 32BPP support
   
+  const Mat &packedImg = getPackedPixels(input);
+  const uint32_t *packedPtr = (const uint32_t *) packedImg.data;
+  
+  const TiledImage *tiledPtr = tiledPackedPixels.empty() ? NULL : &tiledPackedPixels;
+  
   for (auto it = coords.begin(); it != coords.end(); ++it) {
     Coord coord = *it;
     int32_t X = coord.x;
     int32_t Y = coord.y;
     
-    Vec3b pixelVec = input.at<Vec3b>(Y, X);
-    uint32_t pixel = (uint32_t) (Vec3BToUID(pixelVec) & 0x00FFFFFF);
+    uint32_t pixel = (tiledPtr != NULL) ? tiledPtr->at<uint32_t>(X, Y) : packedPtr[(Y * packedImg.cols) + X];
     
     if (debug) {
       // Print BGRA format
       
-      int32_t pixel = Vec3BToUID(pixelVec);
       char buffer[6+1];
       snprintf(buffer, 6+1, "%06X", pixel);
       
@@ -1628,11 +3234,7 @@ void generateStaticColortable(Mat &inputImg, SuperpixelImage &spImage)
   staticColortable.erase(staticColortable.begin(), staticColortable.end());
   
   for (int i = 0; i < max; i++) {
-    uint32_t pixel = 0;
-    pixel |= (rand() % 256);
-    pixel |= ((rand() % 256) << 8);
-    pixel |= ((rand() % 256) << 16);
-    pixel |= (0xFF << 24);
+    uint32_t pixel = randomPixelForIndex(i);
     staticColortable.push_back(pixel);
   }
   
@@ -1651,148 +3253,135 @@ void generateStaticColortable(Mat &inputImg, SuperpixelImage &spImage)
 
 void writeTagsWithStaticColortable(SuperpixelImage &spImage, Mat &resultImg)
 {
-  for (auto it = spImage.superpixels.begin(); it != spImage.superpixels.end(); ++it) {
-    int32_t tag = *it;
-    
+  vector<Superpixel*> superpixelPtrs;
+  vector<Vec3b> pixelVecs;
+  
+  superpixelPtrs.reserve(spImage.superpixels.size());
+  pixelVecs.reserve(spImage.superpixels.size());
+  
+  for ( int32_t tag : spImage.superpixels ) {
     Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
     assert(spPtr);
     
-    auto &coords = spPtr->coords;
+    uint32_t offset = staticTagToOffsetTable[tag];
+    uint32_t pixel = staticColortable[offset];
     
-    for (auto coordsIter = coords.begin(); coordsIter != coords.end(); ++coordsIter) {
-      Coord coord = *coordsIter;
-      int32_t X = coord.x;
-      int32_t Y = coord.y;
-      
-      uint32_t offset = staticTagToOffsetTable[tag];
-      uint32_t pixel = staticColortable[offset];
-      
-      Vec3b tagVec;
-      tagVec[0] = pixel & 0xFF;
-      tagVec[1] = (pixel >> 8) & 0xFF;
-      tagVec[2] = (pixel >> 16) & 0xFF;
-      resultImg.at<Vec3b>(Y, X) = tagVec;
-    }
+    superpixelPtrs.push_back(spPtr);
+    pixelVecs.push_back(PixelToVec3b(pixel));
   }
+  
+  fillSuperpixelRuns(superpixelPtrs, pixelVecs, resultImg);
 }
 
-// Write tags but use a passed in colortable to map superpixel UIDs to colors
-
-void writeTagsWithDymanicColortable(SuperpixelImage &spImage, Mat &resultImg, unordered_map<int32_t,int32_t> map)
+void writeTagsWithIndexColors(SuperpixelImage &spImage, Mat &resultImg)
 {
-  for (auto it = spImage.superpixels.begin(); it != spImage.superpixels.end(); ++it) {
-    int32_t tag = *it;
-    
+  vector<Superpixel*> superpixelPtrs;
+  vector<Vec3b> pixelVecs;
+  
+  superpixelPtrs.reserve(spImage.superpixels.size());
+  pixelVecs.reserve(spImage.superpixels.size());
+  
+  uint32_t offset = 0;
+  
+  for ( int32_t tag : spImage.superpixels ) {
     Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
     assert(spPtr);
     
-    auto &coords = spPtr->coords;
-    
-    for (auto coordsIter = coords.begin(); coordsIter != coords.end(); ++coordsIter) {
-      Coord coord = *coordsIter;
-      int32_t X = coord.x;
-      int32_t Y = coord.y;
-      
-      assert(map.count(tag) > 0);
-      uint32_t pixel = (uint32_t) map[tag];
-      
-      Vec3b tagVec;
-      tagVec[0] = pixel & 0xFF;
-      tagVec[1] = (pixel >> 8) & 0xFF;
-      tagVec[2] = (pixel >> 16) & 0xFF;
-      resultImg.at<Vec3b>(Y, X) = tagVec;
-    }
+    superpixelPtrs.push_back(spPtr);
+    pixelVecs.push_back(PixelToVec3b(randomPixelForIndex(offset++)));
   }
+  
+  fillSuperpixelRuns(superpixelPtrs, pixelVecs, resultImg);
 }
 
-// Assuming that there are N < 256 superpixels then the output can be writting as 8 bit grayscale.
+// Write tags but use a passed in colortable to map superpixel UIDs to colors
 
-void writeTagsWithGraytable(SuperpixelImage &spImage, Mat &origImg, Mat &resultImg)
+void writeTagsWithDymanicColortable(SuperpixelImage &spImage, Mat &resultImg, const unordered_map<int32_t,int32_t> &map)
 {
-  resultImg.create(origImg.rows, origImg.cols, CV_8UC(1));
+  vector<Superpixel*> superpixelPtrs;
+  vector<Vec3b> pixelVecs;
   
-  int gray = 0;
+  superpixelPtrs.reserve(spImage.superpixels.size());
+  pixelVecs.reserve(spImage.superpixels.size());
   
-  // Sort superpixel by size
+  for ( int32_t tag : spImage.superpixels ) {
+    Superpixel *spPtr = spImage.getSuperpixelPtr(tag);
+    assert(spPtr);
+    
+    assert(map.count(tag) > 0);
+    uint32_t pixel = (uint32_t) map.find(tag)->second;
+    
+    superpixelPtrs.push_back(spPtr);
+    pixelVecs.push_back(PixelToVec3b(pixel));
+  }
   
+  fillSuperpixelRuns(superpixelPtrs, pixelVecs, resultImg);
+}
+
+// Superpixels in decreasing size order, the gray and min colortable index of each
+// superpixel is the offset in this order.
+
+static
+vector<Superpixel*> superpixelsBySizeDecreasing(SuperpixelImage &spImage)
+{
   vector<SuperpixelSortStruct> sortedSuperpixels;
+  sortedSuperpixels.reserve(spImage.superpixels.size());
   
-  for (auto it = spImage.superpixels.begin(); it != spImage.superpixels.end(); ++it) {
-    int32_t tag = *it;
+  for ( int32_t tag : spImage.superpixels ) {
     SuperpixelSortStruct ss;
     ss.spPtr = spImage.getSuperpixelPtr(tag);
+    assert(ss.spPtr);
     sortedSuperpixels.push_back(ss);
   }
   
   sort(sortedSuperpixels.begin(), sortedSuperpixels.end(), CompareSuperpixelSizeDecreasingFunc);
   
-  for (auto it = sortedSuperpixels.begin(); it != sortedSuperpixels.end(); ++it) {
-    SuperpixelSortStruct ss = *it;
-    Superpixel *spPtr = ss.spPtr;
-    assert(spPtr);
-    
-    //cout << "N = " << (int)spPtr->coords.size() << endl;
-    
-    auto &coords = spPtr->coords;
-    
-    for (auto coordsIter = coords.begin(); coordsIter != coords.end(); ++coordsIter) {
-      Coord coord = *coordsIter;
-      int32_t X = coord.x;
-      int32_t Y = coord.y;
-      
-      resultImg.at<uint8_t>(Y, X) = gray;
-    }
-    
-    gray++;
+  vector<Superpixel*> superpixelPtrs;
+  superpixelPtrs.reserve(sortedSuperpixels.size());
+  
+  for ( SuperpixelSortStruct &ss : sortedSuperpixels ) {
+    superpixelPtrs.push_back(ss.spPtr);
   }
+  
+  return superpixelPtrs;
 }
 
-// Generate gray table and the write pixels as int BGR.
+// Assuming that there are N < 256 superpixels then the output can be writting as 8 bit grayscale.
 
-void writeTagsWithMinColortable(SuperpixelImage &spImage, Mat &origImg, Mat &resultImg)
+void writeTagsWithGraytable(SuperpixelImage &spImage, Mat &origImg, Mat &resultImg)
 {
-  resultImg.create(origImg.rows, origImg.cols, CV_8UC(3));
-  
-  int gray = 0;
+  resultImg.create(origImg.rows, origImg.cols, CV_8UC(1));
   
-  // Sort superpixel by size
+  vector<Superpixel*> superpixelPtrs = superpixelsBySizeDecreasing(spImage);
   
-  vector<SuperpixelSortStruct> sortedSuperpixels;
+  vector<uint8_t> grays(superpixelPtrs.size());
   
-  for (auto it = spImage.superpixels.begin(); it != spImage.superpixels.end(); ++it) {
-    int32_t tag = *it;
-    SuperpixelSortStruct ss;
-    ss.spPtr = spImage.getSuperpixelPtr(tag);
-    sortedSuperpixels.push_back(ss);
+  for ( int gray = 0; gray < (int) grays.size(); gray++ ) {
+    grays[gray] = (uint8_t) gray;
   }
   
-  sort(sortedSuperpixels.begin(), sortedSuperpixels.end(), CompareSuperpixelSizeDecreasingFunc);
+  fillSuperpixelRuns(superpixelPtrs, grays, resultImg);
+}
+
+// Generate gray table and the write pixels as int BGR.
+
+void writeTagsWithMinColortable(SuperpixelImage &spImage, Mat &origImg, Mat &resultImg)
+{
+  resultImg.create(origImg.rows, origImg.cols, CV_8UC(3));
   
-  for (auto it = sortedSuperpixels.begin(); it != sortedSuperpixels.end(); ++it) {
-    SuperpixelSortStruct ss = *it;
-    Superpixel *spPtr = ss.spPtr;
-    assert(spPtr);
-    
-    //cout << "N[" << gray << "] = " << (int)spPtr->coords.size() << endl;
-    
-    auto &coords = spPtr->coords;
-    
-    for (auto coordsIter = coords.begin(); coordsIter != coords.end(); ++coordsIter) {
-      Coord coord = *coordsIter;
-      int32_t X = coord.x;
-      int32_t Y = coord.y;
-      
-      uint8_t B = gray & 0xFF;
-      uint8_t G = (gray >> 8) & 0xFF;
-      uint8_t R = (gray >> 16) & 0xFF;
-      
-      Vec3b pixelVec(B,G,R);
-      
-      resultImg.at<Vec3b>(Y, X) = pixelVec;
-    }
+  vector<Superpixel*> superpixelPtrs = superpixelsBySizeDecreasing(spImage);
+  
+  vector<Vec3b> pixelVecs(superpixelPtrs.size());
+  
+  for ( int gray = 0; gray < (int) pixelVecs.size(); gray++ ) {
+    uint8_t B = gray & 0xFF;
+    uint8_t G = (gray >> 8) & 0xFF;
+    uint8_t R = (gray >> 16) & 0xFF;
     
-    gray++;
+    pixelVecs[gray] = Vec3b(B,G,R);
   }
+  
+  fillSuperpixelRuns(superpixelPtrs, pixelVecs, resultImg);
 }
 
 
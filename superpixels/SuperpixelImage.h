@@ -18,19 +18,52 @@ class SuperpixelEdge;
 
 #include "Coord.h"
 #include "SuperpixelEdgeTable.h"
+#include "SparseColorHistogram.h"
+#include "SuperpixelGraphSnapshot.h"
+#include "SuperpixelArena.h"
+#include "SuperpixelMergeLog.h"
+#include "SuperpixelMergeTree.h"
+#include "TiledImage.h"
 
 typedef unordered_map<int32_t, Superpixel*> TagToSuperpixelMap;
 
 typedef tuple<double, int32_t, int32_t> CompareNeighborTuple;
 
+// A histogram of the pixels in one superpixel, the bins are not normalized so
+// that the histograms of two superpixels can be added when they are merged.
+// The entry is only valid when numCoords is the number of superpixel coords.
+
+typedef struct {
+  SparseColorHistogram hist;
+  size_t numCoords;
+} SuperpixelHistogram;
+
+// Process wide default for SuperpixelImage::tiledImageDim, 0 is no tiles and
+// is the default.
+
+void setDefaultTiledImageDim(int tileDim);
+
+int getDefaultTiledImageDim();
+
 class SuperpixelImage {
   
   public:
   
+  // The Superpixel objects are owned by the arena, the tables below only
+  // refer to them.
+  
+  SuperpixelArena superpixelArena;
+  
   // This map contains the actual pointers to Superpixel objects.
   
   TagToSuperpixelMap tagToSuperpixelMap;
   
+  // Direct indexed table of the same Superpixel pointers, indexed by tag. This
+  // table is filled in by parse() when the tags are dense and it is empty
+  // otherwise. A merged superpixel leaves a NULL entry in the table.
+  
+  vector<Superpixel*> tagToSuperpixelTable;
+  
   // The superpixels list contains the UIDs for superpixels
   // in UID sorted order.
   
@@ -47,6 +80,120 @@ class SuperpixelImage {
   vector<SuperpixelEdge> mergeOrder;
 #endif
   
+  // The image data that the superpixel color stats were read from, NULL when
+  // the color stats have not been set. Stats are only used for the same image
+  // so the pixels of that image must not be modified.
+  
+  const uchar *colorStatsData;
+  
+  // Cached 16x16x16 histograms by tag for the image in histogramData, see
+  // getHistogram(). Merges add the histograms of the two superpixels.
+  
+  unordered_map<int32_t, SuperpixelHistogram> histogramCache;
+  
+  const uchar *histogramData;
+  
+  // The input image converted to other colorspaces, by cvtColor() code, see
+  // getConvertedImage(). The images were converted from convertedImagesData.
+  
+  unordered_map<int, Mat> convertedImages;
+  
+  const uchar *convertedImagesData;
+  
+  // Converted images uploaded as UMat, see getConvertedUMat(). These are
+  // discarded along with convertedImages.
+  
+  unordered_map<int, UMat> convertedUMats;
+  
+  // The input image packed to 32 bit pixels, see getPackedPixels(). This is
+  // discarded along with convertedImages.
+  
+  Mat packedPixels;
+  
+  // The Lab gradient magnitude of the input image, see getLabGradients(). This
+  // is discarded along with convertedImages.
+  
+  Mat labGradients;
+  
+  // Tiled copies of the input image and the converted images by cvtColor()
+  // code, with 0 for the input image, and of the packed pixels. These are only
+  // made when tiledImageDim is not zero and are discarded along with
+  // convertedImages.
+  
+  unordered_map<int, TiledImage> tiledImages;
+  
+  TiledImage tiledPackedPixels;
+  
+  // The image that the edge gradient sums were computed from, NULL when
+  // computeEdgeGradients() has not been invoked.
+  
+  const uchar *edgeGradientsData;
+  
+  // Superpixels in sortSuperpixelsBySize() order as (-N, tag) keys, so the
+  // largest superpixel is first and ties are in increasing tag order. The order
+  // is built on first use and mergeEdge() replaces the keys of the merged pair,
+  // it is rebuilt when a key no longer matches the number of coords.
+  
+  set<pair<int32_t, int32_t> > sizeOrder;
+  
+  // When true parse() records the boundary pixels of each edge in the edge
+  // table so that filterEdgeCoords() does not need to scan the coords. This
+  // must be set before the parse, false by default.
+  
+  bool recordEdgeBoundaries;
+  
+  // When true and OpenCL is available, back projections of a histogram over the
+  // whole image are run on a UMat so that OpenCV can use the OpenCL device. A
+  // back projection of only a few superpixels still reads the pixels on the CPU.
+  // False by default.
+  
+  bool useOpenCL;
+  
+  // When 4 or 8 the input image, the converted images and the packed pixels
+  // are also copied into tiles of tiledImageDim x tiledImageDim pixels as they
+  // are cached, and fillMatrixFromCoords(), isAllSamePixels() and
+  // gatherPackedPixels() read the pixels of a region from the tiles. The
+  // gathered pixels are the same either way. Set this before the images are
+  // cached, the default is getDefaultTiledImageDim().
+  
+  int tiledImageDim;
+  
+  // Number of merges done with mergeEdge(), this is the version of the graph
+  // returned by takeSnapshot().
+  
+  uint32_t numMerges;
+  
+  // The graph as of the last takeSnapshot() and the tags that merges modified
+  // since then, the tags are only recorded once a snapshot has been taken.
+  
+  SuperpixelGraphSnapshot lastSnapshot;
+  
+  bool hasSnapshot;
+  
+  vector<int32_t> snapshotDirtyTags;
+  
+  // When not NULL each mergeEdge() is recorded in this log, see
+  // SuperpixelMergeLog. The log is owned by the caller, NULL by default.
+  
+  SuperpixelMergeLog *mergeLog;
+  
+  // When not NULL each mergeEdge() adds a node to this tree, see
+  // SuperpixelMergeTree. The tree is owned by the caller, NULL by default.
+  
+  SuperpixelMergeTree *mergeTree;
+  
+  SuperpixelImage()
+  : colorStatsData(NULL), histogramData(NULL), convertedImagesData(NULL), edgeGradientsData(NULL), recordEdgeBoundaries(false), useOpenCL(false), tiledImageDim(getDefaultTiledImageDim()),
+  numMerges(0), hasSnapshot(false), mergeLog(NULL), mergeTree(NULL)
+  {
+  }
+  
+  // Return to the state of a new SuperpixelImage so that another image can be
+  // parsed. The superpixels are not freed one at a time, the arena is reset and
+  // the objects and their coords capacity are reused by the next parse.
+  
+  void reset();
+  
   // Lookup Superpixel* given a UID
 
   Superpixel* getSuperpixelPtr(int32_t uid);
@@ -54,18 +201,168 @@ class SuperpixelImage {
   // Return vector of all edges
   vector<SuperpixelEdge> getEdges();
   
+  // Invoke f(const SuperpixelEdge&) for each edge in the graph without a copy
+  // of the edges, see SuperpixelEdgeTable::forEachEdge().
+  
+  template <typename F>
+  void forEachEdge(F f) {
+    edgeTable.forEachEdge(f);
+  }
+  
   // Parse tags image and construct superpixels. Note that this method will modify the
-  // original tag values by adding 1 to each original tag value.
+  // original tag values by adding 1 to each original tag value. The tags image
+  // is either CV_8UC3 with 24 bit tags or CV_32SC1 with non negative 32 bit tags.
   
   static
   bool parse(Mat &tags, SuperpixelImage &spImage);
 
+  // Construct superpixels from a CV_32SC1 label image, the tag of each
+  // superpixel is the label plus labelOffset and the tags image is written
+  // with these tags. This is the same as parse() on the tags image written
+  // with label + labelOffset - 1 but does not scan the tags a second time.
+  // Pass the pixel count of each label, as returned by generateSRMLabels(),
+  // to build the superpixels in a single pass over the labels. The bbox of
+  // each label, when also passed, is cached in each superpixel so that the
+  // bbox and the containment roots do not need to scan the coords. Pass
+  // CV_32SC1 as tagsType to write a 32 bit tags image, the number of labels
+  // is then not limited to 24 bits.
+  
+  static
+  bool parseLabels(const Mat &labels, int32_t labelOffset, Mat &tags, SuperpixelImage &spImage,
+                   const vector<int32_t> *labelCounts = NULL,
+                   const vector<cv::Rect> *labelBounds = NULL,
+                   int tagsType = CV_8UC3);
+
+  // Write the superpixels to a flat binary snapshot, the coords of all the
+  // superpixels are one contiguous array and the neighbors are in CSR form,
+  // along with the edge weights and the merge weights of each superpixel.
+  // The color stats, histograms, hulls and converted images are not written
+  // since they depend on an input image. Returns false on a write error.
+  
+  bool save(const string &filename);
+  
+  // Read a snapshot written by save() into an empty spImage. The file is
+  // mapped and each section is copied out as a block, so no tags image is
+  // parsed and no edges are scanned.
+  
+  static
+  bool load(const string &filename, SuperpixelImage &spImage);
+  
   static
   bool parseSuperpixelEdges(Mat &tags, SuperpixelImage &spImage);
+
+  // Parse edges in row stripes on multiple threads, the results are the same as
+  // parseSuperpixelEdges(). Zero stripeRows means one stripe for each thread.
+  
+  static
+  bool parseSuperpixelEdgesParallel(Mat &tags, SuperpixelImage &spImage, int stripeRows = 0);
+  
+  // Set the color stats of each superpixel from the pixels in inputImg so
+  // that mean and variance queries and isAllSamePixels() do not read pixels.
+  
+  void setColorStats(Mat &inputImg);
+  
+  // Store the coords of each superpixel as runs of pixels on a row, this uses
+  // much less memory for large regions. See SuperpixelCoords::encodeRuns().
+  
+  void encodeCoordRuns();
+  
+  // Return the coords of each superpixel that touch the other superpixel, see
+  // Superpixel::filterEdgeCoords(). The recorded edge boundaries are used when
+  // they were parsed, otherwise the coords of the two superpixels are scanned.
+  
+  void filterEdgeCoords(int32_t tag1,
+                        vector<Coord> &edgeCoords1,
+                        int32_t tag2,
+                        vector<Coord> &edgeCoords2);
+  
+  // Return the 16x16x16 histogram of the pixels in a superpixel. The histogram is
+  // cached and kept up to date on merge, so a superpixel that is compared many
+  // times only reads its pixels once. The bins are counts and not normalized.
+  // A different inputImg discards all cached histograms, so the pixels of the
+  // image must not be modified while histograms are cached.
+  
+  const SparseColorHistogram & getHistogram(Mat &inputImg, int32_t tag);
+  
+  // Return inputImg converted with the cvtColor() code in conversion, for example
+  // CV_BGR2Lab. The whole image is converted the first time a colorspace is used
+  // and the result is cached, so pixels gathered from the converted image are the
+  // same as converting the gathered pixels. Zero returns inputImg. A different
+  // inputImg discards the cached images, the pixels of inputImg must not be
+  // modified while converted images are cached.
+  
+  Mat & getConvertedImage(Mat &inputImg, int conversion);
+  
+  // Discard the cached converted images, packed pixels, gradients and tiles
+  // when inputImg is not the image they were made from.
+  
+  void discardConvertedImages(const Mat &inputImg);
+  
+  // Return the result of getConvertedImage() uploaded to a UMat, the upload is
+  // done once and cached with the converted image.
+  
+  UMat & getConvertedUMat(Mat &inputImg, int conversion);
+  
+  // Return inputImg packed by packPixels(), the image is packed once and cached
+  // with the converted images. The first call for an image is not thread safe,
+  // so a caller that reads the packed pixels from threads packs it first.
+  
+  const Mat & getPackedPixels(const Mat &inputImg);
+  
+  // Read the packed pixel value at each coord of inputImg, the same values as
+  // gatherPixels() on getPackedPixels(). The tiled packed pixels are read when
+  // tiledImageDim is set.
   
-  // Merge superpixels defined by edge in this image container
+  void gatherPackedPixels(const Mat &inputImg, const vector<Coord> &coords, uint32_t *pixels);
   
-  void mergeEdge(SuperpixelEdge &edge);
+  // The tiled copy of inputImg or of an image returned by getConvertedImage()
+  // or NULL when the image has not been tiled.
+  
+  const TiledImage* findTiledImage(const Mat &img) const;
+  
+  // Return the gradient magnitude of the Lab image as CV_32FC1, the root of the
+  // sum of the squared Scharr x and y derivatives of the 3 channels divided by
+  // 16 so that a pixel next to a step between two flat colors has the Delta-E
+  // of the colors. The rows are computed in parallel the first time and the
+  // result is cached with the converted images.
+  
+  const Mat & getLabGradients(Mat &inputImg);
+  
+  // Sum getLabGradients() over the boundary pixels of every edge in one parallel
+  // sweep and store the sums in edgeTable.edgeGradientMap, merges then add the
+  // sums together. compareNeighborEdges() uses the mean gradient over an edge as
+  // the edge weight instead of comparing the pixels on each side. The boundaries
+  // must have been recorded by parse(), returns false when there are none.
+  
+  bool computeEdgeGradients(Mat &inputImg);
+  
+  // True when computeEdgeGradients() was invoked for inputImg
+  
+  bool hasEdgeGradients(const Mat &inputImg) {
+    return (edgeGradientsData != NULL && edgeGradientsData == inputImg.data);
+  }
+  
+  // Return true when whole image back projections should use getConvertedUMat()
+  
+  bool isOpenCLBackProjection();
+  
+  // Return a read only view of the current graph that other threads can read
+  // while this image is merged, see SuperpixelGraphSnapshot. This must be
+  // invoked from the thread that merges, only the nodes modified by merges
+  // since the last snapshot are rebuilt.
+  
+  SuperpixelGraphSnapshot takeSnapshot();
+  
+  // Rebuild the whole graph on the next takeSnapshot(), this must be invoked
+  // after the coords or the neighbors are modified other than by mergeEdge().
+  
+  void invalidateSnapshot();
+  
+  // Merge superpixels defined by edge in this image container. The merge cost is
+  // only recorded in the merge tree, a negative cost means the caller does not
+  // have a cost for the merge.
+  
+  void mergeEdge(SuperpixelEdge &edge, float mergeCost = -1.0f);
   
   // Merge superpixels where all pixels are the same pixel.
   
@@ -82,6 +379,8 @@ class SuperpixelImage {
   
   void fillMatrixFromCoords(Mat &input, int32_t tag, Mat &output);
   
+  void fillMatrixFromCoords(Mat &input, vector<Coord> &coords, Mat &output);
+  
   // This method is the inverse of fillMatrixFromCoords(), it reads pixel values from a matrix
   // and writes them back to X,Y values that correspond to the original image. This method is
   // very useful when running an image operation on all the pixels in a superpixel but without
@@ -91,10 +390,16 @@ class SuperpixelImage {
   void reverseFillMatrixFromCoords(Mat &input, bool isGray, int32_t tag, Mat &output);
   
   // Fill a matrix using the superpixel tag as the RGB value, this method makes it
-  // easy to lookup the tag at a specific (X,Y) coordinate.
+  // easy to lookup the tag at a specific (X,Y) coordinate. A CV_32SC1 matrix
+  // is filled with the tag values.
   
   void fillMatrixWithSuperpixelTags(Mat &outputTagsImg);
   
+  // Scan the pixels of all superpixels once and set the all same flags, the packed
+  // pixel value of each superpixel that has all identical pixels is returned by tag.
+  
+  void scanAllSamePixels(Mat &inputImg, unordered_map<int32_t, uint32_t> &allSamePixels);
+  
   // true when all pixels in a superpixel are exactly identical
   
   bool isAllSamePixels(Mat &input, int32_t tag);
@@ -107,8 +412,25 @@ class SuperpixelImage {
   
   bool isAllSamePixels(Mat &input, uint32_t knownFirstPixel, vector<Coord> &coords);
 
+  // Superpixel tags with the largest superpixel first, ties are sorted so that
+  // smaller tags appear first. The order is kept up to date by merges, so a call
+  // after a merge does not sort all the superpixels again.
+  
   vector<int32_t> sortSuperpixelsBySize();
   
+  // Superpixel tags with the smallest superpixel first, the reverse order of
+  // sortSuperpixelsBySize().
+  
+  vector<int32_t> sortSuperpixelsBySizeIncreasing();
+  
+  // The superpixel UIDs in sorted order without a copy, the set is modified
+  // by a merge so a caller that merges while it iterates must use
+  // getSuperpixelsVec() instead.
+  
+  const set<int32_t> & getSuperpixelsRef() const {
+    return superpixels;
+  }
+  
   vector<int32_t> getSuperpixelsVec() {
     vector<int32_t> vec;
     for ( int32_t tag : superpixels ) {
@@ -125,6 +447,12 @@ void writeTagsWithStaticColortable(SuperpixelImage &spImage, Mat &resultImg);
 
 void generateStaticColortable(Mat &inputImg, SuperpixelImage &spImage);
 
+// Write each superpixel with the same color as generateStaticColortable() and
+// writeTagsWithStaticColortable() without the shared colortable, so this can be
+// invoked from more than one thread at a time.
+
+void writeTagsWithIndexColors(SuperpixelImage &spImage, Mat &resultImg);
+
 void writeTagsWithGraytable(SuperpixelImage &spImage, Mat &origImg, Mat &resultImg);
 
 void writeTagsWithMinColortable(SuperpixelImage &spImage, Mat &origImg, Mat &resultImg);
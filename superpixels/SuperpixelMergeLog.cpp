@@ -0,0 +1,217 @@
+// Compact log of superpixel merges, see SuperpixelMergeLog.h
+
+#include "SuperpixelMergeLog.h"
+
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+
+#include "SuperpixelImage.h"
+
+using namespace std;
+
+void SuperpixelMergeLog::appendVarint(uint64_t value)
+{
+  while (value >= 0x80) {
+    bytes.push_back((uint8_t) (value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back((uint8_t) value);
+}
+
+// Decode one varint at offset, returns false when the bytes end before the
+// last byte of the varint or the varint does not fit in 64 bits.
+
+static inline
+bool readMergeLogVarint(const uint8_t *bytesPtr, size_t numBytes, size_t &offset, uint64_t &value)
+{
+  value = 0;
+
+  for ( int shift = 0; shift < 64; shift += 7 ) {
+    if (offset >= numBytes) {
+      return false;
+    }
+    uint8_t byte = bytesPtr[offset++];
+    value |= ((uint64_t) (byte & 0x7F)) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void SuperpixelMergeLog::appendMerge(const SuperpixelEdge &edge)
+{
+  assert(edge.A >= 0 && edge.A < edge.B);
+  appendVarint(((uint64_t) edge.A) << 1);
+  appendVarint((uint64_t) (edge.B - edge.A));
+  numMerges += 1;
+}
+
+void SuperpixelMergeLog::markPass()
+{
+  appendVarint((((uint64_t) numPasses) << 1) | 1);
+  numPasses += 1;
+}
+
+void SuperpixelMergeLog::clear()
+{
+  bytes.clear();
+  numMerges = 0;
+  numPasses = 0;
+}
+
+bool SuperpixelMergeLog::save(const string &filename) const
+{
+  SuperpixelMergeLogHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SUPERPIXEL_MERGE_LOG_MAGIC, sizeof(header.magic));
+  header.version = SUPERPIXEL_MERGE_LOG_VERSION;
+  header.headerSize = sizeof(SuperpixelMergeLogHeader);
+  header.numMerges = numMerges;
+  header.numPasses = numPasses;
+  header.numBytes = bytes.size();
+
+  std::ofstream outFile(filename.c_str(), std::ios::binary | std::ios::trunc);
+
+  if (!outFile) {
+    return false;
+  }
+
+  outFile.write((const char*) &header, sizeof(header));
+  outFile.write((const char*) bytes.data(), bytes.size());
+
+  return (bool) outFile;
+}
+
+// The varints are decoded once to check that the counts in the header match,
+// so that replay() can trust the log.
+
+bool SuperpixelMergeLog::load(const string &filename, SuperpixelMergeLog &mergeLog)
+{
+  mergeLog.clear();
+
+  std::ifstream inFile(filename.c_str(), std::ios::binary);
+
+  if (!inFile) {
+    return false;
+  }
+
+  SuperpixelMergeLogHeader header;
+
+  if (!inFile.read((char*) &header, sizeof(header)) ||
+      memcmp(header.magic, SUPERPIXEL_MERGE_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SUPERPIXEL_MERGE_LOG_VERSION ||
+      header.headerSize != sizeof(SuperpixelMergeLogHeader)) {
+    cerr << "error : \"" << filename << "\" is not a merge log" << endl;
+    return false;
+  }
+
+  inFile.seekg(0, std::ios::end);
+  const uint64_t fileSize = (uint64_t) inFile.tellg();
+
+  if (fileSize != sizeof(header) + header.numBytes) {
+    cerr << "error : merge log \"" << filename << "\" is " << fileSize << " bytes" << endl;
+    return false;
+  }
+
+  inFile.seekg(sizeof(header), std::ios::beg);
+
+  vector<uint8_t> &bytes = mergeLog.bytes;
+  bytes.resize((size_t) header.numBytes);
+
+  if (!inFile.read((char*) bytes.data(), bytes.size())) {
+    mergeLog.clear();
+    return false;
+  }
+
+  uint32_t numMerges = 0;
+  uint32_t numPasses = 0;
+  size_t offset = 0;
+
+  while (offset < bytes.size()) {
+    uint64_t value;
+    uint64_t delta;
+
+    if (!readMergeLogVarint(bytes.data(), bytes.size(), offset, value)) {
+      break;
+    }
+
+    if (value & 1) {
+      if ((value >> 1) != numPasses) {
+        break;
+      }
+      numPasses += 1;
+    } else {
+      if (!readMergeLogVarint(bytes.data(), bytes.size(), offset, delta) || delta == 0 || ((value >> 1) + delta) > INT32_MAX) {
+        break;
+      }
+      numMerges += 1;
+    }
+  }
+
+  if (offset != bytes.size() || numMerges != header.numMerges || numPasses != header.numPasses) {
+    cerr << "error : merge log \"" << filename << "\" is corrupt" << endl;
+    mergeLog.clear();
+    return false;
+  }
+
+  mergeLog.numMerges = numMerges;
+  mergeLog.numPasses = numPasses;
+
+  return true;
+}
+
+int SuperpixelMergeLog::replay(SuperpixelImage &spImage, int endPass) const
+{
+  const bool debug = false;
+
+  // The image must not record the replay into a log, that could be this log
+
+  SuperpixelMergeLog *savedMergeLog = spImage.mergeLog;
+  spImage.mergeLog = NULL;
+
+  const bool savedLazyMerge = spImage.edgeTable.lazyMerge;
+  spImage.edgeTable.lazyMerge = true;
+
+  int numReplayed = 0;
+  size_t offset = 0;
+
+  while (offset < bytes.size()) {
+    uint64_t value;
+    uint64_t delta;
+
+    readMergeLogVarint(bytes.data(), bytes.size(), offset, value);
+
+    if (value & 1) {
+      if (endPass >= 0 && (int64_t) (value >> 1) >= endPass) {
+        break;
+      }
+      continue;
+    }
+
+    readMergeLogVarint(bytes.data(), bytes.size(), offset, delta);
+
+    SuperpixelEdge edge((int32_t) (value >> 1), (int32_t) ((value >> 1) + delta));
+
+    if (spImage.getSuperpixelPtr(edge.A) == NULL || spImage.getSuperpixelPtr(edge.B) == NULL) {
+      cerr << "error : merge log edge (" << edge.A << "," << edge.B << ") is not in the superpixel image" << endl;
+      numReplayed = -1;
+      break;
+    }
+
+    if (debug) {
+      cout << "replay merge (" << edge.A << "," << edge.B << ")" << endl;
+    }
+
+    spImage.mergeEdge(edge);
+    numReplayed += 1;
+  }
+
+  spImage.edgeTable.lazyMerge = savedLazyMerge;
+  spImage.mergeLog = savedMergeLog;
+
+  return numReplayed;
+}
@@ -0,0 +1,94 @@
+// A merge log records the edges passed to SuperpixelImage::mergeEdge() as a
+// compact byte stream, so that a segmentation can be reproduced by replaying
+// the merges on the superpixels parsed from the same tags without running the
+// merge predicates again. Each merge is two varints, the tag A of the edge
+// times 2 and then B - A. A pass marker is one varint, the pass index times 2
+// plus 1. A merge of two neighbors with small tags takes 2 or 3 bytes. The log
+// is recorded when SuperpixelImage::mergeLog is set, this works in a release
+// build, and MergeSuperpixelPipeline marks the start of each pass it runs.
+//
+// File layout, all values in little endian byte order:
+//
+// SuperpixelMergeLogHeader
+// uint8_t x numBytes, the varints
+
+#ifndef SUPERPIXEL_MERGE_LOG_H
+#define	SUPERPIXEL_MERGE_LOG_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "SuperpixelEdge.h"
+
+class SuperpixelImage;
+
+#define SUPERPIXEL_MERGE_LOG_MAGIC "CSMERGES"
+#define SUPERPIXEL_MERGE_LOG_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t numMerges;
+  uint32_t numPasses;
+  uint64_t numBytes;
+} SuperpixelMergeLogHeader;
+
+class SuperpixelMergeLog {
+public:
+  SuperpixelMergeLog()
+  : numMerges(0), numPasses(0)
+  {
+  }
+
+  // Record one merge, the edge is recorded with A < B
+
+  void appendMerge(const SuperpixelEdge &edge);
+
+  // Record the start of the next pass, the first pass is index 0
+
+  void markPass();
+
+  void clear();
+
+  uint32_t getNumMerges() const {
+    return numMerges;
+  }
+
+  uint32_t getNumPasses() const {
+    return numPasses;
+  }
+
+  const std::vector<uint8_t> & getBytes() const {
+    return bytes;
+  }
+
+  // Returns false on a write error
+
+  bool save(const std::string &filename) const;
+
+  // Read a log written by save(), returns false when the file is not a valid log
+
+  static
+  bool load(const std::string &filename, SuperpixelMergeLog &mergeLog);
+
+  // Merge the recorded edges in spImage, which must be parsed from the same
+  // tags as the image the log was recorded from. The merges are done with
+  // the lazy neighbors merge of the edge table. Only the merges before the
+  // pass marker endPass are done, a negative endPass replays the whole log.
+  // Returns the number of merges, or -1 when an edge is not in spImage.
+
+  int replay(SuperpixelImage &spImage, int endPass = -1) const;
+
+private:
+  std::vector<uint8_t> bytes;
+
+  uint32_t numMerges;
+  uint32_t numPasses;
+
+  void appendVarint(uint64_t value);
+};
+
+#endif // SUPERPIXEL_MERGE_LOG_H
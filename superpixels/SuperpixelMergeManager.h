@@ -11,6 +11,88 @@
 
 #include "SuperpixelImage.h"
 
+#include <assert.h>
+
+#include <unordered_set>
+
+
+// Dense membership test for a set of superpixel tags, one bit for each tag
+// value up to the largest tag in the set. Tags are small non-negative ints
+// so a lookup is a single bit test instead of a set or hash lookup.
+
+class SuperpixelTagBitset
+{
+public:
+  vector<uint64_t> bits;
+  
+  // Number of tags in the set
+  
+  int count;
+  
+  SuperpixelTagBitset()
+  : count(0)
+  {}
+  
+  // Discard any existing tags and set the bits for the tags in the container
+  
+  template <class C>
+  void assign(const C &tags) {
+    int32_t maxTag = -1;
+    for ( int32_t tag : tags ) {
+      maxTag = std::max(maxTag, tag);
+    }
+    
+    bits.assign((maxTag / 64) + 1, 0);
+    count = 0;
+    
+    for ( int32_t tag : tags ) {
+      assert(tag >= 0);
+      uint64_t bit = ((uint64_t) 1) << (tag & 63);
+      uint64_t &word = bits[tag >> 6];
+      if ((word & bit) == 0) {
+        word |= bit;
+        count += 1;
+      }
+    }
+  }
+  
+  bool contains(int32_t tag) const {
+    uint32_t wordi = ((uint32_t) tag) >> 6;
+    if (wordi >= bits.size()) {
+      return false;
+    }
+    return (bits[wordi] >> (tag & 63)) & 0x1;
+  }
+  
+  // Add one tag, the bits grow as needed
+  
+  void insert(int32_t tag) {
+    assert(tag >= 0);
+    uint32_t wordi = ((uint32_t) tag) >> 6;
+    if (wordi >= bits.size()) {
+      bits.resize(wordi + 1, 0);
+    }
+    uint64_t bit = ((uint64_t) 1) << (tag & 63);
+    uint64_t &word = bits[wordi];
+    if ((word & bit) == 0) {
+      word |= bit;
+      count += 1;
+    }
+  }
+  
+  void erase(int32_t tag) {
+    uint32_t wordi = ((uint32_t) tag) >> 6;
+    if (wordi >= bits.size()) {
+      return;
+    }
+    uint64_t bit = ((uint64_t) 1) << (tag & 63);
+    uint64_t &word = bits[wordi];
+    if ((word & bit) != 0) {
+      word &= ~bit;
+      count -= 1;
+    }
+  }
+};
 
 // An instance of SuperpixelMergeManager should extend this class and implement any
 // methods that are required for a specific type of merge operation.
@@ -23,6 +105,14 @@ public:
   
   int mergeStep;
   
+  // A manager that sets this to true in a subclass declares that checkEdge()
+  // only reads the state of the two superpixels, does not modify the manager
+  // and can be invoked from multiple threads at the same time. The merge loop
+  // then checks the edges of many superpixels in parallel, see
+  // SuperpixelMergeManagerParallelFunc().
+  
+  static const bool orderInsensitive = false;
+  
   // The superpixels will be processed in order as identified by this vector of tags
   
   vector<int32_t> superpixels;
@@ -92,15 +182,317 @@ public:
   
 };
 
+// A trace policy is invoked by SuperpixelMergeManagerFunc() at each step of the
+// merge loop. The default policy has empty inline methods so that the trace calls
+// compile to nothing, the loop output is only generated when a trace is passed.
+
+class SuperpixelMergeNoTrace
+{
+public:
+  void alreadyProcessed(int32_t tag) {}
+  
+  void alreadyMerged(int32_t tag) {}
+  
+  void foundNeighbors(int32_t tag, int numNeighbors) {}
+  
+  void checkedEdge(int32_t tag, int32_t neighborTag, bool doMerge) {}
+  
+  void mergedIntoNeighbor(int32_t tag, int32_t neighborTag) {}
+  
+  void doneProcessing(int32_t tag, bool mergedNeighbor) {}
+};
+
+typedef enum {
+  SUPERPIXEL_MERGE_TRACE_ALREADY_PROCESSED = 0,
+  SUPERPIXEL_MERGE_TRACE_ALREADY_MERGED,
+  SUPERPIXEL_MERGE_TRACE_FOUND_NEIGHBORS,
+  SUPERPIXEL_MERGE_TRACE_CHECKED_EDGE,
+  SUPERPIXEL_MERGE_TRACE_MERGED_INTO_NEIGHBOR,
+  SUPERPIXEL_MERGE_TRACE_DONE_PROCESSING
+} SuperpixelMergeTraceType;
+
+// One trace event, the meaning of value depends on the type. It is the neighbor
+// tag for a checked edge or merge into a neighbor, the number of neighbors for
+// found neighbors and 1 or 0 for doMerge or mergedNeighbor.
+
+typedef struct {
+  SuperpixelMergeTraceType type;
+  int32_t tag;
+  int32_t neighborTag;
+  int32_t value;
+} SuperpixelMergeTraceEvent;
+
+// Trace policy that records each step of the merge loop as an event so that
+// the steps can be checked or printed after the loop is done.
+
+class SuperpixelMergeTrace
+{
+public:
+  vector<SuperpixelMergeTraceEvent> events;
+  
+  void alreadyProcessed(int32_t tag) {
+    addEvent(SUPERPIXEL_MERGE_TRACE_ALREADY_PROCESSED, tag, -1, 0);
+  }
+  
+  void alreadyMerged(int32_t tag) {
+    addEvent(SUPERPIXEL_MERGE_TRACE_ALREADY_MERGED, tag, -1, 0);
+  }
+  
+  void foundNeighbors(int32_t tag, int numNeighbors) {
+    addEvent(SUPERPIXEL_MERGE_TRACE_FOUND_NEIGHBORS, tag, -1, numNeighbors);
+  }
+  
+  void checkedEdge(int32_t tag, int32_t neighborTag, bool doMerge) {
+    addEvent(SUPERPIXEL_MERGE_TRACE_CHECKED_EDGE, tag, neighborTag, doMerge ? 1 : 0);
+  }
+  
+  void mergedIntoNeighbor(int32_t tag, int32_t neighborTag) {
+    addEvent(SUPERPIXEL_MERGE_TRACE_MERGED_INTO_NEIGHBOR, tag, neighborTag, 0);
+  }
+  
+  void doneProcessing(int32_t tag, bool mergedNeighbor) {
+    addEvent(SUPERPIXEL_MERGE_TRACE_DONE_PROCESSING, tag, -1, mergedNeighbor ? 1 : 0);
+  }
+  
+  // Number of recorded events of the indicated type
+  
+  int count(SuperpixelMergeTraceType type) const {
+    int num = 0;
+    for ( const SuperpixelMergeTraceEvent &event : events ) {
+      if (event.type == type) {
+        num += 1;
+      }
+    }
+    return num;
+  }
+  
+  // Write one line for each recorded event
+  
+  void print(ostream &os) const {
+    for ( const SuperpixelMergeTraceEvent &event : events ) {
+      switch (event.type) {
+        case SUPERPIXEL_MERGE_TRACE_ALREADY_PROCESSED:
+          os << "superpixel " << event.tag << " is already processed" << endl;
+          break;
+        case SUPERPIXEL_MERGE_TRACE_ALREADY_MERGED:
+          os << "superpixel " << event.tag << " was merged away already" << endl;
+          break;
+        case SUPERPIXEL_MERGE_TRACE_FOUND_NEIGHBORS:
+          os << "found " << event.value << " neighbors of superpixel " << event.tag << endl;
+          break;
+        case SUPERPIXEL_MERGE_TRACE_CHECKED_EDGE:
+          os << "neighbor " << event.neighborTag << " of " << event.tag << " doMerge -> " << event.value << endl;
+          break;
+        case SUPERPIXEL_MERGE_TRACE_MERGED_INTO_NEIGHBOR:
+          os << "superpixel " << event.tag << " was merged into neighbor " << event.neighborTag << endl;
+          break;
+        case SUPERPIXEL_MERGE_TRACE_DONE_PROCESSING:
+          os << "done processing superpixel " << event.tag << " mergedNeighbor -> " << event.value << endl;
+          break;
+      }
+    }
+  }
+  
+  private:
+  
+  void addEvent(SuperpixelMergeTraceType type, int32_t tag, int32_t neighborTag, int32_t value) {
+    SuperpixelMergeTraceEvent event;
+    event.type = type;
+    event.tag = tag;
+    event.neighborTag = neighborTag;
+    event.value = value;
+    events.push_back(event);
+  }
+};
+
+// Parallel body that invokes checkEdge() for every neighbor of the selected
+// superpixels, doMerge is indexed by neighbor in the same order as neighbors.
+
+template <class T>
+class SuperpixelMergeCheckEdgesParallelBody : public cv::ParallelLoopBody
+{
+public:
+  SuperpixelMergeCheckEdgesParallelBody(T &_mergeManager,
+                                        const vector<int32_t> &_selected,
+                                        const vector<vector<int32_t> > &_neighbors,
+                                        vector<vector<uint8_t> > &_doMerge)
+  : mergeManager(_mergeManager), selected(_selected), neighbors(_neighbors), doMerge(_doMerge) {}
+  
+  void operator()(const cv::Range& range) const {
+    for ( int i = range.start; i < range.end; i++ ) {
+      int32_t tag = selected[i];
+      const vector<int32_t> &neighborTags = neighbors[i];
+      vector<uint8_t> &results = doMerge[i];
+      
+      results.resize(neighborTags.size());
+      
+      for ( int j = 0; j < (int) neighborTags.size(); j++ ) {
+        results[j] = mergeManager.checkEdge(tag, neighborTags[j]) ? 1 : 0;
+      }
+    }
+  }
+  
+private:
+  T &mergeManager;
+  const vector<int32_t> &selected;
+  const vector<vector<int32_t> > &neighbors;
+  vector<vector<uint8_t> > &doMerge;
+};
+
+// Merge loop for a manager with orderInsensitive set. Each round selects the
+// pending superpixels in order such that no two selected superpixels are
+// neighbors or share a neighbor, so a merge done for one selected superpixel
+// can not change the neighbors of another one. The edges of all the selected
+// superpixels are checked in parallel and then the merges are done in order
+// on this thread, an edge of a superpixel that already merged a neighbor in
+// this round is checked again after that merge. As in SuperpixelMergeManagerFunc(), a superpixel that merged
+// a neighbor is processed again and one that did not merge is done. Pending
+// superpixels that were not selected are left for the next round.
+
+template <class T, class Trace>
+int SuperpixelMergeManagerParallelFunc(T & mergeManager, Trace & trace) {
+  mergeManager.setup();
+  
+  SuperpixelImage &spImage = mergeManager.spImage;
+  
+  vector<int32_t> pending = mergeManager.superpixels;
+  
+  unordered_set<int32_t> started;
+  
+  vector<int32_t> selected;
+  vector<vector<int32_t> > neighbors;
+  vector<vector<uint8_t> > doMerge;
+  
+  while (!pending.empty()) {
+    // Select superpixels whose tag and neighbors are not already claimed
+    
+    unordered_set<int32_t> claimed;
+    vector<int32_t> nextPending;
+    
+    selected.clear();
+    neighbors.clear();
+    
+    for ( int32_t tag : pending ) {
+      if (mergeManager.checkProcessed(tag) == false) {
+        trace.alreadyProcessed(tag);
+        continue;
+      }
+      
+      if (spImage.getSuperpixelPtr(tag) == NULL) {
+        trace.alreadyMerged(tag);
+        continue;
+      }
+      
+      if (claimed.count(tag) > 0) {
+        nextPending.push_back(tag);
+        continue;
+      }
+      
+      auto &neighborsSet = spImage.edgeTable.getNeighborsSet(tag);
+      
+      bool isClaimed = false;
+      
+      for ( int32_t neighborTag : neighborsSet ) {
+        if (claimed.count(neighborTag) > 0) {
+          isClaimed = true;
+          break;
+        }
+      }
+      
+      if (isClaimed) {
+        nextPending.push_back(tag);
+        continue;
+      }
+      
+      claimed.insert(tag);
+      claimed.insert(neighborsSet.begin(), neighborsSet.end());
+      
+      if (started.count(tag) == 0) {
+        started.insert(tag);
+        mergeManager.startProcessing(tag);
+      }
+      
+      trace.foundNeighbors(tag, (int) neighborsSet.size());
+      
+      selected.push_back(tag);
+      neighbors.push_back(vector<int32_t>(neighborsSet.begin(), neighborsSet.end()));
+    }
+    
+    // Check the edges of the selected superpixels in parallel
+    
+    doMerge.clear();
+    doMerge.resize(selected.size());
+    
+    parallelFor(Range(0, (int) selected.size()), SuperpixelMergeCheckEdgesParallelBody<T>(mergeManager, selected, neighbors, doMerge));
+    
+    // Do the merges in order, a superpixel that merged a neighbor is pending again.
+    // A parallel result is only valid until the first merge into tag, once tag has
+    // changed the remaining edges are checked again on this thread.
+    
+    vector<int32_t> repeatPending;
+    
+    for ( int i = 0; i < (int) selected.size(); i++ ) {
+      int32_t tag = selected[i];
+      bool mergedNeighbor = false;
+      
+      for ( int j = 0; j < (int) neighbors[i].size(); j++ ) {
+        int32_t neighborTag = neighbors[i][j];
+        
+        bool doMergeEdge = mergedNeighbor ? mergeManager.checkEdge(tag, neighborTag) : (doMerge[i][j] != 0);
+        
+        trace.checkedEdge(tag, neighborTag, doMergeEdge);
+        
+        if (doMergeEdge) {
+          SuperpixelEdge edge(tag, neighborTag);
+          mergeManager.mergeEdge(edge);
+          
+          if (spImage.getSuperpixelPtr(tag) == NULL) {
+            trace.mergedIntoNeighbor(tag, neighborTag);
+            
+            mergeManager.mergedInto(neighborTag);
+            break;
+          } else {
+            mergedNeighbor = true;
+            mergeManager.mergedInto(tag);
+          }
+        }
+      }
+      
+      trace.doneProcessing(tag, mergedNeighbor);
+      
+      if (mergedNeighbor) {
+        repeatPending.push_back(tag);
+      } else {
+        mergeManager.doneProcessing(tag);
+      }
+    }
+    
+    // Repeated superpixels go before the ones that were not selected, this is
+    // the same order as the serial loop.
+    
+    repeatPending.insert(repeatPending.end(), nextPending.begin(), nextPending.end());
+    pending.swap(repeatPending);
+  }
+  
+  mergeManager.finish();
+  
+  return mergeManager.mergeStep;
+}
+
 // The process of merging superpixels depends on some tricky state
 // and looping logic. This generic templated class make use of
 // a class known to implement the abstract API defined by
-// SuperpixelMergeManager to process merge operations.
-
-template <class T>
-int SuperpixelMergeManagerFunc(T & mergeManager) {
-  const bool debug = true;
+// SuperpixelMergeManager to process merge operations. Each step
+// of the loop is reported to trace, see SuperpixelMergeNoTrace.
+// A manager that declares orderInsensitive is run with
+// SuperpixelMergeManagerParallelFunc() instead.
 
+template <class T, class Trace>
+int SuperpixelMergeManagerFunc(T & mergeManager, Trace & trace) {
+  if (T::orderInsensitive) {
+    return SuperpixelMergeManagerParallelFunc(mergeManager, trace);
+  }
+  
   // Setup does one time init and cache logic
   
   mergeManager.setup();
@@ -119,9 +511,7 @@ int SuperpixelMergeManagerFunc(T & mergeManager) {
     int32_t tag = *it;
     
     if (mergeManager.checkProcessed(tag) == false) {
-      if (debug) {
-        cout << "superpixel " << tag << " is already processed" << endl;
-      }
+      trace.alreadyProcessed(tag);
       
       ++it;
       continue;
@@ -133,9 +523,7 @@ int SuperpixelMergeManagerFunc(T & mergeManager) {
       // Check for the edge case of this superpixel being merged into a neighbor as a result
       // of a previous iteration.
       
-      if (debug) {
-        cout << "superpixel " << tag << " was merged away already" << endl;
-      }
+      trace.alreadyMerged(tag);
       
       ++it;
       continue;
@@ -150,13 +538,7 @@ int SuperpixelMergeManagerFunc(T & mergeManager) {
     
     auto &neighborsSet = mergeManager.spImage.edgeTable.getNeighborsSet(tag);
     
-    if (debug) {
-      cout << "found " << neighborsSet.size() << " neighbors of superpixel " << tag << endl;
-      
-      for ( int32_t neighborTag : neighborsSet ) {
-        cout << "neighbor " << neighborTag << endl;
-      }
-    }
+    trace.foundNeighbors(tag, (int) neighborsSet.size());
     
     bool mergedNeighbor = false;
     
@@ -167,15 +549,9 @@ int SuperpixelMergeManagerFunc(T & mergeManager) {
       
       bool doMerge = mergeManager.checkEdge(tag, neighborTag);
       
-      if (debug) {
-        cout << "neighbor " << neighborTag << " doMerge -> " << doMerge << endl;
-      }
+      trace.checkedEdge(tag, neighborTag, doMerge);
       
       if (doMerge) {
-        if (debug) {
-          cout << "found superpixels " << tag << " and " << neighborTag << " (merging)" << endl;
-        }
-
         SuperpixelEdge edge(tag, neighborTag);
         mergeManager.mergeEdge(edge);
         
@@ -183,9 +559,7 @@ int SuperpixelMergeManagerFunc(T & mergeManager) {
           // In the case where the identical superpixel was merged into a neighbor then
           // the neighbors have changed and this iteration has to end.
           
-          if (debug) {
-            cout << "ending neighbors iteration since " << tag << " was merged into larger neighbor " << neighborTag << endl;
-          }
+          trace.mergedIntoNeighbor(tag, neighborTag);
           
           mergeManager.mergedInto(neighborTag);
           break;
@@ -197,15 +571,11 @@ int SuperpixelMergeManagerFunc(T & mergeManager) {
       }
     } // end foreach neighbors loop
     
+    trace.doneProcessing(tag, mergedNeighbor);
+    
     if (mergedNeighbor) {
-      if (debug) {
-        cout << "repeating merge loop for superpixel " << tag << " since neighbor was merged" << endl;
-      }
+      // Repeat merge loop for this superpixel since a neighbor was merged
     } else {
-      if (debug) {
-        cout << "advance iterator from superpixel " << tag << " since no neighbor was merged" << endl;
-      }
-
       mergeManager.doneProcessing(tag);
       
       ++it;
@@ -219,4 +589,12 @@ int SuperpixelMergeManagerFunc(T & mergeManager) {
   return mergeManager.mergeStep;
 }
 
+// Run the merge loop without a trace
+
+template <class T>
+int SuperpixelMergeManagerFunc(T & mergeManager) {
+  SuperpixelMergeNoTrace trace;
+  return SuperpixelMergeManagerFunc(mergeManager, trace);
+}
+
 #endif /* SuperpixelMergeManager_hpp */
@@ -0,0 +1,121 @@
+// Merge tree over the superpixels of an image, see SuperpixelMergeTree.h
+
+#include "SuperpixelMergeTree.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include "SuperpixelImage.h"
+
+using namespace std;
+
+void SuperpixelMergeTree::start(const SuperpixelImage &spImage)
+{
+  const set<int32_t> &superpixels = spImage.getSuperpixelsRef();
+
+  leafTags.assign(superpixels.begin(), superpixels.end());
+
+  const int32_t numLeaves = (int32_t) leafTags.size();
+
+  parents.assign(numLeaves, -1);
+  costs.assign(numLeaves, 0.0f);
+  nodeTags = leafTags;
+
+  tagToNode.clear();
+  tagToNode.reserve(numLeaves);
+
+  for ( int32_t node = 0; node < numLeaves; node++ ) {
+    tagToNode[leafTags[node]] = node;
+  }
+}
+
+void SuperpixelMergeTree::addMerge(int32_t srcTag, int32_t dstTag, float cost)
+{
+  auto srcIt = tagToNode.find(srcTag);
+  auto dstIt = tagToNode.find(dstTag);
+
+  if (srcIt == tagToNode.end() || dstIt == tagToNode.end()) {
+    // The tree was started after one of these superpixels was created
+    assert(0);
+    return;
+  }
+
+  const int32_t srcNode = srcIt->second;
+  const int32_t dstNode = dstIt->second;
+  const int32_t node = (int32_t) parents.size();
+
+  if (cost < 0.0f) {
+    cost = (float) getNumMerges();
+  }
+
+  parents[srcNode] = node;
+  parents[dstNode] = node;
+
+  parents.push_back(-1);
+  costs.push_back(max(cost, max(costs[srcNode], costs[dstNode])));
+  nodeTags.push_back(dstTag);
+
+  dstIt->second = node;
+  tagToNode.erase(srcIt);
+}
+
+// A node is merged into the merged node that is furthest up the tree, a parent
+// is always created after its children so the nodes are visited top down by
+// iterating backwards.
+
+template <typename F>
+int SuperpixelMergeTree::cut(F isMerged, vector<int32_t> &regionTags) const
+{
+  const int32_t numNodes = (int32_t) parents.size();
+  const int32_t numLeaves = (int32_t) leafTags.size();
+
+  vector<int32_t> topNodes(numNodes);
+
+  int numRegions = 0;
+
+  for ( int32_t node = numNodes - 1; node >= 0; node-- ) {
+    const int32_t parent = parents[node];
+
+    if (parent != -1 && isMerged(parent)) {
+      topNodes[node] = topNodes[parent];
+    } else {
+      topNodes[node] = node;
+      // An unmerged internal node or leaf is the top of one region
+      if (node < numLeaves || isMerged(node)) {
+        numRegions += 1;
+      }
+    }
+  }
+
+  regionTags.resize(numLeaves);
+
+  for ( int32_t leaf = 0; leaf < numLeaves; leaf++ ) {
+    regionTags[leaf] = nodeTags[topNodes[leaf]];
+  }
+
+  return numRegions;
+}
+
+int SuperpixelMergeTree::cutByRegionCount(int numRegions, vector<int32_t> &regionTags) const
+{
+  const int32_t numLeaves = (int32_t) leafTags.size();
+  const int32_t numMerges = min((int32_t) getNumMerges(), max(numLeaves - numRegions, 0));
+
+  // The merges before numMerges are done
+
+  const int32_t endNode = numLeaves + numMerges;
+
+  return cut([endNode](int32_t node) {
+    return node < endNode;
+  }, regionTags);
+}
+
+int SuperpixelMergeTree::cutByCost(float maxCost, vector<int32_t> &regionTags) const
+{
+  const vector<float> &costs = this->costs;
+
+  return cut([&costs, maxCost](int32_t node) {
+    return costs[node] <= maxCost;
+  }, regionTags);
+}
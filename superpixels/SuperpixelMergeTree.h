@@ -0,0 +1,91 @@
+// A merge tree (dendrogram) records the merges done by SuperpixelImage::mergeEdge()
+// as a binary tree over the superpixels that the tree was started from, so
+// that a segmentation at any granularity can be cut from one run of the merge
+// passes. Each leaf is one of the starting superpixels and each merge adds a
+// node with the two merged nodes as children. The cost of a node is the merge
+// cost passed to mergeEdge(), raised to the cost of its children so that the
+// costs never decrease going up the tree. A merge without a cost gets the
+// number of merges before it as the cost, so a cost cut is only meaningful
+// when every merge had a cost, a cut by the number of regions always works.
+//
+// Both cuts are linear in the number of nodes. A cut returns the region tag
+// of each leaf, the tag of the superpixel the leaf was merged into.
+
+#ifndef SUPERPIXEL_MERGE_TREE_H
+#define	SUPERPIXEL_MERGE_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+class SuperpixelImage;
+
+class SuperpixelMergeTree {
+public:
+  // Start a tree with the current superpixels of spImage as the leaves, any
+  // nodes from a previous start are discarded.
+
+  void start(const SuperpixelImage &spImage);
+
+  // Record src merged into dst, a negative cost means the merge has no cost
+
+  void addMerge(int32_t srcTag, int32_t dstTag, float cost);
+
+  // Leaf tags in increasing order, a cut returns a region tag for each
+
+  const std::vector<int32_t> & getLeafTags() const {
+    return leafTags;
+  }
+
+  size_t getNumLeaves() const {
+    return leafTags.size();
+  }
+
+  size_t getNumMerges() const {
+    return parents.size() - leafTags.size();
+  }
+
+  // Cost of the node created by merge i, merges are in the order they were done
+
+  float getMergeCost(size_t i) const {
+    return costs[leafTags.size() + i];
+  }
+
+  // The segmentation after the merges that leave numRegions regions, or the
+  // final segmentation when fewer merges were done. Returns the number of
+  // regions.
+
+  int cutByRegionCount(int numRegions, std::vector<int32_t> &regionTags) const;
+
+  // The segmentation with only the merges with a cost less than or equal to
+  // maxCost. Returns the number of regions.
+
+  int cutByCost(float maxCost, std::vector<int32_t> &regionTags) const;
+
+private:
+  std::vector<int32_t> leafTags;
+
+  // Node arrays, the leaves come first and then one node for each merge. The
+  // parent is -1 for a node that was not merged.
+
+  std::vector<int32_t> parents;
+  std::vector<float> costs;
+
+  // Tag of the superpixel a node was merged into, this is the leaf tag for a leaf
+
+  std::vector<int32_t> nodeTags;
+
+  // Current node of each superpixel that was not merged away
+
+  std::unordered_map<int32_t, int32_t> tagToNode;
+
+  // Region tags of the leaves when the nodes for which isMerged(node) is true
+  // are the merges that were done.
+
+  template <typename F>
+  int cut(F isMerged, std::vector<int32_t> &regionTags) const;
+};
+
+#endif // SUPERPIXEL_MERGE_TREE_H
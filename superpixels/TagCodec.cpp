@@ -0,0 +1,446 @@
+// Tags image codec, see TagCodec.h
+
+#include "TagCodec.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <fstream>
+
+#include "OpenCVUtil.h"
+#include "Util.h"
+
+using namespace cv;
+using namespace std;
+
+static inline
+void appendTagCodecVarint(vector<uint8_t> &tokens, uint32_t value)
+{
+  while (value >= 0x80) {
+    tokens.push_back((uint8_t) (value | 0x80));
+    value >>= 7;
+  }
+  tokens.push_back((uint8_t) value);
+}
+
+static inline
+bool readTagCodecVarint(const uint8_t *&ptr, const uint8_t *endPtr, uint32_t &value)
+{
+  value = 0;
+
+  for ( int shift = 0; shift < 32; shift += 7 ) {
+    if (ptr == endPtr) {
+      return false;
+    }
+    uint8_t byte = *ptr++;
+    value |= ((uint32_t) (byte & 0x7F)) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static inline
+void appendTagCodecToken(vector<uint8_t> &tokens, TagCodecTokenKind kind, uint32_t count)
+{
+  appendTagCodecVarint(tokens, (count << 2) | (uint32_t) kind);
+}
+
+// Residual bytes of a literal tag, the low bytesPerTag bytes of the residual
+
+static inline
+void appendTagCodecResidual(vector<uint8_t> &tokens, uint32_t residual, int bytesPerTag)
+{
+  for ( int i = 0; i < bytesPerTag; i++ ) {
+    tokens.push_back((uint8_t) (residual >> (i * 8)));
+  }
+}
+
+// Tokens for one row, upRow is NULL for the first row of a band. The run that
+// covers the most tags is taken at each position, a literal token covers the
+// tags that neither the left tag nor the tag above predicts.
+
+static
+void encodeTagCodecRow(const uint32_t *row, const uint32_t *upRow, int width, int bytesPerTag, vector<uint8_t> &tokens)
+{
+  int x = 0;
+
+  while (x < width) {
+    int leftRun = 0;
+    if (x > 0) {
+      const uint32_t leftTag = row[x - 1];
+      while ((x + leftRun) < width && row[x + leftRun] == leftTag) {
+        leftRun++;
+      }
+    }
+
+    int upRun = 0;
+    if (upRow != NULL) {
+      while ((x + upRun) < width && row[x + upRun] == upRow[x + upRun]) {
+        upRun++;
+      }
+    }
+
+    if (leftRun > 0 && leftRun >= upRun) {
+      appendTagCodecToken(tokens, TAG_CODEC_TOKEN_LEFT, leftRun);
+      x += leftRun;
+    } else if (upRun > 0) {
+      appendTagCodecToken(tokens, TAG_CODEC_TOKEN_UP, upRun);
+      x += upRun;
+    } else {
+      int numLiterals = 1;
+      while ((x + numLiterals) < width &&
+             row[x + numLiterals] != row[x + numLiterals - 1] &&
+             (upRow == NULL || row[x + numLiterals] != upRow[x + numLiterals])) {
+        numLiterals++;
+      }
+
+      appendTagCodecToken(tokens, TAG_CODEC_TOKEN_LITERAL, numLiterals);
+
+      for ( int i = x; i < (x + numLiterals); i++ ) {
+        const uint32_t predTag = (i > 0) ? row[i - 1] : ((upRow != NULL) ? upRow[i] : 0);
+        appendTagCodecResidual(tokens, predict_trivial_component_sub(row[i], predTag), bytesPerTag);
+      }
+
+      x += numLiterals;
+    }
+  }
+}
+
+// Decode the tokens of one row, returns false if the tokens do not fill the
+// row exactly or refer to a tag that does not exist.
+
+static
+bool decodeTagCodecRow(const uint8_t *&ptr, const uint8_t *endPtr, uint32_t *row, const uint32_t *upRow, int width, int bytesPerTag)
+{
+  int x = 0;
+
+  while (x < width) {
+    uint32_t token;
+    if (!readTagCodecVarint(ptr, endPtr, token)) {
+      return false;
+    }
+
+    const uint32_t kind = token & 0x3;
+    const uint32_t count = token >> 2;
+
+    if (count == 0 || count > (uint32_t) (width - x)) {
+      return false;
+    }
+
+    const int endX = x + (int) count;
+
+    if (kind == TAG_CODEC_TOKEN_LEFT) {
+      if (x == 0) {
+        return false;
+      }
+      const uint32_t leftTag = row[x - 1];
+      for ( ; x < endX; x++ ) {
+        row[x] = leftTag;
+      }
+    } else if (kind == TAG_CODEC_TOKEN_UP) {
+      if (upRow == NULL) {
+        return false;
+      }
+      for ( ; x < endX; x++ ) {
+        row[x] = upRow[x];
+      }
+    } else if (kind == TAG_CODEC_TOKEN_LITERAL) {
+      if ((size_t) (endPtr - ptr) < ((size_t) count * bytesPerTag)) {
+        return false;
+      }
+      for ( ; x < endX; x++ ) {
+        uint32_t residual = 0;
+        for ( int i = 0; i < bytesPerTag; i++ ) {
+          residual |= ((uint32_t) *ptr++) << (i * 8);
+        }
+        const uint32_t predTag = (x > 0) ? row[x - 1] : ((upRow != NULL) ? upRow[x] : 0);
+        row[x] = predict_trivial_component_add(predTag, residual);
+      }
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Encode each band into its own deflated buffer
+
+class EncodeTagBandsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  EncodeTagBandsParallelBody(const Mat &_tagsImg, int _bandRows, vector<vector<uint8_t> > &_bandDeflated, vector<uint32_t> &_bandTokensSize)
+  : tagsImg(_tagsImg), bandRows(_bandRows), bandDeflated(_bandDeflated), bandTokensSize(_bandTokensSize) {}
+
+  void operator()(const cv::Range& range) const {
+    for ( int band = range.start; band < range.end; band++ ) {
+      encodeBand(band);
+    }
+  }
+
+private:
+  const Mat &tagsImg;
+  int bandRows;
+  vector<vector<uint8_t> > &bandDeflated;
+  vector<uint32_t> &bandTokensSize;
+
+  void encodeBand(int band) const {
+    const int width = tagsImg.cols;
+    const int bytesPerTag = (tagsImg.type() == CV_32SC1) ? 4 : 3;
+    const int startY = band * bandRows;
+    const int endY = mini(tagsImg.rows, startY + bandRows);
+
+    // A packed CV_8UC3 row is only valid until the next row is packed into
+    // the same buffer, so the rows alternate between two buffers.
+
+    vector<uint32_t> rowBuffers(width * 2);
+
+    vector<uint8_t> tokens;
+    tokens.reserve(width * 2);
+
+    const uint32_t *upRow = NULL;
+
+    for ( int y = startY; y < endY; y++ ) {
+      const uint32_t *row = readTagsRow(tagsImg, y, &rowBuffers[(y & 1) * width]);
+      encodeTagCodecRow(row, upRow, width, bytesPerTag, tokens);
+      upRow = row;
+    }
+
+    vector<uint8_t> &deflated = bandDeflated[band];
+
+    uLongf deflatedSize = compressBound((uLong) tokens.size());
+    deflated.resize(deflatedSize);
+
+    if (compress2(deflated.data(), &deflatedSize, tokens.data(), (uLong) tokens.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+      deflated.clear();
+      bandTokensSize[band] = 0;
+      return;
+    }
+
+    deflated.resize(deflatedSize);
+    bandTokensSize[band] = (uint32_t) tokens.size();
+  }
+};
+
+// Decode each band into its rows of tagsImg, bandWorked is set to 0 when a
+// band is not valid.
+
+class DecodeTagBandsParallelBody : public cv::ParallelLoopBody
+{
+public:
+  DecodeTagBandsParallelBody(const uint8_t *_encoded, const TagCodecHeader &_header, const TagCodecBand *_bands, Mat &_tagsImg, vector<uint8_t> &_bandWorked)
+  : encoded(_encoded), header(_header), bands(_bands), tagsImg(_tagsImg), bandWorked(_bandWorked) {}
+
+  void operator()(const cv::Range& range) const {
+    for ( int band = range.start; band < range.end; band++ ) {
+      bandWorked[band] = decodeBand(band) ? 1 : 0;
+    }
+  }
+
+private:
+  const uint8_t *encoded;
+  const TagCodecHeader &header;
+  const TagCodecBand *bands;
+  Mat &tagsImg;
+  vector<uint8_t> &bandWorked;
+
+  bool decodeBand(int band) const {
+    const TagCodecBand &bandInfo = bands[band];
+
+    vector<uint8_t> tokens(bandInfo.tokensSize);
+    uLongf tokensSize = bandInfo.tokensSize;
+
+    if (uncompress(tokens.data(), &tokensSize, encoded + bandInfo.offset, bandInfo.deflatedSize) != Z_OK ||
+        tokensSize != bandInfo.tokensSize) {
+      return false;
+    }
+
+    const int width = header.width;
+    const int bytesPerTag = (int) header.bytesPerTag;
+    const int startY = band * (int) header.bandRows;
+    const int endY = mini(header.height, startY + (int) header.bandRows);
+    const bool packed = (tagsImg.type() == CV_8UC3);
+
+    vector<uint32_t> rowBuffers(packed ? (width * 2) : 0);
+
+    const uint8_t *ptr = tokens.data();
+    const uint8_t *endPtr = ptr + tokens.size();
+
+    const uint32_t *upRow = NULL;
+
+    for ( int y = startY; y < endY; y++ ) {
+      uint32_t *row = packed ? &rowBuffers[(y & 1) * width] : tagsImg.ptr<uint32_t>(y);
+
+      if (!decodeTagCodecRow(ptr, endPtr, row, upRow, width, bytesPerTag)) {
+        return false;
+      }
+
+      if (packed) {
+        unpackPixelRow(row, tagsImg.ptr<uint8_t>(y), width);
+      }
+
+      upRow = row;
+    }
+
+    return (ptr == endPtr);
+  }
+};
+
+bool encodeTagsImage(const Mat &tagsImg, vector<uint8_t> &encoded, int bandRows)
+{
+  encoded.clear();
+
+  if (!isTagsImageType(tagsImg) || tagsImg.empty() || tagsImg.cols >= (1 << 29)) {
+    cerr << "error : tags image to encode must be a CV_8UC3 or CV_32SC1 Mat" << endl;
+    return false;
+  }
+
+  bandRows = maxi(bandRows, 1);
+
+  const int numBands = (tagsImg.rows + bandRows - 1) / bandRows;
+
+  vector<vector<uint8_t> > bandDeflated(numBands);
+  vector<uint32_t> bandTokensSize(numBands, 0);
+
+  parallelFor(Range(0, numBands), EncodeTagBandsParallelBody(tagsImg, bandRows, bandDeflated, bandTokensSize));
+
+  TagCodecHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TAG_CODEC_MAGIC, sizeof(header.magic));
+  header.version = TAG_CODEC_VERSION;
+  header.headerSize = sizeof(TagCodecHeader);
+  header.width = tagsImg.cols;
+  header.height = tagsImg.rows;
+  header.bytesPerTag = (tagsImg.type() == CV_32SC1) ? 4 : 3;
+  header.bandRows = bandRows;
+  header.numBands = numBands;
+
+  vector<TagCodecBand> bands(numBands);
+
+  uint64_t offset = sizeof(TagCodecHeader) + (uint64_t) numBands * sizeof(TagCodecBand);
+
+  for ( int band = 0; band < numBands; band++ ) {
+    if (bandDeflated[band].empty()) {
+      cerr << "error : could not deflate band " << band << " of the tags image" << endl;
+      return false;
+    }
+    bands[band].offset = offset;
+    bands[band].deflatedSize = (uint32_t) bandDeflated[band].size();
+    bands[band].tokensSize = bandTokensSize[band];
+    offset += bands[band].deflatedSize;
+  }
+
+  header.encodedSize = offset;
+
+  encoded.resize((size_t) offset);
+
+  uint8_t *outPtr = encoded.data();
+
+  memcpy(outPtr, &header, sizeof(header));
+  outPtr += sizeof(header);
+  memcpy(outPtr, bands.data(), bands.size() * sizeof(TagCodecBand));
+  outPtr += bands.size() * sizeof(TagCodecBand);
+
+  for ( int band = 0; band < numBands; band++ ) {
+    memcpy(outPtr, bandDeflated[band].data(), bandDeflated[band].size());
+    outPtr += bandDeflated[band].size();
+  }
+
+  return true;
+}
+
+bool decodeTagsImage(const uint8_t *encoded, size_t numBytes, Mat &tagsImg)
+{
+  if (numBytes < sizeof(TagCodecHeader)) {
+    cerr << "error : encoded tags are too small to hold a header" << endl;
+    return false;
+  }
+
+  TagCodecHeader header;
+  memcpy(&header, encoded, sizeof(header));
+
+  if (memcmp(header.magic, TAG_CODEC_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TAG_CODEC_VERSION || header.headerSize != sizeof(TagCodecHeader) ||
+      header.encodedSize != numBytes || header.width <= 0 || header.height <= 0 ||
+      header.width >= (1 << 29) || (header.bytesPerTag != 3 && header.bytesPerTag != 4) ||
+      header.bandRows == 0 || header.numBands != (((uint64_t) header.height + header.bandRows - 1) / header.bandRows)) {
+    cerr << "error : encoded tags do not have a valid header" << endl;
+    return false;
+  }
+
+  const uint64_t bandsEnd = sizeof(TagCodecHeader) + (uint64_t) header.numBands * sizeof(TagCodecBand);
+
+  if (bandsEnd > numBytes) {
+    cerr << "error : encoded tags band table does not fit" << endl;
+    return false;
+  }
+
+  vector<TagCodecBand> bands(header.numBands);
+  memcpy(bands.data(), encoded + sizeof(TagCodecHeader), bands.size() * sizeof(TagCodecBand));
+
+  for ( const TagCodecBand &band : bands ) {
+    if (band.offset < bandsEnd || band.offset > numBytes || band.deflatedSize > (numBytes - band.offset)) {
+      cerr << "error : encoded tags band does not fit" << endl;
+      return false;
+    }
+  }
+
+  tagsImg.create(header.height, header.width, (header.bytesPerTag == 4) ? CV_32SC1 : CV_8UC3);
+
+  vector<uint8_t> bandWorked(header.numBands, 0);
+
+  parallelFor(Range(0, (int) header.numBands), DecodeTagBandsParallelBody(encoded, header, bands.data(), tagsImg, bandWorked));
+
+  for ( uint32_t band = 0; band < header.numBands; band++ ) {
+    if (!bandWorked[band]) {
+      cerr << "error : encoded tags band " << band << " is not valid" << endl;
+      tagsImg.release();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool writeTagsFile(const string &filename, const Mat &tagsImg)
+{
+  vector<uint8_t> encoded;
+
+  if (!encodeTagsImage(tagsImg, encoded)) {
+    return false;
+  }
+
+  std::ofstream outFile(filename.c_str(), std::ios::binary | std::ios::trunc);
+
+  if (!outFile) {
+    cerr << "error : could not open tags file \"" << filename << "\" for writing" << endl;
+    return false;
+  }
+
+  outFile.write((const char*) encoded.data(), (std::streamsize) encoded.size());
+  outFile.close();
+
+  if (!outFile) {
+    cerr << "error : could not write tags file \"" << filename << "\"" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool readTagsFile(const string &filename, Mat &tagsImg)
+{
+  std::ifstream inFile(filename.c_str(), std::ios::binary);
+
+  if (!inFile) {
+    cerr << "error : could not open tags file \"" << filename << "\"" << endl;
+    return false;
+  }
+
+  vector<uint8_t> encoded((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
+
+  return decodeTagsImage(encoded.data(), encoded.size(), tagsImg);
+}
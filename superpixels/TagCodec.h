@@ -0,0 +1,77 @@
+// Lossless codec for tags images. A tag is almost always the same as the tag to
+// its left or the tag above it, so each row is coded as tokens that either copy
+// a run of tags from the left or from the row above, or give literal tags as the
+// residual from the left tag via predict_trivial_component_sub(). The tokens of
+// each band of rows are then deflated with zlib. A band does not refer to the
+// rows of another band, so the bands are encoded and decoded in parallel.
+//
+// Layout, all values in little endian byte order:
+//
+// TagCodecHeader
+// TagCodecBand x numBands
+// deflated tokens of each band at the offset given in its TagCodecBand
+//
+// Each token is a varint where the low 2 bits are the kind and the rest is a
+// count of tags, a literal token is followed by count residuals of bytesPerTag
+// bytes each.
+
+#ifndef TAG_CODEC_H
+#define	TAG_CODEC_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define TAG_CODEC_MAGIC "CSTAGCOD"
+#define TAG_CODEC_VERSION 1
+
+#define TAG_CODEC_DEFAULT_BAND_ROWS 64
+
+typedef enum {
+  TAG_CODEC_TOKEN_LEFT = 0,
+  TAG_CODEC_TOKEN_UP = 1,
+  TAG_CODEC_TOKEN_LITERAL = 2
+} TagCodecTokenKind;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  int32_t width;
+  int32_t height;
+  // 3 for a CV_8UC3 tags image, 4 for CV_32SC1
+  uint32_t bytesPerTag;
+  // Rows in each band, the last band can have fewer
+  uint32_t bandRows;
+  uint32_t numBands;
+  uint32_t reserved;
+  uint64_t encodedSize;
+} TagCodecHeader;
+
+typedef struct {
+  // Offset from the start of the encoded data
+  uint64_t offset;
+  uint32_t deflatedSize;
+  uint32_t tokensSize;
+} TagCodecBand;
+
+// Encode a CV_8UC3 or CV_32SC1 tags image, bands of bandRows rows are encoded
+// in parallel. Returns false if the tags image could not be encoded.
+
+bool encodeTagsImage(const cv::Mat &tagsImg, std::vector<uint8_t> &encoded, int bandRows = TAG_CODEC_DEFAULT_BAND_ROWS);
+
+// Decode encoded data back into a tags image of the type that was encoded,
+// returns false if the data is not a valid encoding.
+
+bool decodeTagsImage(const uint8_t *encoded, size_t numBytes, cv::Mat &tagsImg);
+
+// Encode into or decode from a file, returns false on error
+
+bool writeTagsFile(const std::string &filename, const cv::Mat &tagsImg);
+
+bool readTagsFile(const std::string &filename, cv::Mat &tagsImg);
+
+#endif // TAG_CODEC_H
@@ -0,0 +1,158 @@
+// Image copy stored in square tiles, see TiledImage.h
+
+#include "TiledImage.h"
+
+#include <string.h>
+
+#include "OpenCVUtil.h"
+
+using namespace cv;
+using namespace std;
+
+// Copy the rows of each row of tiles, the rows of tiles do not share any bytes
+// so they are copied on multiple threads.
+
+class TiledImageCopyParallelBody : public cv::ParallelLoopBody
+{
+public:
+  TiledImageCopyParallelBody(const Mat &_img, uint8_t *_tiles, int _tileBits, int _tilesPerRow, bool _toTiles)
+  : img(_img), tiles(_tiles), tileBits(_tileBits), tilesPerRow(_tilesPerRow), toTiles(_toTiles) {}
+
+  void operator()(const cv::Range& range) const {
+    const int tileDim = 1 << tileBits;
+    const size_t pixelSize = img.elemSize();
+    const size_t tileBytes = ((size_t) tileDim * tileDim) * pixelSize;
+
+    for ( int ty = range.start; ty < range.end; ty++ ) {
+      const int endY = mini((ty + 1) * tileDim, img.rows);
+
+      for ( int y = ty * tileDim; y < endY; y++ ) {
+        uint8_t *rowPtr = (uint8_t *) img.ptr(y);
+        uint8_t *tileRowPtr = tiles + ((size_t) ty * tilesPerRow) * tileBytes + ((size_t) (y & (tileDim - 1)) << tileBits) * pixelSize;
+
+        for ( int tx = 0; tx < tilesPerRow; tx++ ) {
+          const int x = tx * tileDim;
+          const size_t numBytes = mini(tileDim, img.cols - x) * pixelSize;
+
+          if (toTiles) {
+            memcpy(tileRowPtr, rowPtr + (x * pixelSize), numBytes);
+          } else {
+            memcpy(rowPtr + (x * pixelSize), tileRowPtr, numBytes);
+          }
+
+          tileRowPtr += tileBytes;
+        }
+      }
+    }
+  }
+
+private:
+  const Mat &img;
+  uint8_t *tiles;
+  const int tileBits;
+  const int tilesPerRow;
+  const bool toTiles;
+};
+
+bool TiledImage::create(const Mat &img, int tileDim)
+{
+  if (tileDim != 4 && tileDim != 8) {
+    cerr << "error : TiledImage tile dimension must be 4 or 8 : " << tileDim << endl;
+    return false;
+  }
+
+  if (img.type() != CV_8UC3 && img.type() != CV_32SC1) {
+    cerr << "error : TiledImage image must be CV_8UC3 or CV_32SC1" << endl;
+    return false;
+  }
+
+  cols = img.cols;
+  rows = img.rows;
+  imageType = img.type();
+  tileBits = (tileDim == 8) ? 3 : 2;
+  tilesPerRow = (cols + tileDim - 1) >> tileBits;
+  pixelSize = (int) img.elemSize();
+
+  const int tilesPerColumn = (rows + tileDim - 1) >> tileBits;
+
+  data.assign(((size_t) tilesPerRow * tilesPerColumn) * (tileDim * tileDim) * pixelSize, 0);
+
+  if (!data.empty()) {
+    parallelFor(Range(0, tilesPerColumn), TiledImageCopyParallelBody(img, data.data(), tileBits, tilesPerRow, true));
+  }
+
+  return true;
+}
+
+void TiledImage::release()
+{
+  vector<uint8_t>().swap(data);
+  cols = 0;
+  rows = 0;
+  imageType = -1;
+  tileBits = 0;
+  tilesPerRow = 0;
+  pixelSize = 0;
+}
+
+void TiledImage::gather(const vector<Coord> &coords, Mat &output) const
+{
+  assert(!empty());
+
+  const int numCoords = (int) coords.size();
+
+  output.create(1, numCoords, imageType);
+
+  if (numCoords == 0) {
+    return;
+  }
+
+  if (imageType == CV_8UC3) {
+    Vec3b *outPtr = output.ptr<Vec3b>(0);
+
+    for ( int i = 0; i < numCoords; i++ ) {
+      Coord c = coords[i];
+      outPtr[i] = at<Vec3b>(c.x, c.y);
+    }
+  } else {
+    uint32_t *outPtr = output.ptr<uint32_t>(0);
+
+    for ( int i = 0; i < numCoords; i++ ) {
+      Coord c = coords[i];
+      outPtr[i] = at<uint32_t>(c.x, c.y);
+    }
+  }
+}
+
+void TiledImage::gatherPixels(const vector<Coord> &coords, uint32_t *pixels) const
+{
+  assert(!empty());
+
+  const int numCoords = (int) coords.size();
+
+  if (imageType == CV_32SC1) {
+    for ( int i = 0; i < numCoords; i++ ) {
+      Coord c = coords[i];
+      pixels[i] = at<uint32_t>(c.x, c.y) & 0x00FFFFFF;
+    }
+  } else {
+    for ( int i = 0; i < numCoords; i++ ) {
+      Coord c = coords[i];
+      pixels[i] = Vec3BToUID(at<Vec3b>(c.x, c.y));
+    }
+  }
+}
+
+void TiledImage::copyTo(Mat &img) const
+{
+  if (empty()) {
+    img.release();
+    return;
+  }
+
+  img.create(rows, cols, imageType);
+
+  const int tilesPerColumn = (rows + getTileDim() - 1) >> tileBits;
+
+  parallelFor(Range(0, tilesPerColumn), TiledImageCopyParallelBody(img, (uint8_t *) data.data(), tileBits, tilesPerRow, false));
+}
@@ -0,0 +1,97 @@
+// A TiledImage is a copy of an image stored in square tiles of 4x4 or 8x8
+// pixels. The pixels of a tile are next to each other in memory and the tiles
+// are in raster order, so a gather of a tall narrow region reads one tile for
+// every 4 or 8 rows instead of one cache line and often one page for every row
+// of a row major image. The tiles on the right and bottom are padded with zero
+// pixels. A CV_8UC3 image and a packed CV_32SC1 image from packPixels() can be
+// tiled, see SuperpixelImage::getTiledImage().
+
+#ifndef TILED_IMAGE_H
+#define	TILED_IMAGE_H
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "Coord.h"
+
+#define TILED_IMAGE_DEFAULT_TILE_DIM 4
+
+class TiledImage {
+  public:
+
+  TiledImage()
+  : cols(0), rows(0), imageType(-1), tileBits(0), tilesPerRow(0), pixelSize(0)
+  {
+  }
+
+  // Copy img into tiles of tileDim x tileDim pixels, tileDim must be 4 or 8.
+  // Returns false when tileDim or the image type is not supported.
+
+  bool create(const cv::Mat &img, int tileDim = TILED_IMAGE_DEFAULT_TILE_DIM);
+
+  void release();
+
+  bool empty() const {
+    return data.empty();
+  }
+
+  int getCols() const {
+    return cols;
+  }
+
+  int getRows() const {
+    return rows;
+  }
+
+  int getTileDim() const {
+    return 1 << tileBits;
+  }
+
+  // CV_8UC3 or CV_32SC1, -1 when empty
+
+  int type() const {
+    return imageType;
+  }
+
+  // Offset in pixels of (x, y) from the start of the tiles
+
+  size_t pixelOffset(int x, int y) const {
+    const int tileMask = (1 << tileBits) - 1;
+    const size_t tileOffset = ((size_t) (y >> tileBits) * tilesPerRow) + (x >> tileBits);
+    return (tileOffset << (tileBits * 2)) + ((y & tileMask) << tileBits) + (x & tileMask);
+  }
+
+  template <typename T>
+  const T & at(int x, int y) const {
+    return ((const T *) data.data())[pixelOffset(x, y)];
+  }
+
+  // Copy the pixels at coords into a 1 x N Mat of the image type, the output
+  // is the same as Superpixel::fillMatrixFromCoords() on the row major image.
+
+  void gather(const std::vector<Coord> &coords, cv::Mat &output) const;
+
+  // Read the 24 bit pixel value at each coord, the same values as gatherPixels()
+
+  void gatherPixels(const std::vector<Coord> &coords, uint32_t *pixels) const;
+
+  // Copy the tiles back into a row major Mat
+
+  void copyTo(cv::Mat &img) const;
+
+  private:
+
+  int cols;
+  int rows;
+  int imageType;
+  int tileBits;
+  int tilesPerRow;
+  int pixelSize;
+
+  std::vector<uint8_t> data;
+};
+
+#endif // TILED_IMAGE_H
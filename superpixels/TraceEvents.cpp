@@ -0,0 +1,172 @@
+// Process wide list of trace events written as Chrome trace event JSON
+
+#include "TraceEvents.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef struct {
+  const char *name;
+  int64_t startNanos;
+  int64_t durationNanos;
+  int32_t tag;
+  int64_t size;
+  int threadNum;
+} TraceEvent;
+
+static atomic<bool> traceEnabled(false);
+static once_flag traceInitFlag;
+
+static mutex traceMutex;
+static vector<TraceEvent> traceEvents;
+
+// Event times are relative to the first time tracing was checked
+
+static std::chrono::steady_clock::time_point traceStartTime;
+
+static atomic<int> traceNumThreads(0);
+
+static string traceOutputPath;
+
+static void writeTraceEventsAtExit()
+{
+  FILE *fp = fopen(traceOutputPath.c_str(), "w");
+
+  if (fp == NULL) {
+    fprintf(stderr, "could not write trace events to \"%s\"\n", traceOutputPath.c_str());
+    return;
+  }
+
+  writeTraceEventsJSON(fp);
+  fclose(fp);
+}
+
+// Check the environment once, the first time any trace method is invoked
+
+static void initTraceEvents()
+{
+  traceStartTime = std::chrono::steady_clock::now();
+
+  const char *path = getenv("SEGMENTATION_TRACE");
+
+  if (path != NULL && *path != '\0') {
+    traceOutputPath = path;
+    traceEnabled = true;
+    atexit(writeTraceEventsAtExit);
+  }
+}
+
+void setTraceEventsEnabled(bool enable)
+{
+  call_once(traceInitFlag, initTraceEvents);
+  traceEnabled = enable;
+}
+
+bool isTraceEventsEnabled()
+{
+  call_once(traceInitFlag, initTraceEvents);
+  return traceEnabled;
+}
+
+// Small number for each thread in the order the threads first record an event
+
+static int traceThreadNum()
+{
+  static thread_local int threadNum = -1;
+
+  if (threadNum == -1) {
+    threadNum = traceNumThreads++;
+  }
+
+  return threadNum;
+}
+
+void addTraceEvent(const char *name,
+                   std::chrono::steady_clock::time_point startTime,
+                   std::chrono::steady_clock::time_point endTime,
+                   int32_t tag,
+                   int64_t size)
+{
+  if (!isTraceEventsEnabled()) {
+    return;
+  }
+
+  TraceEvent event;
+  event.name = name;
+  event.startNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(startTime - traceStartTime).count();
+  event.durationNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+  event.tag = tag;
+  event.size = size;
+  event.threadNum = traceThreadNum();
+
+  lock_guard<mutex> lock(traceMutex);
+
+  traceEvents.push_back(event);
+}
+
+void clearTraceEvents()
+{
+  lock_guard<mutex> lock(traceMutex);
+
+  traceEvents.clear();
+}
+
+size_t numTraceEvents()
+{
+  lock_guard<mutex> lock(traceMutex);
+
+  return traceEvents.size();
+}
+
+static void writeTraceJSONString(FILE *fp, const char *str)
+{
+  fputc('"', fp);
+  for ( const char *ptr = str; *ptr != '\0'; ptr++ ) {
+    if (*ptr == '"' || *ptr == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(*ptr, fp);
+  }
+  fputc('"', fp);
+}
+
+// Each event is a complete "X" event with the times in microseconds, the tag
+// and size are written as args so that the viewer shows them for a zone.
+
+void writeTraceEventsJSON(FILE *fp)
+{
+  lock_guard<mutex> lock(traceMutex);
+
+  fprintf(fp, "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [");
+
+  const char *sep = "\n";
+
+  for ( const TraceEvent &event : traceEvents ) {
+    fprintf(fp, "%s    { \"name\": ", sep);
+    writeTraceJSONString(fp, event.name);
+    fprintf(fp, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+            event.threadNum, event.startNanos / 1000.0, event.durationNanos / 1000.0);
+
+    if (event.tag != -1 || event.size != -1) {
+      fprintf(fp, ", \"args\": {");
+      if (event.tag != -1) {
+        fprintf(fp, " \"tag\": %d", event.tag);
+      }
+      if (event.size != -1) {
+        fprintf(fp, "%s \"size\": %lld", (event.tag != -1) ? "," : "", (long long) event.size);
+      }
+      fprintf(fp, " }");
+    }
+
+    fprintf(fp, " }");
+    sep = ",\n";
+  }
+
+  fprintf(fp, "%s]\n}\n", traceEvents.empty() ? "" : "\n  ");
+}
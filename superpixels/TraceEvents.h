@@ -0,0 +1,79 @@
+// Timeline of scoped zones for the segmentation logic. A TraceZone records the
+// wall time between construction and destruction on the current thread along
+// with an optional superpixel tag and region size, so that a slow run can be
+// loaded into a timeline viewer and the zone for a pathological region found
+// directly. The events are written as Chrome trace event JSON, which loads in
+// chrome://tracing and in Perfetto. Tracing is disabled by default, it is
+// enabled by calling setTraceEventsEnabled() or by setting the
+// SEGMENTATION_TRACE environment variable to a file path. With the environment
+// variable the events are written to that path when the process exits.
+
+#ifndef TRACE_EVENTS_H
+#define	TRACE_EVENTS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+
+void setTraceEventsEnabled(bool enable);
+
+bool isTraceEventsEnabled();
+
+// Record a zone that ran from startTime to endTime on this thread. The name
+// must remain valid until the events are written, typically a string literal.
+// A tag or size of -1 is not written with the event.
+
+void addTraceEvent(const char *name,
+                   std::chrono::steady_clock::time_point startTime,
+                   std::chrono::steady_clock::time_point endTime,
+                   int32_t tag = -1,
+                   int64_t size = -1);
+
+// Discard all the recorded events
+
+void clearTraceEvents();
+
+// Number of recorded events
+
+size_t numTraceEvents();
+
+// Write the recorded events as a Chrome trace event JSON object
+
+void writeTraceEventsJSON(FILE *fp);
+
+class TraceZone
+{
+public:
+  explicit TraceZone(const char *name, int32_t tag = -1, int64_t size = -1)
+  : name(name), tag(tag), size(size), enabled(isTraceEventsEnabled())
+  {
+    if (enabled) {
+      startTime = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~TraceZone() {
+    if (enabled) {
+      addTraceEvent(name, startTime, std::chrono::steady_clock::now(), tag, size);
+    }
+  }
+
+  // Set the region size when it is not known as the zone starts
+
+  void setSize(int64_t size) {
+    this->size = size;
+  }
+
+private:
+  const char *name;
+  int32_t tag;
+  int64_t size;
+  bool enabled;
+  std::chrono::steady_clock::time_point startTime;
+
+  TraceZone(const TraceZone &);
+  TraceZone& operator=(const TraceZone &);
+};
+
+#endif // TRACE_EVENTS_H
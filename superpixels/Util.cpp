@@ -2,6 +2,8 @@
 
 #include "Util.h"
 
+#include <algorithm>
+#include <atomic>
 #include <ostream>
 #include <iostream>
 
@@ -17,8 +19,7 @@ using namespace std;
 
 // mean of N values
 
-void sample_mean(vector<float> &values, float *meanPtr) {
-  int len = (int) values.size();
+void sample_mean(const float *values, int len, float *meanPtr) {
   if (len == 0) {
     *meanPtr = 0.0f;
     return;
@@ -28,8 +29,8 @@ void sample_mean(vector<float> &values, float *meanPtr) {
   }
   
   float sum = 0.0f;
-  for (auto it = values.begin(); it != values.end(); ++it) {
-    float val = *it;
+  for (int i = 0; i < len; i++) {
+    float val = values[i];
     sum += val;
   }
   if (sum == 0.0f) {
@@ -39,18 +40,21 @@ void sample_mean(vector<float> &values, float *meanPtr) {
   }
 }
 
+void sample_mean(vector<float> &values, float *meanPtr) {
+  sample_mean(values.data(), (int) values.size(), meanPtr);
+}
+
 // The caller must pass in the mean value calculated via sample_mean()
 
-void sample_mean_delta_squared_div(vector<float> &values, float mean, float *stddevPtr) {
-  int len = (int) values.size();
+void sample_mean_delta_squared_div(const float *values, int len, float mean, float *stddevPtr) {
   if (len == 0 || len == 1) {
     *stddevPtr = 0.0f;
     return;
   }
   
   float sum = 0.0f;
-  for (auto it = values.begin(); it != values.end(); ++it) {
-    float value = *it;
+  for (int i = 0; i < len; i++) {
+    float value = values[i];
     float delta = value - mean;
     sum += (delta * delta);
   }
@@ -61,6 +65,10 @@ void sample_mean_delta_squared_div(vector<float> &values, float mean, float *std
   }
 }
 
+void sample_mean_delta_squared_div(vector<float> &values, float mean, float *stddevPtr) {
+  sample_mean_delta_squared_div(values.data(), (int) values.size(), mean, stddevPtr);
+}
+
 // Util method to return the 8 neighbors of a center point in the order
 // R, U, L, D, UR, UL, DL, DR while taking the image bounds into
 // account. For example, the point (0, 1) will not return UL, L, or DL.
@@ -234,7 +242,7 @@ uint32_t closestToPixel(const vector<uint32_t> &pixels, const uint32_t closeToPi
 // is closest to the given coordinate.
 
 Coord closestToCoord(const vector<Coord> &coords, const Coord &closeToCoord) {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
 #if defined(DEBUG)
   assert(coords.size() > 0);
@@ -298,158 +306,302 @@ vector<uint32_t> generate_cluster_walk_on_center_dist(const vector<uint32_t> &cl
   return generate_cluster_walk_on_center_dist(clusterCenterPixels, 0x0);
 }
 
-vector<uint32_t> generate_cluster_walk_on_center_dist(const vector<uint32_t> &clusterCenterPixels, uint32_t startPixel)
+// Squared 3D distance between the B G R components of two pixels
+
+static inline
+uint32_t pixel_dist_squared(uint32_t p1, uint32_t p2)
 {
-  const bool debugDumpClusterWalk = false;
+  int dB = (int)(p1 & 0xFF) - (int)(p2 & 0xFF);
+  int dG = (int)((p1 >> 8) & 0xFF) - (int)((p2 >> 8) & 0xFF);
+  int dR = (int)((p1 >> 16) & 0xFF) - (int)((p2 >> 16) & 0xFF);
+  return (uint32_t) ((dB * dB) + (dG * dG) + (dR * dR));
+}
+
+// Remaining cluster centers bucketed into cells of 32x32x32 values in the RGB cube.
+// The nearest query visits shells of cells around the cell of the query pixel until
+// no center outside the shells can be closer. Offsets in a cell are kept packed at
+// the front of the cell range so that removing a visited center is a swap.
+
+class ClusterCenterCubeGrid {
+  public:
   
-#if defined(DEBUG)
+  enum {
+    CELL_SHIFT = 5,
+    CELL_SIZE = (1 << CELL_SHIFT),
+    NUM_CELLS_AXIS = (256 >> CELL_SHIFT)
+  };
+  
+  ClusterCenterCubeGrid(const vector<uint32_t> &pixels)
+  : pixels(pixels)
   {
-    unordered_map<uint32_t, bool> seen;
+    const int N = (int) pixels.size();
+    const int numCells = NUM_CELLS_AXIS * NUM_CELLS_AXIS * NUM_CELLS_AXIS;
     
-    int clusteri = 0;
-    for ( uint32_t pixel : clusterCenterPixels ) {
-      if (debugDumpClusterWalk) {
-        fprintf(stderr, "clusterCenterPixels[%5d] = 0x%08X\n", clusteri, clusterCenterPixels[clusteri]);
+    cellStarts.assign(numCells + 1, 0);
+    
+    for ( uint32_t pixel : pixels ) {
+      cellStarts[cellOf(pixel) + 1] += 1;
+    }
+    
+    for ( int i = 1; i <= numCells; i++ ) {
+      cellStarts[i] += cellStarts[i-1];
+    }
+    
+    cellEnds.assign(cellStarts.begin(), cellStarts.end() - 1);
+    cellOffsets.resize(N);
+    positions.resize(N);
+    
+    for ( int i = 0; i < N; i++ ) {
+      int32_t pos = cellEnds[cellOf(pixels[i])]++;
+      cellOffsets[pos] = i;
+      positions[i] = pos;
+    }
+  }
+  
+  void erase(int32_t offset) {
+    const int cell = cellOf(pixels[offset]);
+    const int32_t pos = positions[offset];
+    const int32_t last = --cellEnds[cell];
+    const int32_t lastOffset = cellOffsets[last];
+    cellOffsets[pos] = lastOffset;
+    positions[lastOffset] = pos;
+    cellOffsets[last] = offset;
+    positions[offset] = last;
+  }
+  
+  // Offset of the remaining center closest to pixel, ties resolve to the smallest
+  // offset. Returns -1 when no centers remain.
+  
+  int32_t nearest(uint32_t pixel) const {
+    const int q[3] = { (int)(pixel & 0xFF), (int)((pixel >> 8) & 0xFF), (int)((pixel >> 16) & 0xFF) };
+    const int c[3] = { q[0] >> CELL_SHIFT, q[1] >> CELL_SHIFT, q[2] >> CELL_SHIFT };
+    
+    uint32_t minDist = 0xFFFFFFFF;
+    int32_t minOffset = -1;
+    
+    for ( int r = 0; r < NUM_CELLS_AXIS; r++ ) {
+      for ( int z = c[2] - r; z <= c[2] + r; z++ ) {
+        if (z < 0 || z >= NUM_CELLS_AXIS) {
+          continue;
+        }
+        
+        for ( int y = c[1] - r; y <= c[1] + r; y++ ) {
+          if (y < 0 || y >= NUM_CELLS_AXIS) {
+            continue;
+          }
+          
+          // Only the first and last cell of a row are on the shell unless the
+          // row is on a face of the shell.
+          
+          const bool isFaceRow = (z == c[2] - r) || (z == c[2] + r) || (y == c[1] - r) || (y == c[1] + r);
+          const int xStep = isFaceRow ? 1 : maxi(1, 2 * r);
+          
+          for ( int x = c[0] - r; x <= c[0] + r; x += xStep ) {
+            if (x < 0 || x >= NUM_CELLS_AXIS) {
+              continue;
+            }
+            
+            const int cell = (((z * NUM_CELLS_AXIS) + y) * NUM_CELLS_AXIS) + x;
+            
+            for ( int32_t i = cellStarts[cell]; i < cellEnds[cell]; i++ ) {
+              const int32_t offset = cellOffsets[i];
+              const uint32_t d3 = pixel_dist_squared(pixel, pixels[offset]);
+              
+              if (d3 < minDist || (d3 == minDist && offset < minOffset)) {
+                minDist = d3;
+                minOffset = offset;
+              }
+            }
+          }
+        }
       }
       
-      if (seen.count(pixel) > 0) {
-        assert(0);
+      // Distance from pixel to the closest value in a cell outside the shells
+      // visited so far, sides with no more cells are skipped.
+      
+      bool moreCells = false;
+      int minOutside = 0x7FFFFFFF;
+      
+      for ( int axis = 0; axis < 3; axis++ ) {
+        if (c[axis] - r > 0) {
+          moreCells = true;
+          minOutside = mini(minOutside, q[axis] - ((c[axis] - r) * CELL_SIZE) + 1);
+        }
+        if (c[axis] + r < NUM_CELLS_AXIS - 1) {
+          moreCells = true;
+          minOutside = mini(minOutside, ((c[axis] + r + 1) * CELL_SIZE) - q[axis]);
+        }
+      }
+      
+      if (!moreCells) {
+        break;
+      }
+      
+      if (minOffset != -1 && minDist < (uint32_t) (minOutside * minOutside)) {
+        break;
       }
-      seen[pixel] = true;
-
-      clusteri += 1;
     }
+    
+    return minOffset;
   }
-#endif // DEBUG
   
-  int numClusters = (int) clusterCenterPixels.size();
+  private:
+  
+  const vector<uint32_t> &pixels;
   
-  unordered_map<uint32_t, uint32_t> clusterCenterToClusterOffsetMap;
+  // Remaining offsets for a cell are in the range cellStarts[cell] up to cellEnds[cell]
   
-  int clusteri = 0;
+  vector<int32_t> cellStarts;
   
-  for ( clusteri = 0; clusteri < numClusters; clusteri++) {
-    uint32_t closestToCenterOfMassPixel = clusterCenterPixels[clusteri];
-    clusterCenterToClusterOffsetMap[closestToCenterOfMassPixel] = clusteri;
+  vector<int32_t> cellEnds;
+  
+  vector<int32_t> cellOffsets;
+  
+  // Position of each offset in cellOffsets
+  
+  vector<int32_t> positions;
+  
+  static inline
+  int cellOf(uint32_t pixel) {
+    int B = (pixel & 0xFF) >> CELL_SHIFT;
+    int G = ((pixel >> 8) & 0xFF) >> CELL_SHIFT;
+    int R = ((pixel >> 16) & 0xFF) >> CELL_SHIFT;
+    return (((R * NUM_CELLS_AXIS) + G) * NUM_CELLS_AXIS) + B;
   }
+};
+
+// Each step of the walk moves to the remaining cluster center closest to the current
+// center, a tie is resolved to the smallest cluster offset. Up to 256 clusters the
+// distance from each center to every other center is read from a flat table, larger
+// cluster tables query a ClusterCenterCubeGrid so that a step does not scan all the
+// remaining centers.
+
+vector<uint32_t> generate_cluster_walk_on_center_dist(const vector<uint32_t> &clusterCenterPixels, uint32_t startPixel)
+{
+  const bool debugDumpClusterWalk = false;
   
-  // Reorder the clusters so that the first cluster contains the pixel with the value
-  // that is closest to zero. Then, the next cluster is determined by checking
-  // the distance to the first pixel in the next cluster. The clusters are already
-  // ordered in terms of density so this reordering logic basically jumps from one
-  // cluster to the next in terms of the shortest distance to the next clsuter.
+  const int numClusters = (int) clusterCenterPixels.size();
+  
+#if defined(DEBUG)
+  {
+    // Cluster centers must be unique
+    
+    vector<uint32_t> sortedPixels(clusterCenterPixels);
+    sort(begin(sortedPixels), end(sortedPixels));
+    assert(adjacent_find(begin(sortedPixels), end(sortedPixels)) == end(sortedPixels));
+  }
+#endif // DEBUG
+  
+  if (debugDumpClusterWalk) {
+    for ( int clusteri = 0; clusteri < numClusters; clusteri++ ) {
+      fprintf(stderr, "clusterCenterPixels[%5d] = 0x%08X\n", clusteri, clusterCenterPixels[clusteri]);
+    }
+  }
   
   vector<uint32_t> closestSortedClusterOrder;
   
+  if (numClusters == 0) {
+    return closestSortedClusterOrder;
+  }
+  
   closestSortedClusterOrder.reserve(numClusters);
   
-  if ((1)) {
-    // Choose cluster that is closest to startPixel
-    
-    uint32_t closestToZeroCenter = closestToPixel(clusterCenterPixels, startPixel);
-    
-    int closestToZeroClusteri = -1;
+  // Choose cluster that is closest to startPixel, the first one in the table on a tie
+  
+  int32_t clusteri = 0;
+  uint32_t minDist = pixel_dist_squared(clusterCenterPixels[0], startPixel);
+  
+  for ( int i = 1; i < numClusters && minDist > 0; i++ ) {
+    uint32_t d3 = pixel_dist_squared(clusterCenterPixels[i], startPixel);
+    if (d3 < minDist) {
+      minDist = d3;
+      clusteri = i;
+    }
+  }
+  
+  if (debugDumpClusterWalk) {
+    fprintf(stdout, "closestToZero 0x%08X is in clusteri %d\n", clusterCenterPixels[clusteri], clusteri);
+  }
+  
+  closestSortedClusterOrder.push_back(clusteri);
+  
+  if (numClusters <= 256) {
+    static thread_local vector<uint32_t> distTable;
+    static thread_local vector<int32_t> remaining;
     
-    clusteri = 0;
+    distTable.resize(numClusters * numClusters);
     
-    for ( uint32_t clusterCenter : clusterCenterPixels ) {
-      if (closestToZeroCenter == clusterCenter) {
-        closestToZeroClusteri = clusteri;
-        break;
+    for ( int i = 0; i < numClusters; i++ ) {
+      uint32_t *row = &distTable[i * numClusters];
+      row[i] = 0;
+      for ( int j = i + 1; j < numClusters; j++ ) {
+        uint32_t d3 = pixel_dist_squared(clusterCenterPixels[i], clusterCenterPixels[j]);
+        row[j] = d3;
+        distTable[(j * numClusters) + i] = d3;
       }
-      
-      clusteri += 1;
     }
     
-    assert(closestToZeroClusteri != -1);
+    remaining.clear();
     
-    if (debugDumpClusterWalk) {
-      fprintf(stdout, "closestToZero 0x%08X is in clusteri %d\n", closestToZeroCenter, closestToZeroClusteri);
+    for ( int i = 0; i < numClusters; i++ ) {
+      if (i != clusteri) {
+        remaining.push_back(i);
+      }
     }
     
-    closestSortedClusterOrder.push_back(closestToZeroClusteri);
-    
-    // Calculate the distance from the cluster center to the next closest cluster center.
-    
-    {
-      uint32_t closestToCenterOfMassPixel = clusterCenterPixels[closestToZeroClusteri];
+    while (!remaining.empty()) {
+      const uint32_t *row = &distTable[clusteri * numClusters];
       
-      auto it = clusterCenterToClusterOffsetMap.find(closestToCenterOfMassPixel);
-      
-#if defined(DEBUG)
-      assert(it != end(clusterCenterToClusterOffsetMap));
-#endif // DEBUG
-      
-      clusterCenterToClusterOffsetMap.erase(it);
-    }
-    
-    // Each remaining cluster is represented by an entry in clusterCenterToClusterOffsetMap.
-    // Get the center coord and use the center to lookup the cluster index. Then find
-    // the next closest cluster in terms of distance in 3D space.
-    
-    uint32_t closestCenterPixel = clusterCenterPixels[closestToZeroClusteri];
-    
-    if (debugDumpClusterWalk) {
-      fprintf(stdout, "closestCenterPixel is 0x%08X from index %d\n", closestCenterPixel, closestToZeroClusteri);
-    }
-    
-    for ( ; 1 ; ) {
-      if (clusterCenterToClusterOffsetMap.size() == 0) {
-        break;
-      }
+      int minPos = 0;
+      int32_t minOffset = remaining[0];
+      uint32_t minD3 = row[minOffset];
       
-      vector<uint32_t> remainingClustersCenterPoints;
-      
-      for ( auto it = begin(clusterCenterToClusterOffsetMap); it != end(clusterCenterToClusterOffsetMap); it++) {
-        //uint32_t clusterCenterPixel = it->first;
-        uint32_t clusterOffset = it->second;
+      for ( int pos = 1; pos < (int) remaining.size(); pos++ ) {
+        int32_t offset = remaining[pos];
+        uint32_t d3 = row[offset];
         
-        uint32_t clusterStartPixel = clusterCenterPixels[clusterOffset];
-        remainingClustersCenterPoints.push_back(clusterStartPixel);
-      }
-      
-      if (debugDumpClusterWalk) {
-        fprintf(stdout, "there are %d remaining center pixel clusters\n", (int)remainingClustersCenterPoints.size());
-        
-        for ( uint32_t pixel : remainingClustersCenterPoints ) {
-          fprintf(stdout, "0x%08X\n", pixel);
+        if (d3 < minD3 || (d3 == minD3 && offset < minOffset)) {
+          minD3 = d3;
+          minOffset = offset;
+          minPos = pos;
         }
       }
       
-      uint32_t nextClosestClusterCenterPixel = closestToPixel(remainingClustersCenterPoints, closestCenterPixel);
-      
       if (debugDumpClusterWalk) {
-        fprintf(stdout, "nextClosestClusterPixel is 0x%08X from current clusterEndPixel 0x%08X\n", nextClosestClusterCenterPixel, closestCenterPixel);
+        fprintf(stdout, "nextClosestClusterPixel is 0x%08X from current clusterEndPixel 0x%08X\n", clusterCenterPixels[minOffset], clusterCenterPixels[clusteri]);
       }
       
-      assert(nextClosestClusterCenterPixel != closestCenterPixel);
+      remaining[minPos] = remaining.back();
+      remaining.pop_back();
       
-#if defined(DEBUG)
-      assert(clusterCenterToClusterOffsetMap.count(nextClosestClusterCenterPixel) > 0);
-#endif // DEBUG
-      
-      uint32_t nextClosestClusteri = clusterCenterToClusterOffsetMap[nextClosestClusterCenterPixel];
-      
-      closestSortedClusterOrder.push_back(nextClosestClusteri);
+      closestSortedClusterOrder.push_back(minOffset);
+      clusteri = minOffset;
+    }
+  } else {
+    ClusterCenterCubeGrid grid(clusterCenterPixels);
+    
+    grid.erase(clusteri);
+    
+    for ( int step = 1; step < numClusters; step++ ) {
+      int32_t nextClusteri = grid.nearest(clusterCenterPixels[clusteri]);
       
-      {
-        // Find index from next closest and then lookup cluster center
-        
-        uint32_t nextClosestCenterPixel = clusterCenterPixels[nextClosestClusteri];
-        
-        auto it = clusterCenterToClusterOffsetMap.find(nextClosestCenterPixel);
 #if defined(DEBUG)
-        assert(it != end(clusterCenterToClusterOffsetMap));
+      assert(nextClusteri != -1);
 #endif // DEBUG
-        clusterCenterToClusterOffsetMap.erase(it);
+      
+      if (debugDumpClusterWalk) {
+        fprintf(stdout, "nextClosestClusterPixel is 0x%08X from current clusterEndPixel 0x%08X\n", clusterCenterPixels[nextClusteri], clusterCenterPixels[clusteri]);
       }
       
-      closestCenterPixel = nextClosestClusterCenterPixel;
+      grid.erase(nextClusteri);
+      
+      closestSortedClusterOrder.push_back(nextClusteri);
+      clusteri = nextClusteri;
     }
-    
-    assert(closestSortedClusterOrder.size() == clusterCenterPixels.size());
   }
   
+  assert(closestSortedClusterOrder.size() == clusterCenterPixels.size());
+  
   return closestSortedClusterOrder;
 }
 
@@ -507,56 +659,110 @@ uint32_t my_adler32(
   return result;
 }
 
-// Sort keys in histogram like table in terms of the count
+// Sort keys in histogram like table in terms of the count. The collected
+// key and count pairs are sorted with the dense count version.
 
-static
-bool CompareKeySizePairFunc (pair<uint32_t,uint32_t> &elem1, pair<uint32_t,uint32_t> &elem2) {
-  uint32_t size1 = elem1.second;
-  uint32_t size2 = elem2.second;
-  return (size1 < size2);
+vector<uint32_t>
+sort_keys_by_count(unordered_map<uint32_t, uint32_t> &pixelToCountTable, bool biggestToSmallest)
+{
+  vector<uint32_t> keys;
+  vector<uint32_t> counts;
+  
+  keys.reserve(pixelToCountTable.size());
+  counts.reserve(pixelToCountTable.size());
+  
+  for ( auto &pair : pixelToCountTable ) {
+    keys.push_back(pair.first);
+    counts.push_back(pair.second);
+  }
+  
+  return sort_keys_by_count(counts, keys, biggestToSmallest, false);
 }
 
-static
-bool CompareKeySizePairFuncBigToSmall (pair<uint32_t,uint32_t> &elem1, pair<uint32_t,uint32_t> &elem2) {
-  uint32_t size1 = elem1.second;
-  uint32_t size2 = elem2.second;
-  return (size2 < size1);
-}
+// Counts are sorted with a counting sort when the largest count is not much
+// larger than the number of keys, otherwise with a LSD radix sort over the
+// bytes of the count that are not zero for every key. Both sorts are stable,
+// so keys with the same count stay in the order of the keys vector.
 
 vector<uint32_t>
-sort_keys_by_count(unordered_map<uint32_t, uint32_t> &pixelToCountTable, bool biggestToSmallest)
+sort_keys_by_count(const vector<uint32_t> &counts, const vector<uint32_t> &keys, bool biggestToSmallest, bool skipZeroCounts)
 {
-  vector<pair<uint32_t,uint32_t> > sizePairs;
-
-  for ( auto &pair : pixelToCountTable ) {
-    uint32_t pixel = pair.first;
-    uint32_t count = pair.second;
-    
-    std::pair<uint32_t,uint32_t> sp;
+#if defined(DEBUG)
+  assert(counts.size() == keys.size());
+#endif // DEBUG
+  
+  const int numKeys = (int) keys.size();
+  
+  // Offsets of the keys to sort and the largest count
+  
+  vector<uint32_t> offsets;
+  offsets.reserve(numKeys);
+  
+  uint32_t maxCount = 0;
+  
+  for ( int i = 0; i < numKeys; i++ ) {
+    uint32_t count = counts[i];
+    if (skipZeroCounts && count == 0) {
+      continue;
+    }
+    offsets.push_back(i);
+    if (count > maxCount) {
+      maxCount = count;
+    }
+  }
+  
+  const int N = (int) offsets.size();
+  
+  // Sort value for each count, inverted for a big to small order
+  
+  auto sortValue = [&counts, biggestToSmallest, maxCount](uint32_t offset)->uint32_t {
+    uint32_t count = counts[offset];
+    return biggestToSmallest ? (maxCount - count) : count;
+  };
+  
+  vector<uint32_t> sorted(N);
+  
+  if (maxCount <= (uint32_t) (N * 4 + 256)) {
+    vector<uint32_t> starts(maxCount + 2, 0);
     
-    sp.first = pixel;
-    sp.second = count;
+    for ( uint32_t offset : offsets ) {
+      starts[sortValue(offset) + 1] += 1;
+    }
     
-    sizePairs.push_back(sp);
+    for ( uint32_t i = 1; i < starts.size(); i++ ) {
+      starts[i] += starts[i-1];
+    }
     
-    //fprintf(stdout, "0x%08X (%d) -> %d\n", pixel, pixel, count);
-  }
-
-  if (biggestToSmallest) {
-    sort(begin(sizePairs), end(sizePairs), CompareKeySizePairFuncBigToSmall);
+    for ( uint32_t offset : offsets ) {
+      sorted[starts[sortValue(offset)]++] = offset;
+    }
   } else {
-    sort(begin(sizePairs), end(sizePairs), CompareKeySizePairFunc);
+    for ( int shift = 0; shift < 32 && (maxCount >> shift) != 0; shift += 8 ) {
+      uint32_t starts[256 + 1] = { 0 };
+      
+      for ( uint32_t offset : offsets ) {
+        starts[((sortValue(offset) >> shift) & 0xFF) + 1] += 1;
+      }
+      
+      for ( int i = 1; i <= 256; i++ ) {
+        starts[i] += starts[i-1];
+      }
+      
+      for ( uint32_t offset : offsets ) {
+        sorted[starts[(sortValue(offset) >> shift) & 0xFF]++] = offset;
+      }
+      
+      offsets.swap(sorted);
+    }
+    
+    offsets.swap(sorted);
   }
-
-  vector<uint32_t> keys;
   
-  for ( auto &pair : sizePairs ) {
-    keys.push_back(pair.first);
-    
-    //fprintf(stdout, "0x%08X -> %d\n", pair.first, pair.second);
+  for ( int i = 0; i < N; i++ ) {
+    sorted[i] = keys[sorted[i]];
   }
   
-  return keys;
+  return sorted;
 }
 
 // Simple signed subtraction of each component in a pixel by comparing the
@@ -689,7 +895,7 @@ uint32_t predict_trivial_component_add(uint32_t prevPixel, uint32_t residual)
 // For example, (128, 255, 1) would be scaled to (1, 2, 0).
 
 void xyzDeltaToUnitVector(int32_t &dR, int32_t &dG, int32_t &dB) {
-  const bool debug = true;
+  const bool debug = isDebugTraceEnabled();
   
   float scale = sqrt(float(dR*dR + dG*dG + dB*dB));
   
@@ -787,3 +993,57 @@ void xyzDeltaToUnitVector(int32_t &dR, int32_t &dG, int32_t &dB) {
   return;
 }
 
+static std::atomic<uint32_t> randomSeed(0);
+
+void setRandomSeed(uint32_t seed)
+{
+  randomSeed = seed;
+}
+
+uint32_t getRandomSeed()
+{
+  return randomSeed;
+}
+
+// Murmur3 finalizer of the seed and index, each output bit depends on every input bit
+
+uint32_t randomPixelForIndex(uint32_t index)
+{
+  uint32_t h = (getRandomSeed() * 0x9E3779B9) ^ index;
+  h ^= h >> 16;
+  h *= 0x85EBCA6B;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35;
+  h ^= h >> 16;
+  return (h & 0x00FFFFFF) | (0xFF << 24);
+}
+
+static thread_local DebugOutputLevel debugOutputLevel = DEBUG_OUTPUT_ALL;
+
+// Sorted tags, empty means all tags
+
+static thread_local vector<int32_t> debugOutputTags;
+
+void setDebugOutputLevel(DebugOutputLevel level)
+{
+  debugOutputLevel = level;
+}
+
+DebugOutputLevel getDebugOutputLevel()
+{
+  return debugOutputLevel;
+}
+
+void setDebugOutputTags(const vector<int32_t> &tags)
+{
+  debugOutputTags = tags;
+  sort(debugOutputTags.begin(), debugOutputTags.end());
+}
+
+bool isDebugOutputTag(int32_t tag)
+{
+  if (debugOutputTags.empty()) {
+    return true;
+  }
+  return binary_search(debugOutputTags.begin(), debugOutputTags.end(), tag);
+}
@@ -3,6 +3,7 @@
 #ifndef SUPERPIXEL_UTIL_H
 #define	SUPERPIXEL_UTIL_H
 
+#include <cmath>
 #include <vector>
 #include <unordered_map>
 #include <iostream>
@@ -14,6 +15,12 @@ using namespace std;
 void sample_mean(vector<float> &values, float *meanPtr);
 void sample_mean_delta_squared_div(vector<float> &values, float mean, float *stddevPtr);
 
+// Same as above for the len values at a pointer, so that the values left after
+// skipping the first few values of a vector need not be copied.
+
+void sample_mean(const float *values, int len, float *meanPtr);
+void sample_mean_delta_squared_div(const float *values, int len, float mean, float *stddevPtr);
+
 // Given a vector of N type specific values, return a vector of N deltas from one
 // value to the next. The first value is always values[0] and then the rest of the
 // values are calculated as (values[N] - values[N-1]).
@@ -263,13 +270,15 @@ bool canSignedValueBeRepresented(uint8_t bval, const uint8_t nbits) {
 uint32_t closestToPixel(const vector<uint32_t> &pixels, const uint32_t closeToPixel);
 
 // Given a vecor of 2D coordinates and another coordinate, determine which 2D coordinate
-// is closest to the given coordinate.
+// is closest to the given coordinate. A CoordNearestGrid in CoordGrid.h answers
+// the same query without a linear scan when many coords are queried against one set.
 
 Coord closestToCoord(const vector<Coord> &coords, const Coord &closeToCoord);
 
 // Given a vector of cluster center pixels, determine a cluster to cluster walk order based on 3D
 // distance from one cluster center to the next. This method returns a vector of offsets into
 // the cluster table with the assumption that the number of clusters fits into a 16 bit offset.
+// When two remaining centers are the same distance away the smaller offset is walked first.
 
 vector<uint32_t> generate_cluster_walk_on_center_dist(const vector<uint32_t> &clusterCenterPixels);
 
@@ -280,6 +289,13 @@ vector<uint32_t> generate_cluster_walk_on_center_dist(const vector<uint32_t> &cl
 vector<uint32_t>
 sort_keys_by_count(unordered_map<uint32_t, uint32_t> &pixelToCountTable, bool biggestToSmallest);
 
+// Sort keys in terms of a dense count for each key, for example the count for
+// each entry of a palette. Keys with the same count are returned in the order
+// they appear in keys and keys with a zero count are skipped by default.
+
+vector<uint32_t>
+sort_keys_by_count(const vector<uint32_t> &counts, const vector<uint32_t> &keys, bool biggestToSmallest, bool skipZeroCounts = true);
+
 // Trivial sub operation via (pixel - prev) for each
 // component. Returns the prediction error.
 
@@ -454,4 +470,68 @@ void filter (const vector<T> &inVec, vector<T> &outVec, F f) noexcept
   return;
 }
 
+// Diagnostics level for debug console tracing and debug images. The level is
+// set for each thread and defaults to DEBUG_OUTPUT_ALL. The build caps the
+// level at DEBUG_OUTPUT_MAX_LEVEL, which is DEBUG_OUTPUT_NONE unless DEBUG is
+// defined, so that a production build compiles the debug branches away and
+// never encodes a debug image.
+
+typedef enum {
+  // No tracing or debug images
+  DEBUG_OUTPUT_NONE = 0,
+  // Console tracing only
+  DEBUG_OUTPUT_TRACE = 1,
+  // Tracing and the images that show the whole result of a stage
+  DEBUG_OUTPUT_STAGES = 2,
+  // Tracing, stage images and the images for each tag
+  DEBUG_OUTPUT_ALL = 3
+} DebugOutputLevel;
+
+#if !defined(DEBUG_OUTPUT_MAX_LEVEL)
+# if defined(DEBUG)
+#  define DEBUG_OUTPUT_MAX_LEVEL DEBUG_OUTPUT_ALL
+# else
+#  define DEBUG_OUTPUT_MAX_LEVEL DEBUG_OUTPUT_NONE
+# endif
+#endif
+
+void setDebugOutputLevel(DebugOutputLevel level);
+
+DebugOutputLevel getDebugOutputLevel();
+
+// Limit the images for each tag to these tags, an empty vector enables the
+// images for every tag.
+
+void setDebugOutputTags(const vector<int32_t> &tags);
+
+bool isDebugOutputTag(int32_t tag);
+
+// Seed for the colors of the debug images and of the static colortable. The
+// colors are a hash of the seed and an index instead of the rand() sequence,
+// so that the same seed gives the same colors with any number of threads and
+// in any order. The seed is shared by all threads.
+
+void setRandomSeed(uint32_t seed);
+
+uint32_t getRandomSeed();
+
+// Pseudo random BGR pixel for index with the alpha set to 0xFF
+
+uint32_t randomPixelForIndex(uint32_t index);
+
+static inline
+bool isDebugTraceEnabled() {
+  return (DEBUG_OUTPUT_MAX_LEVEL >= DEBUG_OUTPUT_TRACE) && (getDebugOutputLevel() >= DEBUG_OUTPUT_TRACE);
+}
+
+static inline
+bool isDebugStageImagesEnabled() {
+  return (DEBUG_OUTPUT_MAX_LEVEL >= DEBUG_OUTPUT_STAGES) && (getDebugOutputLevel() >= DEBUG_OUTPUT_STAGES);
+}
+
+static inline
+bool isDebugTagImagesEnabled(int32_t tag) {
+  return (DEBUG_OUTPUT_MAX_LEVEL >= DEBUG_OUTPUT_ALL) && (getDebugOutputLevel() >= DEBUG_OUTPUT_ALL) && isDebugOutputTag(tag);
+}
+
 #endif // SUPERPIXEL_UTIL_H
@@ -236,84 +236,223 @@ struct DistanceTransform
 
     //--------------------------------------------------------------------------
 
-    template <class Functor, class BoolImage, class Metric>
-    static void calculate (Functor f, BoolImage test, int const m, int const n, Metric metric)
-    {
-      std::vector <int> g (m * n);
+    // Buffers used by calculate() that can be kept between calls so that the
+    // transform of many regions does not reallocate the g, s and t arrays.
+    // There is a pair of s and t arrays for each stripe of rows processed by
+    // calculateParallel(). A scratch must only be used by one call at a time.
 
-      int const inf = m + n;
+    struct Scratch
+    {
+      std::vector <int> g;
+      std::vector <std::vector <int> > s;
+      std::vector <std::vector <int> > t;
 
-      // phase 1
+      void reserve (int const m, int const n, int const numStripes)
       {
-        for (int x = 0; x < m; ++x)
+        g.resize (m * n);
+
+        if ((int) s.size () < numStripes)
         {
-          g [x] = test (x, 0) ? 0 : inf;
+          s.resize (numStripes);
+          t.resize (numStripes);
+        }
 
-          // scan 1
-          for (int y = 1; y < n; ++y)
-          {
-            int const ym = y*m;
-            g [x+ym] = test (x, y) ? 0 : 1 + g [x+ym-m];
-          }
+        for (int i = 0; i < numStripes; ++i)
+        {
+          s [i].resize (maxi(m, n));
+          t [i].resize (maxi(m, n));
+        }
+      }
+    };
 
-          // scan 2
-          for (int y = n-2; y >=0; --y)
-          {
-            int const ym = y*m;
+    //--------------------------------------------------------------------------
+
+    template <class BoolImage>
+    static inline void phase1Column (BoolImage const& test, int const x, int const m, int const n, int const inf, int* g)
+    {
+      g [x] = test (x, 0) ? 0 : inf;
+
+      // scan 1
+      for (int y = 1; y < n; ++y)
+      {
+        int const ym = y*m;
+        g [x+ym] = test (x, y) ? 0 : 1 + g [x+ym-m];
+      }
+
+      // scan 2
+      for (int y = n-2; y >=0; --y)
+      {
+        int const ym = y*m;
+
+        if (g [x+ym+m] < g [x+ym])
+          g [x+ym] = 1 + g[x+ym+m];
+      }
+    }
+
+    template <class Functor, class Metric>
+    static inline void phase2Row (Functor& f, int const y, int const m, int const inf, int const* g, int* s, int* t, Metric& metric)
+    {
+      int q = 0;
+      s [0] = 0;
+      t [0] = 0;
 
-            if (g [x+ym+m] < g [x+ym])
-              g [x+ym] = 1 + g[x+ym+m];
+      int const ym = y*m;
+
+      // scan 3
+      for (int u = 1; u < m; ++u)
+      {
+        while (q >= 0 && metric.f (t[q]-s[q], g[s[q]+ym]) > metric.f (t[q]-u, g[u+ym]))
+          q--;
+
+        if (q < 0)
+        {
+          q = 0;
+          s [0] = u;
+        }
+        else
+        {
+          int const w = 1 + metric.sep (s[q], u, g[s[q]+ym], g[u+ym], inf);
+
+          if (w < m)
+          {
+            ++q;
+            s[q] = u;
+            t[q] = w;
           }
         }
       }
 
+      // scan 4
+      for (int u = m-1; u >= 0; --u)
+      {
+        int const d = metric.f (u-s[q], g[s[q]+ym]);
+        f (u, y, d);
+        if (u == t[q])
+          --q;
+      }
+    }
+
+    //--------------------------------------------------------------------------
+
+    template <class Functor, class BoolImage, class Metric>
+    static void calculate (Functor f, BoolImage test, int const m, int const n, Metric metric)
+    {
+      Scratch scratch;
+      calculate (f, test, m, n, metric, scratch);
+    }
+
+    template <class Functor, class BoolImage, class Metric>
+    static void calculate (Functor f, BoolImage test, int const m, int const n, Metric metric, Scratch& scratch)
+    {
+      scratch.reserve (m, n, 1);
+
+      int* g = scratch.g.data ();
+
+      int const inf = m + n;
+
+      // phase 1
+      for (int x = 0; x < m; ++x)
+        phase1Column (test, x, m, n, inf, g);
+
       // phase 2
+      int* s = scratch.s [0].data ();
+      int* t = scratch.t [0].data ();
+
+      for (int y = 0; y < n; ++y)
+        phase2Row (f, y, m, inf, g, s, t, metric);
+    }
+
+    //--------------------------------------------------------------------------
+
+    template <class BoolImage>
+    class Phase1ParallelBody : public cv::ParallelLoopBody
+    {
+    public:
+      Phase1ParallelBody (BoolImage const& test_, int m_, int n_, int* g_)
+        : test (test_), m (m_), n (n_), g (g_)
       {
-        std::vector <int> s (maxi(m, n));
-        std::vector <int> t (maxi(m, n));
+      }
 
-        for (int y = 0; y < n; ++y)
-        {
-          int q = 0;
-          s [0] = 0;
-          t [0] = 0;
+      void operator() (const cv::Range& range) const
+      {
+        int const inf = m + n;
 
-          int const ym = y*m;
+        for (int x = range.start; x < range.end; ++x)
+          phase1Column (test, x, m, n, inf, g);
+      }
 
-          // scan 3
-          for (int u = 1; u < m; ++u)
-          {
-            while (q >= 0 && metric.f (t[q]-s[q], g[s[q]+ym]) > metric.f (t[q]-u, g[u+ym]))
-              q--;
+    private:
+      BoolImage test;
+      int m;
+      int n;
+      int* g;
+    };
 
-            if (q < 0)
-            {
-              q = 0;
-              s [0] = u;
-            }
-            else
-            {
-              int const w = 1 + metric.sep (s[q], u, g[s[q]+ym], g[u+ym], inf);
+    template <class Functor, class Metric>
+    class Phase2ParallelBody : public cv::ParallelLoopBody
+    {
+    public:
+      Phase2ParallelBody (Functor const& f_, Metric const& metric_, int m_, int n_, int stripeRows_, int const* g_, Scratch& scratch_)
+        : f (f_), metric (metric_), m (m_), n (n_), stripeRows (stripeRows_), g (g_), scratch (scratch_)
+      {
+      }
 
-              if (w < m)
-              {
-                ++q;
-                s[q] = u;
-                t[q] = w;
-              }
-            }
-          }
+      void operator() (const cv::Range& range) const
+      {
+        int const inf = m + n;
 
-          // scan 4
-          for (int u = m-1; u >= 0; --u)
-          {
-            int const d = metric.f (u-s[q], g[s[q]+ym]);
-            f (u, y, d);
-            if (u == t[q])
-              --q;
-          }
+        Functor stripeF = f;
+        Metric stripeMetric = metric;
+
+        for (int stripe = range.start; stripe < range.end; ++stripe)
+        {
+          int* s = scratch.s [stripe].data ();
+          int* t = scratch.t [stripe].data ();
+
+          int const yEnd = mini(n, (stripe + 1) * stripeRows);
+
+          for (int y = stripe * stripeRows; y < yEnd; ++y)
+            phase2Row (stripeF, y, m, inf, g, s, t, stripeMetric);
         }
       }
+
+    private:
+      Functor f;
+      Metric metric;
+      int m;
+      int n;
+      int stripeRows;
+      int const* g;
+      Scratch& scratch;
+    };
+
+    // Same results as calculate() with the columns of phase 1 and then the rows
+    // of phase 2 split across threads. The functor is copied for each stripe of
+    // rows and is invoked from more than one thread, each (x, y) is written by
+    // one thread only. Pass zero as numStripes to use one stripe per thread.
+
+    template <class Functor, class BoolImage, class Metric>
+    static void calculateParallel (Functor f, BoolImage test, int const m, int const n, Metric metric, Scratch& scratch, int numStripes = 0)
+    {
+      if (numStripes <= 0)
+        numStripes = maxi(1, cv::getNumThreads ());
+
+      numStripes = maxi(1, mini(numStripes, n));
+
+      int const stripeRows = (n + numStripes - 1) / maxi(1, numStripes);
+
+      if (n > 0)
+        numStripes = (n + stripeRows - 1) / stripeRows;
+
+      scratch.reserve (m, n, numStripes);
+
+      int* g = scratch.g.data ();
+
+      // phase 1
+      cv::parallel_for_ (cv::Range (0, m), Phase1ParallelBody <BoolImage> (test, m, n, g), numStripes);
+
+      // phase 2
+      cv::parallel_for_ (cv::Range (0, numStripes), Phase2ParallelBody <Functor, Metric> (f, metric, m, n, stripeRows, g, scratch));
     }
 
     //--------------------------------------------------------------------------